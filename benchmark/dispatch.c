@@ -0,0 +1,107 @@
+#define G_LOG_DOMAIN "CpcGpuBenchmark"
+#include <cpc-gpu/cpc-gpu.h>
+
+#include "fixture.h"
+#include "null-gl.h"
+
+/* Measures the CPU cost of dispatching commands, with every
+ * GL entry point replaced by a function that does nothing.
+ * The lean variant is what cg_plan_unref_to_commands ()
+ * produces; the traced variant records every call. */
+
+#define DEFAULT_DRAWS 1000
+#define DEFAULT_ITERATIONS 1000
+
+static gboolean
+run (const char *label,
+     CgCommands *commands,
+     guint iterations,
+     double *us_per_dispatch,
+     GError **error)
+{
+  guint64 n_calls = 0;
+  gint64 start = 0;
+  gint64 elapsed = 0;
+
+  /* Warm up, and count the GL calls a single dispatch makes */
+  null_gl_reset_n_calls ();
+  if (!cg_commands_dispatch (commands, error))
+    return FALSE;
+  n_calls = null_gl_get_n_calls ();
+
+  start = g_get_monotonic_time ();
+  for (guint i = 0; i < iterations; i++)
+    {
+      if (!cg_commands_dispatch (commands, error))
+        return FALSE;
+    }
+  elapsed = g_get_monotonic_time () - start;
+  *us_per_dispatch = (double)elapsed / iterations;
+
+  g_print ("%-8s %10.2f us/dispatch %8.2f ns/call (%" G_GUINT64_FORMAT " calls)\n",
+           label,
+           *us_per_dispatch,
+           (double)elapsed * 1000.0 / ((double)iterations * n_calls),
+           n_calls);
+
+  return TRUE;
+}
+
+int
+main (int argc,
+      char **argv)
+{
+  g_autoptr (GError) local_error = NULL;
+  guint n_draws = DEFAULT_DRAWS;
+  guint iterations = DEFAULT_ITERATIONS;
+  g_autoptr (CgGpu) gpu = NULL;
+  g_autoptr (CgShader) shader = NULL;
+  g_autoptr (CgBuffer) vertices = NULL;
+  g_autoptr (CgCommands) lean = NULL;
+  g_autoptr (CgCommands) traced = NULL;
+  double lean_us = 0.0;
+  double traced_us = 0.0;
+
+  if (argc > 1)
+    n_draws = MAX (1, g_ascii_strtoull (argv[1], NULL, 10));
+  if (argc > 2)
+    iterations = MAX (1, g_ascii_strtoull (argv[2], NULL, 10));
+
+  gpu = cg_gpu_new (
+      CG_INIT_FLAG_BACKEND_OPENGL
+          | CG_INIT_FLAG_NO_FALLBACK,
+      null_gl_get_proc_address, &local_error);
+  if (gpu == NULL)
+    goto err;
+  cg_gpu_steal_this_thread (gpu);
+
+  shader = fixture_new_shader (gpu);
+  vertices = fixture_new_triangle (gpu);
+
+  lean = cg_plan_unref_to_commands (
+      fixture_build_plan (gpu, NULL, 1920, 1080, shader, vertices, n_draws), &local_error);
+  if (lean == NULL)
+    goto err;
+  traced = cg_plan_unref_to_debugging_commands (
+      fixture_build_plan (gpu, NULL, 1920, 1080, shader, vertices, n_draws), &local_error);
+  if (traced == NULL)
+    goto err;
+
+  g_print ("%u draws, %u iterations\n", n_draws, iterations);
+  if (!run ("lean", lean, iterations, &lean_us, &local_error))
+    goto err;
+  if (!run ("traced", traced, iterations, &traced_us, &local_error))
+    goto err;
+  g_print ("traced/lean %.1fx\n", traced_us / lean_us);
+
+  g_clear_pointer (&lean, cg_commands_unref);
+  g_clear_pointer (&traced, cg_commands_unref);
+  g_clear_pointer (&vertices, cg_buffer_unref);
+  g_clear_pointer (&shader, cg_shader_unref);
+  cg_gpu_release_this_thread (gpu);
+  return 0;
+
+err:
+  g_printerr ("%s\n", local_error != NULL ? local_error->message : "Unknown error");
+  return 1;
+}
@@ -0,0 +1,185 @@
+#define G_LOG_DOMAIN "CpcGpuBenchmark"
+#include <cpc-gpu/cpc-gpu.h>
+
+#include "fixture.h"
+
+/* Measures how creating resources, building plans and
+ * compiling them scales with the number of threads doing
+ * it at once. Every thread repeats the same rounds, and
+ * the throughput for each thread count is printed as JSON.
+ *
+ * The software backend is used as it compiles from any
+ * thread and needs no GPU; the OpenGL backend only ever
+ * compiles on the thread that owns the context. */
+
+#define DEFAULT_APPENDS 2000
+#define DEFAULT_ROUNDS 20
+
+typedef struct
+{
+  CgGpu *gpu;
+  guint appends;
+  guint rounds;
+
+  GMutex mutex;
+  GCond cond;
+  gboolean go;
+} Shared;
+
+static gboolean
+run_round (Shared *shared,
+           GError **error)
+{
+  g_autoptr (CgShader) shader = NULL;
+  g_autoptr (CgBuffer) vertices = NULL;
+  g_autoptr (CgTexture) target = NULL;
+  g_autoptr (CgCommands) commands = NULL;
+
+  shader = fixture_new_shader (shared->gpu);
+  vertices = fixture_new_triangle (shared->gpu);
+  target = cg_texture_new_for_data (
+      shared->gpu, NULL, 0, 64, 64, CG_FORMAT_RGBA8, 1, 0);
+
+  commands = cg_plan_unref_to_commands (
+      fixture_build_plan (shared->gpu, target, 64, 64,
+                          shader, vertices, shared->appends),
+      error);
+  return commands != NULL;
+}
+
+static gpointer
+worker (gpointer user_data)
+{
+  Shared *shared = user_data;
+  GError *local_error = NULL;
+
+  g_mutex_lock (&shared->mutex);
+  while (!shared->go)
+    g_cond_wait (&shared->cond, &shared->mutex);
+  g_mutex_unlock (&shared->mutex);
+
+  for (guint i = 0; i < shared->rounds; i++)
+    {
+      if (!run_round (shared, &local_error))
+        break;
+    }
+
+  return local_error;
+}
+
+static gboolean
+measure (Shared *shared,
+         guint n_threads,
+         double *seconds,
+         GError **error)
+{
+  g_autofree GThread **threads = NULL;
+  GError *first_error = NULL;
+  gint64 start = 0;
+
+  shared->go = FALSE;
+
+  threads = g_new0 (GThread *, n_threads);
+  for (guint i = 0; i < n_threads; i++)
+    threads[i] = g_thread_new ("cpc-gpu-bench", worker, shared);
+
+  g_mutex_lock (&shared->mutex);
+  start = g_get_monotonic_time ();
+  shared->go = TRUE;
+  g_cond_broadcast (&shared->cond);
+  g_mutex_unlock (&shared->mutex);
+
+  for (guint i = 0; i < n_threads; i++)
+    {
+      GError *thread_error = g_thread_join (threads[i]);
+
+      if (thread_error != NULL && first_error == NULL)
+        first_error = thread_error;
+      else
+        g_clear_error (&thread_error);
+    }
+
+  *seconds = (double)(g_get_monotonic_time () - start) / G_USEC_PER_SEC;
+
+  if (first_error != NULL)
+    {
+      g_propagate_error (error, first_error);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+int
+main (int argc,
+      char **argv)
+{
+  g_autoptr (GError) local_error = NULL;
+  guint max_threads = g_get_num_processors ();
+  guint raster_threads = 1;
+  g_autoptr (CgGpu) gpu = NULL;
+  Shared shared = { 0 };
+  double base_throughput = 0.0;
+
+  shared.appends = DEFAULT_APPENDS;
+  shared.rounds = DEFAULT_ROUNDS;
+
+  if (argc > 1)
+    max_threads = MAX (1, g_ascii_strtoull (argv[1], NULL, 10));
+  if (argc > 2)
+    shared.appends = MAX (1, g_ascii_strtoull (argv[2], NULL, 10));
+  if (argc > 3)
+    shared.rounds = MAX (1, g_ascii_strtoull (argv[3], NULL, 10));
+
+  /* Nothing is dispatched, so the rasterizer
+   * needs no more than a single thread */
+  gpu = cg_gpu_new (
+      CG_INIT_FLAG_BACKEND_SOFTWARE
+          | CG_INIT_FLAG_NO_FALLBACK,
+      &raster_threads, &local_error);
+  if (gpu == NULL)
+    goto err;
+
+  shared.gpu = gpu;
+  g_mutex_init (&shared.mutex);
+  g_cond_init (&shared.cond);
+
+  g_print ("{\n"
+           "  \"appends\": %u,\n"
+           "  \"rounds\": %u,\n"
+           "  \"results\": [\n",
+           shared.appends, shared.rounds);
+
+  for (guint n_threads = 1; n_threads <= max_threads; n_threads++)
+    {
+      double seconds = 0.0;
+      double throughput = 0.0;
+
+      if (!measure (&shared, n_threads, &seconds, &local_error))
+        goto err;
+
+      /* Rounds are plans compiled, with their resources */
+      throughput = (double)n_threads * shared.rounds / seconds;
+      if (n_threads == 1)
+        base_throughput = throughput;
+
+      g_print ("    { \"threads\": %u, \"seconds\": %.6f, "
+               "\"rounds_per_second\": %.2f, \"speedup\": %.3f, "
+               "\"efficiency\": %.3f }%s\n",
+               n_threads, seconds, throughput,
+               throughput / base_throughput,
+               throughput / base_throughput / n_threads,
+               n_threads < max_threads ? "," : "");
+    }
+
+  g_print ("  ]\n"
+           "}\n");
+
+  g_mutex_clear (&shared.mutex);
+  g_cond_clear (&shared.cond);
+  return 0;
+
+err:
+  g_printerr ("%s\n", local_error != NULL ? local_error->message : "Unknown error");
+  return 1;
+}
@@ -0,0 +1,411 @@
+/* cpc-gpu-batch.c
+ *
+ * Copyright 2025 Adam Masciola
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+#define G_LOG_DOMAIN "CpcGpuBatch"
+#include "cpc-gpu-private.h"
+
+#include <string.h>
+
+#define VERTEX_SHADER                                                       \
+  "#version 330\n"                                                          \
+  "#pragma cpc_gpu_kernel batch\n"                                          \
+  "in vec2 batchCorner;\n"                                                  \
+  "in vec3 batchTransformX;\n"                                              \
+  "in vec3 batchTransformY;\n"                                              \
+  "in vec4 batchUv;\n"                                                      \
+  "in vec4 batchColor;\n"                                                   \
+  "out vec2 fragUv;\n"                                                      \
+  "out vec4 fragColor;\n"                                                   \
+  "uniform vec2 batchViewport;\n"                                           \
+  "void main()\n"                                                           \
+  "{\n"                                                                     \
+  "    vec3 corner = vec3(batchCorner, 1.0);\n"                             \
+  "    vec2 position = vec2(dot(batchTransformX, corner),\n"                \
+  "                         dot(batchTransformY, corner));\n"               \
+  "    position = position / batchViewport * vec2(2.0, -2.0)\n"             \
+  "               + vec2(-1.0, 1.0);\n"                                     \
+  "    gl_Position = vec4(position, 0.0, 1.0);\n"                           \
+  "    fragUv = mix(batchUv.xy, batchUv.zw, batchCorner);\n"                \
+  "    fragColor = batchColor;\n"                                           \
+  "}\n"
+
+#define FRAGMENT_SHADER                                                     \
+  "#version 330\n"                                                          \
+  "#pragma cpc_gpu_kernel batch\n"                                          \
+  "in vec2 fragUv;\n"                                                       \
+  "in vec4 fragColor;\n"                                                    \
+  "out vec4 finalColor;\n"                                                  \
+  "uniform sampler2D batchTexture;\n"                                       \
+  "void main()\n"                                                           \
+  "{\n"                                                                     \
+  "    finalColor = texture(batchTexture, fragUv) * fragColor;\n"           \
+  "}\n"
+
+static const CgDataSegment corner_layout[] = {
+  {
+      .name = "batchCorner",
+      .type = CG_TYPE_FLOAT,
+      .num = 2,
+      .instance_rate = 0,
+  },
+};
+
+static const CgDataSegment instance_layout[] = {
+  {
+      .name = "batchTransformX",
+      .type = CG_TYPE_FLOAT,
+      .num = 3,
+      .instance_rate = 1,
+  },
+  {
+      .name = "batchTransformY",
+      .type = CG_TYPE_FLOAT,
+      .num = 3,
+      .instance_rate = 1,
+  },
+  {
+      .name = "batchUv",
+      .type = CG_TYPE_FLOAT,
+      .num = 4,
+      .instance_rate = 1,
+  },
+  {
+      .name = "batchColor",
+      .type = CG_COMPONENT_UINT8,
+      .num = 4,
+      .instance_rate = 1,
+      .conversion = CG_CONVERSION_NORMALIZE,
+  },
+};
+
+/* Matches instance_layout */
+typedef struct
+{
+  float transform_x[3];
+  float transform_y[3];
+  float uv[4];
+  guint8 color[4];
+} Instance;
+
+/* A unit square, drawn as a triangle strip */
+static const float corners[] = {
+  0.0f, 0.0f,
+  1.0f, 0.0f,
+  0.0f, 1.0f,
+  1.0f, 1.0f,
+};
+
+static const guint8 white_pixel[] = { 0xff, 0xff, 0xff, 0xff };
+
+typedef struct
+{
+  int layer;
+  guint texture;
+  guint quad;
+} SortKey;
+
+struct _CgBatch
+{
+  gatomicrefcount refcount;
+  CgGpu *gpu;
+
+  CgShader *shader;
+  CgBuffer *corners;
+  CgTexture *white;
+
+  /* Quads are accumulated as a structure of arrays
+   * and only interleaved once they have been sorted */
+  GArray *transforms; /* float[6] */
+  GArray *uvs;        /* float[4] */
+  GArray *colors;     /* guint8[4] */
+  GArray *keys;
+
+  /* Textures in order of first use; keys
+   * refer to them by index */
+  GPtrArray *textures;
+  GHashTable *texture_indices;
+};
+
+CgBatch *
+cg_batch_new (CgGpu *self)
+{
+  CgBatch *batch = NULL;
+
+  g_return_val_if_fail (self != NULL, NULL);
+
+  batch = g_new0 (CgBatch, 1);
+  g_atomic_ref_count_init (&batch->refcount);
+  batch->gpu = cg_gpu_ref (self);
+
+  batch->shader = cg_shader_new_for_code (
+      self, VERTEX_SHADER, FRAGMENT_SHADER);
+  batch->corners = cg_buffer_new_for_data (
+      self, corners, sizeof (corners),
+      corner_layout, G_N_ELEMENTS (corner_layout));
+  batch->white = cg_texture_new_for_data (
+      self, white_pixel, sizeof (white_pixel),
+      1, 1, CG_FORMAT_RGBA8, 1, 0);
+
+  batch->transforms = g_array_new (FALSE, FALSE, sizeof (float) * 6);
+  batch->uvs = g_array_new (FALSE, FALSE, sizeof (float) * 4);
+  batch->colors = g_array_new (FALSE, FALSE, sizeof (guint8) * 4);
+  batch->keys = g_array_new (FALSE, FALSE, sizeof (SortKey));
+
+  batch->textures = g_ptr_array_new_with_free_func (cg_texture_unref);
+  batch->texture_indices = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+  return batch;
+}
+
+CgBatch *
+cg_batch_ref (CgBatch *self)
+{
+  g_return_val_if_fail (self != NULL, NULL);
+
+  g_atomic_ref_count_inc (&self->refcount);
+  return self;
+}
+
+void
+cg_batch_unref (gpointer self)
+{
+  CgBatch *batch = self;
+
+  g_return_if_fail (self != NULL);
+
+  if (g_atomic_ref_count_dec (&batch->refcount))
+    {
+      g_clear_pointer (&batch->transforms, g_array_unref);
+      g_clear_pointer (&batch->uvs, g_array_unref);
+      g_clear_pointer (&batch->colors, g_array_unref);
+      g_clear_pointer (&batch->keys, g_array_unref);
+      g_clear_pointer (&batch->textures, g_ptr_array_unref);
+      g_clear_pointer (&batch->texture_indices, g_hash_table_unref);
+
+      g_clear_pointer (&batch->shader, cg_shader_unref);
+      g_clear_pointer (&batch->corners, cg_buffer_unref);
+      g_clear_pointer (&batch->white, cg_texture_unref);
+      g_clear_pointer (&batch->gpu, cg_gpu_unref);
+      g_free (batch);
+    }
+}
+
+static guint
+texture_index (CgBatch *self,
+               CgTexture *texture)
+{
+  gpointer index = NULL;
+
+  if (texture == NULL)
+    texture = self->white;
+
+  /* Stored plus one so that zero means absent */
+  index = g_hash_table_lookup (self->texture_indices, texture);
+  if (index != NULL)
+    return GPOINTER_TO_UINT (index) - 1;
+
+  g_ptr_array_add (self->textures, cg_texture_ref (texture));
+  g_hash_table_insert (self->texture_indices, texture,
+                       GUINT_TO_POINTER (self->textures->len));
+
+  return self->textures->len - 1;
+}
+
+void
+cg_batch_add (
+    CgBatch *self,
+    int layer,
+    CgTexture *texture,
+    const float *uv,
+    const float *transform,
+    const float *color)
+{
+  static const float default_uv[4] = { 0.0f, 0.0f, 1.0f, 1.0f };
+  SortKey key = { 0 };
+  guint8 packed[4] = { 0xff, 0xff, 0xff, 0xff };
+
+  g_return_if_fail (self != NULL);
+  g_return_if_fail (transform != NULL);
+  g_return_if_fail (texture == NULL || texture->gpu == self->gpu);
+
+  if (color != NULL)
+    {
+      for (guint i = 0; i < 4; i++)
+        packed[i] = (guint8)(CLAMP (color[i], 0.0f, 1.0f) * 255.0f + 0.5f);
+    }
+
+  key.layer = layer;
+  key.texture = texture_index (self, texture);
+  key.quad = self->keys->len;
+
+  g_array_append_vals (self->transforms, transform, 1);
+  g_array_append_vals (self->uvs, uv != NULL ? uv : default_uv, 1);
+  g_array_append_vals (self->colors, packed, 1);
+  g_array_append_val (self->keys, key);
+}
+
+void
+cg_batch_add_rect (
+    CgBatch *self,
+    int layer,
+    CgTexture *texture,
+    const float *uv,
+    float x,
+    float y,
+    float width,
+    float height,
+    const float *color)
+{
+  const float transform[6] = { width, 0.0f, 0.0f, height, x, y };
+
+  cg_batch_add (self, layer, texture, uv, transform, color);
+}
+
+guint
+cg_batch_get_n_quads (CgBatch *self)
+{
+  g_return_val_if_fail (self != NULL, 0);
+
+  return self->keys->len;
+}
+
+static int
+cmp_sort_key (gconstpointer a,
+              gconstpointer b)
+{
+  const SortKey *ka = a;
+  const SortKey *kb = b;
+
+  if (ka->layer != kb->layer)
+    return ka->layer < kb->layer ? -1 : 1;
+  if (ka->texture != kb->texture)
+    return ka->texture < kb->texture ? -1 : 1;
+
+  /* Keeps the sort stable */
+  return ka->quad < kb->quad ? -1 : (ka->quad > kb->quad ? 1 : 0);
+}
+
+static void
+clear_quads (CgBatch *self)
+{
+  g_array_set_size (self->transforms, 0);
+  g_array_set_size (self->uvs, 0);
+  g_array_set_size (self->colors, 0);
+  g_array_set_size (self->keys, 0);
+  g_ptr_array_set_size (self->textures, 0);
+  g_hash_table_remove_all (self->texture_indices);
+}
+
+void
+cg_batch_flush (
+    CgBatch *self,
+    CgPlan *plan,
+    int width,
+    int height)
+{
+  Instance *instances = NULL;
+  g_autoptr (CgBuffer) instance_buffer = NULL;
+  CgBuffer *buffers[2] = { 0 };
+  guint n_quads = 0;
+  guint start = 0;
+
+  g_return_if_fail (self != NULL);
+  g_return_if_fail (plan != NULL);
+  g_return_if_fail (plan->gpu == self->gpu);
+  g_return_if_fail (width > 0 && height > 0);
+
+  n_quads = self->keys->len;
+  if (n_quads == 0)
+    return;
+
+  /* Lower layers first, then grouped by texture within a layer */
+  g_array_sort (self->keys, cmp_sort_key);
+
+  instances = g_new (Instance, n_quads);
+  for (guint i = 0; i < n_quads; i++)
+    {
+      guint quad = g_array_index (self->keys, SortKey, i).quad;
+      const float *transform = &g_array_index (self->transforms, float, quad * 6);
+      const float *uv = &g_array_index (self->uvs, float, quad * 4);
+      const guint8 *color = &g_array_index (self->colors, guint8, quad * 4);
+      Instance *instance = &instances[i];
+
+      /* Rows of the affine matrix, so the shader can take
+       * the dot product with (corner.x, corner.y, 1) */
+      instance->transform_x[0] = transform[0];
+      instance->transform_x[1] = transform[2];
+      instance->transform_x[2] = transform[4];
+      instance->transform_y[0] = transform[1];
+      instance->transform_y[1] = transform[3];
+      instance->transform_y[2] = transform[5];
+      memcpy (instance->uv, uv, sizeof (instance->uv));
+      memcpy (instance->color, color, sizeof (instance->color));
+    }
+
+  instance_buffer = cg_buffer_new_for_data_take (
+      self->gpu, instances, n_quads * sizeof (Instance),
+      instance_layout, G_N_ELEMENTS (instance_layout));
+  buffers[0] = self->corners;
+  buffers[1] = instance_buffer;
+
+  cg_plan_push_state (
+      plan,
+      CG_STATE_SHADER, CG_SHADER (self->shader),
+      CG_STATE_UNIFORM, CG_KEYVAL ("batchViewport", CG_VEC2 (width, height)),
+      CG_STATE_WRITE_MASK, CG_UINT (CG_WRITE_MASK_COLOR),
+      CG_STATE_DEPTH_FUNC, CG_INT (CG_TEST_ALWAYS),
+      CG_STATE_BACKFACE_CULL, CG_BOOL (FALSE),
+      NULL);
+
+  /* One instanced draw per run of quads sharing a texture */
+  while (start < n_quads)
+    {
+      guint texture = g_array_index (self->keys, SortKey, start).texture;
+      guint end = start + 1;
+
+      while (end < n_quads && g_array_index (self->keys, SortKey, end).texture == texture)
+        end++;
+
+      cg_plan_push_state (
+          plan,
+          CG_STATE_UNIFORM, CG_KEYVAL ("batchTexture", CG_TEXTURE (g_ptr_array_index (self->textures, texture))),
+          NULL);
+      cg_plan_append_instances_v (
+          plan, CG_TOPOLOGY_TRIANGLE_STRIP,
+          start, end - start, NULL,
+          buffers, G_N_ELEMENTS (buffers));
+      cg_plan_pop (plan);
+
+      start = end;
+    }
+
+  cg_plan_pop (plan);
+
+  clear_quads (self);
+}
+
+void
+cg_batch_clear (CgBatch *self)
+{
+  g_return_if_fail (self != NULL);
+
+  clear_quads (self);
+}
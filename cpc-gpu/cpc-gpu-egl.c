@@ -0,0 +1,405 @@
+/* cpc-gpu-egl.c
+ *
+ * Copyright 2025 Adam Masciola
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+#define G_LOG_DOMAIN "CpcGpuEGL"
+#include "cpc-gpu-private.h"
+
+#include <string.h>
+
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+
+/* From drm_fourcc.h, which we otherwise have no use for */
+#define CG_EGL_DRM_FORMAT_MOD_INVALID ((1ULL << 56) - 1)
+/* From the GL headers, which are the GL backend's business */
+#define CG_EGL_GL_TEXTURE_2D 0x0DE1
+
+typedef void (*ImageTargetTexture2DOES) (unsigned int target, void *image);
+
+static const EGLint plane_attribs[CG_DMABUF_MAX_PLANES][5] = {
+  {
+      EGL_DMA_BUF_PLANE0_FD_EXT,
+      EGL_DMA_BUF_PLANE0_OFFSET_EXT,
+      EGL_DMA_BUF_PLANE0_PITCH_EXT,
+      EGL_DMA_BUF_PLANE0_MODIFIER_LO_EXT,
+      EGL_DMA_BUF_PLANE0_MODIFIER_HI_EXT,
+  },
+  {
+      EGL_DMA_BUF_PLANE1_FD_EXT,
+      EGL_DMA_BUF_PLANE1_OFFSET_EXT,
+      EGL_DMA_BUF_PLANE1_PITCH_EXT,
+      EGL_DMA_BUF_PLANE1_MODIFIER_LO_EXT,
+      EGL_DMA_BUF_PLANE1_MODIFIER_HI_EXT,
+  },
+  {
+      EGL_DMA_BUF_PLANE2_FD_EXT,
+      EGL_DMA_BUF_PLANE2_OFFSET_EXT,
+      EGL_DMA_BUF_PLANE2_PITCH_EXT,
+      EGL_DMA_BUF_PLANE2_MODIFIER_LO_EXT,
+      EGL_DMA_BUF_PLANE2_MODIFIER_HI_EXT,
+  },
+  {
+      EGL_DMA_BUF_PLANE3_FD_EXT,
+      EGL_DMA_BUF_PLANE3_OFFSET_EXT,
+      EGL_DMA_BUF_PLANE3_PITCH_EXT,
+      EGL_DMA_BUF_PLANE3_MODIFIER_LO_EXT,
+      EGL_DMA_BUF_PLANE3_MODIFIER_HI_EXT,
+  },
+};
+
+gboolean
+cg_priv_egl_has_extension (gpointer display,
+                           const char *name)
+{
+  const char *extensions = NULL;
+  gsize len = strlen (name);
+
+  extensions = eglQueryString (display, EGL_EXTENSIONS);
+  if (extensions == NULL)
+    return FALSE;
+
+  /* Names are separated by spaces and may prefix each other */
+  for (const char *match = strstr (extensions, name);
+       match != NULL;
+       match = strstr (match + len, name))
+    {
+      if ((match == extensions || match[-1] == ' ')
+          && (match[len] == ' ' || match[len] == '\0'))
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+static EGLDisplay
+get_display (const char *extension,
+             GError **error)
+{
+  EGLDisplay display = EGL_NO_DISPLAY;
+
+  display = eglGetCurrentDisplay ();
+  if (display == EGL_NO_DISPLAY)
+    {
+      g_set_error (
+          error, CG_ERROR, CG_ERROR_NOT_SUPPORTED,
+          "EGL: The current context was not created with EGL");
+      return EGL_NO_DISPLAY;
+    }
+
+  if (!cg_priv_egl_has_extension (display, extension))
+    {
+      g_set_error (
+          error, CG_ERROR, CG_ERROR_NOT_SUPPORTED,
+          "EGL: %s is not supported", extension);
+      return EGL_NO_DISPLAY;
+    }
+
+  return display;
+}
+
+gboolean
+cg_priv_egl_bind_dmabuf (const CgDmabuf *dmabuf,
+                         GError **error)
+{
+  EGLDisplay display = EGL_NO_DISPLAY;
+  PFNEGLCREATEIMAGEKHRPROC create_image = NULL;
+  PFNEGLDESTROYIMAGEKHRPROC destroy_image = NULL;
+  ImageTargetTexture2DOES target_texture = NULL;
+  gboolean modifiers = FALSE;
+  EGLint attribs[6 + CG_DMABUF_MAX_PLANES * 10 + 1] = { 0 };
+  guint n_attribs = 0;
+  EGLImageKHR image = EGL_NO_IMAGE_KHR;
+
+  display = get_display ("EGL_EXT_image_dma_buf_import", error);
+  if (display == EGL_NO_DISPLAY)
+    return FALSE;
+
+  modifiers = dmabuf->modifier != CG_EGL_DRM_FORMAT_MOD_INVALID;
+  if (modifiers && !cg_priv_egl_has_extension (display, "EGL_EXT_image_dma_buf_import_modifiers"))
+    {
+      g_set_error (
+          error, CG_ERROR, CG_ERROR_NOT_SUPPORTED,
+          "EGL: Explicit DMA-BUF modifiers are not supported");
+      return FALSE;
+    }
+
+  create_image = (PFNEGLCREATEIMAGEKHRPROC)eglGetProcAddress ("eglCreateImageKHR");
+  destroy_image = (PFNEGLDESTROYIMAGEKHRPROC)eglGetProcAddress ("eglDestroyImageKHR");
+  target_texture = (ImageTargetTexture2DOES)eglGetProcAddress ("glEGLImageTargetTexture2DOES");
+  if (create_image == NULL || destroy_image == NULL || target_texture == NULL)
+    {
+      g_set_error (
+          error, CG_ERROR, CG_ERROR_NOT_SUPPORTED,
+          "EGL: EGLImage entry points are missing");
+      return FALSE;
+    }
+
+  attribs[n_attribs++] = EGL_WIDTH;
+  attribs[n_attribs++] = dmabuf->width;
+  attribs[n_attribs++] = EGL_HEIGHT;
+  attribs[n_attribs++] = dmabuf->height;
+  attribs[n_attribs++] = EGL_LINUX_DRM_FOURCC_EXT;
+  attribs[n_attribs++] = (EGLint)dmabuf->fourcc;
+
+  for (guint i = 0; i < dmabuf->n_planes; i++)
+    {
+      attribs[n_attribs++] = plane_attribs[i][0];
+      attribs[n_attribs++] = dmabuf->fds[i];
+      attribs[n_attribs++] = plane_attribs[i][1];
+      attribs[n_attribs++] = (EGLint)dmabuf->offsets[i];
+      attribs[n_attribs++] = plane_attribs[i][2];
+      attribs[n_attribs++] = (EGLint)dmabuf->strides[i];
+
+      if (modifiers)
+        {
+          attribs[n_attribs++] = plane_attribs[i][3];
+          attribs[n_attribs++] = (EGLint)(dmabuf->modifier & 0xffffffff);
+          attribs[n_attribs++] = plane_attribs[i][4];
+          attribs[n_attribs++] = (EGLint)(dmabuf->modifier >> 32);
+        }
+    }
+  attribs[n_attribs++] = EGL_NONE;
+
+  image = create_image (display, EGL_NO_CONTEXT, EGL_LINUX_DMA_BUF_EXT, NULL, attribs);
+  if (image == EGL_NO_IMAGE_KHR)
+    {
+      g_set_error (
+          error, CG_ERROR, CG_ERROR_FAILED_TEXTURE_GEN,
+          "EGL: Failed to import DMA-BUF: 0x%x", eglGetError ());
+      return FALSE;
+    }
+
+  /* The texture keeps the storage alive on its own */
+  target_texture (CG_EGL_GL_TEXTURE_2D, image);
+  destroy_image (display, image);
+
+  return TRUE;
+}
+
+gboolean
+cg_priv_egl_export_texture (guint texture,
+                            CgDmabuf *dmabuf,
+                            GError **error)
+{
+  EGLDisplay display = EGL_NO_DISPLAY;
+  PFNEGLCREATEIMAGEKHRPROC create_image = NULL;
+  PFNEGLDESTROYIMAGEKHRPROC destroy_image = NULL;
+  PFNEGLEXPORTDMABUFIMAGEQUERYMESAPROC export_query = NULL;
+  PFNEGLEXPORTDMABUFIMAGEMESAPROC export_image = NULL;
+  static const EGLint attribs[] = { EGL_GL_TEXTURE_LEVEL_KHR, 0, EGL_NONE };
+  EGLImageKHR image = EGL_NO_IMAGE_KHR;
+  int fourcc = 0;
+  int n_planes = 0;
+  EGLuint64KHR modifiers[CG_DMABUF_MAX_PLANES] = { 0 };
+  int fds[CG_DMABUF_MAX_PLANES] = { -1, -1, -1, -1 };
+  EGLint strides[CG_DMABUF_MAX_PLANES] = { 0 };
+  EGLint offsets[CG_DMABUF_MAX_PLANES] = { 0 };
+
+  display = get_display ("EGL_MESA_image_dma_buf_export", error);
+  if (display == EGL_NO_DISPLAY)
+    return FALSE;
+
+  create_image = (PFNEGLCREATEIMAGEKHRPROC)eglGetProcAddress ("eglCreateImageKHR");
+  destroy_image = (PFNEGLDESTROYIMAGEKHRPROC)eglGetProcAddress ("eglDestroyImageKHR");
+  export_query = (PFNEGLEXPORTDMABUFIMAGEQUERYMESAPROC)eglGetProcAddress ("eglExportDMABUFImageQueryMESA");
+  export_image = (PFNEGLEXPORTDMABUFIMAGEMESAPROC)eglGetProcAddress ("eglExportDMABUFImageMESA");
+  if (create_image == NULL || destroy_image == NULL
+      || export_query == NULL || export_image == NULL)
+    {
+      g_set_error (
+          error, CG_ERROR, CG_ERROR_NOT_SUPPORTED,
+          "EGL: EGLImage entry points are missing");
+      return FALSE;
+    }
+
+  image = create_image (
+      display, eglGetCurrentContext (), EGL_GL_TEXTURE_2D_KHR,
+      (EGLClientBuffer)(guintptr)texture, attribs);
+  if (image == EGL_NO_IMAGE_KHR)
+    {
+      g_set_error (
+          error, CG_ERROR, CG_ERROR_FAILED_TEXTURE_GEN,
+          "EGL: Failed to create image from texture: 0x%x", eglGetError ());
+      return FALSE;
+    }
+
+  if (!export_query (display, image, &fourcc, &n_planes, modifiers)
+      || n_planes < 1 || n_planes > CG_DMABUF_MAX_PLANES
+      || !export_image (display, image, fds, strides, offsets))
+    {
+      g_set_error (
+          error, CG_ERROR, CG_ERROR_FAILED_TEXTURE_GEN,
+          "EGL: Failed to export texture as DMA-BUF: 0x%x", eglGetError ());
+      destroy_image (display, image);
+      return FALSE;
+    }
+
+  destroy_image (display, image);
+
+  dmabuf->fourcc = fourcc;
+  dmabuf->modifier = modifiers[0];
+  dmabuf->n_planes = n_planes;
+  for (int i = 0; i < CG_DMABUF_MAX_PLANES; i++)
+    {
+      /* Planes sharing a buffer with an earlier one report -1 */
+      dmabuf->fds[i] = i < n_planes ? fds[i] : -1;
+      dmabuf->offsets[i] = i < n_planes ? offsets[i] : 0;
+      dmabuf->strides[i] = i < n_planes ? strides[i] : 0;
+    }
+
+  return TRUE;
+}
+
+typedef struct
+{
+  EGLDisplay display;
+  EGLContext context;
+} Headless;
+
+gpointer
+cg_priv_egl_headless_new (int device,
+                          GError **error)
+{
+  static const EGLint context_attribs[] = {
+    EGL_CONTEXT_MAJOR_VERSION,
+    4,
+    EGL_CONTEXT_MINOR_VERSION,
+    3,
+    EGL_CONTEXT_OPENGL_PROFILE_MASK,
+    EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+    EGL_NONE,
+  };
+  PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display = NULL;
+  EGLDisplay display = EGL_NO_DISPLAY;
+  EGLContext context = EGL_NO_CONTEXT;
+  EGLint major = 0;
+  EGLint minor = 0;
+  Headless *headless = NULL;
+
+  get_platform_display = (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress ("eglGetPlatformDisplayEXT");
+  if (get_platform_display == NULL)
+    {
+      g_set_error (
+          error, CG_ERROR, CG_ERROR_NOT_SUPPORTED,
+          "EGL: Platform displays are not supported");
+      return NULL;
+    }
+
+  if (device >= 0)
+    {
+      PFNEGLQUERYDEVICESEXTPROC query_devices = NULL;
+      EGLDeviceEXT devices[64] = { 0 };
+      EGLint n_devices = 0;
+
+      query_devices = (PFNEGLQUERYDEVICESEXTPROC)eglGetProcAddress ("eglQueryDevicesEXT");
+      if (query_devices == NULL
+          || !query_devices (G_N_ELEMENTS (devices), devices, &n_devices))
+        {
+          g_set_error (
+              error, CG_ERROR, CG_ERROR_NOT_SUPPORTED,
+              "EGL: Devices cannot be enumerated");
+          return NULL;
+        }
+      if (device >= n_devices)
+        {
+          g_set_error (
+              error, CG_ERROR, CG_ERROR_FAILED_INIT,
+              "EGL: Device %d does not exist, there are %d",
+              device, n_devices);
+          return NULL;
+        }
+
+      display = get_platform_display (EGL_PLATFORM_DEVICE_EXT, devices[device], NULL);
+    }
+  else
+    display = get_platform_display (EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+
+  if (display == EGL_NO_DISPLAY || !eglInitialize (display, &major, &minor))
+    {
+      g_set_error (
+          error, CG_ERROR, CG_ERROR_FAILED_INIT,
+          "EGL: Failed to initialize display: 0x%x", eglGetError ());
+      return NULL;
+    }
+  g_debug ("EGL: Initialized version %d.%d for headless use", major, minor);
+
+  if (!cg_priv_egl_has_extension (display, "EGL_KHR_surfaceless_context")
+      || !cg_priv_egl_has_extension (display, "EGL_KHR_no_config_context"))
+    {
+      g_set_error (
+          error, CG_ERROR, CG_ERROR_NOT_SUPPORTED,
+          "EGL: Surfaceless contexts are not supported");
+      return NULL;
+    }
+
+  if (!eglBindAPI (EGL_OPENGL_API))
+    {
+      g_set_error (
+          error, CG_ERROR, CG_ERROR_NOT_SUPPORTED,
+          "EGL: Desktop OpenGL is not supported");
+      return NULL;
+    }
+
+  context = eglCreateContext (display, EGL_NO_CONFIG_KHR, EGL_NO_CONTEXT, context_attribs);
+  if (context == EGL_NO_CONTEXT)
+    {
+      g_set_error (
+          error, CG_ERROR, CG_ERROR_FAILED_INIT,
+          "EGL: Failed to create context: 0x%x", eglGetError ());
+      return NULL;
+    }
+
+  if (!eglMakeCurrent (display, EGL_NO_SURFACE, EGL_NO_SURFACE, context))
+    {
+      g_set_error (
+          error, CG_ERROR, CG_ERROR_FAILED_INIT,
+          "EGL: Failed to make context current: 0x%x", eglGetError ());
+      eglDestroyContext (display, context);
+      return NULL;
+    }
+
+  headless = g_new0 (Headless, 1);
+  headless->display = display;
+  headless->context = context;
+
+  return headless;
+}
+
+void
+cg_priv_egl_headless_free (gpointer headless)
+{
+  Headless *self = headless;
+
+  if (eglGetCurrentContext () == self->context)
+    eglMakeCurrent (self->display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+  eglDestroyContext (self->display, self->context);
+
+  /* Displays are shared within a process, so
+   * terminating one could pull the rug out from
+   * under other headless gpus */
+  g_free (self);
+}
+
+gpointer
+cg_priv_egl_get_loader (void)
+{
+  return (gpointer)eglGetProcAddress;
+}
@@ -0,0 +1,1525 @@
+/* cpc-gpu-gl-dispatch.h
+ *
+ * Copyright 2025 Adam Masciola
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+/* No include guard: cpc-gpu-gl.c includes this file once per
+ * dispatch variant. Before each inclusion it defines
+ * CGL_DISPATCH_TRACE to 0 or 1 and CGL_DISPATCH_SUFFIX to the
+ * suffix given to every function below. The renames are
+ * function-like macros so that members such as `instr->blit'
+ * are left alone.
+ *
+ * With CGL_DISPATCH_TRACE set to 0, CGL_RUN only makes the GL
+ * call; the trace arguments are never evaluated. With it set
+ * to 1, every call is recorded unconditionally. */
+
+#if !defined(CGL_DISPATCH_TRACE) || !defined(CGL_DISPATCH_SUFFIX)
+#error "cpc-gpu-gl-dispatch.h must only be included by cpc-gpu-gl.c"
+#endif
+
+#define _CGL_DISPATCH_NAME(name, suffix) name##_##suffix
+#define CGL_DISPATCH_NAME(name, suffix) _CGL_DISPATCH_NAME (name, suffix)
+
+#define setup_or_teardown(...) CGL_DISPATCH_NAME (setup_or_teardown, CGL_DISPATCH_SUFFIX) (__VA_ARGS__)
+#define draw_vertices(...) CGL_DISPATCH_NAME (draw_vertices, CGL_DISPATCH_SUFFIX) (__VA_ARGS__)
+#define blit(...) CGL_DISPATCH_NAME (blit, CGL_DISPATCH_SUFFIX) (__VA_ARGS__)
+#define build_depth_pyramid(...) CGL_DISPATCH_NAME (build_depth_pyramid, CGL_DISPATCH_SUFFIX) (__VA_ARGS__)
+#define process_instr_node(...) CGL_DISPATCH_NAME (process_instr_node, CGL_DISPATCH_SUFFIX) (__VA_ARGS__)
+
+#if CGL_DISPATCH_TRACE
+#define CGL_RUN(commands, func, args, fmt, fmt_args) \
+  CG_PRIV_RUN_TRACED (commands, func, _A (args), fmt, _A (fmt_args))
+#else
+#define CGL_RUN(commands, func, args, fmt, fmt_args) \
+  G_STMT_START                                       \
+  {                                                  \
+    (void)(commands);                                \
+    (func) (args);                                   \
+  }                                                  \
+  G_STMT_END
+#endif
+
+static gboolean
+setup_or_teardown (GLuint framebuffer,
+                   GLuint blit_read_fb,
+                   GLuint blit_draw_fb,
+                   CgPrivInstr *instr,
+                   CgPrivInstr *ref,
+                   ProcessData *data,
+                   int mode)
+{
+  CgShader *shader = NULL;
+  CglProgram *gl_program = NULL;
+  gboolean setup = FALSE;
+  gboolean teardown = FALSE;
+  gboolean attach = FALSE;
+
+  g_assert (instr->type == CG_PRIV_INSTR_PASS);
+  g_assert (mode == PASS_SETUP || mode == PASS_TEARDOWN || ref != NULL);
+
+  shader = instr->pass.shader;
+  gl_program = shader != NULL ? ((CglShader *)shader)->program : NULL;
+
+  setup = mode == PASS_SETUP;
+  teardown = mode == PASS_TEARDOWN;
+  attach = !instr->pass.fake
+           && !get_native_framebuffer (instr, NULL)
+           && (setup
+               || (teardown
+                   && !instr->pass.merge_parent
+                   && !instr->pass.keep_targets));
+
+  if (!teardown)
+    {
+      GLint program = shader != NULL ? (GLint)gl_program->id : 0;
+
+      if ((GLint)framebuffer != data->bound_framebuffer)
+        {
+          CGL_RUN (
+              data->commands,
+              glBindFramebuffer, _A (GL_FRAMEBUFFER, framebuffer),
+              "%s, %d", _A ("GL_FRAMEBUFFER", framebuffer));
+          data->bound_framebuffer = framebuffer;
+        }
+      if (program != data->bound_program)
+        {
+          CGL_RUN (
+              data->commands,
+              glUseProgram, _A (program),
+              "%d", _A (program));
+          data->bound_program = program;
+        }
+    }
+
+  if (attach)
+    {
+      for (guint i = 0, colors = 0, depths = 0;
+           i < instr->pass.targets->len;
+           i++)
+        {
+          CgPrivTarget *target = NULL;
+          CglTexture *gl_target = NULL;
+
+          target = &g_array_index (instr->pass.targets, CgPrivTarget, i);
+          gl_target = (CglTexture *)target->texture;
+
+          if (target->texture->init.format == CG_PRIV_FORMAT_DEPTH)
+            {
+              gboolean stencil = cg_priv_texture_has_stencil (target->texture);
+
+              g_assert (depths == 0);
+
+              CGL_RUN (
+                  data->commands,
+                  glFramebufferTexture2D,
+                  _A (
+                      GL_FRAMEBUFFER,
+                      stencil
+                          ? GL_DEPTH_STENCIL_ATTACHMENT
+                          : GL_DEPTH_ATTACHMENT,
+                      target->texture->init.msaa > 0
+                          ? GL_TEXTURE_2D_MULTISAMPLE
+                          : GL_TEXTURE_2D,
+                      teardown ? 0 : gl_target->id,
+                      0),
+                  "%s, %s, %s, %d, %d",
+                  _A (
+                      "GL_FRAMEBUFFER",
+                      stencil
+                          ? "GL_DEPTH_STENCIL_ATTACHMENT"
+                          : "GL_DEPTH_ATTACHMENT",
+                      target->texture->init.msaa > 0
+                          ? "GL_TEXTURE_2D_MULTISAMPLE"
+                          : "GL_TEXTURE_2D",
+                      teardown ? 0 : gl_target->id,
+                      0));
+
+              depths++;
+            }
+          else
+            {
+              g_assert (colors < G_N_ELEMENTS (gl_draw_buffer_enums));
+
+              CGL_RUN (
+                  data->commands,
+                  glFramebufferTexture2D,
+                  _A (
+                      GL_FRAMEBUFFER, gl_draw_buffer_enums[colors],
+                      target->texture->init.msaa > 0
+                          ? GL_TEXTURE_2D_MULTISAMPLE
+                          : GL_TEXTURE_2D,
+                      teardown ? 0 : gl_target->id, 0),
+                  "%s, %s, %s, %d, %d",
+                  _A (
+                      "GL_FRAMEBUFFER", gl_draw_buffer_str_enums[colors],
+                      target->texture->init.msaa > 0
+                          ? "GL_TEXTURE_2D_MULTISAMPLE"
+                          : "GL_TEXTURE_2D",
+                      teardown ? 0 : gl_target->id, 0));
+
+              CGL_RUN (
+                  data->commands,
+                  glBlendFunci,
+                  _A (
+                      colors,
+                      blend_func_map[target->src_blend],
+                      blend_func_map[target->dst_blend]),
+                  "%d, %s, %s",
+                  _A (
+                      colors,
+                      blend_func_str_map[target->src_blend],
+                      blend_func_str_map[target->dst_blend]));
+
+              colors++;
+            }
+        }
+
+      if (setup)
+        {
+          GLenum status = 0;
+
+          CGL_RUN (
+              data->commands,
+              glDrawBuffers,
+              _A (
+                  (int)CLAMP (instr->pass.targets->len, 1, G_N_ELEMENTS (gl_draw_buffer_enums)),
+                  gl_draw_buffer_enums),
+              "%d, %s",
+              _A (
+                  (int)CLAMP (instr->pass.targets->len, 1, G_N_ELEMENTS (gl_draw_buffer_enums)),
+                  CG_PRIV_ADDRESS));
+
+          status = glCheckFramebufferStatus (GL_FRAMEBUFFER);
+          if (status != GL_FRAMEBUFFER_COMPLETE)
+            {
+              CGL_SET_ERROR (
+                  data->error,
+                  CG_ERROR_FAILED_TARGET_CREATION,
+                  "Failed to complete framebuffer");
+              return FALSE;
+            }
+        }
+    }
+
+  if (setup
+      && !instr->pass.fake
+      && get_native_framebuffer (instr, NULL))
+    {
+      CgPrivTarget *target = NULL;
+
+      target = &g_array_index (instr->pass.targets, CgPrivTarget, 0);
+      CGL_RUN (
+          data->commands,
+          glBlendFunci,
+          _A (
+              0,
+              blend_func_map[target->src_blend],
+              blend_func_map[target->dst_blend]),
+          "%d, %s, %s",
+          _A (
+              0,
+              blend_func_str_map[target->src_blend],
+              blend_func_str_map[target->dst_blend]));
+    }
+
+  if ((mode == PASS_CONTINUE || mode == PASS_RESTORE)
+      && instr->pass.targets != ref->pass.targets)
+    {
+      for (guint i = 0, colors = 0;
+           i < instr->pass.targets->len;
+           i++)
+        {
+          CgPrivTarget *target = NULL;
+          CgPrivTarget *ref_target = NULL;
+
+          target = &g_array_index (instr->pass.targets, CgPrivTarget, i);
+          if (target->texture->init.format == CG_PRIV_FORMAT_DEPTH)
+            continue;
+
+          if (i < ref->pass.targets->len)
+            ref_target = &g_array_index (ref->pass.targets, CgPrivTarget, i);
+
+          if (ref_target == NULL
+              || ref_target->src_blend != target->src_blend
+              || ref_target->dst_blend != target->dst_blend)
+            CGL_RUN (
+                data->commands,
+                glBlendFunci,
+                _A (
+                    colors,
+                    blend_func_map[target->src_blend],
+                    blend_func_map[target->dst_blend]),
+                "%d, %s, %s",
+                _A (
+                    colors,
+                    blend_func_str_map[target->src_blend],
+                    blend_func_str_map[target->dst_blend]));
+
+          colors++;
+        }
+    }
+
+  if (shader != NULL)
+    {
+      for (guint i = 0, textures = 0;
+           i < instr->pass.uniforms.order->len;
+           i++)
+        {
+          const char *name = NULL;
+          CgValue *value = NULL;
+          guint uniform_index = 0;
+          ShaderLocation *uniform = NULL;
+
+          name = g_ptr_array_index (instr->pass.uniforms.order, i);
+          value = g_hash_table_lookup (instr->pass.uniforms.hash, name);
+
+          uniform_index = GPOINTER_TO_UINT (g_hash_table_lookup (gl_program->uniform_assoc, name));
+          g_assert (uniform_index > 0);
+          uniform = &gl_program->uniforms[uniform_index - 1];
+
+          g_assert (value != NULL);
+          g_assert (uniform != NULL);
+
+          switch (value->type)
+            {
+            case CG_TYPE_TEXTURE:
+              {
+                GLint textures_int = textures + 1;
+                CglTexture *gl_texture = (CglTexture *)value->texture;
+
+                g_assert (textures + 1 < G_N_ELEMENTS (gl_texture_slot_enums));
+
+                if (value->texture->init.msaa > 0)
+                  {
+                    CglTexture *read_texture = NULL;
+
+                    read_texture = gl_texture;
+                    gl_texture = (CglTexture *)gl_texture->non_msaa;
+
+                    /* If the texture uses msaa, blit to a temp texture */
+                    if (!teardown)
+                      {
+                        for (int j = 0; j < 2; j++)
+                          {
+                            GLenum tmp_status = 0;
+
+                            CGL_RUN (
+                                data->commands,
+                                glBindFramebuffer, _A (GL_FRAMEBUFFER, j == 0 ? blit_read_fb : blit_draw_fb),
+                                "%s, %d", _A ("GL_FRAMEBUFFER", j == 0 ? blit_read_fb : blit_draw_fb));
+
+                            CGL_RUN (
+                                data->commands,
+                                glFramebufferTexture2D,
+                                _A (
+                                    GL_FRAMEBUFFER,
+                                    value->texture->init.format == CG_PRIV_FORMAT_DEPTH
+                                        ? GL_DEPTH_ATTACHMENT
+                                        : GL_COLOR_ATTACHMENT0,
+                                    (j == 0 ? read_texture->non_msaa : gl_texture->non_msaa) != NULL
+                                        ? GL_TEXTURE_2D_MULTISAMPLE
+                                        : GL_TEXTURE_2D,
+                                    j == 0
+                                        ? read_texture->id
+                                        : gl_texture->id,
+                                    0),
+                                "%s, %s, %s, %d, %d",
+                                _A (
+                                    "GL_FRAMEBUFFER",
+                                    value->texture->init.format == CG_PRIV_FORMAT_DEPTH
+                                        ? "GL_DEPTH_ATTACHMENT"
+                                        : "GL_COLOR_ATTACHMENT0",
+                                    (j == 0 ? read_texture->non_msaa : gl_texture->non_msaa) != NULL
+                                        ? "GL_TEXTURE_2D_MULTISAMPLE"
+                                        : "GL_TEXTURE_2D",
+                                    j == 0
+                                        ? read_texture->id
+                                        : gl_texture->id,
+                                    0));
+
+                            tmp_status = glCheckFramebufferStatus (GL_FRAMEBUFFER);
+                            if (tmp_status != GL_FRAMEBUFFER_COMPLETE)
+                              {
+                                CGL_SET_ERROR (
+                                    data->error,
+                                    CG_ERROR_FAILED_TARGET_CREATION,
+                                    "Failed to complete framebuffer");
+                                return FALSE;
+                              }
+                          }
+
+                        CGL_RUN (
+                            data->commands,
+                            glBindFramebuffer, _A (GL_READ_FRAMEBUFFER, blit_read_fb),
+                            "%s, %d", _A ("GL_READ_FRAMEBUFFER", blit_read_fb));
+                        CGL_RUN (
+                            data->commands,
+                            glBindFramebuffer, _A (GL_DRAW_FRAMEBUFFER, blit_draw_fb),
+                            "%s, %d", _A ("GL_DRAW_FRAMEBUFFER", blit_draw_fb));
+
+                        CGL_RUN (
+                            data->commands,
+                            glBlitFramebuffer,
+                            _A (
+                                0, 0, value->texture->init.width, value->texture->init.height,
+                                0, 0, value->texture->init.width, value->texture->init.height,
+                                value->texture->init.format == CG_PRIV_FORMAT_DEPTH
+                                    ? GL_DEPTH_BUFFER_BIT
+                                    : GL_COLOR_BUFFER_BIT,
+                                GL_NEAREST),
+                            "%d, %d, %d, %d, %d, %d, %d, %d, %s, %s",
+                            _A (
+                                0, 0, value->texture->init.width, value->texture->init.height,
+                                0, 0, value->texture->init.width, value->texture->init.height,
+                                value->texture->init.format == CG_PRIV_FORMAT_DEPTH
+                                    ? "GL_DEPTH_BUFFER_BIT"
+                                    : "GL_COLOR_BUFFER_BIT",
+                                "GL_NEAREST"));
+
+                        CGL_RUN (
+                            data->commands,
+                            glBindFramebuffer, _A (GL_READ_FRAMEBUFFER, 0),
+                            "%s, %d", _A ("GL_READ_FRAMEBUFFER", 0));
+                        CGL_RUN (
+                            data->commands,
+                            glBindFramebuffer, _A (GL_DRAW_FRAMEBUFFER, 0),
+                            "%s, %d", _A ("GL_DRAW_FRAMEBUFFER", 0));
+
+                        for (int j = 0; j < 2; j++)
+                          {
+                            CGL_RUN (
+                                data->commands,
+                                glBindFramebuffer, _A (GL_FRAMEBUFFER, j == 0 ? blit_read_fb : blit_draw_fb),
+                                "%s, %d", _A ("GL_FRAMEBUFFER", j == 0 ? blit_read_fb : blit_draw_fb));
+
+                            CGL_RUN (
+                                data->commands,
+                                glFramebufferTexture2D,
+                                _A (
+                                    GL_FRAMEBUFFER,
+                                    value->texture->init.format == CG_PRIV_FORMAT_DEPTH
+                                        ? GL_DEPTH_ATTACHMENT
+                                        : GL_COLOR_ATTACHMENT0,
+                                    (j == 0 ? read_texture->non_msaa : gl_texture->non_msaa) != NULL
+                                        ? GL_TEXTURE_2D_MULTISAMPLE
+                                        : GL_TEXTURE_2D,
+                                    0, 0),
+                                "%s, %s, %s, %d, %d",
+                                _A (
+                                    "GL_FRAMEBUFFER",
+                                    value->texture->init.format == CG_PRIV_FORMAT_DEPTH
+                                        ? "GL_DEPTH_ATTACHMENT"
+                                        : "GL_COLOR_ATTACHMENT0",
+                                    (j == 0 ? read_texture->non_msaa : gl_texture->non_msaa) != NULL
+                                        ? "GL_TEXTURE_2D_MULTISAMPLE"
+                                        : "GL_TEXTURE_2D",
+                                    0, 0));
+                          }
+
+                        CGL_RUN (
+                            data->commands,
+                            glBindFramebuffer, _A (GL_FRAMEBUFFER, framebuffer),
+                            "%s, %d", _A ("GL_FRAMEBUFFER", framebuffer));
+                      }
+                  }
+
+                CGL_RUN (
+                    data->commands,
+                    glActiveTexture, _A (gl_texture_slot_enums[textures + 1]),
+                    "%s", _A (gl_texture_slot_str_enums[textures + 1]));
+
+                CGL_RUN (
+                    data->commands,
+                    glBindTexture,
+                    _A (
+                        value->texture->init.cubemap
+                            ? GL_TEXTURE_CUBE_MAP
+                            : GL_TEXTURE_2D,
+                        teardown ? 0 : gl_texture->id),
+                    "%s, %d",
+                    _A (
+                        value->texture->init.cubemap
+                            ? "GL_TEXTURE_CUBE_MAP"
+                            : "GL_TEXTURE_2D",
+                        teardown ? 0 : gl_texture->id));
+                CGL_RUN (
+                    data->commands,
+                    glUniform1i, _A (uniform->location, teardown ? 0 : textures_int),
+                    "%d, %d", _A (uniform->location, teardown ? 0 : textures_int));
+
+                CGL_RUN (
+                    data->commands,
+                    glActiveTexture, _A (gl_texture_slot_enums[0]),
+                    "%s", _A (gl_texture_slot_str_enums[0]));
+
+                textures++;
+              }
+              break;
+            case CG_TYPE_BUFFER:
+              {
+                guint block_index = 0;
+                CglBuffer *gl_buffer = (CglBuffer *)value->buffer;
+
+                block_index = GPOINTER_TO_UINT (
+                    g_hash_table_lookup (
+                        gl_program->uniform_blocks,
+                        GUINT_TO_POINTER (uniform->location)));
+                g_assert (block_index > 0);
+
+                CGL_RUN (
+                    data->commands,
+                    glUniformBlockBinding, _A (gl_program->id, block_index - 1, 0),
+                    "%d, %d, %d", _A (gl_program->id, block_index - 1, 0));
+                CGL_RUN (
+                    data->commands,
+                    glBindBufferBase, _A (GL_UNIFORM_BUFFER, 0, teardown ? 0 : gl_buffer->ubo_id),
+                    "%s, %d, %d", _A ("GL_UNIFORM_BUFFER", 0, teardown ? 0 : gl_buffer->ubo_id));
+              }
+              break;
+            case CG_TYPE_BOOL:
+              if (!teardown)
+                CGL_RUN (
+                    data->commands,
+                    glUniform1i, _A (uniform->location, value->b ? GL_TRUE : GL_FALSE),
+                    "%d, %s", _A (uniform->location, value->b ? "GL_TRUE" : "GL_FALSE"));
+              break;
+            case CG_TYPE_INT:
+              if (!teardown)
+                CGL_RUN (
+                    data->commands,
+                    glUniform1i, _A (uniform->location, value->i),
+                    "%d, %d", _A (uniform->location, value->i));
+              break;
+            case CG_TYPE_UINT:
+              if (!teardown)
+                CGL_RUN (
+                    data->commands,
+                    glUniform1ui, _A (uniform->location, value->ui),
+                    "%d, %d", _A (uniform->location, value->ui));
+              break;
+            case CG_TYPE_FLOAT:
+              if (!teardown)
+                CGL_RUN (
+                    data->commands,
+                    glUniform1f, _A (uniform->location, value->f),
+                    "%d, %f", _A (uniform->location, value->f));
+              break;
+            case CG_TYPE_VEC2:
+              if (!teardown)
+                CGL_RUN (
+                    data->commands,
+                    glUniform2fv, _A (uniform->location, 1, value->vec2),
+                    "%d, %d, VEC2{%f %f}", _A (uniform->location, 1, value->vec2[0], value->vec2[1]));
+              break;
+            case CG_TYPE_VEC3:
+              if (!teardown)
+                CGL_RUN (
+                    data->commands,
+                    glUniform3fv, _A (uniform->location, 1, value->vec3),
+                    "%d, %d, VEC3{%f %f %f}",
+                    _A (
+                        uniform->location, 1,
+                        value->vec3[0],
+                        value->vec3[1],
+                        value->vec3[2]));
+              break;
+            case CG_TYPE_VEC4:
+              if (!teardown)
+                CGL_RUN (
+                    data->commands,
+                    glUniform4fv, _A (uniform->location, 1, value->vec4),
+                    "%d, %d, VEC4{%f %f %f %f}",
+                    _A (
+                        uniform->location, 1,
+                        value->vec4[0],
+                        value->vec4[1],
+                        value->vec4[2],
+                        value->vec4[3]));
+              break;
+            case CG_TYPE_MAT4:
+              if (!teardown)
+                CGL_RUN (
+                    data->commands,
+                    glUniformMatrix4fv, _A (uniform->location, 1, GL_FALSE, value->mat4.initialized),
+                    "%d, %d, %s, MAT4{%f %f %f %f %f %f %f %f %f %f %f %f %f %f %f %f}",
+                    _A (
+                        uniform->location, 1, "GL_FALSE",
+                        value->mat4.initialized[0],
+                        value->mat4.initialized[1],
+                        value->mat4.initialized[2],
+                        value->mat4.initialized[3],
+                        value->mat4.initialized[4],
+                        value->mat4.initialized[5],
+                        value->mat4.initialized[6],
+                        value->mat4.initialized[7],
+                        value->mat4.initialized[8],
+                        value->mat4.initialized[9],
+                        value->mat4.initialized[10],
+                        value->mat4.initialized[11],
+                        value->mat4.initialized[12],
+                        value->mat4.initialized[13],
+                        value->mat4.initialized[14],
+                        value->mat4.initialized[15]));
+              break;
+            default:
+              g_assert_not_reached ();
+            }
+        }
+    }
+
+  if (setup && !instr->pass.fake)
+    {
+      CGL_RUN (
+          data->commands,
+          glColorMask, _A (GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE),
+          "%s, %s, %s, %s", _A ("GL_TRUE", "GL_TRUE", "GL_TRUE", "GL_TRUE"));
+      CGL_RUN (
+          data->commands,
+          glDepthMask, _A (GL_TRUE),
+          "%s", _A ("GL_TRUE"));
+      CGL_RUN (
+          data->commands,
+          glStencilMask, _A (0xff),
+          "%#x", _A (0xff));
+      CGL_RUN (
+          data->commands,
+          glClearColor, _A (0.0, 0.0, 0.0, 0.0),
+          "%f, %f, %f, %f", _A (0.0, 0.0, 0.0, 0.0));
+      CGL_RUN (
+          data->commands,
+          glClearStencil, _A (0),
+          "%d", _A (0));
+      CGL_RUN (
+          data->commands,
+          glClear, _A (GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT),
+          "%s", _A ("GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT"));
+    }
+
+  if (!teardown)
+    {
+      gboolean dest_changed = FALSE;
+      gboolean write_mask_changed = FALSE;
+      gboolean depth_test_func_changed = FALSE;
+      gboolean clockwise_faces_changed = FALSE;
+      gboolean backface_cull_changed = FALSE;
+      gboolean stencil_func_changed = FALSE;
+      gboolean stencil_ops_changed = FALSE;
+
+      if (setup)
+        {
+          dest_changed = instr->pass.dest.set;
+          write_mask_changed = instr->pass.write_mask.set || !instr->pass.fake;
+          depth_test_func_changed = instr->pass.depth_test_func.set;
+          clockwise_faces_changed = instr->pass.clockwise_faces.set;
+          backface_cull_changed = instr->pass.backface_cull.set;
+          stencil_func_changed = instr->pass.stencil_func.set;
+          stencil_ops_changed = instr->pass.stencil_ops.set;
+        }
+      else
+        {
+          /* Values are inherited, so comparing them against
+           * whatever `ref` applied is enough. A viewport that
+           * was never set is left alone. */
+          dest_changed = memcmp (instr->pass.dest.val, ref->pass.dest.val,
+                                 sizeof (instr->pass.dest.val)) != 0
+                         && instr->pass.dest.val[2] > 0
+                         && instr->pass.dest.val[3] > 0;
+          write_mask_changed = instr->pass.write_mask.val != ref->pass.write_mask.val;
+          depth_test_func_changed = instr->pass.depth_test_func.val != ref->pass.depth_test_func.val;
+          clockwise_faces_changed = instr->pass.clockwise_faces.val != ref->pass.clockwise_faces.val;
+          backface_cull_changed = instr->pass.backface_cull.val != ref->pass.backface_cull.val;
+          stencil_func_changed = instr->pass.stencil_func.val != ref->pass.stencil_func.val
+                                 || instr->pass.stencil_func.ref != ref->pass.stencil_func.ref
+                                 || instr->pass.stencil_func.mask != ref->pass.stencil_func.mask;
+          stencil_ops_changed = memcmp (instr->pass.stencil_ops.val, ref->pass.stencil_ops.val,
+                                        sizeof (instr->pass.stencil_ops.val)) != 0;
+        }
+
+      if (dest_changed)
+        CGL_RUN (
+            data->commands,
+            glViewport,
+            _A (
+                instr->pass.dest.val[0],
+                instr->pass.dest.val[1],
+                instr->pass.dest.val[2],
+                instr->pass.dest.val[3]),
+            "%d, %d, %d, %d",
+            _A (
+                instr->pass.dest.val[0],
+                instr->pass.dest.val[1],
+                instr->pass.dest.val[2],
+                instr->pass.dest.val[3]));
+
+      if (write_mask_changed)
+        {
+          CGL_RUN (
+              data->commands,
+              glColorMask,
+              _A (
+                  instr->pass.write_mask.val & CG_WRITE_MASK_COLOR_RED ? GL_TRUE : GL_FALSE,
+                  instr->pass.write_mask.val & CG_WRITE_MASK_COLOR_GREEN ? GL_TRUE : GL_FALSE,
+                  instr->pass.write_mask.val & CG_WRITE_MASK_COLOR_BLUE ? GL_TRUE : GL_FALSE,
+                  instr->pass.write_mask.val & CG_WRITE_MASK_COLOR_ALPHA ? GL_TRUE : GL_FALSE),
+              "%s, %s, %s, %s",
+              _A (
+                  instr->pass.write_mask.val & CG_WRITE_MASK_COLOR_RED ? "GL_TRUE" : "GL_FALSE",
+                  instr->pass.write_mask.val & CG_WRITE_MASK_COLOR_GREEN ? "GL_TRUE" : "GL_FALSE",
+                  instr->pass.write_mask.val & CG_WRITE_MASK_COLOR_BLUE ? "GL_TRUE" : "GL_FALSE",
+                  instr->pass.write_mask.val & CG_WRITE_MASK_COLOR_ALPHA ? "GL_TRUE" : "GL_FALSE"));
+
+          CGL_RUN (
+              data->commands,
+              glDepthMask,
+              _A (
+                  instr->pass.write_mask.val & CG_WRITE_MASK_DEPTH ? GL_TRUE : GL_FALSE),
+              "%s",
+              _A (
+                  instr->pass.write_mask.val & CG_WRITE_MASK_DEPTH ? "GL_TRUE" : "GL_FALSE"));
+
+          CGL_RUN (
+              data->commands,
+              glStencilMask,
+              _A (
+                  instr->pass.write_mask.val & CG_WRITE_MASK_STENCIL ? 0xff : 0),
+              "%#x",
+              _A (
+                  instr->pass.write_mask.val & CG_WRITE_MASK_STENCIL ? 0xff : 0));
+        }
+
+      if (setup)
+        CGL_RUN (
+            data->commands,
+            glEnable, _A (GL_DEPTH_TEST),
+            "%s", _A ("GL_DEPTH_TEST"));
+      if (depth_test_func_changed)
+        CGL_RUN (
+            data->commands,
+            glDepthFunc, _A (test_func_map[instr->pass.depth_test_func.val]),
+            "%s", _A (test_func_str_map[instr->pass.depth_test_func.val]));
+
+      /* Without a stencil attachment the test always passes */
+      if (setup)
+        CGL_RUN (
+            data->commands,
+            glEnable, _A (GL_STENCIL_TEST),
+            "%s", _A ("GL_STENCIL_TEST"));
+      if (stencil_func_changed)
+        CGL_RUN (
+            data->commands,
+            glStencilFunc,
+            _A (
+                test_func_map[instr->pass.stencil_func.val],
+                (GLint)instr->pass.stencil_func.ref,
+                instr->pass.stencil_func.mask),
+            "%s, %d, %#x",
+            _A (
+                test_func_str_map[instr->pass.stencil_func.val],
+                (GLint)instr->pass.stencil_func.ref,
+                instr->pass.stencil_func.mask));
+      if (stencil_ops_changed)
+        CGL_RUN (
+            data->commands,
+            glStencilOp,
+            _A (
+                stencil_op_map[instr->pass.stencil_ops.val[0]],
+                stencil_op_map[instr->pass.stencil_ops.val[1]],
+                stencil_op_map[instr->pass.stencil_ops.val[2]]),
+            "%s, %s, %s",
+            _A (
+                stencil_op_str_map[instr->pass.stencil_ops.val[0]],
+                stencil_op_str_map[instr->pass.stencil_ops.val[1]],
+                stencil_op_str_map[instr->pass.stencil_ops.val[2]]));
+
+      if (clockwise_faces_changed)
+        CGL_RUN (
+            data->commands,
+            glFrontFace, _A (instr->pass.clockwise_faces.val ? GL_CW : GL_CCW),
+            "%s", _A (instr->pass.clockwise_faces.val ? "GL_CW" : "GL_CCW"));
+
+      if (backface_cull_changed)
+        {
+          if (instr->pass.backface_cull.val)
+            CGL_RUN (
+                data->commands,
+                glEnable, _A (GL_CULL_FACE),
+                "%s", _A ("GL_CULL_FACE"));
+          else
+            CGL_RUN (
+                data->commands,
+                glDisable, _A (GL_CULL_FACE),
+                "%s", _A ("GL_CULL_FACE"));
+        }
+    }
+
+  return TRUE;
+}
+
+static gboolean
+draw_vertices (CgPrivInstr *instr,
+               CgShader *shader,
+               ProcessData *data)
+{
+  CglProgram *gl_program = ((CglShader *)shader)->program;
+  CgBuffer **buffers = NULL;
+  guint n_buffers = 0;
+  guint first_instance = 0;
+  guint instance_offset = 0;
+  guint instances = 0;
+  CglBuffer *indices = NULL;
+  int topology = 0;
+  guint max_length = 0;
+  guint max_instance_length = 0;
+
+  if (instr->vertices.n_buffers > 1)
+    buffers = instr->vertices.many_buffers;
+  else
+    buffers = &instr->vertices.one_buffer;
+  n_buffers = instr->vertices.n_buffers;
+  first_instance = instr->vertices.first_instance;
+  instances = instr->vertices.instances;
+  indices = (CglBuffer *)instr->vertices.indices;
+  topology = instr->vertices.topology;
+
+  /* Without base instance draws, per-instance segments
+   * start at the first instance by moving their pointers
+   * instead, which fetches the same elements */
+  if (!((CglGpu *)data->commands->gpu)->base_instance)
+    {
+      instance_offset = first_instance;
+      first_instance = 0;
+    }
+
+  CGL_RUN (
+      data->commands,
+      glBindVertexArray, _A (((CglGpu *)data->commands->gpu)->vao),
+      "%d", _A (((CglGpu *)data->commands->gpu)->vao));
+
+  for (guint i = 0; i < n_buffers; i++)
+    {
+      CglBuffer *gl_buffer = NULL;
+      gsize stride = 0;
+      gsize offset = 0;
+      gboolean per_vertex = FALSE;
+
+      g_assert (buffers[i]->spec != NULL);
+
+      gl_buffer = (CglBuffer *)buffers[i];
+      CGL_RUN (
+          data->commands,
+          glBindBuffer, _A (GL_ARRAY_BUFFER, gl_buffer->vbo_id),
+          "%s, %d", _A ("GL_ARRAY_BUFFER", gl_buffer->vbo_id));
+
+      stride = cg_priv_get_data_layout_stride (
+          buffers[i]->spec, buffers[i]->spec_length);
+
+      for (guint j = 0; j < buffers[i]->spec_length; j++)
+        {
+          const CgDataSegment *segment = &buffers[i]->spec[j];
+          ShaderLocation *attribute = NULL;
+          int component = 0;
+          gsize pointer = 0;
+
+          attribute = g_hash_table_lookup (
+              gl_program->attribute_assoc,
+              segment->name);
+          g_assert (attribute != NULL);
+
+          component = cg_priv_get_segment_component (segment);
+          pointer = offset;
+          if (segment->instance_rate > 0)
+            pointer += (gsize)instance_offset * stride;
+
+          if (segment->conversion == CG_CONVERSION_INTEGER)
+            CGL_RUN (
+                data->commands,
+                glVertexAttribIPointer,
+                _A (
+                    attribute->location,
+                    segment->num,
+                    component_map[component],
+                    stride,
+                    GSIZE_TO_POINTER (pointer)),
+                "%d, %d, %s, %zu, %zu",
+                _A (
+                    attribute->location,
+                    segment->num,
+                    component_str_map[component],
+                    stride,
+                    pointer));
+          else
+            CGL_RUN (
+                data->commands,
+                glVertexAttribPointer,
+                _A (
+                    attribute->location,
+                    segment->num,
+                    component_map[component],
+                    segment->conversion == CG_CONVERSION_NORMALIZE
+                        ? GL_TRUE
+                        : GL_FALSE,
+                    stride,
+                    GSIZE_TO_POINTER (pointer)),
+                "%d, %d, %s, %s, %zu, %zu",
+                _A (
+                    attribute->location,
+                    segment->num,
+                    component_str_map[component],
+                    segment->conversion == CG_CONVERSION_NORMALIZE
+                        ? "GL_TRUE"
+                        : "GL_FALSE",
+                    stride,
+                    pointer));
+
+          CGL_RUN (
+              data->commands,
+              glVertexAttribDivisor,
+              _A (attribute->location, segment->instance_rate),
+              "%d, %d",
+              _A (attribute->location, segment->instance_rate));
+
+          CGL_RUN (
+              data->commands,
+              glEnableVertexAttribArray, _A (attribute->location),
+              "%d", _A (attribute->location));
+
+          if (segment->instance_rate == 0)
+            per_vertex = TRUE;
+          offset += cg_priv_get_segment_size (segment);
+        }
+
+      /* Buffers holding only per-instance data
+       * do not decide how many vertices to draw */
+      gl_buffer->length = buffers[i]->init.size / stride;
+      if (per_vertex)
+        max_length = MAX (max_length, gl_buffer->length);
+      else
+        max_instance_length = MAX (max_instance_length, gl_buffer->length);
+    }
+  if (max_length == 0)
+    max_length = max_instance_length;
+
+  if (indices != NULL)
+    {
+      int format = indices->base.index_format;
+      gboolean restart = FALSE;
+
+      /* Restarting only makes sense for strips, and
+       * leaving it on would reserve an index value
+       * for every other topology */
+      restart = topology == CG_TOPOLOGY_TRIANGLE_STRIP
+                || topology == CG_TOPOLOGY_LINE_STRIP;
+
+      CGL_RUN (
+          data->commands,
+          glBindBuffer, _A (GL_ELEMENT_ARRAY_BUFFER, indices->ebo_id),
+          "%s, %d", _A ("GL_ELEMENT_ARRAY_BUFFER", indices->ebo_id));
+
+      if (restart)
+        {
+          CGL_RUN (
+              data->commands,
+              glEnable, _A (GL_PRIMITIVE_RESTART),
+              "%s", _A ("GL_PRIMITIVE_RESTART"));
+          CGL_RUN (
+              data->commands,
+              glPrimitiveRestartIndex, _A (restart_index_map[format]),
+              "%u", _A (restart_index_map[format]));
+        }
+
+      if (first_instance > 0)
+        CGL_RUN (
+            data->commands,
+            glDrawElementsInstancedBaseInstance,
+            _A (topology_map[topology], indices->length, component_map[format],
+                NULL, instances, first_instance),
+            "%s, %d, %s, %s, %d, %d",
+            _A (topology_str_map[topology], indices->length, component_str_map[format],
+                "NULL", instances, first_instance));
+      else if (instances > 1)
+        CGL_RUN (
+            data->commands,
+            glDrawElementsInstanced,
+            _A (topology_map[topology], indices->length, component_map[format],
+                NULL, instances),
+            "%s, %d, %s, %s, %d",
+            _A (topology_str_map[topology], indices->length, component_str_map[format],
+                "NULL", instances));
+      else
+        CGL_RUN (
+            data->commands,
+            glDrawElements,
+            _A (topology_map[topology], indices->length, component_map[format], NULL),
+            "%s, %d, %s, %s",
+            _A (topology_str_map[topology], indices->length, component_str_map[format],
+                "NULL"));
+
+      if (restart)
+        CGL_RUN (
+            data->commands,
+            glDisable, _A (GL_PRIMITIVE_RESTART),
+            "%s", _A ("GL_PRIMITIVE_RESTART"));
+
+      CGL_RUN (
+          data->commands,
+          glBindBuffer, _A (GL_ELEMENT_ARRAY_BUFFER, 0),
+          "%s, %d", _A ("GL_ELEMENT_ARRAY_BUFFER", 0));
+    }
+  else if (first_instance > 0)
+    CGL_RUN (
+        data->commands,
+        glDrawArraysInstancedBaseInstance,
+        _A (topology_map[topology], 0, max_length, instances, first_instance),
+        "%s, %d, %d, %d, %d", _A (topology_str_map[topology], 0, max_length, instances, first_instance));
+  else if (instances > 1)
+    CGL_RUN (
+        data->commands,
+        glDrawArraysInstanced, _A (topology_map[topology], 0, max_length, instances),
+        "%s, %d, %d, %d", _A (topology_str_map[topology], 0, max_length, instances));
+  else
+    CGL_RUN (
+        data->commands,
+        glDrawArrays, _A (topology_map[topology], 0, max_length),
+        "%s, %d, %d", _A (topology_str_map[topology], 0, max_length));
+
+  for (guint i = 0; i < n_buffers; i++)
+    {
+      CglBuffer *gl_buffer = NULL;
+
+      g_assert (buffers[i]->spec != NULL);
+
+      gl_buffer = (CglBuffer *)buffers[i];
+      CGL_RUN (
+          data->commands,
+          glBindBuffer, _A (GL_ARRAY_BUFFER, gl_buffer->vbo_id),
+          "%s, %d", _A ("GL_ARRAY_BUFFER", gl_buffer->vbo_id));
+
+      for (guint j = 0; j < buffers[i]->spec_length; j++)
+        {
+          ShaderLocation *attribute = NULL;
+
+          /* TODO: maybe prevent multiple lookups in same function */
+          attribute = g_hash_table_lookup (
+              gl_program->attribute_assoc,
+              buffers[i]->spec[j].name);
+          g_assert (attribute != NULL);
+
+          CGL_RUN (
+              data->commands,
+              glDisableVertexAttribArray, _A (attribute->location),
+              "%d", _A (attribute->location));
+        }
+    }
+
+  CGL_RUN (
+      data->commands,
+      glBindVertexArray, _A (0),
+      "%d", _A (0));
+
+  return TRUE;
+}
+
+static gboolean
+blit (GLuint framebuffer,
+      GLuint blit_read_fb,
+      GLuint blit_draw_fb,
+      CgPrivInstr *pass_instr,
+      CgPrivInstr *instr,
+      ProcessData *data)
+{
+  CglTexture *gl_texture = (CglTexture *)instr->blit.src;
+  GLenum status = 0;
+  int src[4] = { 0 };
+  int dst[4] = { 0 };
+  gboolean linear = FALSE;
+  GLenum attachment = GL_COLOR_ATTACHMENT0;
+  GLbitfield mask = GL_COLOR_BUFFER_BIT;
+  /* Only read when tracing */
+  G_GNUC_UNUSED const char *attachment_str = "GL_COLOR_ATTACHMENT0";
+  G_GNUC_UNUSED const char *mask_str = "GL_COLOR_BUFFER_BIT";
+
+  if (instr->blit.region_set)
+    {
+      src[0] = instr->blit.region[0];
+      src[1] = instr->blit.region[1];
+      src[2] = instr->blit.region[0] + instr->blit.region[2];
+      src[3] = instr->blit.region[1] + instr->blit.region[3];
+    }
+  else
+    {
+      src[2] = instr->blit.src->init.width;
+      src[3] = instr->blit.src->init.height;
+    }
+
+  dst[0] = pass_instr->pass.dest.val[0];
+  dst[1] = pass_instr->pass.dest.val[1];
+  dst[2] = pass_instr->pass.dest.val[0] + pass_instr->pass.dest.val[2];
+  dst[3] = pass_instr->pass.dest.val[1] + pass_instr->pass.dest.val[3];
+
+  /* Depth and multisampled sources only allow GL_NEAREST */
+  linear = instr->blit.linear
+           && instr->blit.src->init.format != CG_PRIV_FORMAT_DEPTH
+           && instr->blit.src->init.msaa == 0;
+
+  /* Stencil is copied along with depth when both
+   * sides have it, and silently skipped otherwise */
+  if (cg_priv_texture_has_stencil (instr->blit.src))
+    {
+      attachment = GL_DEPTH_STENCIL_ATTACHMENT;
+      attachment_str = "GL_DEPTH_STENCIL_ATTACHMENT";
+      mask = GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT;
+      mask_str = "GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT";
+    }
+  else if (instr->blit.src->init.format == CG_PRIV_FORMAT_DEPTH)
+    {
+      attachment = GL_DEPTH_ATTACHMENT;
+      attachment_str = "GL_DEPTH_ATTACHMENT";
+      mask = GL_DEPTH_BUFFER_BIT;
+      mask_str = "GL_DEPTH_BUFFER_BIT";
+    }
+
+  CGL_RUN (
+      data->commands,
+      glBindFramebuffer, _A (GL_FRAMEBUFFER, blit_read_fb),
+      "%s, %d", _A ("GL_FRAMEBUFFER", blit_read_fb));
+  CGL_RUN (
+      data->commands,
+      glFramebufferTexture2D,
+      _A (
+          GL_FRAMEBUFFER, attachment,
+          instr->blit.src->init.msaa > 0
+              ? GL_TEXTURE_2D_MULTISAMPLE
+              : GL_TEXTURE_2D,
+          gl_texture->id, 0),
+      "%s, %s, %s, %d, %d",
+      _A (
+          "GL_FRAMEBUFFER", attachment_str,
+          instr->blit.src->init.msaa > 0
+              ? "GL_TEXTURE_2D_MULTISAMPLE"
+              : "GL_TEXTURE_2D",
+          gl_texture->id, 0));
+
+  status = glCheckFramebufferStatus (GL_FRAMEBUFFER);
+  if (status != GL_FRAMEBUFFER_COMPLETE)
+    {
+      CGL_SET_ERROR (
+          data->error,
+          CG_ERROR_FAILED_TARGET_CREATION,
+          "Failed to complete framebuffer");
+      return FALSE;
+    }
+
+  CGL_RUN (
+      data->commands,
+      glBindFramebuffer, _A (GL_READ_FRAMEBUFFER, blit_read_fb),
+      "%s, %d", _A ("GL_READ_FRAMEBUFFER", blit_read_fb));
+  CGL_RUN (
+      data->commands,
+      glBindFramebuffer, _A (GL_DRAW_FRAMEBUFFER, framebuffer),
+      "%s, %d", _A ("GL_DRAW_FRAMEBUFFER", framebuffer));
+
+  CGL_RUN (
+      data->commands,
+      glBlitFramebuffer,
+      _A (
+          src[0], src[1], src[2], src[3],
+          dst[0], dst[1], dst[2], dst[3],
+          mask, linear ? GL_LINEAR : GL_NEAREST),
+      "%d, %d, %d, %d, %d, %d, %d, %d, %s, %s",
+      _A (
+          src[0], src[1], src[2], src[3],
+          dst[0], dst[1], dst[2], dst[3],
+          mask_str, linear ? "GL_LINEAR" : "GL_NEAREST"));
+
+  CGL_RUN (
+      data->commands,
+      glBindFramebuffer, _A (GL_READ_FRAMEBUFFER, 0),
+      "%s, %d", _A ("GL_READ_FRAMEBUFFER", 0));
+  CGL_RUN (
+      data->commands,
+      glBindFramebuffer, _A (GL_DRAW_FRAMEBUFFER, 0),
+      "%s, %d", _A ("GL_DRAW_FRAMEBUFFER", 0));
+
+  CGL_RUN (
+      data->commands,
+      glBindFramebuffer, _A (GL_FRAMEBUFFER, blit_read_fb),
+      "%s, %d", _A ("GL_FRAMEBUFFER", blit_read_fb));
+  CGL_RUN (
+      data->commands,
+      glFramebufferTexture2D,
+      _A (GL_FRAMEBUFFER, attachment, GL_TEXTURE_2D, 0, 0),
+      "%s, %s, %s, %d, %d",
+      _A ("GL_FRAMEBUFFER", attachment_str, "GL_TEXTURE_2D", 0, 0));
+
+  CGL_RUN (
+      data->commands,
+      glBindFramebuffer, _A (GL_FRAMEBUFFER, framebuffer),
+      "%s, %d", _A ("GL_FRAMEBUFFER", framebuffer));
+
+  return TRUE;
+}
+
+/* Every level is written in turn, reading the one before
+ * it. Without compute, each level is drawn into through
+ * the scratch framebuffer, and the state a draw depends
+ * on is put back for the rest of the group. */
+static gboolean
+build_depth_pyramid (GLuint framebuffer,
+                     GLuint scratch_fb,
+                     CgPrivInstr *pass_instr,
+                     CgPrivInstr *instr,
+                     ProcessData *data)
+{
+  CglGpu *gl_gpu = (CglGpu *)data->commands->gpu;
+  CgTexture *pyramid = instr->depth_pyramid.pyramid;
+  GLuint depth_id = ((CglTexture *)instr->depth_pyramid.depth)->id;
+  GLuint pyramid_id = ((CglTexture *)pyramid)->id;
+  GLint viewport[4] = { 0 };
+
+  CGL_RUN (
+      data->commands,
+      glUseProgram, _A (gl_gpu->depth_pyramid_program),
+      "%d", _A (gl_gpu->depth_pyramid_program));
+  CGL_RUN (
+      data->commands,
+      glUniform1i, _A (gl_gpu->depth_pyramid_src, 0),
+      "%d, %d", _A (gl_gpu->depth_pyramid_src, 0));
+  CGL_RUN (
+      data->commands,
+      glUniform1i, _A (gl_gpu->depth_pyramid_max_depth, instr->depth_pyramid.max_depth ? GL_TRUE : GL_FALSE),
+      "%d, %s", _A (gl_gpu->depth_pyramid_max_depth, instr->depth_pyramid.max_depth ? "GL_TRUE" : "GL_FALSE"));
+
+  if (!gl_gpu->compute)
+    {
+      /* The pass's own viewport is put back afterwards. Only
+       * one that was never set has to be asked for, which
+       * would otherwise stall on the driver. */
+      viewport[0] = pass_instr->pass.dest.val[0];
+      viewport[1] = pass_instr->pass.dest.val[1];
+      viewport[2] = pass_instr->pass.dest.val[2];
+      viewport[3] = pass_instr->pass.dest.val[3];
+      if (viewport[2] <= 0 || viewport[3] <= 0)
+        CGL_RUN (
+            data->commands,
+            glGetIntegerv, _A (GL_VIEWPORT, viewport),
+            "%s, %s", _A ("GL_VIEWPORT", CG_PRIV_ADDRESS));
+      CGL_RUN (
+          data->commands,
+          glBindFramebuffer, _A (GL_FRAMEBUFFER, scratch_fb),
+          "%s, %d", _A ("GL_FRAMEBUFFER", scratch_fb));
+      CGL_RUN (
+          data->commands,
+          glDrawBuffers, _A (1, gl_draw_buffer_enums),
+          "%d, %s", _A (1, CG_PRIV_ADDRESS));
+      CGL_RUN (
+          data->commands,
+          glDisable, _A (GL_DEPTH_TEST),
+          "%s", _A ("GL_DEPTH_TEST"));
+      CGL_RUN (
+          data->commands,
+          glDisable, _A (GL_BLEND),
+          "%s", _A ("GL_BLEND"));
+      CGL_RUN (
+          data->commands,
+          glDisable, _A (GL_CULL_FACE),
+          "%s", _A ("GL_CULL_FACE"));
+      CGL_RUN (
+          data->commands,
+          glColorMask, _A (GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE),
+          "%s, %s, %s, %s", _A ("GL_TRUE", "GL_TRUE", "GL_TRUE", "GL_TRUE"));
+      CGL_RUN (
+          data->commands,
+          glBindVertexArray, _A (gl_gpu->vao),
+          "%d", _A (gl_gpu->vao));
+    }
+
+  for (int level = 0; level < pyramid->init.mipmaps; level++)
+    {
+      int width = MAX (1, pyramid->init.width >> level);
+      int height = MAX (1, pyramid->init.height >> level);
+
+      if (level <= 1)
+        CGL_RUN (
+            data->commands,
+            glBindTexture, _A (GL_TEXTURE_2D, level == 0 ? depth_id : pyramid_id),
+            "%s, %d", _A ("GL_TEXTURE_2D", level == 0 ? depth_id : pyramid_id));
+      if (level >= 1)
+        {
+          CGL_RUN (
+              data->commands,
+              glTexParameteri, _A (GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, level - 1),
+              "%s, %s, %d", _A ("GL_TEXTURE_2D", "GL_TEXTURE_BASE_LEVEL", level - 1));
+          CGL_RUN (
+              data->commands,
+              glTexParameteri, _A (GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, level - 1),
+              "%s, %s, %d", _A ("GL_TEXTURE_2D", "GL_TEXTURE_MAX_LEVEL", level - 1));
+        }
+
+      if (gl_gpu->compute)
+        {
+          CGL_RUN (
+              data->commands,
+              glBindImageTexture, _A (0, pyramid_id, level, GL_FALSE, 0, GL_WRITE_ONLY, GL_R32F),
+              "%d, %d, %d, %s, %d, %s, %s",
+              _A (0, pyramid_id, level, "GL_FALSE", 0, "GL_WRITE_ONLY", "GL_R32F"));
+          CGL_RUN (
+              data->commands,
+              glDispatchCompute, _A ((width + 7) / 8, (height + 7) / 8, 1),
+              "%d, %d, %d", _A ((width + 7) / 8, (height + 7) / 8, 1));
+          CGL_RUN (
+              data->commands,
+              glMemoryBarrier, _A (GL_TEXTURE_FETCH_BARRIER_BIT),
+              "%s", _A ("GL_TEXTURE_FETCH_BARRIER_BIT"));
+        }
+      else
+        {
+          GLenum status = 0;
+
+          CGL_RUN (
+              data->commands,
+              glFramebufferTexture2D,
+              _A (GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, pyramid_id, level),
+              "%s, %s, %s, %d, %d",
+              _A ("GL_FRAMEBUFFER", "GL_COLOR_ATTACHMENT0", "GL_TEXTURE_2D", pyramid_id, level));
+
+          status = glCheckFramebufferStatus (GL_FRAMEBUFFER);
+          if (status != GL_FRAMEBUFFER_COMPLETE)
+            {
+              CGL_SET_ERROR (
+                  data->error,
+                  CG_ERROR_FAILED_TARGET_CREATION,
+                  "Failed to complete framebuffer");
+              return FALSE;
+            }
+
+          CGL_RUN (
+              data->commands,
+              glViewport, _A (0, 0, width, height),
+              "%d, %d, %d, %d", _A (0, 0, width, height));
+          CGL_RUN (
+              data->commands,
+              glUniform2i, _A (gl_gpu->depth_pyramid_dst_size, width, height),
+              "%d, %d, %d", _A (gl_gpu->depth_pyramid_dst_size, width, height));
+          CGL_RUN (
+              data->commands,
+              glDrawArrays, _A (GL_TRIANGLES, 0, 3),
+              "%s, %d, %d", _A ("GL_TRIANGLES", 0, 3));
+        }
+    }
+
+  if (pyramid->init.mipmaps > 1)
+    {
+      CGL_RUN (
+          data->commands,
+          glTexParameteri, _A (GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, 0),
+          "%s, %s, %d", _A ("GL_TEXTURE_2D", "GL_TEXTURE_BASE_LEVEL", 0));
+      CGL_RUN (
+          data->commands,
+          glTexParameteri, _A (GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 1000),
+          "%s, %s, %d", _A ("GL_TEXTURE_2D", "GL_TEXTURE_MAX_LEVEL", 1000));
+    }
+  CGL_RUN (
+      data->commands,
+      glBindTexture, _A (GL_TEXTURE_2D, 0),
+      "%s, %d", _A ("GL_TEXTURE_2D", 0));
+
+  if (gl_gpu->compute)
+    {
+      CGL_RUN (
+          data->commands,
+          glBindImageTexture, _A (0, 0, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_R32F),
+          "%d, %d, %d, %s, %d, %s, %s",
+          _A (0, 0, 0, "GL_FALSE", 0, "GL_WRITE_ONLY", "GL_R32F"));
+      /* Whatever comes next may read the pyramid any way */
+      CGL_RUN (
+          data->commands,
+          glMemoryBarrier, _A (GL_ALL_BARRIER_BITS),
+          "%s", _A ("GL_ALL_BARRIER_BITS"));
+    }
+  else
+    {
+      CGL_RUN (
+          data->commands,
+          glBindVertexArray, _A (0),
+          "%d", _A (0));
+      CGL_RUN (
+          data->commands,
+          glFramebufferTexture2D,
+          _A (GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, 0, 0),
+          "%s, %s, %s, %d, %d",
+          _A ("GL_FRAMEBUFFER", "GL_COLOR_ATTACHMENT0", "GL_TEXTURE_2D", 0, 0));
+      CGL_RUN (
+          data->commands,
+          glBindFramebuffer, _A (GL_FRAMEBUFFER, framebuffer),
+          "%s, %d", _A ("GL_FRAMEBUFFER", framebuffer));
+
+      CGL_RUN (
+          data->commands,
+          glViewport, _A (viewport[0], viewport[1], viewport[2], viewport[3]),
+          "%d, %d, %d, %d", _A (viewport[0], viewport[1], viewport[2], viewport[3]));
+      CGL_RUN (
+          data->commands,
+          glEnable, _A (GL_DEPTH_TEST),
+          "%s", _A ("GL_DEPTH_TEST"));
+      CGL_RUN (
+          data->commands,
+          glEnable, _A (GL_BLEND),
+          "%s", _A ("GL_BLEND"));
+      if (pass_instr->pass.backface_cull.val)
+        CGL_RUN (
+            data->commands,
+            glEnable, _A (GL_CULL_FACE),
+            "%s", _A ("GL_CULL_FACE"));
+      CGL_RUN (
+          data->commands,
+          glColorMask,
+          _A (
+              pass_instr->pass.write_mask.val & CG_WRITE_MASK_COLOR_RED ? GL_TRUE : GL_FALSE,
+              pass_instr->pass.write_mask.val & CG_WRITE_MASK_COLOR_GREEN ? GL_TRUE : GL_FALSE,
+              pass_instr->pass.write_mask.val & CG_WRITE_MASK_COLOR_BLUE ? GL_TRUE : GL_FALSE,
+              pass_instr->pass.write_mask.val & CG_WRITE_MASK_COLOR_ALPHA ? GL_TRUE : GL_FALSE),
+          "%s, %s, %s, %s",
+          _A (
+              pass_instr->pass.write_mask.val & CG_WRITE_MASK_COLOR_RED ? "GL_TRUE" : "GL_FALSE",
+              pass_instr->pass.write_mask.val & CG_WRITE_MASK_COLOR_GREEN ? "GL_TRUE" : "GL_FALSE",
+              pass_instr->pass.write_mask.val & CG_WRITE_MASK_COLOR_BLUE ? "GL_TRUE" : "GL_FALSE",
+              pass_instr->pass.write_mask.val & CG_WRITE_MASK_COLOR_ALPHA ? "GL_TRUE" : "GL_FALSE"));
+    }
+
+  CGL_RUN (
+      data->commands,
+      glUseProgram, _A (data->bound_program),
+      "%d", _A (data->bound_program));
+
+  return TRUE;
+}
+
+static gboolean
+process_instr_node (guint node,
+                    ProcessData *data)
+{
+  GArray *nodes = data->nodes;
+  CgPrivInstr *pass_instr = CG_PRIV_NODE_INSTR (nodes, node);
+  CgCommands *commands = data->commands;
+  CglGpu *gl_gpu = (CglGpu *)commands->gpu;
+  GLuint framebuffer = 0;
+  GLuint blit_read_fb = 0;
+  GLuint blit_draw_fb = 0;
+
+  g_assert (pass_instr->type == CG_PRIV_INSTR_PASS);
+
+  if (get_native_framebuffer (pass_instr, &framebuffer))
+    {
+      blit_read_fb = g_array_index (gl_gpu->framebuffer_stack, GLuint, pass_instr->depth + 0);
+      blit_draw_fb = g_array_index (gl_gpu->framebuffer_stack, GLuint, pass_instr->depth + 1);
+    }
+  else if (pass_instr->pass.targets->len == 0)
+    {
+      framebuffer = data->framebuffer;
+      blit_read_fb = g_array_index (gl_gpu->framebuffer_stack, GLuint, pass_instr->depth + 0);
+      blit_draw_fb = g_array_index (gl_gpu->framebuffer_stack, GLuint, pass_instr->depth + 1);
+    }
+  else
+    {
+      framebuffer = g_array_index (gl_gpu->framebuffer_stack, GLuint, pass_instr->depth + 0);
+      blit_read_fb = g_array_index (gl_gpu->framebuffer_stack, GLuint, pass_instr->depth + 1);
+      blit_draw_fb = g_array_index (gl_gpu->framebuffer_stack, GLuint, pass_instr->depth + 2);
+    }
+
+  if (pass_instr->pass.merge_parent)
+    {
+      if (!setup_or_teardown (
+              framebuffer, blit_read_fb, blit_draw_fb,
+              pass_instr, CG_PRIV_NODE_INSTR (nodes, CG_PRIV_NODE (nodes, node)->parent),
+              data, PASS_CONTINUE))
+        return FALSE;
+    }
+  else if (pass_instr->pass.merge_sibling)
+    {
+      if (!setup_or_teardown (
+              framebuffer, blit_read_fb, blit_draw_fb,
+              pass_instr, CG_PRIV_NODE_INSTR (nodes, CG_PRIV_NODE (nodes, node)->prev_sibling),
+              data, PASS_CONTINUE))
+        return FALSE;
+    }
+  else if (!setup_or_teardown (
+               framebuffer, blit_read_fb, blit_draw_fb,
+               pass_instr, NULL, data, PASS_SETUP))
+    return FALSE;
+
+  for (guint child = CG_PRIV_NODE (nodes, node)->first_child;
+       child != CG_PRIV_NO_NODE;
+       child = CG_PRIV_NODE (nodes, child)->next_sibling)
+    {
+      CgPrivInstr *instr = CG_PRIV_NODE_INSTR (nodes, child);
+      guint next = CG_PRIV_NODE (nodes, child)->next_sibling;
+
+      switch (instr->type)
+        {
+        case CG_PRIV_INSTR_PASS:
+          if (!process_instr_node (child, data))
+            return FALSE;
+          /* The next pass picks up where this one left off */
+          if (next != CG_PRIV_NO_NODE
+              && CG_PRIV_NODE_INSTR (nodes, next)->type == CG_PRIV_INSTR_PASS
+              && CG_PRIV_NODE_INSTR (nodes, next)->pass.merge_sibling)
+            break;
+          if (!setup_or_teardown (
+                  framebuffer, blit_read_fb, blit_draw_fb,
+                  pass_instr, instr, data, PASS_RESTORE))
+            return FALSE;
+          break;
+        case CG_PRIV_INSTR_VERTICES:
+          g_assert (pass_instr->pass.shader != NULL);
+          if (!draw_vertices (instr, pass_instr->pass.shader, data))
+            return FALSE;
+          break;
+        case CG_PRIV_INSTR_BLIT:
+          if (!blit (framebuffer, blit_read_fb,
+                     blit_draw_fb, pass_instr,
+                     instr, data))
+            return FALSE;
+          break;
+        case CG_PRIV_INSTR_DEPTH_PYRAMID:
+          if (!build_depth_pyramid (framebuffer, blit_read_fb,
+                                    pass_instr, instr, data))
+            return FALSE;
+          break;
+        default:
+          g_assert_not_reached ();
+        }
+    }
+
+  if (!setup_or_teardown (
+          framebuffer, blit_read_fb, blit_draw_fb,
+          pass_instr, NULL, data, PASS_TEARDOWN))
+    return FALSE;
+
+  return TRUE;
+}
+
+#undef CGL_RUN
+#undef process_instr_node
+#undef blit
+#undef build_depth_pyramid
+#undef draw_vertices
+#undef setup_or_teardown
+#undef CGL_DISPATCH_NAME
+#undef _CGL_DISPATCH_NAME
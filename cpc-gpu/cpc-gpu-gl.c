@@ -39,6 +39,29 @@
 #define CGL_ENTER_DESTROYED_OBJECTS(gpu) CG_PRIV_ENTER_BIT (gpu, CGL_DESTROYED_OBJECTS_LOCK_BIT)
 #define CGL_LEAVE_DESTROYED_OBJECTS(gpu) CG_PRIV_LEAVE_BIT (gpu, CGL_DESTROYED_OBJECTS_LOCK_BIT)
 
+/* These live in the share group rather than the gpu,
+ * as every member of the group contends for them */
+#define CGL_SHARE_GROUP_PROGRAMS_LOCK_BIT 0
+#define CGL_SHARE_GROUP_OBJECTS_LOCK_BIT 1
+#define CGL_ENTER_SHARE_GROUP_BIT(gpu, bit)                                    \
+  G_STMT_START                                                                 \
+  {                                                                            \
+    if (CG_PRIV_DEAL_WITH_THREADS (gpu))                                       \
+      g_bit_lock (&((CglGpu *)(gpu))->share_group->atomic_field, (bit));       \
+  }                                                                            \
+  G_STMT_END
+#define CGL_LEAVE_SHARE_GROUP_BIT(gpu, bit)                                    \
+  G_STMT_START                                                                 \
+  {                                                                            \
+    if (CG_PRIV_DEAL_WITH_THREADS (gpu))                                       \
+      g_bit_unlock (&((CglGpu *)(gpu))->share_group->atomic_field, (bit));     \
+  }                                                                            \
+  G_STMT_END
+#define CGL_ENTER_PROGRAMS(gpu) CGL_ENTER_SHARE_GROUP_BIT (gpu, CGL_SHARE_GROUP_PROGRAMS_LOCK_BIT)
+#define CGL_LEAVE_PROGRAMS(gpu) CGL_LEAVE_SHARE_GROUP_BIT (gpu, CGL_SHARE_GROUP_PROGRAMS_LOCK_BIT)
+#define CGL_ENTER_OBJECTS(gpu) CGL_ENTER_SHARE_GROUP_BIT (gpu, CGL_SHARE_GROUP_OBJECTS_LOCK_BIT)
+#define CGL_LEAVE_OBJECTS(gpu) CGL_LEAVE_SHARE_GROUP_BIT (gpu, CGL_SHARE_GROUP_OBJECTS_LOCK_BIT)
+
 typedef struct
 {
   char *name;
@@ -53,12 +76,15 @@ enum
   OBJECT_BUFFER,
   OBJECT_VERTEX_ARRAY,
   OBJECT_TEXTURE,
+  OBJECT_QUERY,
+  OBJECT_SYNC,
 };
 
 typedef struct
 {
   GLenum type;
   GLuint id;
+  GLsync sync;
 } DestroyedObject;
 
 typedef struct _CglGpu CglGpu;
@@ -67,6 +93,22 @@ typedef struct _CglShader CglShader;
 typedef struct _CglBuffer CglBuffer;
 typedef struct _CglTexture CglTexture;
 typedef struct _CglCommands CglCommands;
+typedef struct _CglTimer CglTimer;
+typedef struct _CglReadback CglReadback;
+typedef struct _CglProgram CglProgram;
+typedef struct _CglShareGroup CglShareGroup;
+
+/* State common to every gpu whose context
+ * shares objects with the others */
+struct _CglShareGroup
+{
+  gatomicrefcount refcount;
+  gint32 atomic_field;
+
+  /* Linked programs by source checksum, shared
+   * between shaders with identical sources */
+  GHashTable *programs;
+};
 
 struct _CglGpu
 {
@@ -75,9 +117,30 @@ struct _CglGpu
 
   int n_extensions;
   int max_texture_size;
+  gboolean spirv;
+  gboolean compute;
+  gboolean base_instance;
 
+  /* Container objects are never shared between
+   * contexts, so each gpu keeps its own */
+  GLuint vao;
   GArray *framebuffer_stack;
   GArray *destroyed_objects;
+
+  /* Pixel pack buffers of finished readbacks, kept for
+   * the next ones. Guarded by the destroyed objects lock,
+   * as readbacks can be released from any thread. */
+  GArray *readback_buffers;
+  GLuint readback_framebuffer;
+
+  /* Linked on first use by cg_plan_build_depth_pyramid (),
+   * as a compute shader if `compute' is set */
+  GLuint depth_pyramid_program;
+  GLint depth_pyramid_src;
+  GLint depth_pyramid_dst_size;
+  GLint depth_pyramid_max_depth;
+
+  CglShareGroup *share_group;
 };
 
 struct _CglPlan
@@ -86,12 +149,14 @@ struct _CglPlan
   gatomicrefcount refcount;
 };
 
-struct _CglShader
+/* Read-only once linked. The refcount is
+ * guarded by the programs lock. */
+struct _CglProgram
 {
-  CgShader base;
-  gatomicrefcount refcount;
+  guint refcount;
+  char *key;
 
-  GLuint program;
+  GLuint id;
 
   ShaderLocation *attributes;
   guint n_attributes;
@@ -103,14 +168,22 @@ struct _CglShader
   GHashTable *uniform_blocks;
 };
 
+struct _CglShader
+{
+  CgShader base;
+  gatomicrefcount refcount;
+
+  CglProgram *program;
+};
+
 struct _CglBuffer
 {
   CgBuffer base;
   gatomicrefcount refcount;
 
-  GLuint vao_id;
   GLuint vbo_id;
   GLuint ubo_id;
+  GLuint ebo_id;
 
   guint length;
   gboolean dynamic;
@@ -131,9 +204,42 @@ struct _CglCommands
   CgCommands base;
   gatomicrefcount refcount;
 
-  GNode *instrs;
+  GArray *nodes;
+
+  /* Whether any group renders into whatever
+   * framebuffer is bound at dispatch */
+  gboolean default_framebuffer;
+};
+
+/* A ring of GL_TIME_ELAPSED queries, so results can be
+ * read back a few frames later without stalling */
+struct _CglTimer
+{
+  GLuint *queries;
+  guint n_queries;
+  guint head;
+  guint n_pending;
+};
+
+/* A copy on its way into a pixel pack buffer */
+struct _CglReadback
+{
+  GLuint buffer;
+  gsize capacity;
+  gsize size;
+  GLsync sync;
 };
 
+typedef struct
+{
+  GLuint id;
+  gsize capacity;
+} ReadbackBuffer;
+
+/* Enough to keep a readback in flight for each
+ * frame the driver may queue ahead */
+#define CGL_READBACK_RING_SIZE 4
+
 static void
 _cgl_set_error (GError **error,
                 int code,
@@ -323,11 +429,48 @@ clear_destroyed_object (gpointer ptr)
     case OBJECT_TEXTURE:
       glDeleteTextures (1, &self->id);
       break;
+    case OBJECT_QUERY:
+      glDeleteQueries (1, &self->id);
+      break;
+    case OBJECT_SYNC:
+      glDeleteSync (self->sync);
+      break;
     default:
       g_assert_not_reached ();
     }
 }
 
+static CglShareGroup *
+share_group_new (void)
+{
+  CglShareGroup *group = NULL;
+
+  group = CG_PRIV_CREATE (group);
+  g_atomic_ref_count_init (&group->refcount);
+  group->programs = g_hash_table_new (g_str_hash, g_str_equal);
+
+  return group;
+}
+
+static CglShareGroup *
+share_group_ref (CglShareGroup *self)
+{
+  g_atomic_ref_count_inc (&self->refcount);
+  return self;
+}
+
+static void
+share_group_unref (CglShareGroup *self)
+{
+  if (g_atomic_ref_count_dec (&self->refcount))
+    {
+      /* Every program holds a shader, which holds a gpu */
+      g_assert (g_hash_table_size (self->programs) == 0);
+      g_hash_table_unref (self->programs);
+      g_free (self);
+    }
+}
+
 static CgGpu *
 gpu_new (guint32 flags,
          gpointer extra_data,
@@ -338,6 +481,8 @@ gpu_new (guint32 flags,
 #endif
   g_autoptr (CgGpu) gpu = NULL;
   CglGpu *gl_gpu = NULL;
+  GLint major_version = 0;
+  GLint minor_version = 0;
 
   gpu = (CgGpu *)CG_PRIV_CREATE (gl_gpu);
   gpu->impl = &cg_gl_impl;
@@ -359,6 +504,24 @@ gpu_new (guint32 flags,
   glGetIntegerv (GL_MAX_TEXTURE_SIZE, &gl_gpu->max_texture_size);
   g_debug ("GL: The max texture size is %d", gl_gpu->max_texture_size);
 
+  for (int i = 0; i < gl_gpu->n_extensions; i++)
+    {
+      const char *extension = (const char *)glGetStringi (GL_EXTENSIONS, i);
+
+      if (g_strcmp0 (extension, "GL_ARB_gl_spirv") == 0)
+        gl_gpu->spirv = TRUE;
+      else if (g_strcmp0 (extension, "GL_ARB_base_instance") == 0)
+        gl_gpu->base_instance = TRUE;
+    }
+  g_debug ("GL: SPIR-V shaders are %s", gl_gpu->spirv ? "supported" : "unsupported");
+
+  glGetIntegerv (GL_MAJOR_VERSION, &major_version);
+  glGetIntegerv (GL_MINOR_VERSION, &minor_version);
+  gl_gpu->compute = major_version > 4 || (major_version == 4 && minor_version >= 3);
+  g_debug ("GL: Compute shaders are %s", gl_gpu->compute ? "supported" : "unsupported");
+  gl_gpu->base_instance |= major_version > 4 || (major_version == 4 && minor_version >= 2);
+  g_debug ("GL: Base instance draws are %s", gl_gpu->base_instance ? "supported" : "emulated");
+
   if (flags & CG_INIT_FLAG_USE_DEBUG_LAYERS)
     {
       glDebugMessageCallback (debug_cb, 0);
@@ -375,10 +538,23 @@ gpu_new (guint32 flags,
   glFrontFace (GL_CCW);
   glEnable (GL_CULL_FACE);
   glEnable (GL_MULTISAMPLE);
+  glEnable (GL_PROGRAM_POINT_SIZE);
 
   gl_gpu->framebuffer_stack = g_array_new (FALSE, TRUE, sizeof (GLuint));
+  gl_gpu->share_group = share_group_new ();
   gl_gpu->destroyed_objects = g_array_new (FALSE, TRUE, sizeof (DestroyedObject));
   g_array_set_clear_func (gl_gpu->destroyed_objects, clear_destroyed_object);
+  gl_gpu->readback_buffers = g_array_new (FALSE, TRUE, sizeof (ReadbackBuffer));
+
+  /* Attributes are specified on every draw, so one
+   * vertex array object serves every buffer */
+  glGenVertexArrays (1, &gl_gpu->vao);
+  if (gl_gpu->vao == 0)
+    {
+      CGL_SET_ERROR (error, CG_ERROR_FAILED_INIT,
+                     "Failed to generate vertex array object");
+      return NULL;
+    }
 
   return g_steal_pointer (&gpu);
 }
@@ -398,10 +574,27 @@ clear_gpu (CgGpu *self)
   CglGpu *gl_gpu = (CglGpu *)self;
 
   /* TODO could be the wrong thread? */
-  glDeleteFramebuffers (gl_gpu->framebuffer_stack->len,
-                        (GLuint *)(gpointer)gl_gpu->framebuffer_stack->data);
+  /* gpu_new () may have failed before creating these */
+  if (gl_gpu->framebuffer_stack != NULL)
+    glDeleteFramebuffers (gl_gpu->framebuffer_stack->len,
+                          (GLuint *)(gpointer)gl_gpu->framebuffer_stack->data);
   g_clear_pointer (&gl_gpu->framebuffer_stack, g_array_unref);
+  if (gl_gpu->vao > 0)
+    glDeleteVertexArrays (1, &gl_gpu->vao);
+  if (gl_gpu->readback_framebuffer > 0)
+    glDeleteFramebuffers (1, &gl_gpu->readback_framebuffer);
+  if (gl_gpu->depth_pyramid_program > 0)
+    glDeleteProgram (gl_gpu->depth_pyramid_program);
+  for (guint i = 0; gl_gpu->readback_buffers != NULL && i < gl_gpu->readback_buffers->len; i++)
+    glDeleteBuffers (1, &g_array_index (gl_gpu->readback_buffers, ReadbackBuffer, i).id);
+  g_clear_pointer (&gl_gpu->readback_buffers, g_array_unref);
   g_clear_pointer (&gl_gpu->destroyed_objects, g_array_unref);
+  g_clear_pointer (&gl_gpu->share_group, share_group_unref);
+
+#ifdef USE_EGL
+  /* Last, as everything above needs the context */
+  g_clear_pointer (&self->headless, cg_priv_egl_headless_free);
+#endif
 }
 
 static void
@@ -416,6 +609,20 @@ gpu_unref (CgGpu *self)
     }
 }
 
+static gboolean
+gpu_share (CgGpu *self,
+           CgGpu *share,
+           GError **error)
+{
+  CglGpu *gl_gpu = (CglGpu *)self;
+  CglGpu *gl_share = (CglGpu *)share;
+
+  g_clear_pointer (&gl_gpu->share_group, share_group_unref);
+  gl_gpu->share_group = share_group_ref (gl_share->share_group);
+
+  return TRUE;
+}
+
 static const struct
 {
   const char *k;
@@ -480,33 +687,51 @@ clear_plan (CgPlan *self)
 static void
 init_shader (CgShader *self)
 {
-  CglShader *gl_shader = (CglShader *)self;
+}
+
+static void
+program_free (CgGpu *gpu,
+              CglProgram *program)
+{
+  DESTROY_GL_OBJECT_ON_FLUSH (gpu, program->id, OBJECT_SHADER);
+
+  if (program->uniforms != NULL)
+    for (guint i = 0; i < program->n_uniforms; i++)
+      g_clear_pointer (&program->uniforms[i].name, g_free);
+  g_clear_pointer (&program->uniforms, g_free);
+
+  if (program->attributes != NULL)
+    for (guint i = 0; i < program->n_attributes; i++)
+      g_clear_pointer (&program->attributes[i].name, g_free);
+  g_clear_pointer (&program->attributes, g_free);
+
+  g_clear_pointer (&program->uniform_assoc, g_hash_table_unref);
+  g_clear_pointer (&program->uniform_blocks, g_hash_table_unref);
+  g_clear_pointer (&program->attribute_assoc, g_hash_table_unref);
 
-  gl_shader->uniform_assoc = g_hash_table_new (g_str_hash, g_str_equal);
-  gl_shader->uniform_blocks = g_hash_table_new (g_direct_hash, g_direct_equal);
-  gl_shader->attribute_assoc = g_hash_table_new (g_str_hash, g_str_equal);
+  g_free (program->key);
+  g_free (program);
 }
 
 static void
 clear_shader (CgShader *self)
 {
   CglShader *gl_shader = (CglShader *)self;
+  CglProgram *program = g_steal_pointer (&gl_shader->program);
 
-  DESTROY_GL_OBJECT_ON_FLUSH (self->gpu, gl_shader->program, OBJECT_SHADER);
-
-  if (gl_shader->uniforms != NULL)
-    for (guint i = 0; i < gl_shader->n_uniforms; i++)
-      g_clear_pointer (&gl_shader->uniforms[i].name, g_free);
-  g_clear_pointer (&gl_shader->uniforms, g_free);
+  if (program != NULL)
+    {
+      gboolean last = FALSE;
 
-  if (gl_shader->attributes != NULL)
-    for (guint i = 0; i < gl_shader->n_attributes; i++)
-      g_clear_pointer (&gl_shader->attributes[i].name, g_free);
-  g_clear_pointer (&gl_shader->attributes, g_free);
+      CGL_ENTER_PROGRAMS (self->gpu);
+      last = --program->refcount == 0;
+      if (last)
+        g_hash_table_remove (((CglGpu *)self->gpu)->share_group->programs, program->key);
+      CGL_LEAVE_PROGRAMS (self->gpu);
 
-  g_clear_pointer (&gl_shader->uniform_assoc, g_hash_table_unref);
-  g_clear_pointer (&gl_shader->uniform_blocks, g_hash_table_unref);
-  g_clear_pointer (&gl_shader->attribute_assoc, g_hash_table_unref);
+      if (last)
+        program_free (self->gpu, program);
+    }
 
   cg_priv_shader_finish (self);
 }
@@ -523,7 +748,7 @@ clear_buffer (CgBuffer *self)
 
   DESTROY_GL_OBJECT_ON_FLUSH (self->gpu, gl_buffer->vbo_id, OBJECT_BUFFER);
   DESTROY_GL_OBJECT_ON_FLUSH (self->gpu, gl_buffer->ubo_id, OBJECT_BUFFER);
-  DESTROY_GL_OBJECT_ON_FLUSH (self->gpu, gl_buffer->vao_id, OBJECT_VERTEX_ARRAY);
+  DESTROY_GL_OBJECT_ON_FLUSH (self->gpu, gl_buffer->ebo_id, OBJECT_BUFFER);
 
   cg_priv_buffer_finish (self);
 }
@@ -538,14 +763,179 @@ clear_texture (CgTexture *self)
 {
   CglTexture *gl_texture = (CglTexture *)self;
 
-  DESTROY_GL_OBJECT_ON_FLUSH (self->gpu, gl_texture->id, OBJECT_TEXTURE);
+  if (!self->init.native)
+    DESTROY_GL_OBJECT_ON_FLUSH (self->gpu, gl_texture->id, OBJECT_TEXTURE);
   g_clear_pointer (&gl_texture->non_msaa, cg_texture_unref);
 
   cg_priv_texture_finish (self);
 }
 
+static void
+timer_free (CgGpu *self,
+            gpointer timer)
+{
+  CglTimer *gl_timer = timer;
+
+  for (guint i = 0; i < gl_timer->n_queries; i++)
+    DESTROY_GL_OBJECT_ON_FLUSH (self, gl_timer->queries[i], OBJECT_QUERY);
+
+  g_free (gl_timer->queries);
+  g_free (gl_timer);
+}
+
+static gpointer
+timer_new (CgGpu *self,
+           guint n_queries,
+           GError **error)
+{
+  CglTimer *timer = NULL;
+  GLint bits = 0;
+
+  glGetQueryiv (GL_TIME_ELAPSED, GL_QUERY_COUNTER_BITS, &bits);
+  if (bits == 0)
+    {
+      CGL_SET_ERROR (
+          error, CG_ERROR_NOT_SUPPORTED,
+          "Timer queries are not supported");
+      return NULL;
+    }
+
+  timer = CG_PRIV_CREATE (timer);
+  timer->queries = g_new0 (GLuint, n_queries);
+  timer->n_queries = n_queries;
+
+  glGenQueries (n_queries, timer->queries);
+  for (guint i = 0; i < n_queries; i++)
+    {
+      if (timer->queries[i] == 0)
+        {
+          CGL_SET_ERROR (
+              error, CG_ERROR_NOT_SUPPORTED,
+              "Failed to generate timer queries");
+          timer_free (self, timer);
+          return NULL;
+        }
+    }
+
+  return timer;
+}
+
+static gboolean
+timer_begin (CgGpu *self,
+             gpointer timer)
+{
+  CglTimer *gl_timer = timer;
+
+  /* Every query is still in flight, skip this one */
+  if (gl_timer->n_pending == gl_timer->n_queries)
+    return FALSE;
+
+  glBeginQuery (GL_TIME_ELAPSED, gl_timer->queries[gl_timer->head]);
+  return TRUE;
+}
+
+static void
+timer_end (CgGpu *self,
+           gpointer timer)
+{
+  CglTimer *gl_timer = timer;
+
+  glEndQuery (GL_TIME_ELAPSED);
+  gl_timer->head = (gl_timer->head + 1) % gl_timer->n_queries;
+  gl_timer->n_pending++;
+}
+
+static gboolean
+timer_collect (CgGpu *self,
+               gpointer timer,
+               guint64 *nanoseconds)
+{
+  CglTimer *gl_timer = timer;
+  GLuint query = 0;
+  GLint available = GL_FALSE;
+  GLuint64 result = 0;
+
+  if (gl_timer->n_pending == 0)
+    return FALSE;
+
+  query = gl_timer->queries[(gl_timer->head + gl_timer->n_queries - gl_timer->n_pending) % gl_timer->n_queries];
+
+  glGetQueryObjectiv (query, GL_QUERY_RESULT_AVAILABLE, &available);
+  if (available == GL_FALSE)
+    return FALSE;
+
+  glGetQueryObjectui64v (query, GL_QUERY_RESULT, &result);
+  gl_timer->n_pending--;
+
+  *nanoseconds = result;
+  return TRUE;
+}
+
 #undef DESTROY_GL_OBJECT_ON_FLUSH
 
+static gpointer
+fence_new (CgGpu *self,
+           GError **error)
+{
+  GLsync sync = NULL;
+
+  sync = glFenceSync (GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  if (sync == NULL)
+    {
+      CGL_SET_ERROR (
+          error, CG_ERROR_NOT_SUPPORTED,
+          "Failed to create sync object");
+      return NULL;
+    }
+
+  /* Other contexts can only wait on
+   * a fence that has been submitted */
+  glFlush ();
+
+  return sync;
+}
+
+static void
+fence_free (CgGpu *self,
+            gpointer fence)
+{
+  DestroyedObject object = { 0 };
+
+  object.type = OBJECT_SYNC;
+  object.sync = fence;
+
+  CGL_ENTER_DESTROYED_OBJECTS (self);
+  g_array_append_val (((CglGpu *)self)->destroyed_objects, object);
+  CGL_LEAVE_DESTROYED_OBJECTS (self);
+}
+
+static void
+fence_wait (CgGpu *self,
+            gpointer fence)
+{
+  glWaitSync (fence, 0, GL_TIMEOUT_IGNORED);
+}
+
+static gboolean
+fence_client_wait (CgGpu *self,
+                   gpointer fence,
+                   guint64 timeout,
+                   GError **error)
+{
+  GLenum status = 0;
+
+  status = glClientWaitSync (fence, GL_SYNC_FLUSH_COMMANDS_BIT, timeout);
+  if (status == GL_WAIT_FAILED)
+    {
+      CGL_SET_ERROR (
+          error, CG_ERROR_NOT_SUPPORTED,
+          "Failed to wait on sync object");
+      return FALSE;
+    }
+
+  return status == GL_ALREADY_SIGNALED || status == GL_CONDITION_SATISFIED;
+}
+
 static void
 init_commands (CgCommands *self)
 {
@@ -556,7 +946,7 @@ clear_commands (CgCommands *self)
 {
   CglCommands *gl_commands = (CglCommands *)self;
 
-  g_clear_pointer (&gl_commands->instrs, cg_priv_destroy_instr_node);
+  g_clear_pointer (&gl_commands->nodes, g_array_unref);
   cg_priv_commands_finish (self);
 }
 
@@ -597,16 +987,12 @@ DEFINE_BASIC_OBJECT (commands, CglCommands, CgCommands)
 #undef DEFINE_BASIC_OBJECT
 
 static guint
-compile_shader (const char *code,
-                int type,
-                GError **error)
+check_compiled_shader (guint shader,
+                       int type,
+                       GError **error)
 {
-  guint shader = 0;
   GLint success = 0;
 
-  shader = glCreateShader (type);
-  glShaderSource (shader, 1, &code, NULL);
-  glCompileShader (shader);
   glGetShaderiv (shader, GL_COMPILE_STATUS, &success);
 
   if (success != GL_TRUE)
@@ -644,17 +1030,96 @@ compile_shader (const char *code,
           "Failed to generate %s shader: GL: %s",
           type_string, error_string);
 
+      glDeleteShader (shader);
       return 0;
     }
 
   return shader;
 }
 
-static gboolean
-ensure_shader (CgShader *self,
-               GError **error)
+static guint
+compile_shader (const char *code,
+                int type,
+                GError **error)
 {
-  CglShader *gl_shader = (CglShader *)self;
+  guint shader = 0;
+
+  shader = glCreateShader (type);
+  glShaderSource (shader, 1, &code, NULL);
+  glCompileShader (shader);
+
+  return check_compiled_shader (shader, type, error);
+}
+
+static guint
+specialize_shader (CgShader *self,
+                   GBytes *spirv,
+                   int type,
+                   GError **error)
+{
+  guint shader = 0;
+  gsize size = 0;
+  gconstpointer data = NULL;
+
+  data = g_bytes_get_data (spirv, &size);
+
+  shader = glCreateShader (type);
+  glShaderBinary (1, &shader, GL_SHADER_BINARY_FORMAT_SPIR_V_ARB, data, size);
+  glSpecializeShaderARB (
+      shader, self->init.entry_point,
+      self->init.n_constants,
+      self->init.constant_ids,
+      self->init.constant_values);
+
+  return check_compiled_shader (shader, type, error);
+}
+
+static char *
+compute_program_key (CgShader *self)
+{
+  g_autoptr (GChecksum) checksum = NULL;
+
+  checksum = g_checksum_new (G_CHECKSUM_SHA256);
+
+  /* Lengths keep the boundaries between inputs unambiguous */
+#define UPDATE_CHECKSUM(data, size)                                       \
+  G_STMT_START                                                            \
+  {                                                                       \
+    guint64 _size = (size);                                               \
+    g_checksum_update (checksum, (const guchar *)&_size, sizeof (_size)); \
+    g_checksum_update (checksum, (const guchar *)(data), _size);          \
+  }                                                                       \
+  G_STMT_END
+
+  if (self->init.vertex_spirv != NULL)
+    {
+      gsize size = 0;
+      gconstpointer data = NULL;
+
+      data = g_bytes_get_data (self->init.vertex_spirv, &size);
+      UPDATE_CHECKSUM (data, size);
+      data = g_bytes_get_data (self->init.fragment_spirv, &size);
+      UPDATE_CHECKSUM (data, size);
+      UPDATE_CHECKSUM (self->init.entry_point, strlen (self->init.entry_point));
+      UPDATE_CHECKSUM (self->init.constant_ids, self->init.n_constants * sizeof (guint));
+      UPDATE_CHECKSUM (self->init.constant_values, self->init.n_constants * sizeof (guint));
+    }
+  else
+    {
+      UPDATE_CHECKSUM (self->init.vertex_code, strlen (self->init.vertex_code));
+      UPDATE_CHECKSUM (self->init.fragment_code, strlen (self->init.fragment_code));
+    }
+
+#undef UPDATE_CHECKSUM
+
+  return g_strdup (g_checksum_get_string (checksum));
+}
+
+static CglProgram *
+link_program (CgShader *self,
+              GError **error)
+{
+  CglProgram *linked = NULL;
   guint vertex_id = 0;
   guint fragment_id = 0;
   guint program = 0;
@@ -664,17 +1129,35 @@ ensure_shader (CgShader *self,
   GLint n_uniforms = 0;
   g_autoptr (GArray) uniforms = NULL;
 
-  if (gl_shader->program > 0) return TRUE;
+  if (self->init.vertex_spirv != NULL)
+    {
+      if (!((CglGpu *)self->gpu)->spirv)
+        {
+          CGL_SET_ERROR (
+              error, CG_ERROR_NOT_SUPPORTED,
+              "SPIR-V shaders require GL_ARB_gl_spirv");
+          return NULL;
+        }
 
-  vertex_id = compile_shader (self->init.vertex_code, GL_VERTEX_SHADER, error);
-  if (vertex_id == 0)
-    return FALSE;
+      vertex_id = specialize_shader (self, self->init.vertex_spirv, GL_VERTEX_SHADER, error);
+      if (vertex_id == 0)
+        return NULL;
+
+      fragment_id = specialize_shader (self, self->init.fragment_spirv, GL_FRAGMENT_SHADER, error);
+    }
+  else
+    {
+      vertex_id = compile_shader (self->init.vertex_code, GL_VERTEX_SHADER, error);
+      if (vertex_id == 0)
+        return NULL;
+
+      fragment_id = compile_shader (self->init.fragment_code, GL_FRAGMENT_SHADER, error);
+    }
 
-  fragment_id = compile_shader (self->init.fragment_code, GL_FRAGMENT_SHADER, error);
   if (fragment_id == 0)
     {
       glDeleteShader (vertex_id);
-      return FALSE;
+      return NULL;
     }
 
   program = glCreateProgram ();
@@ -707,15 +1190,20 @@ ensure_shader (CgShader *self,
           error_string);
 
       glDeleteProgram (program);
-      return FALSE;
+      return NULL;
     }
 
-  gl_shader->program = program;
+  linked = g_new0 (CglProgram, 1);
+  linked->refcount = 1;
+  linked->id = program;
+  linked->uniform_assoc = g_hash_table_new (g_str_hash, g_str_equal);
+  linked->uniform_blocks = g_hash_table_new (g_direct_hash, g_direct_equal);
+  linked->attribute_assoc = g_hash_table_new (g_str_hash, g_str_equal);
 
   /* --- Attributes --- */
   glGetProgramiv (program, GL_ACTIVE_ATTRIBUTES, &n_attributes);
-  gl_shader->attributes = g_malloc0_n (n_attributes, sizeof (ShaderLocation));
-  gl_shader->n_attributes = n_attributes;
+  linked->attributes = g_malloc0_n (n_attributes, sizeof (ShaderLocation));
+  linked->n_attributes = n_attributes;
 
   for (int i = 0; i < n_attributes; i++)
     {
@@ -729,15 +1217,15 @@ ensure_shader (CgShader *self,
       name[namelen] = '\0';
 
       /* TODO make this more memory-efficient */
-      gl_shader->attributes[i].name = g_strdup (name);
-      gl_shader->attributes[i].location = i;
-      gl_shader->attributes[i].num = num;
-      gl_shader->attributes[i].type = type;
+      linked->attributes[i].name = g_strdup (name);
+      linked->attributes[i].location = i;
+      linked->attributes[i].num = num;
+      linked->attributes[i].type = type;
 
       g_hash_table_replace (
-          gl_shader->attribute_assoc,
-          gl_shader->attributes[i].name,
-          gl_shader->attributes + i);
+          linked->attribute_assoc,
+          linked->attributes[i].name,
+          linked->attributes + i);
     }
 
   /* --- Uniforms --- */
@@ -772,15 +1260,15 @@ ensure_shader (CgShader *self,
 
       /* Map the uniform name to its corresponding location + 1. */
       g_hash_table_replace (
-          gl_shader->uniform_assoc,
+          linked->uniform_assoc,
           uniform.name,
           GUINT_TO_POINTER (uniforms->len));
 
       location += num;
     }
 
-  gl_shader->n_uniforms = uniforms->len;
-  gl_shader->uniforms = (ShaderLocation *)(gpointer)g_array_free (g_steal_pointer (&uniforms), FALSE);
+  linked->n_uniforms = uniforms->len;
+  linked->uniforms = (ShaderLocation *)(gpointer)g_array_free (g_steal_pointer (&uniforms), FALSE);
 
   /* --- Uniform Blocks --- */
   glGetProgramiv (program, GL_ACTIVE_UNIFORM_BLOCKS, &n_uniform_blocks);
@@ -799,11 +1287,46 @@ ensure_shader (CgShader *self,
       /* Map the uniform location to its corresponding block + 1. */
       for (int j = 0; j < n_block_uniforms; j++)
         g_hash_table_replace (
-            gl_shader->uniform_blocks,
-            GINT_TO_POINTER (gl_shader->uniforms[block_uniforms[j]].location),
+            linked->uniform_blocks,
+            GINT_TO_POINTER (linked->uniforms[block_uniforms[j]].location),
             GINT_TO_POINTER (i + 1));
     }
 
+  return linked;
+}
+
+static gboolean
+ensure_shader (CgShader *self,
+               GError **error)
+{
+  CglShader *gl_shader = (CglShader *)self;
+  CglGpu *gl_gpu = (CglGpu *)self->gpu;
+  g_autofree char *key = NULL;
+  CglProgram *program = NULL;
+
+  if (gl_shader->program != NULL) return TRUE;
+
+  key = compute_program_key (self);
+
+  CGL_ENTER_PROGRAMS (self->gpu);
+  program = g_hash_table_lookup (gl_gpu->share_group->programs, key);
+  if (program != NULL)
+    program->refcount++;
+  CGL_LEAVE_PROGRAMS (self->gpu);
+
+  if (program == NULL)
+    {
+      program = link_program (self, error);
+      if (program == NULL)
+        return FALSE;
+      program->key = g_steal_pointer (&key);
+
+      CGL_ENTER_PROGRAMS (self->gpu);
+      g_hash_table_replace (gl_gpu->share_group->programs, program->key, program);
+      CGL_LEAVE_PROGRAMS (self->gpu);
+    }
+
+  gl_shader->program = program;
   return TRUE;
 }
 
@@ -814,14 +1337,21 @@ ensure_buffer (CgBuffer *self,
   CglBuffer *gl_buffer = (CglBuffer *)self;
   guint ubo_id = 0;
 
-  if (gl_buffer->vao_id > 0)
+  if (gl_buffer->vbo_id > 0)
     {
       CGL_CRITICAL_USER_ERROR (
           "Buffer previously initialized as a vertex buffer "
           "erroneously being used as a uniform buffer");
       return FALSE;
     }
-  if (gl_buffer->vbo_id > 0)
+  if (self->index_format != 0)
+    {
+      CGL_CRITICAL_USER_ERROR (
+          "Index buffer erroneously being used "
+          "as a uniform buffer");
+      return FALSE;
+    }
+  if (gl_buffer->ubo_id > 0)
     return TRUE;
 
   glGenBuffers (1, &ubo_id);
@@ -838,7 +1368,6 @@ ensure_buffer (CgBuffer *self,
                 self->init.data, GL_STATIC_DRAW);
   glBindBuffer (GL_UNIFORM_BUFFER, 0);
 
-  gl_buffer->vao_id = 0;
   gl_buffer->vbo_id = 0;
   gl_buffer->ubo_id = ubo_id;
   gl_buffer->length = 0;
@@ -852,7 +1381,6 @@ ensure_vertices (CgBuffer *self,
                  GError **error)
 {
   CglBuffer *gl_buffer = (CglBuffer *)self;
-  guint vao_id = 0;
   guint vbo_id = 0;
 
   if (gl_buffer->ubo_id > 0)
@@ -862,10 +1390,16 @@ ensure_vertices (CgBuffer *self,
           "erroneously being used as a vertex buffer");
       return FALSE;
     }
-  if (gl_buffer->vao_id > 0 && gl_buffer->vbo_id > 0)
+  if (gl_buffer->vbo_id > 0)
     return TRUE;
-  g_assert (gl_buffer->vao_id == 0 && gl_buffer->vbo_id == 0);
 
+  if (self->index_format != 0)
+    {
+      CGL_CRITICAL_USER_ERROR (
+          "Index buffer erroneously being used "
+          "as a vertex buffer");
+      return FALSE;
+    }
   if (self->spec == NULL)
     {
       CGL_CRITICAL_USER_ERROR (
@@ -874,22 +1408,12 @@ ensure_vertices (CgBuffer *self,
       return FALSE;
     }
 
-  glGenVertexArrays (1, &vao_id);
-  if (vao_id == 0)
+  glGenBuffers (1, &vbo_id);
+  if (vbo_id == 0)
     {
       CGL_SET_ERROR (
           error, CG_ERROR_FAILED_BUFFER_GEN,
-          "Failed to generate vertex array object");
-      return FALSE;
-    }
-
-  glGenBuffers (1, &vbo_id);
-  if (vbo_id == 0)
-    {
-      CGL_SET_ERROR (
-          error, CG_ERROR_FAILED_BUFFER_GEN,
-          "Failed to generate vertex buffer object");
-      glDeleteVertexArrays (1, &vao_id);
+          "Failed to generate vertex buffer object");
       return FALSE;
     }
 
@@ -899,7 +1423,6 @@ ensure_vertices (CgBuffer *self,
                 self->init.data, GL_STATIC_DRAW);
   glBindBuffer (GL_ARRAY_BUFFER, 0);
 
-  gl_buffer->vao_id = vao_id;
   gl_buffer->vbo_id = vbo_id;
   gl_buffer->ubo_id = 0;
   gl_buffer->length = self->init.size;
@@ -908,6 +1431,63 @@ ensure_vertices (CgBuffer *self,
   return TRUE;
 }
 
+static inline gsize
+get_index_size (int format)
+{
+  switch (format)
+    {
+    case CG_COMPONENT_UINT8:
+      return 1;
+    case CG_COMPONENT_UINT16:
+      return 2;
+    case CG_COMPONENT_UINT32:
+      return 4;
+    default:
+      g_assert_not_reached ();
+    }
+}
+
+static gboolean
+ensure_indices (CgBuffer *self,
+                GError **error)
+{
+  CglBuffer *gl_buffer = (CglBuffer *)self;
+  guint ebo_id = 0;
+
+  if (self->index_format == 0)
+    {
+      CGL_CRITICAL_USER_ERROR (
+          "Buffer needs an index format "
+          "to be used as indices");
+      return FALSE;
+    }
+  if (gl_buffer->ebo_id > 0)
+    return TRUE;
+
+  glGenBuffers (1, &ebo_id);
+  if (ebo_id == 0)
+    {
+      CGL_SET_ERROR (
+          error, CG_ERROR_FAILED_BUFFER_GEN,
+          "Failed to generate index buffer object");
+      return FALSE;
+    }
+
+  /* Element array bindings belong to the vertex array
+   * object, so upload through a neutral target and
+   * attach to the VAO at draw time. */
+  glBindBuffer (GL_COPY_WRITE_BUFFER, ebo_id);
+  glBufferData (GL_COPY_WRITE_BUFFER, self->init.size,
+                self->init.data, GL_STATIC_DRAW);
+  glBindBuffer (GL_COPY_WRITE_BUFFER, 0);
+
+  gl_buffer->ebo_id = ebo_id;
+  gl_buffer->length = self->init.size / get_index_size (self->index_format);
+  gl_buffer->dynamic = FALSE;
+
+  return TRUE;
+}
+
 static inline gsize
 get_image_size (int width,
                 int height,
@@ -945,6 +1525,88 @@ get_image_size (int width,
   return bytes_per_pixel * width * height;
 }
 
+static void
+get_texture_format (int format,
+                    GLuint *gl_internal,
+                    GLuint *gl_format,
+                    GLuint *gl_type)
+{
+  switch (format)
+    {
+    case CG_FORMAT_R8:
+      *gl_internal = GL_R8;
+      *gl_format = GL_RED;
+      *gl_type = GL_UNSIGNED_BYTE;
+      break;
+    case CG_FORMAT_RA8:
+      *gl_internal = GL_RG8;
+      *gl_format = GL_RG;
+      *gl_type = GL_UNSIGNED_BYTE;
+      break;
+    case CG_FORMAT_RGB8:
+      *gl_internal = GL_RGB8;
+      *gl_format = GL_RGB;
+      *gl_type = GL_UNSIGNED_BYTE;
+      break;
+    case CG_FORMAT_RGBA8:
+      *gl_internal = GL_RGBA8;
+      *gl_format = GL_RGBA;
+      *gl_type = GL_UNSIGNED_BYTE;
+      break;
+    case CG_FORMAT_R32:
+      *gl_internal = GL_R32F;
+      *gl_format = GL_RED;
+      *gl_type = GL_FLOAT;
+      break;
+    case CG_FORMAT_RGB32:
+      *gl_internal = GL_RGB32F;
+      *gl_format = GL_RGB;
+      *gl_type = GL_FLOAT;
+      break;
+    case CG_FORMAT_RGBA32:
+      *gl_internal = GL_RGBA32F;
+      *gl_format = GL_RGBA;
+      *gl_type = GL_FLOAT;
+      break;
+    default:
+      g_assert_not_reached ();
+    }
+}
+
+static void
+get_depth_format (int format,
+                  GLuint *gl_internal,
+                  GLuint *gl_format,
+                  GLuint *gl_type)
+{
+  switch (format)
+    {
+    case CG_DEPTH_FORMAT_0:
+      /* Unsized, the driver picks the precision */
+      *gl_internal = GL_DEPTH_COMPONENT;
+      *gl_format = GL_DEPTH_COMPONENT;
+      *gl_type = GL_FLOAT;
+      break;
+    case CG_DEPTH_FORMAT_D16:
+      *gl_internal = GL_DEPTH_COMPONENT16;
+      *gl_format = GL_DEPTH_COMPONENT;
+      *gl_type = GL_UNSIGNED_SHORT;
+      break;
+    case CG_DEPTH_FORMAT_D24S8:
+      *gl_internal = GL_DEPTH24_STENCIL8;
+      *gl_format = GL_DEPTH_STENCIL;
+      *gl_type = GL_UNSIGNED_INT_24_8;
+      break;
+    case CG_DEPTH_FORMAT_D32F:
+      *gl_internal = GL_DEPTH_COMPONENT32F;
+      *gl_format = GL_DEPTH_COMPONENT;
+      *gl_type = GL_FLOAT;
+      break;
+    default:
+      g_assert_not_reached ();
+    }
+}
+
 static gboolean
 ensure_texture (CgTexture *self,
                 GError **error)
@@ -958,6 +1620,14 @@ ensure_texture (CgTexture *self,
   if (gl_texture->id > 0)
     return TRUE;
 
+  if (self->init.native)
+    {
+      /* Framebuffers are bound by name at dispatch */
+      if (!self->init.native_framebuffer)
+        gl_texture->id = self->init.native_handle;
+      return TRUE;
+    }
+
   glGenTextures (1, &gl_texture->id);
   if (gl_texture->id == 0)
     {
@@ -969,6 +1639,8 @@ ensure_texture (CgTexture *self,
 
   if (self->init.format == CG_PRIV_FORMAT_DEPTH)
     {
+      get_depth_format (self->init.depth_format, &gl_internal, &gl_format, &gl_type);
+
       glBindTexture (
           self->init.msaa > 0
               ? GL_TEXTURE_2D_MULTISAMPLE
@@ -978,13 +1650,20 @@ ensure_texture (CgTexture *self,
       if (self->init.msaa > 0)
         glTexImage2DMultisample (
             GL_TEXTURE_2D_MULTISAMPLE, self->init.msaa,
-            GL_DEPTH_COMPONENT, self->init.width,
+            gl_internal, self->init.width,
             self->init.height, GL_TRUE);
       else
-        glTexImage2D (
-            GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT,
-            self->init.width, self->init.height,
-            0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
+        {
+          glTexImage2D (
+              GL_TEXTURE_2D, 0, gl_internal,
+              self->init.width, self->init.height,
+              0, gl_format, gl_type, NULL);
+
+          /* The default minification filter wants
+           * mipmaps, without which sampling fails */
+          glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+          glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        }
 
       glBindTexture (
           self->init.msaa > 0
@@ -995,46 +1674,7 @@ ensure_texture (CgTexture *self,
       return TRUE;
     }
 
-  switch (self->init.format)
-    {
-    case CG_FORMAT_R8:
-      gl_internal = GL_R8;
-      gl_format = GL_RED;
-      gl_type = GL_UNSIGNED_BYTE;
-      break;
-    case CG_FORMAT_RA8:
-      gl_internal = GL_RG8;
-      gl_format = GL_RG;
-      gl_type = GL_UNSIGNED_BYTE;
-      break;
-    case CG_FORMAT_RGB8:
-      gl_internal = GL_RGB8;
-      gl_format = GL_RGB;
-      gl_type = GL_UNSIGNED_BYTE;
-      break;
-    case CG_FORMAT_RGBA8:
-      gl_internal = GL_RGBA8;
-      gl_format = GL_RGBA;
-      gl_type = GL_UNSIGNED_BYTE;
-      break;
-    case CG_FORMAT_R32:
-      gl_internal = GL_R32F;
-      gl_format = GL_RED;
-      gl_type = GL_FLOAT;
-      break;
-    case CG_FORMAT_RGB32:
-      gl_internal = GL_RGB32F;
-      gl_format = GL_RGB;
-      gl_type = GL_FLOAT;
-      break;
-    case CG_FORMAT_RGBA32:
-      gl_internal = GL_RGBA32F;
-      gl_format = GL_RGBA;
-      gl_type = GL_FLOAT;
-      break;
-    default:
-      g_assert_not_reached ();
-    }
+  get_texture_format (self->init.format, &gl_internal, &gl_format, &gl_type);
 
   image_size = get_image_size (
       self->init.width, self->init.height, self->init.format);
@@ -1120,6 +1760,342 @@ ensure_texture (CgTexture *self,
   return TRUE;
 }
 
+/* For use outside of compiling a plan */
+static gboolean
+ensure_texture_locked (CgTexture *self,
+                       GError **error)
+{
+  gboolean success = FALSE;
+
+  CGL_ENTER_OBJECTS (self->gpu);
+  success = ensure_texture (self, error);
+  CGL_LEAVE_OBJECTS (self->gpu);
+
+  return success;
+}
+
+static gboolean
+texture_update (CgTexture *self,
+                int x,
+                int y,
+                int width,
+                int height,
+                gconstpointer data,
+                GError **error)
+{
+  CglTexture *gl_texture = (CglTexture *)self;
+  GLuint gl_internal = 0;
+  GLuint gl_format = 0;
+  GLuint gl_type = 0;
+
+  if (!ensure_texture_locked (self, error))
+    return FALSE;
+
+  get_texture_format (self->init.format, &gl_internal, &gl_format, &gl_type);
+
+  glBindTexture (GL_TEXTURE_2D, gl_texture->id);
+  /* Rows of the source data are tightly packed */
+  glPixelStorei (GL_UNPACK_ALIGNMENT, 1);
+  glTexSubImage2D (
+      GL_TEXTURE_2D, 0, x, y, width, height,
+      gl_format, gl_type, data);
+  glPixelStorei (GL_UNPACK_ALIGNMENT, 4);
+  glBindTexture (GL_TEXTURE_2D, 0);
+
+  return TRUE;
+}
+
+static gboolean
+texture_download (CgTexture *self,
+                  gpointer data,
+                  gsize size,
+                  GError **error)
+{
+  CglTexture *gl_texture = (CglTexture *)self;
+  GLuint gl_internal = 0;
+  GLuint gl_format = 0;
+  GLuint gl_type = 0;
+
+  if (size < get_image_size (self->init.width, self->init.height, self->init.format))
+    {
+      CGL_SET_ERROR (
+          error, CG_ERROR_FAILED_TEXTURE_GEN,
+          "Destination of %zu bytes is too small for texture contents",
+          size);
+      return FALSE;
+    }
+
+  if (!ensure_texture_locked (self, error))
+    return FALSE;
+
+  get_texture_format (self->init.format, &gl_internal, &gl_format, &gl_type);
+
+  glBindTexture (GL_TEXTURE_2D, gl_texture->id);
+  glPixelStorei (GL_PACK_ALIGNMENT, 1);
+  glGetTexImage (GL_TEXTURE_2D, 0, gl_format, gl_type, data);
+  glPixelStorei (GL_PACK_ALIGNMENT, 4);
+  glBindTexture (GL_TEXTURE_2D, 0);
+
+  return TRUE;
+}
+
+static void
+readback_free (CgGpu *self,
+               gpointer readback)
+{
+  CglGpu *gl_gpu = (CglGpu *)self;
+  CglReadback *gl_readback = readback;
+  DestroyedObject object = { 0 };
+  ReadbackBuffer buffer = { 0 };
+
+  buffer.id = gl_readback->buffer;
+  buffer.capacity = gl_readback->capacity;
+
+  object.type = OBJECT_SYNC;
+  object.sync = gl_readback->sync;
+
+  CGL_ENTER_DESTROYED_OBJECTS (self);
+  if (gl_gpu->readback_buffers->len < CGL_READBACK_RING_SIZE)
+    g_array_append_val (gl_gpu->readback_buffers, buffer);
+  else
+    {
+      DestroyedObject buffer_object = { 0 };
+
+      buffer_object.type = OBJECT_BUFFER;
+      buffer_object.id = buffer.id;
+      g_array_append_val (gl_gpu->destroyed_objects, buffer_object);
+    }
+  if (object.sync != NULL)
+    g_array_append_val (gl_gpu->destroyed_objects, object);
+  CGL_LEAVE_DESTROYED_OBJECTS (self);
+
+  g_free (gl_readback);
+}
+
+/* The copy goes into a pixel pack buffer, so
+ * glReadPixels returns without waiting for the
+ * GPU. Format conversion happens on the way. */
+static gpointer
+readback_new (CgTexture *self,
+              int x,
+              int y,
+              int width,
+              int height,
+              int format,
+              GError **error)
+{
+  CglGpu *gl_gpu = (CglGpu *)self->gpu;
+  CglTexture *gl_texture = (CglTexture *)self;
+  CglReadback *readback = NULL;
+  GLuint gl_internal = 0;
+  GLuint gl_format = 0;
+  GLuint gl_type = 0;
+  GLint previous_framebuffer = 0;
+
+  if (!ensure_texture_locked (self, error))
+    return NULL;
+
+  if (gl_gpu->readback_framebuffer == 0)
+    {
+      glGenFramebuffers (1, &gl_gpu->readback_framebuffer);
+      if (gl_gpu->readback_framebuffer == 0)
+        {
+          CGL_SET_ERROR (
+              error, CG_ERROR_FAILED_TARGET_CREATION,
+              "Failed to generate framebuffer");
+          return NULL;
+        }
+    }
+
+  readback = CG_PRIV_CREATE (readback);
+  readback->size = get_image_size (width, height, format);
+
+  /* Prefer a buffer which is already large enough */
+  CGL_ENTER_DESTROYED_OBJECTS (self->gpu);
+  if (gl_gpu->readback_buffers->len > 0)
+    {
+      guint pick = gl_gpu->readback_buffers->len - 1;
+
+      for (guint i = 0; i < gl_gpu->readback_buffers->len; i++)
+        {
+          if (g_array_index (gl_gpu->readback_buffers, ReadbackBuffer, i).capacity >= readback->size)
+            {
+              pick = i;
+              break;
+            }
+        }
+
+      readback->buffer = g_array_index (gl_gpu->readback_buffers, ReadbackBuffer, pick).id;
+      readback->capacity = g_array_index (gl_gpu->readback_buffers, ReadbackBuffer, pick).capacity;
+      g_array_remove_index_fast (gl_gpu->readback_buffers, pick);
+    }
+  CGL_LEAVE_DESTROYED_OBJECTS (self->gpu);
+
+  if (readback->buffer == 0)
+    {
+      glGenBuffers (1, &readback->buffer);
+      if (readback->buffer == 0)
+        {
+          CGL_SET_ERROR (
+              error, CG_ERROR_FAILED_BUFFER_GEN,
+              "Failed to generate pixel pack buffer");
+          g_free (readback);
+          return NULL;
+        }
+    }
+
+  glBindBuffer (GL_PIXEL_PACK_BUFFER, readback->buffer);
+  if (readback->capacity < readback->size)
+    {
+      glBufferData (GL_PIXEL_PACK_BUFFER, readback->size, NULL, GL_STREAM_READ);
+      readback->capacity = readback->size;
+    }
+
+  get_texture_format (format, &gl_internal, &gl_format, &gl_type);
+
+  glGetIntegerv (GL_READ_FRAMEBUFFER_BINDING, &previous_framebuffer);
+  glBindFramebuffer (GL_READ_FRAMEBUFFER, gl_gpu->readback_framebuffer);
+  glFramebufferTexture2D (
+      GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+      GL_TEXTURE_2D, gl_texture->id, 0);
+  glReadBuffer (GL_COLOR_ATTACHMENT0);
+
+  glPixelStorei (GL_PACK_ALIGNMENT, 1);
+  glReadPixels (x, y, width, height, gl_format, gl_type, NULL);
+  glPixelStorei (GL_PACK_ALIGNMENT, 4);
+
+  /* Detach, so the texture can be deleted while
+   * the framebuffer waits for the next readback */
+  glFramebufferTexture2D (
+      GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+      GL_TEXTURE_2D, 0, 0);
+  glBindFramebuffer (GL_READ_FRAMEBUFFER, previous_framebuffer);
+  glBindBuffer (GL_PIXEL_PACK_BUFFER, 0);
+
+  readback->sync = glFenceSync (GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  if (readback->sync == NULL)
+    {
+      CGL_SET_ERROR (
+          error, CG_ERROR_NOT_SUPPORTED,
+          "Failed to create sync object");
+      readback_free (self->gpu, readback);
+      return NULL;
+    }
+
+  return readback;
+}
+
+static gboolean
+readback_wait (CgGpu *self,
+               gpointer readback,
+               guint64 timeout,
+               GError **error)
+{
+  CglReadback *gl_readback = readback;
+
+  return fence_client_wait (self, gl_readback->sync, timeout, error);
+}
+
+static gboolean
+readback_read (CgGpu *self,
+               gpointer readback,
+               gpointer data,
+               GError **error)
+{
+  CglReadback *gl_readback = readback;
+  gpointer mapped = NULL;
+
+  glBindBuffer (GL_PIXEL_PACK_BUFFER, gl_readback->buffer);
+  mapped = glMapBufferRange (GL_PIXEL_PACK_BUFFER, 0, gl_readback->size, GL_MAP_READ_BIT);
+  if (mapped == NULL)
+    {
+      glBindBuffer (GL_PIXEL_PACK_BUFFER, 0);
+      CGL_SET_ERROR (
+          error, CG_ERROR_FAILED_TEXTURE_GEN,
+          "Failed to map pixel pack buffer");
+      return FALSE;
+    }
+
+  memcpy (data, mapped, gl_readback->size);
+  glUnmapBuffer (GL_PIXEL_PACK_BUFFER);
+  glBindBuffer (GL_PIXEL_PACK_BUFFER, 0);
+
+  return TRUE;
+}
+
+static gboolean
+texture_import_dmabuf (CgTexture *self,
+                       const CgDmabuf *dmabuf,
+                       GError **error)
+{
+#ifdef USE_EGL
+  CglTexture *gl_texture = (CglTexture *)self;
+  gboolean success = FALSE;
+
+  glGenTextures (1, &gl_texture->id);
+  if (gl_texture->id == 0)
+    {
+      CGL_SET_ERROR (
+          error, CG_ERROR_FAILED_TEXTURE_GEN,
+          "Failed to generate texture");
+      return FALSE;
+    }
+
+  glBindTexture (GL_TEXTURE_2D, gl_texture->id);
+  success = cg_priv_egl_bind_dmabuf (dmabuf, error);
+  if (success)
+    {
+      glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+      glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+      glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+      glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    }
+  glBindTexture (GL_TEXTURE_2D, 0);
+
+  if (!success)
+    {
+      glDeleteTextures (1, &gl_texture->id);
+      gl_texture->id = 0;
+    }
+
+  return success;
+#else
+  CGL_SET_ERROR (
+      error, CG_ERROR_NOT_SUPPORTED,
+      "DMA-BUF import requires building with EGL");
+  return FALSE;
+#endif
+}
+
+static gboolean
+texture_export_dmabuf (CgTexture *self,
+                       CgDmabuf *dmabuf,
+                       GError **error)
+{
+#ifdef USE_EGL
+  CglTexture *gl_texture = (CglTexture *)self;
+
+  if (!ensure_texture_locked (self, error))
+    return FALSE;
+
+  /* Queued rendering must reach the kernel before the
+   * buffer changes hands for implicit sync to see it */
+  glFlush ();
+
+  if (!cg_priv_egl_export_texture (gl_texture->id, dmabuf, error))
+    return FALSE;
+
+  dmabuf->width = self->init.width;
+  dmabuf->height = self->init.height;
+  return TRUE;
+#else
+  CGL_SET_ERROR (
+      error, CG_ERROR_NOT_SUPPORTED,
+      "DMA-BUF export requires building with EGL");
+  return FALSE;
+#endif
+}
+
 typedef struct
 {
   CgCommands *commands;
@@ -1130,7 +2106,7 @@ typedef struct
 typedef struct
 {
   EnsureData *ensure_data;
-  GNode *start_node;
+  CgShader *shader;
 } ValidateUniformData;
 
 static const GLenum type_to_uniform_map[][3] = {
@@ -1156,130 +2132,119 @@ test_uniform_validity (
     const CgValue *value,
     ValidateUniformData *data)
 {
-  GNode *node = data->start_node;
+  guint index = 0;
+  CglProgram *gl_program = NULL;
+  ShaderLocation *location = NULL;
+  gboolean match = FALSE;
+
+  /* Frontend API should have verified that a shader was present. */
+  g_assert (data->shader != NULL);
+  gl_program = ((CglShader *)data->shader)->program;
+
+  index = GPOINTER_TO_UINT (g_hash_table_lookup (
+      gl_program->uniform_assoc, name));
+
+  if (index == 0)
+    {
+      CGL_SET_ERROR (
+          data->ensure_data->error, CG_ERROR_FAILED_SHADER_UNIFORM_SET,
+          "Uniform \"%s\" does not exist in shader",
+          name);
+      return TRUE;
+    }
+
+  location = &gl_program->uniforms[index - 1];
+
+  for (guint i = 0; i < G_N_ELEMENTS (type_to_uniform_map[value->type]); i++)
+    {
+      if (type_to_uniform_map[value->type][i] == location->type)
+        {
+          match = TRUE;
+          break;
+        }
+    }
 
-  do
+  if (match)
     {
-      CgPrivInstr *instr = node->data;
-
-      if (instr->pass.shader != NULL)
+      if (value->type == CG_TYPE_TEXTURE)
         {
-          guint index = 0;
-          CglShader *gl_shader = NULL;
-          ShaderLocation *location = NULL;
-          gboolean match = FALSE;
-
-          gl_shader = (CglShader *)instr->pass.shader;
-
-          index = GPOINTER_TO_UINT (g_hash_table_lookup (
-              gl_shader->uniform_assoc, name));
+          if (!ensure_texture (value->texture, data->ensure_data->error))
+            return TRUE;
 
-          if (index == 0)
+          if (value->texture->init.msaa > 0)
             {
-              CGL_SET_ERROR (
-                  data->ensure_data->error, CG_ERROR_FAILED_SHADER_UNIFORM_SET,
-                  "Uniform \"%s\" does not exist in shader",
-                  name);
-              return TRUE;
-            }
+              CglTexture *gl_texture = (CglTexture *)value->texture;
 
-          location = &gl_shader->uniforms[index - 1];
-
-          for (guint i = 0; i < G_N_ELEMENTS (type_to_uniform_map[value->type]); i++)
-            {
-              if (type_to_uniform_map[value->type][i] == location->type)
+              /* We must create a temporary texture to use as a uniform
+               * since msaa textures cannot be used in this way.
+               */
+              if (gl_texture->non_msaa == NULL)
                 {
-                  match = TRUE;
-                  break;
+                  gl_texture->non_msaa = texture_new (value->texture->gpu);
+                  gl_texture->non_msaa->gpu = cg_gpu_ref (value->texture->gpu);
+                  gl_texture->non_msaa->init.msaa = 0;
+                  gl_texture->non_msaa->init.cubemap = value->texture->init.cubemap;
+                  gl_texture->non_msaa->init.data = NULL;
+                  gl_texture->non_msaa->init.width = value->texture->init.width;
+                  gl_texture->non_msaa->init.height = value->texture->init.height;
+                  gl_texture->non_msaa->init.format = value->texture->init.format;
+                  gl_texture->non_msaa->init.depth_format = value->texture->init.depth_format;
+                  gl_texture->non_msaa->init.mipmaps = value->texture->init.mipmaps;
+
+                  if (!ensure_texture (gl_texture->non_msaa, data->ensure_data->error))
+                    return TRUE;
                 }
             }
+        }
+      else if (value->type == CG_TYPE_BUFFER
+               && !ensure_buffer (value->buffer, data->ensure_data->error))
+        return TRUE;
 
-          if (match)
-            {
-              if (value->type == CG_TYPE_TEXTURE)
-                {
-                  if (!ensure_texture (value->texture, data->ensure_data->error))
-                    return TRUE;
+      return FALSE;
+    }
+  else
+    {
+      int correct_type = CG_TYPE_0;
 
-                  if (value->texture->init.msaa > 0)
-                    {
-                      CglTexture *gl_texture = (CglTexture *)value->texture;
-
-                      /* We must create a temporary texture to use as a uniform
-                       * since msaa textures cannot be used in this way.
-                       */
-                      if (gl_texture->non_msaa == NULL)
-                        {
-                          gl_texture->non_msaa = texture_new (value->texture->gpu);
-                          gl_texture->non_msaa->gpu = cg_gpu_ref (value->texture->gpu);
-                          gl_texture->non_msaa->init.msaa = 0;
-                          gl_texture->non_msaa->init.cubemap = value->texture->init.cubemap;
-                          gl_texture->non_msaa->init.data = NULL;
-                          gl_texture->non_msaa->init.width = value->texture->init.width;
-                          gl_texture->non_msaa->init.height = value->texture->init.height;
-                          gl_texture->non_msaa->init.format = value->texture->init.format;
-                          gl_texture->non_msaa->init.mipmaps = value->texture->init.mipmaps;
-
-                          if (!ensure_texture (gl_texture->non_msaa, data->ensure_data->error))
-                            return TRUE;
-                        }
-                    }
-                }
-              else if (value->type == CG_TYPE_BUFFER
-                       && !ensure_buffer (value->buffer, data->ensure_data->error))
-                return TRUE;
+      for (int i = CG_TYPE_0 + 1; i < CG_N_TYPES; i++)
+        {
+          gboolean breakout = FALSE;
 
-              return FALSE;
-            }
-          else
+          for (int j = 0; j < G_N_ELEMENTS (type_to_uniform_map[i]); j++)
             {
-              int correct_type = CG_TYPE_0;
-
-              for (int i = CG_TYPE_0 + 1; i < CG_N_TYPES; i++)
+              if (location->type == type_to_uniform_map[i][j])
                 {
-                  gboolean breakout = FALSE;
-
-                  for (int j = 0; j < G_N_ELEMENTS (type_to_uniform_map[i]); j++)
-                    {
-                      if (location->type == type_to_uniform_map[i][j])
-                        {
-                          correct_type = i;
-                          breakout = TRUE;
-                          break;
-                        }
-                    }
-
-                  if (breakout) break;
+                  correct_type = i;
+                  breakout = TRUE;
+                  break;
                 }
-
-              if (correct_type == CG_TYPE_0)
-                CGL_SET_ERROR (
-                    data->ensure_data->error, CG_ERROR_FAILED_SHADER_UNIFORM_SET,
-                    "The type of uniform \"%s\" is not currently supported.",
-                    name);
-              else
-                CGL_SET_ERROR (
-                    data->ensure_data->error, CG_ERROR_FAILED_SHADER_UNIFORM_SET,
-                    "Submitted value type does not match shader type for uniform "
-                    "\"%s\": expected %s, got %s",
-                    name,
-                    cg_priv_get_type_name (correct_type),
-                    cg_priv_get_type_name (value->type));
-
-              return TRUE;
             }
+
+          if (breakout) break;
         }
-    }
-  while ((node = node->parent) != NULL);
 
-  /* Frontend API should have verified that a shader was present. */
-  g_assert_not_reached ();
+      if (correct_type == CG_TYPE_0)
+        CGL_SET_ERROR (
+            data->ensure_data->error, CG_ERROR_FAILED_SHADER_UNIFORM_SET,
+            "The type of uniform \"%s\" is not currently supported.",
+            name);
+      else
+        CGL_SET_ERROR (
+            data->ensure_data->error, CG_ERROR_FAILED_SHADER_UNIFORM_SET,
+            "Submitted value type does not match shader type for uniform "
+            "\"%s\": expected %s, got %s",
+            name,
+            cg_priv_get_type_name (correct_type),
+            cg_priv_get_type_name (value->type));
+
+      return TRUE;
+    }
 }
 
 typedef struct
 {
   EnsureData *ensure_data;
-  GNode *start_node;
+  CgShader *shader;
 } ValidateAttributesData;
 
 static gboolean
@@ -1288,44 +2253,142 @@ test_attribute_validity (
     gconstpointer value,
     ValidateAttributesData *data)
 {
-  GNode *node = data->start_node;
+  CglProgram *gl_program = NULL;
+  ShaderLocation *attribute = NULL;
 
-  do
+  g_assert (data->shader != NULL);
+  gl_program = ((CglShader *)data->shader)->program;
+
+  attribute = g_hash_table_lookup (
+      gl_program->attribute_assoc, name);
+
+  if (attribute != NULL)
+    return FALSE;
+  else
     {
-      CgPrivInstr *instr = node->data;
+      CGL_SET_ERROR (
+          data->ensure_data->error, CG_ERROR_FAILED_SHADER_UNIFORM_SET,
+          "Attribute \"%s\" does not exist in shader",
+          name);
+      return TRUE;
+    }
+}
 
-      if (instr->pass.shader != NULL)
-        {
-          CglShader *gl_shader = NULL;
-          ShaderLocation *attribute = NULL;
+/* Every texel of the destination covers a window of the
+ * source, widened to three texels across where the source
+ * size is odd. The source is the depth texture for level 0
+ * and the previous level otherwise, limited to that level
+ * by GL_TEXTURE_BASE_LEVEL so rendering into the next one
+ * is no feedback loop. */
+#define DEPTH_PYRAMID_REDUCE                                          \
+  "uniform sampler2D src;\n"                                          \
+  "uniform bool max_depth;\n"                                         \
+  "float reduce_depth(ivec2 p, ivec2 dst_size) {\n"                   \
+  "  ivec2 src_size = textureSize(src, 0);\n"                         \
+  "  ivec2 lo = p * src_size / dst_size;\n"                           \
+  "  ivec2 hi = max(lo, ((p + 1) * src_size + dst_size - 1) / dst_size - 1);\n" \
+  "  float d = texelFetch(src, lo, 0).r;\n"                           \
+  "  for (int y = lo.y; y <= hi.y; y++)\n"                            \
+  "    for (int x = lo.x; x <= hi.x; x++) {\n"                        \
+  "      float s = texelFetch(src, ivec2(x, y), 0).r;\n"              \
+  "      d = max_depth ? max(d, s) : min(d, s);\n"                    \
+  "    }\n"                                                           \
+  "  return d;\n"                                                     \
+  "}\n"
+
+static const char *depth_pyramid_compute_code =
+    "#version 430\n"
+    "layout(local_size_x = 8, local_size_y = 8) in;\n"
+    "layout(r32f, binding = 0) writeonly uniform image2D dst;\n"
+    DEPTH_PYRAMID_REDUCE
+    "void main() {\n"
+    "  ivec2 p = ivec2(gl_GlobalInvocationID.xy);\n"
+    "  ivec2 dst_size = imageSize(dst);\n"
+    "  if (any(greaterThanEqual(p, dst_size))) return;\n"
+    "  imageStore(dst, p, vec4(reduce_depth(p, dst_size)));\n"
+    "}\n";
+
+static const char *depth_pyramid_vertex_code =
+    "#version 330\n"
+    "void main() {\n"
+    "  vec2 p = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2);\n"
+    "  gl_Position = vec4(p * 2.0 - 1.0, 0.0, 1.0);\n"
+    "}\n";
+
+static const char *depth_pyramid_fragment_code =
+    "#version 330\n"
+    "uniform ivec2 dst_size;\n"
+    "out float depth;\n"
+    DEPTH_PYRAMID_REDUCE
+    "void main() {\n"
+    "  depth = reduce_depth(ivec2(gl_FragCoord.xy), dst_size);\n"
+    "}\n";
+
+#undef DEPTH_PYRAMID_REDUCE
+
+static gboolean
+ensure_depth_pyramid_program (CglGpu *self,
+                              GError **error)
+{
+  guint shaders[2] = { 0 };
+  guint n_shaders = 0;
+  guint program = 0;
+  GLint link_success = 0;
 
-          gl_shader = (CglShader *)instr->pass.shader;
+  if (self->depth_pyramid_program > 0)
+    return TRUE;
 
-          attribute = g_hash_table_lookup (
-              gl_shader->attribute_assoc, name);
+  if (self->compute)
+    {
+      shaders[n_shaders] = compile_shader (depth_pyramid_compute_code, GL_COMPUTE_SHADER, error);
+      if (shaders[n_shaders++] == 0)
+        return FALSE;
+    }
+  else
+    {
+      shaders[n_shaders] = compile_shader (depth_pyramid_vertex_code, GL_VERTEX_SHADER, error);
+      if (shaders[n_shaders++] == 0)
+        return FALSE;
 
-          if (attribute != NULL)
-            return FALSE;
-          else
-            {
-              CGL_SET_ERROR (
-                  data->ensure_data->error, CG_ERROR_FAILED_SHADER_UNIFORM_SET,
-                  "Attribute \"%s\" does not exist in shader",
-                  name);
-              return TRUE;
-            }
+      shaders[n_shaders] = compile_shader (depth_pyramid_fragment_code, GL_FRAGMENT_SHADER, error);
+      if (shaders[n_shaders++] == 0)
+        {
+          glDeleteShader (shaders[0]);
+          return FALSE;
         }
     }
-  while ((node = node->parent) != NULL);
 
-  g_assert_not_reached ();
+  program = glCreateProgram ();
+  for (guint i = 0; i < n_shaders; i++)
+    glAttachShader (program, shaders[i]);
+  glLinkProgram (program);
+  for (guint i = 0; i < n_shaders; i++)
+    glDeleteShader (shaders[i]);
+
+  glGetProgramiv (program, GL_LINK_STATUS, &link_success);
+  if (link_success != GL_TRUE)
+    {
+      CGL_SET_ERROR (
+          error, CG_ERROR_FAILED_SHADER_GEN,
+          "Failed to link the depth pyramid shader");
+      glDeleteProgram (program);
+      return FALSE;
+    }
+
+  self->depth_pyramid_program = program;
+  self->depth_pyramid_src = glGetUniformLocation (program, "src");
+  self->depth_pyramid_dst_size = glGetUniformLocation (program, "dst_size");
+  self->depth_pyramid_max_depth = glGetUniformLocation (program, "max_depth");
+
+  return TRUE;
 }
 
 static gboolean
-ensure_instr_node (GNode *node,
+ensure_instr_node (GArray *nodes,
+                   guint node,
                    EnsureData *data)
 {
-  CgPrivInstr *instr = node->data;
+  CgPrivInstr *instr = CG_PRIV_NODE_INSTR (nodes, node);
 
   switch (instr->type)
     {
@@ -1354,6 +2417,16 @@ ensure_instr_node (GNode *node,
             CgPrivTarget *target = NULL;
 
             target = &g_array_index (instr->pass.targets, CgPrivTarget, i);
+            if (target->texture->init.native_framebuffer
+                && instr->pass.targets->len > 1)
+              {
+                CGL_SET_ERROR (
+                    data->error, CG_ERROR_FAILED_TARGET_CREATION,
+                    "A wrapped framebuffer must be the only target of a group");
+                data->failure = TRUE;
+                return TRUE;
+              }
+
             success = ensure_texture (target->texture, data->error);
             if (!success)
               {
@@ -1363,7 +2436,7 @@ ensure_instr_node (GNode *node,
           }
 
         uniform_data.ensure_data = data;
-        uniform_data.start_node = node;
+        uniform_data.shader = instr->pass.shader;
         uniform_find_result = g_hash_table_find (
             instr->pass.uniforms.hash, (GHRFunc)test_uniform_validity, &uniform_data);
         if (uniform_find_result != NULL)
@@ -1373,7 +2446,7 @@ ensure_instr_node (GNode *node,
           }
 
         attributes_data.ensure_data = data;
-        attributes_data.start_node = node;
+        attributes_data.shader = instr->pass.shader;
         attribute_find_result = g_hash_table_find (
             instr->pass.attributes, (GHRFunc)test_attribute_validity, &attributes_data);
         if (attribute_find_result != NULL)
@@ -1400,6 +2473,12 @@ ensure_instr_node (GNode *node,
           data->failure = TRUE;
           return TRUE;
         }
+      if (instr->vertices.indices != NULL &&
+          !ensure_indices (instr->vertices.indices, data->error))
+        {
+          data->failure = TRUE;
+          return TRUE;
+        }
       break;
     case CG_PRIV_INSTR_BLIT:
       if (!ensure_texture (instr->blit.src, data->error))
@@ -1408,6 +2487,15 @@ ensure_instr_node (GNode *node,
           return TRUE;
         }
       break;
+    case CG_PRIV_INSTR_DEPTH_PYRAMID:
+      if (!ensure_texture (instr->depth_pyramid.depth, data->error)
+          || !ensure_texture (instr->depth_pyramid.pyramid, data->error)
+          || !ensure_depth_pyramid_program ((CglGpu *)data->commands->gpu, data->error))
+        {
+          data->failure = TRUE;
+          return TRUE;
+        }
+      break;
     default:
       g_assert_not_reached ();
     }
@@ -1436,19 +2524,36 @@ plan_unref_to_commands (
 
       commands->debug.enabled = debug;
 
-      /* Simply grab the plan tree for now, no further compilation. */
-      gl_commands->instrs = g_steal_pointer (&self->root_instr);
+      gl_commands->nodes = g_steal_pointer (&self->nodes);
 
       data.commands = commands;
       data.failure = FALSE;
       data.error = error;
 
-      g_node_traverse (
-          gl_commands->instrs, G_PRE_ORDER, G_TRAVERSE_ALL,
-          -1, (GNodeTraverseFunc)ensure_instr_node, &data);
+      /* The nodes are in pre-order, so a front to back
+       * scan sees every parent before its children */
+      /* Resources may be shared with other gpus in
+       * the group, which could be ensuring them too */
+      CGL_ENTER_OBJECTS (self->gpu);
+      for (guint i = 0; i < gl_commands->nodes->len; i++)
+        {
+          if (ensure_instr_node (gl_commands->nodes, i, &data))
+            break;
+        }
+      CGL_LEAVE_OBJECTS (self->gpu);
+      for (guint i = 0; i < gl_commands->nodes->len; i++)
+        {
+          CgPrivInstr *instr = CG_PRIV_NODE_INSTR (gl_commands->nodes, i);
+
+          cg_priv_merge_instr_node (gl_commands->nodes, i);
+          depth = MAX (depth, CG_PRIV_NODE (gl_commands->nodes, i)->level + 1);
+
+          if (instr->type == CG_PRIV_INSTR_PASS && instr->pass.targets->len == 0)
+            gl_commands->default_framebuffer = TRUE;
+        }
 
       /* Plus two so we have enough for blits */
-      depth = g_node_max_height (gl_commands->instrs) + 2;
+      depth += 2;
 
       if (depth > gl_gpu->framebuffer_stack->len)
         {
@@ -1489,10 +2594,42 @@ plan_unref_to_commands (
 typedef struct
 {
   CgCommands *commands;
+  GArray *nodes;
   GError **error;
   GLint framebuffer;
+
+  /* What is currently bound, so redundant binds can be skipped */
+  GLint bound_framebuffer;
+  GLint bound_program;
 } ProcessData;
 
+enum
+{
+  PASS_SETUP,    /* start rendering into a fresh framebuffer */
+  PASS_CONTINUE, /* keep rendering into the framebuffer of `ref` */
+  PASS_RESTORE,  /* resume after the child `ref` has finished */
+  PASS_TEARDOWN,
+};
+
+/* Returns the wrapped framebuffer a pass renders into, if any */
+static inline gboolean
+get_native_framebuffer (CgPrivInstr *instr,
+                        GLuint *framebuffer)
+{
+  CgTexture *target = NULL;
+
+  if (instr->pass.targets->len != 1)
+    return FALSE;
+
+  target = g_array_index (instr->pass.targets, CgPrivTarget, 0).texture;
+  if (!target->init.native_framebuffer)
+    return FALSE;
+
+  if (framebuffer != NULL)
+    *framebuffer = target->init.native_handle;
+  return TRUE;
+}
+
 static const GLenum gl_draw_buffer_enums[] = {
   GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1, GL_COLOR_ATTACHMENT2,
   GL_COLOR_ATTACHMENT3, GL_COLOR_ATTACHMENT4, GL_COLOR_ATTACHMENT5,
@@ -1571,6 +2708,28 @@ static const char *test_func_str_map[CG_N_TEST_FUNCS] = {
   [CG_TEST_NOT_EQUAL] = "GL_NOTEQUAL",
 };
 
+static const GLenum stencil_op_map[CG_N_STENCIL_OPS] = {
+  [CG_STENCIL_OP_KEEP] = GL_KEEP,
+  [CG_STENCIL_OP_ZERO] = GL_ZERO,
+  [CG_STENCIL_OP_REPLACE] = GL_REPLACE,
+  [CG_STENCIL_OP_INCREMENT] = GL_INCR,
+  [CG_STENCIL_OP_DECREMENT] = GL_DECR,
+  [CG_STENCIL_OP_INVERT] = GL_INVERT,
+  [CG_STENCIL_OP_INCREMENT_WRAP] = GL_INCR_WRAP,
+  [CG_STENCIL_OP_DECREMENT_WRAP] = GL_DECR_WRAP,
+};
+
+static const char *stencil_op_str_map[CG_N_STENCIL_OPS] = {
+  [CG_STENCIL_OP_KEEP] = "GL_KEEP",
+  [CG_STENCIL_OP_ZERO] = "GL_ZERO",
+  [CG_STENCIL_OP_REPLACE] = "GL_REPLACE",
+  [CG_STENCIL_OP_INCREMENT] = "GL_INCR",
+  [CG_STENCIL_OP_DECREMENT] = "GL_DECR",
+  [CG_STENCIL_OP_INVERT] = "GL_INVERT",
+  [CG_STENCIL_OP_INCREMENT_WRAP] = "GL_INCR_WRAP",
+  [CG_STENCIL_OP_DECREMENT_WRAP] = "GL_DECR_WRAP",
+};
+
 static const GLenum blend_func_map[CG_N_BLENDS] = {
   [CG_BLEND_ZERO] = GL_ZERO,
   [CG_BLEND_ONE] = GL_ONE,
@@ -1615,882 +2774,72 @@ static const char *blend_func_str_map[CG_N_BLENDS] = {
   [CG_BLEND_ONE_MINUS_SRC1_ALPHA] = "GL_ONE_MINUS_SRC1_ALPHA",
 };
 
-static gboolean
-setup_or_teardown (GLuint framebuffer,
-                   GLuint blit_read_fb,
-                   GLuint blit_draw_fb,
-                   CgPrivInstr *instr,
-                   ProcessData *data,
-                   gboolean setup,
-                   gboolean teardown)
-{
-  CgShader *shader = NULL;
-  CglShader *gl_shader = NULL;
-
-  g_assert (instr->type == CG_PRIV_INSTR_PASS);
-
-  shader = instr->pass.shader;
-  gl_shader = (CglShader *)shader;
-
-  if (setup && !instr->pass.fake)
-    {
-      CG_PRIV_RUN (
-          data->commands,
-          glBindFramebuffer, _A (GL_FRAMEBUFFER, framebuffer),
-          "%s, %d", _A ("GL_FRAMEBUFFER", framebuffer));
-      CG_PRIV_RUN (
-          data->commands,
-          glUseProgram, _A (shader != NULL ? gl_shader->program : 0),
-          "%d", _A (shader != NULL ? gl_shader->program : 0));
-    }
-
-  if (!instr->pass.fake && (setup || teardown))
-    {
-      for (guint i = 0, colors = 0, depths = 0;
-           i < instr->pass.targets->len;
-           i++)
-        {
-          CgPrivTarget *target = NULL;
-          CglTexture *gl_target = NULL;
-
-          target = &g_array_index (instr->pass.targets, CgPrivTarget, i);
-          gl_target = (CglTexture *)target->texture;
-
-          if (target->texture->init.format == CG_PRIV_FORMAT_DEPTH)
-            {
-              g_assert (depths == 0);
-
-              CG_PRIV_RUN (
-                  data->commands,
-                  glFramebufferTexture2D,
-                  _A (
-                      GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,
-                      target->texture->init.msaa > 0
-                          ? GL_TEXTURE_2D_MULTISAMPLE
-                          : GL_TEXTURE_2D,
-                      teardown ? 0 : gl_target->id,
-                      0),
-                  "%s, %s, %s, %d, %d",
-                  _A (
-                      "GL_FRAMEBUFFER", "GL_DEPTH_ATTACHMENT",
-                      target->texture->init.msaa > 0
-                          ? "GL_TEXTURE_2D_MULTISAMPLE"
-                          : "GL_TEXTURE_2D",
-                      teardown ? 0 : gl_target->id,
-                      0));
-
-              depths++;
-            }
-          else
-            {
-              g_assert (colors < G_N_ELEMENTS (gl_draw_buffer_enums));
-
-              CG_PRIV_RUN (
-                  data->commands,
-                  glFramebufferTexture2D,
-                  _A (
-                      GL_FRAMEBUFFER, gl_draw_buffer_enums[colors],
-                      target->texture->init.msaa > 0
-                          ? GL_TEXTURE_2D_MULTISAMPLE
-                          : GL_TEXTURE_2D,
-                      teardown ? 0 : gl_target->id, 0),
-                  "%s, %s, %s, %d, %d",
-                  _A (
-                      "GL_FRAMEBUFFER", gl_draw_buffer_str_enums[colors],
-                      target->texture->init.msaa > 0
-                          ? "GL_TEXTURE_2D_MULTISAMPLE"
-                          : "GL_TEXTURE_2D",
-                      teardown ? 0 : gl_target->id, 0));
-
-              CG_PRIV_RUN (
-                  data->commands,
-                  glBlendFunci,
-                  _A (
-                      colors,
-                      blend_func_map[target->src_blend],
-                      blend_func_map[target->dst_blend]),
-                  "%d, %s, %s",
-                  _A (
-                      colors,
-                      blend_func_str_map[target->src_blend],
-                      blend_func_str_map[target->dst_blend]));
-
-              colors++;
-            }
-        }
-
-      if (setup)
-        {
-          GLenum status = 0;
-
-          CG_PRIV_RUN (
-              data->commands,
-              glDrawBuffers,
-              _A (
-                  (int)CLAMP (instr->pass.targets->len, 1, G_N_ELEMENTS (gl_draw_buffer_enums)),
-                  gl_draw_buffer_enums),
-              "%d, %s",
-              _A (
-                  (int)CLAMP (instr->pass.targets->len, 1, G_N_ELEMENTS (gl_draw_buffer_enums)),
-                  CG_PRIV_ADDRESS));
-
-          status = glCheckFramebufferStatus (GL_FRAMEBUFFER);
-          if (status != GL_FRAMEBUFFER_COMPLETE)
-            {
-              CGL_SET_ERROR (
-                  data->error,
-                  CG_ERROR_FAILED_TARGET_CREATION,
-                  "Failed to complete framebuffer");
-              return FALSE;
-            }
-        }
-    }
-
-  if (shader != NULL && (setup || teardown))
-    {
-      for (guint i = 0, textures = 0;
-           i < instr->pass.uniforms.order->len;
-           i++)
-        {
-          const char *name = NULL;
-          CgValue *value = NULL;
-          guint uniform_index = 0;
-          ShaderLocation *uniform = NULL;
-
-          name = g_ptr_array_index (instr->pass.uniforms.order, i);
-          value = g_hash_table_lookup (instr->pass.uniforms.hash, name);
-
-          uniform_index = GPOINTER_TO_UINT (g_hash_table_lookup (gl_shader->uniform_assoc, name));
-          g_assert (uniform_index > 0);
-          uniform = &gl_shader->uniforms[uniform_index - 1];
-
-          g_assert (value != NULL);
-          g_assert (uniform != NULL);
-
-          switch (value->type)
-            {
-            case CG_TYPE_TEXTURE:
-              {
-                GLint textures_int = textures + 1;
-                CglTexture *gl_texture = (CglTexture *)value->texture;
-
-                g_assert (textures + 1 < G_N_ELEMENTS (gl_texture_slot_enums));
-
-                if (value->texture->init.msaa > 0)
-                  {
-                    CglTexture *read_texture = NULL;
-
-                    read_texture = gl_texture;
-                    gl_texture = (CglTexture *)gl_texture->non_msaa;
-
-                    /* If the texture uses msaa, blit to a temp texture */
-                    if (!teardown)
-                      {
-                        for (int j = 0; j < 2; j++)
-                          {
-                            GLenum tmp_status = 0;
-
-                            CG_PRIV_RUN (
-                                data->commands,
-                                glBindFramebuffer, _A (GL_FRAMEBUFFER, j == 0 ? blit_read_fb : blit_draw_fb),
-                                "%s, %d", _A ("GL_FRAMEBUFFER", j == 0 ? blit_read_fb : blit_draw_fb));
-
-                            CG_PRIV_RUN (
-                                data->commands,
-                                glFramebufferTexture2D,
-                                _A (
-                                    GL_FRAMEBUFFER,
-                                    value->texture->init.format == CG_PRIV_FORMAT_DEPTH
-                                        ? GL_DEPTH_ATTACHMENT
-                                        : GL_COLOR_ATTACHMENT0,
-                                    (j == 0 ? read_texture->non_msaa : gl_texture->non_msaa) != NULL
-                                        ? GL_TEXTURE_2D_MULTISAMPLE
-                                        : GL_TEXTURE_2D,
-                                    j == 0
-                                        ? read_texture->id
-                                        : gl_texture->id,
-                                    0),
-                                "%s, %s, %s, %d, %d",
-                                _A (
-                                    "GL_FRAMEBUFFER",
-                                    value->texture->init.format == CG_PRIV_FORMAT_DEPTH
-                                        ? "GL_DEPTH_ATTACHMENT"
-                                        : "GL_COLOR_ATTACHMENT0",
-                                    (j == 0 ? read_texture->non_msaa : gl_texture->non_msaa) != NULL
-                                        ? "GL_TEXTURE_2D_MULTISAMPLE"
-                                        : "GL_TEXTURE_2D",
-                                    j == 0
-                                        ? read_texture->id
-                                        : gl_texture->id,
-                                    0));
-
-                            tmp_status = glCheckFramebufferStatus (GL_FRAMEBUFFER);
-                            if (tmp_status != GL_FRAMEBUFFER_COMPLETE)
-                              {
-                                CGL_SET_ERROR (
-                                    data->error,
-                                    CG_ERROR_FAILED_TARGET_CREATION,
-                                    "Failed to complete framebuffer");
-                                return FALSE;
-                              }
-                          }
-
-                        CG_PRIV_RUN (
-                            data->commands,
-                            glBindFramebuffer, _A (GL_READ_FRAMEBUFFER, blit_read_fb),
-                            "%s, %d", _A ("GL_READ_FRAMEBUFFER", blit_read_fb));
-                        CG_PRIV_RUN (
-                            data->commands,
-                            glBindFramebuffer, _A (GL_DRAW_FRAMEBUFFER, blit_draw_fb),
-                            "%s, %d", _A ("GL_DRAW_FRAMEBUFFER", blit_draw_fb));
-
-                        CG_PRIV_RUN (
-                            data->commands,
-                            glBlitFramebuffer,
-                            _A (
-                                0, 0, value->texture->init.width, value->texture->init.height,
-                                0, 0, value->texture->init.width, value->texture->init.height,
-                                value->texture->init.format == CG_PRIV_FORMAT_DEPTH
-                                    ? GL_DEPTH_BUFFER_BIT
-                                    : GL_COLOR_BUFFER_BIT,
-                                GL_NEAREST),
-                            "%d, %d, %d, %d, %d, %d, %d, %d, %s, %s",
-                            _A (
-                                0, 0, value->texture->init.width, value->texture->init.height,
-                                0, 0, value->texture->init.width, value->texture->init.height,
-                                value->texture->init.format == CG_PRIV_FORMAT_DEPTH
-                                    ? "GL_DEPTH_BUFFER_BIT"
-                                    : "GL_COLOR_BUFFER_BIT",
-                                "GL_NEAREST"));
-
-                        CG_PRIV_RUN (
-                            data->commands,
-                            glBindFramebuffer, _A (GL_READ_FRAMEBUFFER, 0),
-                            "%s, %d", _A ("GL_READ_FRAMEBUFFER", 0));
-                        CG_PRIV_RUN (
-                            data->commands,
-                            glBindFramebuffer, _A (GL_DRAW_FRAMEBUFFER, 0),
-                            "%s, %d", _A ("GL_DRAW_FRAMEBUFFER", 0));
-
-                        for (int j = 0; j < 2; j++)
-                          {
-                            CG_PRIV_RUN (
-                                data->commands,
-                                glBindFramebuffer, _A (GL_FRAMEBUFFER, j == 0 ? blit_read_fb : blit_draw_fb),
-                                "%s, %d", _A ("GL_FRAMEBUFFER", j == 0 ? blit_read_fb : blit_draw_fb));
-
-                            CG_PRIV_RUN (
-                                data->commands,
-                                glFramebufferTexture2D,
-                                _A (
-                                    GL_FRAMEBUFFER,
-                                    value->texture->init.format == CG_PRIV_FORMAT_DEPTH
-                                        ? GL_DEPTH_ATTACHMENT
-                                        : GL_COLOR_ATTACHMENT0,
-                                    (j == 0 ? read_texture->non_msaa : gl_texture->non_msaa) != NULL
-                                        ? GL_TEXTURE_2D_MULTISAMPLE
-                                        : GL_TEXTURE_2D,
-                                    0, 0),
-                                "%s, %s, %s, %d, %d",
-                                _A (
-                                    "GL_FRAMEBUFFER",
-                                    value->texture->init.format == CG_PRIV_FORMAT_DEPTH
-                                        ? "GL_DEPTH_ATTACHMENT"
-                                        : "GL_COLOR_ATTACHMENT0",
-                                    (j == 0 ? read_texture->non_msaa : gl_texture->non_msaa) != NULL
-                                        ? "GL_TEXTURE_2D_MULTISAMPLE"
-                                        : "GL_TEXTURE_2D",
-                                    0, 0));
-                          }
-
-                        CG_PRIV_RUN (
-                            data->commands,
-                            glBindFramebuffer, _A (GL_FRAMEBUFFER, framebuffer),
-                            "%s, %d", _A ("GL_FRAMEBUFFER", framebuffer));
-                      }
-                  }
-
-                CG_PRIV_RUN (
-                    data->commands,
-                    glActiveTexture, _A (gl_texture_slot_enums[textures + 1]),
-                    "%s", _A (gl_texture_slot_str_enums[textures + 1]));
-
-                CG_PRIV_RUN (
-                    data->commands,
-                    glBindTexture,
-                    _A (
-                        value->texture->init.cubemap
-                            ? GL_TEXTURE_CUBE_MAP
-                            : GL_TEXTURE_2D,
-                        teardown ? 0 : gl_texture->id),
-                    "%s, %d",
-                    _A (
-                        value->texture->init.cubemap
-                            ? "GL_TEXTURE_CUBE_MAP"
-                            : "GL_TEXTURE_2D",
-                        teardown ? 0 : gl_texture->id));
-                CG_PRIV_RUN (
-                    data->commands,
-                    glUniform1i, _A (uniform->location, teardown ? 0 : textures_int),
-                    "%d, %d", _A (uniform->location, teardown ? 0 : textures_int));
-
-                CG_PRIV_RUN (
-                    data->commands,
-                    glActiveTexture, _A (gl_texture_slot_enums[0]),
-                    "%s", _A (gl_texture_slot_str_enums[0]));
-
-                textures++;
-              }
-              break;
-            case CG_TYPE_BUFFER:
-              {
-                guint block_index = 0;
-                CglBuffer *gl_buffer = (CglBuffer *)value->buffer;
-
-                block_index = GPOINTER_TO_UINT (
-                    g_hash_table_lookup (
-                        gl_shader->uniform_blocks,
-                        GUINT_TO_POINTER (uniform->location)));
-                g_assert (block_index > 0);
-
-                CG_PRIV_RUN (
-                    data->commands,
-                    glUniformBlockBinding, _A (gl_shader->program, block_index - 1, 0),
-                    "%d, %d, %d", _A (gl_shader->program, block_index - 1, 0));
-                CG_PRIV_RUN (
-                    data->commands,
-                    glBindBufferBase, _A (GL_UNIFORM_BUFFER, 0, teardown ? 0 : gl_buffer->ubo_id),
-                    "%s, %d, %d", _A ("GL_UNIFORM_BUFFER", 0, teardown ? 0 : gl_buffer->ubo_id));
-              }
-              break;
-            case CG_TYPE_BOOL:
-              if (!teardown)
-                CG_PRIV_RUN (
-                    data->commands,
-                    glUniform1i, _A (uniform->location, value->b ? GL_TRUE : GL_FALSE),
-                    "%d, %s", _A (uniform->location, value->b ? "GL_TRUE" : "GL_FALSE"));
-              break;
-            case CG_TYPE_INT:
-              if (!teardown)
-                CG_PRIV_RUN (
-                    data->commands,
-                    glUniform1i, _A (uniform->location, value->i),
-                    "%d, %d", _A (uniform->location, value->i));
-              break;
-            case CG_TYPE_UINT:
-              if (!teardown)
-                CG_PRIV_RUN (
-                    data->commands,
-                    glUniform1ui, _A (uniform->location, value->ui),
-                    "%d, %d", _A (uniform->location, value->ui));
-              break;
-            case CG_TYPE_FLOAT:
-              if (!teardown)
-                CG_PRIV_RUN (
-                    data->commands,
-                    glUniform1f, _A (uniform->location, value->f),
-                    "%d, %f", _A (uniform->location, value->f));
-              break;
-            case CG_TYPE_VEC2:
-              if (!teardown)
-                CG_PRIV_RUN (
-                    data->commands,
-                    glUniform2fv, _A (uniform->location, 1, value->vec2),
-                    "%d, %d, VEC2{%f %f}", _A (uniform->location, 1, value->vec2[0], value->vec2[1]));
-              break;
-            case CG_TYPE_VEC3:
-              if (!teardown)
-                CG_PRIV_RUN (
-                    data->commands,
-                    glUniform3fv, _A (uniform->location, 1, value->vec3),
-                    "%d, %d, VEC3{%f %f %f}",
-                    _A (
-                        uniform->location, 1,
-                        value->vec3[0],
-                        value->vec3[1],
-                        value->vec3[2]));
-              break;
-            case CG_TYPE_VEC4:
-              if (!teardown)
-                CG_PRIV_RUN (
-                    data->commands,
-                    glUniform4fv, _A (uniform->location, 1, value->vec4),
-                    "%d, %d, VEC4{%f %f %f %f}",
-                    _A (
-                        uniform->location, 1,
-                        value->vec4[0],
-                        value->vec4[1],
-                        value->vec4[2],
-                        value->vec4[3]));
-              break;
-            case CG_TYPE_MAT4:
-              if (!teardown)
-                CG_PRIV_RUN (
-                    data->commands,
-                    glUniformMatrix4fv, _A (uniform->location, 1, GL_FALSE, value->mat4.initialized),
-                    "%d, %d, %s, MAT4{%f %f %f %f %f %f %f %f %f %f %f %f %f %f %f %f}",
-                    _A (
-                        uniform->location, 1, "GL_FALSE",
-                        value->mat4.initialized[0],
-                        value->mat4.initialized[1],
-                        value->mat4.initialized[2],
-                        value->mat4.initialized[3],
-                        value->mat4.initialized[4],
-                        value->mat4.initialized[5],
-                        value->mat4.initialized[6],
-                        value->mat4.initialized[7],
-                        value->mat4.initialized[8],
-                        value->mat4.initialized[9],
-                        value->mat4.initialized[10],
-                        value->mat4.initialized[11],
-                        value->mat4.initialized[12],
-                        value->mat4.initialized[13],
-                        value->mat4.initialized[14],
-                        value->mat4.initialized[15]));
-              break;
-            default:
-              g_assert_not_reached ();
-            }
-        }
-    }
-
-  if (setup && !instr->pass.fake)
-    {
-      CG_PRIV_RUN (
-          data->commands,
-          glColorMask, _A (GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE),
-          "%s, %s, %s, %s", _A ("GL_TRUE", "GL_TRUE", "GL_TRUE", "GL_TRUE"));
-      CG_PRIV_RUN (
-          data->commands,
-          glDepthMask, _A (GL_TRUE),
-          "%s", _A ("GL_TRUE"));
-      CG_PRIV_RUN (
-          data->commands,
-          glClearColor, _A (0.0, 0.0, 0.0, 0.0),
-          "%f, %f, %f, %f", _A (0.0, 0.0, 0.0, 0.0));
-      CG_PRIV_RUN (
-          data->commands,
-          glClear, _A (GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT),
-          "%s", _A ("GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT"));
-    }
-
-  if (!teardown)
-    {
-      if (instr->pass.dest.set)
-        CG_PRIV_RUN (
-            data->commands,
-            glViewport,
-            _A (
-                instr->pass.dest.val[0],
-                instr->pass.dest.val[1],
-                instr->pass.dest.val[2],
-                instr->pass.dest.val[3]),
-            "%d, %d, %d, %d",
-            _A (
-                instr->pass.dest.val[0],
-                instr->pass.dest.val[1],
-                instr->pass.dest.val[2],
-                instr->pass.dest.val[3]));
-
-      if (instr->pass.write_mask.set || (setup && !instr->pass.fake))
-        {
-          CG_PRIV_RUN (
-              data->commands,
-              glColorMask,
-              _A (
-                  instr->pass.write_mask.val & CG_WRITE_MASK_COLOR_RED ? GL_TRUE : GL_FALSE,
-                  instr->pass.write_mask.val & CG_WRITE_MASK_COLOR_GREEN ? GL_TRUE : GL_FALSE,
-                  instr->pass.write_mask.val & CG_WRITE_MASK_COLOR_BLUE ? GL_TRUE : GL_FALSE,
-                  instr->pass.write_mask.val & CG_WRITE_MASK_COLOR_ALPHA ? GL_TRUE : GL_FALSE),
-              "%s, %s, %s, %s",
-              _A (
-                  instr->pass.write_mask.val & CG_WRITE_MASK_COLOR_RED ? "GL_TRUE" : "GL_FALSE",
-                  instr->pass.write_mask.val & CG_WRITE_MASK_COLOR_GREEN ? "GL_TRUE" : "GL_FALSE",
-                  instr->pass.write_mask.val & CG_WRITE_MASK_COLOR_BLUE ? "GL_TRUE" : "GL_FALSE",
-                  instr->pass.write_mask.val & CG_WRITE_MASK_COLOR_ALPHA ? "GL_TRUE" : "GL_FALSE"));
-
-          CG_PRIV_RUN (
-              data->commands,
-              glDepthMask,
-              _A (
-                  instr->pass.write_mask.val & CG_WRITE_MASK_DEPTH ? GL_TRUE : GL_FALSE),
-              "%s",
-              _A (
-                  instr->pass.write_mask.val & CG_WRITE_MASK_DEPTH ? "GL_TRUE" : "GL_FALSE"));
-        }
-
-      CG_PRIV_RUN (
-          data->commands,
-          glEnable, _A (GL_DEPTH_TEST),
-          "%s", _A ("GL_DEPTH_TEST"));
-      if (instr->pass.depth_test_func.set)
-        CG_PRIV_RUN (
-            data->commands,
-            glDepthFunc, _A (test_func_map[instr->pass.depth_test_func.val]),
-            "%s", _A (test_func_str_map[instr->pass.depth_test_func.val]));
-
-      if (instr->pass.clockwise_faces.set)
-        CG_PRIV_RUN (
-            data->commands,
-            glFrontFace, _A (instr->pass.clockwise_faces.val ? GL_CW : GL_CCW),
-            "%s", _A (instr->pass.clockwise_faces.val ? "GL_CW" : "GL_CCW"));
-
-      if (instr->pass.backface_cull.set)
-        {
-          if (instr->pass.backface_cull.val)
-            CG_PRIV_RUN (
-                data->commands,
-                glEnable, _A (GL_CULL_FACE),
-                "%s", _A ("GL_CULL_FACE"));
-          else
-            CG_PRIV_RUN (
-                data->commands,
-                glDisable, _A (GL_CULL_FACE),
-                "%s", _A ("GL_CULL_FACE"));
-        }
-    }
-
-  return TRUE;
-}
-
-static gboolean
-draw_vertices (CgBuffer **buffers,
-               guint n_buffers,
-               CgShader *shader,
-               guint instances,
-               ProcessData *data)
-{
-  CglShader *gl_shader = (CglShader *)shader;
-  CglBuffer *first_buffer = (CglBuffer *)*buffers;
-  guint max_length = 0;
-
-  CG_PRIV_RUN (
-      data->commands,
-      glBindVertexArray, _A (first_buffer->vao_id),
-      "%d", _A (first_buffer->vao_id));
-
-  for (guint i = 0; i < n_buffers; i++)
-    {
-      CglBuffer *gl_buffer = NULL;
-      gsize stride = 0;
-      gsize offset = 0;
-
-      g_assert (buffers[i]->spec != NULL);
-
-      gl_buffer = (CglBuffer *)buffers[i];
-      CG_PRIV_RUN (
-          data->commands,
-          glBindBuffer, _A (GL_ARRAY_BUFFER, gl_buffer->vbo_id),
-          "%s, %d", _A ("GL_ARRAY_BUFFER", gl_buffer->vbo_id));
-
-      for (guint j = 0; j < buffers[i]->spec_length; j++)
-        stride += buffers[i]->spec[j].num
-                  * (buffers[i]->spec[j].type == CG_TYPE_FLOAT
-                         ? sizeof (float)
-                         : sizeof (guchar));
-
-      for (guint j = 0; j < buffers[i]->spec_length; j++)
-        {
-          ShaderLocation *attribute = NULL;
-
-          attribute = g_hash_table_lookup (
-              gl_shader->attribute_assoc,
-              buffers[i]->spec[j].name);
-          g_assert (attribute != NULL);
-
-          CG_PRIV_RUN (
-              data->commands,
-              glVertexAttribPointer,
-              _A (
-                  attribute->location,
-                  buffers[i]->spec[j].num,
-                  buffers[i]->spec[j].type == CG_TYPE_FLOAT
-                      ? GL_FLOAT
-                      : GL_UNSIGNED_BYTE,
-                  GL_FALSE,
-                  stride,
-                  GSIZE_TO_POINTER (offset)),
-              "%d, %d, %s, %s, %zu, %zu",
-              _A (
-                  attribute->location,
-                  buffers[i]->spec[j].num,
-                  buffers[i]->spec[j].type == CG_TYPE_FLOAT
-                      ? "GL_FLOAT"
-                      : "GL_UNSIGNED_BYTE",
-                  "GL_FALSE",
-                  stride,
-                  offset));
-
-          CG_PRIV_RUN (
-              data->commands,
-              glVertexAttribDivisor,
-              _A (attribute->location, buffers[i]->spec[j].instance_rate),
-              "%d, %d",
-              _A (attribute->location, buffers[i]->spec[j].instance_rate));
-
-          CG_PRIV_RUN (
-              data->commands,
-              glEnableVertexAttribArray, _A (attribute->location),
-              "%d", _A (attribute->location));
-
-          offset += buffers[i]->spec[j].num
-                    * (buffers[i]->spec[j].type == CG_TYPE_FLOAT
-                           ? sizeof (float)
-                           : sizeof (guchar));
-        }
-
-      gl_buffer->length = buffers[i]->init.size / stride;
-      if (gl_buffer->length > max_length)
-        max_length = gl_buffer->length;
-    }
-
-  if (instances > 1)
-    CG_PRIV_RUN (
-        data->commands,
-        glDrawArraysInstanced, _A (GL_TRIANGLES, 0, max_length, instances),
-        "%s, %d, %d, %d", _A ("GL_TRIANGLES", 0, max_length, instances));
-  else
-    CG_PRIV_RUN (
-        data->commands,
-        glDrawArrays, _A (GL_TRIANGLES, 0, max_length),
-        "%s, %d, %d", _A ("GL_TRIANGLES", 0, max_length));
-
-  for (guint i = 0; i < n_buffers; i++)
-    {
-      CglBuffer *gl_buffer = NULL;
-
-      g_assert (buffers[i]->spec != NULL);
-
-      gl_buffer = (CglBuffer *)buffers[i];
-      CG_PRIV_RUN (
-          data->commands,
-          glBindBuffer, _A (GL_ARRAY_BUFFER, gl_buffer->vbo_id),
-          "%s, %d", _A ("GL_ARRAY_BUFFER", gl_buffer->vbo_id));
-
-      for (guint j = 0; j < buffers[i]->spec_length; j++)
-        {
-          ShaderLocation *attribute = NULL;
-
-          /* TODO: maybe prevent multiple lookups in same function */
-          attribute = g_hash_table_lookup (
-              gl_shader->attribute_assoc,
-              buffers[i]->spec[j].name);
-          g_assert (attribute != NULL);
-
-          CG_PRIV_RUN (
-              data->commands,
-              glDisableVertexAttribArray, _A (attribute->location),
-              "%d", _A (attribute->location));
-        }
-    }
-
-  CG_PRIV_RUN (
-      data->commands,
-      glBindVertexArray, _A (0),
-      "%d", _A (0));
-
-  return TRUE;
-}
-
-static gboolean
-blit (GLuint framebuffer,
-      GLuint blit_read_fb,
-      GLuint blit_draw_fb,
-      CgPrivInstr *pass_instr,
-      CgPrivInstr *instr,
-      ProcessData *data)
-{
-  CglTexture *gl_texture = (CglTexture *)instr->blit.src;
-  GLenum status = 0;
-
-  CG_PRIV_RUN (
-      data->commands,
-      glBindFramebuffer, _A (GL_FRAMEBUFFER, blit_read_fb),
-      "%s, %d", _A ("GL_FRAMEBUFFER", blit_read_fb));
-  CG_PRIV_RUN (
-      data->commands,
-      glFramebufferTexture2D,
-      _A (
-          GL_FRAMEBUFFER,
-          instr->blit.src->init.format == CG_PRIV_FORMAT_DEPTH
-              ? GL_DEPTH_ATTACHMENT
-              : GL_COLOR_ATTACHMENT0,
-          instr->blit.src->init.msaa > 0
-              ? GL_TEXTURE_2D_MULTISAMPLE
-              : GL_TEXTURE_2D,
-          gl_texture->id, 0),
-      "%s, %s, %s, %d, %d",
-      _A (
-          "GL_FRAMEBUFFER",
-          instr->blit.src->init.format == CG_PRIV_FORMAT_DEPTH
-              ? "GL_DEPTH_ATTACHMENT"
-              : "GL_COLOR_ATTACHMENT0",
-          instr->blit.src->init.msaa > 0
-              ? "GL_TEXTURE_2D_MULTISAMPLE"
-              : "GL_TEXTURE_2D",
-          gl_texture->id, 0));
-
-  status = glCheckFramebufferStatus (GL_FRAMEBUFFER);
-  if (status != GL_FRAMEBUFFER_COMPLETE)
-    {
-      CGL_SET_ERROR (
-          data->error,
-          CG_ERROR_FAILED_TARGET_CREATION,
-          "Failed to complete framebuffer");
-      return FALSE;
-    }
-
-  CG_PRIV_RUN (
-      data->commands,
-      glBindFramebuffer, _A (GL_READ_FRAMEBUFFER, blit_read_fb),
-      "%s, %d", _A ("GL_READ_FRAMEBUFFER", blit_read_fb));
-  CG_PRIV_RUN (
-      data->commands,
-      glBindFramebuffer, _A (GL_DRAW_FRAMEBUFFER, framebuffer),
-      "%s, %d", _A ("GL_DRAW_FRAMEBUFFER", framebuffer));
-
-  CG_PRIV_RUN (
-      data->commands,
-      glBlitFramebuffer,
-      _A (
-          0, 0, instr->blit.src->init.width, instr->blit.src->init.height,
-          pass_instr->pass.dest.val[0], pass_instr->pass.dest.val[1],
-          pass_instr->pass.dest.val[2], pass_instr->pass.dest.val[3],
-          instr->blit.src->init.format == CG_PRIV_FORMAT_DEPTH
-              ? GL_DEPTH_BUFFER_BIT
-              : GL_COLOR_BUFFER_BIT,
-          GL_NEAREST),
-      "%d, %d, %d, %d, %d, %d, %d, %d, %s, %s",
-      _A (
-          0, 0, instr->blit.src->init.width, instr->blit.src->init.height,
-          pass_instr->pass.dest.val[0], pass_instr->pass.dest.val[1],
-          pass_instr->pass.dest.val[2], pass_instr->pass.dest.val[3],
-          instr->blit.src->init.format == CG_PRIV_FORMAT_DEPTH
-              ? "GL_DEPTH_BUFFER_BIT"
-              : "GL_COLOR_BUFFER_BIT",
-          "GL_NEAREST"));
-
-  CG_PRIV_RUN (
-      data->commands,
-      glBindFramebuffer, _A (GL_READ_FRAMEBUFFER, 0),
-      "%s, %d", _A ("GL_READ_FRAMEBUFFER", 0));
-  CG_PRIV_RUN (
-      data->commands,
-      glBindFramebuffer, _A (GL_DRAW_FRAMEBUFFER, 0),
-      "%s, %d", _A ("GL_DRAW_FRAMEBUFFER", 0));
-
-  CG_PRIV_RUN (
-      data->commands,
-      glBindFramebuffer, _A (GL_FRAMEBUFFER, blit_read_fb),
-      "%s, %d", _A ("GL_FRAMEBUFFER", blit_read_fb));
-  CG_PRIV_RUN (
-      data->commands,
-      glFramebufferTexture2D,
-      _A (
-          GL_FRAMEBUFFER,
-          instr->blit.src->init.format == CG_PRIV_FORMAT_DEPTH
-              ? GL_DEPTH_ATTACHMENT
-              : GL_COLOR_ATTACHMENT0,
-          GL_TEXTURE_2D, 0, 0),
-      "%s, %s, %s, %d, %d",
-      _A (
-          "GL_FRAMEBUFFER",
-          instr->blit.src->init.format == CG_PRIV_FORMAT_DEPTH
-              ? "GL_DEPTH_ATTACHMENT"
-              : "GL_COLOR_ATTACHMENT0",
-          "GL_TEXTURE_2D", 0, 0));
-
-  CG_PRIV_RUN (
-      data->commands,
-      glBindFramebuffer, _A (GL_FRAMEBUFFER, framebuffer),
-      "%s, %d", _A ("GL_FRAMEBUFFER", framebuffer));
-
-  return TRUE;
-}
-
-static gboolean
-process_instr_node (GNode *node,
-                    ProcessData *data)
-{
-  CgPrivInstr *pass_instr = node->data;
-  CgCommands *commands = data->commands;
-  CglGpu *gl_gpu = (CglGpu *)commands->gpu;
-  GLuint framebuffer = 0;
-  GLuint blit_read_fb = 0;
-  GLuint blit_draw_fb = 0;
+static const GLenum topology_map[CG_N_TOPOLOGIES] = {
+  [CG_TOPOLOGY_TRIANGLES] = GL_TRIANGLES,
+  [CG_TOPOLOGY_TRIANGLE_STRIP] = GL_TRIANGLE_STRIP,
+  [CG_TOPOLOGY_LINES] = GL_LINES,
+  [CG_TOPOLOGY_LINE_STRIP] = GL_LINE_STRIP,
+  [CG_TOPOLOGY_POINTS] = GL_POINTS,
+};
 
-  g_assert (pass_instr->type == CG_PRIV_INSTR_PASS);
+static const char *topology_str_map[CG_N_TOPOLOGIES] = {
+  [CG_TOPOLOGY_TRIANGLES] = "GL_TRIANGLES",
+  [CG_TOPOLOGY_TRIANGLE_STRIP] = "GL_TRIANGLE_STRIP",
+  [CG_TOPOLOGY_LINES] = "GL_LINES",
+  [CG_TOPOLOGY_LINE_STRIP] = "GL_LINE_STRIP",
+  [CG_TOPOLOGY_POINTS] = "GL_POINTS",
+};
 
-  if (pass_instr->pass.targets->len == 0)
-    {
-      framebuffer = data->framebuffer;
-      blit_read_fb = g_array_index (gl_gpu->framebuffer_stack, GLuint, pass_instr->depth + 0);
-      blit_draw_fb = g_array_index (gl_gpu->framebuffer_stack, GLuint, pass_instr->depth + 1);
-    }
-  else
-    {
-      framebuffer = g_array_index (gl_gpu->framebuffer_stack, GLuint, pass_instr->depth + 0);
-      blit_read_fb = g_array_index (gl_gpu->framebuffer_stack, GLuint, pass_instr->depth + 1);
-      blit_draw_fb = g_array_index (gl_gpu->framebuffer_stack, GLuint, pass_instr->depth + 2);
-    }
+static const GLenum component_map[CG_N_COMPONENTS] = {
+  [CG_COMPONENT_FLOAT32] = GL_FLOAT,
+  [CG_COMPONENT_FLOAT16] = GL_HALF_FLOAT,
+  [CG_COMPONENT_INT8] = GL_BYTE,
+  [CG_COMPONENT_UINT8] = GL_UNSIGNED_BYTE,
+  [CG_COMPONENT_INT16] = GL_SHORT,
+  [CG_COMPONENT_UINT16] = GL_UNSIGNED_SHORT,
+  [CG_COMPONENT_INT32] = GL_INT,
+  [CG_COMPONENT_UINT32] = GL_UNSIGNED_INT,
+  [CG_COMPONENT_INT_2_10_10_10] = GL_INT_2_10_10_10_REV,
+  [CG_COMPONENT_UINT_2_10_10_10] = GL_UNSIGNED_INT_2_10_10_10_REV,
+};
 
-  if (!setup_or_teardown (
-          framebuffer, blit_read_fb, blit_draw_fb,
-          pass_instr, data, TRUE, FALSE))
-    return FALSE;
+static const char *component_str_map[CG_N_COMPONENTS] = {
+  [CG_COMPONENT_FLOAT32] = "GL_FLOAT",
+  [CG_COMPONENT_FLOAT16] = "GL_HALF_FLOAT",
+  [CG_COMPONENT_INT8] = "GL_BYTE",
+  [CG_COMPONENT_UINT8] = "GL_UNSIGNED_BYTE",
+  [CG_COMPONENT_INT16] = "GL_SHORT",
+  [CG_COMPONENT_UINT16] = "GL_UNSIGNED_SHORT",
+  [CG_COMPONENT_INT32] = "GL_INT",
+  [CG_COMPONENT_UINT32] = "GL_UNSIGNED_INT",
+  [CG_COMPONENT_INT_2_10_10_10] = "GL_INT_2_10_10_10_REV",
+  [CG_COMPONENT_UINT_2_10_10_10] = "GL_UNSIGNED_INT_2_10_10_10_REV",
+};
 
-  for (GNode *child = node->children; child != NULL; child = child->next)
-    {
-      CgPrivInstr *instr = child->data;
+/* The largest value of every index type, which is what
+ * GL_PRIMITIVE_RESTART_FIXED_INDEX would use, set through
+ * glPrimitiveRestartIndex () as that only needs GL 3.1 */
+static const GLuint restart_index_map[CG_N_COMPONENTS] = {
+  [CG_COMPONENT_UINT8] = G_MAXUINT8,
+  [CG_COMPONENT_UINT16] = G_MAXUINT16,
+  [CG_COMPONENT_UINT32] = G_MAXUINT32,
+};
 
-      switch (instr->type)
-        {
-        case CG_PRIV_INSTR_PASS:
-          if (!process_instr_node (child, data))
-            return FALSE;
-          if (!setup_or_teardown (
-                  framebuffer, blit_read_fb, blit_draw_fb,
-                  pass_instr, data, FALSE, FALSE))
-            return FALSE;
-          break;
-        case CG_PRIV_INSTR_VERTICES:
-          g_assert (pass_instr->pass.shader != NULL);
-          if (instr->vertices.n_buffers > 1)
-            {
-              if (!draw_vertices (
-                      instr->vertices.many_buffers,
-                      instr->vertices.n_buffers,
-                      pass_instr->pass.shader,
-                      instr->vertices.instances,
-                      data))
-                return FALSE;
-            }
-          else if (!draw_vertices (
-                       &instr->vertices.one_buffer,
-                       1,
-                       pass_instr->pass.shader,
-                       instr->vertices.instances,
-                       data))
-            return FALSE;
-          break;
-        case CG_PRIV_INSTR_BLIT:
-          if (!blit (framebuffer, blit_read_fb,
-                     blit_draw_fb, pass_instr,
-                     instr, data))
-            return FALSE;
-          break;
-        default:
-          g_assert_not_reached ();
-        }
-    }
+/* The dispatch path is built twice: once lean, with no debug
+ * bookkeeping at all, and once recording every call it makes.
+ * commands_dispatch () picks one of them per dispatch. */
+#define CGL_DISPATCH_TRACE 0
+#define CGL_DISPATCH_SUFFIX lean
+#include "cpc-gpu-gl-dispatch.h"
+#undef CGL_DISPATCH_TRACE
+#undef CGL_DISPATCH_SUFFIX
 
-  if (!setup_or_teardown (
-          framebuffer, blit_read_fb, blit_draw_fb,
-          pass_instr, data, FALSE, TRUE))
-    return FALSE;
+#define CGL_DISPATCH_TRACE 1
+#define CGL_DISPATCH_SUFFIX trace
+#include "cpc-gpu-gl-dispatch.h"
+#undef CGL_DISPATCH_TRACE
+#undef CGL_DISPATCH_SUFFIX
 
-  return TRUE;
-}
 
 static gboolean
 commands_dispatch (
@@ -2512,12 +2861,27 @@ commands_dispatch (
   data.commands = self;
   data.error = error;
 
-  CG_PRIV_RUN (
-      self,
-      glGetIntegerv, _A (GL_FRAMEBUFFER_BINDING, &data.framebuffer),
-      "%s, %s", _A ("GL_FRAMEBUFFER_BINDING", CG_PRIV_ADDRESS));
+  /* The query is a round trip on some drivers, so
+   * skip it when every group has its own target */
+  data.bound_framebuffer = -1;
+  if (gl_commands->default_framebuffer)
+    {
+      CG_PRIV_RUN (
+          self,
+          glGetIntegerv, _A (GL_FRAMEBUFFER_BINDING, &data.framebuffer),
+          "%s, %s", _A ("GL_FRAMEBUFFER_BINDING", CG_PRIV_ADDRESS));
+      data.bound_framebuffer = data.framebuffer;
+    }
+  data.bound_program = -1;
+  data.nodes = gl_commands->nodes;
+
+  if (data.nodes->len == 0)
+    return TRUE;
 
-  return process_instr_node (gl_commands->instrs, &data);
+  if (self->debug.enabled)
+    return process_instr_node_trace (0, &data);
+  else
+    return process_instr_node_lean (0, &data);
 }
 
 const CgBackendImpl cg_gl_impl = {
@@ -2530,6 +2894,7 @@ const CgBackendImpl cg_gl_impl = {
   .gpu_unref = gpu_unref,
   .gpu_get_info = gpu_get_info,
   .gpu_flush = gpu_flush,
+  .gpu_share = gpu_share,
 
   .plan_new = plan_new,
   .plan_ref = plan_ref,
@@ -2553,4 +2918,25 @@ const CgBackendImpl cg_gl_impl = {
 
   .plan_unref_to_commands = plan_unref_to_commands,
   .commands_dispatch = commands_dispatch,
+
+  .timer_new = timer_new,
+  .timer_free = timer_free,
+  .timer_begin = timer_begin,
+  .timer_end = timer_end,
+  .timer_collect = timer_collect,
+
+  .fence_new = fence_new,
+  .fence_free = fence_free,
+  .fence_wait = fence_wait,
+  .fence_client_wait = fence_client_wait,
+
+  .texture_update = texture_update,
+  .texture_download = texture_download,
+  .texture_import_dmabuf = texture_import_dmabuf,
+  .texture_export_dmabuf = texture_export_dmabuf,
+
+  .readback_new = readback_new,
+  .readback_free = readback_free,
+  .readback_wait = readback_wait,
+  .readback_read = readback_read,
 };
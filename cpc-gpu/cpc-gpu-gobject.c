@@ -27,3 +27,9 @@ G_DEFINE_BOXED_TYPE (CgBuffer, cg_buffer, cg_buffer_ref, cg_buffer_unref);
 G_DEFINE_BOXED_TYPE (CgTexture, cg_texture, cg_texture_ref, cg_texture_unref);
 G_DEFINE_BOXED_TYPE (CgPlan, cg_plan, cg_plan_ref, cg_plan_unref);
 G_DEFINE_BOXED_TYPE (CgCommands, cg_commands, cg_commands_ref, cg_commands_unref);
+G_DEFINE_BOXED_TYPE (CgGraph, cg_graph, cg_graph_ref, cg_graph_unref);
+G_DEFINE_BOXED_TYPE (CgScaler, cg_scaler, cg_scaler_ref, cg_scaler_unref);
+G_DEFINE_BOXED_TYPE (CgBatch, cg_batch, cg_batch_ref, cg_batch_unref);
+G_DEFINE_BOXED_TYPE (CgVirtualTexture, cg_virtual_texture, cg_virtual_texture_ref, cg_virtual_texture_unref);
+G_DEFINE_BOXED_TYPE (CgFence, cg_fence, cg_fence_ref, cg_fence_unref);
+G_DEFINE_BOXED_TYPE (CgReadback, cg_readback, cg_readback_ref, cg_readback_unref);
@@ -50,4 +50,28 @@ GType cg_plan_get_type (void) G_GNUC_CONST;
 CPC_GPU_AVAILABLE_IN_ALL
 GType cg_commands_get_type (void) G_GNUC_CONST;
 
+#define CPC_TYPE_GPU_GRAPH cpc_gpu_graph_get_type ()
+CPC_GPU_AVAILABLE_IN_ALL
+GType cg_graph_get_type (void) G_GNUC_CONST;
+
+#define CPC_TYPE_GPU_SCALER cpc_gpu_scaler_get_type ()
+CPC_GPU_AVAILABLE_IN_ALL
+GType cg_scaler_get_type (void) G_GNUC_CONST;
+
+#define CPC_TYPE_GPU_BATCH cpc_gpu_batch_get_type ()
+CPC_GPU_AVAILABLE_IN_ALL
+GType cg_batch_get_type (void) G_GNUC_CONST;
+
+#define CPC_TYPE_GPU_VIRTUAL_TEXTURE cpc_gpu_virtual_texture_get_type ()
+CPC_GPU_AVAILABLE_IN_ALL
+GType cg_virtual_texture_get_type (void) G_GNUC_CONST;
+
+#define CPC_TYPE_GPU_FENCE cpc_gpu_fence_get_type ()
+CPC_GPU_AVAILABLE_IN_ALL
+GType cg_fence_get_type (void) G_GNUC_CONST;
+
+#define CPC_TYPE_GPU_READBACK cpc_gpu_readback_get_type ()
+CPC_GPU_AVAILABLE_IN_ALL
+GType cg_readback_get_type (void) G_GNUC_CONST;
+
 G_END_DECLS
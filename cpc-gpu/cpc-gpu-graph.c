@@ -0,0 +1,964 @@
+/* cpc-gpu-graph.c
+ *
+ * Copyright 2025 Adam Masciola
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+#define G_LOG_DOMAIN "CpcGpuGraph"
+#include "cpc-gpu-private.h"
+
+#define NO_INDEX G_MAXUINT
+
+typedef struct
+{
+  /* The imported texture, or the physical
+   * texture assigned during compilation */
+  CgTexture *texture;
+
+  gboolean transient;
+  gboolean exported;
+  int width;
+  int height;
+  int format;
+  int msaa;
+
+  /* Compilation state */
+  guint resolved;
+  guint first_step;
+  guint last_step;
+} GraphResource;
+
+typedef struct
+{
+  char *name;
+  CgGraphPassFunc func;
+  gpointer user_data;
+  GDestroyNotify destroy_user_data;
+
+  GArray *reads;
+  GArray *writes;
+
+  /* Compilation state */
+  gboolean live;
+  guint resolve_src;
+} GraphPass;
+
+struct _CgGraph
+{
+  gatomicrefcount refcount;
+  CgGpu *gpu;
+
+  GArray *resources;
+  GArray *passes;
+
+  /* Transient textures, kept across resets */
+  GPtrArray *pool;
+
+  guint current_pass;
+};
+
+static void
+clear_resource (gpointer data)
+{
+  GraphResource *resource = data;
+
+  g_clear_pointer (&resource->texture, cg_texture_unref);
+}
+
+static void
+clear_pass (gpointer data)
+{
+  GraphPass *pass = data;
+
+  g_clear_pointer (&pass->name, g_free);
+  g_clear_pointer (&pass->reads, g_array_unref);
+  g_clear_pointer (&pass->writes, g_array_unref);
+
+  if (pass->user_data != NULL
+      && pass->destroy_user_data != NULL)
+    pass->destroy_user_data (pass->user_data);
+  pass->user_data = NULL;
+}
+
+static void
+init_resources (CgGraph *self)
+{
+  GraphResource default_target = { 0 };
+
+  /* Index 0 is reserved for CG_GRAPH_DEFAULT_TARGET */
+  g_array_append_val (self->resources, default_target);
+}
+
+CgGraph *
+cg_graph_new (CgGpu *self)
+{
+  CgGraph *graph = NULL;
+
+  g_return_val_if_fail (self != NULL, NULL);
+
+  graph = g_new0 (CgGraph, 1);
+  g_atomic_ref_count_init (&graph->refcount);
+  graph->gpu = cg_gpu_ref (self);
+
+  graph->resources = g_array_new (FALSE, TRUE, sizeof (GraphResource));
+  g_array_set_clear_func (graph->resources, clear_resource);
+  graph->passes = g_array_new (FALSE, TRUE, sizeof (GraphPass));
+  g_array_set_clear_func (graph->passes, clear_pass);
+  graph->pool = g_ptr_array_new_with_free_func (cg_texture_unref);
+  graph->current_pass = NO_INDEX;
+
+  init_resources (graph);
+
+  return graph;
+}
+
+CgGraph *
+cg_graph_ref (CgGraph *self)
+{
+  g_return_val_if_fail (self != NULL, NULL);
+
+  g_atomic_ref_count_inc (&self->refcount);
+  return self;
+}
+
+void
+cg_graph_unref (gpointer self)
+{
+  CgGraph *graph = self;
+
+  g_return_if_fail (self != NULL);
+
+  if (g_atomic_ref_count_dec (&graph->refcount))
+    {
+      g_clear_pointer (&graph->passes, g_array_unref);
+      g_clear_pointer (&graph->resources, g_array_unref);
+      g_clear_pointer (&graph->pool, g_ptr_array_unref);
+      g_clear_pointer (&graph->gpu, cg_gpu_unref);
+      g_free (graph);
+    }
+}
+
+static guint
+add_resource (CgGraph *self,
+              const GraphResource *resource)
+{
+  g_array_append_vals (self->resources, resource, 1);
+  return self->resources->len - 1;
+}
+
+guint
+cg_graph_import_texture (
+    CgGraph *self,
+    CgTexture *texture)
+{
+  GraphResource resource = { 0 };
+
+  g_return_val_if_fail (self != NULL, 0);
+  g_return_val_if_fail (texture != NULL, 0);
+
+  resource.texture = cg_texture_ref (texture);
+  resource.width = texture->init.width;
+  resource.height = texture->init.height;
+  resource.format = texture->init.format;
+  resource.msaa = texture->init.msaa;
+
+  return add_resource (self, &resource);
+}
+
+guint
+cg_graph_create_texture (
+    CgGraph *self,
+    int width,
+    int height,
+    int format,
+    int msaa)
+{
+  GraphResource resource = { 0 };
+
+  g_return_val_if_fail (self != NULL, 0);
+  g_return_val_if_fail (width > 0, 0);
+  g_return_val_if_fail (height > 0, 0);
+  g_return_val_if_fail (format > CG_FORMAT_0 && format < CG_N_FORMATS, 0);
+  g_return_val_if_fail (msaa >= 0, 0);
+
+  resource.transient = TRUE;
+  resource.width = width;
+  resource.height = height;
+  resource.format = format;
+  resource.msaa = msaa;
+
+  return add_resource (self, &resource);
+}
+
+guint
+cg_graph_create_depth (
+    CgGraph *self,
+    int width,
+    int height,
+    int msaa)
+{
+  GraphResource resource = { 0 };
+
+  g_return_val_if_fail (self != NULL, 0);
+  g_return_val_if_fail (width > 0, 0);
+  g_return_val_if_fail (height > 0, 0);
+  g_return_val_if_fail (msaa >= 0, 0);
+
+  resource.transient = TRUE;
+  resource.width = width;
+  resource.height = height;
+  resource.format = CG_PRIV_FORMAT_DEPTH;
+  resource.msaa = msaa;
+
+  return add_resource (self, &resource);
+}
+
+void
+cg_graph_export (
+    CgGraph *self,
+    guint resource)
+{
+  g_return_if_fail (self != NULL);
+  g_return_if_fail (resource > CG_GRAPH_DEFAULT_TARGET);
+  g_return_if_fail (resource < self->resources->len);
+
+  g_array_index (self->resources, GraphResource, resource).exported = TRUE;
+}
+
+guint
+cg_graph_add_pass (
+    CgGraph *self,
+    const char *name,
+    CgGraphPassFunc func,
+    gpointer user_data,
+    GDestroyNotify destroy_user_data)
+{
+  GraphPass pass = { 0 };
+
+  g_return_val_if_fail (self != NULL, 0);
+  g_return_val_if_fail (name != NULL, 0);
+  g_return_val_if_fail (func != NULL, 0);
+
+  pass.name = g_strdup (name);
+  pass.func = func;
+  pass.user_data = user_data;
+  pass.destroy_user_data = destroy_user_data;
+  pass.reads = g_array_new (FALSE, FALSE, sizeof (guint));
+  pass.writes = g_array_new (FALSE, FALSE, sizeof (guint));
+
+  g_array_append_val (self->passes, pass);
+  return self->passes->len - 1;
+}
+
+static gboolean
+array_contains (GArray *array,
+                guint val)
+{
+  for (guint i = 0; i < array->len; i++)
+    if (g_array_index (array, guint, i) == val)
+      return TRUE;
+  return FALSE;
+}
+
+void
+cg_graph_pass_read (
+    CgGraph *self,
+    guint pass,
+    guint resource)
+{
+  GraphPass *graph_pass = NULL;
+
+  g_return_if_fail (self != NULL);
+  g_return_if_fail (pass < self->passes->len);
+  g_return_if_fail (resource > CG_GRAPH_DEFAULT_TARGET);
+  g_return_if_fail (resource < self->resources->len);
+
+  graph_pass = &g_array_index (self->passes, GraphPass, pass);
+  if (!array_contains (graph_pass->reads, resource))
+    g_array_append_val (graph_pass->reads, resource);
+}
+
+void
+cg_graph_pass_write (
+    CgGraph *self,
+    guint pass,
+    guint resource)
+{
+  GraphPass *graph_pass = NULL;
+
+  g_return_if_fail (self != NULL);
+  g_return_if_fail (pass < self->passes->len);
+  g_return_if_fail (resource < self->resources->len);
+
+  graph_pass = &g_array_index (self->passes, GraphPass, pass);
+  if (!array_contains (graph_pass->writes, resource))
+    g_array_append_val (graph_pass->writes, resource);
+}
+
+CgTexture *
+cg_graph_get_texture (
+    CgGraph *self,
+    guint resource)
+{
+  GraphResource *graph_resource = NULL;
+
+  g_return_val_if_fail (self != NULL, NULL);
+  g_return_val_if_fail (resource < self->resources->len, NULL);
+
+  graph_resource = &g_array_index (self->resources, GraphResource, resource);
+
+  if (graph_resource->resolved != 0 && self->current_pass != NO_INDEX)
+    {
+      GraphPass *pass = NULL;
+
+      pass = &g_array_index (self->passes, GraphPass, self->current_pass);
+      if (!array_contains (pass->writes, resource))
+        graph_resource = &g_array_index (self->resources, GraphResource, graph_resource->resolved);
+    }
+
+  if (graph_resource->texture == NULL && graph_resource->transient)
+    CG_PRIV_CRITICAL ("Transient resource %u has no texture "
+                      "assigned, is the graph compiled?",
+                      resource);
+
+  return graph_resource->texture;
+}
+
+void
+cg_graph_reset (CgGraph *self)
+{
+  g_return_if_fail (self != NULL);
+
+  g_array_set_size (self->passes, 0);
+  g_array_set_size (self->resources, 0);
+  init_resources (self);
+  self->current_pass = NO_INDEX;
+}
+
+static gboolean
+validate_passes (CgGraph *self,
+                 GError **error)
+{
+  for (guint i = 0; i < self->passes->len; i++)
+    {
+      GraphPass *pass = &g_array_index (self->passes, GraphPass, i);
+
+      for (guint j = 0; j < pass->reads->len; j++)
+        {
+          guint resource = g_array_index (pass->reads, guint, j);
+
+          if (array_contains (pass->writes, resource))
+            {
+              g_set_error (
+                  error, CG_ERROR, CG_ERROR_INVALID_GRAPH,
+                  "Pass \"%s\" both reads and writes resource %u",
+                  pass->name, resource);
+              return FALSE;
+            }
+        }
+
+      if (pass->writes->len > 1
+          && array_contains (pass->writes, CG_GRAPH_DEFAULT_TARGET))
+        {
+          g_set_error (
+              error, CG_ERROR, CG_ERROR_INVALID_GRAPH,
+              "Pass \"%s\" writes both the default "
+              "target and textures",
+              pass->name);
+          return FALSE;
+        }
+    }
+
+  return TRUE;
+}
+
+static gboolean
+pass_writes (GraphPass *pass,
+             guint resource)
+{
+  return array_contains (pass->writes, resource);
+}
+
+/* Every write makes a new version of a resource, in the
+ * order the passes were added. A pass reads the version
+ * made by the last writer added before it, or the initial
+ * contents when there is none. */
+static guint
+find_writer_before (CgGraph *self,
+                    guint resource,
+                    guint before)
+{
+  for (guint i = before; i > 0; i--)
+    {
+      GraphPass *pass = &g_array_index (self->passes, GraphPass, i - 1);
+
+      if (pass->resolve_src == 0 && pass_writes (pass, resource))
+        return i - 1;
+    }
+
+  return NO_INDEX;
+}
+
+static void
+mark_live (CgGraph *self,
+           GArray *stack,
+           guint idx)
+{
+  GraphPass *pass = &g_array_index (self->passes, GraphPass, idx);
+
+  if (pass->live || pass->resolve_src != 0)
+    return;
+
+  pass->live = TRUE;
+  g_array_append_val (stack, idx);
+}
+
+/* Walk backwards from passes with side effects. A live pass
+ * keeps alive the writer of each version it reads, as well
+ * as earlier writers of the resources it writes. */
+static void
+mark_live_passes (CgGraph *self)
+{
+  g_autoptr (GArray) stack = NULL;
+
+  stack = g_array_new (FALSE, FALSE, sizeof (guint));
+
+  for (guint i = 0; i < self->passes->len; i++)
+    g_array_index (self->passes, GraphPass, i).live = FALSE;
+
+  for (guint i = 0; i < self->passes->len; i++)
+    {
+      GraphPass *pass = &g_array_index (self->passes, GraphPass, i);
+
+      /* Resolves are scheduled separately */
+      if (pass->resolve_src != 0)
+        continue;
+
+      for (guint j = 0; j < pass->writes->len; j++)
+        {
+          guint resource = g_array_index (pass->writes, guint, j);
+
+          if (resource == CG_GRAPH_DEFAULT_TARGET
+              || g_array_index (self->resources, GraphResource, resource).exported)
+            {
+              mark_live (self, stack, i);
+              break;
+            }
+        }
+    }
+
+  while (stack->len > 0)
+    {
+      guint idx = g_array_index (stack, guint, stack->len - 1);
+      GraphPass *pass = &g_array_index (self->passes, GraphPass, idx);
+
+      g_array_set_size (stack, stack->len - 1);
+
+      for (guint j = 0; j < pass->reads->len; j++)
+        {
+          guint writer = find_writer_before (self, g_array_index (pass->reads, guint, j), idx);
+
+          if (writer != NO_INDEX)
+            mark_live (self, stack, writer);
+        }
+
+      for (guint i = 0; i < idx; i++)
+        {
+          GraphPass *other = &g_array_index (self->passes, GraphPass, i);
+
+          for (guint j = 0; j < pass->writes->len; j++)
+            {
+              if (pass_writes (other, g_array_index (pass->writes, guint, j)))
+                {
+                  mark_live (self, stack, i);
+                  break;
+                }
+            }
+        }
+    }
+}
+
+/* A reader runs after the writer of the version it reads,
+ * and a writer runs after earlier writers and readers of
+ * the same resource, so it can't clobber a version which
+ * is still needed. */
+static gboolean
+depends_on (CgGraph *self,
+            guint pass_idx,
+            guint other_idx)
+{
+  GraphPass *pass = &g_array_index (self->passes, GraphPass, pass_idx);
+  GraphPass *other = &g_array_index (self->passes, GraphPass, other_idx);
+
+  for (guint i = 0; i < pass->reads->len; i++)
+    if (find_writer_before (self, g_array_index (pass->reads, guint, i), pass_idx) == other_idx)
+      return TRUE;
+
+  if (other_idx < pass_idx)
+    {
+      for (guint i = 0; i < pass->writes->len; i++)
+        {
+          guint resource = g_array_index (pass->writes, guint, i);
+
+          if (pass_writes (other, resource)
+              || array_contains (other->reads, resource))
+            return TRUE;
+        }
+    }
+
+  return FALSE;
+}
+
+/* Kahn's algorithm, always picking the earliest declared
+ * pass among those that are ready so the result is stable */
+static GArray *
+sort_live_passes (CgGraph *self,
+                  GError **error)
+{
+  g_autoptr (GArray) order = NULL;
+  g_autofree guint *n_deps = NULL;
+  g_autofree gboolean *emitted = NULL;
+  guint n_live = 0;
+
+  order = g_array_new (FALSE, FALSE, sizeof (guint));
+  n_deps = g_new0 (guint, self->passes->len);
+  emitted = g_new0 (gboolean, self->passes->len);
+
+  for (guint i = 0; i < self->passes->len; i++)
+    {
+      GraphPass *pass = &g_array_index (self->passes, GraphPass, i);
+
+      if (!pass->live)
+        continue;
+      n_live++;
+
+      for (guint j = 0; j < self->passes->len; j++)
+        {
+          GraphPass *other = &g_array_index (self->passes, GraphPass, j);
+
+          if (i != j && other->live && depends_on (self, i, j))
+            n_deps[i]++;
+        }
+    }
+
+  while (order->len < n_live)
+    {
+      guint next = NO_INDEX;
+
+      for (guint i = 0; i < self->passes->len; i++)
+        {
+          GraphPass *pass = &g_array_index (self->passes, GraphPass, i);
+
+          if (pass->live && !emitted[i] && n_deps[i] == 0)
+            {
+              next = i;
+              break;
+            }
+        }
+
+      if (next == NO_INDEX)
+        {
+          for (guint i = 0; i < self->passes->len; i++)
+            {
+              GraphPass *pass = &g_array_index (self->passes, GraphPass, i);
+
+              if (pass->live && !emitted[i])
+                {
+                  g_set_error (
+                      error, CG_ERROR, CG_ERROR_INVALID_GRAPH,
+                      "Dependency cycle involving pass \"%s\"",
+                      pass->name);
+                  break;
+                }
+            }
+          return NULL;
+        }
+
+      emitted[next] = TRUE;
+      g_array_append_val (order, next);
+
+      for (guint i = 0; i < self->passes->len; i++)
+        {
+          GraphPass *pass = &g_array_index (self->passes, GraphPass, i);
+
+          if (pass->live && !emitted[i] && depends_on (self, i, next))
+            n_deps[i]--;
+        }
+    }
+
+  return g_steal_pointer (&order);
+}
+
+static guint
+find_resolve_pass (CgGraph *self,
+                   guint src)
+{
+  for (guint i = 0; i < self->passes->len; i++)
+    if (g_array_index (self->passes, GraphPass, i).resolve_src == src)
+      return i;
+  return NO_INDEX;
+}
+
+/* Passes that sample a multisampled resource get a single
+ * resolved copy of each version, made right before the
+ * first of them runs. The resolve passes and resources are
+ * created once and reused by later compilations of the
+ * same graph. */
+static void
+insert_resolves (CgGraph *self,
+                 GArray *order)
+{
+  g_autoptr (GArray) handled = NULL;
+
+  handled = g_array_new (FALSE, FALSE, sizeof (guint));
+
+  for (guint step = 0; step < order->len; step++)
+    {
+      guint idx = g_array_index (order, guint, step);
+
+      for (guint i = 0; i < g_array_index (self->passes, GraphPass, idx).reads->len; i++)
+        {
+          guint src = g_array_index (g_array_index (self->passes, GraphPass, idx).reads, guint, i);
+          GraphResource *resource = NULL;
+          guint resolve_idx = 0;
+
+          resource = &g_array_index (self->resources, GraphResource, src);
+          if (resource->msaa == 0 || array_contains (handled, src))
+            continue;
+
+          if (resource->resolved == 0)
+            {
+              GraphResource resolved = { 0 };
+
+              resolved.transient = TRUE;
+              resolved.width = resource->width;
+              resolved.height = resource->height;
+              resolved.format = resource->format;
+              resolved.msaa = 0;
+              /* `resource` is invalidated by this */
+              g_array_index (self->resources, GraphResource, src).resolved = add_resource (self, &resolved);
+            }
+
+          resolve_idx = find_resolve_pass (self, src);
+          if (resolve_idx == NO_INDEX)
+            {
+              GraphPass resolve = { 0 };
+              guint dest = g_array_index (self->resources, GraphResource, src).resolved;
+
+              resolve.name = g_strdup_printf ("resolve %u", src);
+              resolve.reads = g_array_new (FALSE, FALSE, sizeof (guint));
+              resolve.writes = g_array_new (FALSE, FALSE, sizeof (guint));
+              g_array_append_val (resolve.reads, src);
+              g_array_append_val (resolve.writes, dest);
+              resolve.resolve_src = src;
+
+              g_array_append_val (self->passes, resolve);
+              resolve_idx = self->passes->len - 1;
+            }
+
+          g_array_index (self->passes, GraphPass, resolve_idx).live = TRUE;
+          g_array_insert_val (order, step, resolve_idx);
+          g_array_append_val (handled, src);
+          step++;
+        }
+
+      /* A new version needs resolving again */
+      for (guint i = 0; i < g_array_index (self->passes, GraphPass, idx).writes->len; i++)
+        {
+          guint dest = g_array_index (g_array_index (self->passes, GraphPass, idx).writes, guint, i);
+
+          for (guint j = 0; j < handled->len; j++)
+            {
+              if (g_array_index (handled, guint, j) == dest)
+                {
+                  g_array_remove_index_fast (handled, j);
+                  break;
+                }
+            }
+        }
+    }
+}
+
+static gboolean
+texture_matches (CgTexture *texture,
+                 GraphResource *resource)
+{
+  return texture->init.width == resource->width
+         && texture->init.height == resource->height
+         && texture->init.format == resource->format
+         && texture->init.msaa == resource->msaa
+         && !texture->init.cubemap
+         && texture->init.mipmaps == 0;
+}
+
+/* Greedy interval assignment: transient resources are visited
+ * in order of first use and take any pooled texture with an
+ * identical description that is no longer in use. */
+static void
+assign_transients (CgGraph *self,
+                   GArray *order)
+{
+  g_autoptr (GPtrArray) old_pool = NULL;
+  g_autoptr (GArray) busy_until = NULL;
+  g_autoptr (GArray) by_first_use = NULL;
+
+  for (guint i = 0; i < self->resources->len; i++)
+    {
+      GraphResource *resource = &g_array_index (self->resources, GraphResource, i);
+
+      resource->first_step = NO_INDEX;
+      resource->last_step = 0;
+    }
+
+  for (guint step = 0; step < order->len; step++)
+    {
+      GraphPass *pass = &g_array_index (self->passes, GraphPass, g_array_index (order, guint, step));
+
+      for (guint k = 0; k < 2; k++)
+        {
+          GArray *uses = k == 0 ? pass->reads : pass->writes;
+
+          for (guint i = 0; i < uses->len; i++)
+            {
+              guint idx = g_array_index (uses, guint, i);
+              GraphResource *resource = &g_array_index (self->resources, GraphResource, idx);
+
+              /* Readers other than the resolve itself use the copy */
+              if (k == 0 && resource->resolved != 0 && pass->resolve_src != idx)
+                resource = &g_array_index (self->resources, GraphResource, resource->resolved);
+
+              resource->first_step = MIN (resource->first_step, step);
+              resource->last_step = MAX (resource->last_step, step);
+            }
+        }
+    }
+
+  by_first_use = g_array_new (FALSE, FALSE, sizeof (guint));
+  for (guint i = 0; i < self->resources->len; i++)
+    {
+      GraphResource *resource = &g_array_index (self->resources, GraphResource, i);
+
+      if (!resource->transient || resource->first_step == NO_INDEX)
+        continue;
+      if (resource->exported)
+        resource->last_step = order->len;
+
+      g_array_append_val (by_first_use, i);
+    }
+
+  /* Insertion sort, these arrays are tiny */
+  for (guint i = 1; i < by_first_use->len; i++)
+    {
+      guint val = g_array_index (by_first_use, guint, i);
+      guint first = g_array_index (self->resources, GraphResource, val).first_step;
+      guint j = i;
+
+      for (; j > 0; j--)
+        {
+          guint prev = g_array_index (by_first_use, guint, j - 1);
+
+          if (g_array_index (self->resources, GraphResource, prev).first_step <= first)
+            break;
+          g_array_index (by_first_use, guint, j) = prev;
+        }
+      g_array_index (by_first_use, guint, j) = val;
+    }
+
+  old_pool = g_steal_pointer (&self->pool);
+  self->pool = g_ptr_array_new_with_free_func (cg_texture_unref);
+  busy_until = g_array_new (FALSE, FALSE, sizeof (guint));
+
+  for (guint i = 0; i < by_first_use->len; i++)
+    {
+      GraphResource *resource = NULL;
+      CgTexture *texture = NULL;
+
+      resource = &g_array_index (self->resources, GraphResource, g_array_index (by_first_use, guint, i));
+
+      for (guint j = 0; j < self->pool->len; j++)
+        {
+          if (g_array_index (busy_until, guint, j) < resource->first_step
+              && texture_matches (g_ptr_array_index (self->pool, j), resource))
+            {
+              texture = g_ptr_array_index (self->pool, j);
+              g_array_index (busy_until, guint, j) = resource->last_step;
+              break;
+            }
+        }
+
+      if (texture == NULL)
+        {
+          for (guint j = 0; j < old_pool->len; j++)
+            {
+              if (texture_matches (g_ptr_array_index (old_pool, j), resource))
+                {
+                  texture = g_ptr_array_steal_index_fast (old_pool, j);
+                  break;
+                }
+            }
+
+          if (texture == NULL)
+            {
+              if (resource->format == CG_PRIV_FORMAT_DEPTH)
+                texture = cg_texture_new_depth (
+                    self->gpu, resource->width, resource->height, resource->msaa);
+              else
+                texture = cg_texture_new_for_data (
+                    self->gpu, NULL, 0, resource->width, resource->height,
+                    resource->format, 0, resource->msaa);
+            }
+
+          g_ptr_array_add (self->pool, texture);
+          g_array_append_val (busy_until, resource->last_step);
+        }
+
+      CG_PRIV_REPLACE_POINTER_REF (
+          &resource->texture, texture,
+          cg_texture_ref, cg_texture_unref);
+    }
+
+  /* Anything left in `old_pool` wasn't needed this time */
+}
+
+static void
+record_pass (CgGraph *self,
+             CgPlan *plan,
+             guint idx)
+{
+  GraphPass *pass = &g_array_index (self->passes, GraphPass, idx);
+  guint group = 0;
+  gboolean pushed = FALSE;
+
+  self->current_pass = idx;
+
+  if (pass->writes->len > 0
+      && g_array_index (pass->writes, guint, 0) != CG_GRAPH_DEFAULT_TARGET)
+    {
+      g_autofree CgValue *values = NULL;
+      g_autofree const CgValue **targets = NULL;
+      GraphResource *first = NULL;
+
+      values = g_new0 (CgValue, pass->writes->len);
+      targets = g_new0 (const CgValue *, pass->writes->len);
+
+      for (guint i = 0; i < pass->writes->len; i++)
+        {
+          GraphResource *resource = NULL;
+
+          resource = &g_array_index (self->resources, GraphResource, g_array_index (pass->writes, guint, i));
+          values[i].type = CG_TYPE_TEXTURE;
+          values[i].texture = resource->texture;
+          targets[i] = &values[i];
+        }
+
+      first = &g_array_index (self->resources, GraphResource, g_array_index (pass->writes, guint, 0));
+
+      cg_plan_begin_config (plan);
+      cg_plan_config_targets_v (plan, targets, pass->writes->len);
+      cg_plan_config_dest (plan, 0, 0, first->width, first->height);
+      cg_plan_push_group (plan);
+      pushed = TRUE;
+    }
+
+  group = plan->cur_node;
+
+  if (pass->resolve_src != 0)
+    cg_plan_blit (plan, g_array_index (self->resources, GraphResource, pass->resolve_src).texture);
+  else
+    pass->func (self, plan, pass->user_data);
+
+  if (plan->configuring != NULL)
+    {
+      CG_PRIV_CRITICAL ("Pass \"%s\" left a group configuring", pass->name);
+      cg_plan_push_group (plan);
+    }
+  if (plan->cur_node != group)
+    {
+      CG_PRIV_CRITICAL ("Pass \"%s\" did not pop all of its groups", pass->name);
+      while (plan->cur_node != CG_PRIV_NO_NODE && plan->cur_node != group)
+        cg_plan_pop (plan);
+    }
+
+  if (pushed)
+    cg_plan_pop (plan);
+
+  self->current_pass = NO_INDEX;
+}
+
+CgPlan *
+cg_graph_compile (
+    CgGraph *self,
+    GError **error)
+{
+  g_autoptr (GArray) order = NULL;
+  g_autoptr (CgPlan) plan = NULL;
+
+  g_return_val_if_fail (self != NULL, NULL);
+  g_return_val_if_fail (self->current_pass == NO_INDEX, NULL);
+
+  if (!validate_passes (self, error))
+    return NULL;
+
+  mark_live_passes (self);
+
+  order = sort_live_passes (self, error);
+  if (order == NULL)
+    return NULL;
+
+  for (guint step = 0; step < order->len; step++)
+    {
+      GraphPass *pass = &g_array_index (self->passes, GraphPass, g_array_index (order, guint, step));
+
+      for (guint i = 0; i < pass->reads->len; i++)
+        {
+          guint idx = g_array_index (pass->reads, guint, i);
+          GraphResource *resource = &g_array_index (self->resources, GraphResource, idx);
+          gboolean written = FALSE;
+
+          if (!resource->transient)
+            continue;
+
+          for (guint j = 0; j < step && !written; j++)
+            written = pass_writes (
+                &g_array_index (self->passes, GraphPass, g_array_index (order, guint, j)),
+                idx);
+
+          if (!written)
+            {
+              g_set_error (
+                  error, CG_ERROR, CG_ERROR_INVALID_GRAPH,
+                  "Pass \"%s\" reads transient resource %u "
+                  "which is never written",
+                  pass->name, idx);
+              return NULL;
+            }
+        }
+    }
+
+  insert_resolves (self, order);
+  assign_transients (self, order);
+
+  plan = cg_plan_new (self->gpu);
+  cg_plan_begin_config (plan);
+  cg_plan_push_group (plan);
+
+  for (guint step = 0; step < order->len; step++)
+    record_pass (self, plan, g_array_index (order, guint, step));
+
+  return g_steal_pointer (&plan);
+}
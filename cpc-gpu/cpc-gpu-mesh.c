@@ -0,0 +1,687 @@
+/* cpc-gpu-mesh.c
+ *
+ * Copyright 2025 Adam Masciola
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+#define G_LOG_DOMAIN "CpcGpuMesh"
+#include "cpc-gpu-private.h"
+
+#include <string.h>
+
+#define DEFAULT_CACHE_SIZE 16
+#define NO_VERTEX G_MAXUINT32
+
+/* Below these sizes a job isn't worth a thread */
+#define MIN_VERTICES_PER_JOB (1 << 15)
+#define MIN_TRIANGLES_PER_JOB (1 << 14)
+#define MAX_JOBS 64
+
+/* Hash tables are sized to twice their entries, so this
+ * keeps their capacity from overflowing a gsize */
+#define MAX_INPUT_VERTICES MIN (G_MAXUINT32 - 1, G_MAXSIZE / (4 * sizeof (guint32)))
+
+static guint
+get_n_jobs (guint n_items,
+            guint min_items_per_job)
+{
+  guint n_jobs = 0;
+
+  n_jobs = MIN (g_get_num_processors (), n_items / min_items_per_job);
+  return CLAMP (n_jobs, 1, MAX_JOBS);
+}
+
+/* The smallest power of two that keeps an open
+ * addressing table of `n_entries` at most half full */
+static gsize
+get_table_capacity (gsize n_entries)
+{
+  gsize capacity = 2;
+
+  g_assert (n_entries <= MAX_INPUT_VERTICES);
+
+  while (capacity < n_entries * 2)
+    capacity <<= 1;
+  return capacity;
+}
+
+/* Runs `func` over `n_jobs` elements of `jobs`, with
+ * the first job executing on the calling thread. */
+static void
+run_jobs (GThreadFunc func,
+          gpointer jobs,
+          gsize job_size,
+          guint n_jobs)
+{
+  GThread *threads[MAX_JOBS] = { 0 };
+
+  g_assert (n_jobs > 0 && n_jobs <= MAX_JOBS);
+
+  for (guint i = 1; i < n_jobs; i++)
+    threads[i] = g_thread_new ("cg-mesh", func, (guchar *)jobs + i * job_size);
+
+  func (jobs);
+
+  for (guint i = 1; i < n_jobs; i++)
+    g_thread_join (threads[i]);
+}
+
+static inline guint32
+hash_vertex (const guchar *vertex,
+             gsize stride)
+{
+  /* FNV-1a */
+  guint32 hash = 2166136261u;
+
+  for (gsize i = 0; i < stride; i++)
+    {
+      hash ^= vertex[i];
+      hash *= 16777619u;
+    }
+
+  return hash;
+}
+
+typedef struct
+{
+  const guchar *data;
+  gsize stride;
+  guint n_vertices;
+  guint32 *hashes;
+  guint32 *first;
+
+  guint start;
+  guint end;
+  guint partition;
+  guint n_partitions;
+} DedupJob;
+
+static gpointer
+hash_vertices_job (gpointer user_data)
+{
+  DedupJob *job = user_data;
+
+  for (guint i = job->start; i < job->end; i++)
+    job->hashes[i] = hash_vertex (job->data + (gsize)i * job->stride, job->stride);
+
+  return NULL;
+}
+
+/* Every job scans the whole mesh but only considers vertices
+ * whose hash falls into its partition, so no two jobs ever
+ * touch the same entry of `first`. */
+static gpointer
+dedup_partition_job (gpointer user_data)
+{
+  DedupJob *job = user_data;
+  g_autofree guint32 *table = NULL;
+  guint n_members = 0;
+  gsize capacity = 0;
+  gsize mask = 0;
+
+  for (guint i = 0; i < job->n_vertices; i++)
+    if (job->hashes[i] % job->n_partitions == job->partition)
+      n_members++;
+  if (n_members == 0)
+    return NULL;
+
+  capacity = get_table_capacity (n_members);
+  mask = capacity - 1;
+
+  table = g_malloc_n (capacity, sizeof (*table));
+  memset (table, 0xff, capacity * sizeof (*table));
+
+  for (guint i = 0; i < job->n_vertices; i++)
+    {
+      guint32 hash = job->hashes[i];
+      gsize slot = 0;
+
+      if (hash % job->n_partitions != job->partition)
+        continue;
+
+      slot = (hash / job->n_partitions) & mask;
+      for (;;)
+        {
+          guint32 candidate = table[slot];
+
+          if (candidate == NO_VERTEX)
+            {
+              table[slot] = i;
+              job->first[i] = i;
+              break;
+            }
+          if (job->hashes[candidate] == hash
+              && memcmp (job->data + (gsize)candidate * job->stride,
+                         job->data + (gsize)i * job->stride,
+                         job->stride) == 0)
+            {
+              job->first[i] = candidate;
+              break;
+            }
+
+          slot = (slot + 1) & mask;
+        }
+    }
+
+  return NULL;
+}
+
+/* Returns the number of unique vertices and fills `remap`
+ * with the new index of every input vertex. */
+static guint
+deduplicate (const guchar *data,
+             gsize stride,
+             guint n_vertices,
+             guint32 *remap)
+{
+  g_autofree guint32 *hashes = NULL;
+  g_autofree guint32 *first = NULL;
+  DedupJob jobs[MAX_JOBS] = { 0 };
+  guint n_jobs = 0;
+  guint n_unique = 0;
+
+  hashes = g_malloc_n (n_vertices, sizeof (*hashes));
+  first = g_malloc_n (n_vertices, sizeof (*first));
+
+  n_jobs = get_n_jobs (n_vertices, MIN_VERTICES_PER_JOB);
+  for (guint i = 0; i < n_jobs; i++)
+    {
+      jobs[i].data = data;
+      jobs[i].stride = stride;
+      jobs[i].n_vertices = n_vertices;
+      jobs[i].hashes = hashes;
+      jobs[i].first = first;
+      jobs[i].start = (guint64)n_vertices * i / n_jobs;
+      jobs[i].end = (guint64)n_vertices * (i + 1) / n_jobs;
+      jobs[i].partition = i;
+      jobs[i].n_partitions = n_jobs;
+    }
+
+  run_jobs (hash_vertices_job, jobs, sizeof (*jobs), n_jobs);
+  run_jobs (dedup_partition_job, jobs, sizeof (*jobs), n_jobs);
+
+  /* first[i] <= i, so earlier entries are always resolved */
+  for (guint i = 0; i < n_vertices; i++)
+    {
+      if (first[i] == i)
+        remap[i] = n_unique++;
+      else
+        remap[i] = remap[first[i]];
+    }
+
+  return n_unique;
+}
+
+typedef struct
+{
+  const guint32 *indices;
+  guint32 *output;
+  guint n_triangles;
+  guint cache_size;
+} CacheJob;
+
+static inline guint32
+get_local_vertex (guint32 *keys,
+                  guint32 *values,
+                  gsize mask,
+                  guint32 vertex,
+                  guint32 *n_local)
+{
+  gsize slot = (guint32)(vertex * 2654435761u) & mask;
+
+  for (;;)
+    {
+      if (keys[slot] == NO_VERTEX)
+        {
+          keys[slot] = vertex;
+          values[slot] = (*n_local)++;
+          return values[slot];
+        }
+      if (keys[slot] == vertex)
+        return values[slot];
+
+      slot = (slot + 1) & mask;
+    }
+}
+
+/* Tipsify: Sander, Nehab and Barczak, "Fast Triangle Reordering
+ * for Vertex Locality and Reduced Overdraw", SIGGRAPH 2007.
+ *
+ * Vertices are first remapped to ids local to this run of
+ * triangles, so the working set scales with the job rather
+ * than with the whole mesh. */
+static gpointer
+optimize_cache_job (gpointer user_data)
+{
+  CacheJob *job = user_data;
+  guint n_indices = job->n_triangles * 3;
+  gsize capacity = 0;
+  guint32 n_local = 0;
+  g_autofree guint32 *keys = NULL;
+  g_autofree guint32 *values = NULL;
+  g_autofree guint32 *local = NULL;
+  g_autofree guint32 *local_to_global = NULL;
+  g_autofree guint32 *offsets = NULL;
+  g_autofree guint32 *adjacency = NULL;
+  g_autofree guint32 *live = NULL;
+  g_autofree guint32 *timestamps = NULL;
+  g_autofree guint32 *dead_ends = NULL;
+  g_autofree guint32 *candidates = NULL;
+  g_autofree guint8 *emitted = NULL;
+  guint n_dead_ends = 0;
+  guint32 fanning = 0;
+  guint32 timestamp = 0;
+  guint cursor = 0;
+  guint n_output = 0;
+
+  if (job->n_triangles == 0)
+    return NULL;
+
+  capacity = get_table_capacity (n_indices);
+  keys = g_malloc_n (capacity, sizeof (*keys));
+  values = g_malloc_n (capacity, sizeof (*values));
+  memset (keys, 0xff, capacity * sizeof (*keys));
+
+  local = g_malloc_n (n_indices, sizeof (*local));
+  local_to_global = g_malloc_n (n_indices, sizeof (*local_to_global));
+  for (guint i = 0; i < n_indices; i++)
+    {
+      guint32 vertex = job->indices[i];
+      guint32 n_local_before = n_local;
+
+      local[i] = get_local_vertex (keys, values, capacity - 1, vertex, &n_local);
+      if (n_local != n_local_before)
+        local_to_global[local[i]] = vertex;
+    }
+  g_clear_pointer (&keys, g_free);
+  g_clear_pointer (&values, g_free);
+
+  /* Vertex to triangle adjacency */
+  offsets = g_malloc0_n (n_local + 1, sizeof (*offsets));
+  live = g_malloc0_n (n_local, sizeof (*live));
+  for (guint i = 0; i < n_indices; i++)
+    live[local[i]]++;
+  for (guint i = 0; i < n_local; i++)
+    offsets[i + 1] = offsets[i] + live[i];
+
+  adjacency = g_malloc_n (n_indices, sizeof (*adjacency));
+  timestamps = g_malloc0_n (n_local, sizeof (*timestamps));
+  /* Borrow timestamps as fill cursors before they are needed */
+  for (guint i = 0; i < n_indices; i++)
+    adjacency[offsets[local[i]] + timestamps[local[i]]++] = i / 3;
+  memset (timestamps, 0, n_local * sizeof (*timestamps));
+
+  dead_ends = g_malloc_n (n_indices, sizeof (*dead_ends));
+  candidates = g_malloc_n (n_indices, sizeof (*candidates));
+  emitted = g_malloc0_n (job->n_triangles, sizeof (*emitted));
+
+  fanning = local[0];
+  timestamp = job->cache_size + 1;
+
+  while (fanning != NO_VERTEX)
+    {
+      guint n_candidates = 0;
+      guint32 best = NO_VERTEX;
+      guint32 best_priority = 0;
+
+      for (guint32 a = offsets[fanning]; a < offsets[fanning + 1]; a++)
+        {
+          guint32 triangle = adjacency[a];
+
+          if (emitted[triangle])
+            continue;
+
+          for (guint k = 0; k < 3; k++)
+            {
+              guint32 vertex = local[triangle * 3 + k];
+
+              job->output[n_output++] = local_to_global[vertex];
+              dead_ends[n_dead_ends++] = vertex;
+              candidates[n_candidates++] = vertex;
+              live[vertex]--;
+
+              if (timestamp - timestamps[vertex] > job->cache_size)
+                timestamps[vertex] = timestamp++;
+            }
+
+          emitted[triangle] = TRUE;
+        }
+
+      /* Prefer the oldest candidate that will still
+       * be in the cache after its fan is emitted */
+      for (guint i = 0; i < n_candidates; i++)
+        {
+          guint32 vertex = candidates[i];
+          guint32 priority = 0;
+
+          if (live[vertex] == 0)
+            continue;
+
+          if (timestamp - timestamps[vertex] + 2 * live[vertex] <= job->cache_size)
+            priority = timestamp - timestamps[vertex];
+
+          if (priority > best_priority)
+            {
+              best = vertex;
+              best_priority = priority;
+            }
+        }
+
+      if (best == NO_VERTEX)
+        {
+          while (n_dead_ends > 0)
+            {
+              guint32 vertex = dead_ends[--n_dead_ends];
+
+              if (live[vertex] > 0)
+                {
+                  best = vertex;
+                  break;
+                }
+            }
+        }
+
+      if (best == NO_VERTEX)
+        {
+          for (; cursor < job->n_triangles; cursor++)
+            {
+              if (!emitted[cursor])
+                {
+                  best = local[cursor * 3];
+                  break;
+                }
+            }
+        }
+
+      fanning = best;
+    }
+
+  g_assert (n_output == n_indices);
+  return NULL;
+}
+
+/* Rewrites `indices` in breadth-first order over shared
+ * vertices, so that contiguous runs of triangles cover
+ * connected regions of the surface regardless of the
+ * order they were submitted in. */
+static void
+order_by_connectivity (guint32 *indices,
+                       guint n_triangles,
+                       guint n_vertices)
+{
+  guint n_indices = n_triangles * 3;
+  g_autofree guint32 *offsets = NULL;
+  g_autofree guint32 *fill = NULL;
+  g_autofree guint32 *adjacency = NULL;
+  g_autofree guint8 *visited = NULL;
+  g_autofree guint32 *queue = NULL;
+  g_autofree guint32 *output = NULL;
+  guint head = 0;
+  guint tail = 0;
+
+  offsets = g_malloc0_n (n_vertices + 1, sizeof (*offsets));
+  fill = g_malloc0_n (n_vertices, sizeof (*fill));
+  for (guint i = 0; i < n_indices; i++)
+    offsets[indices[i] + 1]++;
+  for (guint i = 0; i < n_vertices; i++)
+    offsets[i + 1] += offsets[i];
+
+  adjacency = g_malloc_n (n_indices, sizeof (*adjacency));
+  for (guint i = 0; i < n_indices; i++)
+    adjacency[offsets[indices[i]] + fill[indices[i]]++] = i / 3;
+  g_clear_pointer (&fill, g_free);
+
+  visited = g_malloc0_n (n_triangles, sizeof (*visited));
+  queue = g_malloc_n (n_triangles, sizeof (*queue));
+
+  for (guint seed = 0; seed < n_triangles; seed++)
+    {
+      if (visited[seed])
+        continue;
+
+      visited[seed] = TRUE;
+      queue[tail++] = seed;
+
+      while (head < tail)
+        {
+          guint32 triangle = queue[head++];
+
+          for (guint k = 0; k < 3; k++)
+            {
+              guint32 vertex = indices[triangle * 3 + k];
+
+              for (guint32 a = offsets[vertex]; a < offsets[vertex + 1]; a++)
+                {
+                  if (!visited[adjacency[a]])
+                    {
+                      visited[adjacency[a]] = TRUE;
+                      queue[tail++] = adjacency[a];
+                    }
+                }
+            }
+        }
+    }
+
+  output = g_malloc_n (n_indices, sizeof (*output));
+  for (guint i = 0; i < n_triangles; i++)
+    memcpy (output + i * 3, indices + queue[i] * 3, 3 * sizeof (*output));
+  memcpy (indices, output, n_indices * sizeof (*indices));
+}
+
+static void
+optimize_cache (guint32 *indices,
+                guint n_triangles,
+                guint n_vertices,
+                guint cache_size)
+{
+  g_autofree guint32 *output = NULL;
+  CacheJob jobs[MAX_JOBS] = { 0 };
+  guint n_jobs = 0;
+
+  output = g_malloc_n (n_triangles * 3, sizeof (*output));
+
+  n_jobs = get_n_jobs (n_triangles, MIN_TRIANGLES_PER_JOB);
+  if (n_jobs > 1)
+    order_by_connectivity (indices, n_triangles, n_vertices);
+
+  for (guint i = 0; i < n_jobs; i++)
+    {
+      guint start = (guint64)n_triangles * i / n_jobs;
+      guint end = (guint64)n_triangles * (i + 1) / n_jobs;
+
+      jobs[i].indices = indices + start * 3;
+      jobs[i].output = output + start * 3;
+      jobs[i].n_triangles = end - start;
+      jobs[i].cache_size = cache_size;
+    }
+
+  run_jobs (optimize_cache_job, jobs, sizeof (*jobs), n_jobs);
+
+  memcpy (indices, output, n_triangles * 3 * sizeof (*indices));
+}
+
+/* Returns the new vertex data, with `indices` rewritten
+ * to reference vertices in order of first use. */
+static gpointer
+optimize_fetch (const guchar *vertices,
+                gsize stride,
+                guint n_vertices,
+                guint32 *indices,
+                guint n_indices)
+{
+  g_autofree guint32 *remap = NULL;
+  guchar *output = NULL;
+  guint32 next = 0;
+
+  remap = g_malloc_n (n_vertices, sizeof (*remap));
+  memset (remap, 0xff, n_vertices * sizeof (*remap));
+
+  for (guint i = 0; i < n_indices; i++)
+    {
+      if (remap[indices[i]] == NO_VERTEX)
+        remap[indices[i]] = next++;
+      indices[i] = remap[indices[i]];
+    }
+  g_assert (next == n_vertices);
+
+  output = g_malloc_n (n_vertices, stride);
+  for (guint i = 0; i < n_vertices; i++)
+    memcpy (output + (gsize)remap[i] * stride,
+            vertices + (gsize)i * stride,
+            stride);
+
+  return output;
+}
+
+static float
+compute_acmr (const guint32 *indices,
+              guint n_indices,
+              guint n_vertices,
+              guint cache_size)
+{
+  g_autofree guint32 *timestamps = NULL;
+  guint32 timestamp = 0;
+  guint misses = 0;
+
+  if (n_indices == 0)
+    return 0.0f;
+
+  timestamps = g_malloc0_n (n_vertices, sizeof (*timestamps));
+  timestamp = cache_size + 1;
+
+  /* FIFO cache: hits don't refresh the entry */
+  for (guint i = 0; i < n_indices; i++)
+    {
+      if (timestamp - timestamps[indices[i]] > cache_size)
+        {
+          timestamps[indices[i]] = timestamp++;
+          misses++;
+        }
+    }
+
+  return (float)misses / (float)(n_indices / 3);
+}
+
+gboolean
+cg_mesh_optimize (
+    const CgDataSegment *spec,
+    guint spec_length,
+    gconstpointer data,
+    gsize size,
+    int flags,
+    guint cache_size,
+    CgMesh *mesh)
+{
+  gsize stride = 0;
+  guint n_input_vertices = 0;
+  guint n_vertices = 0;
+  guint n_indices = 0;
+  g_autofree guint32 *indices = NULL;
+  g_autofree guchar *vertices = NULL;
+
+  g_return_val_if_fail (spec != NULL, FALSE);
+  g_return_val_if_fail (spec_length > 0, FALSE);
+  g_return_val_if_fail (cg_priv_check_data_layout (spec, spec_length), FALSE);
+  g_return_val_if_fail (data != NULL, FALSE);
+  g_return_val_if_fail (size > 0, FALSE);
+  g_return_val_if_fail (mesh != NULL, FALSE);
+
+  stride = cg_priv_get_data_layout_stride (spec, spec_length);
+  g_return_val_if_fail (size % stride == 0, FALSE);
+  g_return_val_if_fail (size / stride <= MAX_INPUT_VERTICES, FALSE);
+
+  n_input_vertices = size / stride;
+  g_return_val_if_fail (n_input_vertices % 3 == 0, FALSE);
+
+  if (cache_size == 0)
+    cache_size = DEFAULT_CACHE_SIZE;
+
+  n_indices = n_input_vertices;
+  indices = g_malloc_n (n_indices, sizeof (*indices));
+
+  if (flags & CG_MESH_DEDUPLICATE)
+    {
+      n_vertices = deduplicate (data, stride, n_input_vertices, indices);
+
+      vertices = g_malloc_n (n_vertices, stride);
+      for (guint i = 0; i < n_input_vertices; i++)
+        memcpy (vertices + (gsize)indices[i] * stride,
+                (const guchar *)data + (gsize)i * stride,
+                stride);
+    }
+  else
+    {
+      n_vertices = n_input_vertices;
+      vertices = g_memdup2 (data, size);
+      for (guint i = 0; i < n_indices; i++)
+        indices[i] = i;
+    }
+
+  mesh->acmr_before = compute_acmr (indices, n_indices, n_vertices, cache_size);
+
+  if (flags & CG_MESH_OPTIMIZE_CACHE)
+    optimize_cache (indices, n_indices / 3, n_vertices, cache_size);
+
+  if (flags & CG_MESH_OPTIMIZE_FETCH)
+    {
+      guchar *fetch_vertices = NULL;
+
+      fetch_vertices = optimize_fetch (vertices, stride, n_vertices, indices, n_indices);
+      CG_PRIV_REPLACE_POINTER (&vertices, fetch_vertices, g_free);
+    }
+
+  mesh->acmr_after = compute_acmr (indices, n_indices, n_vertices, cache_size);
+
+  if (!(flags & CG_MESH_32_BIT_INDICES) && n_vertices < G_MAXUINT16)
+    {
+      guint16 *indices16 = NULL;
+
+      indices16 = g_malloc_n (n_indices, sizeof (*indices16));
+      for (guint i = 0; i < n_indices; i++)
+        indices16[i] = indices[i];
+
+      mesh->indices = indices16;
+      mesh->indices_size = n_indices * sizeof (*indices16);
+      mesh->index_format = CG_COMPONENT_UINT16;
+    }
+  else
+    {
+      mesh->indices = g_steal_pointer (&indices);
+      mesh->indices_size = n_indices * sizeof (guint32);
+      mesh->index_format = CG_COMPONENT_UINT32;
+    }
+
+  mesh->vertices = g_steal_pointer (&vertices);
+  mesh->vertices_size = (gsize)n_vertices * stride;
+  mesh->n_input_vertices = n_input_vertices;
+  mesh->n_vertices = n_vertices;
+  mesh->n_triangles = n_indices / 3;
+
+  return TRUE;
+}
+
+void
+cg_mesh_clear (CgMesh *self)
+{
+  g_return_if_fail (self != NULL);
+
+  g_clear_pointer (&self->vertices, g_free);
+  g_clear_pointer (&self->indices, g_free);
+  self->vertices_size = 0;
+  self->indices_size = 0;
+}
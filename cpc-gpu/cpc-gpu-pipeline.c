@@ -0,0 +1,344 @@
+/* cpc-gpu-pipeline.c
+ *
+ * Copyright 2025 Adam Masciola
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+#define G_LOG_DOMAIN "CpcGpuPipeline"
+#include "cpc-gpu-private.h"
+
+/* Offscreen targets only need to exist, not hold anything */
+#define WARM_UP_SIZE 1
+
+static gboolean
+layouts_equal (const CgDataSegment *a,
+               guint a_length,
+               const CgDataSegment *b,
+               guint b_length)
+{
+  if (a_length != b_length)
+    return FALSE;
+
+  for (guint i = 0; i < a_length; i++)
+    {
+      if (g_strcmp0 (a[i].name, b[i].name) != 0
+          || a[i].type != b[i].type
+          || a[i].num != b[i].num
+          || a[i].instance_rate != b[i].instance_rate
+          || a[i].conversion != b[i].conversion)
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+static gboolean
+descs_equal (const CgPipelineDesc *a,
+             const CgPipelineDesc *b)
+{
+  return a->shader == b->shader
+         && a->n_color_formats == b->n_color_formats
+         && memcmp (a->color_formats, b->color_formats,
+                    a->n_color_formats * sizeof (*a->color_formats)) == 0
+         && a->depth == b->depth
+         && a->msaa == b->msaa
+         && a->src_blend == b->src_blend
+         && a->dst_blend == b->dst_blend
+         && a->depth_test_func == b->depth_test_func
+         && a->no_backface_cull == b->no_backface_cull
+         && a->topology == b->topology
+         && layouts_equal (a->layout, a->layout_length,
+                           b->layout, b->layout_length);
+}
+
+static void
+clear_desc (CgPipelineDesc *desc)
+{
+  g_clear_pointer (&desc->shader, cg_shader_unref);
+  g_free ((int *)desc->color_formats);
+  desc->color_formats = NULL;
+  cg_priv_clear_data_layout ((CgDataSegment *)desc->layout, desc->layout_length);
+  g_free ((CgDataSegment *)desc->layout);
+  desc->layout = NULL;
+}
+
+static void
+collect_pipeline (GArray *nodes,
+                  guint idx,
+                  GArray *descs)
+{
+  CgPrivInstr *instr = CG_PRIV_NODE_INSTR (nodes, idx);
+  CgPrivInstr *pass = NULL;
+  CgBuffer *buffer = NULL;
+  g_autofree int *color_formats = NULL;
+  CgPipelineDesc desc = { 0 };
+
+  if (instr->type != CG_PRIV_INSTR_VERTICES || instr->vertices.n_buffers != 1)
+    return;
+
+  pass = CG_PRIV_NODE_INSTR (nodes, CG_PRIV_NODE (nodes, idx)->parent);
+  buffer = instr->vertices.one_buffer;
+  if (pass->pass.shader == NULL || buffer->spec == NULL)
+    return;
+
+  color_formats = g_new0 (int, MAX (1, pass->pass.targets->len));
+
+  desc.shader = pass->pass.shader;
+  desc.color_formats = color_formats;
+  for (guint i = 0; i < pass->pass.targets->len; i++)
+    {
+      CgPrivTarget *target = &g_array_index (pass->pass.targets, CgPrivTarget, i);
+
+      desc.msaa = target->texture->init.msaa;
+      if (target->texture->init.format == CG_PRIV_FORMAT_DEPTH)
+        desc.depth = TRUE;
+      else
+        {
+          if (desc.n_color_formats == 0)
+            {
+              desc.src_blend = target->src_blend;
+              desc.dst_blend = target->dst_blend;
+            }
+          color_formats[desc.n_color_formats++] = target->texture->init.format;
+        }
+    }
+  desc.depth_test_func = pass->pass.depth_test_func.val;
+  desc.no_backface_cull = !pass->pass.backface_cull.val;
+  desc.layout = buffer->spec;
+  desc.layout_length = buffer->spec_length;
+  desc.topology = instr->vertices.topology;
+
+  for (guint i = 0; i < descs->len; i++)
+    if (descs_equal (&g_array_index (descs, CgPipelineDesc, i), &desc))
+      return;
+
+  desc.shader = cg_shader_ref (desc.shader);
+  desc.color_formats = g_steal_pointer (&color_formats);
+  desc.layout = cg_priv_copy_data_layout (buffer->spec, buffer->spec_length);
+  g_array_append_val (descs, desc);
+}
+
+CgPipelineDesc *
+cg_plan_collect_pipelines (
+    CgPlan *self,
+    guint *n_descs)
+{
+  g_autoptr (GArray) descs = NULL;
+
+  g_return_val_if_fail (self != NULL, NULL);
+  g_return_val_if_fail (n_descs != NULL, NULL);
+
+  descs = g_array_new (FALSE, TRUE, sizeof (CgPipelineDesc));
+
+  for (guint i = 0; i < self->nodes->len; i++)
+    collect_pipeline (self->nodes, i, descs);
+
+  *n_descs = descs->len;
+  return (CgPipelineDesc *)(gpointer)g_array_free (g_steal_pointer (&descs), FALSE);
+}
+
+void
+cg_pipeline_descs_free (
+    CgPipelineDesc *descs,
+    guint n_descs)
+{
+  if (descs == NULL)
+    return;
+
+  for (guint i = 0; i < n_descs; i++)
+    clear_desc (&descs[i]);
+  g_free (descs);
+}
+
+static CgTexture *
+get_target (CgGpu *gpu,
+            GHashTable *targets,
+            guint slot,
+            int format,
+            int msaa)
+{
+  gpointer key = NULL;
+  CgTexture *texture = NULL;
+
+  /* The same texture can't be attached twice, so the slot is part of the key */
+  key = GUINT_TO_POINTER (((slot & 0xff) << 24) | (((guint)format & 0xff) << 16) | (msaa & 0xffff));
+
+  texture = g_hash_table_lookup (targets, key);
+  if (texture == NULL)
+    {
+      if (format == CG_PRIV_FORMAT_DEPTH)
+        texture = cg_texture_new_depth (gpu, WARM_UP_SIZE, WARM_UP_SIZE, msaa);
+      else
+        texture = cg_texture_new_for_data (
+            gpu, NULL, 0, WARM_UP_SIZE, WARM_UP_SIZE, format, 0, msaa);
+      g_hash_table_replace (targets, key, texture);
+    }
+
+  return texture;
+}
+
+static gboolean
+check_desc (const CgPipelineDesc *desc)
+{
+  if (desc->shader == NULL)
+    return FALSE;
+  if (desc->n_color_formats > 0 && desc->color_formats == NULL)
+    return FALSE;
+  for (guint i = 0; i < desc->n_color_formats; i++)
+    if (desc->color_formats[i] <= CG_FORMAT_0 || desc->color_formats[i] >= CG_N_FORMATS)
+      return FALSE;
+  if (desc->msaa < 0)
+    return FALSE;
+  if ((desc->src_blend == CG_BLEND_0) != (desc->dst_blend == CG_BLEND_0)
+      || desc->src_blend < CG_BLEND_0 || desc->src_blend >= CG_N_BLENDS
+      || desc->dst_blend < CG_BLEND_0 || desc->dst_blend >= CG_N_BLENDS)
+    return FALSE;
+  if (desc->depth_test_func < CG_TEST_FUNC_0 || desc->depth_test_func >= CG_N_TEST_FUNCS)
+    return FALSE;
+  if (desc->topology < CG_TOPOLOGY_0 || desc->topology >= CG_N_TOPOLOGIES)
+    return FALSE;
+  if (desc->layout == NULL || !cg_priv_check_data_layout (desc->layout, desc->layout_length))
+    return FALSE;
+
+  return TRUE;
+}
+
+static void
+append_desc (CgPlan *plan,
+             GHashTable *targets,
+             GPtrArray *buffers,
+             const CgPipelineDesc *desc)
+{
+  CgGpu *gpu = plan->gpu;
+  guint n_colors = MAX (1, desc->n_color_formats);
+  g_autofree CgValue *values = NULL;
+  g_autofree const CgValue **target_values = NULL;
+  CgValue src_blend = { 0 };
+  CgValue dst_blend = { 0 };
+  guint n_targets = 0;
+  gsize stride = 0;
+  CgBuffer *buffer = NULL;
+
+  /* Colors use 2 values each, the texture and the tuple */
+  values = g_new0 (CgValue, n_colors * 2 + 1);
+  target_values = g_new0 (const CgValue *, n_colors + 1);
+
+  src_blend.type = CG_TYPE_INT;
+  src_blend.i = desc->src_blend != CG_BLEND_0 ? desc->src_blend : CG_BLEND_SRC_ALPHA;
+  dst_blend.type = CG_TYPE_INT;
+  dst_blend.i = desc->dst_blend != CG_BLEND_0 ? desc->dst_blend : CG_BLEND_ONE_MINUS_SRC_ALPHA;
+
+  for (guint i = 0; i < n_colors; i++)
+    {
+      CgValue *texture = &values[i * 2];
+      CgValue *tuple = &values[i * 2 + 1];
+      int format = desc->n_color_formats > 0 ? desc->color_formats[i] : CG_FORMAT_RGBA8;
+
+      texture->type = CG_TYPE_TEXTURE;
+      texture->texture = get_target (gpu, targets, i, format, desc->msaa);
+
+      tuple->type = CG_TYPE_TUPLE3;
+      tuple->tuple3[0] = texture;
+      tuple->tuple3[1] = &src_blend;
+      tuple->tuple3[2] = &dst_blend;
+
+      target_values[n_targets++] = tuple;
+    }
+
+  if (desc->depth)
+    {
+      CgValue *texture = &values[n_colors * 2];
+
+      texture->type = CG_TYPE_TEXTURE;
+      texture->texture = get_target (gpu, targets, 0xff, CG_PRIV_FORMAT_DEPTH, desc->msaa);
+      target_values[n_targets++] = texture;
+    }
+
+  /* Three identical vertices, so nothing is actually rasterized */
+  stride = cg_priv_get_data_layout_stride (desc->layout, desc->layout_length);
+  buffer = cg_buffer_new_for_data_take (
+      gpu, g_malloc0 (stride * 3), stride * 3,
+      desc->layout, desc->layout_length);
+  g_ptr_array_add (buffers, buffer);
+
+  cg_plan_begin_config (plan);
+  cg_plan_config_targets_v (plan, target_values, n_targets);
+  cg_plan_config_shader (plan, desc->shader);
+  cg_plan_config_dest (plan, 0, 0, WARM_UP_SIZE, WARM_UP_SIZE);
+  if (desc->depth_test_func != CG_TEST_FUNC_0)
+    cg_plan_config_depth_test_func (plan, desc->depth_test_func);
+  cg_plan_config_backface_cull (plan, !desc->no_backface_cull);
+  cg_plan_push_group (plan);
+
+  cg_plan_append_primitives (
+      plan,
+      desc->topology != CG_TOPOLOGY_0 ? desc->topology : CG_TOPOLOGY_TRIANGLES,
+      1, NULL, buffer, NULL);
+
+  cg_plan_pop (plan);
+}
+
+gboolean
+cg_gpu_warm_up (
+    CgGpu *self,
+    const CgPipelineDesc *descs,
+    guint n_descs,
+    GError **error)
+{
+  g_autoptr (GHashTable) targets = NULL;
+  g_autoptr (GPtrArray) buffers = NULL;
+  g_autoptr (CgPlan) plan = NULL;
+  g_autoptr (CgCommands) commands = NULL;
+
+  g_return_val_if_fail (self != NULL, FALSE);
+  g_return_val_if_fail (descs != NULL || n_descs == 0, FALSE);
+
+  for (guint i = 0; i < n_descs; i++)
+    {
+      if (!check_desc (&descs[i]))
+        {
+          CG_PRIV_CRITICAL ("Pipeline description %u is invalid", i);
+          return FALSE;
+        }
+    }
+
+  if (n_descs == 0)
+    return TRUE;
+
+  targets = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, cg_texture_unref);
+  buffers = g_ptr_array_new_with_free_func (cg_buffer_unref);
+
+  plan = cg_plan_new (self);
+  cg_plan_begin_config (plan);
+  cg_plan_push_group (plan);
+
+  for (guint i = 0; i < n_descs; i++)
+    append_desc (plan, targets, buffers, &descs[i]);
+
+  cg_plan_pop (plan);
+
+  commands = cg_plan_unref_to_commands (g_steal_pointer (&plan), error);
+  if (commands == NULL)
+    return FALSE;
+
+  if (!cg_commands_dispatch (commands, error))
+    return FALSE;
+
+  /* Let the driver finish compiling before loading goes on */
+  return cg_gpu_flush (self, error);
+}
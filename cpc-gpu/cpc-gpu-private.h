@@ -73,6 +73,10 @@ typedef struct
   gboolean (*gpu_flush) (
       CgGpu *self,
       GError **error);
+  gboolean (*gpu_share) (
+      CgGpu *self,
+      CgGpu *share,
+      GError **error);
 
 #define DECLARE_ANCILLARY_OBJECT(lower, upper)  \
   Cg##upper *(*lower##_new) (CgGpu * gpu);      \
@@ -96,6 +100,84 @@ typedef struct
       CgCommands *self,
       GError **error);
 
+  gpointer (*timer_new) (
+      CgGpu *self,
+      guint n_queries,
+      GError **error);
+  void (*timer_free) (
+      CgGpu *self,
+      gpointer timer);
+  gboolean (*timer_begin) (
+      CgGpu *self,
+      gpointer timer);
+  void (*timer_end) (
+      CgGpu *self,
+      gpointer timer);
+  gboolean (*timer_collect) (
+      CgGpu *self,
+      gpointer timer,
+      guint64 *nanoseconds);
+
+  gpointer (*fence_new) (
+      CgGpu *self,
+      GError **error);
+  void (*fence_free) (
+      CgGpu *self,
+      gpointer fence);
+  void (*fence_wait) (
+      CgGpu *self,
+      gpointer fence);
+  gboolean (*fence_client_wait) (
+      CgGpu *self,
+      gpointer fence,
+      guint64 timeout,
+      GError **error);
+
+  gboolean (*texture_update) (
+      CgTexture *self,
+      int x,
+      int y,
+      int width,
+      int height,
+      gconstpointer data,
+      GError **error);
+  gboolean (*texture_download) (
+      CgTexture *self,
+      gpointer data,
+      gsize size,
+      GError **error);
+  gboolean (*texture_import_dmabuf) (
+      CgTexture *self,
+      const CgDmabuf *dmabuf,
+      GError **error);
+  gboolean (*texture_export_dmabuf) (
+      CgTexture *self,
+      CgDmabuf *dmabuf,
+      GError **error);
+
+  gpointer (*readback_new) (
+      CgTexture *self,
+      int x,
+      int y,
+      int width,
+      int height,
+      int format,
+      GError **error);
+  void (*readback_free) (
+      CgGpu *self,
+      gpointer readback);
+  gboolean (*readback_wait) (
+      CgGpu *self,
+      gpointer readback,
+      guint64 timeout,
+      GError **error);
+  /* Only called once `readback_wait` has returned TRUE */
+  gboolean (*readback_read) (
+      CgGpu *self,
+      gpointer readback,
+      gpointer data,
+      GError **error);
+
 } CgBackendImpl;
 
 struct _CgGpu
@@ -106,6 +188,9 @@ struct _CgGpu
   gboolean debug_output;
   gboolean exit_on_error;
 
+  /* The context the gpu created for itself, if any */
+  gpointer headless;
+
   const CgBackendImpl *impl;
 };
 void cg_priv_finish (CgGpu *self);
@@ -139,6 +224,7 @@ enum
   CG_PRIV_INSTR_PASS = 0,
   CG_PRIV_INSTR_VERTICES,
   CG_PRIV_INSTR_BLIT,
+  CG_PRIV_INSTR_DEPTH_PYRAMID,
 };
 
 typedef struct
@@ -152,6 +238,14 @@ typedef struct
     {
       gboolean fake; /* means depth is the same as parent's */
 
+      /* Set by the backend while compiling */
+      gboolean merge_parent;  /* keeps rendering into the parent's framebuffer */
+      gboolean merge_sibling; /* keeps rendering into the previous sibling's framebuffer */
+      gboolean keep_targets;  /* the next sibling takes over the framebuffer */
+
+      /* Once pushed, the values below hold the effective
+       * state, including whatever was inherited from the
+       * parent; `set` only records explicit configuration. */
       CgShader *shader;
       GArray *targets;
       GHashTable *attributes;
@@ -186,6 +280,19 @@ typedef struct
         gboolean val;
         gboolean set;
       } backface_cull;
+      struct
+      {
+        int val;
+        guint32 ref;
+        guint32 mask;
+        gboolean set;
+      } stencil_func;
+      struct
+      {
+        /* Stencil fail, depth fail, pass */
+        int val[3];
+        gboolean set;
+      } stencil_ops;
     } pass;
 
     struct
@@ -196,27 +303,66 @@ typedef struct
         CgBuffer *one_buffer;
         CgBuffer **many_buffers;
       };
+      CgBuffer *indices;
+      guint first_instance;
       guint instances;
+      int topology;
     } vertices;
 
     struct
     {
       CgTexture *src;
+      int region[4];
+      gboolean region_set;
+      gboolean linear;
     } blit;
+
+    struct
+    {
+      CgTexture *depth;
+      CgTexture *pyramid;
+      gboolean max_depth;
+    } depth_pyramid;
   };
 
   gpointer user_data;
   GDestroyNotify destroy_user_data;
 
 } CgPrivInstr;
-void cg_priv_destroy_instr_node (GNode *self);
+void cg_priv_clear_instr (CgPrivInstr *self);
+
+/* Plans are stored as an array of nodes in pre-order,
+ * so walking a plan front to back visits every group
+ * before its children, and children in order. */
+#define CG_PRIV_NO_NODE G_MAXUINT
+typedef struct
+{
+  CgPrivInstr instr;
+
+  guint parent;
+  guint prev_sibling;
+  guint next_sibling;
+  guint first_child;
+  guint last_child;
+  guint level;
+} CgPrivNode;
+#define CG_PRIV_NODE(nodes, idx) (&g_array_index ((nodes), CgPrivNode, (idx)))
+#define CG_PRIV_NODE_INSTR(nodes, idx) (&CG_PRIV_NODE (nodes, idx)->instr)
+GArray *cg_priv_nodes_new (void);
+guint cg_priv_nodes_append (
+    GArray *nodes,
+    guint parent);
+gboolean cg_priv_targets_equal (CgPrivInstr *a,
+                                CgPrivInstr *b);
+void cg_priv_merge_instr_node (GArray *nodes,
+                               guint node);
 
 struct _CgPlan
 {
   CgGpu *gpu;
 
-  GNode *root_instr;
-  GNode *cur_instr;
+  GArray *nodes;
+  guint cur_node;
 
   CgPrivInstr *configuring;
 };
@@ -230,6 +376,14 @@ struct _CgShader
   {
     char *vertex_code;
     char *fragment_code;
+
+    /* Set instead of the code for SPIR-V shaders */
+    GBytes *vertex_spirv;
+    GBytes *fragment_spirv;
+    char *entry_point;
+    guint *constant_ids;
+    guint *constant_values;
+    guint n_constants;
   } init;
 };
 void cg_priv_shader_finish (CgShader *self);
@@ -240,6 +394,7 @@ struct _CgBuffer
 
   CgDataSegment *spec;
   guint spec_length;
+  int index_format;
 
   struct
   {
@@ -261,8 +416,17 @@ struct _CgTexture
     int width;
     int height;
     int format;
+    /* Only for CG_PRIV_FORMAT_DEPTH, where
+     * 0 leaves the precision to the backend */
+    int depth_format;
     int mipmaps;
     int msaa;
+
+    /* Backend objects owned by someone else, which
+     * are used as is and never destroyed */
+    gboolean native;
+    gboolean native_framebuffer;
+    guint64 native_handle;
   } init;
 };
 void cg_priv_texture_finish (CgTexture *self);
@@ -282,20 +446,36 @@ struct _CgCommands
   } debug;
 };
 CgCommands *cg_priv_commands_new (CgGpu *gpu);
+gpointer cg_priv_timer_new (
+    CgGpu *gpu,
+    guint n_queries,
+    GError **error);
+void cg_priv_timer_free (
+    CgGpu *gpu,
+    gpointer timer);
+gboolean cg_priv_timer_collect (
+    CgGpu *gpu,
+    gpointer timer,
+    guint64 *nanoseconds);
+gboolean cg_priv_commands_dispatch_timed (
+    CgCommands *self,
+    gpointer timer,
+    GError **error);
 void cg_priv_commands_finish (CgCommands *self);
 
-#define _CG_PRIV_CALL(commands, ptrarray, func, args, fmt, ...)   \
-  G_STMT_START                                                    \
-  {                                                               \
-    (func) args;                                                  \
-    if ((commands)->debug.enabled)                                \
-      {                                                           \
-        g_ptr_array_add (                                         \
-            (commands)->debug.calls.ptrarray,                     \
-            g_strdup_printf (                                     \
-                G_STRINGIFY (func) " (" fmt ")", ##__VA_ARGS__)); \
-      }                                                           \
-  }                                                               \
+#define _CG_PRIV_RECORD(commands, ptrarray, func, fmt, ...) \
+  g_ptr_array_add (                                         \
+      (commands)->debug.calls.ptrarray,                     \
+      g_strdup_printf (                                     \
+          G_STRINGIFY (func) " (" fmt ")", ##__VA_ARGS__))
+
+#define _CG_PRIV_CALL(commands, ptrarray, func, args, fmt, ...)    \
+  G_STMT_START                                                     \
+  {                                                                \
+    (func) args;                                                   \
+    if ((commands)->debug.enabled)                                 \
+      _CG_PRIV_RECORD (commands, ptrarray, func, fmt, __VA_ARGS__); \
+  }                                                                \
   G_STMT_END
 
 #define CG_PRIV_COMPILE(commands, func, args, fmt, fmt_args) \
@@ -304,11 +484,23 @@ void cg_priv_commands_finish (CgCommands *self);
 #define CG_PRIV_RUN(commands, func, args, fmt, fmt_args) \
   _CG_PRIV_CALL (commands, run, func, (args), fmt, fmt_args)
 
+/* For code paths that already know debugging is enabled */
+#define CG_PRIV_RUN_TRACED(commands, func, args, fmt, fmt_args) \
+  G_STMT_START                                                  \
+  {                                                             \
+    (func) (args);                                              \
+    _CG_PRIV_RECORD (commands, run, func, fmt, fmt_args);       \
+  }                                                             \
+  G_STMT_END
+
 #define _A(...) __VA_ARGS__
 #define CG_PRIV_ADDRESS "[internal address]"
 
 extern const CgBackendImpl cg_gl_impl;
-/* extern const CgBackendImpl cg_vk_impl; */
+extern const CgBackendImpl cg_sw_impl;
+#ifdef USE_VULKAN
+extern const CgBackendImpl cg_vk_impl;
+#endif
 
 const char *cg_priv_get_type_name (int type);
 CgValue *cg_priv_transfer_value_from_static_foreign (
@@ -321,5 +513,80 @@ void cg_priv_clear_target (gpointer data);
 
 void cg_priv_clear_data_layout (CgDataSegment *layout,
                                 guint length);
+CgDataSegment *cg_priv_copy_data_layout (const CgDataSegment *layout,
+                                         guint length);
+gboolean cg_priv_check_data_layout (const CgDataSegment *layout,
+                                    guint length);
+int cg_priv_get_segment_component (const CgDataSegment *segment);
+gsize cg_priv_get_segment_size (const CgDataSegment *segment);
+gsize cg_priv_get_data_layout_stride (const CgDataSegment *layout,
+                                      guint length);
+gsize cg_priv_get_pixel_size (int format);
+gboolean cg_priv_texture_has_stencil (CgTexture *texture);
+
+#ifdef USE_EGL
+/* cpc-gpu-egl.c, which works on the current EGL context */
+gboolean cg_priv_egl_has_extension (gpointer display,
+                                    const char *name);
+gboolean cg_priv_egl_bind_dmabuf (const CgDmabuf *dmabuf,
+                                  GError **error);
+gboolean cg_priv_egl_export_texture (guint texture,
+                                     CgDmabuf *dmabuf,
+                                     GError **error);
+gpointer cg_priv_egl_headless_new (int device,
+                                   GError **error);
+void cg_priv_egl_headless_free (gpointer headless);
+gpointer cg_priv_egl_get_loader (void);
+#endif
+
+#ifdef USE_VULKAN
+/* cpc-gpu-spirv.c, which reads just enough of a SPIR-V
+ * module to bind uniforms and attributes by name */
+enum
+{
+  CG_PRIV_SPIRV_SAMPLER = 0,
+  CG_PRIV_SPIRV_UNIFORM_BLOCK,
+  CG_PRIV_SPIRV_PUSH_CONSTANTS,
+};
+
+typedef struct
+{
+  char *name;
+  int type; /* CG_TYPE_0 if not representable as a CgValue */
+  guint offset;
+} CgPrivSpirvMember;
+
+typedef struct
+{
+  int kind;
+  char *name;
+  char *block_name;
+  guint set;
+  guint binding;
+  guint size;
+  gboolean cubemap;
+  GArray *members;
+} CgPrivSpirvResource;
+
+typedef struct
+{
+  char *name;
+  int location;
+  int type;
+  guint components;
+} CgPrivSpirvInput;
+
+typedef struct
+{
+  GArray *resources;
+  GArray *inputs;
+} CgPrivSpirvReflection;
+
+gboolean cg_priv_spirv_reflect (GBytes *spirv,
+                                gboolean vertex,
+                                CgPrivSpirvReflection *reflection,
+                                GError **error);
+void cg_priv_spirv_reflection_clear (CgPrivSpirvReflection *self);
+#endif
 
 G_END_DECLS
@@ -0,0 +1,205 @@
+/* cpc-gpu-scaler.c
+ *
+ * Copyright 2025 Adam Masciola
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+#define G_LOG_DOMAIN "CpcGpuScaler"
+#include "cpc-gpu-private.h"
+
+/* Enough to cover the latency between
+ * submitting work and its completion */
+#define N_QUERIES 4
+
+/* Weight given to each new measurement */
+#define SMOOTHING 0.1
+/* Relative distance from the target that is tolerated */
+#define DEADBAND 0.05
+/* Largest relative change of scale per measurement */
+#define MAX_STEP 0.05
+
+struct _CgScaler
+{
+  gatomicrefcount refcount;
+  CgGpu *gpu;
+  gpointer timer;
+
+  double target_ms;
+  double min_scale;
+
+  double scale;
+  double gpu_ms;
+};
+
+CgScaler *
+cg_scaler_new (
+    CgGpu *self,
+    double target_ms,
+    double min_scale,
+    GError **error)
+{
+  gpointer timer = NULL;
+  CgScaler *scaler = NULL;
+
+  g_return_val_if_fail (self != NULL, NULL);
+  g_return_val_if_fail (target_ms > 0.0, NULL);
+  g_return_val_if_fail (min_scale > 0.0 && min_scale <= 1.0, NULL);
+
+  timer = cg_priv_timer_new (self, N_QUERIES, error);
+  if (timer == NULL)
+    return NULL;
+
+  scaler = g_new0 (CgScaler, 1);
+  g_atomic_ref_count_init (&scaler->refcount);
+  scaler->gpu = cg_gpu_ref (self);
+  scaler->timer = timer;
+  scaler->target_ms = target_ms;
+  scaler->min_scale = min_scale;
+  scaler->scale = 1.0;
+  scaler->gpu_ms = -1.0;
+
+  return scaler;
+}
+
+CgScaler *
+cg_scaler_ref (CgScaler *self)
+{
+  g_return_val_if_fail (self != NULL, NULL);
+
+  g_atomic_ref_count_inc (&self->refcount);
+  return self;
+}
+
+void
+cg_scaler_unref (gpointer self)
+{
+  CgScaler *scaler = self;
+
+  g_return_if_fail (self != NULL);
+
+  if (g_atomic_ref_count_dec (&scaler->refcount))
+    {
+      cg_priv_timer_free (scaler->gpu, scaler->timer);
+      g_clear_pointer (&scaler->gpu, cg_gpu_unref);
+      g_free (scaler);
+    }
+}
+
+static void
+update_scale (CgScaler *self,
+              double ms)
+{
+  double ratio = 0.0;
+  double factor = 0.0;
+
+  if (self->gpu_ms < 0.0)
+    self->gpu_ms = ms;
+  else
+    self->gpu_ms += (ms - self->gpu_ms) * SMOOTHING;
+
+  ratio = self->target_ms / self->gpu_ms;
+  if (ratio > 1.0 - DEADBAND && ratio < 1.0 + DEADBAND)
+    return;
+
+  /* GPU time follows the pixel count, which goes with the
+   * square of the scale. Near 1, stepping halfway towards
+   * the ratio approximates its square root. */
+  factor = CLAMP ((1.0 + ratio) * 0.5, 1.0 - MAX_STEP, 1.0 + MAX_STEP);
+  self->scale = CLAMP (self->scale * factor, self->min_scale, 1.0);
+}
+
+gboolean
+cg_scaler_dispatch (
+    CgScaler *self,
+    CgCommands *commands,
+    GError **error)
+{
+  guint64 nanoseconds = 0;
+
+  g_return_val_if_fail (self != NULL, FALSE);
+  g_return_val_if_fail (commands != NULL, FALSE);
+  g_return_val_if_fail (commands->gpu == self->gpu, FALSE);
+
+  if (!cg_priv_commands_dispatch_timed (commands, self->timer, error))
+    return FALSE;
+
+  while (cg_priv_timer_collect (self->gpu, self->timer, &nanoseconds))
+    update_scale (self, (double)nanoseconds / 1000000.0);
+
+  return TRUE;
+}
+
+double
+cg_scaler_get_scale (CgScaler *self)
+{
+  g_return_val_if_fail (self != NULL, 1.0);
+
+  return self->scale;
+}
+
+double
+cg_scaler_get_gpu_ms (CgScaler *self)
+{
+  g_return_val_if_fail (self != NULL, -1.0);
+
+  return self->gpu_ms;
+}
+
+static void
+get_scaled_size (CgScaler *self,
+                 CgTexture *target,
+                 int *width,
+                 int *height)
+{
+  *width = MAX (1, (int)(target->init.width * self->scale + 0.5));
+  *height = MAX (1, (int)(target->init.height * self->scale + 0.5));
+}
+
+void
+cg_scaler_config_dest (
+    CgScaler *self,
+    CgPlan *plan,
+    CgTexture *target)
+{
+  int width = 0;
+  int height = 0;
+
+  g_return_if_fail (self != NULL);
+  g_return_if_fail (plan != NULL);
+  g_return_if_fail (target != NULL);
+
+  get_scaled_size (self, target, &width, &height);
+  cg_plan_config_dest (plan, 0, 0, width, height);
+}
+
+void
+cg_scaler_blit (
+    CgScaler *self,
+    CgPlan *plan,
+    CgTexture *target)
+{
+  int width = 0;
+  int height = 0;
+
+  g_return_if_fail (self != NULL);
+  g_return_if_fail (plan != NULL);
+  g_return_if_fail (target != NULL);
+
+  get_scaled_size (self, target, &width, &height);
+  cg_plan_blit_region (plan, target, 0, 0, width, height, TRUE);
+}
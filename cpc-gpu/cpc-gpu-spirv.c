@@ -0,0 +1,554 @@
+/* cpc-gpu-spirv.c
+ *
+ * Copyright 2025 Adam Masciola
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+#define G_LOG_DOMAIN "CpcGpuSpirv"
+#include "cpc-gpu-private.h"
+
+/* Just enough of the SPIR-V specification to find the
+ * names behind a module's inputs and resources. */
+
+#define SPIRV_MAGIC 0x07230203
+#define SPIRV_HEADER_WORDS 5
+
+enum
+{
+  OP_NAME = 5,
+  OP_MEMBER_NAME = 6,
+  OP_ENTRY_POINT = 15,
+  OP_TYPE_BOOL = 20,
+  OP_TYPE_INT = 21,
+  OP_TYPE_FLOAT = 22,
+  OP_TYPE_VECTOR = 23,
+  OP_TYPE_MATRIX = 24,
+  OP_TYPE_IMAGE = 25,
+  OP_TYPE_SAMPLED_IMAGE = 27,
+  OP_TYPE_ARRAY = 28,
+  OP_TYPE_STRUCT = 30,
+  OP_TYPE_POINTER = 32,
+  OP_CONSTANT = 43,
+  OP_VARIABLE = 59,
+  OP_DECORATE = 71,
+  OP_MEMBER_DECORATE = 72,
+};
+
+enum
+{
+  DECORATION_BLOCK = 2,
+  DECORATION_ARRAY_STRIDE = 6,
+  DECORATION_MATRIX_STRIDE = 7,
+  DECORATION_BUILT_IN = 11,
+  DECORATION_LOCATION = 30,
+  DECORATION_BINDING = 33,
+  DECORATION_DESCRIPTOR_SET = 34,
+  DECORATION_OFFSET = 35,
+};
+
+enum
+{
+  STORAGE_UNIFORM_CONSTANT = 0,
+  STORAGE_INPUT = 1,
+  STORAGE_UNIFORM = 2,
+  STORAGE_PUSH_CONSTANT = 9,
+};
+
+#define EXECUTION_MODEL_VERTEX 0
+#define DIM_CUBE 3
+
+typedef struct
+{
+  const guint32 *words;
+  guint n_words;
+
+  const char *name;
+  gboolean block;
+  gboolean built_in;
+  int location;
+  int binding;
+  int set;
+  guint array_stride;
+  guint64 constant;
+} Id;
+
+typedef struct
+{
+  guint type;
+  guint member;
+  const char *name;
+  guint offset;
+  guint matrix_stride;
+  gboolean built_in;
+} Member;
+
+typedef struct
+{
+  guint bound;
+  Id *ids;
+  GArray *members;
+} Module;
+
+static const char *
+read_string (const guint32 *words,
+             guint n_words,
+             guint *consumed)
+{
+  const char *string = (const char *)words;
+  gsize max = n_words * sizeof (guint32);
+  gsize length = strnlen (string, max);
+
+  /* Strings are nul terminated and padded to a word */
+  if (length == max)
+    return NULL;
+  if (consumed != NULL)
+    *consumed = length / sizeof (guint32) + 1;
+
+  return string;
+}
+
+static Member *
+get_member (Module *module,
+            guint type,
+            guint member)
+{
+  Member new_member = { 0 };
+
+  for (guint i = 0; i < module->members->len; i++)
+    {
+      Member *existing = &g_array_index (module->members, Member, i);
+
+      if (existing->type == type && existing->member == member)
+        return existing;
+    }
+
+  new_member.type = type;
+  new_member.member = member;
+  g_array_append_val (module->members, new_member);
+
+  return &g_array_index (module->members, Member, module->members->len - 1);
+}
+
+static inline Id *
+get_id (Module *module,
+        guint id)
+{
+  return id < module->bound ? &module->ids[id] : NULL;
+}
+
+static inline guint
+get_opcode (Id *id)
+{
+  return id != NULL && id->words != NULL ? id->words[0] & 0xffff : 0;
+}
+
+static int
+get_value_type (Module *module,
+                guint type_id)
+{
+  Id *type = get_id (module, type_id);
+  Id *component = NULL;
+
+  switch (get_opcode (type))
+    {
+    case OP_TYPE_BOOL:
+      return CG_TYPE_BOOL;
+    case OP_TYPE_INT:
+      if (type->words[2] != 32)
+        return CG_TYPE_0;
+      return type->words[3] ? CG_TYPE_INT : CG_TYPE_UINT;
+    case OP_TYPE_FLOAT:
+      return type->words[2] == 32 ? CG_TYPE_FLOAT : CG_TYPE_0;
+    case OP_TYPE_VECTOR:
+      if (get_value_type (module, type->words[2]) != CG_TYPE_FLOAT)
+        return CG_TYPE_0;
+      switch (type->words[3])
+        {
+        case 2:
+          return CG_TYPE_VEC2;
+        case 3:
+          return CG_TYPE_VEC3;
+        case 4:
+          return CG_TYPE_VEC4;
+        default:
+          return CG_TYPE_0;
+        }
+    case OP_TYPE_MATRIX:
+      component = get_id (module, type->words[2]);
+      if (type->words[3] == 4
+          && get_value_type (module, type->words[2]) == CG_TYPE_VEC4
+          && component != NULL)
+        return CG_TYPE_MAT4;
+      return CG_TYPE_0;
+    default:
+      return CG_TYPE_0;
+    }
+}
+
+static guint
+get_type_size (Module *module,
+               guint type_id,
+               guint matrix_stride)
+{
+  Id *type = get_id (module, type_id);
+  Id *length = NULL;
+  guint size = 0;
+
+  switch (get_opcode (type))
+    {
+    case OP_TYPE_BOOL:
+      return 4;
+    case OP_TYPE_INT:
+    case OP_TYPE_FLOAT:
+      return type->words[2] / 8;
+    case OP_TYPE_VECTOR:
+      return get_type_size (module, type->words[2], 0) * type->words[3];
+    case OP_TYPE_MATRIX:
+      return (matrix_stride > 0 ? matrix_stride : 16) * type->words[3];
+    case OP_TYPE_ARRAY:
+      length = get_id (module, type->words[3]);
+      return length != NULL ? type->array_stride * (guint)length->constant : 0;
+    case OP_TYPE_STRUCT:
+      for (guint i = 2; i < type->n_words; i++)
+        {
+          Member *member = get_member (module, type_id, i - 2);
+          guint end = 0;
+
+          end = member->offset
+                + get_type_size (module, type->words[i], member->matrix_stride);
+          size = MAX (size, end);
+        }
+      return size;
+    default:
+      return 0;
+    }
+}
+
+static void
+add_block (Module *module,
+           CgPrivSpirvReflection *reflection,
+           Id *variable,
+           guint type_id,
+           int kind)
+{
+  Id *type = get_id (module, type_id);
+  CgPrivSpirvResource resource = { 0 };
+
+  resource.kind = kind;
+  resource.name = g_strdup (variable->name != NULL ? variable->name : "");
+  resource.block_name = g_strdup (type->name != NULL ? type->name : "");
+  resource.set = MAX (variable->set, 0);
+  resource.binding = MAX (variable->binding, 0);
+  resource.size = get_type_size (module, type_id, 0);
+  resource.members = g_array_new (FALSE, TRUE, sizeof (CgPrivSpirvMember));
+
+  for (guint i = 2; i < type->n_words; i++)
+    {
+      Member *member = get_member (module, type_id, i - 2);
+      CgPrivSpirvMember out = { 0 };
+
+      if (member->name == NULL || member->built_in)
+        continue;
+
+      out.name = g_strdup (member->name);
+      out.type = get_value_type (module, type->words[i]);
+      out.offset = member->offset;
+      g_array_append_val (resource.members, out);
+    }
+
+  g_array_append_val (reflection->resources, resource);
+}
+
+static gboolean
+add_variable (Module *module,
+              CgPrivSpirvReflection *reflection,
+              Id *variable,
+              gboolean vertex,
+              GError **error)
+{
+  guint storage = variable->words[3];
+  Id *pointer = get_id (module, variable->words[1]);
+  guint type_id = 0;
+  Id *type = NULL;
+
+  if (get_opcode (pointer) != OP_TYPE_POINTER)
+    return TRUE;
+  type_id = pointer->words[3];
+  type = get_id (module, type_id);
+
+  switch (storage)
+    {
+    case STORAGE_UNIFORM_CONSTANT:
+      if (get_opcode (type) == OP_TYPE_SAMPLED_IMAGE)
+        {
+          CgPrivSpirvResource resource = { 0 };
+          Id *image = get_id (module, type->words[2]);
+
+          resource.kind = CG_PRIV_SPIRV_SAMPLER;
+          resource.name = g_strdup (variable->name != NULL ? variable->name : "");
+          resource.set = MAX (variable->set, 0);
+          resource.binding = MAX (variable->binding, 0);
+          resource.cubemap = get_opcode (image) == OP_TYPE_IMAGE
+                             && image->words[3] == DIM_CUBE;
+          g_array_append_val (reflection->resources, resource);
+        }
+      else if (get_opcode (type) == OP_TYPE_IMAGE)
+        {
+          g_set_error (
+              error, CG_ERROR, CG_ERROR_FAILED_SHADER_GEN,
+              "Separate images and samplers are not supported, "
+              "use combined image samplers instead (\"%s\")",
+              variable->name != NULL ? variable->name : "");
+          return FALSE;
+        }
+      break;
+    case STORAGE_UNIFORM:
+      if (get_opcode (type) == OP_TYPE_STRUCT && type->block)
+        add_block (module, reflection, variable, type_id, CG_PRIV_SPIRV_UNIFORM_BLOCK);
+      break;
+    case STORAGE_PUSH_CONSTANT:
+      if (get_opcode (type) == OP_TYPE_STRUCT)
+        add_block (module, reflection, variable, type_id, CG_PRIV_SPIRV_PUSH_CONSTANTS);
+      break;
+    case STORAGE_INPUT:
+      if (vertex && !variable->built_in && variable->location >= 0)
+        {
+          CgPrivSpirvInput input = { 0 };
+          int value_type = 0;
+
+          value_type = get_value_type (module, type_id);
+          input.name = g_strdup (variable->name != NULL ? variable->name : "");
+          input.location = variable->location;
+          input.components = get_opcode (type) == OP_TYPE_VECTOR ? type->words[3] : 1;
+          if (value_type == CG_TYPE_INT || value_type == CG_TYPE_UINT)
+            input.type = value_type;
+          else
+            input.type = CG_TYPE_FLOAT;
+          g_array_append_val (reflection->inputs, input);
+        }
+      break;
+    default:
+      break;
+    }
+
+  return TRUE;
+}
+
+gboolean
+cg_priv_spirv_reflect (GBytes *spirv,
+                       gboolean vertex,
+                       CgPrivSpirvReflection *reflection,
+                       GError **error)
+{
+  const guint32 *code = NULL;
+  gsize size = 0;
+  guint n_words = 0;
+  Module module = { 0 };
+  GArray *variables = NULL;
+  gboolean success = TRUE;
+
+  code = g_bytes_get_data (spirv, &size);
+  n_words = size / sizeof (guint32);
+
+  if (n_words < SPIRV_HEADER_WORDS || code[0] != SPIRV_MAGIC)
+    {
+      g_set_error (
+          error, CG_ERROR, CG_ERROR_FAILED_SHADER_GEN,
+          "Shader is not a little endian SPIR-V module");
+      return FALSE;
+    }
+
+  module.bound = code[3];
+  module.ids = g_new0 (Id, module.bound);
+  module.members = g_array_new (FALSE, TRUE, sizeof (Member));
+  variables = g_array_new (FALSE, FALSE, sizeof (guint));
+
+  for (guint i = 0; i < module.bound; i++)
+    {
+      module.ids[i].location = -1;
+      module.ids[i].binding = -1;
+      module.ids[i].set = -1;
+    }
+
+  for (guint i = SPIRV_HEADER_WORDS; i < n_words;)
+    {
+      const guint32 *words = code + i;
+      guint count = words[0] >> 16;
+      guint opcode = words[0] & 0xffff;
+      Id *id = NULL;
+
+      if (count == 0 || i + count > n_words)
+        {
+          g_set_error (
+              error, CG_ERROR, CG_ERROR_FAILED_SHADER_GEN,
+              "SPIR-V module is truncated");
+          success = FALSE;
+          break;
+        }
+
+      switch (opcode)
+        {
+        case OP_NAME:
+          if (count >= 3 && (id = get_id (&module, words[1])) != NULL)
+            id->name = read_string (words + 2, count - 2, NULL);
+          break;
+        case OP_MEMBER_NAME:
+          if (count >= 4 && words[1] < module.bound)
+            get_member (&module, words[1], words[2])->name = read_string (words + 3, count - 3, NULL);
+          break;
+        case OP_DECORATE:
+          if (count >= 3 && (id = get_id (&module, words[1])) != NULL)
+            {
+              switch (words[2])
+                {
+                case DECORATION_BLOCK:
+                  id->block = TRUE;
+                  break;
+                case DECORATION_BUILT_IN:
+                  id->built_in = TRUE;
+                  break;
+                case DECORATION_ARRAY_STRIDE:
+                  if (count >= 4) id->array_stride = words[3];
+                  break;
+                case DECORATION_LOCATION:
+                  if (count >= 4) id->location = words[3];
+                  break;
+                case DECORATION_BINDING:
+                  if (count >= 4) id->binding = words[3];
+                  break;
+                case DECORATION_DESCRIPTOR_SET:
+                  if (count >= 4) id->set = words[3];
+                  break;
+                default:
+                  break;
+                }
+            }
+          break;
+        case OP_MEMBER_DECORATE:
+          if (count >= 4 && words[1] < module.bound)
+            {
+              Member *member = get_member (&module, words[1], words[2]);
+
+              switch (words[3])
+                {
+                case DECORATION_OFFSET:
+                  if (count >= 5) member->offset = words[4];
+                  break;
+                case DECORATION_MATRIX_STRIDE:
+                  if (count >= 5) member->matrix_stride = words[4];
+                  break;
+                case DECORATION_BUILT_IN:
+                  member->built_in = TRUE;
+                  break;
+                default:
+                  break;
+                }
+            }
+          break;
+        case OP_TYPE_BOOL:
+        case OP_TYPE_INT:
+        case OP_TYPE_FLOAT:
+        case OP_TYPE_VECTOR:
+        case OP_TYPE_MATRIX:
+        case OP_TYPE_IMAGE:
+        case OP_TYPE_SAMPLED_IMAGE:
+        case OP_TYPE_ARRAY:
+        case OP_TYPE_STRUCT:
+        case OP_TYPE_POINTER:
+          if (count >= 2 && (id = get_id (&module, words[1])) != NULL)
+            {
+              id->words = words;
+              id->n_words = count;
+            }
+          break;
+        case OP_CONSTANT:
+          if (count >= 4 && (id = get_id (&module, words[2])) != NULL)
+            {
+              id->words = words;
+              id->n_words = count;
+              id->constant = words[3];
+            }
+          break;
+        case OP_VARIABLE:
+          if (count >= 4 && (id = get_id (&module, words[2])) != NULL)
+            {
+              guint variable = words[2];
+
+              id->words = words;
+              id->n_words = count;
+              g_array_append_val (variables, variable);
+            }
+          break;
+        default:
+          break;
+        }
+
+      i += count;
+    }
+
+  if (success)
+    {
+      reflection->resources = g_array_new (FALSE, TRUE, sizeof (CgPrivSpirvResource));
+      reflection->inputs = g_array_new (FALSE, TRUE, sizeof (CgPrivSpirvInput));
+
+      for (guint i = 0; i < variables->len && success; i++)
+        {
+          guint variable = g_array_index (variables, guint, i);
+
+          success = add_variable (&module, reflection, &module.ids[variable], vertex, error);
+        }
+
+      if (!success)
+        cg_priv_spirv_reflection_clear (reflection);
+    }
+
+  g_array_unref (variables);
+  g_array_unref (module.members);
+  g_free (module.ids);
+
+  return success;
+}
+
+void
+cg_priv_spirv_reflection_clear (CgPrivSpirvReflection *self)
+{
+  if (self->resources != NULL)
+    {
+      for (guint i = 0; i < self->resources->len; i++)
+        {
+          CgPrivSpirvResource *resource = &g_array_index (self->resources, CgPrivSpirvResource, i);
+
+          g_free (resource->name);
+          g_free (resource->block_name);
+          if (resource->members != NULL)
+            {
+              for (guint j = 0; j < resource->members->len; j++)
+                g_free (g_array_index (resource->members, CgPrivSpirvMember, j).name);
+              g_array_unref (resource->members);
+            }
+        }
+      g_clear_pointer (&self->resources, g_array_unref);
+    }
+
+  if (self->inputs != NULL)
+    {
+      for (guint i = 0; i < self->inputs->len; i++)
+        g_free (g_array_index (self->inputs, CgPrivSpirvInput, i).name);
+      g_clear_pointer (&self->inputs, g_array_unref);
+    }
+}
@@ -0,0 +1,3162 @@
+/* cpc-gpu-sw.c
+ *
+ * Copyright 2025 Adam Masciola
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+#define G_LOG_DOMAIN "CpcGpuSW"
+#include "cpc-gpu-private.h"
+
+#include <string.h>
+
+#define CGS_MESSAGE_PREFIX "Software Backend: "
+#define CGS_CRITICAL(...) g_critical (CGS_MESSAGE_PREFIX __VA_ARGS__)
+#define CGS_CRITICAL_USER_ERROR(...) g_critical (CGS_MESSAGE_PREFIX "User Error: " __VA_ARGS__)
+#define CGS_SET_ERROR(error, code, ...) \
+  g_set_error ((error), CG_ERROR, (code), CGS_MESSAGE_PREFIX __VA_ARGS__)
+
+/* Shaders are not compiled. Instead, GLSL code names one of
+ * the built-in kernels below with this pragma, which GL
+ * ignores, so the same code runs on either backend. */
+#define CGS_KERNEL_PRAGMA "#pragma cpc_gpu_kernel"
+
+/* Render targets are split into square tiles. Triangles are
+ * binned into every tile their bounds touch, then tiles are
+ * rasterized independently on the gpu's worker threads. */
+#define CGS_TILE_SIZE 64
+/* Bins are rasterized early once they hold this many
+ * triangles, which bounds the memory a dispatch needs */
+#define CGS_MAX_BINNED_TRIANGLES 16384
+/* Below this, waking the workers costs more than it saves */
+#define CGS_PARALLEL_MIN_TRIANGLES 32
+#define CGS_PARALLEL_MIN_TILES 2
+
+#define CGS_MAX_TARGETS 8
+#define CGS_MAX_INPUTS 8
+#define CGS_MAX_VARYINGS 8
+
+/* Vertices are snapped to sixteenths of a pixel, which keeps
+ * edge functions exact in double precision, so that triangles
+ * sharing an edge never both cover, or both miss, a pixel */
+#define CGS_SUBPIXEL_STEPS 16.0f
+/* Triangles are only clipped against the sides of the view
+ * volume once they reach this many viewports past it */
+#define CGS_GUARD_BAND 4.0f
+#define CGS_MAX_CLIPPED_VERTICES 9
+
+/* Pixels are shaded in groups of four along a row, using
+ * the compiler's generic vectors, which map to SSE or NEON
+ * registers wherever those are available */
+#define CGS_LANES 4
+typedef float CgsVec __attribute__ ((vector_size (CGS_LANES * sizeof (float))));
+typedef gint32 CgsMask __attribute__ ((vector_size (CGS_LANES * sizeof (gint32))));
+typedef double CgsVecD __attribute__ ((vector_size (CGS_LANES * sizeof (double))));
+typedef gint64 CgsMaskD __attribute__ ((vector_size (CGS_LANES * sizeof (gint64))));
+
+typedef struct _CgsGpu CgsGpu;
+typedef struct _CgsPlan CgsPlan;
+typedef struct _CgsShader CgsShader;
+typedef struct _CgsBuffer CgsBuffer;
+typedef struct _CgsTexture CgsTexture;
+typedef struct _CgsCommands CgsCommands;
+typedef struct _CgsTimer CgsTimer;
+typedef struct _CgsReadback CgsReadback;
+
+typedef struct _Kernel Kernel;
+
+struct _CgsGpu
+{
+  CgGpu base;
+  gatomicrefcount refcount;
+
+  /* Held while dispatching, while touching pixels and while
+   * creating backend objects for resources, which happens
+   * lazily */
+  GMutex lock;
+
+  /* The calling thread rasterizes too, so this
+   * has one thread less than the gpu uses */
+  guint n_threads;
+  GThreadPool *workers;
+};
+
+struct _CgsPlan
+{
+  CgPlan base;
+  gatomicrefcount refcount;
+};
+
+struct _CgsShader
+{
+  CgShader base;
+  gatomicrefcount refcount;
+
+  const Kernel *kernel;
+};
+
+/* Vertex and index data are read straight from `init.data` */
+struct _CgsBuffer
+{
+  CgBuffer base;
+  gatomicrefcount refcount;
+};
+
+struct _CgsTexture
+{
+  CgTexture base;
+  gatomicrefcount refcount;
+
+  /* The layout the user uploads and downloads, with
+   * depth as floats. Only the base level is sampled;
+   * further levels follow it, written by depth pyramids. */
+  guchar *pixels;
+  gsize pixel_size;
+  /* One byte per texel, for depth formats with stencil */
+  guint8 *stencil;
+};
+
+struct _CgsCommands
+{
+  CgCommands base;
+  gatomicrefcount refcount;
+
+  GArray *nodes;
+};
+
+/* Dispatching is synchronous, so a
+ * ring of wall clock times will do */
+struct _CgsTimer
+{
+  guint n_queries;
+  guint head;
+  guint n_pending;
+  gint64 *begin;
+  gint64 *elapsed;
+};
+
+/* Likewise, readbacks copy the pixels right away */
+struct _CgsReadback
+{
+  guchar *pixels;
+  gsize size;
+};
+
+typedef struct
+{
+  int channels;
+  gboolean floating;
+} PixelFormat;
+
+static const PixelFormat pixel_formats[CG_N_FORMATS] = {
+  [CG_FORMAT_R8] = { 1, FALSE },
+  [CG_FORMAT_RA8] = { 2, FALSE },
+  [CG_FORMAT_RGB8] = { 3, FALSE },
+  [CG_FORMAT_RGBA8] = { 4, FALSE },
+  [CG_FORMAT_R32] = { 1, TRUE },
+  [CG_FORMAT_RGB32] = { 3, TRUE },
+  [CG_FORMAT_RGBA32] = { 4, TRUE },
+};
+static const PixelFormat depth_pixel_format = { 1, TRUE };
+
+static inline const PixelFormat *
+get_pixel_format (int format)
+{
+  return format == CG_PRIV_FORMAT_DEPTH ? &depth_pixel_format : &pixel_formats[format];
+}
+
+static inline int
+floor_to_int (float x)
+{
+  int i = (int)x;
+  return i - (x < (float)i);
+}
+
+static inline gboolean
+any_lane (CgsMask mask)
+{
+  return (mask[0] | mask[1] | mask[2] | mask[3]) != 0;
+}
+
+static inline gboolean
+any_lane_d (const CgsMaskD *mask)
+{
+  return ((*mask)[0] | (*mask)[1] | (*mask)[2] | (*mask)[3]) != 0;
+}
+
+/* Missing channels read as zero, and alpha as one */
+static inline void
+load_texel (const CgTexture *texture,
+            gsize texel,
+            float *out)
+{
+  const CgsTexture *sw_texture = (const CgsTexture *)texture;
+  const PixelFormat *format = get_pixel_format (texture->init.format);
+  const guchar *src = sw_texture->pixels + texel * sw_texture->pixel_size;
+
+  out[0] = out[1] = out[2] = 0.0f;
+  out[3] = 1.0f;
+
+  if (format->floating)
+    memcpy (out, src, format->channels * sizeof (float));
+  else
+    for (int i = 0; i < format->channels; i++)
+      out[i] = src[i] * (1.0f / G_MAXUINT8);
+}
+
+/* Bit `i` of `mask` enables channel `i`, matching the
+ * color bits of @a CG_WRITE_MASK_COLOR_RED and friends */
+static inline void
+pack_texel (guchar *dest,
+            const PixelFormat *format,
+            const float *in,
+            guint32 mask)
+{
+  for (int i = 0; i < format->channels; i++)
+    {
+      if (!(mask & (1 << i)))
+        continue;
+
+      if (format->floating)
+        memcpy (dest + i * sizeof (float), &in[i], sizeof (float));
+      else
+        dest[i] = (guchar)(CLAMP (in[i], 0.0f, 1.0f) * G_MAXUINT8 + 0.5f);
+    }
+}
+
+static inline void
+store_texel (CgTexture *texture,
+             gsize texel,
+             const float *in,
+             guint32 mask)
+{
+  CgsTexture *sw_texture = (CgsTexture *)texture;
+
+  pack_texel (sw_texture->pixels + texel * sw_texture->pixel_size,
+              get_pixel_format (texture->init.format), in, mask);
+}
+
+/* Bilinear filtering with repeating coordinates, like the
+ * default GL sampler, with the same swizzle for grayscale */
+static void
+sample_texture (const CgValue *value,
+                CgsVec u,
+                CgsVec v,
+                CgsVec *color)
+{
+  const CgTexture *texture = NULL;
+  int width = 0;
+  int height = 0;
+
+  if (value == NULL)
+    {
+      /* Like an incomplete GL texture */
+      color[0] = color[1] = color[2] = (CgsVec){ 0 };
+      color[3] = (CgsVec){ 0 } + 1.0f;
+      return;
+    }
+
+  texture = value->texture;
+  width = texture->init.width;
+  height = texture->init.height;
+
+  for (int lane = 0; lane < CGS_LANES; lane++)
+    {
+      float s = u[lane];
+      float t = v[lane];
+      int x0 = 0;
+      int y0 = 0;
+      int x1 = 0;
+      int y1 = 0;
+      float fx = 0.0f;
+      float fy = 0.0f;
+      float texels[4][4] = { 0 };
+      float texel[4] = { 0 };
+
+      /* Also catches NaN */
+      if (!(s > -1e6f && s < 1e6f))
+        s = 0.0f;
+      if (!(t > -1e6f && t < 1e6f))
+        t = 0.0f;
+
+      s = s * width - 0.5f;
+      t = t * height - 0.5f;
+      x0 = floor_to_int (s);
+      y0 = floor_to_int (t);
+      fx = s - x0;
+      fy = t - y0;
+
+      x0 = ((x0 % width) + width) % width;
+      y0 = ((y0 % height) + height) % height;
+      x1 = (x0 + 1) % width;
+      y1 = (y0 + 1) % height;
+
+      load_texel (texture, (gsize)y0 * width + x0, texels[0]);
+      load_texel (texture, (gsize)y0 * width + x1, texels[1]);
+      load_texel (texture, (gsize)y1 * width + x0, texels[2]);
+      load_texel (texture, (gsize)y1 * width + x1, texels[3]);
+
+      for (int i = 0; i < 4; i++)
+        {
+          float bottom = texels[0][i] + (texels[1][i] - texels[0][i]) * fx;
+          float top = texels[2][i] + (texels[3][i] - texels[2][i]) * fx;
+
+          texel[i] = bottom + (top - bottom) * fy;
+        }
+
+      if (texture->init.format == CG_FORMAT_R8)
+        texel[1] = texel[2] = texel[0];
+      else if (texture->init.format == CG_FORMAT_RA8)
+        {
+          texel[3] = texel[1];
+          texel[1] = texel[2] = texel[0];
+        }
+
+      for (int i = 0; i < 4; i++)
+        color[i][lane] = texel[i];
+    }
+}
+
+/* Kernels stand in for shaders. Uniforms are passed in the
+ * order the kernel lists them, and are NULL until set.
+ * Attributes are always four floats, which come from the
+ * fallback when no buffer provides them. */
+typedef struct
+{
+  const char *name;
+  int type;
+  float fallback[4];
+} KernelInput;
+
+typedef void (*KernelVertexFunc) (
+    const CgValue *const *uniforms,
+    const float (*attributes)[4],
+    float *position,
+    float *varyings);
+
+typedef void (*KernelFragmentFunc) (
+    const CgValue *const *uniforms,
+    const CgsVec *varyings,
+    CgsVec *color);
+
+struct _Kernel
+{
+  const char *name;
+  const KernelInput *attributes;
+  guint n_attributes;
+  const KernelInput *uniforms;
+  guint n_uniforms;
+  guint n_varyings;
+  KernelVertexFunc vertex;
+  KernelFragmentFunc fragment;
+};
+
+/* A mat4 uniform is column major, like in GLSL */
+static void
+transform_position (const CgValue *transform,
+                    const float *in,
+                    float *out)
+{
+  const float *m = NULL;
+
+  if (transform == NULL)
+    {
+      memcpy (out, in, sizeof (float) * 4);
+      return;
+    }
+
+  m = transform->mat4.initialized;
+  for (int i = 0; i < 4; i++)
+    out[i] = m[i] * in[0] + m[4 + i] * in[1] + m[8 + i] * in[2] + m[12 + i] * in[3];
+}
+
+static void
+tint_color (const CgValue *tint,
+            const float *in,
+            float *out)
+{
+  for (int i = 0; i < 4; i++)
+    out[i] = tint != NULL ? in[i] * tint->vec4[i] : in[i];
+}
+
+static const KernelInput color_attributes[] = {
+  { "position", CG_TYPE_VEC4, { 0.0f, 0.0f, 0.0f, 1.0f } },
+  { "color", CG_TYPE_VEC4, { 1.0f, 1.0f, 1.0f, 1.0f } },
+};
+
+static const KernelInput color_uniforms[] = {
+  { "transform", CG_TYPE_MAT4, { 0 } },
+  { "tint", CG_TYPE_VEC4, { 0 } },
+};
+
+static void
+color_vertex (const CgValue *const *uniforms,
+              const float (*attributes)[4],
+              float *position,
+              float *varyings)
+{
+  transform_position (uniforms[0], attributes[0], position);
+  tint_color (uniforms[1], attributes[1], varyings);
+}
+
+static void
+color_fragment (const CgValue *const *uniforms,
+                const CgsVec *varyings,
+                CgsVec *color)
+{
+  for (int i = 0; i < 4; i++)
+    color[i] = varyings[i];
+}
+
+static const KernelInput texture_attributes[] = {
+  { "position", CG_TYPE_VEC4, { 0.0f, 0.0f, 0.0f, 1.0f } },
+  { "uv", CG_TYPE_VEC2, { 0.0f, 0.0f, 0.0f, 1.0f } },
+  { "color", CG_TYPE_VEC4, { 1.0f, 1.0f, 1.0f, 1.0f } },
+};
+
+static const KernelInput texture_uniforms[] = {
+  { "transform", CG_TYPE_MAT4, { 0 } },
+  { "tint", CG_TYPE_VEC4, { 0 } },
+  { "tex", CG_TYPE_TEXTURE, { 0 } },
+};
+
+static void
+texture_vertex (const CgValue *const *uniforms,
+                const float (*attributes)[4],
+                float *position,
+                float *varyings)
+{
+  transform_position (uniforms[0], attributes[0], position);
+  varyings[0] = attributes[1][0];
+  varyings[1] = attributes[1][1];
+  tint_color (uniforms[1], attributes[2], varyings + 2);
+}
+
+/* Both textured kernels pass the coordinates,
+ * then the color, as their varyings */
+static inline void
+modulate_texture (const CgValue *texture,
+                  const CgsVec *varyings,
+                  CgsVec *color)
+{
+  sample_texture (texture, varyings[0], varyings[1], color);
+  for (int i = 0; i < 4; i++)
+    color[i] *= varyings[2 + i];
+}
+
+static void
+texture_fragment (const CgValue *const *uniforms,
+                  const CgsVec *varyings,
+                  CgsVec *color)
+{
+  modulate_texture (uniforms[2], varyings, color);
+}
+
+/* The same math as the shaders of CgBatch */
+static const KernelInput batch_attributes[] = {
+  { "batchCorner", CG_TYPE_VEC2, { 0.0f, 0.0f, 0.0f, 1.0f } },
+  { "batchTransformX", CG_TYPE_VEC3, { 1.0f, 0.0f, 0.0f, 1.0f } },
+  { "batchTransformY", CG_TYPE_VEC3, { 0.0f, 1.0f, 0.0f, 1.0f } },
+  { "batchUv", CG_TYPE_VEC4, { 0.0f, 0.0f, 1.0f, 1.0f } },
+  { "batchColor", CG_TYPE_VEC4, { 1.0f, 1.0f, 1.0f, 1.0f } },
+};
+
+static const KernelInput batch_uniforms[] = {
+  { "batchViewport", CG_TYPE_VEC2, { 0 } },
+  { "batchTexture", CG_TYPE_TEXTURE, { 0 } },
+};
+
+static void
+batch_vertex (const CgValue *const *uniforms,
+              const float (*attributes)[4],
+              float *position,
+              float *varyings)
+{
+  const float *corner = attributes[0];
+  const float *transform_x = attributes[1];
+  const float *transform_y = attributes[2];
+  const float *uv = attributes[3];
+  float x = 0.0f;
+  float y = 0.0f;
+
+  x = transform_x[0] * corner[0] + transform_x[1] * corner[1] + transform_x[2];
+  y = transform_y[0] * corner[0] + transform_y[1] * corner[1] + transform_y[2];
+  if (uniforms[0] != NULL)
+    {
+      x /= uniforms[0]->vec2[0];
+      y /= uniforms[0]->vec2[1];
+    }
+
+  position[0] = x * 2.0f - 1.0f;
+  position[1] = y * -2.0f + 1.0f;
+  position[2] = 0.0f;
+  position[3] = 1.0f;
+
+  varyings[0] = uv[0] + (uv[2] - uv[0]) * corner[0];
+  varyings[1] = uv[1] + (uv[3] - uv[1]) * corner[1];
+  memcpy (varyings + 2, attributes[4], sizeof (float) * 4);
+}
+
+static void
+batch_fragment (const CgValue *const *uniforms,
+                const CgsVec *varyings,
+                CgsVec *color)
+{
+  modulate_texture (uniforms[1], varyings, color);
+}
+
+static const Kernel kernels[] = {
+  {
+      .name = "color",
+      .attributes = color_attributes,
+      .n_attributes = G_N_ELEMENTS (color_attributes),
+      .uniforms = color_uniforms,
+      .n_uniforms = G_N_ELEMENTS (color_uniforms),
+      .n_varyings = 4,
+      .vertex = color_vertex,
+      .fragment = color_fragment,
+  },
+  {
+      .name = "texture",
+      .attributes = texture_attributes,
+      .n_attributes = G_N_ELEMENTS (texture_attributes),
+      .uniforms = texture_uniforms,
+      .n_uniforms = G_N_ELEMENTS (texture_uniforms),
+      .n_varyings = 6,
+      .vertex = texture_vertex,
+      .fragment = texture_fragment,
+  },
+  {
+      .name = "batch",
+      .attributes = batch_attributes,
+      .n_attributes = G_N_ELEMENTS (batch_attributes),
+      .uniforms = batch_uniforms,
+      .n_uniforms = G_N_ELEMENTS (batch_uniforms),
+      .n_varyings = 6,
+      .vertex = batch_vertex,
+      .fragment = batch_fragment,
+  },
+};
+
+static int
+find_kernel_input (const KernelInput *inputs,
+                   guint n_inputs,
+                   const char *name)
+{
+  for (guint i = 0; i < n_inputs; i++)
+    if (g_str_equal (inputs[i].name, name))
+      return i;
+
+  return -1;
+}
+
+static GPrivate current_context = G_PRIVATE_INIT (cg_gpu_unref);
+
+static CgGpu *
+get_gpu_for_this_thread (void)
+{
+  return g_private_get (&current_context);
+}
+
+static void
+set_gpu_for_this_thread (CgGpu *gpu)
+{
+  g_private_replace (&current_context, cg_gpu_ref (gpu));
+}
+
+static void rasterize_job (gpointer job_data,
+                           gpointer user_data);
+
+static CgGpu *
+gpu_new (guint32 flags,
+         gpointer extra_data,
+         GError **error)
+{
+  g_autoptr (CgGpu) gpu = NULL;
+  CgsGpu *sw_gpu = NULL;
+  guint n_threads = 0;
+
+  gpu = (CgGpu *)CG_PRIV_CREATE (sw_gpu);
+  gpu->impl = &cg_sw_impl;
+  sw_gpu = (CgsGpu *)gpu;
+  g_atomic_ref_count_init (&sw_gpu->refcount);
+  g_mutex_init (&sw_gpu->lock);
+
+  /* `extra_data` may point to the number of threads to use */
+  if (extra_data != NULL)
+    n_threads = *(const guint *)extra_data;
+  if (n_threads == 0)
+    n_threads = g_get_num_processors ();
+
+  sw_gpu->n_threads = n_threads;
+  if (n_threads > 1)
+    {
+      sw_gpu->workers = g_thread_pool_new (
+          rasterize_job, NULL, n_threads - 1, FALSE, error);
+      if (sw_gpu->workers == NULL)
+        return NULL;
+    }
+
+  return g_steal_pointer (&gpu);
+}
+
+static CgGpu *
+gpu_ref (CgGpu *self)
+{
+  CgsGpu *sw_gpu = (CgsGpu *)self;
+
+  g_atomic_ref_count_inc (&sw_gpu->refcount);
+  return self;
+}
+
+static void
+clear_gpu (CgGpu *self)
+{
+  CgsGpu *sw_gpu = (CgsGpu *)self;
+
+  if (sw_gpu->workers != NULL)
+    g_thread_pool_free (g_steal_pointer (&sw_gpu->workers), FALSE, TRUE);
+  g_mutex_clear (&sw_gpu->lock);
+}
+
+static void
+gpu_unref (CgGpu *self)
+{
+  CgsGpu *sw_gpu = (CgsGpu *)self;
+
+  if (g_atomic_ref_count_dec (&sw_gpu->refcount))
+    {
+      clear_gpu (self);
+      g_free (self);
+    }
+}
+
+static gboolean
+gpu_share (CgGpu *self,
+           CgGpu *share,
+           GError **error)
+{
+  CGS_SET_ERROR (
+      error, CG_ERROR_NOT_SUPPORTED,
+      "Share groups are not supported");
+  return FALSE;
+}
+
+static char *
+gpu_get_info (CgGpu *self,
+              const char *param,
+              GError **error)
+{
+  CgsGpu *sw_gpu = (CgsGpu *)self;
+
+  if (g_str_equal (param, "vendor"))
+    return g_strdup ("cpc-gpu");
+  else if (g_str_equal (param, "renderer"))
+    return g_strdup_printf ("Software rasterizer (%u threads)", sw_gpu->n_threads);
+  else if (g_str_equal (param, "version"))
+    return g_strdup (PACKAGE_VERSION);
+
+  return NULL;
+}
+
+static gboolean
+gpu_flush (CgGpu *self,
+           GError **error)
+{
+  /* Nothing is ever deferred */
+  return TRUE;
+}
+
+static void
+init_plan (CgPlan *self)
+{
+}
+
+static void
+clear_plan (CgPlan *self)
+{
+  cg_priv_plan_finish (self);
+}
+
+static void
+init_shader (CgShader *self)
+{
+}
+
+static void
+clear_shader (CgShader *self)
+{
+  cg_priv_shader_finish (self);
+}
+
+static void
+init_buffer (CgBuffer *self)
+{
+}
+
+static void
+clear_buffer (CgBuffer *self)
+{
+  cg_priv_buffer_finish (self);
+}
+
+static void
+init_texture (CgTexture *self)
+{
+}
+
+static void
+clear_texture (CgTexture *self)
+{
+  CgsTexture *sw_texture = (CgsTexture *)self;
+
+  g_clear_pointer (&sw_texture->pixels, g_free);
+  g_clear_pointer (&sw_texture->stencil, g_free);
+  cg_priv_texture_finish (self);
+}
+
+static void
+init_commands (CgCommands *self)
+{
+}
+
+static void
+clear_commands (CgCommands *self)
+{
+  CgsCommands *sw_commands = (CgsCommands *)self;
+
+  g_clear_pointer (&sw_commands->nodes, g_array_unref);
+  cg_priv_commands_finish (self);
+}
+
+#define DEFINE_BASIC_OBJECT(name, type, parent_type)        \
+  static parent_type *                                      \
+      name##_new (CgGpu *self)                              \
+  {                                                         \
+    parent_type *obj = (parent_type *)g_new0 (type, 1);     \
+    g_atomic_ref_count_init (&((type *)obj)->refcount);     \
+    init_##name (obj);                                      \
+    return obj;                                             \
+  }                                                         \
+  static parent_type *                                      \
+      name##_ref (parent_type *self)                        \
+  {                                                         \
+    g_atomic_ref_count_inc (&((type *)self)->refcount);     \
+    return self;                                            \
+  }                                                         \
+  static inline void                                        \
+      destroy_##name (parent_type *self)                    \
+  {                                                         \
+    clear_##name (self);                                    \
+    g_free (self);                                          \
+  }                                                         \
+  static void                                               \
+      name##_unref (parent_type *self)                      \
+  {                                                         \
+    if (g_atomic_ref_count_dec (&((type *)self)->refcount)) \
+      destroy_##name (self);                                \
+  }
+
+DEFINE_BASIC_OBJECT (plan, CgsPlan, CgPlan)
+DEFINE_BASIC_OBJECT (shader, CgsShader, CgShader)
+DEFINE_BASIC_OBJECT (buffer, CgsBuffer, CgBuffer)
+DEFINE_BASIC_OBJECT (texture, CgsTexture, CgTexture)
+DEFINE_BASIC_OBJECT (commands, CgsCommands, CgCommands)
+
+#undef DEFINE_BASIC_OBJECT
+
+static void
+timer_free (CgGpu *self,
+            gpointer timer)
+{
+  CgsTimer *sw_timer = timer;
+
+  g_free (sw_timer->begin);
+  g_free (sw_timer->elapsed);
+  g_free (sw_timer);
+}
+
+static gpointer
+timer_new (CgGpu *self,
+           guint n_queries,
+           GError **error)
+{
+  CgsTimer *timer = NULL;
+
+  timer = CG_PRIV_CREATE (timer);
+  timer->n_queries = n_queries;
+  timer->begin = g_new0 (gint64, n_queries);
+  timer->elapsed = g_new0 (gint64, n_queries);
+
+  return timer;
+}
+
+static gboolean
+timer_begin (CgGpu *self,
+             gpointer timer)
+{
+  CgsTimer *sw_timer = timer;
+
+  /* Every result is still uncollected, skip this one */
+  if (sw_timer->n_pending == sw_timer->n_queries)
+    return FALSE;
+
+  sw_timer->begin[sw_timer->head] = g_get_monotonic_time ();
+  return TRUE;
+}
+
+static void
+timer_end (CgGpu *self,
+           gpointer timer)
+{
+  CgsTimer *sw_timer = timer;
+
+  sw_timer->elapsed[sw_timer->head] = g_get_monotonic_time () - sw_timer->begin[sw_timer->head];
+  sw_timer->head = (sw_timer->head + 1) % sw_timer->n_queries;
+  sw_timer->n_pending++;
+}
+
+static gboolean
+timer_collect (CgGpu *self,
+               gpointer timer,
+               guint64 *nanoseconds)
+{
+  CgsTimer *sw_timer = timer;
+  guint query = 0;
+
+  if (sw_timer->n_pending == 0)
+    return FALSE;
+
+  query = (sw_timer->head + sw_timer->n_queries - sw_timer->n_pending) % sw_timer->n_queries;
+  sw_timer->n_pending--;
+
+  *nanoseconds = (guint64)sw_timer->elapsed[query] * 1000;
+  return TRUE;
+}
+
+/* Every dispatch has finished by the time it returns,
+ * so fences are always signaled */
+static gpointer
+fence_new (CgGpu *self,
+           GError **error)
+{
+  return g_new0 (guint8, 1);
+}
+
+static void
+fence_free (CgGpu *self,
+            gpointer fence)
+{
+  g_free (fence);
+}
+
+static void
+fence_wait (CgGpu *self,
+            gpointer fence)
+{
+}
+
+static gboolean
+fence_client_wait (CgGpu *self,
+                   gpointer fence,
+                   guint64 timeout,
+                   GError **error)
+{
+  return TRUE;
+}
+
+static char *
+get_kernel_name (const char *code)
+{
+  const char *start = NULL;
+  const char *end = NULL;
+
+  if (code == NULL)
+    return NULL;
+
+  start = strstr (code, CGS_KERNEL_PRAGMA);
+  if (start == NULL)
+    return NULL;
+
+  start += strlen (CGS_KERNEL_PRAGMA);
+  while (*start == ' ' || *start == '\t')
+    start++;
+  for (end = start; g_ascii_isalnum (*end) || *end == '_'; end++)
+    ;
+
+  return g_strndup (start, end - start);
+}
+
+static gboolean
+ensure_shader (CgShader *self,
+               GError **error)
+{
+  CgsShader *sw_shader = (CgsShader *)self;
+  g_autofree char *vertex_name = NULL;
+  g_autofree char *fragment_name = NULL;
+  const char *name = NULL;
+
+  if (sw_shader->kernel != NULL)
+    return TRUE;
+
+  if (self->init.vertex_code == NULL || self->init.fragment_code == NULL)
+    {
+      CGS_SET_ERROR (
+          error, CG_ERROR_NOT_SUPPORTED,
+          "SPIR-V shaders are not supported, only GLSL "
+          "code which names a built-in kernel");
+      return FALSE;
+    }
+
+  vertex_name = get_kernel_name (self->init.vertex_code);
+  fragment_name = get_kernel_name (self->init.fragment_code);
+  if (vertex_name == NULL && fragment_name == NULL)
+    {
+      CGS_SET_ERROR (
+          error, CG_ERROR_FAILED_SHADER_GEN,
+          "Shader code must name a built-in kernel with \"%s <name>\"",
+          CGS_KERNEL_PRAGMA);
+      return FALSE;
+    }
+  if (vertex_name != NULL && fragment_name != NULL
+      && !g_str_equal (vertex_name, fragment_name))
+    {
+      CGS_SET_ERROR (
+          error, CG_ERROR_FAILED_SHADER_GEN,
+          "Vertex and fragment code name different kernels: \"%s\" and \"%s\"",
+          vertex_name, fragment_name);
+      return FALSE;
+    }
+
+  name = vertex_name != NULL ? vertex_name : fragment_name;
+  for (guint i = 0; i < G_N_ELEMENTS (kernels); i++)
+    {
+      if (g_str_equal (kernels[i].name, name))
+        {
+          sw_shader->kernel = &kernels[i];
+          return TRUE;
+        }
+    }
+
+  CGS_SET_ERROR (
+      error, CG_ERROR_FAILED_SHADER_GEN,
+      "There is no built-in kernel named \"%s\"",
+      name);
+  return FALSE;
+}
+
+static gboolean
+ensure_buffer (CgBuffer *self,
+               gboolean indices,
+               GError **error)
+{
+  if (indices && self->index_format == 0)
+    {
+      CGS_SET_ERROR (
+          error, CG_ERROR_FAILED_BUFFER_GEN,
+          "Buffer was not created to hold indices");
+      return FALSE;
+    }
+  if (!indices && self->spec == NULL)
+    {
+      CGS_SET_ERROR (
+          error, CG_ERROR_FAILED_BUFFER_GEN,
+          "Buffer needs a layout specification "
+          "to be used as an attribute");
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static gsize
+get_level_offset (const CgTexture *texture,
+                  gsize pixel_size,
+                  int level)
+{
+  gsize offset = 0;
+
+  for (int i = 0; i < level; i++)
+    offset += (gsize)MAX (1, texture->init.width >> i) * MAX (1, texture->init.height >> i);
+
+  return offset * pixel_size;
+}
+
+static gboolean
+ensure_texture (CgTexture *self,
+                GError **error)
+{
+  CgsTexture *sw_texture = (CgsTexture *)self;
+  gsize size = 0;
+  const PixelFormat *format = NULL;
+
+  if (sw_texture->pixels != NULL)
+    return TRUE;
+
+  if (self->init.native || self->init.native_framebuffer)
+    {
+      CGS_SET_ERROR (
+          error, CG_ERROR_NOT_SUPPORTED,
+          "Native textures are not supported");
+      return FALSE;
+    }
+
+  /* Multisampling is ignored, every
+   * texture has a single sample */
+  format = get_pixel_format (self->init.format);
+  sw_texture->pixel_size = format->channels * (format->floating ? sizeof (float) : 1);
+  size = (gsize)self->init.width * self->init.height
+         * sw_texture->pixel_size * (self->init.cubemap ? 6 : 1);
+
+  if (!self->init.cubemap && self->init.mipmaps > 1)
+    {
+      sw_texture->pixels = g_malloc0 (
+          get_level_offset (self, sw_texture->pixel_size, self->init.mipmaps));
+      if (self->init.data != NULL)
+        memcpy (sw_texture->pixels, self->init.data, size);
+      g_clear_pointer (&self->init.data, g_free);
+    }
+  else if (self->init.data != NULL)
+    sw_texture->pixels = g_steal_pointer (&self->init.data);
+  else
+    sw_texture->pixels = g_malloc0 (size);
+
+  /* Depth stays in floats whatever the precision of
+   * its format, and stencil gets a plane of its own */
+  if (cg_priv_texture_has_stencil (self))
+    sw_texture->stencil = g_malloc0 ((gsize)self->init.width * self->init.height);
+
+  return TRUE;
+}
+
+static gboolean
+texture_update (CgTexture *self,
+                int x,
+                int y,
+                int width,
+                int height,
+                gconstpointer data,
+                GError **error)
+{
+  CgsGpu *sw_gpu = (CgsGpu *)self->gpu;
+  CgsTexture *sw_texture = (CgsTexture *)self;
+  gsize row_size = 0;
+
+  g_mutex_lock (&sw_gpu->lock);
+
+  if (!ensure_texture (self, error))
+    {
+      g_mutex_unlock (&sw_gpu->lock);
+      return FALSE;
+    }
+
+  row_size = width * sw_texture->pixel_size;
+  for (int row = 0; row < height; row++)
+    memcpy (sw_texture->pixels
+                + ((gsize)(y + row) * self->init.width + x) * sw_texture->pixel_size,
+            (const guchar *)data + row * row_size,
+            row_size);
+
+  g_mutex_unlock (&sw_gpu->lock);
+  return TRUE;
+}
+
+static gboolean
+texture_download (CgTexture *self,
+                  gpointer data,
+                  gsize size,
+                  GError **error)
+{
+  CgsGpu *sw_gpu = (CgsGpu *)self->gpu;
+  CgsTexture *sw_texture = (CgsTexture *)self;
+  gsize needed = 0;
+
+  g_mutex_lock (&sw_gpu->lock);
+
+  if (!ensure_texture (self, error))
+    {
+      g_mutex_unlock (&sw_gpu->lock);
+      return FALSE;
+    }
+
+  needed = (gsize)self->init.width * self->init.height * sw_texture->pixel_size;
+  if (size < needed)
+    {
+      g_mutex_unlock (&sw_gpu->lock);
+      CGS_SET_ERROR (
+          error, CG_ERROR_FAILED_TEXTURE_GEN,
+          "Destination of %zu bytes is too small for texture contents",
+          size);
+      return FALSE;
+    }
+
+  memcpy (data, sw_texture->pixels, needed);
+
+  g_mutex_unlock (&sw_gpu->lock);
+  return TRUE;
+}
+
+static gpointer
+readback_new (CgTexture *self,
+              int x,
+              int y,
+              int width,
+              int height,
+              int format,
+              GError **error)
+{
+  CgsGpu *sw_gpu = (CgsGpu *)self->gpu;
+  CgsTexture *sw_texture = (CgsTexture *)self;
+  const PixelFormat *dest_format = NULL;
+  gsize dest_pixel_size = 0;
+  CgsReadback *readback = NULL;
+
+  g_mutex_lock (&sw_gpu->lock);
+
+  if (!ensure_texture (self, error))
+    {
+      g_mutex_unlock (&sw_gpu->lock);
+      return NULL;
+    }
+
+  dest_format = get_pixel_format (format);
+  dest_pixel_size = cg_priv_get_pixel_size (format);
+
+  readback = CG_PRIV_CREATE (readback);
+  readback->size = (gsize)width * height * dest_pixel_size;
+  readback->pixels = g_malloc (readback->size);
+
+  for (int row = 0; row < height; row++)
+    {
+      gsize texel = (gsize)(y + row) * self->init.width + x;
+      guchar *dest = readback->pixels + (gsize)row * width * dest_pixel_size;
+
+      if (format == self->init.format)
+        {
+          memcpy (dest, sw_texture->pixels + texel * sw_texture->pixel_size,
+                  width * dest_pixel_size);
+          continue;
+        }
+
+      for (int column = 0; column < width; column++)
+        {
+          float rgba[4] = { 0 };
+
+          load_texel (self, texel + column, rgba);
+          pack_texel (dest + column * dest_pixel_size, dest_format, rgba, CG_WRITE_MASK_COLOR);
+        }
+    }
+
+  g_mutex_unlock (&sw_gpu->lock);
+  return readback;
+}
+
+static void
+readback_free (CgGpu *self,
+               gpointer readback)
+{
+  CgsReadback *sw_readback = readback;
+
+  g_free (sw_readback->pixels);
+  g_free (sw_readback);
+}
+
+static gboolean
+readback_wait (CgGpu *self,
+               gpointer readback,
+               guint64 timeout,
+               GError **error)
+{
+  return TRUE;
+}
+
+static gboolean
+readback_read (CgGpu *self,
+               gpointer readback,
+               gpointer data,
+               GError **error)
+{
+  CgsReadback *sw_readback = readback;
+
+  memcpy (data, sw_readback->pixels, sw_readback->size);
+  return TRUE;
+}
+
+static gboolean
+texture_import_dmabuf (CgTexture *self,
+                       const CgDmabuf *dmabuf,
+                       GError **error)
+{
+  CGS_SET_ERROR (
+      error, CG_ERROR_NOT_SUPPORTED,
+      "DMA-BUF import is not supported");
+  return FALSE;
+}
+
+static gboolean
+texture_export_dmabuf (CgTexture *self,
+                       CgDmabuf *dmabuf,
+                       GError **error)
+{
+  CGS_SET_ERROR (
+      error, CG_ERROR_NOT_SUPPORTED,
+      "DMA-BUF export is not supported");
+  return FALSE;
+}
+
+typedef struct
+{
+  CgCommands *commands;
+  gboolean failure;
+  GError **error;
+} EnsureData;
+
+typedef struct
+{
+  EnsureData *ensure_data;
+  CgShader *shader;
+} ValidateUniformData;
+
+static gboolean
+test_uniform_validity (
+    const char *name,
+    const CgValue *value,
+    ValidateUniformData *data)
+{
+  const Kernel *kernel = ((CgsShader *)data->shader)->kernel;
+  int input = 0;
+
+  /* Frontend API should have verified that a shader was present. */
+  g_assert (data->shader != NULL);
+
+  input = find_kernel_input (kernel->uniforms, kernel->n_uniforms, name);
+  if (input < 0)
+    {
+      CGS_SET_ERROR (
+          data->ensure_data->error, CG_ERROR_FAILED_SHADER_UNIFORM_SET,
+          "Uniform \"%s\" does not exist in shader",
+          name);
+      return TRUE;
+    }
+  if (kernel->uniforms[input].type != value->type)
+    {
+      CGS_SET_ERROR (
+          data->ensure_data->error, CG_ERROR_FAILED_SHADER_UNIFORM_SET,
+          "Submitted value type does not match shader type for uniform "
+          "\"%s\": expected %s, got %s",
+          name,
+          cg_priv_get_type_name (kernel->uniforms[input].type),
+          cg_priv_get_type_name (value->type));
+      return TRUE;
+    }
+
+  if (value->type == CG_TYPE_TEXTURE)
+    {
+      if (!ensure_texture (value->texture, data->ensure_data->error))
+        return TRUE;
+
+      if (value->texture->init.cubemap)
+        {
+          CGS_SET_ERROR (
+              data->ensure_data->error, CG_ERROR_FAILED_SHADER_UNIFORM_SET,
+              "Uniform \"%s\" does not expect a cubemap",
+              name);
+          return TRUE;
+        }
+    }
+
+  return FALSE;
+}
+
+static gboolean
+test_attribute_validity (
+    const char *name,
+    gconstpointer value,
+    ValidateUniformData *data)
+{
+  const Kernel *kernel = NULL;
+
+  g_assert (data->shader != NULL);
+
+  kernel = ((CgsShader *)data->shader)->kernel;
+  if (find_kernel_input (kernel->attributes, kernel->n_attributes, name) >= 0)
+    return FALSE;
+
+  CGS_SET_ERROR (
+      data->ensure_data->error, CG_ERROR_FAILED_SHADER_UNIFORM_SET,
+      "Attribute \"%s\" does not exist in shader",
+      name);
+  return TRUE;
+}
+
+static gboolean
+ensure_pass (CgPrivInstr *instr,
+             EnsureData *data)
+{
+  ValidateUniformData validate_data = { 0 };
+
+  if (instr->pass.shader != NULL
+      && !ensure_shader (instr->pass.shader, data->error))
+    return FALSE;
+
+  if (instr->pass.targets->len > CGS_MAX_TARGETS)
+    {
+      CGS_SET_ERROR (
+          data->error, CG_ERROR_FAILED_TARGET_CREATION,
+          "At most %d targets are supported", CGS_MAX_TARGETS);
+      return FALSE;
+    }
+
+  for (guint i = 0; i < instr->pass.targets->len; i++)
+    {
+      CgPrivTarget *target = &g_array_index (instr->pass.targets, CgPrivTarget, i);
+
+      if (!ensure_texture (target->texture, data->error))
+        return FALSE;
+
+      if (target->texture->init.cubemap)
+        {
+          CGS_SET_ERROR (
+              data->error, CG_ERROR_FAILED_TARGET_CREATION,
+              "Cubemaps cannot be rendered into");
+          return FALSE;
+        }
+
+      if (target->src_blend >= CG_BLEND_SRC1_COLOR
+          || target->dst_blend >= CG_BLEND_SRC1_COLOR)
+        {
+          CGS_SET_ERROR (
+              data->error, CG_ERROR_NOT_SUPPORTED,
+              "Dual source blending is not supported");
+          return FALSE;
+        }
+    }
+
+  if (instr->pass.shader == NULL)
+    return TRUE;
+
+  validate_data.ensure_data = data;
+  validate_data.shader = instr->pass.shader;
+  return g_hash_table_find (instr->pass.uniforms.hash,
+                            (GHRFunc)test_uniform_validity, &validate_data)
+             == NULL
+         && g_hash_table_find (instr->pass.attributes,
+                               (GHRFunc)test_attribute_validity, &validate_data)
+                == NULL;
+}
+
+static gboolean
+ensure_vertices (CgPrivInstr *pass_instr,
+                 CgPrivInstr *instr,
+                 EnsureData *data)
+{
+  const Kernel *kernel = NULL;
+
+  if (instr->vertices.topology != CG_TOPOLOGY_TRIANGLES
+      && instr->vertices.topology != CG_TOPOLOGY_TRIANGLE_STRIP)
+    {
+      CGS_SET_ERROR (
+          data->error, CG_ERROR_NOT_SUPPORTED,
+          "Only triangles can be rasterized");
+      return FALSE;
+    }
+
+  /* Frontend API should have verified that a shader was present. */
+  g_assert (pass_instr->pass.shader != NULL);
+  kernel = ((CgsShader *)pass_instr->pass.shader)->kernel;
+
+  for (guint i = 0; i < instr->vertices.n_buffers; i++)
+    {
+      CgBuffer *buffer = instr->vertices.n_buffers > 1
+                             ? instr->vertices.many_buffers[i]
+                             : instr->vertices.one_buffer;
+
+      if (!ensure_buffer (buffer, FALSE, data->error))
+        return FALSE;
+
+      for (guint j = 0; j < buffer->spec_length; j++)
+        {
+          if (find_kernel_input (kernel->attributes, kernel->n_attributes,
+                                 buffer->spec[j].name)
+              < 0)
+            {
+              CGS_SET_ERROR (
+                  data->error, CG_ERROR_FAILED_SHADER_UNIFORM_SET,
+                  "Attribute \"%s\" does not exist in shader",
+                  buffer->spec[j].name);
+              return FALSE;
+            }
+        }
+    }
+
+  return instr->vertices.indices == NULL
+         || ensure_buffer (instr->vertices.indices, TRUE, data->error);
+}
+
+static gboolean
+ensure_instr_node (GArray *nodes,
+                   guint node,
+                   EnsureData *data)
+{
+  CgPrivInstr *instr = CG_PRIV_NODE_INSTR (nodes, node);
+
+  switch (instr->type)
+    {
+    case CG_PRIV_INSTR_PASS:
+      if (!ensure_pass (instr, data))
+        {
+          data->failure = TRUE;
+          return TRUE;
+        }
+      break;
+    case CG_PRIV_INSTR_VERTICES:
+      if (!ensure_vertices (
+              CG_PRIV_NODE_INSTR (nodes, CG_PRIV_NODE (nodes, node)->parent),
+              instr, data))
+        {
+          data->failure = TRUE;
+          return TRUE;
+        }
+      break;
+    case CG_PRIV_INSTR_BLIT:
+      if (!ensure_texture (instr->blit.src, data->error))
+        {
+          data->failure = TRUE;
+          return TRUE;
+        }
+      break;
+    case CG_PRIV_INSTR_DEPTH_PYRAMID:
+      if (!ensure_texture (instr->depth_pyramid.depth, data->error)
+          || !ensure_texture (instr->depth_pyramid.pyramid, data->error))
+        {
+          data->failure = TRUE;
+          return TRUE;
+        }
+      break;
+    default:
+      g_assert_not_reached ();
+    }
+
+  return FALSE;
+}
+
+/* Everything a triangle needs from the pass which drew it */
+typedef struct
+{
+  const Kernel *kernel;
+  const CgValue *uniforms[CGS_MAX_INPUTS];
+
+  int blends[CGS_MAX_TARGETS][2];
+  gboolean reads_targets[CGS_MAX_TARGETS];
+  guint32 write_mask;
+  int depth_func;
+  gboolean clockwise_faces;
+  gboolean backface_cull;
+  int stencil_func;
+  guint8 stencil_ref;
+  guint8 stencil_mask;
+  int stencil_ops[3];
+
+  float viewport[4];
+  /* Left, bottom, right, top, exclusive of the end */
+  int scissor[4];
+} Draw;
+
+typedef struct
+{
+  float position[4];
+  float varyings[CGS_MAX_VARYINGS];
+} Vertex;
+
+/* Edge `i` runs between the two vertices other than vertex
+ * `i`, so that it evaluates to the doubled area of the
+ * triangle at vertex `i` and to zero at the others */
+typedef struct
+{
+  guint draw;
+  int bounds[4];
+
+  double a[3];
+  double b[3];
+  double origin_x[3];
+  double origin_y[3];
+  gboolean owner[3];
+  double inv_area;
+
+  float z[3];
+  float inv_w[3];
+  float varyings[3][CGS_MAX_VARYINGS];
+} Triangle;
+
+/* Uniform values stay with a shader for the rest of the
+ * dispatch once set, like they stay with a GL program */
+typedef struct
+{
+  const CgValue *values[CGS_MAX_INPUTS];
+} UniformState;
+
+typedef struct
+{
+  CgCommands *commands;
+  GArray *nodes;
+  GError **error;
+
+  GHashTable *states;
+
+  /* The pass whose targets are bound, colors
+   * in the order they were given, then depth */
+  CgPrivInstr *open;
+  CgTexture *colors[CGS_MAX_TARGETS];
+  guint n_colors;
+  CgTexture *depth;
+  int width;
+  int height;
+  guint tiles_x;
+  guint tiles_y;
+
+  GArray *draws;
+  GArray *triangles;
+  GPtrArray *bins;
+  guint draw;
+} RunData;
+
+typedef struct
+{
+  RunData *data;
+  guint *tiles;
+  guint n_tiles;
+  gint next;
+
+  GMutex mutex;
+  GCond cond;
+  guint pending;
+} RasterJob;
+
+static inline CgsMask
+test_values (int func,
+             CgsVec z,
+             CgsVec stored)
+{
+  switch (func)
+    {
+    case CG_TEST_NEVER:
+      return (CgsMask){ 0 };
+    case CG_TEST_ALWAYS:
+      return (CgsMask){ 0 } - 1;
+    case CG_TEST_LESS:
+      return z < stored;
+    case CG_TEST_LEQUAL:
+      return z <= stored;
+    case CG_TEST_GREATER:
+      return z > stored;
+    case CG_TEST_GEQUAL:
+      return z >= stored;
+    case CG_TEST_EQUAL:
+      return z == stored;
+    case CG_TEST_NOT_EQUAL:
+      return z != stored;
+    default:
+      return (CgsMask){ 0 } - 1;
+    }
+}
+
+static inline void
+update_stencil (const Draw *draw,
+                guint8 *stored,
+                CgsMask mask,
+                int op)
+{
+  if (op == CG_STENCIL_OP_KEEP
+      || !(draw->write_mask & CG_WRITE_MASK_STENCIL)
+      || !any_lane (mask))
+    return;
+
+  for (int lane = 0; lane < CGS_LANES; lane++)
+    {
+      if (!mask[lane])
+        continue;
+
+      switch (op)
+        {
+        case CG_STENCIL_OP_ZERO:
+          stored[lane] = 0;
+          break;
+        case CG_STENCIL_OP_REPLACE:
+          stored[lane] = draw->stencil_ref;
+          break;
+        case CG_STENCIL_OP_INCREMENT:
+          if (stored[lane] < G_MAXUINT8)
+            stored[lane]++;
+          break;
+        case CG_STENCIL_OP_DECREMENT:
+          if (stored[lane] > 0)
+            stored[lane]--;
+          break;
+        case CG_STENCIL_OP_INVERT:
+          stored[lane] = ~stored[lane];
+          break;
+        case CG_STENCIL_OP_INCREMENT_WRAP:
+          stored[lane]++;
+          break;
+        case CG_STENCIL_OP_DECREMENT_WRAP:
+          stored[lane]--;
+          break;
+        default:
+          break;
+        }
+    }
+}
+
+/* The blend color is never set, so it is always zero */
+static inline float
+get_blend_factor (int factor,
+                  const float *src,
+                  const float *dst,
+                  int channel)
+{
+  switch (factor)
+    {
+    case CG_BLEND_ZERO:
+      return 0.0f;
+    case CG_BLEND_ONE:
+      return 1.0f;
+    case CG_BLEND_SRC_COLOR:
+      return src[channel];
+    case CG_BLEND_ONE_MINUS_SRC_COLOR:
+      return 1.0f - src[channel];
+    case CG_BLEND_DST_COLOR:
+      return dst[channel];
+    case CG_BLEND_ONE_MINUS_DST_COLOR:
+      return 1.0f - dst[channel];
+    case CG_BLEND_SRC_ALPHA:
+      return src[3];
+    case CG_BLEND_ONE_MINUS_SRC_ALPHA:
+      return 1.0f - src[3];
+    case CG_BLEND_DST_ALPHA:
+      return dst[3];
+    case CG_BLEND_ONE_MINUS_DST_ALPHA:
+      return 1.0f - dst[3];
+    case CG_BLEND_CONSTANT_COLOR:
+    case CG_BLEND_CONSTANT_ALPHA:
+      return 0.0f;
+    case CG_BLEND_ONE_MINUS_CONSTANT_COLOR:
+    case CG_BLEND_ONE_MINUS_CONSTANT_ALPHA:
+      return 1.0f;
+    case CG_BLEND_SRC_ALPHA_SATURATE:
+      return channel == 3 ? 1.0f : MIN (src[3], 1.0f - dst[3]);
+    default:
+      return 0.0f;
+    }
+}
+
+static inline gboolean
+blend_reads_target (int src_blend,
+                    int dst_blend)
+{
+  return dst_blend != CG_BLEND_ZERO
+         || src_blend == CG_BLEND_DST_COLOR
+         || src_blend == CG_BLEND_ONE_MINUS_DST_COLOR
+         || src_blend == CG_BLEND_DST_ALPHA
+         || src_blend == CG_BLEND_ONE_MINUS_DST_ALPHA
+         || src_blend == CG_BLEND_SRC_ALPHA_SATURATE;
+}
+
+static void
+write_pixels (const Draw *draw,
+              guint target,
+              CgTexture *texture,
+              int x,
+              int y,
+              CgsMask mask,
+              const CgsVec *color)
+{
+  gboolean floating = get_pixel_format (texture->init.format)->floating;
+  int src_blend = draw->blends[target][0];
+  int dst_blend = draw->blends[target][1];
+  gsize texel = (gsize)y * texture->init.width + x;
+
+  for (int lane = 0; lane < CGS_LANES; lane++)
+    {
+      float src[4] = { 0 };
+      float dst[4] = { 0.0f, 0.0f, 0.0f, 1.0f };
+      float out[4] = { 0 };
+
+      if (!mask[lane])
+        continue;
+
+      /* Like GL, sources are clamped for normalized targets */
+      for (int i = 0; i < 4; i++)
+        src[i] = floating ? color[i][lane] : CLAMP (color[i][lane], 0.0f, 1.0f);
+      if (draw->reads_targets[target])
+        load_texel (texture, texel + lane, dst);
+
+      for (int i = 0; i < 4; i++)
+        out[i] = src[i] * get_blend_factor (src_blend, src, dst, i)
+                 + dst[i] * get_blend_factor (dst_blend, src, dst, i);
+
+      store_texel (texture, texel + lane, out, draw->write_mask);
+    }
+}
+
+static void
+shade_pixels (RunData *data,
+              const Triangle *triangle,
+              const Draw *draw,
+              int x,
+              int y,
+              CgsMask mask,
+              const CgsVec *weights)
+{
+  guint n_varyings = draw->kernel->n_varyings;
+  CgsVec z = { 0 };
+  CgsVec inv_w = { 0 };
+  CgsVec varyings[CGS_MAX_VARYINGS] = { 0 };
+  CgsVec color[4] = { 0 };
+
+  z = weights[0] * triangle->z[0]
+      + weights[1] * triangle->z[1]
+      + weights[2] * triangle->z[2];
+
+  if (data->depth != NULL)
+    {
+      CgsTexture *sw_depth = (CgsTexture *)data->depth;
+      gsize offset = (gsize)y * data->depth->init.width + x;
+      float *stored = (float *)sw_depth->pixels + offset;
+      guint8 *stencil = sw_depth->stencil != NULL ? sw_depth->stencil + offset : NULL;
+      CgsVec current = { 0 };
+      CgsMask passed = { 0 };
+
+      if (stencil != NULL)
+        {
+          CgsVec reference = { 0 };
+
+          /* Eight bit values compare exactly as floats */
+          for (int lane = 0; lane < CGS_LANES; lane++)
+            {
+              reference[lane] = draw->stencil_ref & draw->stencil_mask;
+              if (mask[lane])
+                current[lane] = stencil[lane] & draw->stencil_mask;
+            }
+
+          passed = mask & test_values (draw->stencil_func, reference, current);
+          update_stencil (draw, stencil, mask & ~passed, draw->stencil_ops[0]);
+          mask = passed;
+          if (!any_lane (mask))
+            return;
+        }
+
+      for (int lane = 0; lane < CGS_LANES; lane++)
+        if (mask[lane])
+          current[lane] = stored[lane];
+
+      passed = mask & test_values (draw->depth_func, z, current);
+      if (stencil != NULL)
+        {
+          update_stencil (draw, stencil, mask & ~passed, draw->stencil_ops[1]);
+          update_stencil (draw, stencil, passed, draw->stencil_ops[2]);
+        }
+      mask = passed;
+      if (!any_lane (mask))
+        return;
+
+      if (draw->write_mask & CG_WRITE_MASK_DEPTH)
+        for (int lane = 0; lane < CGS_LANES; lane++)
+          if (mask[lane])
+            stored[lane] = z[lane];
+    }
+
+  /* Perspective correct interpolation */
+  inv_w = weights[0] * triangle->inv_w[0]
+          + weights[1] * triangle->inv_w[1]
+          + weights[2] * triangle->inv_w[2];
+  inv_w = 1.0f / inv_w;
+  for (guint i = 0; i < n_varyings; i++)
+    varyings[i] = (weights[0] * triangle->varyings[0][i]
+                   + weights[1] * triangle->varyings[1][i]
+                   + weights[2] * triangle->varyings[2][i])
+                  * inv_w;
+
+  draw->kernel->fragment (draw->uniforms, varyings, color);
+
+  for (guint i = 0; i < data->n_colors; i++)
+    write_pixels (draw, i, data->colors[i], x, y, mask, color);
+}
+
+static void
+rasterize_triangle (RunData *data,
+                    const Triangle *triangle,
+                    const Draw *draw,
+                    const int *bounds)
+{
+  const CgsVecD offsets = { 0.5, 1.5, 2.5, 3.5 };
+  const CgsMaskD lanes = { 0, 1, 2, 3 };
+  CgsMaskD owners[3] = { 0 };
+
+  for (int i = 0; i < 3; i++)
+    owners[i] = (CgsMaskD){ 0 } - (gint64)triangle->owner[i];
+
+  for (int y = bounds[1]; y < bounds[3]; y++)
+    {
+      double rows[3] = { 0 };
+
+      for (int i = 0; i < 3; i++)
+        rows[i] = triangle->b[i] * (y + 0.5 - triangle->origin_y[i]);
+
+      for (int x = bounds[0]; x < bounds[2]; x += CGS_LANES)
+        {
+          CgsVecD centers = offsets + (double)x;
+          CgsMaskD inside = lanes < (CgsMaskD){ 0 } + (bounds[2] - x);
+          CgsVecD edges[3] = { 0 };
+          CgsVec weights[3] = { 0 };
+
+          /* A pixel exactly on an edge belongs to the one
+           * triangle which owns that edge, so that adjacent
+           * triangles neither overlap nor leave gaps */
+          for (int i = 0; i < 3; i++)
+            {
+              edges[i] = triangle->a[i] * (centers - triangle->origin_x[i]) + rows[i];
+              inside &= (edges[i] > 0.0) | ((edges[i] == 0.0) & owners[i]);
+            }
+          if (!any_lane_d (&inside))
+            continue;
+
+          for (int i = 0; i < 3; i++)
+            weights[i] = __builtin_convertvector (edges[i] * triangle->inv_area, CgsVec);
+
+          shade_pixels (data, triangle, draw, x, y,
+                        __builtin_convertvector (inside, CgsMask),
+                        weights);
+        }
+    }
+}
+
+/* Triangles in a tile are drawn in the order they were
+ * binned, so blending and depth behave like on a GPU */
+static void
+rasterize_tile (RunData *data,
+                guint tile)
+{
+  GArray *bin = g_ptr_array_index (data->bins, tile);
+  int tile_bounds[4] = { 0 };
+
+  tile_bounds[0] = (tile % data->tiles_x) * CGS_TILE_SIZE;
+  tile_bounds[1] = (tile / data->tiles_x) * CGS_TILE_SIZE;
+  tile_bounds[2] = MIN (tile_bounds[0] + CGS_TILE_SIZE, data->width);
+  tile_bounds[3] = MIN (tile_bounds[1] + CGS_TILE_SIZE, data->height);
+
+  for (guint i = 0; i < bin->len; i++)
+    {
+      const Triangle *triangle = &g_array_index (
+          data->triangles, Triangle, g_array_index (bin, guint, i));
+      const Draw *draw = &g_array_index (data->draws, Draw, triangle->draw);
+      int bounds[4] = { 0 };
+
+      bounds[0] = MAX (triangle->bounds[0], tile_bounds[0]);
+      bounds[1] = MAX (triangle->bounds[1], tile_bounds[1]);
+      bounds[2] = MIN (triangle->bounds[2], tile_bounds[2]);
+      bounds[3] = MIN (triangle->bounds[3], tile_bounds[3]);
+
+      if (bounds[0] < bounds[2] && bounds[1] < bounds[3])
+        rasterize_triangle (data, triangle, draw, bounds);
+    }
+}
+
+static void
+rasterize_tiles (RasterJob *job)
+{
+  for (;;)
+    {
+      gint next = g_atomic_int_add (&job->next, 1);
+
+      if (next >= (gint)job->n_tiles)
+        break;
+      rasterize_tile (job->data, job->tiles[next]);
+    }
+}
+
+/* Runs on the gpu's pool of workers. Tiles are handed
+ * out one at a time, so busy tiles do not hold up the
+ * rest of the job. */
+static void
+rasterize_job (gpointer job_data,
+               gpointer user_data)
+{
+  RasterJob *job = job_data;
+
+  rasterize_tiles (job);
+
+  g_mutex_lock (&job->mutex);
+  if (--job->pending == 0)
+    g_cond_signal (&job->cond);
+  g_mutex_unlock (&job->mutex);
+}
+
+static void
+rasterize_bins (RunData *data)
+{
+  CgsGpu *sw_gpu = (CgsGpu *)data->commands->gpu;
+  g_autofree guint *tiles = NULL;
+  RasterJob job = { 0 };
+  guint n_tiles = 0;
+  guint n_workers = 0;
+
+  tiles = g_new (guint, data->bins->len);
+  for (guint i = 0; i < data->bins->len; i++)
+    {
+      GArray *bin = g_ptr_array_index (data->bins, i);
+
+      if (bin->len > 0)
+        tiles[n_tiles++] = i;
+    }
+
+  job.data = data;
+  job.tiles = tiles;
+  job.n_tiles = n_tiles;
+
+  if (sw_gpu->workers != NULL
+      && data->triangles->len >= CGS_PARALLEL_MIN_TRIANGLES
+      && n_tiles >= CGS_PARALLEL_MIN_TILES)
+    n_workers = MIN (sw_gpu->n_threads - 1, n_tiles - 1);
+
+  if (n_workers > 0)
+    {
+      g_mutex_init (&job.mutex);
+      g_cond_init (&job.cond);
+      job.pending = n_workers;
+
+      for (guint i = 0; i < n_workers; i++)
+        g_thread_pool_push (sw_gpu->workers, &job, NULL);
+    }
+
+  rasterize_tiles (&job);
+
+  if (n_workers > 0)
+    {
+      g_mutex_lock (&job.mutex);
+      while (job.pending > 0)
+        g_cond_wait (&job.cond, &job.mutex);
+      g_mutex_unlock (&job.mutex);
+
+      g_cond_clear (&job.cond);
+      g_mutex_clear (&job.mutex);
+    }
+
+  for (guint i = 0; i < data->bins->len; i++)
+    g_array_set_size (g_ptr_array_index (data->bins, i), 0);
+  g_array_set_size (data->triangles, 0);
+  g_array_set_size (data->draws, 0);
+}
+
+static void
+flush_bins (RunData *data)
+{
+  guint n_triangles = data->triangles->len;
+
+  if (n_triangles == 0)
+    return;
+
+  CG_PRIV_RUN (
+      data->commands,
+      rasterize_bins, _A (data),
+      "%s, %u triangles, %u tiles",
+      _A (CG_PRIV_ADDRESS, n_triangles, data->bins->len));
+}
+
+static void
+clear_targets (RunData *data)
+{
+  for (guint i = 0; i < data->n_colors; i++)
+    {
+      CgsTexture *sw_texture = (CgsTexture *)data->colors[i];
+
+      memset (sw_texture->pixels, 0,
+              (gsize)data->colors[i]->init.width
+                  * data->colors[i]->init.height
+                  * sw_texture->pixel_size);
+    }
+
+  if (data->depth != NULL)
+    {
+      float *depth = (float *)((CgsTexture *)data->depth)->pixels;
+      gsize n_texels = (gsize)data->depth->init.width * data->depth->init.height;
+
+      for (gsize i = 0; i < n_texels; i++)
+        depth[i] = 1.0f;
+
+      if (((CgsTexture *)data->depth)->stencil != NULL)
+        memset (((CgsTexture *)data->depth)->stencil, 0, n_texels);
+    }
+}
+
+static gboolean
+open_targets (RunData *data,
+              CgPrivInstr *pass_instr,
+              gboolean clear)
+{
+  guint n_tiles = 0;
+
+  if (!clear && data->open != NULL
+      && cg_priv_targets_equal (data->open, pass_instr))
+    return TRUE;
+
+  if (pass_instr->pass.targets->len == 0)
+    {
+      CGS_SET_ERROR (
+          data->error, CG_ERROR_INVALID_PLAN,
+          "There is no default framebuffer, so every group "
+          "which draws or blits needs a target");
+      return FALSE;
+    }
+
+  flush_bins (data);
+
+  data->open = pass_instr;
+  data->n_colors = 0;
+  data->depth = NULL;
+  data->width = G_MAXINT;
+  data->height = G_MAXINT;
+  for (guint i = 0; i < pass_instr->pass.targets->len; i++)
+    {
+      CgTexture *texture = g_array_index (pass_instr->pass.targets, CgPrivTarget, i).texture;
+
+      if (texture->init.format == CG_PRIV_FORMAT_DEPTH)
+        data->depth = texture;
+      else
+        data->colors[data->n_colors++] = texture;
+
+      data->width = MIN (data->width, texture->init.width);
+      data->height = MIN (data->height, texture->init.height);
+    }
+
+  data->tiles_x = (data->width + CGS_TILE_SIZE - 1) / CGS_TILE_SIZE;
+  data->tiles_y = (data->height + CGS_TILE_SIZE - 1) / CGS_TILE_SIZE;
+  n_tiles = data->tiles_x * data->tiles_y;
+  while (data->bins->len < n_tiles)
+    g_ptr_array_add (data->bins, g_array_new (FALSE, FALSE, sizeof (guint)));
+  g_ptr_array_set_size (data->bins, n_tiles);
+
+  if (clear)
+    CG_PRIV_RUN (
+        data->commands,
+        clear_targets, _A (data),
+        "%s", _A (CG_PRIV_ADDRESS));
+
+  return TRUE;
+}
+
+static inline double
+snap_coordinate (float coordinate)
+{
+  return (double)floor_to_int (coordinate * CGS_SUBPIXEL_STEPS + 0.5f)
+         / CGS_SUBPIXEL_STEPS;
+}
+
+static void
+bin_triangle (RunData *data,
+              const Vertex *v0,
+              const Vertex *v1,
+              const Vertex *v2)
+{
+  const Vertex *vertices[3] = { v0, v1, v2 };
+  Draw *draw = &g_array_index (data->draws, Draw, data->draw);
+  guint n_varyings = draw->kernel->n_varyings;
+  double x[3] = { 0 };
+  double y[3] = { 0 };
+  float z[3] = { 0 };
+  float inv_w[3] = { 0 };
+  double area = 0.0;
+  gboolean front = FALSE;
+  guint order[3] = { 0, 1, 2 };
+  int bounds[4] = { 0 };
+  guint index = 0;
+  Triangle *triangle = NULL;
+
+  for (int i = 0; i < 3; i++)
+    {
+      const float *position = vertices[i]->position;
+
+      /* Also catches NaN */
+      if (!(position[3] > 0.0f))
+        return;
+
+      inv_w[i] = 1.0f / position[3];
+      x[i] = snap_coordinate (draw->viewport[0]
+                              + (position[0] * inv_w[i] + 1.0f) * 0.5f * draw->viewport[2]);
+      y[i] = snap_coordinate (draw->viewport[1]
+                              + (position[1] * inv_w[i] + 1.0f) * 0.5f * draw->viewport[3]);
+      z[i] = position[2] * inv_w[i] * 0.5f + 0.5f;
+    }
+
+  /* Window coordinates point up, so like in GL
+   * counter-clockwise triangles have a positive area */
+  area = (x[1] - x[0]) * (y[2] - y[0]) - (x[2] - x[0]) * (y[1] - y[0]);
+  if (area == 0.0)
+    return;
+
+  front = draw->clockwise_faces ? area < 0.0 : area > 0.0;
+  if (draw->backface_cull && !front)
+    return;
+
+  if (area < 0.0)
+    {
+      order[1] = 2;
+      order[2] = 1;
+      area = -area;
+    }
+
+  bounds[0] = floor_to_int (MIN (MIN (x[0], x[1]), x[2]));
+  bounds[1] = floor_to_int (MIN (MIN (y[0], y[1]), y[2]));
+  bounds[2] = floor_to_int (MAX (MAX (x[0], x[1]), x[2])) + 1;
+  bounds[3] = floor_to_int (MAX (MAX (y[0], y[1]), y[2])) + 1;
+  for (int i = 0; i < 2; i++)
+    {
+      bounds[i] = MAX (bounds[i], draw->scissor[i]);
+      bounds[2 + i] = MIN (bounds[2 + i], draw->scissor[2 + i]);
+    }
+  if (bounds[0] >= bounds[2] || bounds[1] >= bounds[3])
+    return;
+
+  if (data->triangles->len >= CGS_MAX_BINNED_TRIANGLES)
+    {
+      Draw copy = *draw;
+
+      flush_bins (data);
+      g_array_append_val (data->draws, copy);
+      data->draw = 0;
+    }
+
+  index = data->triangles->len;
+  g_array_set_size (data->triangles, index + 1);
+  triangle = &g_array_index (data->triangles, Triangle, index);
+
+  triangle->draw = data->draw;
+  memcpy (triangle->bounds, bounds, sizeof (bounds));
+  triangle->inv_area = 1.0 / area;
+
+  for (int i = 0; i < 3; i++)
+    {
+      guint vertex = order[i];
+      guint from = order[(i + 1) % 3];
+      guint to = order[(i + 2) % 3];
+
+      triangle->z[i] = z[vertex];
+      triangle->inv_w[i] = inv_w[vertex];
+      for (guint j = 0; j < n_varyings; j++)
+        triangle->varyings[i][j] = vertices[vertex]->varyings[j] * inv_w[vertex];
+
+      triangle->a[i] = y[from] - y[to];
+      triangle->b[i] = x[to] - x[from];
+      triangle->origin_x[i] = x[from];
+      triangle->origin_y[i] = y[from];
+      triangle->owner[i] = triangle->a[i] > 0.0
+                           || (triangle->a[i] == 0.0 && triangle->b[i] > 0.0);
+    }
+
+  for (int tile_y = bounds[1] / CGS_TILE_SIZE;
+       tile_y <= (bounds[3] - 1) / CGS_TILE_SIZE;
+       tile_y++)
+    for (int tile_x = bounds[0] / CGS_TILE_SIZE;
+         tile_x <= (bounds[2] - 1) / CGS_TILE_SIZE;
+         tile_x++)
+      g_array_append_val (
+          g_ptr_array_index (data->bins, tile_y * data->tiles_x + tile_x),
+          index);
+}
+
+/* A vertex is inside a plane when the dot product of
+ * the two is positive. The sides of the view volume
+ * are pushed out to the guard band. */
+static const float clip_planes[][4] = {
+  { 0.0f, 0.0f, 1.0f, 1.0f },
+  { 0.0f, 0.0f, -1.0f, 1.0f },
+  { 1.0f, 0.0f, 0.0f, CGS_GUARD_BAND },
+  { -1.0f, 0.0f, 0.0f, CGS_GUARD_BAND },
+  { 0.0f, 1.0f, 0.0f, CGS_GUARD_BAND },
+  { 0.0f, -1.0f, 0.0f, CGS_GUARD_BAND },
+};
+
+static inline float
+get_plane_distance (const float *plane,
+                    const Vertex *vertex)
+{
+  return plane[0] * vertex->position[0]
+         + plane[1] * vertex->position[1]
+         + plane[2] * vertex->position[2]
+         + plane[3] * vertex->position[3];
+}
+
+static guint
+get_outcode (const Vertex *vertex)
+{
+  guint code = 0;
+
+  for (guint i = 0; i < G_N_ELEMENTS (clip_planes); i++)
+    if (get_plane_distance (clip_planes[i], vertex) < 0.0f)
+      code |= 1 << i;
+
+  return code;
+}
+
+static guint
+clip_polygon (const Vertex *in,
+              guint n_in,
+              Vertex *out,
+              const float *plane,
+              guint n_varyings)
+{
+  guint n_out = 0;
+
+  for (guint i = 0; i < n_in; i++)
+    {
+      const Vertex *current = &in[i];
+      const Vertex *next = &in[(i + 1) % n_in];
+      float current_distance = get_plane_distance (plane, current);
+      float next_distance = get_plane_distance (plane, next);
+
+      if (current_distance >= 0.0f)
+        out[n_out++] = *current;
+
+      if ((current_distance >= 0.0f) != (next_distance >= 0.0f))
+        {
+          float t = current_distance / (current_distance - next_distance);
+          Vertex *vertex = &out[n_out++];
+
+          for (int j = 0; j < 4; j++)
+            vertex->position[j] = current->position[j]
+                                  + (next->position[j] - current->position[j]) * t;
+          for (guint j = 0; j < n_varyings; j++)
+            vertex->varyings[j] = current->varyings[j]
+                                  + (next->varyings[j] - current->varyings[j]) * t;
+        }
+    }
+
+  return n_out;
+}
+
+static void
+clip_triangle (RunData *data,
+               const Vertex *v0,
+               const Vertex *v1,
+               const Vertex *v2)
+{
+  guint n_varyings = g_array_index (data->draws, Draw, data->draw).kernel->n_varyings;
+  guint codes[3] = { 0 };
+  Vertex polygons[2][CGS_MAX_CLIPPED_VERTICES];
+  guint n_vertices = 3;
+  guint current = 0;
+
+  codes[0] = get_outcode (v0);
+  codes[1] = get_outcode (v1);
+  codes[2] = get_outcode (v2);
+
+  if ((codes[0] & codes[1] & codes[2]) != 0)
+    return;
+  if ((codes[0] | codes[1] | codes[2]) == 0)
+    {
+      bin_triangle (data, v0, v1, v2);
+      return;
+    }
+
+  polygons[0][0] = *v0;
+  polygons[0][1] = *v1;
+  polygons[0][2] = *v2;
+
+  for (guint i = 0; i < G_N_ELEMENTS (clip_planes); i++)
+    {
+      if (!((codes[0] | codes[1] | codes[2]) & (1 << i)))
+        continue;
+
+      n_vertices = clip_polygon (
+          polygons[current], n_vertices,
+          polygons[!current], clip_planes[i],
+          n_varyings);
+      current = !current;
+
+      if (n_vertices < 3)
+        return;
+    }
+
+  for (guint i = 1; i + 1 < n_vertices; i++)
+    bin_triangle (data,
+                  &polygons[current][0],
+                  &polygons[current][i],
+                  &polygons[current][i + 1]);
+}
+
+static inline float
+half_to_float (guint16 half)
+{
+  guint32 sign = (guint32)(half & 0x8000) << 16;
+  guint32 exponent = (half >> 10) & 0x1f;
+  guint32 mantissa = half & 0x3ff;
+  guint32 bits = 0;
+  float value = 0.0f;
+
+  if (exponent == 0)
+    {
+      value = mantissa * (1.0f / (1 << 24));
+      return sign ? -value : value;
+    }
+  else if (exponent == 0x1f)
+    bits = sign | 0x7f800000 | (mantissa << 13);
+  else
+    bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+
+  memcpy (&value, &bits, sizeof (value));
+  return value;
+}
+
+/* Kernels only take floats, so integer
+ * inputs are cast like CG_CONVERSION_CAST */
+static void
+fetch_attribute (const guchar *src,
+                 const CgDataSegment *segment,
+                 float *out)
+{
+  int component = cg_priv_get_segment_component (segment);
+  gboolean normalize = segment->conversion == CG_CONVERSION_NORMALIZE;
+
+  out[0] = out[1] = out[2] = 0.0f;
+  out[3] = 1.0f;
+
+  if (component == CG_COMPONENT_INT_2_10_10_10
+      || component == CG_COMPONENT_UINT_2_10_10_10)
+    {
+      guint32 packed = 0;
+
+      memcpy (&packed, src, sizeof (packed));
+      for (int i = 0; i < 4; i++)
+        {
+          int bits = i < 3 ? 10 : 2;
+          guint32 raw = (packed >> (i * 10)) & ((1u << bits) - 1);
+          float max = (float)((1u << (bits - 1)) - 1);
+
+          if (component == CG_COMPONENT_UINT_2_10_10_10)
+            out[i] = normalize ? raw / (float)((1u << bits) - 1) : raw;
+          else
+            {
+              int value = raw & (1u << (bits - 1))
+                              ? (int)raw - (1 << bits)
+                              : (int)raw;
+
+              out[i] = normalize ? MAX (value / max, -1.0f) : value;
+            }
+        }
+      return;
+    }
+
+  for (int i = 0; i < MIN (segment->num, 4); i++)
+    {
+      union
+      {
+        float f32;
+        guint16 f16;
+        gint8 i8;
+        guint8 u8;
+        gint16 i16;
+        guint16 u16;
+        gint32 i32;
+        guint32 u32;
+      } value;
+
+      switch (component)
+        {
+        case CG_COMPONENT_FLOAT32:
+          memcpy (&value.f32, src + i * 4, 4);
+          out[i] = value.f32;
+          break;
+        case CG_COMPONENT_FLOAT16:
+          memcpy (&value.f16, src + i * 2, 2);
+          out[i] = half_to_float (value.f16);
+          break;
+        case CG_COMPONENT_INT8:
+          memcpy (&value.i8, src + i, 1);
+          out[i] = normalize ? MAX (value.i8 / (float)G_MAXINT8, -1.0f) : value.i8;
+          break;
+        case CG_COMPONENT_UINT8:
+          memcpy (&value.u8, src + i, 1);
+          out[i] = normalize ? value.u8 / (float)G_MAXUINT8 : value.u8;
+          break;
+        case CG_COMPONENT_INT16:
+          memcpy (&value.i16, src + i * 2, 2);
+          out[i] = normalize ? MAX (value.i16 / (float)G_MAXINT16, -1.0f) : value.i16;
+          break;
+        case CG_COMPONENT_UINT16:
+          memcpy (&value.u16, src + i * 2, 2);
+          out[i] = normalize ? value.u16 / (float)G_MAXUINT16 : value.u16;
+          break;
+        case CG_COMPONENT_INT32:
+          memcpy (&value.i32, src + i * 4, 4);
+          out[i] = normalize ? MAX (value.i32 / (float)G_MAXINT32, -1.0f) : value.i32;
+          break;
+        case CG_COMPONENT_UINT32:
+          memcpy (&value.u32, src + i * 4, 4);
+          out[i] = normalize ? value.u32 / (float)G_MAXUINT32 : value.u32;
+          break;
+        default:
+          break;
+        }
+    }
+}
+
+/* Where one attribute of a kernel comes from */
+typedef struct
+{
+  const guchar *data;
+  gsize size;
+  gsize stride;
+  gsize offset;
+  const CgDataSegment *segment;
+} AttributeSource;
+
+static void
+process_vertices (const Kernel *kernel,
+                  const CgValue *const *uniforms,
+                  const AttributeSource *sources,
+                  guint instance,
+                  Vertex *vertices,
+                  guint n_vertices)
+{
+  for (guint i = 0; i < n_vertices; i++)
+    {
+      float attributes[CGS_MAX_INPUTS][4] = { 0 };
+
+      for (guint j = 0; j < kernel->n_attributes; j++)
+        {
+          const AttributeSource *source = &sources[j];
+          gsize element = 0;
+          gsize offset = 0;
+
+          memcpy (attributes[j], kernel->attributes[j].fallback, sizeof (attributes[j]));
+          if (source->segment == NULL)
+            continue;
+
+          element = source->segment->instance_rate > 0
+                        ? instance / source->segment->instance_rate
+                        : i;
+          offset = element * source->stride + source->offset;
+          if (offset + cg_priv_get_segment_size (source->segment) > source->size)
+            continue;
+
+          fetch_attribute (source->data + offset, source->segment, attributes[j]);
+        }
+
+      kernel->vertex (uniforms,
+                      (const float (*)[4])attributes,
+                      vertices[i].position,
+                      vertices[i].varyings);
+    }
+}
+
+static void
+assemble_triangles (RunData *data,
+                    CgPrivInstr *instr,
+                    const Vertex *vertices,
+                    guint n_vertices)
+{
+  CgBuffer *indices = instr->vertices.indices;
+  gsize index_size = 0;
+  guint32 restart = G_MAXUINT32;
+  gsize count = n_vertices;
+  gboolean strip = instr->vertices.topology == CG_TOPOLOGY_TRIANGLE_STRIP;
+  guint window[3] = { 0 };
+  guint n_window = 0;
+  guint n_strip = 0;
+
+  if (indices != NULL)
+    {
+      switch (indices->index_format)
+        {
+        case CG_COMPONENT_UINT8:
+          index_size = sizeof (guint8);
+          restart = G_MAXUINT8;
+          break;
+        case CG_COMPONENT_UINT16:
+          index_size = sizeof (guint16);
+          restart = G_MAXUINT16;
+          break;
+        case CG_COMPONENT_UINT32:
+        default:
+          index_size = sizeof (guint32);
+          restart = G_MAXUINT32;
+          break;
+        }
+      count = indices->init.size / index_size;
+    }
+
+  for (gsize i = 0; i < count; i++)
+    {
+      guint32 vertex = i;
+
+      if (indices != NULL)
+        {
+          const guchar *src = (const guchar *)indices->init.data + i * index_size;
+
+          switch (index_size)
+            {
+            case sizeof (guint8):
+              vertex = *src;
+              break;
+            case sizeof (guint16):
+              {
+                guint16 value = 0;
+
+                memcpy (&value, src, sizeof (value));
+                vertex = value;
+              }
+              break;
+            default:
+              memcpy (&vertex, src, sizeof (vertex));
+              break;
+            }
+        }
+
+      /* Out of range indices restart too */
+      if (vertex == restart || vertex >= n_vertices)
+        {
+          n_window = 0;
+          n_strip = 0;
+          continue;
+        }
+
+      if (n_window < 3)
+        window[n_window++] = vertex;
+      else
+        {
+          window[0] = window[1];
+          window[1] = window[2];
+          window[2] = vertex;
+        }
+      if (n_window < 3)
+        continue;
+
+      if (!strip)
+        {
+          clip_triangle (data, &vertices[window[0]], &vertices[window[1]], &vertices[window[2]]);
+          n_window = 0;
+        }
+      else
+        {
+          /* Every other triangle of a strip is flipped
+           * to keep the same winding as the first */
+          if (n_strip % 2 == 0)
+            clip_triangle (data, &vertices[window[0]], &vertices[window[1]], &vertices[window[2]]);
+          else
+            clip_triangle (data, &vertices[window[1]], &vertices[window[0]], &vertices[window[2]]);
+          n_strip++;
+        }
+    }
+}
+
+static UniformState *
+get_uniform_state (RunData *data,
+                   CgShader *shader)
+{
+  UniformState *state = NULL;
+
+  state = g_hash_table_lookup (data->states, shader);
+  if (state == NULL)
+    {
+      state = CG_PRIV_CREATE (state);
+      g_hash_table_insert (data->states, shader, state);
+    }
+
+  return state;
+}
+
+static gboolean
+run_draw (RunData *data,
+          CgPrivInstr *pass_instr,
+          CgPrivInstr *instr)
+{
+  const Kernel *kernel = NULL;
+  UniformState *state = NULL;
+  Draw draw = { 0 };
+  AttributeSource sources[CGS_MAX_INPUTS] = { 0 };
+  guint max_length = 0;
+  guint max_instance_length = 0;
+  guint n_vertices = 0;
+  guint instances = 0;
+  g_autofree Vertex *vertices = NULL;
+  guint n_colors = 0;
+
+  g_assert (pass_instr->pass.shader != NULL);
+
+  if (!open_targets (data, pass_instr, FALSE))
+    return FALSE;
+
+  kernel = ((CgsShader *)pass_instr->pass.shader)->kernel;
+  state = get_uniform_state (data, pass_instr->pass.shader);
+
+  draw.kernel = kernel;
+  memcpy (draw.uniforms, state->values, sizeof (draw.uniforms));
+  for (guint i = 0; i < pass_instr->pass.targets->len; i++)
+    {
+      CgPrivTarget *target = &g_array_index (pass_instr->pass.targets, CgPrivTarget, i);
+
+      if (target->texture->init.format == CG_PRIV_FORMAT_DEPTH)
+        continue;
+
+      draw.blends[n_colors][0] = target->src_blend;
+      draw.blends[n_colors][1] = target->dst_blend;
+      draw.reads_targets[n_colors] = blend_reads_target (target->src_blend, target->dst_blend);
+      n_colors++;
+    }
+  draw.write_mask = pass_instr->pass.write_mask.val;
+  draw.depth_func = pass_instr->pass.depth_test_func.val;
+  draw.clockwise_faces = pass_instr->pass.clockwise_faces.val;
+  draw.backface_cull = pass_instr->pass.backface_cull.val;
+  draw.stencil_func = pass_instr->pass.stencil_func.val;
+  draw.stencil_ref = pass_instr->pass.stencil_func.ref;
+  draw.stencil_mask = pass_instr->pass.stencil_func.mask;
+  memcpy (draw.stencil_ops, pass_instr->pass.stencil_ops.val, sizeof (draw.stencil_ops));
+
+  if (pass_instr->pass.dest.val[2] > 0 && pass_instr->pass.dest.val[3] > 0)
+    {
+      for (int i = 0; i < 4; i++)
+        draw.viewport[i] = pass_instr->pass.dest.val[i];
+    }
+  else
+    {
+      draw.viewport[2] = data->width;
+      draw.viewport[3] = data->height;
+    }
+
+  /* Clipping only goes as far as the guard
+   * band, so the rest happens here */
+  draw.scissor[0] = MAX ((int)draw.viewport[0], 0);
+  draw.scissor[1] = MAX ((int)draw.viewport[1], 0);
+  draw.scissor[2] = MIN ((int)(draw.viewport[0] + draw.viewport[2]), data->width);
+  draw.scissor[3] = MIN ((int)(draw.viewport[1] + draw.viewport[3]), data->height);
+
+  for (guint i = 0; i < instr->vertices.n_buffers; i++)
+    {
+      CgBuffer *buffer = instr->vertices.n_buffers > 1
+                             ? instr->vertices.many_buffers[i]
+                             : instr->vertices.one_buffer;
+      gsize stride = 0;
+      gsize offset = 0;
+      gboolean per_vertex = FALSE;
+      guint length = 0;
+
+      stride = cg_priv_get_data_layout_stride (buffer->spec, buffer->spec_length);
+
+      for (guint j = 0; j < buffer->spec_length; j++)
+        {
+          const CgDataSegment *segment = &buffer->spec[j];
+          int input = 0;
+
+          input = find_kernel_input (kernel->attributes, kernel->n_attributes, segment->name);
+          g_assert (input >= 0);
+
+          sources[input].data = buffer->init.data;
+          sources[input].size = buffer->init.size;
+          sources[input].stride = stride;
+          sources[input].offset = offset;
+          sources[input].segment = segment;
+
+          if (segment->instance_rate == 0)
+            per_vertex = TRUE;
+          offset += cg_priv_get_segment_size (segment);
+        }
+
+      /* Buffers holding only per-instance data
+       * do not decide how many vertices to draw */
+      length = stride > 0 ? buffer->init.size / stride : 0;
+      if (per_vertex)
+        max_length = MAX (max_length, length);
+      else
+        max_instance_length = MAX (max_instance_length, length);
+    }
+
+  n_vertices = max_length > 0 ? max_length : max_instance_length;
+  instances = MAX (instr->vertices.instances, 1);
+  if (n_vertices == 0)
+    return TRUE;
+
+  g_array_append_val (data->draws, draw);
+  data->draw = data->draws->len - 1;
+
+  vertices = g_new (Vertex, n_vertices);
+  for (guint i = 0; i < instances; i++)
+    {
+      process_vertices (
+          kernel, g_array_index (data->draws, Draw, data->draw).uniforms,
+          sources, instr->vertices.first_instance + i,
+          vertices, n_vertices);
+      assemble_triangles (data, instr, vertices, n_vertices);
+    }
+
+  return TRUE;
+}
+
+static void
+blit_pixels (CgTexture *src,
+             CgTexture *dst,
+             const int *src_region,
+             const int *dst_region,
+             gboolean linear)
+{
+  int width = src->init.width;
+  int height = src->init.height;
+  float scale_x = (float)(src_region[2] - src_region[0]) / (dst_region[2] - dst_region[0]);
+  float scale_y = (float)(src_region[3] - src_region[1]) / (dst_region[3] - dst_region[1]);
+
+  for (int y = MAX (dst_region[1], 0); y < MIN (dst_region[3], dst->init.height); y++)
+    for (int x = MAX (dst_region[0], 0); x < MIN (dst_region[2], dst->init.width); x++)
+      {
+        float s = src_region[0] + (x - dst_region[0] + 0.5f) * scale_x;
+        float t = src_region[1] + (y - dst_region[1] + 0.5f) * scale_y;
+        float texel[4] = { 0 };
+
+        if (linear)
+          {
+            float texels[4][4] = { 0 };
+            int x0 = 0;
+            int y0 = 0;
+            int x1 = 0;
+            int y1 = 0;
+            float fx = 0.0f;
+            float fy = 0.0f;
+
+            s -= 0.5f;
+            t -= 0.5f;
+            x0 = floor_to_int (s);
+            y0 = floor_to_int (t);
+            fx = s - x0;
+            fy = t - y0;
+            x1 = CLAMP (x0 + 1, 0, width - 1);
+            y1 = CLAMP (y0 + 1, 0, height - 1);
+            x0 = CLAMP (x0, 0, width - 1);
+            y0 = CLAMP (y0, 0, height - 1);
+
+            load_texel (src, (gsize)y0 * width + x0, texels[0]);
+            load_texel (src, (gsize)y0 * width + x1, texels[1]);
+            load_texel (src, (gsize)y1 * width + x0, texels[2]);
+            load_texel (src, (gsize)y1 * width + x1, texels[3]);
+
+            for (int i = 0; i < 4; i++)
+              {
+                float bottom = texels[0][i] + (texels[1][i] - texels[0][i]) * fx;
+                float top = texels[2][i] + (texels[3][i] - texels[2][i]) * fx;
+
+                texel[i] = bottom + (top - bottom) * fy;
+              }
+          }
+        else
+          load_texel (src,
+                      (gsize)CLAMP (floor_to_int (t), 0, height - 1) * width
+                          + CLAMP (floor_to_int (s), 0, width - 1),
+                      texel);
+
+        store_texel (dst, (gsize)y * dst->init.width + x, texel, CG_WRITE_MASK_COLOR);
+      }
+}
+
+static gboolean
+run_blit (RunData *data,
+          CgPrivInstr *pass_instr,
+          CgPrivInstr *instr)
+{
+  CgTexture *src = instr->blit.src;
+  int src_region[4] = { 0 };
+  gboolean any = FALSE;
+
+  if (instr->blit.region_set)
+    {
+      src_region[0] = instr->blit.region[0];
+      src_region[1] = instr->blit.region[1];
+      src_region[2] = instr->blit.region[0] + instr->blit.region[2];
+      src_region[3] = instr->blit.region[1] + instr->blit.region[3];
+    }
+  else
+    {
+      src_region[2] = src->init.width;
+      src_region[3] = src->init.height;
+    }
+
+  if (pass_instr->pass.targets->len == 0)
+    {
+      CGS_SET_ERROR (
+          data->error, CG_ERROR_INVALID_PLAN,
+          "There is no default framebuffer, so every group "
+          "which draws or blits needs a target");
+      return FALSE;
+    }
+  if (src_region[2] <= src_region[0] || src_region[3] <= src_region[1])
+    return TRUE;
+
+  /* Earlier draws may still read from or write to either */
+  flush_bins (data);
+
+  /* Color goes into every color target, depth into depth */
+  for (guint i = 0; i < pass_instr->pass.targets->len; i++)
+    {
+      CgTexture *dst = g_array_index (pass_instr->pass.targets, CgPrivTarget, i).texture;
+      int dst_region[4] = { 0 };
+
+      if ((dst->init.format == CG_PRIV_FORMAT_DEPTH)
+          != (src->init.format == CG_PRIV_FORMAT_DEPTH))
+        continue;
+
+      if (src == dst)
+        {
+          CGS_SET_ERROR (
+              data->error, CG_ERROR_INVALID_PLAN,
+              "A texture cannot be blitted into itself");
+          return FALSE;
+        }
+
+      if (pass_instr->pass.dest.val[2] > 0 && pass_instr->pass.dest.val[3] > 0)
+        {
+          dst_region[0] = pass_instr->pass.dest.val[0];
+          dst_region[1] = pass_instr->pass.dest.val[1];
+          dst_region[2] = pass_instr->pass.dest.val[0] + pass_instr->pass.dest.val[2];
+          dst_region[3] = pass_instr->pass.dest.val[1] + pass_instr->pass.dest.val[3];
+        }
+      else
+        {
+          dst_region[2] = dst->init.width;
+          dst_region[3] = dst->init.height;
+        }
+
+      /* Depth only allows nearest filtering */
+      CG_PRIV_RUN (
+          data->commands,
+          blit_pixels, _A (src, dst, src_region, dst_region,
+                           instr->blit.linear && src->init.format != CG_PRIV_FORMAT_DEPTH),
+          "%s, %s, { %d, %d, %d, %d }, { %d, %d, %d, %d }, %s",
+          _A (CG_PRIV_ADDRESS, CG_PRIV_ADDRESS,
+              src_region[0], src_region[1], src_region[2], src_region[3],
+              dst_region[0], dst_region[1], dst_region[2], dst_region[3],
+              instr->blit.linear ? "TRUE" : "FALSE"));
+      any = TRUE;
+    }
+
+  if (!any)
+    {
+      CGS_SET_ERROR (
+          data->error, CG_ERROR_INVALID_PLAN,
+          "A blit needs a target of the same kind as its source");
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Odd source sizes widen the window to three
+ * texels, so every source texel is covered */
+static void
+reduce_depth (const float *src,
+              int src_width,
+              int src_height,
+              float *dst,
+              int dst_width,
+              int dst_height,
+              gboolean max_depth)
+{
+  for (int y = 0; y < dst_height; y++)
+    {
+      int y0 = y * src_height / dst_height;
+      int y1 = MAX (y0, ((y + 1) * src_height + dst_height - 1) / dst_height - 1);
+
+      for (int x = 0; x < dst_width; x++)
+        {
+          int x0 = x * src_width / dst_width;
+          int x1 = MAX (x0, ((x + 1) * src_width + dst_width - 1) / dst_width - 1);
+          float depth = src[(gsize)y0 * src_width + x0];
+
+          for (int sy = y0; sy <= y1; sy++)
+            for (int sx = x0; sx <= x1; sx++)
+              {
+                float sample = src[(gsize)sy * src_width + sx];
+
+                depth = max_depth ? MAX (depth, sample) : MIN (depth, sample);
+              }
+
+          dst[(gsize)y * dst_width + x] = depth;
+        }
+    }
+}
+
+static void
+run_depth_pyramid (RunData *data,
+                   CgPrivInstr *instr)
+{
+  CgTexture *depth = instr->depth_pyramid.depth;
+  CgTexture *pyramid = instr->depth_pyramid.pyramid;
+  CgsTexture *sw_pyramid = (CgsTexture *)pyramid;
+  const float *src = NULL;
+  int src_width = depth->init.width;
+  int src_height = depth->init.height;
+
+  /* Earlier draws may still write to the depth texture */
+  flush_bins (data);
+
+  src = (const float *)(gpointer)((CgsTexture *)depth)->pixels;
+  for (int level = 0; level < pyramid->init.mipmaps; level++)
+    {
+      float *dst = NULL;
+      int dst_width = MAX (1, pyramid->init.width >> level);
+      int dst_height = MAX (1, pyramid->init.height >> level);
+
+      dst = (float *)(gpointer)(sw_pyramid->pixels
+                                + get_level_offset (pyramid, sw_pyramid->pixel_size, level));
+
+      CG_PRIV_RUN (
+          data->commands,
+          reduce_depth,
+          _A (src, src_width, src_height,
+              dst, dst_width, dst_height,
+              instr->depth_pyramid.max_depth),
+          "%s, %d, %d, %s, %d, %d, %s",
+          _A (CG_PRIV_ADDRESS, src_width, src_height,
+              CG_PRIV_ADDRESS, dst_width, dst_height,
+              instr->depth_pyramid.max_depth ? "TRUE" : "FALSE"));
+
+      src = dst;
+      src_width = dst_width;
+      src_height = dst_height;
+    }
+}
+
+static gboolean
+run_instr_node (guint node,
+                RunData *data)
+{
+  GArray *nodes = data->nodes;
+  CgPrivInstr *pass_instr = CG_PRIV_NODE_INSTR (nodes, node);
+
+  g_assert (pass_instr->type == CG_PRIV_INSTR_PASS);
+
+  if (pass_instr->pass.shader != NULL
+      && g_hash_table_size (pass_instr->pass.uniforms.hash) > 0)
+    {
+      const Kernel *kernel = ((CgsShader *)pass_instr->pass.shader)->kernel;
+      UniformState *state = NULL;
+
+      state = get_uniform_state (data, pass_instr->pass.shader);
+      for (guint i = 0; i < pass_instr->pass.uniforms.order->len; i++)
+        {
+          const char *name = g_ptr_array_index (pass_instr->pass.uniforms.order, i);
+          int input = 0;
+
+          input = find_kernel_input (kernel->uniforms, kernel->n_uniforms, name);
+          g_assert (input >= 0);
+
+          state->values[input] = g_hash_table_lookup (pass_instr->pass.uniforms.hash, name);
+        }
+    }
+
+  if (!pass_instr->pass.fake
+      && !pass_instr->pass.merge_parent
+      && !pass_instr->pass.merge_sibling
+      && pass_instr->pass.targets->len > 0
+      && !open_targets (data, pass_instr, TRUE))
+    return FALSE;
+
+  for (guint child = CG_PRIV_NODE (nodes, node)->first_child;
+       child != CG_PRIV_NO_NODE;
+       child = CG_PRIV_NODE (nodes, child)->next_sibling)
+    {
+      CgPrivInstr *instr = CG_PRIV_NODE_INSTR (nodes, child);
+
+      switch (instr->type)
+        {
+        case CG_PRIV_INSTR_PASS:
+          if (!run_instr_node (child, data))
+            return FALSE;
+          break;
+        case CG_PRIV_INSTR_VERTICES:
+          if (!run_draw (data, pass_instr, instr))
+            return FALSE;
+          break;
+        case CG_PRIV_INSTR_BLIT:
+          if (!run_blit (data, pass_instr, instr))
+            return FALSE;
+          break;
+        case CG_PRIV_INSTR_DEPTH_PYRAMID:
+          run_depth_pyramid (data, instr);
+          break;
+        default:
+          g_assert_not_reached ();
+        }
+    }
+
+  return TRUE;
+}
+
+static void
+free_bin (gpointer data)
+{
+  g_array_unref (data);
+}
+
+/* Validation happens here, but everything else waits
+ * for dispatch, where textures have their contents */
+static CgCommands *
+plan_unref_to_commands (
+    CgPlan *self,
+    gboolean debug,
+    GError **error)
+{
+  CgsPlan *sw_plan = (CgsPlan *)self;
+  CgsGpu *sw_gpu = (CgsGpu *)self->gpu;
+  g_autoptr (CgCommands) commands = NULL;
+
+  if (g_atomic_ref_count_dec (&sw_plan->refcount))
+    {
+      CgsCommands *sw_commands = NULL;
+      EnsureData ensure_data = { 0 };
+
+      commands = cg_priv_commands_new (self->gpu);
+      sw_commands = (CgsCommands *)commands;
+
+      commands->debug.enabled = debug;
+      if (debug)
+        commands->debug.calls.compile = g_ptr_array_new_with_free_func (g_free);
+
+      sw_commands->nodes = g_steal_pointer (&self->nodes);
+
+      ensure_data.commands = commands;
+      ensure_data.error = error;
+
+      /* The nodes are in pre-order, so a front to back
+       * scan sees every parent before its children */
+      g_mutex_lock (&sw_gpu->lock);
+      for (guint i = 0; i < sw_commands->nodes->len; i++)
+        {
+          if (ensure_instr_node (sw_commands->nodes, i, &ensure_data))
+            break;
+        }
+      g_mutex_unlock (&sw_gpu->lock);
+      for (guint i = 0; i < sw_commands->nodes->len; i++)
+        cg_priv_merge_instr_node (sw_commands->nodes, i);
+
+      destroy_plan (self);
+
+      if (ensure_data.failure)
+        return NULL;
+    }
+  else
+    {
+      CGS_CRITICAL_USER_ERROR (
+          "Plan object still has references elsewhere, "
+          "so its resources cannot be compiled!");
+      return NULL;
+    }
+
+  return g_steal_pointer (&commands);
+}
+
+static gboolean
+commands_dispatch (
+    CgCommands *self,
+    GError **error)
+{
+  CgsCommands *sw_commands = (CgsCommands *)self;
+  CgsGpu *sw_gpu = (CgsGpu *)self->gpu;
+  RunData data = { 0 };
+  gboolean success = FALSE;
+
+  if (self->debug.enabled)
+    {
+      g_clear_pointer (&self->debug.calls.run, g_ptr_array_unref);
+      self->debug.calls.run = g_ptr_array_new_with_free_func (g_free);
+    }
+
+  if (sw_commands->nodes->len == 0)
+    return TRUE;
+
+  data.commands = self;
+  data.nodes = sw_commands->nodes;
+  data.error = error;
+  data.states = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, g_free);
+  data.draws = g_array_new (FALSE, TRUE, sizeof (Draw));
+  data.triangles = g_array_new (FALSE, FALSE, sizeof (Triangle));
+  data.bins = g_ptr_array_new_with_free_func (free_bin);
+
+  g_mutex_lock (&sw_gpu->lock);
+  success = run_instr_node (0, &data);
+  if (success)
+    flush_bins (&data);
+  g_mutex_unlock (&sw_gpu->lock);
+
+  g_hash_table_unref (data.states);
+  g_array_unref (data.draws);
+  g_array_unref (data.triangles);
+  g_ptr_array_unref (data.bins);
+
+  return success;
+}
+
+const CgBackendImpl cg_sw_impl = {
+  .is_threadsafe = TRUE,
+  .get_gpu_for_this_thread = get_gpu_for_this_thread,
+  .set_gpu_for_this_thread = set_gpu_for_this_thread,
+
+  .gpu_new = gpu_new,
+  .gpu_ref = gpu_ref,
+  .gpu_unref = gpu_unref,
+  .gpu_get_info = gpu_get_info,
+  .gpu_flush = gpu_flush,
+  .gpu_share = gpu_share,
+
+  .plan_new = plan_new,
+  .plan_ref = plan_ref,
+  .plan_unref = plan_unref,
+
+  .shader_new = shader_new,
+  .shader_ref = shader_ref,
+  .shader_unref = shader_unref,
+
+  .buffer_new = buffer_new,
+  .buffer_ref = buffer_ref,
+  .buffer_unref = buffer_unref,
+
+  .texture_new = texture_new,
+  .texture_ref = texture_ref,
+  .texture_unref = texture_unref,
+
+  .commands_new = commands_new,
+  .commands_ref = commands_ref,
+  .commands_unref = commands_unref,
+
+  .plan_unref_to_commands = plan_unref_to_commands,
+  .commands_dispatch = commands_dispatch,
+
+  .timer_new = timer_new,
+  .timer_free = timer_free,
+  .timer_begin = timer_begin,
+  .timer_end = timer_end,
+  .timer_collect = timer_collect,
+
+  .fence_new = fence_new,
+  .fence_free = fence_free,
+  .fence_wait = fence_wait,
+  .fence_client_wait = fence_client_wait,
+
+  .texture_update = texture_update,
+  .texture_download = texture_download,
+  .texture_import_dmabuf = texture_import_dmabuf,
+  .texture_export_dmabuf = texture_export_dmabuf,
+
+  .readback_new = readback_new,
+  .readback_free = readback_free,
+  .readback_wait = readback_wait,
+  .readback_read = readback_read,
+};
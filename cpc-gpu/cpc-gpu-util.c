@@ -138,6 +138,211 @@ cg_priv_clear_data_layout (CgDataSegment *layout,
   if (layout == NULL)
     return;
 
+  /* Only copies made by cg_priv_copy_data_layout
+   * are cleared, so the names are ours to free */
   for (guint i = 0; i < length; i++)
-    g_free (layout[i].name);
+    g_free ((char *)layout[i].name);
+}
+
+CgDataSegment *
+cg_priv_copy_data_layout (const CgDataSegment *layout,
+                          guint length)
+{
+  CgDataSegment *copy = NULL;
+
+  copy = g_malloc0_n (length, sizeof (*layout));
+  for (guint i = 0; i < length; i++)
+    {
+      copy[i].name = g_strdup (layout[i].name);
+      copy[i].num = layout[i].num;
+      copy[i].type = layout[i].type;
+      copy[i].instance_rate = layout[i].instance_rate;
+      copy[i].conversion = layout[i].conversion;
+    }
+
+  return copy;
+}
+
+static const gsize component_sizes[CG_N_COMPONENTS] = {
+  [CG_COMPONENT_FLOAT32] = 4,
+  [CG_COMPONENT_FLOAT16] = 2,
+  [CG_COMPONENT_INT8] = 1,
+  [CG_COMPONENT_UINT8] = 1,
+  [CG_COMPONENT_INT16] = 2,
+  [CG_COMPONENT_UINT16] = 2,
+  [CG_COMPONENT_INT32] = 4,
+  [CG_COMPONENT_UINT32] = 4,
+  /* packed types are handled separately */
+};
+
+static inline gboolean
+is_packed_component (int component)
+{
+  return component == CG_COMPONENT_INT_2_10_10_10 ||
+         component == CG_COMPONENT_UINT_2_10_10_10;
+}
+
+gboolean
+cg_priv_check_data_layout (const CgDataSegment *layout,
+                           guint length)
+{
+  for (guint i = 0; i < length; i++)
+    {
+      int component = 0;
+
+      if (layout[i].name == NULL)
+        return FALSE;
+      if (layout[i].num < 1 || layout[i].num > 4)
+        return FALSE;
+      if (layout[i].instance_rate < 0)
+        return FALSE;
+      if (layout[i].conversion < CG_CONVERSION_CAST ||
+          layout[i].conversion >= CG_N_CONVERSIONS)
+        return FALSE;
+      if (layout[i].type <= CG_TYPE_0 ||
+          layout[i].type == CG_COMPONENT_0 ||
+          layout[i].type >= CG_N_COMPONENTS)
+        return FALSE;
+
+      component = cg_priv_get_segment_component (&layout[i]);
+
+      if (is_packed_component (component) && layout[i].num != 4)
+        return FALSE;
+      if (layout[i].conversion == CG_CONVERSION_INTEGER &&
+          (component == CG_COMPONENT_FLOAT32 ||
+           component == CG_COMPONENT_FLOAT16 ||
+           is_packed_component (component)))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+int
+cg_priv_get_segment_component (const CgDataSegment *segment)
+{
+  if (segment->type > CG_COMPONENT_0 &&
+      segment->type < CG_N_COMPONENTS)
+    return segment->type;
+  else if (segment->type == CG_TYPE_FLOAT)
+    return CG_COMPONENT_FLOAT32;
+  else
+    return CG_COMPONENT_UINT8;
+}
+
+gsize
+cg_priv_get_segment_size (const CgDataSegment *segment)
+{
+  int component = 0;
+
+  component = cg_priv_get_segment_component (segment);
+  if (is_packed_component (component))
+    return 4;
+  else
+    return component_sizes[component] * segment->num;
+}
+
+gsize
+cg_priv_get_data_layout_stride (const CgDataSegment *layout,
+                                guint length)
+{
+  gsize stride = 0;
+
+  for (guint i = 0; i < length; i++)
+    stride += cg_priv_get_segment_size (&layout[i]);
+
+  return stride;
+}
+
+/* In the tightly packed layout users upload and download */
+gsize
+cg_priv_get_pixel_size (int format)
+{
+  switch (format)
+    {
+    case CG_FORMAT_R8:
+      return 1;
+    case CG_FORMAT_RA8:
+      return 2;
+    case CG_FORMAT_RGB8:
+      return 3;
+    case CG_FORMAT_RGBA8:
+    case CG_FORMAT_R32:
+      return 4;
+    case CG_FORMAT_RGB32:
+      return 12;
+    case CG_FORMAT_RGBA32:
+      return 16;
+    case CG_PRIV_FORMAT_DEPTH:
+      return sizeof (float);
+    default:
+      g_assert_not_reached ();
+    }
+}
+
+gboolean
+cg_priv_texture_has_stencil (CgTexture *texture)
+{
+  return texture->init.format == CG_PRIV_FORMAT_DEPTH
+         && texture->init.depth_format == CG_DEPTH_FORMAT_D24S8;
+}
+
+gboolean
+cg_priv_targets_equal (CgPrivInstr *a,
+                       CgPrivInstr *b)
+{
+  if (a->pass.targets == b->pass.targets)
+    return TRUE;
+  if (a->pass.targets->len != b->pass.targets->len)
+    return FALSE;
+
+  for (guint i = 0; i < a->pass.targets->len; i++)
+    {
+      if (g_array_index (a->pass.targets, CgPrivTarget, i).texture !=
+          g_array_index (b->pass.targets, CgPrivTarget, i).texture)
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* A pass which renders into exactly the same textures as
+ * its parent, or as the pass right before it, doesn't need
+ * a framebuffer or render pass of its own; it keeps using
+ * the one that is already bound, so attaching, checking and
+ * clearing can be skipped. Only the state that differs is
+ * applied. */
+void
+cg_priv_merge_instr_node (GArray *nodes,
+                          guint node)
+{
+  CgPrivInstr *instr = CG_PRIV_NODE_INSTR (nodes, node);
+  CgPrivInstr *parent = NULL;
+  CgPrivInstr *prev = NULL;
+
+  if (instr->type != CG_PRIV_INSTR_PASS
+      || CG_PRIV_NODE (nodes, node)->parent == CG_PRIV_NO_NODE)
+    return;
+
+  parent = CG_PRIV_NODE_INSTR (nodes, CG_PRIV_NODE (nodes, node)->parent);
+  if (CG_PRIV_NODE (nodes, node)->prev_sibling != CG_PRIV_NO_NODE)
+    prev = CG_PRIV_NODE_INSTR (nodes, CG_PRIV_NODE (nodes, node)->prev_sibling);
+
+  if (instr->pass.fake)
+    /* The parent may have been merged already */
+    instr->depth = parent->depth;
+  else if (cg_priv_targets_equal (instr, parent))
+    {
+      instr->pass.merge_parent = TRUE;
+      instr->depth = parent->depth;
+    }
+  else if (prev != NULL
+           && prev->type == CG_PRIV_INSTR_PASS
+           && !prev->pass.fake
+           && cg_priv_targets_equal (instr, prev))
+    {
+      instr->pass.merge_sibling = TRUE;
+      instr->depth = prev->depth;
+      prev->pass.keep_targets = TRUE;
+    }
 }
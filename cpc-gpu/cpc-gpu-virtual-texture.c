@@ -0,0 +1,713 @@
+/* cpc-gpu-virtual-texture.c
+ *
+ * Copyright 2025 Adam Masciola
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+#define G_LOG_DOMAIN "CpcGpuVirtualTexture"
+#include "cpc-gpu-private.h"
+
+#include <string.h>
+
+/* The feedback pass renders at this fraction of the
+ * view's size in each dimension */
+#define FEEDBACK_DIVISOR 8
+#define FEEDBACK_LOG2 3
+/* Feedback is read back asynchronously, and stalls
+ * only once this many readbacks are in flight */
+#define FEEDBACK_READBACKS 3
+
+/* Page coordinates are packed into 12 bits each,
+ * both in page keys and in feedback pixels */
+#define MAX_PAGES_PER_SIDE 4096
+/* Cache slots are stored in 8 bits each in
+ * the indirection texture */
+#define MAX_CACHE_PAGES 256
+
+/* Limits on work done by a single update */
+#define MAX_PENDING 64
+#define MAX_UPLOADS 16
+
+#define PAGE_KEY(level, x, y) (((guint)(level) << 24) | ((guint)(y) << 12) | (guint)(x))
+#define PAGE_KEY_LEVEL(key) ((int)((key) >> 24))
+#define PAGE_KEY_X(key) ((int)((key) & 0xfff))
+#define PAGE_KEY_Y(key) ((int)(((key) >> 12) & 0xfff))
+
+static const char *glsl =
+    "uniform sampler2D vtCache;\n"
+    "uniform sampler2D vtIndirection;\n"
+    "uniform vec4 vtSize;\n"
+    "uniform vec4 vtInfo;\n"
+    "\n"
+    "vec4 vtSample(vec2 uv)\n"
+    "{\n"
+    "    vec2 pages = ceil(vtSize.xy / vtSize.z);\n"
+    "    vec2 cell = clamp(floor(uv * vtSize.xy / vtSize.z), vec2(0.0), pages - 1.0);\n"
+    "    vec4 entry = texelFetch(vtIndirection, ivec2(cell), 0) * 255.0;\n"
+    "    if (entry.a < 0.5)\n"
+    "        return vec4(0.0);\n"
+    "    vec2 inPage = fract(uv * vtSize.xy / (vtSize.z * exp2(entry.b)));\n"
+    "    return texture(vtCache, (entry.rg + inPage) / vtSize.w);\n"
+    "}\n"
+    "\n"
+    "vec4 vtFeedback(vec2 uv)\n"
+    "{\n"
+    "    vec2 texel = uv * vtSize.xy;\n"
+    "    vec2 dx = dFdx(texel);\n"
+    "    vec2 dy = dFdy(texel);\n"
+    "    float lod = 0.5 * log2(max(dot(dx, dx), dot(dy, dy))) - vtInfo.y;\n"
+    "    float level = clamp(floor(lod), 0.0, vtInfo.x - 1.0);\n"
+    "    float scale = vtSize.z * exp2(level);\n"
+    "    vec2 page = floor(clamp(uv, 0.0, 1.0) * vtSize.xy / scale);\n"
+    "    page = min(page, ceil(vtSize.xy / scale) - 1.0);\n"
+    "    vec2 high = floor(page / 256.0);\n"
+    "    return vec4(page - high * 256.0, high.x + high.y * 16.0, level + 1.0) / 255.0;\n"
+    "}\n";
+
+typedef struct
+{
+  guint key;
+  int slot;
+  guint64 last_used;
+  gboolean pinned;
+  GList link;
+} Page;
+
+typedef struct
+{
+  guint key;
+  gpointer data;
+} Load;
+
+struct _CgVirtualTexture
+{
+  gatomicrefcount refcount;
+  CgGpu *gpu;
+
+  int width;
+  int height;
+  int page_size;
+  int cache_pages;
+  int n_levels;
+  int pages_x;
+  int pages_y;
+
+  CgVirtualTextureLoadFunc load;
+  gpointer load_data;
+  GDestroyNotify destroy_load_data;
+
+  CgTexture *cache;
+  CgTexture *indirection;
+  guint8 *indirection_data;
+  int dirty[4];
+
+  CgTexture *feedback;
+  guint8 *feedback_data;
+  gsize feedback_size;
+  gboolean feedback_pending;
+  /* Oldest first, and they complete in this order */
+  CgReadback *readbacks[FEEDBACK_READBACKS];
+  guint n_readbacks;
+
+  guint64 frame;
+  GHashTable *resident; /* key -> Page */
+  GQueue lru;           /* most recently used first */
+  GArray *free_slots;
+
+  /* Only touched by workers through the queue */
+  GThreadPool *pool;
+  GAsyncQueue *loaded;
+  GHashTable *pending; /* key -> Load */
+};
+
+static int
+level_pages (int size,
+             int page_size,
+             int level)
+{
+  int span = page_size << level;
+
+  return (size + span - 1) / span;
+}
+
+static void
+load_page (gpointer data,
+           gpointer user_data)
+{
+  Load *load = data;
+  CgVirtualTexture *self = user_data;
+
+  load->data = self->load (
+      PAGE_KEY_LEVEL (load->key),
+      PAGE_KEY_X (load->key),
+      PAGE_KEY_Y (load->key),
+      self->page_size,
+      self->load_data);
+
+  g_async_queue_push (self->loaded, load);
+}
+
+CgVirtualTexture *
+cg_virtual_texture_new (
+    CgGpu *self,
+    int width,
+    int height,
+    int page_size,
+    int cache_pages,
+    CgVirtualTextureLoadFunc load,
+    gpointer user_data,
+    GDestroyNotify destroy_user_data,
+    GError **error)
+{
+  g_autoptr (CgVirtualTexture) vt = NULL;
+  gsize indirection_size = 0;
+
+  g_return_val_if_fail (self != NULL, NULL);
+  g_return_val_if_fail (width > 0 && height > 0, NULL);
+  g_return_val_if_fail (page_size > 0, NULL);
+  g_return_val_if_fail (cache_pages > 0 && cache_pages <= MAX_CACHE_PAGES, NULL);
+  g_return_val_if_fail (load != NULL, NULL);
+
+  if (level_pages (width, page_size, 0) > MAX_PAGES_PER_SIDE
+      || level_pages (height, page_size, 0) > MAX_PAGES_PER_SIDE)
+    {
+      g_set_error (
+          error, CG_ERROR, CG_ERROR_FAILED_TEXTURE_GEN,
+          "A virtual texture may span at most %d pages per side",
+          MAX_PAGES_PER_SIDE);
+      return NULL;
+    }
+
+  vt = g_new0 (CgVirtualTexture, 1);
+  g_atomic_ref_count_init (&vt->refcount);
+  vt->gpu = cg_gpu_ref (self);
+
+  vt->width = width;
+  vt->height = height;
+  vt->page_size = page_size;
+  vt->cache_pages = cache_pages;
+  vt->pages_x = level_pages (width, page_size, 0);
+  vt->pages_y = level_pages (height, page_size, 0);
+
+  /* Levels halve until a single page covers everything */
+  vt->n_levels = 1;
+  while (level_pages (width, page_size, vt->n_levels - 1) > 1
+         || level_pages (height, page_size, vt->n_levels - 1) > 1)
+    vt->n_levels++;
+
+  vt->load = load;
+  vt->load_data = user_data;
+  vt->destroy_load_data = destroy_user_data;
+
+  vt->cache = cg_texture_new_for_data (
+      self, NULL, 0,
+      cache_pages * page_size, cache_pages * page_size,
+      CG_FORMAT_RGBA8, 1, 0);
+
+  indirection_size = (gsize)vt->pages_x * vt->pages_y * 4;
+  vt->indirection_data = g_malloc0 (indirection_size);
+  vt->indirection = cg_texture_new_for_data (
+      self, vt->indirection_data, indirection_size,
+      vt->pages_x, vt->pages_y,
+      CG_FORMAT_RGBA8, 1, 0);
+
+  vt->resident = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, g_free);
+  g_queue_init (&vt->lru);
+  vt->free_slots = g_array_sized_new (FALSE, FALSE, sizeof (int), cache_pages * cache_pages);
+  for (int i = cache_pages * cache_pages - 1; i >= 0; i--)
+    g_array_append_val (vt->free_slots, i);
+
+  vt->loaded = g_async_queue_new ();
+  vt->pending = g_hash_table_new (g_direct_hash, g_direct_equal);
+  vt->pool = g_thread_pool_new (
+      load_page, vt, g_get_num_processors (), FALSE, error);
+  if (vt->pool == NULL)
+    return NULL;
+
+  return g_steal_pointer (&vt);
+}
+
+CgVirtualTexture *
+cg_virtual_texture_ref (CgVirtualTexture *self)
+{
+  g_return_val_if_fail (self != NULL, NULL);
+
+  g_atomic_ref_count_inc (&self->refcount);
+  return self;
+}
+
+static void
+free_load (Load *load)
+{
+  g_free (load->data);
+  g_free (load);
+}
+
+void
+cg_virtual_texture_unref (gpointer self)
+{
+  CgVirtualTexture *vt = self;
+
+  g_return_if_fail (self != NULL);
+
+  if (g_atomic_ref_count_dec (&vt->refcount))
+    {
+      if (vt->pool != NULL)
+        /* Drops loads that have not started
+         * and waits for the rest */
+        g_thread_pool_free (g_steal_pointer (&vt->pool), TRUE, TRUE);
+
+      if (vt->loaded != NULL)
+        {
+          Load *load = NULL;
+
+          while ((load = g_async_queue_try_pop (vt->loaded)) != NULL)
+            {
+              g_hash_table_remove (vt->pending, GUINT_TO_POINTER (load->key));
+              free_load (load);
+            }
+          g_clear_pointer (&vt->loaded, g_async_queue_unref);
+        }
+
+      if (vt->pending != NULL)
+        {
+          GHashTableIter iter = { 0 };
+          gpointer value = NULL;
+
+          /* What is left never reached a worker */
+          g_hash_table_iter_init (&iter, vt->pending);
+          while (g_hash_table_iter_next (&iter, NULL, &value))
+            free_load (value);
+          g_clear_pointer (&vt->pending, g_hash_table_unref);
+        }
+
+      /* Links are embedded in the pages, which the
+       * resident table owns */
+      g_queue_init (&vt->lru);
+      g_clear_pointer (&vt->resident, g_hash_table_unref);
+      g_clear_pointer (&vt->free_slots, g_array_unref);
+
+      g_clear_pointer (&vt->cache, cg_texture_unref);
+      g_clear_pointer (&vt->indirection, cg_texture_unref);
+      g_clear_pointer (&vt->indirection_data, g_free);
+      for (guint i = 0; i < vt->n_readbacks; i++)
+        cg_readback_unref (vt->readbacks[i]);
+      g_clear_pointer (&vt->feedback, cg_texture_unref);
+      g_clear_pointer (&vt->feedback_data, g_free);
+
+      if (vt->destroy_load_data != NULL)
+        vt->destroy_load_data (vt->load_data);
+
+      g_clear_pointer (&vt->gpu, cg_gpu_unref);
+      g_free (vt);
+    }
+}
+
+const char *
+cg_virtual_texture_get_glsl (void)
+{
+  return glsl;
+}
+
+static void
+mark_dirty (CgVirtualTexture *self,
+            guint key)
+{
+  int level = PAGE_KEY_LEVEL (key);
+  int x0 = PAGE_KEY_X (key) << level;
+  int y0 = PAGE_KEY_Y (key) << level;
+  int x1 = MIN ((PAGE_KEY_X (key) + 1) << level, self->pages_x);
+  int y1 = MIN ((PAGE_KEY_Y (key) + 1) << level, self->pages_y);
+
+  if (self->dirty[0] >= self->dirty[2])
+    {
+      self->dirty[0] = x0;
+      self->dirty[1] = y0;
+      self->dirty[2] = x1;
+      self->dirty[3] = y1;
+    }
+  else
+    {
+      self->dirty[0] = MIN (self->dirty[0], x0);
+      self->dirty[1] = MIN (self->dirty[1], y0);
+      self->dirty[2] = MAX (self->dirty[2], x1);
+      self->dirty[3] = MAX (self->dirty[3], y1);
+    }
+}
+
+static void
+touch (CgVirtualTexture *self,
+       Page *page)
+{
+  page->last_used = self->frame;
+  if (!page->pinned)
+    {
+      g_queue_unlink (&self->lru, &page->link);
+      g_queue_push_head_link (&self->lru, &page->link);
+    }
+}
+
+static void
+request (CgVirtualTexture *self,
+         int level,
+         int x,
+         int y)
+{
+  /* Keep every coarser page this one would fall back
+   * on around, and load the first one missing */
+  for (; level < self->n_levels; level++, x >>= 1, y >>= 1)
+    {
+      guint key = PAGE_KEY (level, x, y);
+      Page *page = NULL;
+
+      page = g_hash_table_lookup (self->resident, GUINT_TO_POINTER (key));
+      if (page != NULL)
+        touch (self, page);
+      else if (!g_hash_table_contains (self->pending, GUINT_TO_POINTER (key))
+               && g_hash_table_size (self->pending) < MAX_PENDING)
+        {
+          Load *load = NULL;
+
+          load = g_new0 (Load, 1);
+          load->key = key;
+          g_hash_table_insert (self->pending, GUINT_TO_POINTER (key), load);
+          g_thread_pool_push (self->pool, load, NULL);
+        }
+    }
+}
+
+static void
+read_feedback (CgVirtualTexture *self,
+               gsize n_pixels)
+{
+  g_autoptr (GHashTable) seen = NULL;
+
+  seen = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+  for (gsize i = 0; i < n_pixels; i++)
+    {
+      const guint8 *pixel = self->feedback_data + i * 4;
+      int level = 0;
+      int x = 0;
+      int y = 0;
+
+      /* Nothing sampled the texture here */
+      if (pixel[3] == 0)
+        continue;
+
+      level = MIN (pixel[3] - 1, self->n_levels - 1);
+      x = pixel[0] | ((pixel[2] & 0x0f) << 8);
+      y = pixel[1] | ((pixel[2] >> 4) << 8);
+
+      if (!g_hash_table_add (seen, GUINT_TO_POINTER (PAGE_KEY (level, x, y))))
+        continue;
+
+      if (x < level_pages (self->width, self->page_size, level)
+          && y < level_pages (self->height, self->page_size, level))
+        request (self, level, x, y);
+    }
+}
+
+/* Reads the newest feedback which has arrived, dropping
+ * anything older. With `block`, the oldest readback is
+ * waited for, to make room for another. */
+static gboolean
+collect_feedback (CgVirtualTexture *self,
+                  gboolean block,
+                  GError **error)
+{
+  g_autoptr (GError) local_error = NULL;
+  guint n_ready = 0;
+  CgReadback *newest = NULL;
+  gsize size = 0;
+  gboolean success = FALSE;
+
+  for (; n_ready < self->n_readbacks; n_ready++)
+    {
+      guint64 timeout = block && n_ready == 0 ? G_MAXUINT64 : 0;
+
+      if (!cg_readback_wait (self->readbacks[n_ready], timeout, &local_error))
+        break;
+    }
+
+  if (local_error != NULL)
+    {
+      g_propagate_error (error, g_steal_pointer (&local_error));
+      return FALSE;
+    }
+  if (n_ready == 0)
+    return TRUE;
+
+  newest = self->readbacks[n_ready - 1];
+  size = cg_readback_get_size (newest);
+  if (size > self->feedback_size)
+    {
+      CG_PRIV_REPLACE_POINTER (&self->feedback_data, g_malloc (size), g_free);
+      self->feedback_size = size;
+    }
+  success = cg_readback_finish (newest, self->feedback_data, size, error);
+
+  for (guint i = 0; i < n_ready; i++)
+    cg_readback_unref (self->readbacks[i]);
+  self->n_readbacks -= n_ready;
+  memmove (self->readbacks, self->readbacks + n_ready,
+           self->n_readbacks * sizeof (*self->readbacks));
+
+  if (!success)
+    return FALSE;
+
+  read_feedback (self, size / 4);
+  return TRUE;
+}
+
+static gboolean
+place_page (CgVirtualTexture *self,
+            Load *load,
+            GError **error)
+{
+  Page *page = NULL;
+  int slot = 0;
+
+  if (self->free_slots->len > 0)
+    {
+      slot = g_array_index (self->free_slots, int, self->free_slots->len - 1);
+      g_array_set_size (self->free_slots, self->free_slots->len - 1);
+    }
+  else
+    {
+      Page *victim = NULL;
+
+      victim = self->lru.tail != NULL ? self->lru.tail->data : NULL;
+      if (victim == NULL || victim->last_used == self->frame)
+        {
+          /* Everything resident is in use, so the cache is
+           * too small for the view; drop the page for now */
+          g_debug ("Page cache is full, dropping page");
+          return TRUE;
+        }
+
+      g_queue_unlink (&self->lru, &victim->link);
+      slot = victim->slot;
+      mark_dirty (self, victim->key);
+      g_hash_table_remove (self->resident, GUINT_TO_POINTER (victim->key));
+    }
+
+  if (!cg_texture_update_region (
+          self->cache,
+          (slot % self->cache_pages) * self->page_size,
+          (slot / self->cache_pages) * self->page_size,
+          self->page_size, self->page_size,
+          load->data, error))
+    {
+      g_array_append_val (self->free_slots, slot);
+      return FALSE;
+    }
+
+  page = g_new0 (Page, 1);
+  page->key = load->key;
+  page->slot = slot;
+  page->last_used = self->frame;
+  page->link.data = page;
+
+  /* The coarsest level is the last resort, so it stays */
+  page->pinned = PAGE_KEY_LEVEL (load->key) == self->n_levels - 1;
+  if (!page->pinned)
+    g_queue_push_head_link (&self->lru, &page->link);
+
+  g_hash_table_insert (self->resident, GUINT_TO_POINTER (page->key), page);
+  mark_dirty (self, page->key);
+
+  return TRUE;
+}
+
+static gboolean
+flush_indirection (CgVirtualTexture *self,
+                   GError **error)
+{
+  int x0 = self->dirty[0];
+  int y0 = self->dirty[1];
+  int width = self->dirty[2] - self->dirty[0];
+  int height = self->dirty[3] - self->dirty[1];
+  g_autofree guint8 *rect = NULL;
+
+  if (width <= 0 || height <= 0)
+    return TRUE;
+  memset (self->dirty, 0, sizeof (self->dirty));
+
+  rect = g_malloc ((gsize)width * height * 4);
+
+  for (int y = y0; y < y0 + height; y++)
+    {
+      for (int x = x0; x < x0 + width; x++)
+        {
+          guint8 *entry = self->indirection_data + ((gsize)y * self->pages_x + x) * 4;
+
+          memset (entry, 0, 4);
+
+          /* Point at the finest resident page covering this cell */
+          for (int level = 0; level < self->n_levels; level++)
+            {
+              Page *page = NULL;
+
+              page = g_hash_table_lookup (
+                  self->resident,
+                  GUINT_TO_POINTER (PAGE_KEY (level, x >> level, y >> level)));
+              if (page != NULL)
+                {
+                  entry[0] = page->slot % self->cache_pages;
+                  entry[1] = page->slot / self->cache_pages;
+                  entry[2] = level;
+                  entry[3] = 0xff;
+                  break;
+                }
+            }
+        }
+
+      memcpy (rect + (gsize)(y - y0) * width * 4,
+              self->indirection_data + ((gsize)y * self->pages_x + x0) * 4,
+              (gsize)width * 4);
+    }
+
+  return cg_texture_update_region (
+      self->indirection, x0, y0, width, height, rect, error);
+}
+
+gboolean
+cg_virtual_texture_update (
+    CgVirtualTexture *self,
+    GError **error)
+{
+  Load *load = NULL;
+
+  g_return_val_if_fail (self != NULL, FALSE);
+
+  self->frame++;
+
+  if (self->feedback_pending)
+    {
+      CgReadback *readback = NULL;
+
+      self->feedback_pending = FALSE;
+      if (self->n_readbacks == FEEDBACK_READBACKS
+          && !collect_feedback (self, TRUE, error))
+        return FALSE;
+
+      /* Should the wait still run out, this frame's
+       * feedback is skipped */
+      if (self->n_readbacks < FEEDBACK_READBACKS)
+        {
+          readback = cg_texture_download_async (
+              self->feedback, 0, 0,
+              self->feedback->init.width, self->feedback->init.height,
+              0, error);
+          if (readback == NULL)
+            return FALSE;
+          self->readbacks[self->n_readbacks++] = readback;
+        }
+    }
+
+  if (!collect_feedback (self, FALSE, error))
+    return FALSE;
+
+  /* Something is always better than nothing */
+  request (self, self->n_levels - 1, 0, 0);
+
+  for (guint i = 0; i < MAX_UPLOADS; i++)
+    {
+      gboolean success = FALSE;
+
+      load = g_async_queue_try_pop (self->loaded);
+      if (load == NULL)
+        break;
+
+      g_hash_table_remove (self->pending, GUINT_TO_POINTER (load->key));
+      success = load->data == NULL || place_page (self, load, error);
+      free_load (load);
+
+      if (!success)
+        return FALSE;
+    }
+
+  return flush_indirection (self, error);
+}
+
+void
+cg_virtual_texture_config_uniforms (
+    CgVirtualTexture *self,
+    CgPlan *plan)
+{
+  g_return_if_fail (self != NULL);
+  g_return_if_fail (plan != NULL);
+
+  cg_plan_config_uniforms (
+      plan,
+      CG_KEYVAL ("vtCache", CG_TEXTURE (self->cache)),
+      CG_KEYVAL ("vtIndirection", CG_TEXTURE (self->indirection)),
+      CG_KEYVAL ("vtSize", CG_VEC4 (self->width, self->height, self->page_size, self->cache_pages)),
+      NULL);
+}
+
+void
+cg_virtual_texture_config_feedback (
+    CgVirtualTexture *self,
+    CgPlan *plan,
+    int width,
+    int height)
+{
+  int feedback_width = 0;
+  int feedback_height = 0;
+
+  g_return_if_fail (self != NULL);
+  g_return_if_fail (plan != NULL);
+  g_return_if_fail (width > 0 && height > 0);
+
+  feedback_width = (width + FEEDBACK_DIVISOR - 1) / FEEDBACK_DIVISOR;
+  feedback_height = (height + FEEDBACK_DIVISOR - 1) / FEEDBACK_DIVISOR;
+
+  if (self->feedback == NULL
+      || self->feedback->init.width != feedback_width
+      || self->feedback->init.height != feedback_height)
+    {
+      g_clear_pointer (&self->feedback, cg_texture_unref);
+      self->feedback = cg_texture_new_for_data (
+          self->gpu, NULL, 0, feedback_width, feedback_height,
+          CG_FORMAT_RGBA8, 1, 0);
+    }
+
+  /* Feedback pixels are data, so they must not be blended */
+  cg_plan_config_targets (
+      plan,
+      CG_TUPLE3 (CG_TEXTURE (self->feedback), CG_INT (CG_BLEND_ONE), CG_INT (CG_BLEND_ZERO)),
+      NULL);
+  cg_plan_config_dest (plan, 0, 0, feedback_width, feedback_height);
+  cg_plan_config_uniforms (
+      plan,
+      CG_KEYVAL ("vtSize", CG_VEC4 (self->width, self->height, self->page_size, self->cache_pages)),
+      CG_KEYVAL ("vtInfo", CG_VEC4 (self->n_levels, FEEDBACK_LOG2, 0.0, 0.0)),
+      NULL);
+
+  self->feedback_pending = TRUE;
+}
+
+guint
+cg_virtual_texture_get_n_resident (CgVirtualTexture *self)
+{
+  g_return_val_if_fail (self != NULL, 0);
+
+  return g_hash_table_size (self->resident);
+}
@@ -19,6 +19,4721 @@
  * SPDX-License-Identifier: LGPL-2.1-or-later
  */
 
+#define G_LOG_DOMAIN "CpcGpuVK"
 #include "cpc-gpu-private.h"
 
-// IMPLEMENT ME!!!
+#include <vulkan/vulkan.h>
+
+#define CGV_MESSAGE_PREFIX "Vulkan Backend: "
+#define CGV_CRITICAL(...) g_critical (CGV_MESSAGE_PREFIX __VA_ARGS__)
+#define CGV_CRITICAL_USER_ERROR(...) g_critical (CGV_MESSAGE_PREFIX "User Error: " __VA_ARGS__)
+
+/* Command buffers are recorded once, at compile time. When a
+ * plan has enough render passes and draws to be worth it, each
+ * render pass is recorded into a secondary command buffer on
+ * its own thread. */
+#define CGV_PARALLEL_MIN_STEPS 2
+#define CGV_PARALLEL_MIN_DRAWS 32
+
+#define CGV_MAX_TARGETS 8
+#define CGV_DESCRIPTOR_POOL_SETS 64
+
+enum
+{
+  SAMPLER_LINEAR_REPEAT = 0,
+  SAMPLER_LINEAR_CLAMP,
+  SAMPLER_NEAREST_REPEAT,
+  SAMPLER_NEAREST_CLAMP,
+  N_SAMPLERS,
+};
+
+/* Every handle is optional; whatever is set is destroyed
+ * once the gpu has finished the submission `serial`. */
+typedef struct
+{
+  guint64 serial;
+
+  VkPipeline pipeline;
+  VkFramebuffer framebuffer;
+  VkCommandPool command_pool;
+  VkDescriptorPool descriptor_pool;
+  VkQueryPool query_pool;
+  VkBuffer buffer;
+  VkImageView views[2];
+  VkImage image;
+  VkDeviceMemory memory;
+  VkShaderModule modules[2];
+  VkPipelineLayout layout;
+  VkDescriptorSetLayout set_layout;
+} DestroyedObject;
+
+typedef struct _CgvGpu CgvGpu;
+typedef struct _CgvPlan CgvPlan;
+typedef struct _CgvShader CgvShader;
+typedef struct _CgvBuffer CgvBuffer;
+typedef struct _CgvTexture CgvTexture;
+typedef struct _CgvCommands CgvCommands;
+typedef struct _CgvTimer CgvTimer;
+typedef struct _CgvReadback CgvReadback;
+
+struct _CgvGpu
+{
+  CgGpu base;
+  gatomicrefcount refcount;
+
+  VkInstance instance;
+  VkPhysicalDevice physical_device;
+  VkPhysicalDeviceProperties properties;
+  VkPhysicalDeviceMemoryProperties memory_properties;
+  gboolean dual_source_blend;
+  VkDevice device;
+  guint32 queue_family;
+  guint32 timestamp_bits;
+
+  /* Guards the queue, the submission counter
+   * and the pool used for uploads */
+  GMutex queue_lock;
+  VkQueue queue;
+  VkCommandPool upload_pool;
+  VkSemaphore timeline;
+  guint64 submitted;
+
+  /* Held while creating backend objects for
+   * resources, which happens lazily */
+  GMutex objects_lock;
+
+  /* Guards the render pass and pipeline caches */
+  GMutex cache_lock;
+  VkPipelineCache pipeline_cache;
+  GHashTable *render_passes;
+
+  VkSampler samplers[N_SAMPLERS];
+
+  GMutex destroyed_lock;
+  GArray *destroyed_objects;
+
+  GThreadPool *recorders;
+};
+
+struct _CgvPlan
+{
+  CgPlan base;
+  gatomicrefcount refcount;
+};
+
+enum
+{
+  SLOT_SAMPLER = 0,
+  SLOT_BLOCK,
+  SLOT_VALUE,
+};
+
+/* Where a uniform name ends up in the shader */
+typedef struct
+{
+  int kind;
+  int type;
+  guint binding;
+  guint offset;
+  gboolean push;
+  gboolean cubemap;
+} CgvSlot;
+
+typedef struct
+{
+  guint binding;
+  int kind;
+  guint size;
+  VkShaderStageFlags stages;
+} CgvBinding;
+
+struct _CgvShader
+{
+  CgShader base;
+  gatomicrefcount refcount;
+
+  VkShaderModule modules[2];
+  VkDescriptorSetLayout set_layout;
+  VkPipelineLayout layout;
+
+  GHashTable *slots;
+  GArray *bindings;
+  guint push_size;
+  VkShaderStageFlags push_stages;
+  GHashTable *inputs;
+
+  /* Pipelines by state key, guarded by the cache lock */
+  GHashTable *pipelines;
+};
+
+enum
+{
+  BUFFER_NONE = 0,
+  BUFFER_VERTICES,
+  BUFFER_UNIFORMS,
+  BUFFER_INDICES,
+};
+
+struct _CgvBuffer
+{
+  CgBuffer base;
+  gatomicrefcount refcount;
+
+  int usage;
+  VkBuffer buffer;
+  VkDeviceMemory memory;
+  VkIndexType index_type;
+  guint length;
+};
+
+struct _CgvTexture
+{
+  CgTexture base;
+  gatomicrefcount refcount;
+
+  VkImage image;
+  VkDeviceMemory memory;
+  VkFormat format;
+  VkImageAspectFlags aspect;
+  VkImageLayout layout;
+  VkSampleCountFlagBits samples;
+  guint levels;
+  guint layers;
+
+  /* Sampling applies the swizzles of one and two
+   * channel formats, rendering must not */
+  VkImageView view;
+  VkImageView attachment_view;
+  VkSampler sampler;
+
+  CgTexture *non_msaa;
+};
+
+enum
+{
+  STEP_RENDER = 0,
+  STEP_BLIT,
+  STEP_RESOLVE,
+};
+
+typedef struct
+{
+  CgPrivInstr *instr;
+  CgvShader *shader;
+  VkPipeline pipeline;
+  VkDescriptorSet set;
+  gint64 push_offset;
+  VkViewport viewport;
+  VkRect2D scissor;
+  guint vertex_count;
+} CgvDraw;
+
+typedef struct
+{
+  int type;
+
+  /* STEP_RENDER */
+  VkRenderPass render_pass;
+  VkFramebuffer framebuffer;
+  VkExtent2D extent;
+  VkClearValue clears[CGV_MAX_TARGETS];
+  guint n_clears;
+  guint first_draw;
+  guint n_draws;
+  VkCommandBuffer secondary;
+
+  /* STEP_BLIT and STEP_RESOLVE */
+  CgTexture *src;
+  CgTexture *dst;
+  int src_region[4];
+  int dst_region[4];
+  gboolean linear;
+} CgvStep;
+
+struct _CgvCommands
+{
+  CgCommands base;
+  gatomicrefcount refcount;
+
+  GArray *nodes;
+
+  VkCommandBuffer primary;
+  GArray *command_pools;
+  GArray *descriptor_pools;
+  GArray *framebuffers;
+
+  /* Values for uniform blocks which are not
+   * backed by a buffer of the user's */
+  VkBuffer arena;
+  VkDeviceMemory arena_memory;
+
+  guint64 last_submitted;
+};
+
+/* A ring of timestamp pairs. Writing each pair is
+ * recorded once, up front, for every slot. */
+struct _CgvTimer
+{
+  VkQueryPool pool;
+  VkCommandPool command_pool;
+  VkCommandBuffer *begin;
+  VkCommandBuffer *end;
+  guint n_queries;
+  guint head;
+  guint n_pending;
+};
+
+/* A copy into host visible memory, submitted with its
+ * own command pool so it can be released from any
+ * thread once the timeline passes `serial` */
+struct _CgvReadback
+{
+  VkBuffer staging;
+  VkDeviceMemory staging_memory;
+  VkCommandPool command_pool;
+  guint64 serial;
+  int format;
+  gsize n_pixels;
+};
+
+static const char *
+result_to_string (VkResult result)
+{
+  switch ((int)result)
+    {
+    case VK_SUCCESS:
+      return "VK_SUCCESS";
+    case VK_NOT_READY:
+      return "VK_NOT_READY";
+    case VK_TIMEOUT:
+      return "VK_TIMEOUT";
+    case VK_ERROR_OUT_OF_HOST_MEMORY:
+      return "VK_ERROR_OUT_OF_HOST_MEMORY";
+    case VK_ERROR_OUT_OF_DEVICE_MEMORY:
+      return "VK_ERROR_OUT_OF_DEVICE_MEMORY";
+    case VK_ERROR_INITIALIZATION_FAILED:
+      return "VK_ERROR_INITIALIZATION_FAILED";
+    case VK_ERROR_DEVICE_LOST:
+      return "VK_ERROR_DEVICE_LOST";
+    case VK_ERROR_LAYER_NOT_PRESENT:
+      return "VK_ERROR_LAYER_NOT_PRESENT";
+    case VK_ERROR_EXTENSION_NOT_PRESENT:
+      return "VK_ERROR_EXTENSION_NOT_PRESENT";
+    case VK_ERROR_FEATURE_NOT_PRESENT:
+      return "VK_ERROR_FEATURE_NOT_PRESENT";
+    case VK_ERROR_INCOMPATIBLE_DRIVER:
+      return "VK_ERROR_INCOMPATIBLE_DRIVER";
+    case VK_ERROR_FORMAT_NOT_SUPPORTED:
+      return "VK_ERROR_FORMAT_NOT_SUPPORTED";
+    default:
+      return "Error Not Recognized!";
+    }
+}
+
+static void
+_cgv_set_error (GError **error,
+                int code,
+                VkResult result,
+                char *msg_to_free)
+{
+  g_autofree char *message = msg_to_free;
+
+  if (result == VK_SUCCESS)
+    g_set_error (error, CG_ERROR, code, CGV_MESSAGE_PREFIX "%s", message);
+  else
+    g_set_error (
+        error, CG_ERROR, code, CGV_MESSAGE_PREFIX "%s: %s",
+        message, result_to_string (result));
+}
+
+#define CGV_SET_ERROR(error, code, result, ...)                                    \
+  G_STMT_START                                                                     \
+  {                                                                                \
+    if (error != NULL)                                                             \
+      _cgv_set_error ((error), (code), (result), g_strdup_printf (__VA_ARGS__)); \
+  }                                                                                \
+  G_STMT_END
+
+static GPrivate current_context = G_PRIVATE_INIT (cg_gpu_unref);
+
+static CgGpu *
+get_gpu_for_this_thread (void)
+{
+  return g_private_get (&current_context);
+}
+
+static void
+set_gpu_for_this_thread (CgGpu *gpu)
+{
+  g_private_replace (&current_context, cg_gpu_ref (gpu));
+}
+
+static void
+clear_destroyed_object (CgvGpu *vk_gpu,
+                        DestroyedObject *self)
+{
+  VkDevice device = vk_gpu->device;
+
+  if (self->pipeline != VK_NULL_HANDLE)
+    vkDestroyPipeline (device, self->pipeline, NULL);
+  if (self->framebuffer != VK_NULL_HANDLE)
+    vkDestroyFramebuffer (device, self->framebuffer, NULL);
+  if (self->command_pool != VK_NULL_HANDLE)
+    vkDestroyCommandPool (device, self->command_pool, NULL);
+  if (self->descriptor_pool != VK_NULL_HANDLE)
+    vkDestroyDescriptorPool (device, self->descriptor_pool, NULL);
+  if (self->query_pool != VK_NULL_HANDLE)
+    vkDestroyQueryPool (device, self->query_pool, NULL);
+  if (self->buffer != VK_NULL_HANDLE)
+    vkDestroyBuffer (device, self->buffer, NULL);
+  for (guint i = 0; i < G_N_ELEMENTS (self->views); i++)
+    if (self->views[i] != VK_NULL_HANDLE)
+      vkDestroyImageView (device, self->views[i], NULL);
+  if (self->image != VK_NULL_HANDLE)
+    vkDestroyImage (device, self->image, NULL);
+  if (self->memory != VK_NULL_HANDLE)
+    vkFreeMemory (device, self->memory, NULL);
+  for (guint i = 0; i < G_N_ELEMENTS (self->modules); i++)
+    if (self->modules[i] != VK_NULL_HANDLE)
+      vkDestroyShaderModule (device, self->modules[i], NULL);
+  if (self->layout != VK_NULL_HANDLE)
+    vkDestroyPipelineLayout (device, self->layout, NULL);
+  if (self->set_layout != VK_NULL_HANDLE)
+    vkDestroyDescriptorSetLayout (device, self->set_layout, NULL);
+}
+
+/* Anything submitted so far may still be using the
+ * object, so it lives until that work has finished */
+static void
+destroy_later (CgGpu *gpu,
+               DestroyedObject *object)
+{
+  CgvGpu *vk_gpu = (CgvGpu *)gpu;
+
+  g_mutex_lock (&vk_gpu->queue_lock);
+  object->serial = vk_gpu->submitted;
+  g_mutex_unlock (&vk_gpu->queue_lock);
+
+  g_mutex_lock (&vk_gpu->destroyed_lock);
+  g_array_append_val (vk_gpu->destroyed_objects, *object);
+  g_mutex_unlock (&vk_gpu->destroyed_lock);
+}
+
+static void
+collect_destroyed_objects (CgvGpu *vk_gpu,
+                           gboolean all)
+{
+  guint64 completed = 0;
+
+  if (!all && vkGetSemaphoreCounterValue (
+                  vk_gpu->device, vk_gpu->timeline, &completed) != VK_SUCCESS)
+    return;
+
+  g_mutex_lock (&vk_gpu->destroyed_lock);
+  for (guint i = 0; i < vk_gpu->destroyed_objects->len;)
+    {
+      DestroyedObject *object = &g_array_index (vk_gpu->destroyed_objects, DestroyedObject, i);
+
+      if (all || object->serial <= completed)
+        {
+          clear_destroyed_object (vk_gpu, object);
+          g_array_remove_index_fast (vk_gpu->destroyed_objects, i);
+        }
+      else
+        i++;
+    }
+  g_mutex_unlock (&vk_gpu->destroyed_lock);
+}
+
+/* Must be called with the queue lock held */
+static gboolean
+submit_locked (CgvGpu *vk_gpu,
+               VkCommandBuffer command_buffer,
+               guint64 *serial,
+               GError **error)
+{
+  VkTimelineSemaphoreSubmitInfo timeline_info = { 0 };
+  VkSubmitInfo submit_info = { 0 };
+  guint64 signal = 0;
+  VkResult result = VK_SUCCESS;
+
+  signal = vk_gpu->submitted + 1;
+
+  timeline_info.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+  timeline_info.signalSemaphoreValueCount = 1;
+  timeline_info.pSignalSemaphoreValues = &signal;
+
+  submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+  submit_info.pNext = &timeline_info;
+  submit_info.commandBufferCount = 1;
+  submit_info.pCommandBuffers = &command_buffer;
+  submit_info.signalSemaphoreCount = 1;
+  submit_info.pSignalSemaphores = &vk_gpu->timeline;
+
+  result = vkQueueSubmit (vk_gpu->queue, 1, &submit_info, VK_NULL_HANDLE);
+  if (result != VK_SUCCESS)
+    {
+      CGV_SET_ERROR (
+          error, CG_ERROR_FAILED_INIT, result,
+          "Failed to submit to the queue");
+      return FALSE;
+    }
+
+  vk_gpu->submitted = signal;
+  if (serial != NULL)
+    *serial = signal;
+
+  return TRUE;
+}
+
+static gboolean
+wait_for_serial (CgvGpu *vk_gpu,
+                 guint64 serial,
+                 guint64 timeout,
+                 gboolean *reached,
+                 GError **error)
+{
+  VkSemaphoreWaitInfo wait_info = { 0 };
+  VkResult result = VK_SUCCESS;
+
+  wait_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+  wait_info.semaphoreCount = 1;
+  wait_info.pSemaphores = &vk_gpu->timeline;
+  wait_info.pValues = &serial;
+
+  result = vkWaitSemaphores (vk_gpu->device, &wait_info, timeout);
+  if (result != VK_SUCCESS && result != VK_TIMEOUT)
+    {
+      CGV_SET_ERROR (
+          error, CG_ERROR_NOT_SUPPORTED, result,
+          "Failed to wait on the timeline semaphore");
+      return FALSE;
+    }
+
+  if (reached != NULL)
+    *reached = result == VK_SUCCESS;
+  return TRUE;
+}
+
+/* Uploads and other transfers outside of a plan
+ * are recorded, submitted and waited on in place */
+static VkCommandBuffer
+begin_one_shot (CgvGpu *vk_gpu,
+                GError **error)
+{
+  VkCommandBufferAllocateInfo allocate_info = { 0 };
+  VkCommandBufferBeginInfo begin_info = { 0 };
+  VkCommandBuffer command_buffer = VK_NULL_HANDLE;
+  VkResult result = VK_SUCCESS;
+
+  g_mutex_lock (&vk_gpu->queue_lock);
+
+  allocate_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+  allocate_info.commandPool = vk_gpu->upload_pool;
+  allocate_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+  allocate_info.commandBufferCount = 1;
+
+  result = vkAllocateCommandBuffers (vk_gpu->device, &allocate_info, &command_buffer);
+  if (result != VK_SUCCESS)
+    {
+      CGV_SET_ERROR (
+          error, CG_ERROR_FAILED_INIT, result,
+          "Failed to allocate a command buffer");
+      g_mutex_unlock (&vk_gpu->queue_lock);
+      return VK_NULL_HANDLE;
+    }
+
+  begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+  begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+
+  result = vkBeginCommandBuffer (command_buffer, &begin_info);
+  if (result != VK_SUCCESS)
+    {
+      CGV_SET_ERROR (
+          error, CG_ERROR_FAILED_INIT, result,
+          "Failed to begin a command buffer");
+      vkFreeCommandBuffers (vk_gpu->device, vk_gpu->upload_pool, 1, &command_buffer);
+      g_mutex_unlock (&vk_gpu->queue_lock);
+      return VK_NULL_HANDLE;
+    }
+
+  return command_buffer;
+}
+
+static gboolean
+end_one_shot (CgvGpu *vk_gpu,
+              VkCommandBuffer command_buffer,
+              GError **error)
+{
+  guint64 serial = 0;
+  gboolean success = FALSE;
+
+  success = vkEndCommandBuffer (command_buffer) == VK_SUCCESS
+            && submit_locked (vk_gpu, command_buffer, &serial, error);
+  g_mutex_unlock (&vk_gpu->queue_lock);
+
+  if (success)
+    success = wait_for_serial (vk_gpu, serial, G_MAXUINT64, NULL, error);
+
+  g_mutex_lock (&vk_gpu->queue_lock);
+  vkFreeCommandBuffers (vk_gpu->device, vk_gpu->upload_pool, 1, &command_buffer);
+  g_mutex_unlock (&vk_gpu->queue_lock);
+
+  return success;
+}
+
+static gboolean
+find_memory_type (CgvGpu *vk_gpu,
+                  guint32 type_bits,
+                  VkMemoryPropertyFlags flags,
+                  guint32 *index)
+{
+  for (guint32 i = 0; i < vk_gpu->memory_properties.memoryTypeCount; i++)
+    {
+      if ((type_bits & (1u << i))
+          && (vk_gpu->memory_properties.memoryTypes[i].propertyFlags & flags) == flags)
+        {
+          *index = i;
+          return TRUE;
+        }
+    }
+
+  return FALSE;
+}
+
+/* One allocation per resource. Plans hold few enough
+ * resources that a suballocator isn't worth it yet. */
+static gboolean
+allocate_memory (CgvGpu *vk_gpu,
+                 const VkMemoryRequirements *requirements,
+                 gboolean host_visible,
+                 VkDeviceMemory *memory,
+                 GError **error)
+{
+  VkMemoryAllocateInfo allocate_info = { 0 };
+  guint32 index = 0;
+  gboolean found = FALSE;
+  VkResult result = VK_SUCCESS;
+
+  if (host_visible)
+    found = find_memory_type (
+                vk_gpu, requirements->memoryTypeBits,
+                VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT
+                    | VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT
+                    | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                &index)
+            || find_memory_type (
+                vk_gpu, requirements->memoryTypeBits,
+                VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT
+                    | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                &index);
+  else
+    found = find_memory_type (
+                vk_gpu, requirements->memoryTypeBits,
+                VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &index)
+            || find_memory_type (
+                vk_gpu, requirements->memoryTypeBits, 0, &index);
+
+  if (!found)
+    {
+      CGV_SET_ERROR (
+          error, CG_ERROR_FAILED_BUFFER_GEN, VK_ERROR_OUT_OF_DEVICE_MEMORY,
+          "No suitable memory type");
+      return FALSE;
+    }
+
+  allocate_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+  allocate_info.allocationSize = requirements->size;
+  allocate_info.memoryTypeIndex = index;
+
+  result = vkAllocateMemory (vk_gpu->device, &allocate_info, NULL, memory);
+  if (result != VK_SUCCESS)
+    {
+      CGV_SET_ERROR (
+          error, CG_ERROR_FAILED_BUFFER_GEN, result,
+          "Failed to allocate memory");
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Creates a host visible buffer, optionally filled with `data` */
+static gboolean
+create_buffer (CgvGpu *vk_gpu,
+               VkDeviceSize size,
+               VkBufferUsageFlags usage,
+               gconstpointer data,
+               VkBuffer *buffer,
+               VkDeviceMemory *memory,
+               GError **error)
+{
+  VkBufferCreateInfo create_info = { 0 };
+  VkMemoryRequirements requirements = { 0 };
+  gpointer mapped = NULL;
+  VkResult result = VK_SUCCESS;
+
+  create_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+  create_info.size = MAX (size, 4);
+  create_info.usage = usage;
+  create_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+  result = vkCreateBuffer (vk_gpu->device, &create_info, NULL, buffer);
+  if (result != VK_SUCCESS)
+    {
+      CGV_SET_ERROR (
+          error, CG_ERROR_FAILED_BUFFER_GEN, result,
+          "Failed to create buffer");
+      return FALSE;
+    }
+
+  vkGetBufferMemoryRequirements (vk_gpu->device, *buffer, &requirements);
+  if (!allocate_memory (vk_gpu, &requirements, TRUE, memory, error))
+    {
+      vkDestroyBuffer (vk_gpu->device, *buffer, NULL);
+      *buffer = VK_NULL_HANDLE;
+      return FALSE;
+    }
+  vkBindBufferMemory (vk_gpu->device, *buffer, *memory, 0);
+
+  if (data != NULL && size > 0)
+    {
+      result = vkMapMemory (vk_gpu->device, *memory, 0, size, 0, &mapped);
+      if (result != VK_SUCCESS)
+        {
+          CGV_SET_ERROR (
+              error, CG_ERROR_FAILED_BUFFER_GEN, result,
+              "Failed to map buffer memory");
+          vkDestroyBuffer (vk_gpu->device, *buffer, NULL);
+          vkFreeMemory (vk_gpu->device, *memory, NULL);
+          *buffer = VK_NULL_HANDLE;
+          *memory = VK_NULL_HANDLE;
+          return FALSE;
+        }
+      memcpy (mapped, data, size);
+      vkUnmapMemory (vk_gpu->device, *memory);
+    }
+
+  return TRUE;
+}
+
+static gboolean
+create_sampler (CgvGpu *vk_gpu,
+                VkFilter filter,
+                VkSamplerAddressMode address_mode,
+                VkSampler *sampler,
+                GError **error)
+{
+  VkSamplerCreateInfo create_info = { 0 };
+  VkResult result = VK_SUCCESS;
+
+  create_info.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+  create_info.magFilter = filter;
+  create_info.minFilter = filter;
+  create_info.mipmapMode = filter == VK_FILTER_LINEAR
+                               ? VK_SAMPLER_MIPMAP_MODE_LINEAR
+                               : VK_SAMPLER_MIPMAP_MODE_NEAREST;
+  create_info.addressModeU = address_mode;
+  create_info.addressModeV = address_mode;
+  create_info.addressModeW = address_mode;
+  create_info.maxLod = VK_LOD_CLAMP_NONE;
+
+  result = vkCreateSampler (vk_gpu->device, &create_info, NULL, sampler);
+  if (result != VK_SUCCESS)
+    {
+      CGV_SET_ERROR (
+          error, CG_ERROR_FAILED_INIT, result,
+          "Failed to create sampler");
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static gboolean
+has_layer (const char *name)
+{
+  g_autofree VkLayerProperties *layers = NULL;
+  guint32 n_layers = 0;
+
+  if (vkEnumerateInstanceLayerProperties (&n_layers, NULL) != VK_SUCCESS)
+    return FALSE;
+  layers = g_new0 (VkLayerProperties, MAX (n_layers, 1));
+  if (vkEnumerateInstanceLayerProperties (&n_layers, layers) != VK_SUCCESS)
+    return FALSE;
+
+  for (guint32 i = 0; i < n_layers; i++)
+    if (g_str_equal (layers[i].layerName, name))
+      return TRUE;
+
+  return FALSE;
+}
+
+static int
+rate_physical_device (VkPhysicalDevice physical_device,
+                      guint32 *queue_family)
+{
+  VkPhysicalDeviceProperties properties = { 0 };
+  g_autofree VkQueueFamilyProperties *families = NULL;
+  guint32 n_families = 0;
+
+  vkGetPhysicalDeviceProperties (physical_device, &properties);
+  if (properties.apiVersion < VK_API_VERSION_1_2)
+    return -1;
+
+  vkGetPhysicalDeviceQueueFamilyProperties (physical_device, &n_families, NULL);
+  families = g_new0 (VkQueueFamilyProperties, MAX (n_families, 1));
+  vkGetPhysicalDeviceQueueFamilyProperties (physical_device, &n_families, families);
+
+  for (guint32 i = 0; i < n_families; i++)
+    {
+      if (families[i].queueFlags & VK_QUEUE_GRAPHICS_BIT)
+        {
+          *queue_family = i;
+
+          switch (properties.deviceType)
+            {
+            case VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU:
+              return 4;
+            case VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU:
+              return 3;
+            case VK_PHYSICAL_DEVICE_TYPE_VIRTUAL_GPU:
+              return 2;
+            case VK_PHYSICAL_DEVICE_TYPE_CPU:
+              return 1;
+            case VK_PHYSICAL_DEVICE_TYPE_OTHER:
+            case VK_PHYSICAL_DEVICE_TYPE_MAX_ENUM:
+            default:
+              return 0;
+            }
+        }
+    }
+
+  return -1;
+}
+
+static void clear_gpu (CgGpu *self);
+static void record_job (gpointer job_data,
+                        gpointer user_data);
+
+static CgGpu *
+gpu_new (guint32 flags,
+         gpointer extra_data,
+         GError **error)
+{
+  g_autoptr (CgGpu) gpu = NULL;
+  CgvGpu *vk_gpu = NULL;
+  const char *validation_layer = "VK_LAYER_KHRONOS_validation";
+  VkApplicationInfo app_info = { 0 };
+  VkInstanceCreateInfo instance_info = { 0 };
+  g_autofree VkPhysicalDevice *physical_devices = NULL;
+  guint32 n_physical_devices = 0;
+  int best_rating = -1;
+  VkPhysicalDeviceVulkan12Features features_12 = { 0 };
+  VkPhysicalDeviceFeatures2 features = { 0 };
+  VkPhysicalDeviceVulkan12Features enable_12 = { 0 };
+  VkPhysicalDeviceFeatures enable = { 0 };
+  float priority = 1.0f;
+  VkDeviceQueueCreateInfo queue_info = { 0 };
+  VkDeviceCreateInfo device_info = { 0 };
+  g_autofree VkQueueFamilyProperties *families = NULL;
+  guint32 n_families = 0;
+  VkSemaphoreTypeCreateInfo timeline_type = { 0 };
+  VkSemaphoreCreateInfo timeline_info = { 0 };
+  VkCommandPoolCreateInfo pool_info = { 0 };
+  VkPipelineCacheCreateInfo cache_info = { 0 };
+  VkResult result = VK_SUCCESS;
+
+  gpu = (CgGpu *)CG_PRIV_CREATE (vk_gpu);
+  gpu->impl = &cg_vk_impl;
+  vk_gpu = (CgvGpu *)gpu;
+  g_atomic_ref_count_init (&vk_gpu->refcount);
+
+  g_mutex_init (&vk_gpu->queue_lock);
+  g_mutex_init (&vk_gpu->objects_lock);
+  g_mutex_init (&vk_gpu->cache_lock);
+  g_mutex_init (&vk_gpu->destroyed_lock);
+  vk_gpu->destroyed_objects = g_array_new (FALSE, TRUE, sizeof (DestroyedObject));
+  vk_gpu->render_passes = g_hash_table_new_full (
+      g_bytes_hash, g_bytes_equal, (GDestroyNotify)g_bytes_unref, NULL);
+
+  app_info.sType = VK_STRUCTURE_TYPE_APPLICATION_INFO;
+  app_info.pApplicationName = g_get_prgname ();
+  app_info.pEngineName = "cpc-gpu";
+  app_info.apiVersion = VK_API_VERSION_1_2;
+
+  instance_info.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
+  instance_info.pApplicationInfo = &app_info;
+  if ((flags & CG_INIT_FLAG_USE_DEBUG_LAYERS) && has_layer (validation_layer))
+    {
+      instance_info.enabledLayerCount = 1;
+      instance_info.ppEnabledLayerNames = &validation_layer;
+    }
+
+  result = vkCreateInstance (&instance_info, NULL, &vk_gpu->instance);
+  if (result != VK_SUCCESS)
+    {
+      CGV_SET_ERROR (
+          error, CG_ERROR_FAILED_INIT, result,
+          "Failed to create instance");
+      return NULL;
+    }
+
+  vkEnumeratePhysicalDevices (vk_gpu->instance, &n_physical_devices, NULL);
+  physical_devices = g_new0 (VkPhysicalDevice, MAX (n_physical_devices, 1));
+  vkEnumeratePhysicalDevices (vk_gpu->instance, &n_physical_devices, physical_devices);
+
+  for (guint32 i = 0; i < n_physical_devices; i++)
+    {
+      guint32 queue_family = 0;
+      int rating = 0;
+
+      rating = rate_physical_device (physical_devices[i], &queue_family);
+      if (rating > best_rating)
+        {
+          best_rating = rating;
+          vk_gpu->physical_device = physical_devices[i];
+          vk_gpu->queue_family = queue_family;
+        }
+    }
+
+  if (vk_gpu->physical_device == VK_NULL_HANDLE)
+    {
+      CGV_SET_ERROR (
+          error, CG_ERROR_FAILED_INIT, VK_ERROR_INCOMPATIBLE_DRIVER,
+          "No Vulkan 1.2 device with a graphics queue");
+      return NULL;
+    }
+
+  vkGetPhysicalDeviceProperties (vk_gpu->physical_device, &vk_gpu->properties);
+  vkGetPhysicalDeviceMemoryProperties (vk_gpu->physical_device, &vk_gpu->memory_properties);
+  g_debug ("VK: Using device %s", vk_gpu->properties.deviceName);
+
+  vkGetPhysicalDeviceQueueFamilyProperties (vk_gpu->physical_device, &n_families, NULL);
+  families = g_new0 (VkQueueFamilyProperties, MAX (n_families, 1));
+  vkGetPhysicalDeviceQueueFamilyProperties (vk_gpu->physical_device, &n_families, families);
+  vk_gpu->timestamp_bits = families[vk_gpu->queue_family].timestampValidBits;
+
+  features_12.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+  features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+  features.pNext = &features_12;
+  vkGetPhysicalDeviceFeatures2 (vk_gpu->physical_device, &features);
+
+  if (!features_12.timelineSemaphore)
+    {
+      CGV_SET_ERROR (
+          error, CG_ERROR_FAILED_INIT, VK_ERROR_FEATURE_NOT_PRESENT,
+          "Device does not support timeline semaphores");
+      return NULL;
+    }
+
+  enable_12.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+  enable_12.timelineSemaphore = VK_TRUE;
+  enable.dualSrcBlend = features.features.dualSrcBlend;
+  enable.independentBlend = features.features.independentBlend;
+  vk_gpu->dual_source_blend = features.features.dualSrcBlend;
+
+  queue_info.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
+  queue_info.queueFamilyIndex = vk_gpu->queue_family;
+  queue_info.queueCount = 1;
+  queue_info.pQueuePriorities = &priority;
+
+  device_info.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
+  device_info.pNext = &enable_12;
+  device_info.queueCreateInfoCount = 1;
+  device_info.pQueueCreateInfos = &queue_info;
+  device_info.pEnabledFeatures = &enable;
+
+  result = vkCreateDevice (vk_gpu->physical_device, &device_info, NULL, &vk_gpu->device);
+  if (result != VK_SUCCESS)
+    {
+      CGV_SET_ERROR (
+          error, CG_ERROR_FAILED_INIT, result,
+          "Failed to create device");
+      return NULL;
+    }
+  vkGetDeviceQueue (vk_gpu->device, vk_gpu->queue_family, 0, &vk_gpu->queue);
+
+  timeline_type.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO;
+  timeline_type.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+  timeline_type.initialValue = 0;
+  timeline_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+  timeline_info.pNext = &timeline_type;
+
+  result = vkCreateSemaphore (vk_gpu->device, &timeline_info, NULL, &vk_gpu->timeline);
+  if (result != VK_SUCCESS)
+    {
+      CGV_SET_ERROR (
+          error, CG_ERROR_FAILED_INIT, result,
+          "Failed to create timeline semaphore");
+      return NULL;
+    }
+
+  pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+  pool_info.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+  pool_info.queueFamilyIndex = vk_gpu->queue_family;
+
+  result = vkCreateCommandPool (vk_gpu->device, &pool_info, NULL, &vk_gpu->upload_pool);
+  if (result != VK_SUCCESS)
+    {
+      CGV_SET_ERROR (
+          error, CG_ERROR_FAILED_INIT, result,
+          "Failed to create command pool");
+      return NULL;
+    }
+
+  cache_info.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+  result = vkCreatePipelineCache (vk_gpu->device, &cache_info, NULL, &vk_gpu->pipeline_cache);
+  if (result != VK_SUCCESS)
+    {
+      CGV_SET_ERROR (
+          error, CG_ERROR_FAILED_INIT, result,
+          "Failed to create pipeline cache");
+      return NULL;
+    }
+
+  if (!create_sampler (vk_gpu, VK_FILTER_LINEAR, VK_SAMPLER_ADDRESS_MODE_REPEAT,
+                       &vk_gpu->samplers[SAMPLER_LINEAR_REPEAT], error)
+      || !create_sampler (vk_gpu, VK_FILTER_LINEAR, VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+                          &vk_gpu->samplers[SAMPLER_LINEAR_CLAMP], error)
+      || !create_sampler (vk_gpu, VK_FILTER_NEAREST, VK_SAMPLER_ADDRESS_MODE_REPEAT,
+                          &vk_gpu->samplers[SAMPLER_NEAREST_REPEAT], error)
+      || !create_sampler (vk_gpu, VK_FILTER_NEAREST, VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+                          &vk_gpu->samplers[SAMPLER_NEAREST_CLAMP], error))
+    return NULL;
+
+  /* Large plans are recorded on several threads */
+  vk_gpu->recorders = g_thread_pool_new (
+      record_job, NULL, g_get_num_processors (), FALSE, error);
+  if (vk_gpu->recorders == NULL)
+    return NULL;
+
+  return g_steal_pointer (&gpu);
+}
+
+static CgGpu *
+gpu_ref (CgGpu *self)
+{
+  CgvGpu *vk_gpu = (CgvGpu *)self;
+
+  g_atomic_ref_count_inc (&vk_gpu->refcount);
+  return self;
+}
+
+static void
+clear_render_pass (gpointer key,
+                   gpointer value,
+                   gpointer user_data)
+{
+  vkDestroyRenderPass (user_data, value, NULL);
+}
+
+static void
+clear_gpu (CgGpu *self)
+{
+  CgvGpu *vk_gpu = (CgvGpu *)self;
+
+  if (vk_gpu->recorders != NULL)
+    g_thread_pool_free (g_steal_pointer (&vk_gpu->recorders), FALSE, TRUE);
+
+  if (vk_gpu->device != VK_NULL_HANDLE)
+    {
+      vkDeviceWaitIdle (vk_gpu->device);
+      collect_destroyed_objects (vk_gpu, TRUE);
+
+      g_hash_table_foreach (vk_gpu->render_passes, clear_render_pass, vk_gpu->device);
+      for (guint i = 0; i < N_SAMPLERS; i++)
+        if (vk_gpu->samplers[i] != VK_NULL_HANDLE)
+          vkDestroySampler (vk_gpu->device, vk_gpu->samplers[i], NULL);
+      if (vk_gpu->pipeline_cache != VK_NULL_HANDLE)
+        vkDestroyPipelineCache (vk_gpu->device, vk_gpu->pipeline_cache, NULL);
+      if (vk_gpu->upload_pool != VK_NULL_HANDLE)
+        vkDestroyCommandPool (vk_gpu->device, vk_gpu->upload_pool, NULL);
+      if (vk_gpu->timeline != VK_NULL_HANDLE)
+        vkDestroySemaphore (vk_gpu->device, vk_gpu->timeline, NULL);
+      vkDestroyDevice (vk_gpu->device, NULL);
+    }
+  if (vk_gpu->instance != VK_NULL_HANDLE)
+    vkDestroyInstance (vk_gpu->instance, NULL);
+
+  g_clear_pointer (&vk_gpu->render_passes, g_hash_table_unref);
+  g_clear_pointer (&vk_gpu->destroyed_objects, g_array_unref);
+  g_mutex_clear (&vk_gpu->queue_lock);
+  g_mutex_clear (&vk_gpu->objects_lock);
+  g_mutex_clear (&vk_gpu->cache_lock);
+  g_mutex_clear (&vk_gpu->destroyed_lock);
+}
+
+static void
+gpu_unref (CgGpu *self)
+{
+  CgvGpu *vk_gpu = (CgvGpu *)self;
+
+  if (g_atomic_ref_count_dec (&vk_gpu->refcount))
+    {
+      clear_gpu (self);
+      g_free (self);
+    }
+}
+
+static gboolean
+gpu_share (CgGpu *self,
+           CgGpu *share,
+           GError **error)
+{
+  CGV_SET_ERROR (
+      error, CG_ERROR_NOT_SUPPORTED, VK_ERROR_FEATURE_NOT_PRESENT,
+      "Share groups are not supported");
+  return FALSE;
+}
+
+static char *
+gpu_get_info (CgGpu *self,
+              const char *param,
+              GError **error)
+{
+  CgvGpu *vk_gpu = (CgvGpu *)self;
+  guint32 api = vk_gpu->properties.apiVersion;
+
+  if (g_str_equal (param, "vendor"))
+    return g_strdup_printf ("0x%04x", vk_gpu->properties.vendorID);
+  else if (g_str_equal (param, "renderer"))
+    return g_strdup (vk_gpu->properties.deviceName);
+  else if (g_str_equal (param, "version"))
+    return g_strdup_printf (
+        "Vulkan %u.%u.%u",
+        VK_API_VERSION_MAJOR (api),
+        VK_API_VERSION_MINOR (api),
+        VK_API_VERSION_PATCH (api));
+  else if (g_str_equal (param, "driver version"))
+    return g_strdup_printf ("0x%08x", vk_gpu->properties.driverVersion);
+
+  return NULL;
+}
+
+static gboolean
+gpu_flush (CgGpu *self,
+           GError **error)
+{
+  collect_destroyed_objects ((CgvGpu *)self, FALSE);
+  return TRUE;
+}
+
+static void
+init_plan (CgPlan *self)
+{
+}
+
+static void
+clear_plan (CgPlan *self)
+{
+  cg_priv_plan_finish (self);
+}
+
+static void
+init_shader (CgShader *self)
+{
+}
+
+static void
+clear_shader (CgShader *self)
+{
+  CgvShader *vk_shader = (CgvShader *)self;
+  DestroyedObject object = { 0 };
+
+  if (vk_shader->pipelines != NULL)
+    {
+      GHashTableIter iter = { 0 };
+      gpointer pipeline = NULL;
+
+      g_hash_table_iter_init (&iter, vk_shader->pipelines);
+      while (g_hash_table_iter_next (&iter, NULL, &pipeline))
+        {
+          DestroyedObject pipeline_object = { 0 };
+
+          pipeline_object.pipeline = pipeline;
+          destroy_later (self->gpu, &pipeline_object);
+        }
+      g_clear_pointer (&vk_shader->pipelines, g_hash_table_unref);
+    }
+
+  object.modules[0] = vk_shader->modules[0];
+  object.modules[1] = vk_shader->modules[1];
+  object.layout = vk_shader->layout;
+  object.set_layout = vk_shader->set_layout;
+  destroy_later (self->gpu, &object);
+
+  g_clear_pointer (&vk_shader->slots, g_hash_table_unref);
+  g_clear_pointer (&vk_shader->bindings, g_array_unref);
+  g_clear_pointer (&vk_shader->inputs, g_hash_table_unref);
+
+  cg_priv_shader_finish (self);
+}
+
+static void
+init_buffer (CgBuffer *self)
+{
+}
+
+static void
+clear_buffer (CgBuffer *self)
+{
+  CgvBuffer *vk_buffer = (CgvBuffer *)self;
+  DestroyedObject object = { 0 };
+
+  object.buffer = vk_buffer->buffer;
+  object.memory = vk_buffer->memory;
+  destroy_later (self->gpu, &object);
+
+  cg_priv_buffer_finish (self);
+}
+
+static void
+init_texture (CgTexture *self)
+{
+}
+
+static void
+clear_texture (CgTexture *self)
+{
+  CgvTexture *vk_texture = (CgvTexture *)self;
+  DestroyedObject object = { 0 };
+
+  object.views[0] = vk_texture->view;
+  object.views[1] = vk_texture->attachment_view;
+  object.image = vk_texture->image;
+  object.memory = vk_texture->memory;
+  destroy_later (self->gpu, &object);
+
+  g_clear_pointer (&vk_texture->non_msaa, cg_texture_unref);
+
+  cg_priv_texture_finish (self);
+}
+
+static void
+init_commands (CgCommands *self)
+{
+  CgvCommands *vk_commands = (CgvCommands *)self;
+
+  vk_commands->command_pools = g_array_new (FALSE, TRUE, sizeof (VkCommandPool));
+  vk_commands->descriptor_pools = g_array_new (FALSE, TRUE, sizeof (VkDescriptorPool));
+  vk_commands->framebuffers = g_array_new (FALSE, TRUE, sizeof (VkFramebuffer));
+}
+
+static void
+clear_commands (CgCommands *self)
+{
+  CgvCommands *vk_commands = (CgvCommands *)self;
+  DestroyedObject object = { 0 };
+
+  /* Destroying a pool frees its command buffers */
+  for (guint i = 0; i < vk_commands->command_pools->len; i++)
+    {
+      memset (&object, 0, sizeof (object));
+      object.command_pool = g_array_index (vk_commands->command_pools, VkCommandPool, i);
+      destroy_later (self->gpu, &object);
+    }
+  for (guint i = 0; i < vk_commands->descriptor_pools->len; i++)
+    {
+      memset (&object, 0, sizeof (object));
+      object.descriptor_pool = g_array_index (vk_commands->descriptor_pools, VkDescriptorPool, i);
+      destroy_later (self->gpu, &object);
+    }
+  for (guint i = 0; i < vk_commands->framebuffers->len; i++)
+    {
+      memset (&object, 0, sizeof (object));
+      object.framebuffer = g_array_index (vk_commands->framebuffers, VkFramebuffer, i);
+      destroy_later (self->gpu, &object);
+    }
+
+  memset (&object, 0, sizeof (object));
+  object.buffer = vk_commands->arena;
+  object.memory = vk_commands->arena_memory;
+  destroy_later (self->gpu, &object);
+
+  g_clear_pointer (&vk_commands->command_pools, g_array_unref);
+  g_clear_pointer (&vk_commands->descriptor_pools, g_array_unref);
+  g_clear_pointer (&vk_commands->framebuffers, g_array_unref);
+  g_clear_pointer (&vk_commands->nodes, g_array_unref);
+
+  cg_priv_commands_finish (self);
+}
+
+#define DEFINE_BASIC_OBJECT(name, type, parent_type)        \
+  static parent_type *                                      \
+      name##_new (CgGpu *self)                              \
+  {                                                         \
+    parent_type *obj = (parent_type *)g_new0 (type, 1);     \
+    g_atomic_ref_count_init (&((type *)obj)->refcount);     \
+    init_##name (obj);                                      \
+    return obj;                                             \
+  }                                                         \
+  static parent_type *                                      \
+      name##_ref (parent_type *self)                        \
+  {                                                         \
+    g_atomic_ref_count_inc (&((type *)self)->refcount);     \
+    return self;                                            \
+  }                                                         \
+  static inline void                                        \
+      destroy_##name (parent_type *self)                    \
+  {                                                         \
+    clear_##name (self);                                    \
+    g_free (self);                                          \
+  }                                                         \
+  static void                                               \
+      name##_unref (parent_type *self)                      \
+  {                                                         \
+    if (g_atomic_ref_count_dec (&((type *)self)->refcount)) \
+      destroy_##name (self);                                \
+  }
+
+DEFINE_BASIC_OBJECT (plan, CgvPlan, CgPlan)
+DEFINE_BASIC_OBJECT (shader, CgvShader, CgShader)
+DEFINE_BASIC_OBJECT (buffer, CgvBuffer, CgBuffer)
+DEFINE_BASIC_OBJECT (texture, CgvTexture, CgTexture)
+DEFINE_BASIC_OBJECT (commands, CgvCommands, CgCommands)
+
+#undef DEFINE_BASIC_OBJECT
+
+static void
+timer_free (CgGpu *self,
+            gpointer timer)
+{
+  CgvTimer *vk_timer = timer;
+  DestroyedObject object = { 0 };
+
+  object.query_pool = vk_timer->pool;
+  object.command_pool = vk_timer->command_pool;
+  destroy_later (self, &object);
+
+  g_free (vk_timer->begin);
+  g_free (vk_timer->end);
+  g_free (vk_timer);
+}
+
+static gpointer
+timer_new (CgGpu *self,
+           guint n_queries,
+           GError **error)
+{
+  CgvGpu *vk_gpu = (CgvGpu *)self;
+  CgvTimer *timer = NULL;
+  VkQueryPoolCreateInfo pool_info = { 0 };
+  VkCommandPoolCreateInfo command_pool_info = { 0 };
+  VkCommandBufferAllocateInfo allocate_info = { 0 };
+  VkCommandBufferBeginInfo begin_info = { 0 };
+  VkResult result = VK_SUCCESS;
+
+  if (vk_gpu->timestamp_bits == 0)
+    {
+      CGV_SET_ERROR (
+          error, CG_ERROR_NOT_SUPPORTED, VK_ERROR_FEATURE_NOT_PRESENT,
+          "Timestamp queries are not supported");
+      return NULL;
+    }
+
+  timer = CG_PRIV_CREATE (timer);
+  timer->n_queries = n_queries;
+  timer->begin = g_new0 (VkCommandBuffer, n_queries);
+  timer->end = g_new0 (VkCommandBuffer, n_queries);
+
+  pool_info.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+  pool_info.queryType = VK_QUERY_TYPE_TIMESTAMP;
+  pool_info.queryCount = n_queries * 2;
+
+  result = vkCreateQueryPool (vk_gpu->device, &pool_info, NULL, &timer->pool);
+  if (result != VK_SUCCESS)
+    {
+      CGV_SET_ERROR (
+          error, CG_ERROR_NOT_SUPPORTED, result,
+          "Failed to create timestamp queries");
+      timer_free (self, timer);
+      return NULL;
+    }
+
+  command_pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+  command_pool_info.queueFamilyIndex = vk_gpu->queue_family;
+
+  result = vkCreateCommandPool (vk_gpu->device, &command_pool_info, NULL, &timer->command_pool);
+  if (result != VK_SUCCESS)
+    {
+      CGV_SET_ERROR (
+          error, CG_ERROR_NOT_SUPPORTED, result,
+          "Failed to create command pool");
+      timer_free (self, timer);
+      return NULL;
+    }
+
+  allocate_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+  allocate_info.commandPool = timer->command_pool;
+  allocate_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+  allocate_info.commandBufferCount = n_queries;
+
+  if (vkAllocateCommandBuffers (vk_gpu->device, &allocate_info, timer->begin) != VK_SUCCESS
+      || vkAllocateCommandBuffers (vk_gpu->device, &allocate_info, timer->end) != VK_SUCCESS)
+    {
+      CGV_SET_ERROR (
+          error, CG_ERROR_NOT_SUPPORTED, VK_ERROR_OUT_OF_HOST_MEMORY,
+          "Failed to allocate command buffers");
+      timer_free (self, timer);
+      return NULL;
+    }
+
+  begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+  begin_info.flags = VK_COMMAND_BUFFER_USAGE_SIMULTANEOUS_USE_BIT;
+
+  for (guint i = 0; i < n_queries && result == VK_SUCCESS; i++)
+    {
+      result = vkBeginCommandBuffer (timer->begin[i], &begin_info);
+      if (result == VK_SUCCESS)
+        {
+          vkCmdResetQueryPool (timer->begin[i], timer->pool, i * 2, 2);
+          vkCmdWriteTimestamp (timer->begin[i], VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, timer->pool, i * 2);
+          result = vkEndCommandBuffer (timer->begin[i]);
+        }
+
+      if (result == VK_SUCCESS)
+        result = vkBeginCommandBuffer (timer->end[i], &begin_info);
+      if (result == VK_SUCCESS)
+        {
+          vkCmdWriteTimestamp (timer->end[i], VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, timer->pool, i * 2 + 1);
+          result = vkEndCommandBuffer (timer->end[i]);
+        }
+    }
+
+  if (result != VK_SUCCESS)
+    {
+      CGV_SET_ERROR (
+          error, CG_ERROR_NOT_SUPPORTED, result,
+          "Failed to record timestamp queries");
+      timer_free (self, timer);
+      return NULL;
+    }
+
+  return timer;
+}
+
+static gboolean
+timer_begin (CgGpu *self,
+             gpointer timer)
+{
+  CgvGpu *vk_gpu = (CgvGpu *)self;
+  CgvTimer *vk_timer = timer;
+  gboolean success = FALSE;
+
+  /* Every query is still in flight, skip this one */
+  if (vk_timer->n_pending == vk_timer->n_queries)
+    return FALSE;
+
+  g_mutex_lock (&vk_gpu->queue_lock);
+  success = submit_locked (vk_gpu, vk_timer->begin[vk_timer->head], NULL, NULL);
+  g_mutex_unlock (&vk_gpu->queue_lock);
+
+  return success;
+}
+
+static void
+timer_end (CgGpu *self,
+           gpointer timer)
+{
+  CgvGpu *vk_gpu = (CgvGpu *)self;
+  CgvTimer *vk_timer = timer;
+
+  g_mutex_lock (&vk_gpu->queue_lock);
+  submit_locked (vk_gpu, vk_timer->end[vk_timer->head], NULL, NULL);
+  g_mutex_unlock (&vk_gpu->queue_lock);
+
+  vk_timer->head = (vk_timer->head + 1) % vk_timer->n_queries;
+  vk_timer->n_pending++;
+}
+
+static gboolean
+timer_collect (CgGpu *self,
+               gpointer timer,
+               guint64 *nanoseconds)
+{
+  CgvGpu *vk_gpu = (CgvGpu *)self;
+  CgvTimer *vk_timer = timer;
+  guint query = 0;
+  guint64 results[2] = { 0 };
+  VkResult result = VK_SUCCESS;
+
+  if (vk_timer->n_pending == 0)
+    return FALSE;
+
+  query = (vk_timer->head + vk_timer->n_queries - vk_timer->n_pending) % vk_timer->n_queries;
+
+  result = vkGetQueryPoolResults (
+      vk_gpu->device, vk_timer->pool, query * 2, 2,
+      sizeof (results), results, sizeof (guint64),
+      VK_QUERY_RESULT_64_BIT);
+  if (result != VK_SUCCESS)
+    return FALSE;
+
+  vk_timer->n_pending--;
+
+  *nanoseconds = (guint64)((double)(results[1] - results[0])
+                           * vk_gpu->properties.limits.timestampPeriod);
+  return TRUE;
+}
+
+/* Fences are points on the timeline semaphore */
+static gpointer
+fence_new (CgGpu *self,
+           GError **error)
+{
+  CgvGpu *vk_gpu = (CgvGpu *)self;
+  guint64 *serial = NULL;
+
+  serial = g_new0 (guint64, 1);
+
+  g_mutex_lock (&vk_gpu->queue_lock);
+  *serial = vk_gpu->submitted;
+  g_mutex_unlock (&vk_gpu->queue_lock);
+
+  return serial;
+}
+
+static void
+fence_free (CgGpu *self,
+            gpointer fence)
+{
+  g_free (fence);
+}
+
+static void
+fence_wait (CgGpu *self,
+            gpointer fence)
+{
+  /* There is only one queue, which executes in order */
+}
+
+static gboolean
+fence_client_wait (CgGpu *self,
+                   gpointer fence,
+                   guint64 timeout,
+                   GError **error)
+{
+  gboolean reached = FALSE;
+
+  if (!wait_for_serial ((CgvGpu *)self, *(guint64 *)fence, timeout, &reached, error))
+    return FALSE;
+
+  return reached;
+}
+
+static gboolean
+create_shader_module (CgvGpu *vk_gpu,
+                      GBytes *spirv,
+                      VkShaderModule *module,
+                      GError **error)
+{
+  VkShaderModuleCreateInfo create_info = { 0 };
+  gsize size = 0;
+  VkResult result = VK_SUCCESS;
+
+  create_info.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+  create_info.pCode = g_bytes_get_data (spirv, &size);
+  create_info.codeSize = size;
+
+  result = vkCreateShaderModule (vk_gpu->device, &create_info, NULL, module);
+  if (result != VK_SUCCESS)
+    {
+      CGV_SET_ERROR (
+          error, CG_ERROR_FAILED_SHADER_GEN, result,
+          "Failed to create shader module");
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static void
+insert_slot (CgvShader *self,
+             const char *name,
+             const CgvSlot *slot)
+{
+  /* Both stages may declare the same resource */
+  if (name == NULL || *name == '\0'
+      || g_hash_table_contains (self->slots, name))
+    return;
+
+  g_hash_table_insert (self->slots, g_strdup (name), g_memdup2 (slot, sizeof (*slot)));
+}
+
+static gboolean
+add_reflection (CgvShader *self,
+                CgPrivSpirvReflection *reflection,
+                VkShaderStageFlags stage,
+                GError **error)
+{
+  for (guint i = 0; i < reflection->resources->len; i++)
+    {
+      CgPrivSpirvResource *resource = &g_array_index (reflection->resources, CgPrivSpirvResource, i);
+      CgvSlot slot = { 0 };
+      CgvBinding *binding = NULL;
+
+      if (resource->kind == CG_PRIV_SPIRV_PUSH_CONSTANTS)
+        {
+          self->push_size = MAX (self->push_size, resource->size);
+          self->push_stages |= stage;
+
+          for (guint j = 0; j < resource->members->len; j++)
+            {
+              CgPrivSpirvMember *member = &g_array_index (resource->members, CgPrivSpirvMember, j);
+
+              slot.kind = SLOT_VALUE;
+              slot.type = member->type;
+              slot.offset = member->offset;
+              slot.push = TRUE;
+              insert_slot (self, member->name, &slot);
+            }
+          continue;
+        }
+
+      if (resource->set != 0)
+        {
+          CGV_SET_ERROR (
+              error, CG_ERROR_NOT_SUPPORTED, VK_ERROR_FEATURE_NOT_PRESENT,
+              "Only descriptor set 0 is supported, but \"%s\" is in set %u",
+              resource->name, resource->set);
+          return FALSE;
+        }
+
+      for (guint j = 0; j < self->bindings->len; j++)
+        {
+          if (g_array_index (self->bindings, CgvBinding, j).binding == resource->binding)
+            {
+              binding = &g_array_index (self->bindings, CgvBinding, j);
+              break;
+            }
+        }
+      if (binding == NULL)
+        {
+          CgvBinding new_binding = { 0 };
+
+          new_binding.binding = resource->binding;
+          new_binding.kind = resource->kind == CG_PRIV_SPIRV_SAMPLER ? SLOT_SAMPLER : SLOT_BLOCK;
+          new_binding.size = resource->size;
+          g_array_append_val (self->bindings, new_binding);
+          binding = &g_array_index (self->bindings, CgvBinding, self->bindings->len - 1);
+        }
+      binding->stages |= stage;
+
+      slot.binding = resource->binding;
+      if (resource->kind == CG_PRIV_SPIRV_SAMPLER)
+        {
+          slot.kind = SLOT_SAMPLER;
+          slot.type = CG_TYPE_TEXTURE;
+          slot.cubemap = resource->cubemap;
+          insert_slot (self, resource->name, &slot);
+        }
+      else
+        {
+          /* A block is bound to a buffer by either name */
+          slot.kind = SLOT_BLOCK;
+          slot.type = CG_TYPE_BUFFER;
+          insert_slot (self, resource->name, &slot);
+          insert_slot (self, resource->block_name, &slot);
+
+          for (guint j = 0; j < resource->members->len; j++)
+            {
+              CgPrivSpirvMember *member = &g_array_index (resource->members, CgPrivSpirvMember, j);
+
+              slot.kind = SLOT_VALUE;
+              slot.type = member->type;
+              slot.offset = member->offset;
+              insert_slot (self, member->name, &slot);
+            }
+        }
+    }
+
+  for (guint i = 0; i < reflection->inputs->len; i++)
+    {
+      CgPrivSpirvInput *input = &g_array_index (reflection->inputs, CgPrivSpirvInput, i);
+
+      g_hash_table_insert (self->inputs, g_strdup (input->name),
+                           GUINT_TO_POINTER (input->location + 1));
+    }
+
+  return TRUE;
+}
+
+static gboolean
+ensure_shader (CgShader *self,
+               GError **error)
+{
+  CgvShader *vk_shader = (CgvShader *)self;
+  CgvGpu *vk_gpu = (CgvGpu *)self->gpu;
+  CgPrivSpirvReflection reflections[2] = { 0 };
+  g_autofree VkDescriptorSetLayoutBinding *bindings = NULL;
+  VkDescriptorSetLayoutCreateInfo set_layout_info = { 0 };
+  VkPushConstantRange push_range = { 0 };
+  VkPipelineLayoutCreateInfo layout_info = { 0 };
+  gboolean success = FALSE;
+  VkResult result = VK_SUCCESS;
+
+  if (vk_shader->layout != VK_NULL_HANDLE)
+    return TRUE;
+
+  if (self->init.vertex_spirv == NULL)
+    {
+      CGV_SET_ERROR (
+          error, CG_ERROR_NOT_SUPPORTED, VK_ERROR_FEATURE_NOT_PRESENT,
+          "Only SPIR-V shaders are supported, "
+          "use cg_shader_new_for_spirv ()");
+      return FALSE;
+    }
+
+  vk_shader->slots = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  vk_shader->bindings = g_array_new (FALSE, TRUE, sizeof (CgvBinding));
+  vk_shader->inputs = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  vk_shader->pipelines = g_hash_table_new_full (
+      g_bytes_hash, g_bytes_equal, (GDestroyNotify)g_bytes_unref, NULL);
+
+  success = cg_priv_spirv_reflect (self->init.vertex_spirv, TRUE, &reflections[0], error)
+            && cg_priv_spirv_reflect (self->init.fragment_spirv, FALSE, &reflections[1], error)
+            && add_reflection (vk_shader, &reflections[0], VK_SHADER_STAGE_VERTEX_BIT, error)
+            && add_reflection (vk_shader, &reflections[1], VK_SHADER_STAGE_FRAGMENT_BIT, error)
+            && create_shader_module (vk_gpu, self->init.vertex_spirv, &vk_shader->modules[0], error)
+            && create_shader_module (vk_gpu, self->init.fragment_spirv, &vk_shader->modules[1], error);
+
+  cg_priv_spirv_reflection_clear (&reflections[0]);
+  cg_priv_spirv_reflection_clear (&reflections[1]);
+  if (!success)
+    return FALSE;
+
+  bindings = g_new0 (VkDescriptorSetLayoutBinding, MAX (vk_shader->bindings->len, 1));
+  for (guint i = 0; i < vk_shader->bindings->len; i++)
+    {
+      CgvBinding *binding = &g_array_index (vk_shader->bindings, CgvBinding, i);
+
+      bindings[i].binding = binding->binding;
+      bindings[i].descriptorType = binding->kind == SLOT_SAMPLER
+                                       ? VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER
+                                       : VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+      bindings[i].descriptorCount = 1;
+      bindings[i].stageFlags = binding->stages;
+    }
+
+  set_layout_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+  set_layout_info.bindingCount = vk_shader->bindings->len;
+  set_layout_info.pBindings = bindings;
+
+  result = vkCreateDescriptorSetLayout (vk_gpu->device, &set_layout_info, NULL, &vk_shader->set_layout);
+  if (result != VK_SUCCESS)
+    {
+      CGV_SET_ERROR (
+          error, CG_ERROR_FAILED_SHADER_GEN, result,
+          "Failed to create descriptor set layout");
+      return FALSE;
+    }
+
+  vk_shader->push_size = (vk_shader->push_size + 3) & ~3u;
+  push_range.stageFlags = vk_shader->push_stages;
+  push_range.size = vk_shader->push_size;
+
+  layout_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+  layout_info.setLayoutCount = 1;
+  layout_info.pSetLayouts = &vk_shader->set_layout;
+  if (vk_shader->push_size > 0)
+    {
+      layout_info.pushConstantRangeCount = 1;
+      layout_info.pPushConstantRanges = &push_range;
+    }
+
+  result = vkCreatePipelineLayout (vk_gpu->device, &layout_info, NULL, &vk_shader->layout);
+  if (result != VK_SUCCESS)
+    {
+      CGV_SET_ERROR (
+          error, CG_ERROR_FAILED_SHADER_GEN, result,
+          "Failed to create pipeline layout");
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static const char *buffer_usage_names[] = {
+  [BUFFER_NONE] = "nothing",
+  [BUFFER_VERTICES] = "a vertex buffer",
+  [BUFFER_UNIFORMS] = "a uniform buffer",
+  [BUFFER_INDICES] = "an index buffer",
+};
+
+static gboolean
+ensure_buffer_usage (CgBuffer *self,
+                     int usage,
+                     GError **error)
+{
+  CgvBuffer *vk_buffer = (CgvBuffer *)self;
+  g_autofree guint16 *converted = NULL;
+  gconstpointer data = NULL;
+  gsize size = 0;
+
+  if (vk_buffer->usage == usage)
+    return TRUE;
+  if (vk_buffer->usage != BUFFER_NONE
+      || (self->index_format != 0) != (usage == BUFFER_INDICES))
+    {
+      CGV_CRITICAL_USER_ERROR (
+          "Buffer previously initialized as %s "
+          "erroneously being used as %s",
+          self->index_format != 0
+              ? buffer_usage_names[BUFFER_INDICES]
+              : buffer_usage_names[vk_buffer->usage],
+          buffer_usage_names[usage]);
+      return FALSE;
+    }
+  if (usage == BUFFER_VERTICES && self->spec == NULL)
+    {
+      CGV_CRITICAL_USER_ERROR (
+          "Buffer needs a layout specification "
+          "to be used as an attribute");
+      return FALSE;
+    }
+
+  data = self->init.data;
+  size = self->init.size;
+
+  if (usage == BUFFER_INDICES)
+    {
+      switch (self->index_format)
+        {
+        case CG_COMPONENT_UINT8:
+          /* 8-bit indices need an extension, so widen them,
+           * keeping the restart index a restart index */
+          converted = g_new (guint16, MAX (size, 1));
+          for (gsize i = 0; i < size; i++)
+            {
+              guint8 index = ((const guint8 *)self->init.data)[i];
+              converted[i] = index == G_MAXUINT8 ? G_MAXUINT16 : index;
+            }
+          data = converted;
+          size *= sizeof (guint16);
+          vk_buffer->index_type = VK_INDEX_TYPE_UINT16;
+          vk_buffer->length = self->init.size;
+          break;
+        case CG_COMPONENT_UINT16:
+          vk_buffer->index_type = VK_INDEX_TYPE_UINT16;
+          vk_buffer->length = size / sizeof (guint16);
+          break;
+        case CG_COMPONENT_UINT32:
+          vk_buffer->index_type = VK_INDEX_TYPE_UINT32;
+          vk_buffer->length = size / sizeof (guint32);
+          break;
+        default:
+          g_assert_not_reached ();
+        }
+    }
+
+  if (!create_buffer (
+          (CgvGpu *)self->gpu, size,
+          VK_BUFFER_USAGE_VERTEX_BUFFER_BIT
+              | VK_BUFFER_USAGE_INDEX_BUFFER_BIT
+              | VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
+          data, &vk_buffer->buffer, &vk_buffer->memory, error))
+    return FALSE;
+
+  vk_buffer->usage = usage;
+  return TRUE;
+}
+
+typedef struct
+{
+  VkFormat format;
+  gsize host_size;
+  gsize device_size;
+} TextureFormat;
+
+static const TextureFormat texture_formats[CG_N_FORMATS] = {
+  [CG_FORMAT_R8] = { VK_FORMAT_R8_UNORM, 1, 1 },
+  [CG_FORMAT_RA8] = { VK_FORMAT_R8G8_UNORM, 2, 2 },
+  /* Three channel formats are rarely renderable,
+   * so they are stored with an opaque alpha */
+  [CG_FORMAT_RGB8] = { VK_FORMAT_R8G8B8A8_UNORM, 3, 4 },
+  [CG_FORMAT_RGBA8] = { VK_FORMAT_R8G8B8A8_UNORM, 4, 4 },
+  [CG_FORMAT_R32] = { VK_FORMAT_R32_SFLOAT, 4, 4 },
+  [CG_FORMAT_RGB32] = { VK_FORMAT_R32G32B32A32_SFLOAT, 12, 16 },
+  [CG_FORMAT_RGBA32] = { VK_FORMAT_R32G32B32A32_SFLOAT, 16, 16 },
+};
+/* Stencil is not implemented, so there is no D24S8 */
+static const TextureFormat depth_formats[CG_N_DEPTH_FORMATS] = {
+  [CG_DEPTH_FORMAT_0] = { VK_FORMAT_D32_SFLOAT, 4, 4 },
+  [CG_DEPTH_FORMAT_D16] = { VK_FORMAT_D16_UNORM, 2, 2 },
+  [CG_DEPTH_FORMAT_D32F] = { VK_FORMAT_D32_SFLOAT, 4, 4 },
+};
+
+static inline const TextureFormat *
+get_texture_format (int format)
+{
+  return format == CG_PRIV_FORMAT_DEPTH ? &depth_formats[CG_DEPTH_FORMAT_0] : &texture_formats[format];
+}
+
+/* Converts between the layout of the user's pixels
+ * and the layout of the image in memory */
+static void
+convert_pixels (int format,
+                gconstpointer src,
+                gpointer dest,
+                gsize n_pixels,
+                gboolean upload)
+{
+  const TextureFormat *info = get_texture_format (format);
+  const guchar *in = src;
+  guchar *out = dest;
+
+  if (info->host_size == info->device_size)
+    {
+      memcpy (dest, src, n_pixels * info->host_size);
+      return;
+    }
+
+  for (gsize i = 0; i < n_pixels; i++)
+    {
+      if (upload)
+        {
+          memcpy (out + i * info->device_size, in + i * info->host_size, info->host_size);
+          if (format == CG_FORMAT_RGB8)
+            out[i * info->device_size + 3] = G_MAXUINT8;
+          else
+            {
+              float one = 1.0f;
+              memcpy (out + i * info->device_size + info->host_size, &one, sizeof (one));
+            }
+        }
+      else
+        memcpy (out + i * info->host_size, in + i * info->device_size, info->host_size);
+    }
+}
+
+static void
+image_barrier (VkCommandBuffer command_buffer,
+               CgvTexture *texture,
+               guint base_level,
+               guint n_levels,
+               VkImageLayout old_layout,
+               VkImageLayout new_layout)
+{
+  VkImageMemoryBarrier barrier = { 0 };
+
+  barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+  barrier.srcAccessMask = VK_ACCESS_MEMORY_WRITE_BIT;
+  barrier.dstAccessMask = VK_ACCESS_MEMORY_READ_BIT | VK_ACCESS_MEMORY_WRITE_BIT;
+  barrier.oldLayout = old_layout;
+  barrier.newLayout = new_layout;
+  barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.image = texture->image;
+  barrier.subresourceRange.aspectMask = texture->aspect;
+  barrier.subresourceRange.baseMipLevel = base_level;
+  barrier.subresourceRange.levelCount = n_levels;
+  barrier.subresourceRange.layerCount = texture->layers;
+
+  vkCmdPipelineBarrier (
+      command_buffer,
+      VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
+      VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
+      0, 0, NULL, 0, NULL, 1, &barrier);
+}
+
+/* Expects every level to be in TRANSFER_DST_OPTIMAL
+ * and leaves them all in the texture's layout */
+static void
+record_mipmaps (VkCommandBuffer command_buffer,
+                CgvTexture *texture,
+                gboolean linear)
+{
+  int width = texture->base.init.width;
+  int height = texture->base.init.height;
+
+  for (guint i = 1; i < texture->levels; i++)
+    {
+      VkImageBlit region = { 0 };
+
+      image_barrier (command_buffer, texture, i - 1, 1,
+                     VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                     VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL);
+
+      region.srcSubresource.aspectMask = texture->aspect;
+      region.srcSubresource.mipLevel = i - 1;
+      region.srcSubresource.layerCount = texture->layers;
+      region.srcOffsets[1].x = width;
+      region.srcOffsets[1].y = height;
+      region.srcOffsets[1].z = 1;
+
+      width = MAX (width / 2, 1);
+      height = MAX (height / 2, 1);
+
+      region.dstSubresource.aspectMask = texture->aspect;
+      region.dstSubresource.mipLevel = i;
+      region.dstSubresource.layerCount = texture->layers;
+      region.dstOffsets[1].x = width;
+      region.dstOffsets[1].y = height;
+      region.dstOffsets[1].z = 1;
+
+      vkCmdBlitImage (
+          command_buffer,
+          texture->image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+          texture->image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+          1, &region, linear ? VK_FILTER_LINEAR : VK_FILTER_NEAREST);
+
+      image_barrier (command_buffer, texture, i - 1, 1,
+                     VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                     texture->layout);
+    }
+
+  image_barrier (command_buffer, texture, texture->levels - 1, 1,
+                 VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                 texture->layout);
+}
+
+static gboolean
+create_image_view (CgvGpu *vk_gpu,
+                   CgvTexture *texture,
+                   gboolean attachment,
+                   VkImageView *view,
+                   GError **error)
+{
+  VkImageViewCreateInfo create_info = { 0 };
+  VkResult result = VK_SUCCESS;
+
+  create_info.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+  create_info.image = texture->image;
+  create_info.viewType = !attachment && texture->base.init.cubemap
+                             ? VK_IMAGE_VIEW_TYPE_CUBE
+                             : VK_IMAGE_VIEW_TYPE_2D;
+  create_info.format = texture->format;
+  create_info.subresourceRange.aspectMask = texture->aspect;
+  create_info.subresourceRange.levelCount = attachment ? 1 : texture->levels;
+  create_info.subresourceRange.layerCount = attachment ? 1 : texture->layers;
+
+  if (!attachment && texture->base.init.format == CG_FORMAT_R8)
+    {
+      create_info.components.g = VK_COMPONENT_SWIZZLE_R;
+      create_info.components.b = VK_COMPONENT_SWIZZLE_R;
+      create_info.components.a = VK_COMPONENT_SWIZZLE_ONE;
+    }
+  else if (!attachment && texture->base.init.format == CG_FORMAT_RA8)
+    {
+      create_info.components.g = VK_COMPONENT_SWIZZLE_R;
+      create_info.components.b = VK_COMPONENT_SWIZZLE_R;
+      create_info.components.a = VK_COMPONENT_SWIZZLE_G;
+    }
+
+  result = vkCreateImageView (vk_gpu->device, &create_info, NULL, view);
+  if (result != VK_SUCCESS)
+    {
+      CGV_SET_ERROR (
+          error, CG_ERROR_FAILED_TEXTURE_GEN, result,
+          "Failed to create image view");
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static gboolean
+get_sample_count (CgvGpu *vk_gpu,
+                  CgTexture *texture,
+                  VkSampleCountFlagBits *samples,
+                  GError **error)
+{
+  VkSampleCountFlags supported = 0;
+
+  if (texture->init.msaa <= 0)
+    {
+      *samples = VK_SAMPLE_COUNT_1_BIT;
+      return TRUE;
+    }
+
+  supported = texture->init.format == CG_PRIV_FORMAT_DEPTH
+                  ? vk_gpu->properties.limits.framebufferDepthSampleCounts
+                  : vk_gpu->properties.limits.framebufferColorSampleCounts;
+
+  /* The flag bits are the sample counts themselves */
+  if ((texture->init.msaa & (texture->init.msaa - 1)) != 0
+      || (supported & (VkSampleCountFlags)texture->init.msaa) == 0)
+    {
+      CGV_SET_ERROR (
+          error, CG_ERROR_FAILED_TEXTURE_GEN, VK_ERROR_FORMAT_NOT_SUPPORTED,
+          "%d samples per pixel are not supported",
+          texture->init.msaa);
+      return FALSE;
+    }
+
+  *samples = (VkSampleCountFlagBits)texture->init.msaa;
+  return TRUE;
+}
+
+static gboolean
+ensure_texture (CgTexture *self,
+                GError **error)
+{
+  CgvTexture *vk_texture = (CgvTexture *)self;
+  CgvGpu *vk_gpu = (CgvGpu *)self->gpu;
+  const TextureFormat *format = NULL;
+  gboolean depth = FALSE;
+  VkFormatProperties format_properties = { 0 };
+  VkImageCreateInfo create_info = { 0 };
+  VkMemoryRequirements requirements = { 0 };
+  VkCommandBuffer command_buffer = VK_NULL_HANDLE;
+  VkBuffer staging = VK_NULL_HANDLE;
+  VkDeviceMemory staging_memory = VK_NULL_HANDLE;
+  gboolean linear = FALSE;
+  gboolean success = FALSE;
+  VkResult result = VK_SUCCESS;
+
+  if (vk_texture->image != VK_NULL_HANDLE)
+    return TRUE;
+
+  if (self->init.native)
+    {
+      CGV_SET_ERROR (
+          error, CG_ERROR_NOT_SUPPORTED, VK_ERROR_FEATURE_NOT_PRESENT,
+          "Wrapping native textures is not supported");
+      return FALSE;
+    }
+
+  depth = self->init.format == CG_PRIV_FORMAT_DEPTH;
+  if (cg_priv_texture_has_stencil (self))
+    {
+      CGV_SET_ERROR (
+          error, CG_ERROR_NOT_SUPPORTED, VK_ERROR_FORMAT_NOT_SUPPORTED,
+          "Stencil is not supported by the Vulkan backend");
+      return FALSE;
+    }
+
+  format = depth
+               ? &depth_formats[self->init.depth_format]
+               : get_texture_format (self->init.format);
+  vkGetPhysicalDeviceFormatProperties (vk_gpu->physical_device, format->format, &format_properties);
+
+  if (depth && !(format_properties.optimalTilingFeatures
+                 & VK_FORMAT_FEATURE_DEPTH_STENCIL_ATTACHMENT_BIT))
+    {
+      CGV_SET_ERROR (
+          error, CG_ERROR_FAILED_TEXTURE_GEN, VK_ERROR_FORMAT_NOT_SUPPORTED,
+          "The depth format is not supported");
+      return FALSE;
+    }
+
+  if (!get_sample_count (vk_gpu, self, &vk_texture->samples, error))
+    return FALSE;
+
+  linear = (format_properties.optimalTilingFeatures
+            & VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT)
+           != 0;
+
+  vk_texture->format = format->format;
+  vk_texture->aspect = depth ? VK_IMAGE_ASPECT_DEPTH_BIT : VK_IMAGE_ASPECT_COLOR_BIT;
+  vk_texture->layers = self->init.cubemap ? 6 : 1;
+  vk_texture->levels = 1;
+  if (!depth && self->init.msaa <= 0 && self->init.mipmaps > 1)
+    vk_texture->levels = MIN ((guint)self->init.mipmaps,
+                              g_bit_storage (MAX (self->init.width, self->init.height)));
+
+  /* Multisampled textures are only ever rendered
+   * into and resolved, never sampled directly */
+  if (depth)
+    vk_texture->layout = self->init.msaa > 0
+                             ? VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL
+                             : VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL;
+  else
+    vk_texture->layout = self->init.msaa > 0
+                             ? VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL
+                             : VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+
+  if (depth || self->init.cubemap)
+    vk_texture->sampler = vk_gpu->samplers[linear && !depth ? SAMPLER_LINEAR_CLAMP : SAMPLER_NEAREST_CLAMP];
+  else
+    vk_texture->sampler = vk_gpu->samplers[linear ? SAMPLER_LINEAR_REPEAT : SAMPLER_NEAREST_REPEAT];
+
+  create_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+  create_info.flags = self->init.cubemap ? VK_IMAGE_CREATE_CUBE_COMPATIBLE_BIT : 0;
+  create_info.imageType = VK_IMAGE_TYPE_2D;
+  create_info.format = format->format;
+  create_info.extent.width = self->init.width;
+  create_info.extent.height = self->init.height;
+  create_info.extent.depth = 1;
+  create_info.mipLevels = vk_texture->levels;
+  create_info.arrayLayers = vk_texture->layers;
+  create_info.samples = vk_texture->samples;
+  create_info.tiling = VK_IMAGE_TILING_OPTIMAL;
+  create_info.usage = VK_IMAGE_USAGE_TRANSFER_SRC_BIT
+                      | VK_IMAGE_USAGE_TRANSFER_DST_BIT
+                      | (depth ? VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT
+                               : VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT)
+                      | (self->init.msaa > 0 ? 0 : VK_IMAGE_USAGE_SAMPLED_BIT);
+  create_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  create_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+
+  result = vkCreateImage (vk_gpu->device, &create_info, NULL, &vk_texture->image);
+  if (result != VK_SUCCESS)
+    {
+      CGV_SET_ERROR (
+          error, CG_ERROR_FAILED_TEXTURE_GEN, result,
+          "Failed to create image");
+      return FALSE;
+    }
+
+  vkGetImageMemoryRequirements (vk_gpu->device, vk_texture->image, &requirements);
+  if (!allocate_memory (vk_gpu, &requirements, FALSE, &vk_texture->memory, error))
+    return FALSE;
+  vkBindImageMemory (vk_gpu->device, vk_texture->image, vk_texture->memory, 0);
+
+  if (!create_image_view (vk_gpu, vk_texture, TRUE, &vk_texture->attachment_view, error))
+    return FALSE;
+  if (self->init.msaa <= 0
+      && !create_image_view (vk_gpu, vk_texture, FALSE, &vk_texture->view, error))
+    return FALSE;
+
+  if (self->init.data != NULL && self->init.msaa <= 0 && !depth)
+    {
+      gsize n_pixels = (gsize)self->init.width * self->init.height * vk_texture->layers;
+      g_autofree guchar *converted = NULL;
+
+      converted = g_malloc (n_pixels * format->device_size);
+      convert_pixels (self->init.format, self->init.data, converted, n_pixels, TRUE);
+
+      if (!create_buffer (vk_gpu, n_pixels * format->device_size,
+                          VK_BUFFER_USAGE_TRANSFER_SRC_BIT, converted,
+                          &staging, &staging_memory, error))
+        return FALSE;
+    }
+
+  command_buffer = begin_one_shot (vk_gpu, error);
+  if (command_buffer == VK_NULL_HANDLE)
+    {
+      if (staging != VK_NULL_HANDLE)
+        {
+          vkDestroyBuffer (vk_gpu->device, staging, NULL);
+          vkFreeMemory (vk_gpu->device, staging_memory, NULL);
+        }
+      return FALSE;
+    }
+
+  if (staging != VK_NULL_HANDLE)
+    {
+      VkBufferImageCopy region = { 0 };
+
+      image_barrier (command_buffer, vk_texture, 0, vk_texture->levels,
+                     VK_IMAGE_LAYOUT_UNDEFINED,
+                     VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
+
+      region.imageSubresource.aspectMask = vk_texture->aspect;
+      region.imageSubresource.layerCount = vk_texture->layers;
+      region.imageExtent.width = self->init.width;
+      region.imageExtent.height = self->init.height;
+      region.imageExtent.depth = 1;
+
+      vkCmdCopyBufferToImage (
+          command_buffer, staging, vk_texture->image,
+          VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
+
+      record_mipmaps (command_buffer, vk_texture,
+                      (format_properties.optimalTilingFeatures
+                       & VK_FORMAT_FEATURE_BLIT_SRC_BIT)
+                          && linear);
+    }
+  else
+    image_barrier (command_buffer, vk_texture, 0, vk_texture->levels,
+                   VK_IMAGE_LAYOUT_UNDEFINED, vk_texture->layout);
+
+  success = end_one_shot (vk_gpu, command_buffer, error);
+
+  if (staging != VK_NULL_HANDLE)
+    {
+      vkDestroyBuffer (vk_gpu->device, staging, NULL);
+      vkFreeMemory (vk_gpu->device, staging_memory, NULL);
+    }
+
+  return success;
+}
+
+/* For use outside of compiling a plan */
+static gboolean
+ensure_texture_locked (CgTexture *self,
+                       GError **error)
+{
+  CgvGpu *vk_gpu = (CgvGpu *)self->gpu;
+  gboolean success = FALSE;
+
+  g_mutex_lock (&vk_gpu->objects_lock);
+  success = ensure_texture (self, error);
+  g_mutex_unlock (&vk_gpu->objects_lock);
+
+  return success;
+}
+
+static gboolean
+texture_update (CgTexture *self,
+                int x,
+                int y,
+                int width,
+                int height,
+                gconstpointer data,
+                GError **error)
+{
+  CgvTexture *vk_texture = (CgvTexture *)self;
+  CgvGpu *vk_gpu = (CgvGpu *)self->gpu;
+  const TextureFormat *format = NULL;
+  gsize n_pixels = 0;
+  g_autofree guchar *converted = NULL;
+  VkBuffer staging = VK_NULL_HANDLE;
+  VkDeviceMemory staging_memory = VK_NULL_HANDLE;
+  VkCommandBuffer command_buffer = VK_NULL_HANDLE;
+  VkBufferImageCopy region = { 0 };
+  gboolean success = FALSE;
+
+  if (!ensure_texture_locked (self, error))
+    return FALSE;
+
+  format = get_texture_format (self->init.format);
+  n_pixels = (gsize)width * height;
+  converted = g_malloc (MAX (n_pixels, 1) * format->device_size);
+  convert_pixels (self->init.format, data, converted, n_pixels, TRUE);
+
+  if (!create_buffer (vk_gpu, n_pixels * format->device_size,
+                      VK_BUFFER_USAGE_TRANSFER_SRC_BIT, converted,
+                      &staging, &staging_memory, error))
+    return FALSE;
+
+  command_buffer = begin_one_shot (vk_gpu, error);
+  if (command_buffer != VK_NULL_HANDLE)
+    {
+      image_barrier (command_buffer, vk_texture, 0, 1,
+                     vk_texture->layout, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
+
+      region.imageSubresource.aspectMask = vk_texture->aspect;
+      region.imageSubresource.layerCount = 1;
+      region.imageOffset.x = x;
+      region.imageOffset.y = y;
+      region.imageExtent.width = width;
+      region.imageExtent.height = height;
+      region.imageExtent.depth = 1;
+
+      vkCmdCopyBufferToImage (
+          command_buffer, staging, vk_texture->image,
+          VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
+
+      image_barrier (command_buffer, vk_texture, 0, 1,
+                     VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, vk_texture->layout);
+
+      success = end_one_shot (vk_gpu, command_buffer, error);
+    }
+
+  vkDestroyBuffer (vk_gpu->device, staging, NULL);
+  vkFreeMemory (vk_gpu->device, staging_memory, NULL);
+
+  return success;
+}
+
+static gboolean
+texture_download (CgTexture *self,
+                  gpointer data,
+                  gsize size,
+                  GError **error)
+{
+  CgvTexture *vk_texture = (CgvTexture *)self;
+  CgvGpu *vk_gpu = (CgvGpu *)self->gpu;
+  const TextureFormat *format = NULL;
+  gsize n_pixels = 0;
+  VkBuffer staging = VK_NULL_HANDLE;
+  VkDeviceMemory staging_memory = VK_NULL_HANDLE;
+  VkCommandBuffer command_buffer = VK_NULL_HANDLE;
+  VkBufferImageCopy region = { 0 };
+  gpointer mapped = NULL;
+  gboolean success = FALSE;
+
+  format = get_texture_format (self->init.format);
+  n_pixels = (gsize)self->init.width * self->init.height;
+
+  if (size < n_pixels * format->host_size)
+    {
+      CGV_SET_ERROR (
+          error, CG_ERROR_FAILED_TEXTURE_GEN, VK_SUCCESS,
+          "Destination of %zu bytes is too small for texture contents",
+          size);
+      return FALSE;
+    }
+  if (self->init.msaa > 0)
+    {
+      CGV_SET_ERROR (
+          error, CG_ERROR_NOT_SUPPORTED, VK_ERROR_FEATURE_NOT_PRESENT,
+          "Multisampled textures cannot be downloaded, blit them first");
+      return FALSE;
+    }
+
+  if (!ensure_texture_locked (self, error))
+    return FALSE;
+
+  if (!create_buffer (vk_gpu, n_pixels * format->device_size,
+                      VK_BUFFER_USAGE_TRANSFER_DST_BIT, NULL,
+                      &staging, &staging_memory, error))
+    return FALSE;
+
+  command_buffer = begin_one_shot (vk_gpu, error);
+  if (command_buffer != VK_NULL_HANDLE)
+    {
+      image_barrier (command_buffer, vk_texture, 0, 1,
+                     vk_texture->layout, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL);
+
+      region.imageSubresource.aspectMask = vk_texture->aspect;
+      region.imageSubresource.layerCount = 1;
+      region.imageExtent.width = self->init.width;
+      region.imageExtent.height = self->init.height;
+      region.imageExtent.depth = 1;
+
+      vkCmdCopyImageToBuffer (
+          command_buffer, vk_texture->image,
+          VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, staging, 1, &region);
+
+      image_barrier (command_buffer, vk_texture, 0, 1,
+                     VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, vk_texture->layout);
+
+      success = end_one_shot (vk_gpu, command_buffer, error);
+    }
+
+  if (success)
+    {
+      VkResult result = VK_SUCCESS;
+
+      result = vkMapMemory (vk_gpu->device, staging_memory, 0, VK_WHOLE_SIZE, 0, &mapped);
+      if (result == VK_SUCCESS)
+        {
+          convert_pixels (self->init.format, mapped, data, n_pixels, FALSE);
+          vkUnmapMemory (vk_gpu->device, staging_memory);
+        }
+      else
+        {
+          CGV_SET_ERROR (
+              error, CG_ERROR_FAILED_TEXTURE_GEN, result,
+              "Failed to map download buffer");
+          success = FALSE;
+        }
+    }
+
+  vkDestroyBuffer (vk_gpu->device, staging, NULL);
+  vkFreeMemory (vk_gpu->device, staging_memory, NULL);
+
+  return success;
+}
+
+static void
+readback_free (CgGpu *self,
+               gpointer readback)
+{
+  CgvReadback *vk_readback = readback;
+  DestroyedObject object = { 0 };
+
+  object.buffer = vk_readback->staging;
+  object.memory = vk_readback->staging_memory;
+  object.command_pool = vk_readback->command_pool;
+  destroy_later (self, &object);
+
+  g_free (vk_readback);
+}
+
+static gpointer
+readback_new (CgTexture *self,
+              int x,
+              int y,
+              int width,
+              int height,
+              int format,
+              GError **error)
+{
+  CgvTexture *vk_texture = (CgvTexture *)self;
+  CgvGpu *vk_gpu = (CgvGpu *)self->gpu;
+  CgvReadback *readback = NULL;
+  VkCommandPoolCreateInfo command_pool_info = { 0 };
+  VkCommandBufferAllocateInfo allocate_info = { 0 };
+  VkCommandBufferBeginInfo begin_info = { 0 };
+  VkCommandBuffer command_buffer = VK_NULL_HANDLE;
+  VkBufferImageCopy region = { 0 };
+  VkResult result = VK_SUCCESS;
+  gboolean success = FALSE;
+
+  if (format != self->init.format)
+    {
+      CGV_SET_ERROR (
+          error, CG_ERROR_NOT_SUPPORTED, VK_ERROR_FORMAT_NOT_SUPPORTED,
+          "Readbacks cannot convert between formats");
+      return NULL;
+    }
+
+  if (!ensure_texture_locked (self, error))
+    return NULL;
+
+  readback = CG_PRIV_CREATE (readback);
+  readback->format = format;
+  readback->n_pixels = (gsize)width * height;
+
+  if (!create_buffer (vk_gpu, readback->n_pixels * get_texture_format (format)->device_size,
+                      VK_BUFFER_USAGE_TRANSFER_DST_BIT, NULL,
+                      &readback->staging, &readback->staging_memory, error))
+    {
+      readback_free (self->gpu, readback);
+      return NULL;
+    }
+
+  command_pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+  command_pool_info.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+  command_pool_info.queueFamilyIndex = vk_gpu->queue_family;
+
+  result = vkCreateCommandPool (vk_gpu->device, &command_pool_info, NULL, &readback->command_pool);
+  if (result != VK_SUCCESS)
+    {
+      CGV_SET_ERROR (
+          error, CG_ERROR_NOT_SUPPORTED, result,
+          "Failed to create command pool");
+      readback_free (self->gpu, readback);
+      return NULL;
+    }
+
+  allocate_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+  allocate_info.commandPool = readback->command_pool;
+  allocate_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+  allocate_info.commandBufferCount = 1;
+
+  result = vkAllocateCommandBuffers (vk_gpu->device, &allocate_info, &command_buffer);
+  if (result != VK_SUCCESS)
+    {
+      CGV_SET_ERROR (
+          error, CG_ERROR_NOT_SUPPORTED, result,
+          "Failed to allocate a command buffer");
+      readback_free (self->gpu, readback);
+      return NULL;
+    }
+
+  begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+  begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+
+  result = vkBeginCommandBuffer (command_buffer, &begin_info);
+  if (result != VK_SUCCESS)
+    {
+      CGV_SET_ERROR (
+          error, CG_ERROR_NOT_SUPPORTED, result,
+          "Failed to begin a command buffer");
+      readback_free (self->gpu, readback);
+      return NULL;
+    }
+
+  image_barrier (command_buffer, vk_texture, 0, 1,
+                 vk_texture->layout, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL);
+
+  region.imageSubresource.aspectMask = vk_texture->aspect;
+  region.imageSubresource.layerCount = 1;
+  region.imageOffset.x = x;
+  region.imageOffset.y = y;
+  region.imageExtent.width = width;
+  region.imageExtent.height = height;
+  region.imageExtent.depth = 1;
+
+  vkCmdCopyImageToBuffer (
+      command_buffer, vk_texture->image,
+      VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, readback->staging, 1, &region);
+
+  image_barrier (command_buffer, vk_texture, 0, 1,
+                 VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, vk_texture->layout);
+
+  /* Submitted without waiting, unlike other transfers */
+  g_mutex_lock (&vk_gpu->queue_lock);
+  success = vkEndCommandBuffer (command_buffer) == VK_SUCCESS
+            && submit_locked (vk_gpu, command_buffer, &readback->serial, error);
+  g_mutex_unlock (&vk_gpu->queue_lock);
+
+  if (!success)
+    {
+      readback_free (self->gpu, readback);
+      return NULL;
+    }
+
+  return readback;
+}
+
+static gboolean
+readback_wait (CgGpu *self,
+               gpointer readback,
+               guint64 timeout,
+               GError **error)
+{
+  gboolean reached = FALSE;
+
+  if (!wait_for_serial ((CgvGpu *)self, ((CgvReadback *)readback)->serial,
+                        timeout, &reached, error))
+    return FALSE;
+
+  return reached;
+}
+
+static gboolean
+readback_read (CgGpu *self,
+               gpointer readback,
+               gpointer data,
+               GError **error)
+{
+  CgvGpu *vk_gpu = (CgvGpu *)self;
+  CgvReadback *vk_readback = readback;
+  gpointer mapped = NULL;
+  VkResult result = VK_SUCCESS;
+
+  result = vkMapMemory (vk_gpu->device, vk_readback->staging_memory, 0, VK_WHOLE_SIZE, 0, &mapped);
+  if (result != VK_SUCCESS)
+    {
+      CGV_SET_ERROR (
+          error, CG_ERROR_FAILED_TEXTURE_GEN, result,
+          "Failed to map readback buffer");
+      return FALSE;
+    }
+
+  convert_pixels (vk_readback->format, mapped, data, vk_readback->n_pixels, FALSE);
+  vkUnmapMemory (vk_gpu->device, vk_readback->staging_memory);
+
+  return TRUE;
+}
+
+static gboolean
+texture_import_dmabuf (CgTexture *self,
+                       const CgDmabuf *dmabuf,
+                       GError **error)
+{
+  CGV_SET_ERROR (
+      error, CG_ERROR_NOT_SUPPORTED, VK_ERROR_EXTENSION_NOT_PRESENT,
+      "DMA-BUF import is not supported");
+  return FALSE;
+}
+
+static gboolean
+texture_export_dmabuf (CgTexture *self,
+                       CgDmabuf *dmabuf,
+                       GError **error)
+{
+  CGV_SET_ERROR (
+      error, CG_ERROR_NOT_SUPPORTED, VK_ERROR_EXTENSION_NOT_PRESENT,
+      "DMA-BUF export is not supported");
+  return FALSE;
+}
+
+typedef struct
+{
+  CgCommands *commands;
+  gboolean failure;
+  GError **error;
+} EnsureData;
+
+typedef struct
+{
+  EnsureData *ensure_data;
+  CgShader *shader;
+} ValidateUniformData;
+
+static gboolean
+test_uniform_validity (
+    const char *name,
+    const CgValue *value,
+    ValidateUniformData *data)
+{
+  CgvShader *vk_shader = (CgvShader *)data->shader;
+  CgvSlot *slot = NULL;
+
+  /* Frontend API should have verified that a shader was present. */
+  g_assert (data->shader != NULL);
+
+  slot = g_hash_table_lookup (vk_shader->slots, name);
+  if (slot == NULL)
+    {
+      CGV_SET_ERROR (
+          data->ensure_data->error, CG_ERROR_FAILED_SHADER_UNIFORM_SET, VK_SUCCESS,
+          "Uniform \"%s\" does not exist in shader",
+          name);
+      return TRUE;
+    }
+  if (slot->type == CG_TYPE_0)
+    {
+      CGV_SET_ERROR (
+          data->ensure_data->error, CG_ERROR_FAILED_SHADER_UNIFORM_SET, VK_SUCCESS,
+          "The type of uniform \"%s\" is not currently supported.",
+          name);
+      return TRUE;
+    }
+  if (slot->type != value->type)
+    {
+      CGV_SET_ERROR (
+          data->ensure_data->error, CG_ERROR_FAILED_SHADER_UNIFORM_SET, VK_SUCCESS,
+          "Submitted value type does not match shader type for uniform "
+          "\"%s\": expected %s, got %s",
+          name,
+          cg_priv_get_type_name (slot->type),
+          cg_priv_get_type_name (value->type));
+      return TRUE;
+    }
+
+  if (value->type == CG_TYPE_TEXTURE)
+    {
+      CgvTexture *vk_texture = (CgvTexture *)value->texture;
+
+      if (!ensure_texture (value->texture, data->ensure_data->error))
+        return TRUE;
+
+      if (slot->cubemap != value->texture->init.cubemap)
+        {
+          CGV_SET_ERROR (
+              data->ensure_data->error, CG_ERROR_FAILED_SHADER_UNIFORM_SET, VK_SUCCESS,
+              "Uniform \"%s\" %s a cubemap",
+              name, slot->cubemap ? "expects" : "does not expect");
+          return TRUE;
+        }
+
+      if (value->texture->init.msaa > 0)
+        {
+          if (value->texture->init.format == CG_PRIV_FORMAT_DEPTH)
+            {
+              CGV_SET_ERROR (
+                  data->ensure_data->error, CG_ERROR_NOT_SUPPORTED,
+                  VK_ERROR_FEATURE_NOT_PRESENT,
+                  "Multisampled depth textures cannot be "
+                  "sampled (uniform \"%s\")",
+                  name);
+              return TRUE;
+            }
+
+          /* Multisampled textures are resolved into
+           * this one before they are sampled */
+          if (vk_texture->non_msaa == NULL)
+            {
+              vk_texture->non_msaa = texture_new (value->texture->gpu);
+              vk_texture->non_msaa->gpu = cg_gpu_ref (value->texture->gpu);
+              vk_texture->non_msaa->init.msaa = 0;
+              vk_texture->non_msaa->init.cubemap = value->texture->init.cubemap;
+              vk_texture->non_msaa->init.data = NULL;
+              vk_texture->non_msaa->init.width = value->texture->init.width;
+              vk_texture->non_msaa->init.height = value->texture->init.height;
+              vk_texture->non_msaa->init.format = value->texture->init.format;
+              vk_texture->non_msaa->init.depth_format = value->texture->init.depth_format;
+              vk_texture->non_msaa->init.mipmaps = 1;
+            }
+
+          if (!ensure_texture (vk_texture->non_msaa, data->ensure_data->error))
+            return TRUE;
+        }
+    }
+  else if (value->type == CG_TYPE_BUFFER
+           && !ensure_buffer_usage (value->buffer, BUFFER_UNIFORMS, data->ensure_data->error))
+    return TRUE;
+
+  return FALSE;
+}
+
+static gboolean
+test_attribute_validity (
+    const char *name,
+    gconstpointer value,
+    ValidateUniformData *data)
+{
+  g_assert (data->shader != NULL);
+
+  if (g_hash_table_contains (((CgvShader *)data->shader)->inputs, name))
+    return FALSE;
+
+  CGV_SET_ERROR (
+      data->ensure_data->error, CG_ERROR_FAILED_SHADER_UNIFORM_SET, VK_SUCCESS,
+      "Attribute \"%s\" does not exist in shader",
+      name);
+  return TRUE;
+}
+
+static gboolean
+ensure_instr_node (GArray *nodes,
+                   guint node,
+                   EnsureData *data)
+{
+  CgPrivInstr *instr = CG_PRIV_NODE_INSTR (nodes, node);
+
+  switch (instr->type)
+    {
+    case CG_PRIV_INSTR_PASS:
+      {
+        ValidateUniformData validate_data = { 0 };
+
+        if (instr->pass.shader != NULL
+            && !ensure_shader (instr->pass.shader, data->error))
+          {
+            data->failure = TRUE;
+            return TRUE;
+          }
+
+        for (guint i = 0; i < instr->pass.targets->len; i++)
+          {
+            CgPrivTarget *target = NULL;
+
+            target = &g_array_index (instr->pass.targets, CgPrivTarget, i);
+            if (!ensure_texture (target->texture, data->error))
+              {
+                data->failure = TRUE;
+                return TRUE;
+              }
+
+            if (target->texture->init.cubemap)
+              {
+                CGV_SET_ERROR (
+                    data->error, CG_ERROR_FAILED_TARGET_CREATION, VK_SUCCESS,
+                    "Cubemaps cannot be rendered into");
+                data->failure = TRUE;
+                return TRUE;
+              }
+          }
+        if (instr->pass.targets->len > CGV_MAX_TARGETS)
+          {
+            CGV_SET_ERROR (
+                data->error, CG_ERROR_FAILED_TARGET_CREATION, VK_SUCCESS,
+                "At most %d targets are supported", CGV_MAX_TARGETS);
+            data->failure = TRUE;
+            return TRUE;
+          }
+
+        validate_data.ensure_data = data;
+        validate_data.shader = instr->pass.shader;
+        if (g_hash_table_find (instr->pass.uniforms.hash,
+                               (GHRFunc)test_uniform_validity, &validate_data)
+                != NULL
+            || g_hash_table_find (instr->pass.attributes,
+                                  (GHRFunc)test_attribute_validity, &validate_data)
+                   != NULL)
+          {
+            data->failure = TRUE;
+            return TRUE;
+          }
+      }
+      break;
+    case CG_PRIV_INSTR_VERTICES:
+      for (guint i = 0; i < instr->vertices.n_buffers; i++)
+        {
+          CgBuffer *buffer = instr->vertices.n_buffers > 1
+                                 ? instr->vertices.many_buffers[i]
+                                 : instr->vertices.one_buffer;
+
+          if (!ensure_buffer_usage (buffer, BUFFER_VERTICES, data->error))
+            {
+              data->failure = TRUE;
+              return TRUE;
+            }
+        }
+      if (instr->vertices.indices != NULL &&
+          !ensure_buffer_usage (instr->vertices.indices, BUFFER_INDICES, data->error))
+        {
+          data->failure = TRUE;
+          return TRUE;
+        }
+      break;
+    case CG_PRIV_INSTR_BLIT:
+      if (!ensure_texture (instr->blit.src, data->error))
+        {
+          data->failure = TRUE;
+          return TRUE;
+        }
+      break;
+    case CG_PRIV_INSTR_DEPTH_PYRAMID:
+      /* Shaders only come as SPIR-V from the user,
+       * so there is nothing to build the levels with */
+      CGV_SET_ERROR (
+          data->error, CG_ERROR_NOT_SUPPORTED, VK_ERROR_FEATURE_NOT_PRESENT,
+          "Depth pyramids are not supported");
+      data->failure = TRUE;
+      return TRUE;
+    default:
+      g_assert_not_reached ();
+    }
+
+  return FALSE;
+}
+
+/* Uniform values stay with a shader for the rest of the
+ * plan once set, like they stay with a GL program */
+typedef struct
+{
+  GHashTable *values;
+  gboolean dirty;
+  VkDescriptorSet set;
+  gint64 push_offset;
+} UniformState;
+
+static void
+uniform_state_free (gpointer data)
+{
+  UniformState *state = data;
+
+  g_hash_table_unref (state->values);
+  g_free (state);
+}
+
+typedef struct
+{
+  VkDescriptorSet set;
+  guint binding;
+  gboolean arena;
+  VkDescriptorType type;
+  VkDescriptorImageInfo image;
+  VkDescriptorBufferInfo buffer;
+} PendingWrite;
+
+typedef struct
+{
+  CgCommands *commands;
+  GArray *nodes;
+  GError **error;
+
+  GArray *steps;
+  GArray *draws;
+  GByteArray *push_data;
+  GByteArray *arena_data;
+  GArray *writes;
+  GHashTable *states;
+
+  /* The pass whose targets the last step renders into,
+   * if that step is still open for more draws */
+  CgPrivInstr *open;
+} BuildData;
+
+/* Colors in the order they were given, then depth */
+static guint
+order_attachments (GArray *targets,
+                   CgPrivTarget **ordered,
+                   guint *n_colors)
+{
+  guint n = 0;
+  CgPrivTarget *depth = NULL;
+
+  for (guint i = 0; i < targets->len; i++)
+    {
+      CgPrivTarget *target = &g_array_index (targets, CgPrivTarget, i);
+
+      if (target->texture->init.format == CG_PRIV_FORMAT_DEPTH)
+        depth = target;
+      else
+        ordered[n++] = target;
+    }
+
+  *n_colors = n;
+  if (depth != NULL)
+    ordered[n++] = depth;
+
+  return n;
+}
+
+typedef struct
+{
+  VkFormat format;
+  VkSampleCountFlagBits samples;
+  VkImageLayout layout;
+} RenderPassKeyAttachment;
+
+static VkRenderPass
+get_render_pass (CgvGpu *vk_gpu,
+                 GArray *targets,
+                 gboolean clear,
+                 GError **error)
+{
+  CgPrivTarget *ordered[CGV_MAX_TARGETS] = { 0 };
+  RenderPassKeyAttachment key[CGV_MAX_TARGETS + 1] = { 0 };
+  guint n_attachments = 0;
+  guint n_colors = 0;
+  g_autoptr (GBytes) bytes = NULL;
+  VkRenderPass render_pass = VK_NULL_HANDLE;
+  VkAttachmentDescription attachments[CGV_MAX_TARGETS] = { 0 };
+  VkAttachmentReference color_refs[CGV_MAX_TARGETS] = { 0 };
+  VkAttachmentReference depth_ref = { 0 };
+  VkSubpassDescription subpass = { 0 };
+  VkSubpassDependency dependencies[2] = { 0 };
+  VkRenderPassCreateInfo create_info = { 0 };
+  VkResult result = VK_SUCCESS;
+
+  n_attachments = order_attachments (targets, ordered, &n_colors);
+
+  for (guint i = 0; i < n_attachments; i++)
+    {
+      CgvTexture *texture = (CgvTexture *)ordered[i]->texture;
+
+      key[i].format = texture->format;
+      key[i].samples = texture->samples;
+      key[i].layout = texture->layout;
+    }
+  key[n_attachments].format = clear;
+  bytes = g_bytes_new (key, sizeof (*key) * (n_attachments + 1));
+
+  g_mutex_lock (&vk_gpu->cache_lock);
+  render_pass = g_hash_table_lookup (vk_gpu->render_passes, bytes);
+  g_mutex_unlock (&vk_gpu->cache_lock);
+  if (render_pass != VK_NULL_HANDLE)
+    return render_pass;
+
+  for (guint i = 0; i < n_attachments; i++)
+    {
+      CgvTexture *texture = (CgvTexture *)ordered[i]->texture;
+      gboolean depth = i >= n_colors;
+
+      attachments[i].format = texture->format;
+      attachments[i].samples = texture->samples;
+      attachments[i].loadOp = clear ? VK_ATTACHMENT_LOAD_OP_CLEAR : VK_ATTACHMENT_LOAD_OP_LOAD;
+      attachments[i].storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+      attachments[i].stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+      attachments[i].stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+      attachments[i].initialLayout = clear ? VK_IMAGE_LAYOUT_UNDEFINED : texture->layout;
+      attachments[i].finalLayout = texture->layout;
+
+      if (depth)
+        {
+          depth_ref.attachment = i;
+          depth_ref.layout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+        }
+      else
+        {
+          color_refs[i].attachment = i;
+          color_refs[i].layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+        }
+    }
+
+  subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+  subpass.colorAttachmentCount = n_colors;
+  subpass.pColorAttachments = color_refs;
+  if (n_attachments > n_colors)
+    subpass.pDepthStencilAttachment = &depth_ref;
+
+  /* Whatever came before may have written the targets or
+   * may read them afterwards, so order against everything */
+  dependencies[0].srcSubpass = VK_SUBPASS_EXTERNAL;
+  dependencies[0].dstSubpass = 0;
+  dependencies[0].srcStageMask = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
+  dependencies[0].dstStageMask = VK_PIPELINE_STAGE_ALL_GRAPHICS_BIT;
+  dependencies[0].srcAccessMask = VK_ACCESS_MEMORY_WRITE_BIT;
+  dependencies[0].dstAccessMask = VK_ACCESS_MEMORY_READ_BIT | VK_ACCESS_MEMORY_WRITE_BIT;
+  dependencies[1].srcSubpass = 0;
+  dependencies[1].dstSubpass = VK_SUBPASS_EXTERNAL;
+  dependencies[1].srcStageMask = VK_PIPELINE_STAGE_ALL_GRAPHICS_BIT;
+  dependencies[1].dstStageMask = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
+  dependencies[1].srcAccessMask = VK_ACCESS_MEMORY_WRITE_BIT;
+  dependencies[1].dstAccessMask = VK_ACCESS_MEMORY_READ_BIT | VK_ACCESS_MEMORY_WRITE_BIT;
+
+  create_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
+  create_info.attachmentCount = n_attachments;
+  create_info.pAttachments = attachments;
+  create_info.subpassCount = 1;
+  create_info.pSubpasses = &subpass;
+  create_info.dependencyCount = G_N_ELEMENTS (dependencies);
+  create_info.pDependencies = dependencies;
+
+  result = vkCreateRenderPass (vk_gpu->device, &create_info, NULL, &render_pass);
+  if (result != VK_SUCCESS)
+    {
+      CGV_SET_ERROR (
+          error, CG_ERROR_FAILED_TARGET_CREATION, result,
+          "Failed to create render pass");
+      return VK_NULL_HANDLE;
+    }
+
+  g_mutex_lock (&vk_gpu->cache_lock);
+  if (g_hash_table_contains (vk_gpu->render_passes, bytes))
+    {
+      /* Another thread got here first */
+      vkDestroyRenderPass (vk_gpu->device, render_pass, NULL);
+      render_pass = g_hash_table_lookup (vk_gpu->render_passes, bytes);
+    }
+  else
+    g_hash_table_insert (vk_gpu->render_passes, g_bytes_ref (bytes), render_pass);
+  g_mutex_unlock (&vk_gpu->cache_lock);
+
+  return render_pass;
+}
+
+static CgvStep *
+open_step (BuildData *data,
+           CgPrivInstr *pass_instr,
+           gboolean clear)
+{
+  CgvGpu *vk_gpu = (CgvGpu *)data->commands->gpu;
+  CgvCommands *vk_commands = (CgvCommands *)data->commands;
+  CgPrivTarget *ordered[CGV_MAX_TARGETS] = { 0 };
+  VkImageView views[CGV_MAX_TARGETS] = { 0 };
+  guint n_attachments = 0;
+  guint n_colors = 0;
+  CgvStep step = { 0 };
+  VkFramebufferCreateInfo create_info = { 0 };
+  VkFramebuffer framebuffer = VK_NULL_HANDLE;
+  VkResult result = VK_SUCCESS;
+
+  if (!clear && data->open != NULL
+      && cg_priv_targets_equal (data->open, pass_instr))
+    return &g_array_index (data->steps, CgvStep, data->steps->len - 1);
+
+  data->open = NULL;
+
+  if (pass_instr->pass.targets->len == 0)
+    {
+      CGV_SET_ERROR (
+          data->error, CG_ERROR_INVALID_PLAN, VK_SUCCESS,
+          "There is no default framebuffer, so every group "
+          "which draws or blits needs a target");
+      return NULL;
+    }
+
+  step.type = STEP_RENDER;
+  step.render_pass = get_render_pass (vk_gpu, pass_instr->pass.targets, clear, data->error);
+  if (step.render_pass == VK_NULL_HANDLE)
+    return NULL;
+
+  n_attachments = order_attachments (pass_instr->pass.targets, ordered, &n_colors);
+  step.extent.width = G_MAXUINT32;
+  step.extent.height = G_MAXUINT32;
+  for (guint i = 0; i < n_attachments; i++)
+    {
+      views[i] = ((CgvTexture *)ordered[i]->texture)->attachment_view;
+      step.extent.width = MIN (step.extent.width, (guint32)ordered[i]->texture->init.width);
+      step.extent.height = MIN (step.extent.height, (guint32)ordered[i]->texture->init.height);
+
+      if (i < n_colors)
+        memset (&step.clears[i].color, 0, sizeof (step.clears[i].color));
+      else
+        step.clears[i].depthStencil.depth = 1.0f;
+    }
+  step.n_clears = n_attachments;
+
+  create_info.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+  create_info.renderPass = step.render_pass;
+  create_info.attachmentCount = n_attachments;
+  create_info.pAttachments = views;
+  create_info.width = step.extent.width;
+  create_info.height = step.extent.height;
+  create_info.layers = 1;
+
+  result = vkCreateFramebuffer (vk_gpu->device, &create_info, NULL, &framebuffer);
+  if (result != VK_SUCCESS)
+    {
+      CGV_SET_ERROR (
+          data->error, CG_ERROR_FAILED_TARGET_CREATION, result,
+          "Failed to create framebuffer");
+      return NULL;
+    }
+  g_array_append_val (vk_commands->framebuffers, framebuffer);
+
+  step.framebuffer = framebuffer;
+  step.first_draw = data->draws->len;
+  g_array_append_val (data->steps, step);
+  data->open = pass_instr;
+
+  return &g_array_index (data->steps, CgvStep, data->steps->len - 1);
+}
+
+static const VkCompareOp test_func_map[CG_N_TEST_FUNCS] = {
+  [CG_TEST_NEVER] = VK_COMPARE_OP_NEVER,
+  [CG_TEST_ALWAYS] = VK_COMPARE_OP_ALWAYS,
+  [CG_TEST_LESS] = VK_COMPARE_OP_LESS,
+  [CG_TEST_LEQUAL] = VK_COMPARE_OP_LESS_OR_EQUAL,
+  [CG_TEST_GREATER] = VK_COMPARE_OP_GREATER,
+  [CG_TEST_GEQUAL] = VK_COMPARE_OP_GREATER_OR_EQUAL,
+  [CG_TEST_EQUAL] = VK_COMPARE_OP_EQUAL,
+  [CG_TEST_NOT_EQUAL] = VK_COMPARE_OP_NOT_EQUAL,
+};
+
+static const VkBlendFactor blend_func_map[CG_N_BLENDS] = {
+  [CG_BLEND_ZERO] = VK_BLEND_FACTOR_ZERO,
+  [CG_BLEND_ONE] = VK_BLEND_FACTOR_ONE,
+  [CG_BLEND_SRC_COLOR] = VK_BLEND_FACTOR_SRC_COLOR,
+  [CG_BLEND_ONE_MINUS_SRC_COLOR] = VK_BLEND_FACTOR_ONE_MINUS_SRC_COLOR,
+  [CG_BLEND_DST_COLOR] = VK_BLEND_FACTOR_DST_COLOR,
+  [CG_BLEND_ONE_MINUS_DST_COLOR] = VK_BLEND_FACTOR_ONE_MINUS_DST_COLOR,
+  [CG_BLEND_SRC_ALPHA] = VK_BLEND_FACTOR_SRC_ALPHA,
+  [CG_BLEND_ONE_MINUS_SRC_ALPHA] = VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA,
+  [CG_BLEND_DST_ALPHA] = VK_BLEND_FACTOR_DST_ALPHA,
+  [CG_BLEND_ONE_MINUS_DST_ALPHA] = VK_BLEND_FACTOR_ONE_MINUS_DST_ALPHA,
+  [CG_BLEND_CONSTANT_COLOR] = VK_BLEND_FACTOR_CONSTANT_COLOR,
+  [CG_BLEND_ONE_MINUS_CONSTANT_COLOR] = VK_BLEND_FACTOR_ONE_MINUS_CONSTANT_COLOR,
+  [CG_BLEND_CONSTANT_ALPHA] = VK_BLEND_FACTOR_CONSTANT_ALPHA,
+  [CG_BLEND_ONE_MINUS_CONSTANT_ALPHA] = VK_BLEND_FACTOR_ONE_MINUS_CONSTANT_ALPHA,
+  [CG_BLEND_SRC_ALPHA_SATURATE] = VK_BLEND_FACTOR_SRC_ALPHA_SATURATE,
+  [CG_BLEND_SRC1_COLOR] = VK_BLEND_FACTOR_SRC1_COLOR,
+  [CG_BLEND_ONE_MINUS_SRC1_COLOR] = VK_BLEND_FACTOR_ONE_MINUS_SRC1_COLOR,
+  [CG_BLEND_SRC1_ALPHA] = VK_BLEND_FACTOR_SRC1_ALPHA,
+  [CG_BLEND_ONE_MINUS_SRC1_ALPHA] = VK_BLEND_FACTOR_ONE_MINUS_SRC1_ALPHA,
+};
+
+static const VkPrimitiveTopology topology_map[CG_N_TOPOLOGIES] = {
+  [CG_TOPOLOGY_TRIANGLES] = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST,
+  [CG_TOPOLOGY_TRIANGLE_STRIP] = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_STRIP,
+  [CG_TOPOLOGY_LINES] = VK_PRIMITIVE_TOPOLOGY_LINE_LIST,
+  [CG_TOPOLOGY_LINE_STRIP] = VK_PRIMITIVE_TOPOLOGY_LINE_STRIP,
+  [CG_TOPOLOGY_POINTS] = VK_PRIMITIVE_TOPOLOGY_POINT_LIST,
+};
+
+/* Indexed by the number of components, minus one */
+static const VkFormat float32_formats[4] = {
+  VK_FORMAT_R32_SFLOAT,
+  VK_FORMAT_R32G32_SFLOAT,
+  VK_FORMAT_R32G32B32_SFLOAT,
+  VK_FORMAT_R32G32B32A32_SFLOAT,
+};
+static const VkFormat float16_formats[4] = {
+  VK_FORMAT_R16_SFLOAT,
+  VK_FORMAT_R16G16_SFLOAT,
+  VK_FORMAT_R16G16B16_SFLOAT,
+  VK_FORMAT_R16G16B16A16_SFLOAT,
+};
+static const VkFormat integer_formats[][CG_N_CONVERSIONS][4] = {
+  [CG_COMPONENT_UINT8 - CG_COMPONENT_INT8] = {
+      [CG_CONVERSION_CAST] = { VK_FORMAT_R8_USCALED, VK_FORMAT_R8G8_USCALED, VK_FORMAT_R8G8B8_USCALED, VK_FORMAT_R8G8B8A8_USCALED },
+      [CG_CONVERSION_NORMALIZE] = { VK_FORMAT_R8_UNORM, VK_FORMAT_R8G8_UNORM, VK_FORMAT_R8G8B8_UNORM, VK_FORMAT_R8G8B8A8_UNORM },
+      [CG_CONVERSION_INTEGER] = { VK_FORMAT_R8_UINT, VK_FORMAT_R8G8_UINT, VK_FORMAT_R8G8B8_UINT, VK_FORMAT_R8G8B8A8_UINT },
+  },
+  [CG_COMPONENT_INT8 - CG_COMPONENT_INT8] = {
+      [CG_CONVERSION_CAST] = { VK_FORMAT_R8_SSCALED, VK_FORMAT_R8G8_SSCALED, VK_FORMAT_R8G8B8_SSCALED, VK_FORMAT_R8G8B8A8_SSCALED },
+      [CG_CONVERSION_NORMALIZE] = { VK_FORMAT_R8_SNORM, VK_FORMAT_R8G8_SNORM, VK_FORMAT_R8G8B8_SNORM, VK_FORMAT_R8G8B8A8_SNORM },
+      [CG_CONVERSION_INTEGER] = { VK_FORMAT_R8_SINT, VK_FORMAT_R8G8_SINT, VK_FORMAT_R8G8B8_SINT, VK_FORMAT_R8G8B8A8_SINT },
+  },
+  [CG_COMPONENT_UINT16 - CG_COMPONENT_INT8] = {
+      [CG_CONVERSION_CAST] = { VK_FORMAT_R16_USCALED, VK_FORMAT_R16G16_USCALED, VK_FORMAT_R16G16B16_USCALED, VK_FORMAT_R16G16B16A16_USCALED },
+      [CG_CONVERSION_NORMALIZE] = { VK_FORMAT_R16_UNORM, VK_FORMAT_R16G16_UNORM, VK_FORMAT_R16G16B16_UNORM, VK_FORMAT_R16G16B16A16_UNORM },
+      [CG_CONVERSION_INTEGER] = { VK_FORMAT_R16_UINT, VK_FORMAT_R16G16_UINT, VK_FORMAT_R16G16B16_UINT, VK_FORMAT_R16G16B16A16_UINT },
+  },
+  [CG_COMPONENT_INT16 - CG_COMPONENT_INT8] = {
+      [CG_CONVERSION_CAST] = { VK_FORMAT_R16_SSCALED, VK_FORMAT_R16G16_SSCALED, VK_FORMAT_R16G16B16_SSCALED, VK_FORMAT_R16G16B16A16_SSCALED },
+      [CG_CONVERSION_NORMALIZE] = { VK_FORMAT_R16_SNORM, VK_FORMAT_R16G16_SNORM, VK_FORMAT_R16G16B16_SNORM, VK_FORMAT_R16G16B16A16_SNORM },
+      [CG_CONVERSION_INTEGER] = { VK_FORMAT_R16_SINT, VK_FORMAT_R16G16_SINT, VK_FORMAT_R16G16B16_SINT, VK_FORMAT_R16G16B16A16_SINT },
+  },
+  /* There are no scaled or normalized 32-bit formats */
+  [CG_COMPONENT_UINT32 - CG_COMPONENT_INT8] = {
+      [CG_CONVERSION_INTEGER] = { VK_FORMAT_R32_UINT, VK_FORMAT_R32G32_UINT, VK_FORMAT_R32G32B32_UINT, VK_FORMAT_R32G32B32A32_UINT },
+  },
+  [CG_COMPONENT_INT32 - CG_COMPONENT_INT8] = {
+      [CG_CONVERSION_INTEGER] = { VK_FORMAT_R32_SINT, VK_FORMAT_R32G32_SINT, VK_FORMAT_R32G32B32_SINT, VK_FORMAT_R32G32B32A32_SINT },
+  },
+};
+
+static VkFormat
+get_vertex_format (const CgDataSegment *segment)
+{
+  int component = cg_priv_get_segment_component (segment);
+
+  if (segment->num < 1 || segment->num > 4)
+    return VK_FORMAT_UNDEFINED;
+
+  switch (component)
+    {
+    case CG_COMPONENT_FLOAT32:
+      return float32_formats[segment->num - 1];
+    case CG_COMPONENT_FLOAT16:
+      return float16_formats[segment->num - 1];
+    case CG_COMPONENT_INT8:
+    case CG_COMPONENT_UINT8:
+    case CG_COMPONENT_INT16:
+    case CG_COMPONENT_UINT16:
+    case CG_COMPONENT_INT32:
+    case CG_COMPONENT_UINT32:
+      return integer_formats[component - CG_COMPONENT_INT8][segment->conversion][segment->num - 1];
+    case CG_COMPONENT_INT_2_10_10_10:
+      return segment->conversion == CG_CONVERSION_NORMALIZE
+                 ? VK_FORMAT_A2B10G10R10_SNORM_PACK32
+                 : VK_FORMAT_A2B10G10R10_SSCALED_PACK32;
+    case CG_COMPONENT_UINT_2_10_10_10:
+      return segment->conversion == CG_CONVERSION_NORMALIZE
+                 ? VK_FORMAT_A2B10G10R10_UNORM_PACK32
+                 : VK_FORMAT_A2B10G10R10_USCALED_PACK32;
+    default:
+      return VK_FORMAT_UNDEFINED;
+    }
+}
+
+/* Everything a pipeline depends on besides the shader,
+ * zeroed first so that padding compares equal */
+typedef struct
+{
+  guint32 n_colors;
+  VkFormat formats[CGV_MAX_TARGETS];
+  VkBlendFactor blends[CGV_MAX_TARGETS][2];
+  gboolean blendable[CGV_MAX_TARGETS];
+  VkFormat depth_format;
+  VkSampleCountFlagBits samples;
+
+  guint32 write_mask;
+  VkCompareOp depth_func;
+  gboolean clockwise_faces;
+  gboolean backface_cull;
+  VkPrimitiveTopology topology;
+  gboolean restart;
+
+  guint32 n_bindings;
+  guint32 n_attributes;
+} PipelineKey;
+
+#define CGV_MAX_VERTEX_BUFFERS 16
+#define CGV_MAX_VERTEX_ATTRIBUTES 32
+
+static VkPipeline
+get_pipeline (BuildData *data,
+              CgPrivInstr *pass_instr,
+              CgPrivInstr *instr,
+              CgvStep *step,
+              guint *vertex_count)
+{
+  CgvGpu *vk_gpu = (CgvGpu *)data->commands->gpu;
+  CgvShader *vk_shader = (CgvShader *)pass_instr->pass.shader;
+  CgPrivTarget *ordered[CGV_MAX_TARGETS] = { 0 };
+  guint n_attachments = 0;
+  guint n_colors = 0;
+  PipelineKey key = { 0 };
+  VkVertexInputBindingDescription bindings[CGV_MAX_VERTEX_BUFFERS] = { 0 };
+  VkVertexInputAttributeDescription attributes[CGV_MAX_VERTEX_ATTRIBUTES] = { 0 };
+  guint max_length = 0;
+  guint max_instance_length = 0;
+  g_autoptr (GByteArray) key_bytes = NULL;
+  g_autoptr (GBytes) bytes = NULL;
+  VkPipeline pipeline = VK_NULL_HANDLE;
+  g_autofree VkSpecializationMapEntry *entries = NULL;
+  VkSpecializationInfo specialization = { 0 };
+  VkPipelineShaderStageCreateInfo stages[2] = { 0 };
+  VkPipelineVertexInputStateCreateInfo vertex_input = { 0 };
+  VkPipelineInputAssemblyStateCreateInfo input_assembly = { 0 };
+  VkPipelineViewportStateCreateInfo viewport = { 0 };
+  VkPipelineRasterizationStateCreateInfo rasterization = { 0 };
+  VkPipelineMultisampleStateCreateInfo multisample = { 0 };
+  VkPipelineDepthStencilStateCreateInfo depth_stencil = { 0 };
+  VkPipelineColorBlendAttachmentState blend_attachments[CGV_MAX_TARGETS] = { 0 };
+  VkPipelineColorBlendStateCreateInfo blend = { 0 };
+  const VkDynamicState dynamic_states[] = { VK_DYNAMIC_STATE_VIEWPORT, VK_DYNAMIC_STATE_SCISSOR };
+  VkPipelineDynamicStateCreateInfo dynamic = { 0 };
+  VkGraphicsPipelineCreateInfo create_info = { 0 };
+  VkResult result = VK_SUCCESS;
+
+  n_attachments = order_attachments (pass_instr->pass.targets, ordered, &n_colors);
+
+  memset (&key, 0, sizeof (key));
+  key.n_colors = n_colors;
+  key.samples = ((CgvTexture *)ordered[0]->texture)->samples;
+  for (guint i = 0; i < n_colors; i++)
+    {
+      VkFormatProperties properties = { 0 };
+
+      key.formats[i] = ((CgvTexture *)ordered[i]->texture)->format;
+      key.blends[i][0] = blend_func_map[ordered[i]->src_blend];
+      key.blends[i][1] = blend_func_map[ordered[i]->dst_blend];
+
+      vkGetPhysicalDeviceFormatProperties (vk_gpu->physical_device, key.formats[i], &properties);
+      key.blendable[i] = (properties.optimalTilingFeatures
+                          & VK_FORMAT_FEATURE_COLOR_ATTACHMENT_BLEND_BIT)
+                         != 0;
+    }
+  if (n_attachments > n_colors)
+    key.depth_format = ((CgvTexture *)ordered[n_colors]->texture)->format;
+
+  key.write_mask = pass_instr->pass.write_mask.val;
+  key.depth_func = test_func_map[pass_instr->pass.depth_test_func.val];
+  key.clockwise_faces = pass_instr->pass.clockwise_faces.val;
+  key.backface_cull = pass_instr->pass.backface_cull.val;
+  key.topology = topology_map[instr->vertices.topology];
+  /* Restarting only makes sense for strips */
+  key.restart = instr->vertices.indices != NULL
+                && (instr->vertices.topology == CG_TOPOLOGY_TRIANGLE_STRIP
+                    || instr->vertices.topology == CG_TOPOLOGY_LINE_STRIP);
+
+  if (instr->vertices.n_buffers > CGV_MAX_VERTEX_BUFFERS)
+    {
+      CGV_SET_ERROR (
+          data->error, CG_ERROR_NOT_SUPPORTED, VK_SUCCESS,
+          "At most %d vertex buffers are supported per draw",
+          CGV_MAX_VERTEX_BUFFERS);
+      return VK_NULL_HANDLE;
+    }
+
+  for (guint i = 0; i < instr->vertices.n_buffers; i++)
+    {
+      CgBuffer *buffer = instr->vertices.n_buffers > 1
+                             ? instr->vertices.many_buffers[i]
+                             : instr->vertices.one_buffer;
+      gsize stride = 0;
+      gsize offset = 0;
+      int instance_rate = -1;
+      guint length = 0;
+
+      stride = cg_priv_get_data_layout_stride (buffer->spec, buffer->spec_length);
+
+      for (guint j = 0; j < buffer->spec_length; j++)
+        {
+          const CgDataSegment *segment = &buffer->spec[j];
+          VkVertexInputAttributeDescription *attribute = NULL;
+          guint location = 0;
+
+          location = GPOINTER_TO_UINT (g_hash_table_lookup (vk_shader->inputs, segment->name));
+          if (location == 0)
+            {
+              CGV_SET_ERROR (
+                  data->error, CG_ERROR_FAILED_SHADER_UNIFORM_SET, VK_SUCCESS,
+                  "Attribute \"%s\" does not exist in shader",
+                  segment->name);
+              return VK_NULL_HANDLE;
+            }
+
+          /* Vertex input rates belong to the whole buffer, and
+           * divisors other than one need an extension */
+          if ((instance_rate >= 0 && (segment->instance_rate > 0) != (instance_rate > 0))
+              || segment->instance_rate > 1)
+            {
+              CGV_SET_ERROR (
+                  data->error, CG_ERROR_NOT_SUPPORTED, VK_SUCCESS,
+                  "Every segment of a buffer must advance either per "
+                  "vertex or once per instance (\"%s\")",
+                  segment->name);
+              return VK_NULL_HANDLE;
+            }
+          instance_rate = segment->instance_rate;
+
+          if (key.n_attributes == CGV_MAX_VERTEX_ATTRIBUTES)
+            {
+              CGV_SET_ERROR (
+                  data->error, CG_ERROR_NOT_SUPPORTED, VK_SUCCESS,
+                  "At most %d attributes are supported per draw",
+                  CGV_MAX_VERTEX_ATTRIBUTES);
+              return VK_NULL_HANDLE;
+            }
+
+          attribute = &attributes[key.n_attributes++];
+          attribute->location = location - 1;
+          attribute->binding = i;
+          attribute->format = get_vertex_format (segment);
+          attribute->offset = offset;
+
+          if (attribute->format == VK_FORMAT_UNDEFINED)
+            {
+              CGV_SET_ERROR (
+                  data->error, CG_ERROR_NOT_SUPPORTED, VK_ERROR_FORMAT_NOT_SUPPORTED,
+                  "The layout of attribute \"%s\" has no vertex format",
+                  segment->name);
+              return VK_NULL_HANDLE;
+            }
+
+          offset += cg_priv_get_segment_size (segment);
+        }
+
+      bindings[i].binding = i;
+      bindings[i].stride = stride;
+      bindings[i].inputRate = instance_rate > 0
+                                  ? VK_VERTEX_INPUT_RATE_INSTANCE
+                                  : VK_VERTEX_INPUT_RATE_VERTEX;
+
+      /* Buffers holding only per-instance data
+       * do not decide how many vertices to draw */
+      length = stride > 0 ? buffer->init.size / stride : 0;
+      if (instance_rate > 0)
+        max_instance_length = MAX (max_instance_length, length);
+      else
+        max_length = MAX (max_length, length);
+    }
+  key.n_bindings = instr->vertices.n_buffers;
+  *vertex_count = max_length > 0 ? max_length : max_instance_length;
+
+  key_bytes = g_byte_array_new ();
+  g_byte_array_append (key_bytes, (const guint8 *)&key, sizeof (key));
+  g_byte_array_append (key_bytes, (const guint8 *)bindings, sizeof (*bindings) * key.n_bindings);
+  g_byte_array_append (key_bytes, (const guint8 *)attributes, sizeof (*attributes) * key.n_attributes);
+  bytes = g_byte_array_free_to_bytes (g_steal_pointer (&key_bytes));
+
+  g_mutex_lock (&vk_gpu->cache_lock);
+
+  pipeline = g_hash_table_lookup (vk_shader->pipelines, bytes);
+  if (pipeline != VK_NULL_HANDLE)
+    {
+      g_mutex_unlock (&vk_gpu->cache_lock);
+      return pipeline;
+    }
+
+  if (pass_instr->pass.shader->init.n_constants > 0)
+    {
+      entries = g_new0 (VkSpecializationMapEntry, pass_instr->pass.shader->init.n_constants);
+      for (guint i = 0; i < pass_instr->pass.shader->init.n_constants; i++)
+        {
+          entries[i].constantID = pass_instr->pass.shader->init.constant_ids[i];
+          entries[i].offset = i * sizeof (guint);
+          entries[i].size = sizeof (guint);
+        }
+      specialization.mapEntryCount = pass_instr->pass.shader->init.n_constants;
+      specialization.pMapEntries = entries;
+      specialization.dataSize = pass_instr->pass.shader->init.n_constants * sizeof (guint);
+      specialization.pData = pass_instr->pass.shader->init.constant_values;
+    }
+
+  for (guint i = 0; i < G_N_ELEMENTS (stages); i++)
+    {
+      stages[i].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+      stages[i].stage = i == 0 ? VK_SHADER_STAGE_VERTEX_BIT : VK_SHADER_STAGE_FRAGMENT_BIT;
+      stages[i].module = vk_shader->modules[i];
+      stages[i].pName = pass_instr->pass.shader->init.entry_point != NULL
+                            ? pass_instr->pass.shader->init.entry_point
+                            : "main";
+      if (entries != NULL)
+        stages[i].pSpecializationInfo = &specialization;
+    }
+
+  vertex_input.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
+  vertex_input.vertexBindingDescriptionCount = key.n_bindings;
+  vertex_input.pVertexBindingDescriptions = bindings;
+  vertex_input.vertexAttributeDescriptionCount = key.n_attributes;
+  vertex_input.pVertexAttributeDescriptions = attributes;
+
+  input_assembly.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
+  input_assembly.topology = key.topology;
+  input_assembly.primitiveRestartEnable = key.restart;
+
+  viewport.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
+  viewport.viewportCount = 1;
+  viewport.scissorCount = 1;
+
+  /* Rows are stored bottom up in GL and top down here, and
+   * both backends put row zero of a texture at y = -1, so
+   * the winding seen by the rasterizer is mirrored */
+  rasterization.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
+  rasterization.polygonMode = VK_POLYGON_MODE_FILL;
+  rasterization.cullMode = key.backface_cull ? VK_CULL_MODE_BACK_BIT : VK_CULL_MODE_NONE;
+  rasterization.frontFace = key.clockwise_faces
+                                ? VK_FRONT_FACE_COUNTER_CLOCKWISE
+                                : VK_FRONT_FACE_CLOCKWISE;
+  rasterization.lineWidth = 1.0f;
+
+  multisample.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
+  multisample.rasterizationSamples = key.samples;
+
+  depth_stencil.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
+  depth_stencil.depthTestEnable = key.depth_format != VK_FORMAT_UNDEFINED;
+  depth_stencil.depthWriteEnable = (key.write_mask & CG_WRITE_MASK_DEPTH) != 0;
+  depth_stencil.depthCompareOp = key.depth_func;
+
+  for (guint i = 0; i < n_colors; i++)
+    {
+      blend_attachments[i].blendEnable = key.blendable[i];
+      blend_attachments[i].srcColorBlendFactor = key.blends[i][0];
+      blend_attachments[i].dstColorBlendFactor = key.blends[i][1];
+      blend_attachments[i].colorBlendOp = VK_BLEND_OP_ADD;
+      blend_attachments[i].srcAlphaBlendFactor = key.blends[i][0];
+      blend_attachments[i].dstAlphaBlendFactor = key.blends[i][1];
+      blend_attachments[i].alphaBlendOp = VK_BLEND_OP_ADD;
+      blend_attachments[i].colorWriteMask =
+          (key.write_mask & CG_WRITE_MASK_COLOR_RED ? VK_COLOR_COMPONENT_R_BIT : 0)
+          | (key.write_mask & CG_WRITE_MASK_COLOR_GREEN ? VK_COLOR_COMPONENT_G_BIT : 0)
+          | (key.write_mask & CG_WRITE_MASK_COLOR_BLUE ? VK_COLOR_COMPONENT_B_BIT : 0)
+          | (key.write_mask & CG_WRITE_MASK_COLOR_ALPHA ? VK_COLOR_COMPONENT_A_BIT : 0);
+    }
+
+  blend.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
+  blend.attachmentCount = n_colors;
+  blend.pAttachments = blend_attachments;
+
+  dynamic.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
+  dynamic.dynamicStateCount = G_N_ELEMENTS (dynamic_states);
+  dynamic.pDynamicStates = dynamic_states;
+
+  create_info.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+  create_info.stageCount = G_N_ELEMENTS (stages);
+  create_info.pStages = stages;
+  create_info.pVertexInputState = &vertex_input;
+  create_info.pInputAssemblyState = &input_assembly;
+  create_info.pViewportState = &viewport;
+  create_info.pRasterizationState = &rasterization;
+  create_info.pMultisampleState = &multisample;
+  create_info.pDepthStencilState = &depth_stencil;
+  create_info.pColorBlendState = &blend;
+  create_info.pDynamicState = &dynamic;
+  create_info.layout = vk_shader->layout;
+  /* Load and store operations don't affect compatibility */
+  create_info.renderPass = step->render_pass;
+
+  result = vkCreateGraphicsPipelines (
+      vk_gpu->device, vk_gpu->pipeline_cache, 1, &create_info, NULL, &pipeline);
+  if (result != VK_SUCCESS)
+    {
+      g_mutex_unlock (&vk_gpu->cache_lock);
+      CGV_SET_ERROR (
+          data->error, CG_ERROR_FAILED_SHADER_GEN, result,
+          "Failed to create graphics pipeline");
+      return VK_NULL_HANDLE;
+    }
+
+  g_hash_table_insert (vk_shader->pipelines, g_bytes_ref (bytes), pipeline);
+  g_mutex_unlock (&vk_gpu->cache_lock);
+
+  return pipeline;
+}
+
+static VkDescriptorSet
+allocate_set (BuildData *data,
+              CgvShader *shader)
+{
+  CgvGpu *vk_gpu = (CgvGpu *)data->commands->gpu;
+  CgvCommands *vk_commands = (CgvCommands *)data->commands;
+  VkDescriptorSetAllocateInfo allocate_info = { 0 };
+  VkDescriptorSet set = VK_NULL_HANDLE;
+  VkResult result = VK_ERROR_OUT_OF_POOL_MEMORY;
+
+  allocate_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+  allocate_info.descriptorSetCount = 1;
+  allocate_info.pSetLayouts = &shader->set_layout;
+
+  if (vk_commands->descriptor_pools->len > 0)
+    {
+      allocate_info.descriptorPool = g_array_index (
+          vk_commands->descriptor_pools, VkDescriptorPool,
+          vk_commands->descriptor_pools->len - 1);
+      result = vkAllocateDescriptorSets (vk_gpu->device, &allocate_info, &set);
+    }
+
+  if (result == VK_ERROR_OUT_OF_POOL_MEMORY
+      || result == VK_ERROR_FRAGMENTED_POOL)
+    {
+      VkDescriptorPoolSize sizes[2] = { 0 };
+      VkDescriptorPoolCreateInfo create_info = { 0 };
+      VkDescriptorPool pool = VK_NULL_HANDLE;
+
+      sizes[0].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+      sizes[0].descriptorCount = CGV_DESCRIPTOR_POOL_SETS * 16;
+      sizes[1].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+      sizes[1].descriptorCount = CGV_DESCRIPTOR_POOL_SETS * 16;
+
+      create_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+      create_info.maxSets = CGV_DESCRIPTOR_POOL_SETS;
+      create_info.poolSizeCount = G_N_ELEMENTS (sizes);
+      create_info.pPoolSizes = sizes;
+
+      result = vkCreateDescriptorPool (vk_gpu->device, &create_info, NULL, &pool);
+      if (result == VK_SUCCESS)
+        {
+          g_array_append_val (vk_commands->descriptor_pools, pool);
+          allocate_info.descriptorPool = pool;
+          result = vkAllocateDescriptorSets (vk_gpu->device, &allocate_info, &set);
+        }
+    }
+
+  if (result != VK_SUCCESS)
+    {
+      CGV_SET_ERROR (
+          data->error, CG_ERROR_FAILED_SHADER_UNIFORM_SET, result,
+          "Failed to allocate descriptor set");
+      return VK_NULL_HANDLE;
+    }
+
+  return set;
+}
+
+static void
+write_value (guchar *dest,
+             gsize space,
+             const CgValue *value)
+{
+  guint32 b = 0;
+
+  switch (value->type)
+    {
+    case CG_TYPE_BOOL:
+      b = value->b ? 1 : 0;
+      if (space >= sizeof (b))
+        memcpy (dest, &b, sizeof (b));
+      break;
+    case CG_TYPE_INT:
+      if (space >= sizeof (value->i))
+        memcpy (dest, &value->i, sizeof (value->i));
+      break;
+    case CG_TYPE_UINT:
+      if (space >= sizeof (value->ui))
+        memcpy (dest, &value->ui, sizeof (value->ui));
+      break;
+    case CG_TYPE_FLOAT:
+      if (space >= sizeof (value->f))
+        memcpy (dest, &value->f, sizeof (value->f));
+      break;
+    case CG_TYPE_VEC2:
+      if (space >= sizeof (value->vec2))
+        memcpy (dest, value->vec2, sizeof (value->vec2));
+      break;
+    case CG_TYPE_VEC3:
+      if (space >= sizeof (value->vec3))
+        memcpy (dest, value->vec3, sizeof (value->vec3));
+      break;
+    case CG_TYPE_VEC4:
+      if (space >= sizeof (value->vec4))
+        memcpy (dest, value->vec4, sizeof (value->vec4));
+      break;
+    case CG_TYPE_MAT4:
+      if (space >= sizeof (float) * 16)
+        memcpy (dest, value->mat4.initialized, sizeof (float) * 16);
+      break;
+    default:
+      break;
+    }
+}
+
+/* Snapshots the current uniform values of a shader into
+ * push constants, arena blocks and a descriptor set */
+static gboolean
+flush_uniform_state (BuildData *data,
+                     CgvShader *shader,
+                     UniformState *state)
+{
+  GHashTableIter iter = { 0 };
+  gpointer name = NULL;
+  gpointer value = NULL;
+
+  if (shader->push_size > 0)
+    {
+      state->push_offset = data->push_data->len;
+      g_byte_array_set_size (data->push_data, data->push_data->len + shader->push_size);
+      memset (data->push_data->data + state->push_offset, 0, shader->push_size);
+
+      g_hash_table_iter_init (&iter, state->values);
+      while (g_hash_table_iter_next (&iter, &name, &value))
+        {
+          CgvSlot *slot = g_hash_table_lookup (shader->slots, name);
+
+          if (slot->kind == SLOT_VALUE && slot->push && slot->offset < shader->push_size)
+            write_value (data->push_data->data + state->push_offset + slot->offset,
+                         shader->push_size - slot->offset, value);
+        }
+    }
+
+  if (shader->bindings->len == 0)
+    return TRUE;
+
+  state->set = allocate_set (data, shader);
+  if (state->set == VK_NULL_HANDLE)
+    return FALSE;
+
+  for (guint i = 0; i < shader->bindings->len; i++)
+    {
+      CgvBinding *binding = &g_array_index (shader->bindings, CgvBinding, i);
+      const CgValue *bound = NULL;
+      PendingWrite write = { 0 };
+
+      g_hash_table_iter_init (&iter, state->values);
+      while (g_hash_table_iter_next (&iter, &name, &value))
+        {
+          CgvSlot *slot = g_hash_table_lookup (shader->slots, name);
+
+          if (slot->kind == binding->kind && slot->binding == binding->binding)
+            {
+              bound = value;
+              break;
+            }
+        }
+
+      write.set = state->set;
+      write.binding = binding->binding;
+
+      if (binding->kind == SLOT_SAMPLER)
+        {
+          CgvTexture *texture = NULL;
+
+          if (bound == NULL)
+            {
+              CGV_SET_ERROR (
+                  data->error, CG_ERROR_FAILED_SHADER_UNIFORM_SET, VK_SUCCESS,
+                  "No texture was given for the sampler at binding %u",
+                  binding->binding);
+              return FALSE;
+            }
+
+          texture = (CgvTexture *)bound->texture;
+          if (texture->non_msaa != NULL)
+            texture = (CgvTexture *)texture->non_msaa;
+
+          write.type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+          write.image.sampler = texture->sampler;
+          write.image.imageView = texture->view;
+          write.image.imageLayout = texture->layout;
+        }
+      else if (bound != NULL)
+        {
+          write.type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+          write.buffer.buffer = ((CgvBuffer *)bound->buffer)->buffer;
+          write.buffer.range = VK_WHOLE_SIZE;
+        }
+      else
+        {
+          CgvGpu *vk_gpu = (CgvGpu *)data->commands->gpu;
+          VkDeviceSize alignment = 0;
+          guint offset = 0;
+
+          /* Loose values are gathered into the arena */
+          alignment = MAX (vk_gpu->properties.limits.minUniformBufferOffsetAlignment, 1);
+          offset = (data->arena_data->len + alignment - 1) / alignment * alignment;
+          g_byte_array_set_size (data->arena_data, offset + MAX (binding->size, 4));
+          memset (data->arena_data->data + offset, 0, data->arena_data->len - offset);
+
+          g_hash_table_iter_init (&iter, state->values);
+          while (g_hash_table_iter_next (&iter, &name, &value))
+            {
+              CgvSlot *slot = g_hash_table_lookup (shader->slots, name);
+
+              if (slot->kind == SLOT_VALUE && !slot->push
+                  && slot->binding == binding->binding
+                  && slot->offset < binding->size)
+                write_value (data->arena_data->data + offset + slot->offset,
+                             binding->size - slot->offset, value);
+            }
+
+          write.type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+          write.arena = TRUE;
+          write.buffer.offset = offset;
+          write.buffer.range = MAX (binding->size, 4);
+        }
+
+      g_array_append_val (data->writes, write);
+    }
+
+  return TRUE;
+}
+
+static UniformState *
+get_uniform_state (BuildData *data,
+                   CgShader *shader)
+{
+  UniformState *state = NULL;
+
+  state = g_hash_table_lookup (data->states, shader);
+  if (state == NULL)
+    {
+      state = CG_PRIV_CREATE (state);
+      state->values = g_hash_table_new (g_str_hash, g_str_equal);
+      state->dirty = TRUE;
+      state->push_offset = -1;
+      g_hash_table_insert (data->states, shader, state);
+    }
+
+  return state;
+}
+
+static gboolean
+build_draw (BuildData *data,
+            CgPrivInstr *pass_instr,
+            CgPrivInstr *instr)
+{
+  CgvShader *vk_shader = (CgvShader *)pass_instr->pass.shader;
+  CgvStep *step = NULL;
+  UniformState *state = NULL;
+  CgvDraw draw = { 0 };
+
+  g_assert (pass_instr->pass.shader != NULL);
+
+  step = open_step (data, pass_instr, FALSE);
+  if (step == NULL)
+    return FALSE;
+
+  draw.instr = instr;
+  draw.shader = vk_shader;
+  draw.pipeline = get_pipeline (data, pass_instr, instr, step, &draw.vertex_count);
+  if (draw.pipeline == VK_NULL_HANDLE)
+    return FALSE;
+
+  state = get_uniform_state (data, pass_instr->pass.shader);
+  if (state->dirty)
+    {
+      if (!flush_uniform_state (data, vk_shader, state))
+        return FALSE;
+      state->dirty = FALSE;
+    }
+  draw.set = state->set;
+  draw.push_offset = state->push_offset;
+
+  if (pass_instr->pass.dest.val[2] > 0 && pass_instr->pass.dest.val[3] > 0)
+    {
+      draw.viewport.x = pass_instr->pass.dest.val[0];
+      draw.viewport.y = pass_instr->pass.dest.val[1];
+      draw.viewport.width = pass_instr->pass.dest.val[2];
+      draw.viewport.height = pass_instr->pass.dest.val[3];
+    }
+  else
+    {
+      draw.viewport.width = step->extent.width;
+      draw.viewport.height = step->extent.height;
+    }
+  draw.viewport.maxDepth = 1.0f;
+  draw.scissor.extent = step->extent;
+
+  g_array_append_val (data->draws, draw);
+  step->n_draws++;
+
+  return TRUE;
+}
+
+static gboolean
+build_transfer (BuildData *data,
+                CgTexture *src,
+                CgTexture *dst,
+                const int *src_region,
+                const int *dst_region,
+                gboolean linear)
+{
+  CgvStep step = { 0 };
+
+  if (src == dst)
+    {
+      CGV_SET_ERROR (
+          data->error, CG_ERROR_INVALID_PLAN, VK_SUCCESS,
+          "A texture cannot be blitted into itself");
+      return FALSE;
+    }
+  if (dst->init.msaa > 0)
+    {
+      CGV_SET_ERROR (
+          data->error, CG_ERROR_NOT_SUPPORTED, VK_SUCCESS,
+          "Blitting into a multisampled texture is not supported");
+      return FALSE;
+    }
+
+  data->open = NULL;
+
+  step.src = src;
+  step.dst = dst;
+  memcpy (step.src_region, src_region, sizeof (step.src_region));
+  memcpy (step.dst_region, dst_region, sizeof (step.dst_region));
+
+  if (src->init.msaa > 0)
+    {
+      /* Resolving can neither scale nor filter */
+      if (src_region[2] - src_region[0] != dst_region[2] - dst_region[0]
+          || src_region[3] - src_region[1] != dst_region[3] - dst_region[1]
+          || src->init.format == CG_PRIV_FORMAT_DEPTH)
+        {
+          CGV_SET_ERROR (
+              data->error, CG_ERROR_NOT_SUPPORTED, VK_SUCCESS,
+              "Multisampled color textures can only be "
+              "blitted without scaling");
+          return FALSE;
+        }
+      step.type = STEP_RESOLVE;
+    }
+  else
+    {
+      step.type = STEP_BLIT;
+      step.linear = linear;
+    }
+
+  g_array_append_val (data->steps, step);
+  return TRUE;
+}
+
+static gboolean
+build_blit (BuildData *data,
+            CgPrivInstr *pass_instr,
+            CgPrivInstr *instr)
+{
+  CgTexture *src = instr->blit.src;
+  int src_region[4] = { 0 };
+  gboolean any = FALSE;
+
+  if (instr->blit.region_set)
+    {
+      src_region[0] = instr->blit.region[0];
+      src_region[1] = instr->blit.region[1];
+      src_region[2] = instr->blit.region[0] + instr->blit.region[2];
+      src_region[3] = instr->blit.region[1] + instr->blit.region[3];
+    }
+  else
+    {
+      src_region[2] = src->init.width;
+      src_region[3] = src->init.height;
+    }
+
+  /* Color goes into every color target, depth into depth */
+  for (guint i = 0; i < pass_instr->pass.targets->len; i++)
+    {
+      CgTexture *dst = g_array_index (pass_instr->pass.targets, CgPrivTarget, i).texture;
+      int dst_region[4] = { 0 };
+
+      if ((dst->init.format == CG_PRIV_FORMAT_DEPTH)
+          != (src->init.format == CG_PRIV_FORMAT_DEPTH))
+        continue;
+
+      if (pass_instr->pass.dest.val[2] > 0 && pass_instr->pass.dest.val[3] > 0)
+        {
+          dst_region[0] = pass_instr->pass.dest.val[0];
+          dst_region[1] = pass_instr->pass.dest.val[1];
+          dst_region[2] = pass_instr->pass.dest.val[0] + pass_instr->pass.dest.val[2];
+          dst_region[3] = pass_instr->pass.dest.val[1] + pass_instr->pass.dest.val[3];
+        }
+      else
+        {
+          dst_region[2] = dst->init.width;
+          dst_region[3] = dst->init.height;
+        }
+
+      /* Depth and multisampled sources only allow nearest filtering */
+      if (!build_transfer (
+              data, src, dst, src_region, dst_region,
+              instr->blit.linear
+                  && src->init.format != CG_PRIV_FORMAT_DEPTH
+                  && src->init.msaa == 0))
+        return FALSE;
+      any = TRUE;
+    }
+
+  if (!any)
+    {
+      CGV_SET_ERROR (
+          data->error, CG_ERROR_INVALID_PLAN, VK_SUCCESS,
+          "A blit needs a target of the same kind as its source");
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static gboolean
+build_instr_node (guint node,
+                  BuildData *data)
+{
+  GArray *nodes = data->nodes;
+  CgPrivInstr *pass_instr = CG_PRIV_NODE_INSTR (nodes, node);
+
+  g_assert (pass_instr->type == CG_PRIV_INSTR_PASS);
+
+  if (pass_instr->pass.shader != NULL
+      && g_hash_table_size (pass_instr->pass.uniforms.hash) > 0)
+    {
+      UniformState *state = NULL;
+
+      state = get_uniform_state (data, pass_instr->pass.shader);
+      for (guint i = 0; i < pass_instr->pass.uniforms.order->len; i++)
+        {
+          const char *name = g_ptr_array_index (pass_instr->pass.uniforms.order, i);
+          CgValue *value = g_hash_table_lookup (pass_instr->pass.uniforms.hash, name);
+
+          g_hash_table_insert (state->values, (gpointer)name, value);
+
+          /* Like GL, multisampled textures are resolved
+           * whenever a group hands them to its shader */
+          if (value->type == CG_TYPE_TEXTURE && value->texture->init.msaa > 0)
+            {
+              CgTexture *non_msaa = ((CgvTexture *)value->texture)->non_msaa;
+              int region[4] = { 0, 0, value->texture->init.width, value->texture->init.height };
+
+              if (!build_transfer (data, value->texture, non_msaa, region, region, FALSE))
+                return FALSE;
+            }
+        }
+      state->dirty = TRUE;
+    }
+
+  if (!pass_instr->pass.fake
+      && !pass_instr->pass.merge_parent
+      && !pass_instr->pass.merge_sibling
+      && pass_instr->pass.targets->len > 0
+      && open_step (data, pass_instr, TRUE) == NULL)
+    return FALSE;
+
+  for (guint child = CG_PRIV_NODE (nodes, node)->first_child;
+       child != CG_PRIV_NO_NODE;
+       child = CG_PRIV_NODE (nodes, child)->next_sibling)
+    {
+      CgPrivInstr *instr = CG_PRIV_NODE_INSTR (nodes, child);
+
+      switch (instr->type)
+        {
+        case CG_PRIV_INSTR_PASS:
+          if (!build_instr_node (child, data))
+            return FALSE;
+          break;
+        case CG_PRIV_INSTR_VERTICES:
+          if (!build_draw (data, pass_instr, instr))
+            return FALSE;
+          break;
+        case CG_PRIV_INSTR_BLIT:
+          if (!build_blit (data, pass_instr, instr))
+            return FALSE;
+          break;
+        default:
+          g_assert_not_reached ();
+        }
+    }
+
+  return TRUE;
+}
+
+static void
+record_draws (CgCommands *commands,
+              VkCommandBuffer command_buffer,
+              CgvStep *step,
+              BuildData *data)
+{
+  VkPipeline bound_pipeline = VK_NULL_HANDLE;
+  VkDescriptorSet bound_set = VK_NULL_HANDLE;
+  VkViewport viewport = { 0 };
+
+  for (guint i = step->first_draw; i < step->first_draw + step->n_draws; i++)
+    {
+      CgvDraw *draw = &g_array_index (data->draws, CgvDraw, i);
+      CgPrivInstr *instr = draw->instr;
+      VkBuffer buffers[CGV_MAX_VERTEX_BUFFERS] = { 0 };
+      VkDeviceSize offsets[CGV_MAX_VERTEX_BUFFERS] = { 0 };
+      guint instances = MAX (instr->vertices.instances, 1);
+
+      if (draw->pipeline != bound_pipeline)
+        {
+          CG_PRIV_COMPILE (
+              commands,
+              vkCmdBindPipeline, _A (command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, draw->pipeline),
+              "%s, %s, %s", _A (CG_PRIV_ADDRESS, "VK_PIPELINE_BIND_POINT_GRAPHICS", CG_PRIV_ADDRESS));
+          bound_pipeline = draw->pipeline;
+          bound_set = VK_NULL_HANDLE;
+        }
+
+      if (i == step->first_draw
+          || memcmp (&viewport, &draw->viewport, sizeof (viewport)) != 0)
+        {
+          viewport = draw->viewport;
+          CG_PRIV_COMPILE (
+              commands,
+              vkCmdSetViewport, _A (command_buffer, 0, 1, &draw->viewport),
+              "%s, %d, %d, {%f, %f, %f, %f}",
+              _A (CG_PRIV_ADDRESS, 0, 1,
+                  draw->viewport.x, draw->viewport.y,
+                  draw->viewport.width, draw->viewport.height));
+          CG_PRIV_COMPILE (
+              commands,
+              vkCmdSetScissor, _A (command_buffer, 0, 1, &draw->scissor),
+              "%s, %d, %d, {%u, %u}",
+              _A (CG_PRIV_ADDRESS, 0, 1,
+                  draw->scissor.extent.width, draw->scissor.extent.height));
+        }
+
+      if (draw->set != VK_NULL_HANDLE && draw->set != bound_set)
+        {
+          CG_PRIV_COMPILE (
+              commands,
+              vkCmdBindDescriptorSets,
+              _A (command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                  draw->shader->layout, 0, 1, &draw->set, 0, NULL),
+              "%s, %s, %s, %d, %d, %s, %d, %s",
+              _A (CG_PRIV_ADDRESS, "VK_PIPELINE_BIND_POINT_GRAPHICS",
+                  CG_PRIV_ADDRESS, 0, 1, CG_PRIV_ADDRESS, 0, "NULL"));
+          bound_set = draw->set;
+        }
+
+      if (draw->push_offset >= 0)
+        CG_PRIV_COMPILE (
+            commands,
+            vkCmdPushConstants,
+            _A (command_buffer, draw->shader->layout, draw->shader->push_stages,
+                0, draw->shader->push_size, data->push_data->data + draw->push_offset),
+            "%s, %s, 0x%x, %d, %u, %s",
+            _A (CG_PRIV_ADDRESS, CG_PRIV_ADDRESS, draw->shader->push_stages,
+                0, draw->shader->push_size, CG_PRIV_ADDRESS));
+
+      for (guint j = 0; j < instr->vertices.n_buffers; j++)
+        {
+          CgBuffer *buffer = instr->vertices.n_buffers > 1
+                                 ? instr->vertices.many_buffers[j]
+                                 : instr->vertices.one_buffer;
+          buffers[j] = ((CgvBuffer *)buffer)->buffer;
+        }
+      if (instr->vertices.n_buffers > 0)
+        CG_PRIV_COMPILE (
+            commands,
+            vkCmdBindVertexBuffers,
+            _A (command_buffer, 0, instr->vertices.n_buffers, buffers, offsets),
+            "%s, %d, %u, %s, %s",
+            _A (CG_PRIV_ADDRESS, 0, instr->vertices.n_buffers, CG_PRIV_ADDRESS, CG_PRIV_ADDRESS));
+
+      if (instr->vertices.indices != NULL)
+        {
+          CgvBuffer *indices = (CgvBuffer *)instr->vertices.indices;
+
+          CG_PRIV_COMPILE (
+              commands,
+              vkCmdBindIndexBuffer, _A (command_buffer, indices->buffer, 0, indices->index_type),
+              "%s, %s, %d, %s",
+              _A (CG_PRIV_ADDRESS, CG_PRIV_ADDRESS, 0,
+                  indices->index_type == VK_INDEX_TYPE_UINT32
+                      ? "VK_INDEX_TYPE_UINT32"
+                      : "VK_INDEX_TYPE_UINT16"));
+          CG_PRIV_COMPILE (
+              commands,
+              vkCmdDrawIndexed,
+              _A (command_buffer, indices->length, instances, 0, 0, instr->vertices.first_instance),
+              "%s, %u, %u, %d, %d, %u",
+              _A (CG_PRIV_ADDRESS, indices->length, instances, 0, 0, instr->vertices.first_instance));
+        }
+      else
+        CG_PRIV_COMPILE (
+            commands,
+            vkCmdDraw,
+            _A (command_buffer, draw->vertex_count, instances, 0, instr->vertices.first_instance),
+            "%s, %u, %u, %d, %u",
+            _A (CG_PRIV_ADDRESS, draw->vertex_count, instances, 0, instr->vertices.first_instance));
+    }
+}
+
+static void
+record_transfer (CgCommands *commands,
+                 VkCommandBuffer command_buffer,
+                 CgvStep *step)
+{
+  CgvTexture *src = (CgvTexture *)step->src;
+  CgvTexture *dst = (CgvTexture *)step->dst;
+
+  image_barrier (command_buffer, src, 0, 1, src->layout, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL);
+  image_barrier (command_buffer, dst, 0, 1, dst->layout, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
+
+  if (step->type == STEP_RESOLVE)
+    {
+      VkImageResolve region = { 0 };
+
+      region.srcSubresource.aspectMask = src->aspect;
+      region.srcSubresource.layerCount = 1;
+      region.srcOffset.x = step->src_region[0];
+      region.srcOffset.y = step->src_region[1];
+      region.dstSubresource.aspectMask = dst->aspect;
+      region.dstSubresource.layerCount = 1;
+      region.dstOffset.x = step->dst_region[0];
+      region.dstOffset.y = step->dst_region[1];
+      region.extent.width = step->src_region[2] - step->src_region[0];
+      region.extent.height = step->src_region[3] - step->src_region[1];
+      region.extent.depth = 1;
+
+      CG_PRIV_COMPILE (
+          commands,
+          vkCmdResolveImage,
+          _A (command_buffer,
+              src->image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+              dst->image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+              1, &region),
+          "%s, %s, %s, %s, %s, %d, {%d, %d, %u, %u}",
+          _A (CG_PRIV_ADDRESS,
+              CG_PRIV_ADDRESS, "VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL",
+              CG_PRIV_ADDRESS, "VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL",
+              1, region.srcOffset.x, region.srcOffset.y,
+              region.extent.width, region.extent.height));
+    }
+  else
+    {
+      VkImageBlit region = { 0 };
+
+      region.srcSubresource.aspectMask = src->aspect;
+      region.srcSubresource.layerCount = 1;
+      region.srcOffsets[0].x = step->src_region[0];
+      region.srcOffsets[0].y = step->src_region[1];
+      region.srcOffsets[1].x = step->src_region[2];
+      region.srcOffsets[1].y = step->src_region[3];
+      region.srcOffsets[1].z = 1;
+      region.dstSubresource.aspectMask = dst->aspect;
+      region.dstSubresource.layerCount = 1;
+      region.dstOffsets[0].x = step->dst_region[0];
+      region.dstOffsets[0].y = step->dst_region[1];
+      region.dstOffsets[1].x = step->dst_region[2];
+      region.dstOffsets[1].y = step->dst_region[3];
+      region.dstOffsets[1].z = 1;
+
+      CG_PRIV_COMPILE (
+          commands,
+          vkCmdBlitImage,
+          _A (command_buffer,
+              src->image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+              dst->image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+              1, &region, step->linear ? VK_FILTER_LINEAR : VK_FILTER_NEAREST),
+          "%s, %s, %s, %s, %s, %d, {%d, %d, %d, %d -> %d, %d, %d, %d}, %s",
+          _A (CG_PRIV_ADDRESS,
+              CG_PRIV_ADDRESS, "VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL",
+              CG_PRIV_ADDRESS, "VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL",
+              1,
+              step->src_region[0], step->src_region[1], step->src_region[2], step->src_region[3],
+              step->dst_region[0], step->dst_region[1], step->dst_region[2], step->dst_region[3],
+              step->linear ? "VK_FILTER_LINEAR" : "VK_FILTER_NEAREST"));
+    }
+
+  image_barrier (command_buffer, src, 0, 1, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, src->layout);
+  image_barrier (command_buffer, dst, 0, 1, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, dst->layout);
+}
+
+static VkCommandPool
+create_command_pool (CgvCommands *vk_commands,
+                     GError **error)
+{
+  CgvGpu *vk_gpu = (CgvGpu *)vk_commands->base.gpu;
+  VkCommandPoolCreateInfo create_info = { 0 };
+  VkCommandPool pool = VK_NULL_HANDLE;
+  VkResult result = VK_SUCCESS;
+
+  create_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+  create_info.queueFamilyIndex = vk_gpu->queue_family;
+
+  result = vkCreateCommandPool (vk_gpu->device, &create_info, NULL, &pool);
+  if (result != VK_SUCCESS)
+    {
+      CGV_SET_ERROR (
+          error, CG_ERROR_FAILED_INIT, result,
+          "Failed to create command pool");
+      return VK_NULL_HANDLE;
+    }
+
+  g_array_append_val (vk_commands->command_pools, pool);
+  return pool;
+}
+
+typedef struct
+{
+  GMutex mutex;
+  GCond cond;
+  guint pending;
+  VkResult result;
+} RecordBarrier;
+
+typedef struct
+{
+  BuildData *data;
+  CgvStep *step;
+  VkCommandPool pool;
+  RecordBarrier *barrier;
+} RecordJob;
+
+/* Runs on the gpu's pool of recorder threads. Command
+ * pools are externally synchronized, so every job
+ * records into one of its own. */
+static void
+record_job (gpointer job_data,
+            gpointer user_data)
+{
+  RecordJob *job = job_data;
+  CgvGpu *vk_gpu = (CgvGpu *)job->data->commands->gpu;
+  VkCommandBufferAllocateInfo allocate_info = { 0 };
+  VkCommandBufferInheritanceInfo inheritance = { 0 };
+  VkCommandBufferBeginInfo begin_info = { 0 };
+  VkResult result = VK_SUCCESS;
+
+  allocate_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+  allocate_info.commandPool = job->pool;
+  allocate_info.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
+  allocate_info.commandBufferCount = 1;
+
+  result = vkAllocateCommandBuffers (vk_gpu->device, &allocate_info, &job->step->secondary);
+  if (result == VK_SUCCESS)
+    {
+      inheritance.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+      inheritance.renderPass = job->step->render_pass;
+      inheritance.framebuffer = job->step->framebuffer;
+
+      begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+      begin_info.flags = VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT
+                         | VK_COMMAND_BUFFER_USAGE_SIMULTANEOUS_USE_BIT;
+      begin_info.pInheritanceInfo = &inheritance;
+
+      result = vkBeginCommandBuffer (job->step->secondary, &begin_info);
+    }
+  if (result == VK_SUCCESS)
+    {
+      record_draws (job->data->commands, job->step->secondary, job->step, job->data);
+      result = vkEndCommandBuffer (job->step->secondary);
+    }
+
+  g_mutex_lock (&job->barrier->mutex);
+  if (result != VK_SUCCESS)
+    job->barrier->result = result;
+  if (--job->barrier->pending == 0)
+    g_cond_signal (&job->barrier->cond);
+  g_mutex_unlock (&job->barrier->mutex);
+}
+
+static gboolean
+record_in_parallel (BuildData *data)
+{
+  CgvGpu *vk_gpu = (CgvGpu *)data->commands->gpu;
+  RecordBarrier barrier = { 0 };
+  g_autofree RecordJob *jobs = NULL;
+  guint n_jobs = 0;
+  gboolean success = TRUE;
+
+  g_mutex_init (&barrier.mutex);
+  g_cond_init (&barrier.cond);
+  barrier.result = VK_SUCCESS;
+
+  jobs = g_new0 (RecordJob, data->steps->len);
+  for (guint i = 0; i < data->steps->len; i++)
+    {
+      CgvStep *step = &g_array_index (data->steps, CgvStep, i);
+
+      if (step->type != STEP_RENDER || step->n_draws == 0)
+        continue;
+
+      jobs[n_jobs].data = data;
+      jobs[n_jobs].step = step;
+      jobs[n_jobs].barrier = &barrier;
+      jobs[n_jobs].pool = create_command_pool ((CgvCommands *)data->commands, data->error);
+      if (jobs[n_jobs].pool == VK_NULL_HANDLE)
+        {
+          success = FALSE;
+          break;
+        }
+      n_jobs++;
+    }
+
+  barrier.pending = n_jobs;
+  for (guint i = 0; i < n_jobs; i++)
+    g_thread_pool_push (vk_gpu->recorders, &jobs[i], NULL);
+
+  g_mutex_lock (&barrier.mutex);
+  while (barrier.pending > 0)
+    g_cond_wait (&barrier.cond, &barrier.mutex);
+  g_mutex_unlock (&barrier.mutex);
+
+  if (success && barrier.result != VK_SUCCESS)
+    {
+      CGV_SET_ERROR (
+          data->error, CG_ERROR_FAILED_INIT, barrier.result,
+          "Failed to record a render pass");
+      success = FALSE;
+    }
+
+  g_cond_clear (&barrier.cond);
+  g_mutex_clear (&barrier.mutex);
+
+  return success;
+}
+
+static gboolean
+record_commands (BuildData *data)
+{
+  CgCommands *commands = data->commands;
+  CgvCommands *vk_commands = (CgvCommands *)commands;
+  CgvGpu *vk_gpu = (CgvGpu *)commands->gpu;
+  VkCommandPool pool = VK_NULL_HANDLE;
+  VkCommandBufferAllocateInfo allocate_info = { 0 };
+  VkCommandBufferBeginInfo begin_info = { 0 };
+  VkCommandBuffer command_buffer = VK_NULL_HANDLE;
+  guint n_render_steps = 0;
+  gboolean parallel = FALSE;
+  VkResult result = VK_SUCCESS;
+
+  pool = create_command_pool (vk_commands, data->error);
+  if (pool == VK_NULL_HANDLE)
+    return FALSE;
+
+  allocate_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+  allocate_info.commandPool = pool;
+  allocate_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+  allocate_info.commandBufferCount = 1;
+
+  result = vkAllocateCommandBuffers (vk_gpu->device, &allocate_info, &command_buffer);
+  if (result != VK_SUCCESS)
+    {
+      CGV_SET_ERROR (
+          data->error, CG_ERROR_FAILED_INIT, result,
+          "Failed to allocate command buffer");
+      return FALSE;
+    }
+
+  for (guint i = 0; i < data->steps->len; i++)
+    if (g_array_index (data->steps, CgvStep, i).type == STEP_RENDER)
+      n_render_steps++;
+
+  /* Tracing wants the calls in order */
+  parallel = !commands->debug.enabled
+             && vk_gpu->recorders != NULL
+             && n_render_steps >= CGV_PARALLEL_MIN_STEPS
+             && data->draws->len >= CGV_PARALLEL_MIN_DRAWS;
+  if (parallel && !record_in_parallel (data))
+    return FALSE;
+
+  /* The same commands may be dispatched again
+   * before the previous dispatch has finished */
+  begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+  begin_info.flags = VK_COMMAND_BUFFER_USAGE_SIMULTANEOUS_USE_BIT;
+
+  result = vkBeginCommandBuffer (command_buffer, &begin_info);
+  if (result != VK_SUCCESS)
+    {
+      CGV_SET_ERROR (
+          data->error, CG_ERROR_FAILED_INIT, result,
+          "Failed to begin command buffer");
+      return FALSE;
+    }
+
+  for (guint i = 0; i < data->steps->len; i++)
+    {
+      CgvStep *step = &g_array_index (data->steps, CgvStep, i);
+
+      switch (step->type)
+        {
+        case STEP_RENDER:
+          {
+            VkRenderPassBeginInfo pass_info = { 0 };
+
+            pass_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+            pass_info.renderPass = step->render_pass;
+            pass_info.framebuffer = step->framebuffer;
+            pass_info.renderArea.extent = step->extent;
+            pass_info.clearValueCount = step->n_clears;
+            pass_info.pClearValues = step->clears;
+
+            CG_PRIV_COMPILE (
+                commands,
+                vkCmdBeginRenderPass,
+                _A (command_buffer, &pass_info,
+                    step->secondary != VK_NULL_HANDLE
+                        ? VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS
+                        : VK_SUBPASS_CONTENTS_INLINE),
+                "%s, {%u x %u, %u attachments}, %s",
+                _A (CG_PRIV_ADDRESS, step->extent.width, step->extent.height, step->n_clears,
+                    step->secondary != VK_NULL_HANDLE
+                        ? "VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS"
+                        : "VK_SUBPASS_CONTENTS_INLINE"));
+
+            if (step->secondary != VK_NULL_HANDLE)
+              CG_PRIV_COMPILE (
+                  commands,
+                  vkCmdExecuteCommands, _A (command_buffer, 1, &step->secondary),
+                  "%s, %d, %s", _A (CG_PRIV_ADDRESS, 1, CG_PRIV_ADDRESS));
+            else
+              record_draws (commands, command_buffer, step, data);
+
+            CG_PRIV_COMPILE (
+                commands,
+                vkCmdEndRenderPass, _A (command_buffer),
+                "%s", _A (CG_PRIV_ADDRESS));
+          }
+          break;
+        case STEP_BLIT:
+        case STEP_RESOLVE:
+          record_transfer (commands, command_buffer, step);
+          break;
+        default:
+          g_assert_not_reached ();
+        }
+    }
+
+  result = vkEndCommandBuffer (command_buffer);
+  if (result != VK_SUCCESS)
+    {
+      CGV_SET_ERROR (
+          data->error, CG_ERROR_FAILED_INIT, result,
+          "Failed to record command buffer");
+      return FALSE;
+    }
+
+  vk_commands->primary = command_buffer;
+  return TRUE;
+}
+
+/* Fills in descriptors which point into the arena,
+ * now that the arena exists */
+static gboolean
+write_descriptors (BuildData *data)
+{
+  CgvGpu *vk_gpu = (CgvGpu *)data->commands->gpu;
+  CgvCommands *vk_commands = (CgvCommands *)data->commands;
+  g_autofree VkWriteDescriptorSet *writes = NULL;
+
+  if (data->arena_data->len > 0
+      && !create_buffer (vk_gpu, data->arena_data->len,
+                         VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
+                         data->arena_data->data,
+                         &vk_commands->arena, &vk_commands->arena_memory,
+                         data->error))
+    return FALSE;
+
+  if (data->writes->len == 0)
+    return TRUE;
+
+  writes = g_new0 (VkWriteDescriptorSet, data->writes->len);
+  for (guint i = 0; i < data->writes->len; i++)
+    {
+      PendingWrite *pending = &g_array_index (data->writes, PendingWrite, i);
+
+      if (pending->arena)
+        pending->buffer.buffer = vk_commands->arena;
+
+      writes[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+      writes[i].dstSet = pending->set;
+      writes[i].dstBinding = pending->binding;
+      writes[i].descriptorCount = 1;
+      writes[i].descriptorType = pending->type;
+      if (pending->type == VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER)
+        writes[i].pImageInfo = &pending->image;
+      else
+        writes[i].pBufferInfo = &pending->buffer;
+    }
+
+  vkUpdateDescriptorSets (vk_gpu->device, data->writes->len, writes, 0, NULL);
+
+  return TRUE;
+}
+
+static CgCommands *
+plan_unref_to_commands (
+    CgPlan *self,
+    gboolean debug,
+    GError **error)
+{
+  CgvPlan *vk_plan = (CgvPlan *)self;
+  CgvGpu *vk_gpu = (CgvGpu *)self->gpu;
+  g_autoptr (CgCommands) commands = NULL;
+
+  if (g_atomic_ref_count_dec (&vk_plan->refcount))
+    {
+      CgvCommands *vk_commands = NULL;
+      EnsureData ensure_data = { 0 };
+      BuildData data = { 0 };
+      gboolean success = TRUE;
+
+      commands = cg_priv_commands_new (self->gpu);
+      vk_commands = (CgvCommands *)commands;
+
+      commands->debug.enabled = debug;
+      if (debug)
+        commands->debug.calls.compile = g_ptr_array_new_with_free_func (g_free);
+
+      vk_commands->nodes = g_steal_pointer (&self->nodes);
+
+      ensure_data.commands = commands;
+      ensure_data.error = error;
+
+      /* The nodes are in pre-order, so a front to back
+       * scan sees every parent before its children */
+      g_mutex_lock (&vk_gpu->objects_lock);
+      for (guint i = 0; i < vk_commands->nodes->len; i++)
+        {
+          if (ensure_instr_node (vk_commands->nodes, i, &ensure_data))
+            break;
+        }
+      g_mutex_unlock (&vk_gpu->objects_lock);
+      for (guint i = 0; i < vk_commands->nodes->len; i++)
+        cg_priv_merge_instr_node (vk_commands->nodes, i);
+
+      destroy_plan (self);
+
+      if (ensure_data.failure)
+        return NULL;
+      if (vk_commands->nodes->len == 0)
+        return g_steal_pointer (&commands);
+
+      data.commands = commands;
+      data.nodes = vk_commands->nodes;
+      data.error = error;
+      data.steps = g_array_new (FALSE, TRUE, sizeof (CgvStep));
+      data.draws = g_array_new (FALSE, TRUE, sizeof (CgvDraw));
+      data.push_data = g_byte_array_new ();
+      data.arena_data = g_byte_array_new ();
+      data.writes = g_array_new (FALSE, TRUE, sizeof (PendingWrite));
+      data.states = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, uniform_state_free);
+
+      success = build_instr_node (0, &data)
+                && write_descriptors (&data)
+                && record_commands (&data);
+
+      g_array_unref (data.steps);
+      g_array_unref (data.draws);
+      g_byte_array_unref (data.push_data);
+      g_byte_array_unref (data.arena_data);
+      g_array_unref (data.writes);
+      g_hash_table_unref (data.states);
+
+      if (!success)
+        return NULL;
+    }
+  else
+    {
+      CGV_CRITICAL_USER_ERROR (
+          "Plan object still has references elsewhere, "
+          "so its resources cannot be compiled!");
+      return NULL;
+    }
+
+  return g_steal_pointer (&commands);
+}
+
+static gboolean
+commands_dispatch (
+    CgCommands *self,
+    GError **error)
+{
+  CgvCommands *vk_commands = (CgvCommands *)self;
+  CgvGpu *vk_gpu = (CgvGpu *)self->gpu;
+  gboolean success = FALSE;
+
+  if (!gpu_flush (self->gpu, error))
+    return FALSE;
+
+  if (self->debug.enabled)
+    {
+      g_clear_pointer (&self->debug.calls.run, g_ptr_array_unref);
+      self->debug.calls.run = g_ptr_array_new_with_free_func (g_free);
+
+      /* Everything was recorded up front */
+      for (guint i = 0; i < self->debug.calls.compile->len; i++)
+        g_ptr_array_add (self->debug.calls.run,
+                         g_strdup (g_ptr_array_index (self->debug.calls.compile, i)));
+    }
+
+  if (vk_commands->primary == VK_NULL_HANDLE)
+    return TRUE;
+
+  g_mutex_lock (&vk_gpu->queue_lock);
+  success = submit_locked (vk_gpu, vk_commands->primary, &vk_commands->last_submitted, error);
+  g_mutex_unlock (&vk_gpu->queue_lock);
+
+  if (success && self->debug.enabled)
+    g_ptr_array_add (self->debug.calls.run,
+                     g_strdup_printf ("vkQueueSubmit (%s, %d, %s, %s)",
+                                      CG_PRIV_ADDRESS, 1, CG_PRIV_ADDRESS,
+                                      "VK_NULL_HANDLE"));
+
+  return success;
+}
+
+const CgBackendImpl cg_vk_impl = {
+  .is_threadsafe = TRUE,
+  .get_gpu_for_this_thread = get_gpu_for_this_thread,
+  .set_gpu_for_this_thread = set_gpu_for_this_thread,
+
+  .gpu_new = gpu_new,
+  .gpu_ref = gpu_ref,
+  .gpu_unref = gpu_unref,
+  .gpu_get_info = gpu_get_info,
+  .gpu_flush = gpu_flush,
+  .gpu_share = gpu_share,
+
+  .plan_new = plan_new,
+  .plan_ref = plan_ref,
+  .plan_unref = plan_unref,
+
+  .shader_new = shader_new,
+  .shader_ref = shader_ref,
+  .shader_unref = shader_unref,
+
+  .buffer_new = buffer_new,
+  .buffer_ref = buffer_ref,
+  .buffer_unref = buffer_unref,
+
+  .texture_new = texture_new,
+  .texture_ref = texture_ref,
+  .texture_unref = texture_unref,
+
+  .commands_new = commands_new,
+  .commands_ref = commands_ref,
+  .commands_unref = commands_unref,
+
+  .plan_unref_to_commands = plan_unref_to_commands,
+  .commands_dispatch = commands_dispatch,
+
+  .timer_new = timer_new,
+  .timer_free = timer_free,
+  .timer_begin = timer_begin,
+  .timer_end = timer_end,
+  .timer_collect = timer_collect,
+
+  .fence_new = fence_new,
+  .fence_free = fence_free,
+  .fence_wait = fence_wait,
+  .fence_client_wait = fence_client_wait,
+
+  .texture_update = texture_update,
+  .texture_download = texture_download,
+  .texture_import_dmabuf = texture_import_dmabuf,
+  .texture_export_dmabuf = texture_export_dmabuf,
+
+  .readback_new = readback_new,
+  .readback_free = readback_free,
+  .readback_wait = readback_wait,
+  .readback_read = readback_read,
+};
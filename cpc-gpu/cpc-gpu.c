@@ -22,6 +22,13 @@
 #define G_LOG_DOMAIN "CpcGpu"
 #include "cpc-gpu-private.h"
 
+#ifdef G_OS_UNIX
+#include <errno.h>
+#include <stdio.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
 #define CG_PRIV_GATHER_VA_ARGS_INTO(first, arr, c_arr, n_arr) \
   G_STMT_START                                                \
   {                                                           \
@@ -97,6 +104,7 @@ G_DEFINE_QUARK (cg-error-quark, cg_error);
 
 #define GL_ENUM_STR G_STRINGIFY (CG_INIT_FLAG_BACKEND_VULKAN)
 #define VK_ENUM_STR G_STRINGIFY (CG_INIT_FLAG_BACKEND_OPENGL)
+#define SW_ENUM_STR G_STRINGIFY (CG_INIT_FLAG_BACKEND_SOFTWARE)
 
 CgGpu *
 cg_gpu_new (guint32 flags,
@@ -110,23 +118,30 @@ cg_gpu_new (guint32 flags,
 
   if (flags & CG_INIT_FLAG_BACKEND_VULKAN)
     {
-      // impl = &cg_vk_impl;
-      enum_str = VK_ENUM_STR;
-
+#ifdef USE_VULKAN
+      impl = &cg_vk_impl;
+#else
       CG_PRIV_CRITICAL (
           "%s: Cannot initialize Vulkan "
-          "backend: not implemented yet",
+          "backend: cpc-gpu was built without it",
           VK_ENUM_STR);
+#endif
+      enum_str = VK_ENUM_STR;
     }
   else if (flags & CG_INIT_FLAG_BACKEND_OPENGL)
     {
       impl = &cg_gl_impl;
       enum_str = GL_ENUM_STR;
     }
+  else if (flags & CG_INIT_FLAG_BACKEND_SOFTWARE)
+    {
+      impl = &cg_sw_impl;
+      enum_str = SW_ENUM_STR;
+    }
   else
     CG_PRIV_CRITICAL (
-        "Cannot initialize backend. Please pass "
-        "the flag " GL_ENUM_STR " or " VK_ENUM_STR);
+        "Cannot initialize backend. Please pass the flag "
+        GL_ENUM_STR ", " VK_ENUM_STR " or " SW_ENUM_STR);
 
   g_return_val_if_fail (impl != NULL, NULL);
 
@@ -153,6 +168,212 @@ cg_gpu_new (guint32 flags,
   return g_steal_pointer (&gpu);
 }
 
+CgGpu *
+cg_gpu_new_shared (CgGpu *share,
+                   guint32 flags,
+                   gpointer extra_data,
+                   GError **error)
+{
+  g_autoptr (GError) local_error = NULL;
+  g_autoptr (CgGpu) gpu = NULL;
+  gboolean success = FALSE;
+
+  g_return_val_if_fail (share != NULL, NULL);
+
+  gpu = cg_gpu_new (flags, extra_data, error);
+  if (gpu == NULL)
+    return NULL;
+
+  if (gpu->impl != share->impl)
+    {
+      g_set_error (
+          error, CG_ERROR, CG_ERROR_FAILED_INIT,
+          "A share group cannot mix backends");
+      return NULL;
+    }
+
+  success = gpu->impl->gpu_share (gpu, share, &local_error);
+  CG_PRIV_HANDLE_BACKEND_ERROR (success, error, local_error, gpu, NULL);
+
+  return g_steal_pointer (&gpu);
+}
+
+CgGpu *
+cg_gpu_new_headless (guint32 flags,
+                     int device,
+                     GError **error)
+{
+#ifdef USE_EGL
+  gpointer headless = NULL;
+  CgGpu *gpu = NULL;
+
+  headless = cg_priv_egl_headless_new (device, error);
+  if (headless == NULL)
+    return NULL;
+
+  flags &= ~CG_INIT_FLAG_BACKEND_VULKAN;
+  flags |= CG_INIT_FLAG_BACKEND_OPENGL | CG_INIT_FLAG_NO_FALLBACK;
+
+  gpu = cg_gpu_new (flags, cg_priv_egl_get_loader (), error);
+  if (gpu == NULL)
+    {
+      cg_priv_egl_headless_free (headless);
+      return NULL;
+    }
+  gpu->headless = headless;
+
+  return gpu;
+#else
+  g_set_error (
+      error, CG_ERROR, CG_ERROR_NOT_SUPPORTED,
+      "Headless contexts require building with EGL");
+  return NULL;
+#endif
+}
+
+#if defined(USE_EGL) && defined(G_OS_UNIX)
+/* The number of threads in this process,
+ * or 0 where the system doesn't say */
+static guint
+count_threads (void)
+{
+  FILE *status = NULL;
+  char line[256] = { 0 };
+  guint n_threads = 0;
+
+  status = fopen ("/proc/self/status", "r");
+  if (status == NULL)
+    return 0;
+
+  while (fgets (line, sizeof (line), status) != NULL)
+    {
+      if (sscanf (line, "Threads: %u", &n_threads) == 1)
+        break;
+    }
+  fclose (status);
+
+  return n_threads;
+}
+
+static gboolean
+run_worker (guint32 flags,
+            int device,
+            guint index,
+            guint n_workers,
+            CgWorkerFunc func,
+            gpointer user_data)
+{
+  g_autoptr (CgGpu) gpu = NULL;
+  g_autoptr (GError) local_error = NULL;
+  gboolean success = FALSE;
+
+  gpu = cg_gpu_new_headless (flags, device, &local_error);
+  if (gpu == NULL)
+    {
+      CG_PRIV_CRITICAL ("Worker %u: %s", index, local_error->message);
+      return FALSE;
+    }
+
+  cg_gpu_steal_this_thread (gpu);
+  success = func (gpu, index, n_workers, user_data, &local_error);
+  if (!success)
+    CG_PRIV_CRITICAL (
+        "Worker %u: %s", index,
+        local_error != NULL ? local_error->message : "failed");
+  cg_gpu_release_this_thread (gpu);
+
+  return success;
+}
+#endif
+
+gboolean
+cg_gpu_run_headless_workers (
+    guint32 flags,
+    int device,
+    guint n_workers,
+    CgWorkerFunc func,
+    gpointer user_data,
+    GError **error)
+{
+#if defined(USE_EGL) && defined(G_OS_UNIX)
+  g_autofree pid_t *pids = NULL;
+  guint n_threads = 0;
+  guint n_started = 0;
+  guint n_failed = 0;
+
+  g_return_val_if_fail (n_workers > 0, FALSE);
+  g_return_val_if_fail (func != NULL, FALSE);
+
+  /* A forked child only has the forking thread, and any
+   * lock another thread held stays locked in it forever,
+   * including those inside malloc and the driver */
+  n_threads = count_threads ();
+  if (n_threads > 1)
+    {
+      g_set_error (
+          error, CG_ERROR, CG_ERROR_NOT_SUPPORTED,
+          "Headless workers must start before other threads, "
+          "but this process has %u",
+          n_threads);
+      return FALSE;
+    }
+
+  pids = g_new0 (pid_t, n_workers);
+
+  for (; n_started < n_workers; n_started++)
+    {
+      pid_t pid = fork ();
+
+      if (pid < 0)
+        break;
+      if (pid == 0)
+        /* Skip atexit handlers that belong to the parent */
+        _exit (run_worker (flags, device, n_started, n_workers, func, user_data) ? 0 : 1);
+
+      pids[n_started] = pid;
+    }
+
+  for (guint i = 0; i < n_started; i++)
+    {
+      int status = 0;
+      pid_t result = 0;
+
+      do
+        result = waitpid (pids[i], &status, 0);
+      while (result < 0 && errno == EINTR);
+
+      if (result < 0
+          || !WIFEXITED (status)
+          || WEXITSTATUS (status) != 0)
+        n_failed++;
+    }
+
+  if (n_started < n_workers)
+    {
+      g_set_error (
+          error, CG_ERROR, CG_ERROR_FAILED_INIT,
+          "Could only start %u of %u workers",
+          n_started, n_workers);
+      return FALSE;
+    }
+  if (n_failed > 0)
+    {
+      g_set_error (
+          error, CG_ERROR, CG_ERROR_FAILED_INIT,
+          "%u of %u workers failed",
+          n_failed, n_workers);
+      return FALSE;
+    }
+
+  return TRUE;
+#else
+  g_set_error (
+      error, CG_ERROR, CG_ERROR_NOT_SUPPORTED,
+      "Headless workers require building with EGL on a Unix system");
+  return FALSE;
+#endif
+}
+
 CgGpu *
 cg_gpu_ref (CgGpu *self)
 {
@@ -252,66 +473,116 @@ cg_gpu_flush (CgGpu *self, GError **error)
 static void
 plan_init (CgPlan *self)
 {
+  self->nodes = cg_priv_nodes_new ();
+  self->cur_node = CG_PRIV_NO_NODE;
 }
 
-static gboolean
-destroy_instr_node_data (GNode *node,
-                         gpointer user_data)
+void
+cg_priv_clear_instr (CgPrivInstr *self)
 {
-  CgPrivInstr *instr = node->data;
-
-  if (instr != NULL)
+  switch (self->type)
     {
-      switch (instr->type)
+    case CG_PRIV_INSTR_PASS:
+      g_clear_pointer (&self->pass.shader, cg_shader_unref);
+      g_clear_pointer (&self->pass.targets, g_array_unref);
+      g_clear_pointer (&self->pass.attributes, g_hash_table_unref);
+      g_clear_pointer (&self->pass.uniforms.hash, g_hash_table_unref);
+      g_clear_pointer (&self->pass.uniforms.order, g_ptr_array_unref);
+      break;
+    case CG_PRIV_INSTR_VERTICES:
+      if (self->vertices.n_buffers > 1)
         {
-        case CG_PRIV_INSTR_PASS:
-          g_clear_pointer (&instr->pass.shader, cg_shader_unref);
-          g_clear_pointer (&instr->pass.targets, g_array_unref);
-          g_clear_pointer (&instr->pass.attributes, g_hash_table_unref);
-          g_clear_pointer (&instr->pass.uniforms.hash, g_hash_table_unref);
-          g_clear_pointer (&instr->pass.uniforms.order, g_ptr_array_unref);
-          break;
-        case CG_PRIV_INSTR_VERTICES:
-          if (instr->vertices.n_buffers > 1)
-            {
-              for (guint i = 0; i < instr->vertices.n_buffers; i++)
-                cg_buffer_unref (instr->vertices.many_buffers[i]);
-              g_free (instr->vertices.many_buffers);
-            }
-          else
-            g_clear_pointer (&instr->vertices.one_buffer, cg_buffer_unref);
-          break;
-        case CG_PRIV_INSTR_BLIT:
-          g_clear_pointer (&instr->blit.src, cg_texture_unref);
-          break;
-        default:
-          g_assert_not_reached ();
+          for (guint i = 0; i < self->vertices.n_buffers; i++)
+            cg_buffer_unref (self->vertices.many_buffers[i]);
+          g_free (self->vertices.many_buffers);
         }
+      else
+        g_clear_pointer (&self->vertices.one_buffer, cg_buffer_unref);
+      g_clear_pointer (&self->vertices.indices, cg_buffer_unref);
+      break;
+    case CG_PRIV_INSTR_BLIT:
+      g_clear_pointer (&self->blit.src, cg_texture_unref);
+      break;
+    case CG_PRIV_INSTR_DEPTH_PYRAMID:
+      g_clear_pointer (&self->depth_pyramid.depth, cg_texture_unref);
+      g_clear_pointer (&self->depth_pyramid.pyramid, cg_texture_unref);
+      break;
+    default:
+      g_assert_not_reached ();
+    }
 
-      if (instr->user_data != NULL
-          && instr->destroy_user_data != NULL)
-        instr->destroy_user_data (instr->user_data);
+  if (self->user_data != NULL
+      && self->destroy_user_data != NULL)
+    self->destroy_user_data (self->user_data);
+  self->user_data = NULL;
+}
 
-      g_free (instr);
-    }
+static void
+clear_node (gpointer data)
+{
+  CgPrivNode *node = data;
 
-  /* Keep going */
-  return FALSE;
+  cg_priv_clear_instr (&node->instr);
 }
 
-void
-cg_priv_destroy_instr_node (GNode *self)
+GArray *
+cg_priv_nodes_new (void)
+{
+  GArray *nodes = NULL;
+
+  nodes = g_array_new (FALSE, TRUE, sizeof (CgPrivNode));
+  g_array_set_clear_func (nodes, clear_node);
+
+  return nodes;
+}
+
+guint
+cg_priv_nodes_append (
+    GArray *nodes,
+    guint parent)
 {
-  g_node_traverse (
-      self, G_PRE_ORDER, G_TRAVERSE_ALL,
-      -1, destroy_instr_node_data, NULL);
-  g_node_destroy (self);
+  guint idx = nodes->len;
+  CgPrivNode *node = NULL;
+
+  /* Zero filled */
+  g_array_set_size (nodes, idx + 1);
+
+  node = CG_PRIV_NODE (nodes, idx);
+  node->parent = parent;
+  node->prev_sibling = CG_PRIV_NO_NODE;
+  node->next_sibling = CG_PRIV_NO_NODE;
+  node->first_child = CG_PRIV_NO_NODE;
+  node->last_child = CG_PRIV_NO_NODE;
+  node->level = 0;
+
+  if (parent != CG_PRIV_NO_NODE)
+    {
+      CgPrivNode *parent_node = CG_PRIV_NODE (nodes, parent);
+
+      node->level = parent_node->level + 1;
+
+      if (parent_node->last_child != CG_PRIV_NO_NODE)
+        {
+          node->prev_sibling = parent_node->last_child;
+          CG_PRIV_NODE (nodes, parent_node->last_child)->next_sibling = idx;
+        }
+      else
+        parent_node->first_child = idx;
+      parent_node->last_child = idx;
+    }
+
+  return idx;
 }
 
 void
 cg_priv_plan_finish (CgPlan *self)
 {
-  g_clear_pointer (&self->root_instr, cg_priv_destroy_instr_node);
+  if (self->configuring != NULL)
+    {
+      cg_priv_clear_instr (self->configuring);
+      g_clear_pointer (&self->configuring, g_free);
+    }
+  g_clear_pointer (&self->nodes, g_array_unref);
   g_clear_pointer (&self->gpu, cg_gpu_unref);
 }
 
@@ -325,6 +596,11 @@ cg_priv_shader_finish (CgShader *self)
 {
   g_clear_pointer (&self->init.fragment_code, g_free);
   g_clear_pointer (&self->init.vertex_code, g_free);
+  g_clear_pointer (&self->init.vertex_spirv, g_bytes_unref);
+  g_clear_pointer (&self->init.fragment_spirv, g_bytes_unref);
+  g_clear_pointer (&self->init.entry_point, g_free);
+  g_clear_pointer (&self->init.constant_ids, g_free);
+  g_clear_pointer (&self->init.constant_values, g_free);
   g_clear_pointer (&self->gpu, cg_gpu_unref);
 }
 
@@ -431,6 +707,63 @@ cg_shader_new_for_code (
   return g_steal_pointer (&shader);
 }
 
+CgShader *
+cg_shader_new_for_spirv (
+    CgGpu *self,
+    gconstpointer vertex_spirv,
+    gsize vertex_size,
+    gconstpointer fragment_spirv,
+    gsize fragment_size,
+    const char *entry_point)
+{
+  g_autoptr (CgShader) shader = NULL;
+
+  g_return_val_if_fail (self != NULL, NULL);
+  g_return_val_if_fail (vertex_spirv != NULL, NULL);
+  g_return_val_if_fail (vertex_size > 0 && vertex_size % 4 == 0, NULL);
+  g_return_val_if_fail (fragment_spirv != NULL, NULL);
+  g_return_val_if_fail (fragment_size > 0 && fragment_size % 4 == 0, NULL);
+
+  shader = shader_new (self);
+
+  shader->init.vertex_spirv = g_bytes_new (vertex_spirv, vertex_size);
+  shader->init.fragment_spirv = g_bytes_new (fragment_spirv, fragment_size);
+  shader->init.entry_point = g_strdup (entry_point != NULL ? entry_point : "main");
+
+  return g_steal_pointer (&shader);
+}
+
+CgShader *
+cg_shader_new_specialized (
+    CgShader *self,
+    const guint *constant_ids,
+    const guint *constant_values,
+    guint n_constants)
+{
+  g_autoptr (CgShader) shader = NULL;
+
+  g_return_val_if_fail (self != NULL, NULL);
+  g_return_val_if_fail (self->init.vertex_spirv != NULL, NULL);
+  g_return_val_if_fail (constant_ids != NULL || n_constants == 0, NULL);
+  g_return_val_if_fail (constant_values != NULL || n_constants == 0, NULL);
+
+  shader = shader_new (self->gpu);
+
+  /* The binaries are immutable, so variants share them */
+  shader->init.vertex_spirv = g_bytes_ref (self->init.vertex_spirv);
+  shader->init.fragment_spirv = g_bytes_ref (self->init.fragment_spirv);
+  shader->init.entry_point = g_strdup (self->init.entry_point);
+
+  if (n_constants > 0)
+    {
+      shader->init.constant_ids = g_memdup2 (constant_ids, n_constants * sizeof (guint));
+      shader->init.constant_values = g_memdup2 (constant_values, n_constants * sizeof (guint));
+      shader->init.n_constants = n_constants;
+    }
+
+  return g_steal_pointer (&shader);
+}
+
 static void
 hint_buffer_layout (
     CgBuffer *self,
@@ -439,14 +772,7 @@ hint_buffer_layout (
 {
   g_autofree CgDataSegment *segments_dup = NULL;
 
-  segments_dup = g_malloc0_n (spec_length, sizeof (*spec));
-  for (guint i = 0; i < spec_length; i++)
-    {
-      segments_dup[i].name = g_strdup (spec[i].name);
-      segments_dup[i].num = spec[i].num;
-      segments_dup[i].type = spec[i].type;
-      segments_dup[i].instance_rate = spec[i].instance_rate;
-    }
+  segments_dup = cg_priv_copy_data_layout (spec, spec_length);
 
   cg_priv_clear_data_layout (self->spec, self->spec_length);
   CG_PRIV_REPLACE_POINTER (&self->spec, g_steal_pointer (&segments_dup), g_free);
@@ -467,6 +793,7 @@ cg_buffer_new_for_data (
   g_return_val_if_fail (data != NULL, NULL);
   g_return_val_if_fail (size > 0, NULL);
   g_return_val_if_fail (spec != NULL || spec_length == 0, NULL);
+  g_return_val_if_fail (spec == NULL || cg_priv_check_data_layout (spec, spec_length), NULL);
 
   buffer = buffer_new (self);
   buffer->init.data = g_memdup2 (data, size);
@@ -492,6 +819,7 @@ cg_buffer_new_for_data_take (
   g_return_val_if_fail (data != NULL, NULL);
   g_return_val_if_fail (size > 0, NULL);
   g_return_val_if_fail (spec != NULL || spec_length == 0, NULL);
+  g_return_val_if_fail (spec == NULL || cg_priv_check_data_layout (spec, spec_length), NULL);
 
   buffer = buffer_new (self);
   buffer->init.data = data;
@@ -503,6 +831,58 @@ cg_buffer_new_for_data_take (
   return g_steal_pointer (&buffer);
 }
 
+static inline gboolean
+is_index_format (int format)
+{
+  return format == CG_COMPONENT_UINT8 ||
+         format == CG_COMPONENT_UINT16 ||
+         format == CG_COMPONENT_UINT32;
+}
+
+CgBuffer *
+cg_buffer_new_for_indices (
+    CgGpu *self,
+    gconstpointer data,
+    gsize size,
+    int format)
+{
+  g_autoptr (CgBuffer) buffer = NULL;
+
+  g_return_val_if_fail (self != NULL, NULL);
+  g_return_val_if_fail (data != NULL, NULL);
+  g_return_val_if_fail (size > 0, NULL);
+  g_return_val_if_fail (is_index_format (format), NULL);
+
+  buffer = buffer_new (self);
+  buffer->init.data = g_memdup2 (data, size);
+  buffer->init.size = size;
+  buffer->index_format = format;
+
+  return g_steal_pointer (&buffer);
+}
+
+CgBuffer *
+cg_buffer_new_for_indices_take (
+    CgGpu *self,
+    gpointer data,
+    gsize size,
+    int format)
+{
+  g_autoptr (CgBuffer) buffer = NULL;
+
+  g_return_val_if_fail (self != NULL, NULL);
+  g_return_val_if_fail (data != NULL, NULL);
+  g_return_val_if_fail (size > 0, NULL);
+  g_return_val_if_fail (is_index_format (format), NULL);
+
+  buffer = buffer_new (self);
+  buffer->init.data = data;
+  buffer->init.size = size;
+  buffer->index_format = format;
+
+  return g_steal_pointer (&buffer);
+}
+
 CgTexture *
 cg_texture_new_for_data (
     CgGpu *self,
@@ -651,58 +1031,318 @@ cg_texture_new_depth (
   texture->init.width = width;
   texture->init.height = height;
   texture->init.format = CG_PRIV_FORMAT_DEPTH;
+  texture->init.depth_format = CG_DEPTH_FORMAT_0;
   texture->init.mipmaps = 0;
   texture->init.msaa = msaa;
 
   return g_steal_pointer (&texture);
 }
 
-void
-cg_plan_begin_config (CgPlan *self)
+CgTexture *
+cg_texture_new_depth_for_format (
+    CgGpu *self,
+    int width,
+    int height,
+    int format,
+    int msaa)
 {
-  CgPrivInstr *instr = NULL;
+  g_autoptr (CgTexture) texture = NULL;
 
-  g_return_if_fail (self != NULL);
-  g_return_if_fail (self->configuring == NULL);
+  g_return_val_if_fail (self != NULL, NULL);
+  g_return_val_if_fail (width > 0, NULL);
+  g_return_val_if_fail (height > 0, NULL);
+  g_return_val_if_fail (format > CG_DEPTH_FORMAT_0 && format < CG_N_DEPTH_FORMATS, NULL);
+  g_return_val_if_fail (msaa >= 0, NULL);
 
-  instr = CG_PRIV_CREATE (instr);
-  instr->depth = self->cur_instr != NULL ? ((CgPrivInstr *)self->cur_instr->data)->depth + 1 : 0;
-  instr->type = CG_PRIV_INSTR_PASS;
+  texture = texture_new (self);
 
-  instr->pass.targets = g_array_new (FALSE, TRUE, sizeof (CgPrivTarget));
-  g_array_set_clear_func (instr->pass.targets, cg_priv_clear_target);
-  instr->pass.uniforms.hash = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, cg_priv_destroy_value);
-  instr->pass.uniforms.order = g_ptr_array_new ();
-  instr->pass.attributes = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
-  instr->pass.write_mask.val = 0;
-  instr->pass.write_mask.set = FALSE;
-  instr->pass.depth_test_func.val = CG_TEST_FUNC_0;
-  instr->pass.depth_test_func.set = FALSE;
-  instr->pass.dest.set = FALSE;
-  instr->pass.clockwise_faces.val = FALSE;
-  instr->pass.clockwise_faces.set = FALSE;
-  instr->pass.backface_cull.val = TRUE;
-  instr->pass.backface_cull.set = FALSE;
+  texture->init.cubemap = FALSE;
+  texture->init.data = NULL;
+  texture->init.width = width;
+  texture->init.height = height;
+  texture->init.format = CG_PRIV_FORMAT_DEPTH;
+  texture->init.depth_format = format;
+  texture->init.mipmaps = 0;
+  texture->init.msaa = msaa;
 
-  self->configuring = instr;
+  return g_steal_pointer (&texture);
 }
 
-static void
-config_targets (CgPlan *self,
-                const CgValue *const *targets,
-                guint n_targets)
+CgTexture *
+cg_texture_new_depth_pyramid (
+    CgGpu *self,
+    int width,
+    int height)
 {
-  guint old_length = 0;
+  g_autoptr (CgTexture) texture = NULL;
 
-  g_assert (self->configuring != NULL);
-  g_assert (self->configuring->type == CG_PRIV_INSTR_PASS);
+  g_return_val_if_fail (self != NULL, NULL);
+  g_return_val_if_fail (width > 0, NULL);
+  g_return_val_if_fail (height > 0, NULL);
 
-  old_length = self->configuring->pass.targets->len;
-  g_array_set_size (self->configuring->pass.targets, old_length + n_targets);
+  texture = texture_new (self);
 
-  for (guint i = 0; i < n_targets; i++)
-    {
-      CgPrivTarget *target = NULL;
+  texture->init.cubemap = FALSE;
+  texture->init.data = NULL;
+  texture->init.width = width;
+  texture->init.height = height;
+  texture->init.format = CG_FORMAT_R32;
+  texture->init.mipmaps = g_bit_storage (MAX (width, height));
+  texture->init.msaa = 0;
+
+  return g_steal_pointer (&texture);
+}
+
+CgTexture *
+cg_texture_new_for_native_texture (
+    CgGpu *self,
+    guint64 native,
+    int width,
+    int height,
+    int format,
+    int msaa)
+{
+  g_autoptr (CgTexture) texture = NULL;
+
+  g_return_val_if_fail (self != NULL, NULL);
+  g_return_val_if_fail (native != 0, NULL);
+  g_return_val_if_fail (width > 0, NULL);
+  g_return_val_if_fail (height > 0, NULL);
+  g_return_val_if_fail (format > CG_FORMAT_0 && format < CG_N_FORMATS, NULL);
+  g_return_val_if_fail (msaa >= 0, NULL);
+
+  texture = texture_new (self);
+
+  texture->init.cubemap = FALSE;
+  texture->init.data = NULL;
+  texture->init.width = width;
+  texture->init.height = height;
+  texture->init.format = format;
+  texture->init.mipmaps = 1;
+  texture->init.msaa = msaa;
+  texture->init.native = TRUE;
+  texture->init.native_handle = native;
+
+  return g_steal_pointer (&texture);
+}
+
+CgTexture *
+cg_texture_new_for_native_framebuffer (
+    CgGpu *self,
+    guint64 native,
+    int width,
+    int height,
+    int format)
+{
+  g_autoptr (CgTexture) texture = NULL;
+
+  g_return_val_if_fail (self != NULL, NULL);
+  g_return_val_if_fail (width > 0, NULL);
+  g_return_val_if_fail (height > 0, NULL);
+  g_return_val_if_fail (format > CG_FORMAT_0 && format < CG_N_FORMATS, NULL);
+
+  texture = texture_new (self);
+
+  texture->init.cubemap = FALSE;
+  texture->init.data = NULL;
+  texture->init.width = width;
+  texture->init.height = height;
+  texture->init.format = format;
+  texture->init.mipmaps = 1;
+  texture->init.msaa = 0;
+  texture->init.native = TRUE;
+  texture->init.native_framebuffer = TRUE;
+  texture->init.native_handle = native;
+
+  return g_steal_pointer (&texture);
+}
+
+void
+cg_dmabuf_clear (CgDmabuf *self)
+{
+  g_return_if_fail (self != NULL);
+
+#ifdef G_OS_UNIX
+  for (guint i = 0; i < G_N_ELEMENTS (self->fds); i++)
+    {
+      if (self->fds[i] >= 0)
+        close (self->fds[i]);
+      self->fds[i] = -1;
+    }
+#endif
+  self->n_planes = 0;
+}
+
+CgTexture *
+cg_texture_new_for_dmabuf (
+    CgGpu *self,
+    const CgDmabuf *dmabuf,
+    GError **error)
+{
+  g_autoptr (CgTexture) texture = NULL;
+  gboolean success = FALSE;
+  g_autoptr (GError) local_error = NULL;
+
+  g_return_val_if_fail (self != NULL, NULL);
+  g_return_val_if_fail (dmabuf != NULL, NULL);
+  g_return_val_if_fail (dmabuf->width > 0 && dmabuf->height > 0, NULL);
+  g_return_val_if_fail (dmabuf->n_planes > 0 && dmabuf->n_planes <= CG_DMABUF_MAX_PLANES, NULL);
+
+  texture = texture_new (self);
+
+  texture->init.cubemap = FALSE;
+  texture->init.data = NULL;
+  texture->init.width = dmabuf->width;
+  texture->init.height = dmabuf->height;
+  texture->init.format = CG_FORMAT_RGBA8;
+  texture->init.mipmaps = 1;
+  texture->init.msaa = 0;
+
+  CG_PRIV_TRY_ENTER_ORELSE_RETURN_VAL (self, NULL);
+  success = self->impl->texture_import_dmabuf (texture, dmabuf, &local_error);
+  CG_PRIV_LEAVE (self);
+
+  CG_PRIV_HANDLE_BACKEND_ERROR (success, error, local_error, self, NULL);
+
+  return g_steal_pointer (&texture);
+}
+
+gboolean
+cg_texture_export_dmabuf (
+    CgTexture *self,
+    CgDmabuf *dmabuf,
+    GError **error)
+{
+  gboolean success = FALSE;
+  g_autoptr (GError) local_error = NULL;
+
+  g_return_val_if_fail (self != NULL, FALSE);
+  g_return_val_if_fail (dmabuf != NULL, FALSE);
+  g_return_val_if_fail (!self->init.cubemap, FALSE);
+  g_return_val_if_fail (self->init.msaa == 0, FALSE);
+  g_return_val_if_fail (self->init.format != CG_PRIV_FORMAT_DEPTH, FALSE);
+  g_return_val_if_fail (!self->init.native_framebuffer, FALSE);
+
+  CG_PRIV_TRY_ENTER_ORELSE_RETURN_VAL (self->gpu, FALSE);
+  success = self->gpu->impl->texture_export_dmabuf (self, dmabuf, &local_error);
+  CG_PRIV_LEAVE (self->gpu);
+
+  CG_PRIV_HANDLE_BACKEND_ERROR (success, error, local_error, self->gpu, FALSE);
+
+  return TRUE;
+}
+
+gboolean
+cg_texture_update_region (
+    CgTexture *self,
+    int x,
+    int y,
+    int width,
+    int height,
+    gconstpointer data,
+    GError **error)
+{
+  gboolean success = FALSE;
+  g_autoptr (GError) local_error = NULL;
+
+  g_return_val_if_fail (self != NULL, FALSE);
+  g_return_val_if_fail (data != NULL, FALSE);
+  g_return_val_if_fail (!self->init.cubemap, FALSE);
+  g_return_val_if_fail (self->init.msaa == 0, FALSE);
+  g_return_val_if_fail (self->init.format != CG_PRIV_FORMAT_DEPTH, FALSE);
+  g_return_val_if_fail (!self->init.native_framebuffer, FALSE);
+  g_return_val_if_fail (x >= 0 && y >= 0 && width > 0 && height > 0, FALSE);
+  g_return_val_if_fail (x + width <= self->init.width, FALSE);
+  g_return_val_if_fail (y + height <= self->init.height, FALSE);
+
+  CG_PRIV_TRY_ENTER_ORELSE_RETURN_VAL (self->gpu, FALSE);
+  success = self->gpu->impl->texture_update (
+      self, x, y, width, height, data, &local_error);
+  CG_PRIV_LEAVE (self->gpu);
+
+  CG_PRIV_HANDLE_BACKEND_ERROR (success, error, local_error, self->gpu, FALSE);
+
+  return TRUE;
+}
+
+gboolean
+cg_texture_download (
+    CgTexture *self,
+    gpointer data,
+    gsize size,
+    GError **error)
+{
+  gboolean success = FALSE;
+  g_autoptr (GError) local_error = NULL;
+
+  g_return_val_if_fail (self != NULL, FALSE);
+  g_return_val_if_fail (data != NULL, FALSE);
+  g_return_val_if_fail (!self->init.cubemap, FALSE);
+  g_return_val_if_fail (self->init.msaa == 0, FALSE);
+  g_return_val_if_fail (self->init.format != CG_PRIV_FORMAT_DEPTH, FALSE);
+  g_return_val_if_fail (!self->init.native_framebuffer, FALSE);
+
+  CG_PRIV_TRY_ENTER_ORELSE_RETURN_VAL (self->gpu, FALSE);
+  success = self->gpu->impl->texture_download (
+      self, data, size, &local_error);
+  CG_PRIV_LEAVE (self->gpu);
+
+  CG_PRIV_HANDLE_BACKEND_ERROR (success, error, local_error, self->gpu, FALSE);
+
+  return TRUE;
+}
+
+void
+cg_plan_begin_config (CgPlan *self)
+{
+  CgPrivInstr *instr = NULL;
+
+  g_return_if_fail (self != NULL);
+  g_return_if_fail (self->configuring == NULL);
+
+  instr = CG_PRIV_CREATE (instr);
+  instr->depth = self->cur_node != CG_PRIV_NO_NODE
+                     ? CG_PRIV_NODE_INSTR (self->nodes, self->cur_node)->depth + 1
+                     : 0;
+  instr->type = CG_PRIV_INSTR_PASS;
+
+  instr->pass.targets = g_array_new (FALSE, TRUE, sizeof (CgPrivTarget));
+  g_array_set_clear_func (instr->pass.targets, cg_priv_clear_target);
+  instr->pass.uniforms.hash = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, cg_priv_destroy_value);
+  instr->pass.uniforms.order = g_ptr_array_new ();
+  instr->pass.attributes = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  instr->pass.write_mask.val = 0;
+  instr->pass.write_mask.set = FALSE;
+  instr->pass.depth_test_func.val = CG_TEST_FUNC_0;
+  instr->pass.depth_test_func.set = FALSE;
+  instr->pass.dest.set = FALSE;
+  instr->pass.clockwise_faces.val = FALSE;
+  instr->pass.clockwise_faces.set = FALSE;
+  instr->pass.backface_cull.val = TRUE;
+  instr->pass.backface_cull.set = FALSE;
+  instr->pass.stencil_func.val = CG_TEST_FUNC_0;
+  instr->pass.stencil_func.set = FALSE;
+  instr->pass.stencil_ops.set = FALSE;
+
+  self->configuring = instr;
+}
+
+static void
+config_targets (CgPlan *self,
+                const CgValue *const *targets,
+                guint n_targets)
+{
+  guint old_length = 0;
+
+  g_assert (self->configuring != NULL);
+  g_assert (self->configuring->type == CG_PRIV_INSTR_PASS);
+
+  old_length = self->configuring->pass.targets->len;
+  g_array_set_size (self->configuring->pass.targets, old_length + n_targets);
+
+  for (guint i = 0; i < n_targets; i++)
+    {
+      CgPrivTarget *target = NULL;
 
       target = &g_array_index (self->configuring->pass.targets, CgPrivTarget, old_length + i);
 
@@ -936,15 +1576,64 @@ cg_plan_config_backface_cull (
   self->configuring->pass.backface_cull.set = TRUE;
 }
 
+void
+cg_plan_config_stencil_func (
+    CgPlan *self,
+    int func,
+    guint32 ref,
+    guint32 mask)
+{
+  g_return_if_fail (self != NULL);
+  g_return_if_fail (self->configuring != NULL);
+  g_return_if_fail (func > CG_TEST_FUNC_0 && func < CG_N_TEST_FUNCS);
+
+  self->configuring->pass.stencil_func.val = func;
+  self->configuring->pass.stencil_func.ref = ref;
+  self->configuring->pass.stencil_func.mask = mask;
+  self->configuring->pass.stencil_func.set = TRUE;
+}
+
+void
+cg_plan_config_stencil_ops (
+    CgPlan *self,
+    int stencil_fail,
+    int depth_fail,
+    int pass)
+{
+  g_return_if_fail (self != NULL);
+  g_return_if_fail (self->configuring != NULL);
+  g_return_if_fail (stencil_fail > CG_STENCIL_OP_0 && stencil_fail < CG_N_STENCIL_OPS);
+  g_return_if_fail (depth_fail > CG_STENCIL_OP_0 && depth_fail < CG_N_STENCIL_OPS);
+  g_return_if_fail (pass > CG_STENCIL_OP_0 && pass < CG_N_STENCIL_OPS);
+
+  self->configuring->pass.stencil_ops.val[0] = stencil_fail;
+  self->configuring->pass.stencil_ops.val[1] = depth_fail;
+  self->configuring->pass.stencil_ops.val[2] = pass;
+  self->configuring->pass.stencil_ops.set = TRUE;
+}
+
+static guint
+push_configuring (CgPlan *self,
+                  guint parent)
+{
+  guint idx = 0;
+
+  idx = cg_priv_nodes_append (self->nodes, parent);
+  *CG_PRIV_NODE_INSTR (self->nodes, idx) = *self->configuring;
+  g_clear_pointer (&self->configuring, g_free);
+
+  return idx;
+}
+
 void
 cg_plan_push_group (CgPlan *self)
 {
   g_return_if_fail (self != NULL);
   g_return_if_fail (self->configuring != NULL);
 
-  if (self->cur_instr != NULL)
+  if (self->cur_node != CG_PRIV_NO_NODE)
     {
-      CgPrivInstr *parent_pass = self->cur_instr->data;
+      CgPrivInstr *parent_pass = CG_PRIV_NODE_INSTR (self->nodes, self->cur_node);
 
       self->configuring->pass.fake = TRUE;
 
@@ -957,7 +1646,10 @@ cg_plan_push_group (CgPlan *self)
         self->configuring->pass.fake = FALSE;
 
       if (self->configuring->pass.shader == NULL)
-        self->configuring->pass.shader = cg_shader_ref (parent_pass->pass.shader);
+        {
+          if (parent_pass->pass.shader != NULL)
+            self->configuring->pass.shader = cg_shader_ref (parent_pass->pass.shader);
+        }
       else
         self->configuring->pass.fake = FALSE;
 
@@ -981,9 +1673,19 @@ cg_plan_push_group (CgPlan *self)
       if (!self->configuring->pass.backface_cull.set)
         self->configuring->pass.backface_cull.val = parent_pass->pass.backface_cull.val;
 
-      self->cur_instr = g_node_append_data (
-          self->cur_instr,
-          g_steal_pointer (&self->configuring));
+      if (!self->configuring->pass.stencil_func.set)
+        {
+          self->configuring->pass.stencil_func.val = parent_pass->pass.stencil_func.val;
+          self->configuring->pass.stencil_func.ref = parent_pass->pass.stencil_func.ref;
+          self->configuring->pass.stencil_func.mask = parent_pass->pass.stencil_func.mask;
+        }
+
+      if (!self->configuring->pass.stencil_ops.set)
+        memcpy (self->configuring->pass.stencil_ops.val,
+                parent_pass->pass.stencil_ops.val,
+                sizeof (self->configuring->pass.stencil_ops.val));
+
+      self->cur_node = push_configuring (self, self->cur_node);
     }
   else
     {
@@ -1009,12 +1711,23 @@ cg_plan_push_group (CgPlan *self)
           self->configuring->pass.backface_cull.val = TRUE;
           self->configuring->pass.backface_cull.set = TRUE;
         }
+      if (!self->configuring->pass.stencil_func.set)
+        {
+          self->configuring->pass.stencil_func.val = CG_TEST_ALWAYS;
+          self->configuring->pass.stencil_func.ref = 0;
+          self->configuring->pass.stencil_func.mask = 0xff;
+          self->configuring->pass.stencil_func.set = TRUE;
+        }
+      if (!self->configuring->pass.stencil_ops.set)
+        {
+          for (guint i = 0; i < G_N_ELEMENTS (self->configuring->pass.stencil_ops.val); i++)
+            self->configuring->pass.stencil_ops.val[i] = CG_STENCIL_OP_KEEP;
+          self->configuring->pass.stencil_ops.set = TRUE;
+        }
 
-      CG_PRIV_REPLACE_POINTER (
-          &self->root_instr,
-          g_node_new (g_steal_pointer (&self->configuring)),
-          cg_priv_destroy_instr_node);
-      self->cur_instr = self->root_instr;
+      /* A new root replaces whatever was there */
+      g_array_set_size (self->nodes, 0);
+      self->cur_node = push_configuring (self, CG_PRIV_NO_NODE);
     }
 }
 
@@ -1063,6 +1776,36 @@ set_backface_cull_from_value (CgPlan *self,
   cg_plan_config_backface_cull (self, value->b);
 }
 
+static void
+set_stencil_func_from_value (CgPlan *self,
+                             const CgValue *value)
+{
+  g_return_if_fail (value->type == CG_TYPE_TUPLE3
+                    && value->tuple3[0]->type == CG_TYPE_INT
+                    && value->tuple3[1]->type == CG_TYPE_UINT
+                    && value->tuple3[2]->type == CG_TYPE_UINT);
+  cg_plan_config_stencil_func (
+      self,
+      value->tuple3[0]->i,
+      value->tuple3[1]->ui,
+      value->tuple3[2]->ui);
+}
+
+static void
+set_stencil_ops_from_value (CgPlan *self,
+                            const CgValue *value)
+{
+  g_return_if_fail (value->type == CG_TYPE_TUPLE3
+                    && value->tuple3[0]->type == CG_TYPE_INT
+                    && value->tuple3[1]->type == CG_TYPE_INT
+                    && value->tuple3[2]->type == CG_TYPE_INT);
+  cg_plan_config_stencil_ops (
+      self,
+      value->tuple3[0]->i,
+      value->tuple3[1]->i,
+      value->tuple3[2]->i);
+}
+
 void
 cg_plan_push_state (
     CgPlan *self,
@@ -1118,6 +1861,12 @@ cg_plan_push_state (
         case CG_STATE_BACKFACE_CULL:
           set_backface_cull_from_value (self, value);
           break;
+        case CG_STATE_STENCIL_FUNC:
+          set_stencil_func_from_value (self, value);
+          break;
+        case CG_STATE_STENCIL_OPS:
+          set_stencil_ops_from_value (self, value);
+          break;
         default:
           CG_PRIV_CRITICAL ("%d is not a recognized state enum.", key);
           break;
@@ -1140,61 +1889,42 @@ cg_plan_push_state (
 static gboolean
 validate_append (CgPlan *self)
 {
-  GNode *node = NULL;
-  gboolean has_shader = FALSE;
-  gboolean has_write_mask = FALSE;
-  gboolean has_depth_func = FALSE;
+  CgPrivInstr *instr = NULL;
 
-  g_assert (self->cur_instr != NULL);
-  node = self->cur_instr;
+  g_assert (self->cur_node != CG_PRIV_NO_NODE);
+  instr = CG_PRIV_NODE_INSTR (self->nodes, self->cur_node);
 
-  do
+  /* Inherited state was resolved when the group was pushed, and
+   * the root group always carries a write mask and depth test
+   * function, so only the shader can still be missing here. */
+  if (instr->pass.shader == NULL)
     {
-      CgPrivInstr *instr = node->data;
-
-      if (!has_shader)
-        has_shader = instr->pass.shader != NULL;
-
-      if (!has_depth_func
-          && !has_write_mask
-          && instr->pass.write_mask.set
-          && !(instr->pass.write_mask.val & CG_WRITE_MASK_DEPTH))
-        {
-          has_write_mask = TRUE;
-          has_depth_func = TRUE;
-        }
-      else
-        {
-          if (!has_write_mask)
-            has_write_mask = instr->pass.write_mask.set;
-          if (!has_depth_func)
-            has_depth_func = instr->pass.depth_test_func.set;
-        }
-
-      if (has_shader && has_write_mask && has_depth_func)
-        break;
+      CG_PRIV_CRITICAL ("Invalid append: Needs a shader");
+      return FALSE;
     }
-  while ((node = node->parent) != NULL);
 
-  if (!has_shader) CG_PRIV_CRITICAL ("Invalid append: Needs a shader");
-  if (!has_write_mask) CG_PRIV_CRITICAL ("Invalid append: Needs a write mask");
-  if (!has_depth_func) CG_PRIV_CRITICAL ("Invalid append: Needs a depth test function");
-
-  return has_shader && has_write_mask && has_depth_func;
+  return TRUE;
 }
 
 static void
 append_buffers (CgPlan *self,
+                int topology,
+                guint first_instance,
                 guint instances,
+                CgBuffer *indices,
                 CgBuffer **buffers,
                 guint n_buffers)
 {
   CgPrivInstr *instr = NULL;
+  guint idx = 0;
 
   g_assert (self->configuring == NULL);
-  g_assert (self->cur_instr != NULL);
+  g_assert (self->cur_node != CG_PRIV_NO_NODE);
 
-  instr = CG_PRIV_CREATE (instr);
+  /* Appending may move the array, so it must happen
+   * before the array is indexed */
+  idx = cg_priv_nodes_append (self->nodes, self->cur_node);
+  instr = CG_PRIV_NODE_INSTR (self->nodes, idx);
   instr->type = CG_PRIV_INSTR_VERTICES;
 
   if (n_buffers > 1)
@@ -1211,9 +1941,11 @@ append_buffers (CgPlan *self,
     instr->vertices.one_buffer = cg_buffer_ref (*buffers);
 
   instr->vertices.n_buffers = n_buffers;
+  instr->vertices.first_instance = first_instance;
   instr->vertices.instances = instances;
-
-  g_node_append_data (self->cur_instr, instr);
+  instr->vertices.topology = topology;
+  if (indices != NULL)
+    instr->vertices.indices = cg_buffer_ref (indices);
 }
 
 void
@@ -1228,7 +1960,7 @@ cg_plan_append (
 
   g_return_if_fail (self != NULL);
   g_return_if_fail (self->configuring == NULL);
-  g_return_if_fail (self->cur_instr != NULL);
+  g_return_if_fail (self->cur_node != CG_PRIV_NO_NODE);
   g_return_if_fail (instances > 0);
   g_return_if_fail (first_buffer != NULL);
   g_return_if_fail (validate_append (self));
@@ -1236,7 +1968,7 @@ cg_plan_append (
   CG_PRIV_GATHER_VA_ARGS_INTO (
       first_buffer, buffers, G_N_ELEMENTS (buffers), n_buffers);
 
-  append_buffers (self, instances, buffers, n_buffers);
+  append_buffers (self, CG_TOPOLOGY_TRIANGLES, 0, instances, NULL, buffers, n_buffers);
 }
 
 void
@@ -1248,13 +1980,132 @@ cg_plan_append_v (
 {
   g_return_if_fail (self != NULL);
   g_return_if_fail (self->configuring == NULL);
-  g_return_if_fail (self->cur_instr != NULL);
+  g_return_if_fail (self->cur_node != CG_PRIV_NO_NODE);
   g_return_if_fail (instances > 0);
   g_return_if_fail (buffers != NULL);
   g_return_if_fail (n_buffers > 0);
   g_return_if_fail (validate_append (self));
 
-  append_buffers (self, instances, buffers, n_buffers);
+  append_buffers (self, CG_TOPOLOGY_TRIANGLES, 0, instances, NULL, buffers, n_buffers);
+}
+
+void
+cg_plan_append_indexed (
+    CgPlan *self,
+    guint instances,
+    CgBuffer *indices,
+    CgBuffer *first_buffer,
+    ...)
+{
+  CgBuffer *buffers[32] = { 0 };
+  guint n_buffers = 0;
+
+  g_return_if_fail (self != NULL);
+  g_return_if_fail (self->configuring == NULL);
+  g_return_if_fail (self->cur_node != CG_PRIV_NO_NODE);
+  g_return_if_fail (instances > 0);
+  g_return_if_fail (indices != NULL);
+  g_return_if_fail (indices->index_format != 0);
+  g_return_if_fail (first_buffer != NULL);
+  g_return_if_fail (validate_append (self));
+
+  CG_PRIV_GATHER_VA_ARGS_INTO (
+      first_buffer, buffers, G_N_ELEMENTS (buffers), n_buffers);
+
+  append_buffers (self, CG_TOPOLOGY_TRIANGLES, 0, instances, indices, buffers, n_buffers);
+}
+
+void
+cg_plan_append_indexed_v (
+    CgPlan *self,
+    guint instances,
+    CgBuffer *indices,
+    CgBuffer **buffers,
+    guint n_buffers)
+{
+  g_return_if_fail (self != NULL);
+  g_return_if_fail (self->configuring == NULL);
+  g_return_if_fail (self->cur_node != CG_PRIV_NO_NODE);
+  g_return_if_fail (instances > 0);
+  g_return_if_fail (indices != NULL);
+  g_return_if_fail (indices->index_format != 0);
+  g_return_if_fail (buffers != NULL);
+  g_return_if_fail (n_buffers > 0);
+  g_return_if_fail (validate_append (self));
+
+  append_buffers (self, CG_TOPOLOGY_TRIANGLES, 0, instances, indices, buffers, n_buffers);
+}
+
+void
+cg_plan_append_primitives (
+    CgPlan *self,
+    int topology,
+    guint instances,
+    CgBuffer *indices,
+    CgBuffer *first_buffer,
+    ...)
+{
+  CgBuffer *buffers[32] = { 0 };
+  guint n_buffers = 0;
+
+  g_return_if_fail (self != NULL);
+  g_return_if_fail (self->configuring == NULL);
+  g_return_if_fail (self->cur_node != CG_PRIV_NO_NODE);
+  g_return_if_fail (topology > CG_TOPOLOGY_0 && topology < CG_N_TOPOLOGIES);
+  g_return_if_fail (instances > 0);
+  g_return_if_fail (indices == NULL || indices->index_format != 0);
+  g_return_if_fail (first_buffer != NULL);
+  g_return_if_fail (validate_append (self));
+
+  CG_PRIV_GATHER_VA_ARGS_INTO (
+      first_buffer, buffers, G_N_ELEMENTS (buffers), n_buffers);
+
+  append_buffers (self, topology, 0, instances, indices, buffers, n_buffers);
+}
+
+void
+cg_plan_append_primitives_v (
+    CgPlan *self,
+    int topology,
+    guint instances,
+    CgBuffer *indices,
+    CgBuffer **buffers,
+    guint n_buffers)
+{
+  g_return_if_fail (self != NULL);
+  g_return_if_fail (self->configuring == NULL);
+  g_return_if_fail (self->cur_node != CG_PRIV_NO_NODE);
+  g_return_if_fail (topology > CG_TOPOLOGY_0 && topology < CG_N_TOPOLOGIES);
+  g_return_if_fail (instances > 0);
+  g_return_if_fail (indices == NULL || indices->index_format != 0);
+  g_return_if_fail (buffers != NULL);
+  g_return_if_fail (n_buffers > 0);
+  g_return_if_fail (validate_append (self));
+
+  append_buffers (self, topology, 0, instances, indices, buffers, n_buffers);
+}
+
+void
+cg_plan_append_instances_v (
+    CgPlan *self,
+    int topology,
+    guint first_instance,
+    guint instances,
+    CgBuffer *indices,
+    CgBuffer **buffers,
+    guint n_buffers)
+{
+  g_return_if_fail (self != NULL);
+  g_return_if_fail (self->configuring == NULL);
+  g_return_if_fail (self->cur_node != CG_PRIV_NO_NODE);
+  g_return_if_fail (topology > CG_TOPOLOGY_0 && topology < CG_N_TOPOLOGIES);
+  g_return_if_fail (instances > 0);
+  g_return_if_fail (indices == NULL || indices->index_format != 0);
+  g_return_if_fail (buffers != NULL);
+  g_return_if_fail (n_buffers > 0);
+  g_return_if_fail (validate_append (self));
+
+  append_buffers (self, topology, first_instance, instances, indices, buffers, n_buffers);
 }
 
 void
@@ -1262,17 +2113,83 @@ cg_plan_blit (CgPlan *self,
               CgTexture *src)
 {
   CgPrivInstr *instr = NULL;
+  guint idx = 0;
 
   g_return_if_fail (self != NULL);
   g_return_if_fail (self->configuring == NULL);
-  g_return_if_fail (self->cur_instr != NULL);
+  g_return_if_fail (self->cur_node != CG_PRIV_NO_NODE);
   g_return_if_fail (src != NULL);
 
-  instr = CG_PRIV_CREATE (instr);
+  idx = cg_priv_nodes_append (self->nodes, self->cur_node);
+  instr = CG_PRIV_NODE_INSTR (self->nodes, idx);
   instr->type = CG_PRIV_INSTR_BLIT;
   instr->blit.src = cg_texture_ref (src);
+}
+
+void
+cg_plan_blit_region (
+    CgPlan *self,
+    CgTexture *src,
+    int x,
+    int y,
+    int width,
+    int height,
+    gboolean linear)
+{
+  CgPrivInstr *instr = NULL;
+  guint idx = 0;
+
+  g_return_if_fail (self != NULL);
+  g_return_if_fail (self->configuring == NULL);
+  g_return_if_fail (self->cur_node != CG_PRIV_NO_NODE);
+  g_return_if_fail (src != NULL);
+  g_return_if_fail (x >= 0 && y >= 0);
+  g_return_if_fail (width > 0 && height > 0);
+  g_return_if_fail (x + width <= src->init.width);
+  g_return_if_fail (y + height <= src->init.height);
 
-  g_node_append_data (self->cur_instr, instr);
+  idx = cg_priv_nodes_append (self->nodes, self->cur_node);
+  instr = CG_PRIV_NODE_INSTR (self->nodes, idx);
+  instr->type = CG_PRIV_INSTR_BLIT;
+  instr->blit.src = cg_texture_ref (src);
+  instr->blit.region[0] = x;
+  instr->blit.region[1] = y;
+  instr->blit.region[2] = width;
+  instr->blit.region[3] = height;
+  instr->blit.region_set = TRUE;
+  instr->blit.linear = linear;
+}
+
+void
+cg_plan_build_depth_pyramid (
+    CgPlan *self,
+    CgTexture *depth,
+    CgTexture *pyramid,
+    gboolean max_depth)
+{
+  CgPrivInstr *instr = NULL;
+  guint idx = 0;
+
+  g_return_if_fail (self != NULL);
+  g_return_if_fail (self->configuring == NULL);
+  g_return_if_fail (self->cur_node != CG_PRIV_NO_NODE);
+  g_return_if_fail (depth != NULL);
+  g_return_if_fail (depth->init.format == CG_PRIV_FORMAT_DEPTH);
+  g_return_if_fail (depth->init.msaa == 0);
+  g_return_if_fail (pyramid != NULL);
+  g_return_if_fail (pyramid->init.format == CG_FORMAT_R32);
+  g_return_if_fail (!pyramid->init.cubemap);
+  g_return_if_fail (pyramid->init.mipmaps > 0);
+  g_return_if_fail (pyramid->init.msaa == 0);
+  g_return_if_fail (pyramid->init.width <= depth->init.width);
+  g_return_if_fail (pyramid->init.height <= depth->init.height);
+
+  idx = cg_priv_nodes_append (self->nodes, self->cur_node);
+  instr = CG_PRIV_NODE_INSTR (self->nodes, idx);
+  instr->type = CG_PRIV_INSTR_DEPTH_PYRAMID;
+  instr->depth_pyramid.depth = cg_texture_ref (depth);
+  instr->depth_pyramid.pyramid = cg_texture_ref (pyramid);
+  instr->depth_pyramid.max_depth = max_depth;
 }
 
 void
@@ -1282,17 +2199,17 @@ cg_plan_pop_n_groups (
 {
   g_return_if_fail (self != NULL);
   g_return_if_fail (self->configuring == NULL);
-  g_return_if_fail (self->cur_instr != NULL);
+  g_return_if_fail (self->cur_node != CG_PRIV_NO_NODE);
 
   for (guint i = 0; i < n_groups; i++)
     {
-      if (self->cur_instr == NULL)
+      if (self->cur_node == CG_PRIV_NO_NODE)
         {
           CG_PRIV_CRITICAL ("No more groups to pop!");
           break;
         }
 
-      self->cur_instr = self->cur_instr->parent;
+      self->cur_node = CG_PRIV_NODE (self->nodes, self->cur_node)->parent;
     }
 }
 
@@ -1306,7 +2223,7 @@ cg_plan_unref_to_commands (
   g_autoptr (GError) local_error = NULL;
 
   g_return_val_if_fail (self != NULL, NULL);
-  g_return_val_if_fail (self->cur_instr == NULL, NULL);
+  g_return_val_if_fail (self->cur_node == CG_PRIV_NO_NODE, NULL);
 
   gpu = cg_gpu_ref (self->gpu);
 
@@ -1329,7 +2246,7 @@ cg_plan_unref_to_debugging_commands (
   g_autoptr (GError) local_error = NULL;
 
   g_return_val_if_fail (self != NULL, NULL);
-  g_return_val_if_fail (self->cur_instr == NULL, NULL);
+  g_return_val_if_fail (self->cur_node == CG_PRIV_NO_NODE, NULL);
 
   gpu = cg_gpu_ref (self->gpu);
 
@@ -1361,6 +2278,293 @@ cg_commands_dispatch (
   return TRUE;
 }
 
+gpointer
+cg_priv_timer_new (
+    CgGpu *gpu,
+    guint n_queries,
+    GError **error)
+{
+  g_autoptr (GError) local_error = NULL;
+  gpointer timer = NULL;
+
+  CG_PRIV_TRY_ENTER_ORELSE_RETURN_VAL (gpu, NULL);
+  timer = gpu->impl->timer_new (gpu, n_queries, &local_error);
+  CG_PRIV_LEAVE (gpu);
+
+  CG_PRIV_HANDLE_BACKEND_ERROR (timer != NULL, error, local_error, gpu, NULL);
+
+  return timer;
+}
+
+void
+cg_priv_timer_free (
+    CgGpu *gpu,
+    gpointer timer)
+{
+  gpu->impl->timer_free (gpu, timer);
+}
+
+gboolean
+cg_priv_timer_collect (
+    CgGpu *gpu,
+    gpointer timer,
+    guint64 *nanoseconds)
+{
+  gboolean result = FALSE;
+
+  CG_PRIV_TRY_ENTER_ORELSE_RETURN_VAL (gpu, FALSE);
+  result = gpu->impl->timer_collect (gpu, timer, nanoseconds);
+  CG_PRIV_LEAVE (gpu);
+
+  return result;
+}
+
+struct _CgFence
+{
+  gatomicrefcount refcount;
+  CgGpu *gpu;
+  gpointer handle;
+};
+
+CgFence *
+cg_fence_new (CgGpu *gpu,
+              GError **error)
+{
+  g_autoptr (GError) local_error = NULL;
+  gpointer handle = NULL;
+  CgFence *fence = NULL;
+
+  g_return_val_if_fail (gpu != NULL, NULL);
+
+  CG_PRIV_TRY_ENTER_ORELSE_RETURN_VAL (gpu, NULL);
+  handle = gpu->impl->fence_new (gpu, &local_error);
+  CG_PRIV_LEAVE (gpu);
+
+  CG_PRIV_HANDLE_BACKEND_ERROR (handle != NULL, error, local_error, gpu, NULL);
+
+  fence = CG_PRIV_CREATE (fence);
+  g_atomic_ref_count_init (&fence->refcount);
+  fence->gpu = cg_gpu_ref (gpu);
+  fence->handle = handle;
+
+  return fence;
+}
+
+CgFence *
+cg_fence_ref (CgFence *self)
+{
+  g_return_val_if_fail (self != NULL, NULL);
+
+  g_atomic_ref_count_inc (&self->refcount);
+  return self;
+}
+
+void
+cg_fence_unref (gpointer self)
+{
+  CgFence *fence = self;
+
+  g_return_if_fail (self != NULL);
+
+  if (g_atomic_ref_count_dec (&fence->refcount))
+    {
+      fence->gpu->impl->fence_free (fence->gpu, fence->handle);
+      cg_gpu_unref (fence->gpu);
+      g_free (fence);
+    }
+}
+
+gboolean
+cg_fence_wait (CgFence *self,
+               CgGpu *gpu)
+{
+  g_return_val_if_fail (self != NULL, FALSE);
+  g_return_val_if_fail (gpu != NULL, FALSE);
+  g_return_val_if_fail (gpu->impl == self->gpu->impl, FALSE);
+
+  CG_PRIV_TRY_ENTER_ORELSE_RETURN_VAL (gpu, FALSE);
+  gpu->impl->fence_wait (gpu, self->handle);
+  CG_PRIV_LEAVE (gpu);
+
+  return TRUE;
+}
+
+gboolean
+cg_fence_client_wait (CgFence *self,
+                      CgGpu *gpu,
+                      guint64 timeout,
+                      GError **error)
+{
+  g_autoptr (GError) local_error = NULL;
+  gboolean signaled = FALSE;
+
+  g_return_val_if_fail (self != NULL, FALSE);
+  g_return_val_if_fail (gpu != NULL, FALSE);
+  g_return_val_if_fail (gpu->impl == self->gpu->impl, FALSE);
+
+  CG_PRIV_TRY_ENTER_ORELSE_RETURN_VAL (gpu, FALSE);
+  signaled = gpu->impl->fence_client_wait (gpu, self->handle, timeout, &local_error);
+  CG_PRIV_LEAVE (gpu);
+
+  CG_PRIV_HANDLE_BACKEND_ERROR (signaled || local_error == NULL, error, local_error, gpu, FALSE);
+
+  return signaled;
+}
+
+struct _CgReadback
+{
+  gatomicrefcount refcount;
+  CgGpu *gpu;
+  gpointer handle;
+  gsize size;
+  gboolean ready;
+};
+
+CgReadback *
+cg_texture_download_async (
+    CgTexture *self,
+    int x,
+    int y,
+    int width,
+    int height,
+    int format,
+    GError **error)
+{
+  g_autoptr (GError) local_error = NULL;
+  gpointer handle = NULL;
+  CgReadback *readback = NULL;
+
+  g_return_val_if_fail (self != NULL, NULL);
+  g_return_val_if_fail (!self->init.cubemap, NULL);
+  g_return_val_if_fail (self->init.msaa == 0, NULL);
+  g_return_val_if_fail (self->init.format != CG_PRIV_FORMAT_DEPTH, NULL);
+  g_return_val_if_fail (!self->init.native_framebuffer, NULL);
+  g_return_val_if_fail (x >= 0 && y >= 0 && width > 0 && height > 0, NULL);
+  g_return_val_if_fail (x + width <= self->init.width, NULL);
+  g_return_val_if_fail (y + height <= self->init.height, NULL);
+  g_return_val_if_fail (format >= 0 && format < CG_N_FORMATS, NULL);
+
+  if (format == 0)
+    format = self->init.format;
+
+  CG_PRIV_TRY_ENTER_ORELSE_RETURN_VAL (self->gpu, NULL);
+  handle = self->gpu->impl->readback_new (
+      self, x, y, width, height, format, &local_error);
+  CG_PRIV_LEAVE (self->gpu);
+
+  CG_PRIV_HANDLE_BACKEND_ERROR (handle != NULL, error, local_error, self->gpu, NULL);
+
+  readback = CG_PRIV_CREATE (readback);
+  g_atomic_ref_count_init (&readback->refcount);
+  readback->gpu = cg_gpu_ref (self->gpu);
+  readback->handle = handle;
+  readback->size = (gsize)width * height * cg_priv_get_pixel_size (format);
+
+  return readback;
+}
+
+gboolean
+cg_readback_wait (CgReadback *self,
+                  guint64 timeout,
+                  GError **error)
+{
+  g_autoptr (GError) local_error = NULL;
+  gboolean ready = FALSE;
+
+  g_return_val_if_fail (self != NULL, FALSE);
+
+  if (self->ready)
+    return TRUE;
+
+  CG_PRIV_TRY_ENTER_ORELSE_RETURN_VAL (self->gpu, FALSE);
+  ready = self->gpu->impl->readback_wait (self->gpu, self->handle, timeout, &local_error);
+  CG_PRIV_LEAVE (self->gpu);
+
+  CG_PRIV_HANDLE_BACKEND_ERROR (ready || local_error == NULL, error, local_error, self->gpu, FALSE);
+
+  self->ready = ready;
+  return ready;
+}
+
+gboolean
+cg_readback_finish (CgReadback *self,
+                    gpointer data,
+                    gsize size,
+                    GError **error)
+{
+  g_autoptr (GError) local_error = NULL;
+  gboolean success = FALSE;
+
+  g_return_val_if_fail (self != NULL, FALSE);
+  g_return_val_if_fail (data != NULL, FALSE);
+  g_return_val_if_fail (size >= self->size, FALSE);
+
+  if (!self->ready && !cg_readback_wait (self, G_MAXUINT64, error))
+    return FALSE;
+
+  CG_PRIV_TRY_ENTER_ORELSE_RETURN_VAL (self->gpu, FALSE);
+  success = self->gpu->impl->readback_read (self->gpu, self->handle, data, &local_error);
+  CG_PRIV_LEAVE (self->gpu);
+
+  CG_PRIV_HANDLE_BACKEND_ERROR (success, error, local_error, self->gpu, FALSE);
+
+  return TRUE;
+}
+
+gsize
+cg_readback_get_size (CgReadback *self)
+{
+  g_return_val_if_fail (self != NULL, 0);
+
+  return self->size;
+}
+
+CgReadback *
+cg_readback_ref (CgReadback *self)
+{
+  g_return_val_if_fail (self != NULL, NULL);
+
+  g_atomic_ref_count_inc (&self->refcount);
+  return self;
+}
+
+void
+cg_readback_unref (gpointer self)
+{
+  CgReadback *readback = self;
+
+  g_return_if_fail (self != NULL);
+
+  if (g_atomic_ref_count_dec (&readback->refcount))
+    {
+      readback->gpu->impl->readback_free (readback->gpu, readback->handle);
+      cg_gpu_unref (readback->gpu);
+      g_free (readback);
+    }
+}
+
+gboolean
+cg_priv_commands_dispatch_timed (
+    CgCommands *self,
+    gpointer timer,
+    GError **error)
+{
+  g_autoptr (GError) local_error = NULL;
+  gboolean timing = FALSE;
+  gboolean success = FALSE;
+
+  CG_PRIV_TRY_ENTER_ORELSE_RETURN_VAL (self->gpu, FALSE);
+  timing = self->gpu->impl->timer_begin (self->gpu, timer);
+  success = self->gpu->impl->commands_dispatch (self, &local_error);
+  if (timing)
+    self->gpu->impl->timer_end (self->gpu, timer);
+  CG_PRIV_LEAVE (self->gpu);
+
+  CG_PRIV_HANDLE_BACKEND_ERROR (success, error, local_error, self->gpu, FALSE);
+
+  return TRUE;
+}
+
 GPtrArray *
 cg_commands_ref_last_debug_dispatch (CgCommands *self)
 {
@@ -137,6 +137,15 @@ typedef enum
                                            failed generation of an underlying object or
                                            the underlying framebuffer ultimately being
                                            incomplete. */
+  CG_ERROR_INVALID_GRAPH,             /*!< Could not compile a frame graph, usually due
+                                           to a dependency cycle or a resource that
+                                           is read but never written. */
+  CG_ERROR_NOT_SUPPORTED,             /*!< The backend or driver does not support
+                                           the requested feature. */
+  CG_ERROR_INVALID_PLAN,              /*!< Could not compile a plan because it asks
+                                           for something the backend cannot do, such
+                                           as drawing without a target or blitting a
+                                           texture into itself. */
   CG_N_ERRORS
 } CgError;
 
@@ -217,19 +226,115 @@ typedef struct _CgPlan CgPlan;
  */
 typedef struct _CgCommands CgCommands;
 
+/*! @class CgGraph
+ *
+ * @brief A frame graph which produces @a CgPlan objects.
+ *
+ * Instead of building a plan directly, you describe
+ * passes along with the textures they read and write.
+ * When compiled, the graph orders the passes by their
+ * dependencies, drops passes whose output is never
+ * consumed, resolves multisampled textures before they
+ * are read, and lets transient textures with disjoint
+ * lifetimes share the same memory. Like @a CgPlan ,
+ * this object never invokes the backend directly.
+ *
+ */
+typedef struct _CgGraph CgGraph;
+
+/*! @class CgScaler
+ *
+ * @brief A controller for dynamic resolution scaling.
+ *
+ * The scaler measures how long the GPU spends on the
+ * commands it dispatches and picks a resolution scale
+ * that keeps that time near a target. Scalable render
+ * targets are allocated once at their maximum size and
+ * only the portion given by the current scale is drawn
+ * to, then stretched to the output with a linear blit.
+ *
+ */
+typedef struct _CgScaler CgScaler;
+
+/*! @class CgBatch
+ *
+ * @brief A batcher for 2D quads.
+ *
+ * Quads are collected on the CPU, grouped by texture
+ * within each layer and written into a single buffer
+ * of per-instance data when flushed into a
+ * @a CgPlan , which then draws each run of quads that
+ * share a texture with one instanced draw. This keeps
+ * the cost of large 2D scenes, such as user interfaces,
+ * close to the number of textures rather than the
+ * number of quads.
+ *
+ */
+typedef struct _CgBatch CgBatch;
+
+/*! @class CgVirtualTexture
+ *
+ * @brief A texture too large to keep in video memory,
+ *        streamed in fixed size pages.
+ *
+ * The image is split into square pages at every mip
+ * level, which are produced on worker threads by a
+ * user supplied function and kept in a single cache
+ * texture. A small indirection texture maps each page
+ * of the full resolution image to the finest page
+ * currently in the cache that covers it. Shaders
+ * sample through @a cg_virtual_texture_get_glsl ,
+ * and a low resolution feedback pass tells the
+ * object which pages are actually visible.
+ *
+ */
+typedef struct _CgVirtualTexture CgVirtualTexture;
+
+/*! @class CgFence
+ *
+ * @brief A point in the work submitted to a GPU.
+ *
+ * A fence is signaled once the GPU finishes everything
+ * that was submitted before it. GPU objects in the same
+ * share group can wait on each other's fences, so one
+ * can safely read what another has rendered.
+ *
+ */
+typedef struct _CgFence CgFence;
+
+/*! @class CgReadback
+ *
+ * @brief Pixels on their way back from a texture.
+ *
+ * The copy is queued behind the work already
+ * submitted, so starting a readback does not stall.
+ * The pixels can be collected once the GPU reaches
+ * it, usually a frame or two later.
+ *
+ */
+typedef struct _CgReadback CgReadback;
+
 /*! @brief A component of a contiguous data
  *         layout for an @a CgBuffer
  *
  */
 typedef struct
 {
-  char *name;        /*!< The attribute name. */
-  int type;          /*!< The data type. */
+  const char *name;  /*!< The attribute name. */
+  int type;          /*!< The data type. Either @a CG_TYPE_FLOAT
+                          or one of the @a CG_COMPONENT_FLOAT32 family
+                          of component formats. For historical reasons
+                          any other @a CgValue type is interpreted as
+                          @a CG_COMPONENT_UINT8 . */
   int num;           /*!< The length of this segment. */
   int instance_rate; /*!< The rate at which the segment is applied
                           per instanced render. 0 indicates that
                           the segment will be applied once for
                           every element. */
+  int conversion;    /*!< How non-float components are presented
+                          to the shader; see @a CG_CONVERSION_CAST .
+                          0 (the default) converts integers to floats
+                          without normalization. */
 } CgDataSegment;
 
 /*! @brief Initialization flags.
@@ -250,6 +355,7 @@ enum
   CG_INIT_FLAG_EXIT_ON_ERROR = 1 << 5,    /*!< Terminate the application if any error
                                                occurs instead of returning errors. */
   CG_INIT_FLAG_LOG_ERRORS = 1 << 6,       /*!< Log all errors returned by functions. */
+  CG_INIT_FLAG_BACKEND_SOFTWARE = 1 << 7, /*!< Rasterize on the CPU, without a GPU. */
 };
 
 /*! @brief Render pass write flags.
@@ -265,10 +371,11 @@ enum
   CG_WRITE_MASK_COLOR_BLUE = 1 << 2,  /*!< Blue */
   CG_WRITE_MASK_COLOR_ALPHA = 1 << 3, /*!< Alpha Transparency */
   CG_WRITE_MASK_DEPTH = 1 << 4,       /*!< Depth Component */
+  CG_WRITE_MASK_STENCIL = 1 << 5,     /*!< Stencil Component */
 
   CG_WRITE_MASK_RGB = CG_WRITE_MASK_COLOR_RED | CG_WRITE_MASK_COLOR_GREEN | CG_WRITE_MASK_COLOR_BLUE, /*!< Just rgb, no alpha or depth */
   CG_WRITE_MASK_COLOR = CG_WRITE_MASK_RGB | CG_WRITE_MASK_COLOR_ALPHA,                                /*!< Just color, no depth */
-  CG_WRITE_MASK_ALL = CG_WRITE_MASK_COLOR | CG_WRITE_MASK_DEPTH,                                      /*!< All Components */
+  CG_WRITE_MASK_ALL = CG_WRITE_MASK_COLOR | CG_WRITE_MASK_DEPTH | CG_WRITE_MASK_STENCIL,              /*!< All Components */
 };
 
 /*! @brief Basic numerical test functions.
@@ -294,6 +401,29 @@ enum
   CG_N_TEST_FUNCS /*!< DO NOT USE */
 };
 
+/*! @brief Stencil operations.
+ *
+ * Used to control how the stencil value of
+ * a fragment changes depending on the outcome
+ * of the stencil and depth tests.
+ *
+ */
+enum
+{
+  CG_STENCIL_OP_0 = 0, /*!< DO NOT USE */
+
+  CG_STENCIL_OP_KEEP,           /*!< `x` */
+  CG_STENCIL_OP_ZERO,           /*!< `0` */
+  CG_STENCIL_OP_REPLACE,        /*!< `ref` */
+  CG_STENCIL_OP_INCREMENT,      /*!< `MIN (x + 1, 255)` */
+  CG_STENCIL_OP_DECREMENT,      /*!< `MAX (x - 1, 0)` */
+  CG_STENCIL_OP_INVERT,         /*!< `~x` */
+  CG_STENCIL_OP_INCREMENT_WRAP, /*!< `x + 1` wrapping to 0 */
+  CG_STENCIL_OP_DECREMENT_WRAP, /*!< `x - 1` wrapping to 255 */
+
+  CG_N_STENCIL_OPS /*!< DO NOT USE */
+};
+
 /*! @brief Blending modes
  *
  * Used to control the manner in which component
@@ -352,6 +482,14 @@ enum
                                  | of type: @a CG_TYPE_BOOL */
   CG_STATE_BACKFACE_CULL,   /*!< Set whether to cull backfaces faces;
                                  | of type: @a CG_TYPE_BOOL */
+  CG_STATE_STENCIL_FUNC,    /*!< Set the stencil comparison func;
+                                 | of type: @a CG_TYPE_TUPLE3 { @a CG_TYPE_INT (func) ,
+                                 |                              @a CG_TYPE_UINT (ref) ,
+                                 |                              @a CG_TYPE_UINT (mask) } */
+  CG_STATE_STENCIL_OPS,     /*!< Set the stencil operations;
+                                 | of type: @a CG_TYPE_TUPLE3 { @a CG_TYPE_INT (stencil fail) ,
+                                 |                              @a CG_TYPE_INT (depth fail) ,
+                                 |                              @a CG_TYPE_INT (pass) } */
 
   CG_N_STATES /*!< DO NOT USE */
 };
@@ -386,6 +524,74 @@ enum
   CG_N_TYPES /*!< DO NOT USE */
 };
 
+/*! @brief Primitive topologies.
+ *
+ * Controls how vertices are assembled into
+ * primitives. For use with
+ * @a cg_plan_append_primitives .
+ *
+ */
+enum
+{
+  CG_TOPOLOGY_0 = 0, /*!< DO NOT USE */
+
+  CG_TOPOLOGY_TRIANGLES,      /*!< Every three vertices form a triangle */
+  CG_TOPOLOGY_TRIANGLE_STRIP, /*!< Every vertex forms a triangle with the previous two */
+  CG_TOPOLOGY_LINES,          /*!< Every two vertices form a line */
+  CG_TOPOLOGY_LINE_STRIP,     /*!< Every vertex forms a line with the previous one */
+  CG_TOPOLOGY_POINTS,         /*!< Every vertex is a point, sized by
+                                   `gl_PointSize` in the vertex shader */
+
+  CG_N_TOPOLOGIES /*!< DO NOT USE */
+};
+
+/*! @brief Vertex component formats.
+ *
+ * For use with the `type` field of @a CgDataSegment .
+ * These values never collide with the @a CgValue types,
+ * so layouts which pass @a CG_TYPE_FLOAT keep working.
+ *
+ * The packed formats store all four components of a
+ * segment in 32 bits, so `num` must be 4 when using them.
+ *
+ */
+enum
+{
+  CG_COMPONENT_0 = CG_N_TYPES, /*!< DO NOT USE */
+
+  CG_COMPONENT_FLOAT32,         /*!< 32-bit float */
+  CG_COMPONENT_FLOAT16,         /*!< 16-bit half float */
+  CG_COMPONENT_INT8,            /*!< signed 8-bit integer */
+  CG_COMPONENT_UINT8,           /*!< unsigned 8-bit integer */
+  CG_COMPONENT_INT16,           /*!< signed 16-bit integer */
+  CG_COMPONENT_UINT16,          /*!< unsigned 16-bit integer */
+  CG_COMPONENT_INT32,           /*!< signed 32-bit integer */
+  CG_COMPONENT_UINT32,          /*!< unsigned 32-bit integer */
+  CG_COMPONENT_INT_2_10_10_10,  /*!< signed 10:10:10:2, packed into 32 bits */
+  CG_COMPONENT_UINT_2_10_10_10, /*!< unsigned 10:10:10:2, packed into 32 bits */
+
+  CG_N_COMPONENTS /*!< DO NOT USE */
+};
+
+/*! @brief Vertex component conversions.
+ *
+ * For use with the `conversion` field of @a CgDataSegment .
+ * Float components are always passed through unchanged.
+ *
+ */
+enum
+{
+  CG_CONVERSION_CAST = 0,  /*!< Integers become floats of the same value */
+  CG_CONVERSION_NORMALIZE, /*!< Integers are mapped to `[0, 1]` if unsigned
+                                or `[-1, 1]` if signed */
+  CG_CONVERSION_INTEGER,   /*!< Integers are passed as integers, for use
+                                with `int`, `uint`, `ivec*` or `uvec*`
+                                shader inputs. Not valid for float or
+                                packed components. */
+
+  CG_N_CONVERSIONS /*!< DO NOT USE */
+};
+
 /*! @brief A generic value union.
  *
  * Use the associated macros with the form `CG_TYPE ()`
@@ -485,17 +691,54 @@ enum
   CG_N_FORMATS, /*!< DO NOT USE */
 };
 
+/*! @brief A depth buffer format. */
+enum
+{
+  CG_DEPTH_FORMAT_0 = 0, /*!< DO NOT USE */
+
+  CG_DEPTH_FORMAT_D16,   /*!< 16-bit normalized depth */
+  CG_DEPTH_FORMAT_D24S8, /*!< 24-bit normalized depth, 8-bit stencil */
+  CG_DEPTH_FORMAT_D32F,  /*!< 32-bit float depth */
+
+  CG_N_DEPTH_FORMATS, /*!< DO NOT USE */
+};
+
 /*! @brief Create a new @a CgGpu object.
  *
  * @param [in] flags Initialization flags.
  * @param [in] extra_data A pointer to
  *        backend specific initialization
  *        data, such as an extensions loader.
+ *        The Vulkan backend ignores it. The
+ *        software backend accepts a pointer to
+ *        a `guint` thread count, where 0 uses
+ *        every processor.
  * @param [out] error The return location
  *        for a recoverable error.
  *
  * @return The newly allocated object.
  *
+ * The Vulkan backend picks the most capable device
+ * and only accepts shaders created with
+ * @a cg_shader_new_for_spirv . It has no default
+ * framebuffer, so every pass which draws needs a
+ * target. Recording large plans is spread across
+ * threads. A software implementation such as
+ * lavapipe can be selected with VK_ICD_FILENAMES .
+ *
+ * The software backend rasterizes triangles in tiles
+ * spread across threads and needs no GPU or display.
+ * It does not compile shaders: instead, the GLSL code
+ * names a built-in kernel with a line such as
+ * `#pragma cpc_gpu_kernel texture`, which GL ignores.
+ * The kernels are `color` (attributes `position` and
+ * `color`, uniforms `transform` and `tint`), `texture`
+ * (which adds the attribute `uv` and the uniform `tex`)
+ * and `batch`, which @a CgBatch uses. Like the Vulkan
+ * backend it has no default framebuffer. Lines, points,
+ * cubemap targets, native textures and dual source
+ * blending are not supported.
+ *
  * @memberof CgGpu
  *
  */
@@ -505,6 +748,146 @@ CgGpu *cg_gpu_new (
     gpointer extra_data,
     GError **error) G_GNUC_WARN_UNUSED_RESULT;
 
+/*! @brief Create a new @a CgGpu object which
+ *         shares resources with another.
+ *
+ * @param [in] share A GPU object in the share group
+ *        to join.
+ * @param [in] flags Initialization flags. These must
+ *        select the same backend as @p share .
+ * @param [in] extra_data Backend specific data,
+ *        as in @a cg_gpu_new .
+ * @param [out] error The return location
+ *        for a recoverable error.
+ *
+ * @return The newly allocated object, or NULL on error.
+ *
+ * Buffers, textures and shaders created through any
+ * member of a share group may be used in the plans of
+ * every other member, and identical shaders are only
+ * compiled once for the whole group. Container state,
+ * such as framebuffers, stays with each member.
+ *
+ * With the OpenGL backend, the current context must
+ * already share objects with the context of @p share ,
+ * for example through the share parameter of the
+ * window system's context creation function. The
+ * library cannot check this.
+ *
+ * A resource written by one member is only guaranteed
+ * to be visible to another after the other waits on a
+ * @a CgFence created after the write. Members used on
+ * different threads must all be thread safe.
+ *
+ * @memberof CgGpu
+ *
+ */
+CPC_GPU_AVAILABLE_IN_ALL
+CgGpu *cg_gpu_new_shared (
+    CgGpu *share,
+    guint32 flags,
+    gpointer extra_data,
+    GError **error) G_GNUC_WARN_UNUSED_RESULT;
+
+/*! @brief Create a new @a CgGpu object with
+ *         its own offscreen OpenGL context.
+ *
+ * @param [in] flags Initialization flags. The
+ *        OpenGL backend is always used.
+ * @param [in] device The index of the EGL device to
+ *        render with, or -1 for Mesa's surfaceless
+ *        platform, which picks a default device and
+ *        falls back on software rendering.
+ * @param [out] error The return location
+ *        for a recoverable error.
+ *
+ * @return The newly allocated object, or NULL on error.
+ *
+ * No display or window system is needed, which suits
+ * rendering on servers. The context is current to the
+ * calling thread when this returns and is destroyed
+ * with the object. Render into targets and read the
+ * results back with @a cg_texture_download .
+ *
+ * This requires the library to be built with EGL,
+ * and otherwise fails with @a CG_ERROR_NOT_SUPPORTED .
+ *
+ * @memberof CgGpu
+ *
+ */
+CPC_GPU_AVAILABLE_IN_ALL
+CgGpu *cg_gpu_new_headless (
+    guint32 flags,
+    int device,
+    GError **error) G_GNUC_WARN_UNUSED_RESULT;
+
+/*! @brief The body of a headless worker process.
+ *
+ * @param [in] gpu A headless GPU object owned by
+ *        the worker, current to its thread.
+ * @param [in] index The index of this worker.
+ * @param [in] n_workers The total number of workers.
+ * @param [in] user_data The user data.
+ * @param [out] error The return location
+ *        for a recoverable error.
+ *
+ * @return Whether the work succeeded.
+ *
+ */
+typedef gboolean (*CgWorkerFunc) (
+    CgGpu *gpu,
+    guint index,
+    guint n_workers,
+    gpointer user_data,
+    GError **error);
+
+/*! @brief Render in parallel in several
+ *         worker processes.
+ *
+ * @param [in] flags Initialization flags for
+ *        each worker's GPU object.
+ * @param [in] device See @a cg_gpu_new_headless .
+ * @param [in] n_workers The number of processes,
+ *        usually the number of cores when rendering
+ *        in software.
+ * @param [in] func The function each worker runs.
+ * @param [in] user_data User data for @p func .
+ * @param [out] error The return location
+ *        for a recoverable error.
+ *
+ * @return Whether every worker succeeded.
+ *
+ * Each worker is a forked process with its own
+ * context from @a cg_gpu_new_headless , so drivers
+ * never serialize them against each other. Workers
+ * share nothing after the fork; split the work with
+ * @p index and write results to files or shared
+ * memory. Errors in workers are logged.
+ *
+ * Call this before creating threads or graphics
+ * contexts in the calling process, ideally first
+ * thing in `main`. Only the forking thread is carried
+ * into the workers, so locks held by any other thread,
+ * such as a driver's or the allocator's, would never
+ * be released in them. On Linux, where the thread
+ * count is known, a process that already has more
+ * than one thread fails with
+ * @a CG_ERROR_NOT_SUPPORTED instead. This also
+ * requires EGL and a Unix system, and otherwise
+ * fails with @a CG_ERROR_NOT_SUPPORTED .
+ *
+ * @memberof CgGpu
+ *
+ */
+CPC_GPU_AVAILABLE_IN_ALL
+gboolean cg_gpu_run_headless_workers (
+    guint32 flags,
+    int device,
+    guint n_workers,
+    CgWorkerFunc func,
+    gpointer user_data,
+    GError **error);
+
 /*! @brief Create a strong reference to
  *         a @a CgGpu object.
  *
@@ -614,6 +997,186 @@ void cg_gpu_release_this_thread (CgGpu *self);
 CPC_GPU_AVAILABLE_IN_ALL
 gboolean cg_gpu_flush (CgGpu *self, GError **error);
 
+/*! @brief Create a new @a CgFence object after
+ *         the work submitted so far.
+ *
+ * @param [in] gpu The GPU object.
+ * @param [out] error The return location
+ *        for a recoverable error.
+ *
+ * @return The newly allocated object, or NULL on error.
+ *
+ * The fence follows every @a CgCommands object
+ * dispatched through @p gpu before this call.
+ *
+ * @memberof CgFence
+ *
+ */
+CPC_GPU_AVAILABLE_IN_ALL
+CgFence *cg_fence_new (
+    CgGpu *gpu,
+    GError **error) G_GNUC_WARN_UNUSED_RESULT;
+
+/*! @brief Create a strong reference to
+ *         a @a CgFence object.
+ *
+ * @param [in] self The object.
+ *
+ * @return The newly referenced object.
+ *
+ * @memberof CgFence
+ *
+ */
+CPC_GPU_AVAILABLE_IN_ALL
+CgFence *cg_fence_ref (CgFence *self);
+
+/*! @brief Release a strong reference
+ *         from a @a CgFence object.
+ *
+ * @param [in] self The object.
+ *
+ * @memberof CgFence
+ *
+ */
+CPC_GPU_AVAILABLE_IN_ALL
+void cg_fence_unref (gpointer self);
+
+/*! @brief Make a GPU wait for a fence before
+ *         running any work submitted later.
+ *
+ * @param [in] self The fence.
+ * @param [in] gpu The GPU object which waits. This
+ *        must be in the same share group as the GPU
+ *        the fence was created with.
+ *
+ * @return Whether the wait was queued, which fails
+ *         only if @p gpu does not own the calling thread.
+ *
+ * This returns immediately; only the GPU waits,
+ * so it is the cheap way to order work between the
+ * members of a share group.
+ *
+ * @memberof CgFence
+ *
+ */
+CPC_GPU_AVAILABLE_IN_ALL
+gboolean cg_fence_wait (
+    CgFence *self,
+    CgGpu *gpu);
+
+/*! @brief Block the calling thread until a
+ *         fence is signaled.
+ *
+ * @param [in] self The fence.
+ * @param [in] gpu A GPU object owned by the calling
+ *        thread, in the same share group as the GPU
+ *        the fence was created with.
+ * @param [in] timeout The longest time to wait in
+ *        nanoseconds. Pass 0 to only poll.
+ * @param [out] error The return location
+ *        for a recoverable error.
+ *
+ * @return Whether the fence was signaled. This is
+ *         FALSE without an error if the time ran out.
+ *
+ * @memberof CgFence
+ *
+ */
+CPC_GPU_AVAILABLE_IN_ALL
+gboolean cg_fence_client_wait (
+    CgFence *self,
+    CgGpu *gpu,
+    guint64 timeout,
+    GError **error);
+
+/*! @brief Wait for the pixels of a readback
+ *         to arrive.
+ *
+ * @param [in] self The readback.
+ * @param [in] timeout The longest time to wait in
+ *        nanoseconds. Pass 0 to only poll.
+ * @param [out] error The return location
+ *        for a recoverable error.
+ *
+ * The GPU object of the texture must own the
+ * calling thread.
+ *
+ * @return Whether the pixels are ready. This is
+ *         FALSE without an error if the time ran out.
+ *
+ * @memberof CgReadback
+ *
+ */
+CPC_GPU_AVAILABLE_IN_ALL
+gboolean cg_readback_wait (
+    CgReadback *self,
+    guint64 timeout,
+    GError **error);
+
+/*! @brief Copy the pixels of a readback
+ *         into memory.
+ *
+ * @param [in] self The readback.
+ * @param [out] data Where to write tightly packed rows
+ *        of pixels in the format of the readback.
+ * @param [in] size The size of @p data in bytes, at
+ *        least @a cg_readback_get_size .
+ * @param [out] error The return location
+ *        for a recoverable error.
+ *
+ * This blocks until the pixels are ready, which
+ * @a cg_readback_wait can check beforehand. It
+ * may be called more than once.
+ *
+ * @return Whether the copy succeeded.
+ *
+ * @memberof CgReadback
+ *
+ */
+CPC_GPU_AVAILABLE_IN_ALL
+gboolean cg_readback_finish (
+    CgReadback *self,
+    gpointer data,
+    gsize size,
+    GError **error);
+
+/*! @brief Get the size of the pixels
+ *         of a readback in bytes.
+ *
+ * @param [in] self The readback.
+ *
+ * @return The size in bytes.
+ *
+ * @memberof CgReadback
+ *
+ */
+CPC_GPU_AVAILABLE_IN_ALL
+gsize cg_readback_get_size (CgReadback *self);
+
+/*! @brief Create a strong reference to
+ *         a @a CgReadback object.
+ *
+ * @param [in] self The object.
+ *
+ * @return The newly referenced object.
+ *
+ * @memberof CgReadback
+ *
+ */
+CPC_GPU_AVAILABLE_IN_ALL
+CgReadback *cg_readback_ref (CgReadback *self);
+
+/*! @brief Release a strong reference
+ *         from a @a CgReadback object.
+ *
+ * @param [in] self The object.
+ *
+ * @memberof CgReadback
+ *
+ */
+CPC_GPU_AVAILABLE_IN_ALL
+void cg_readback_unref (gpointer self);
+
 /*! @brief Create a new @a CgShader object
  *         in accordance with vertex and fragment
  *         shader code.
@@ -633,6 +1196,70 @@ CgShader *cg_shader_new_for_code (
     const char *vertex_code,
     const char *fragment_code) G_GNUC_WARN_UNUSED_RESULT;
 
+/*! @brief Create a new @a CgShader object
+ *         from SPIR-V binaries.
+ *
+ * @param [in] self The GPU object.
+ * @param [in] vertex_spirv A SPIR-V module containing
+ *        the vertex stage.
+ * @param [in] vertex_size The size of @p vertex_spirv
+ *        in bytes.
+ * @param [in] fragment_spirv A SPIR-V module containing
+ *        the fragment stage.
+ * @param [in] fragment_size The size of @p fragment_spirv
+ *        in bytes.
+ * @param [in] entry_point The name of the entry point
+ *        of both stages, or NULL for "main".
+ *
+ * @return The newly allocated object.
+ *
+ * This skips parsing GLSL when the shader is first used.
+ * Attributes and uniforms are still looked up by name,
+ * so the modules must be compiled with debug names kept
+ * and with explicit uniform locations. If the backend
+ * does not support SPIR-V, using the shader fails with
+ * @a CG_ERROR_NOT_SUPPORTED . The Vulkan backend requires
+ * every uniform outside of blocks to be a sampler, and
+ * every block to use descriptor set 0.
+ *
+ * @memberof CgShader
+ *
+ */
+CPC_GPU_AVAILABLE_IN_ALL
+CgShader *cg_shader_new_for_spirv (
+    CgGpu *self,
+    gconstpointer vertex_spirv,
+    gsize vertex_size,
+    gconstpointer fragment_spirv,
+    gsize fragment_size,
+    const char *entry_point) G_GNUC_WARN_UNUSED_RESULT;
+
+/*! @brief Create a variant of a SPIR-V
+ *         @a CgShader object.
+ *
+ * @param [in] self A shader created with
+ *        @a cg_shader_new_for_spirv .
+ * @param [in] constant_ids An array of specialization
+ *        constant ids.
+ * @param [in] constant_values An array of the raw 32 bit
+ *        values to give each constant in @p constant_ids .
+ * @param [in] n_constants The length of both arrays.
+ *
+ * @return The newly allocated object.
+ *
+ * The new shader shares the binaries of @p self and
+ * replaces any constants @p self was specialized with.
+ *
+ * @memberof CgShader
+ *
+ */
+CPC_GPU_AVAILABLE_IN_ALL
+CgShader *cg_shader_new_specialized (
+    CgShader *self,
+    const guint *constant_ids,
+    const guint *constant_values,
+    guint n_constants) G_GNUC_WARN_UNUSED_RESULT;
+
 /*! @brief Create a strong reference to
  *         a @a CgShader object.
  *
@@ -701,29 +1328,74 @@ CgBuffer *cg_buffer_new_for_data_take (
     const CgDataSegment *spec,
     guint spec_length) G_GNUC_WARN_UNUSED_RESULT;
 
-/*! @brief Create a strong reference to
- *         a @a CgBuffer object.
+/*! @brief Create a new index buffer object
+ *         from initial data.
  *
- * @param [in] self The object.
+ * @param [in] self The GPU object.
+ * @param [in] data The indices to be stored.
+ * @param [in] size The size of the index data in bytes.
+ * @param [in] format The index format. Must be either
+ *        @a CG_COMPONENT_UINT8 , @a CG_COMPONENT_UINT16
+ *        or @a CG_COMPONENT_UINT32 .
  *
- * @return The newly referenced object.
+ * The resulting buffer may only be used as
+ * the `indices` argument to @a cg_plan_append_indexed .
+ *
+ * @return The newly allocated object.
  *
  * @memberof CgBuffer
  *
  */
 CPC_GPU_AVAILABLE_IN_ALL
-CgBuffer *cg_buffer_ref (CgBuffer *self);
+CgBuffer *cg_buffer_new_for_indices (
+    CgGpu *self,
+    gconstpointer data,
+    gsize size,
+    int format) G_GNUC_WARN_UNUSED_RESULT;
 
-/*! @brief Release a strong reference
- *         from a @a CgBuffer object.
+/*! @brief Like @a cg_buffer_new_for_indices
+ *         except transfer ownership of `data`.
  *
- * @param [in] self The object.
+ * @param [in] self The GPU object.
+ * @param [in] data The indices to be stored.
+ * @param [in] size The size of the index data in bytes.
+ * @param [in] format The index format.
+ *
+ * @return The newly allocated object.
  *
  * @memberof CgBuffer
  *
  */
 CPC_GPU_AVAILABLE_IN_ALL
-void cg_buffer_unref (gpointer self);
+CgBuffer *cg_buffer_new_for_indices_take (
+    CgGpu *self,
+    gpointer data,
+    gsize size,
+    int format) G_GNUC_WARN_UNUSED_RESULT;
+
+/*! @brief Create a strong reference to
+ *         a @a CgBuffer object.
+ *
+ * @param [in] self The object.
+ *
+ * @return The newly referenced object.
+ *
+ * @memberof CgBuffer
+ *
+ */
+CPC_GPU_AVAILABLE_IN_ALL
+CgBuffer *cg_buffer_ref (CgBuffer *self);
+
+/*! @brief Release a strong reference
+ *         from a @a CgBuffer object.
+ *
+ * @param [in] self The object.
+ *
+ * @memberof CgBuffer
+ *
+ */
+CPC_GPU_AVAILABLE_IN_ALL
+void cg_buffer_unref (gpointer self);
 
 /*! @brief Create a new @a CgTexture
  *         with initial duplicated data.
@@ -846,6 +1518,298 @@ CgTexture *cg_texture_new_depth (
     int height,
     int msaa) G_GNUC_WARN_UNUSED_RESULT;
 
+/*! @brief Create a new @a CgTexture capable
+ *         only of holding a depth component,
+ *         and optionally a stencil component,
+ *         in a specific format.
+ *
+ * @param [in] self The GPU object.
+ * @param [in] width The width of the image.
+ * @param [in] height The height of the image.
+ * @param [in] format The depth format enum.
+ * @param [in] msaa The number of samples to use.
+ *
+ * Unlike @a cg_texture_new_depth , which leaves the
+ * precision up to the backend, the storage is exactly
+ * @a format . Only @a CG_DEPTH_FORMAT_D24S8 has a
+ * stencil component, which is cleared to 0 along with
+ * the depth whenever the texture is first drawn to.
+ *
+ * @return The newly allocated object.
+ *
+ * @memberof CgTexture
+ *
+ */
+CPC_GPU_AVAILABLE_IN_ALL
+CgTexture *cg_texture_new_depth_for_format (
+    CgGpu *self,
+    int width,
+    int height,
+    int format,
+    int msaa) G_GNUC_WARN_UNUSED_RESULT;
+
+/*! @brief Create a new @a CgTexture to hold
+ *         a depth pyramid.
+ *
+ * @param [in] self The GPU object.
+ * @param [in] width The width of the base level.
+ * @param [in] height The height of the base level.
+ *
+ * The texture uses @a CG_FORMAT_R32 and has every level
+ * down to 1x1. Fill it with @a cg_plan_build_depth_pyramid .
+ *
+ * @return The newly allocated object.
+ *
+ * @memberof CgTexture
+ *
+ */
+CPC_GPU_AVAILABLE_IN_ALL
+CgTexture *cg_texture_new_depth_pyramid (
+    CgGpu *self,
+    int width,
+    int height) G_GNUC_WARN_UNUSED_RESULT;
+
+/*! @brief Wrap a texture created outside of
+ *         this library in a @a CgTexture .
+ *
+ * @param [in] self The GPU object.
+ * @param [in] native The backend's handle for the
+ *        texture, which is a texture name for OpenGL.
+ * @param [in] width The width of the texture.
+ * @param [in] height The height of the texture.
+ * @param [in] format The format of the texture.
+ * @param [in] msaa The number of samples the texture
+ *        was created with, or 0.
+ *
+ * @return The newly allocated object.
+ *
+ * The texture is sampled and rendered into directly,
+ * without copies. It is not destroyed with the
+ * returned object, and must outlive any commands
+ * using it. The declared size and format are trusted.
+ *
+ * @memberof CgTexture
+ *
+ */
+CPC_GPU_AVAILABLE_IN_ALL
+CgTexture *cg_texture_new_for_native_texture (
+    CgGpu *self,
+    guint64 native,
+    int width,
+    int height,
+    int format,
+    int msaa) G_GNUC_WARN_UNUSED_RESULT;
+
+/*! @brief Wrap a framebuffer created outside of
+ *         this library in a @a CgTexture .
+ *
+ * @param [in] self The GPU object.
+ * @param [in] native The backend's handle for the
+ *        framebuffer, which is a framebuffer name
+ *        for OpenGL, where 0 is the default one.
+ * @param [in] width The width of the framebuffer.
+ * @param [in] height The height of the framebuffer.
+ * @param [in] format The format of its color buffer.
+ *
+ * @return The newly allocated object.
+ *
+ * The object can only be used as the sole target
+ * of a group, which then renders straight into
+ * the framebuffer. Groups without targets otherwise
+ * have to look up the framebuffer bound at dispatch,
+ * which stalls some drivers. The framebuffer is not
+ * destroyed with the returned object.
+ *
+ * @memberof CgTexture
+ *
+ */
+CPC_GPU_AVAILABLE_IN_ALL
+CgTexture *cg_texture_new_for_native_framebuffer (
+    CgGpu *self,
+    guint64 native,
+    int width,
+    int height,
+    int format) G_GNUC_WARN_UNUSED_RESULT;
+
+/*! @brief The maximum number of planes of a @a CgDmabuf .
+ *
+ */
+#define CG_DMABUF_MAX_PLANES 4
+
+/*! @brief A Linux DMA-BUF image description.
+ *
+ * Formats and modifiers are DRM fourcc codes and
+ * modifiers, as found in drm_fourcc.h . Release
+ * exported file descriptors with @a cg_dmabuf_clear .
+ *
+ */
+typedef struct
+{
+  int width;                               /*!< The width of the image. */
+  int height;                              /*!< The height of the image. */
+  guint32 fourcc;                          /*!< The DRM fourcc format code. */
+  guint64 modifier;                        /*!< The DRM format modifier, or
+                                                DRM_FORMAT_MOD_INVALID for an
+                                                implicit one. */
+  guint n_planes;                          /*!< The number of planes in use. */
+  int fds[CG_DMABUF_MAX_PLANES];           /*!< The file descriptor of each plane. */
+  guint32 offsets[CG_DMABUF_MAX_PLANES];   /*!< The offset of each plane in bytes. */
+  guint32 strides[CG_DMABUF_MAX_PLANES];   /*!< The stride of each plane in bytes. */
+} CgDmabuf;
+
+/*! @brief Close the file descriptors of a @a CgDmabuf .
+ *
+ * @param [in] self The description.
+ *
+ */
+CPC_GPU_AVAILABLE_IN_ALL
+void cg_dmabuf_clear (CgDmabuf *self);
+
+/*! @brief Create a new @a CgTexture sharing
+ *         the memory of a DMA-BUF.
+ *
+ * @param [in] self The GPU object.
+ * @param [in] dmabuf The image to import.
+ * @param [out] error Error return location.
+ *
+ * @return The newly allocated object, or NULL on error.
+ *
+ * The import happens immediately and without copies,
+ * so the caller keeps ownership of the file descriptors
+ * and may close them once this returns. The texture is
+ * sampled as RGBA; multi-planar YUV images are only
+ * accepted where the driver can sample them that way.
+ *
+ * This requires the library to be built with EGL
+ * and the GPU object to run on an EGL context, and
+ * otherwise fails with @a CG_ERROR_NOT_SUPPORTED .
+ *
+ * @memberof CgTexture
+ *
+ */
+CPC_GPU_AVAILABLE_IN_ALL
+CgTexture *cg_texture_new_for_dmabuf (
+    CgGpu *self,
+    const CgDmabuf *dmabuf,
+    GError **error) G_GNUC_WARN_UNUSED_RESULT;
+
+/*! @brief Export a texture as a DMA-BUF.
+ *
+ * @param [in] self The texture object.
+ * @param [out] dmabuf Return location for the image,
+ *        whose file descriptors belong to the caller.
+ * @param [out] error Error return location.
+ *
+ * @return Whether the operation succeeded.
+ *
+ * Commands rendering into the texture should have been
+ * dispatched beforehand; they are flushed, and the
+ * kernel's implicit synchronization covers the rest.
+ * The same requirements as @a cg_texture_new_for_dmabuf
+ * apply.
+ *
+ * @memberof CgTexture
+ *
+ */
+CPC_GPU_AVAILABLE_IN_ALL
+gboolean cg_texture_export_dmabuf (
+    CgTexture *self,
+    CgDmabuf *dmabuf,
+    GError **error);
+
+/*! @brief Replace a region of a texture.
+ *
+ * @param [in] self The texture object.
+ * @param [in] x The left edge of the region.
+ * @param [in] y The top edge of the region.
+ * @param [in] width The width of the region.
+ * @param [in] height The height of the region.
+ * @param [in] data Tightly packed rows of pixels in
+ *        the format of the texture.
+ * @param [out] error `GError` return location
+ *        for a recoverable error.
+ *
+ * The texture must be two-dimensional, not use msaa
+ * and not hold depth. Unlike most functions on this
+ * object, this runs immediately, so the GPU object
+ * must own the current thread.
+ *
+ * @return Whether the update succeeded.
+ *
+ * @memberof CgTexture
+ *
+ */
+CPC_GPU_AVAILABLE_IN_ALL
+gboolean cg_texture_update_region (
+    CgTexture *self,
+    int x,
+    int y,
+    int width,
+    int height,
+    gconstpointer data,
+    GError **error);
+
+/*! @brief Copy the contents of a texture
+ *         into memory.
+ *
+ * @param [in] self The texture object.
+ * @param [out] data Where to write tightly packed
+ *        rows of pixels in the format of the texture.
+ * @param [in] size The size of @p data in bytes.
+ * @param [out] error `GError` return location
+ *        for a recoverable error.
+ *
+ * The same restrictions as @a cg_texture_update_region
+ * apply. This waits for all rendering to the texture
+ * to finish.
+ *
+ * @return Whether the download succeeded.
+ *
+ * @memberof CgTexture
+ *
+ */
+CPC_GPU_AVAILABLE_IN_ALL
+gboolean cg_texture_download (
+    CgTexture *self,
+    gpointer data,
+    gsize size,
+    GError **error);
+
+/*! @brief Start copying a region of a texture
+ *         into memory without waiting for it.
+ *
+ * @param [in] self The texture object.
+ * @param [in] x The left edge of the region.
+ * @param [in] y The bottom edge of the region.
+ * @param [in] width The width of the region.
+ * @param [in] height The height of the region.
+ * @param [in] format The @a CG_FORMAT_R8 family format
+ *        to convert the pixels to, or 0 to keep the
+ *        format of the texture.
+ * @param [out] error `GError` return location
+ *        for a recoverable error.
+ *
+ * The same restrictions as @a cg_texture_update_region
+ * apply. The copy follows all rendering submitted so far.
+ * Poll it with @a cg_readback_wait and collect the pixels
+ * with @a cg_readback_finish . The Vulkan backend
+ * cannot convert between formats.
+ *
+ * @return The newly allocated object, or NULL on error.
+ *
+ * @memberof CgTexture
+ *
+ */
+CPC_GPU_AVAILABLE_IN_ALL
+CgReadback *cg_texture_download_async (
+    CgTexture *self,
+    int x,
+    int y,
+    int width,
+    int height,
+    int format,
+    GError **error) G_GNUC_WARN_UNUSED_RESULT;
+
 /*! @brief Create a strong reference to
  *         a @a CgTexture object.
  *
@@ -929,6 +1893,11 @@ void cg_plan_begin_config (CgPlan *self);
  * @param [in] ... Remaining target configurations,
  *         terminated with `NULL`.
  *
+ * Targets are cleared when the group begins, unless
+ * they are exactly the textures of the parent group
+ * or of the group directly before this one, in which
+ * case rendering simply continues into them.
+ *
  * @memberof CgPlan
  *
  */
@@ -1078,6 +2047,52 @@ void cg_plan_config_backface_cull (
     CgPlan *self,
     gboolean cull);
 
+/*! @brief Override the stencil test for
+ *         the group's child render passes.
+ *
+ * @param [in] self The plan object.
+ * @param [in] func The test func enum.
+ * @param [in] ref The reference value.
+ * @param [in] mask The bits of both the reference
+ *        and the stored value which are compared.
+ *
+ * The test compares `ref & mask` against `stored & mask`,
+ * so @a CG_TEST_LESS passes where the reference is smaller. It only has an effect when the depth
+ * target has a stencil component.
+ *
+ * @memberof CgPlan
+ *
+ */
+CPC_GPU_AVAILABLE_IN_ALL
+void cg_plan_config_stencil_func (
+    CgPlan *self,
+    int func,
+    guint32 ref,
+    guint32 mask);
+
+/*! @brief Override the stencil operations
+ *         for the group's child render passes.
+ *
+ * @param [in] self The plan object.
+ * @param [in] stencil_fail The op for fragments
+ *        failing the stencil test.
+ * @param [in] depth_fail The op for fragments passing
+ *        the stencil test but failing the depth test.
+ * @param [in] pass The op for fragments passing both.
+ *
+ * Stencil values are only written while the write
+ * mask includes @a CG_WRITE_MASK_STENCIL .
+ *
+ * @memberof CgPlan
+ *
+ */
+CPC_GPU_AVAILABLE_IN_ALL
+void cg_plan_config_stencil_ops (
+    CgPlan *self,
+    int stencil_fail,
+    int depth_fail,
+    int pass);
+
 /*! @brief End configuration for and
  *         activate the next child group.
  *
@@ -1167,63 +2182,262 @@ void cg_plan_append_v (
     CgBuffer **buffers,
     guint n_buffers);
 
-/*! @brief Copy a texture to the output.
+/*! @brief Like @a cg_plan_append but
+ *         assemble vertices through an index buffer.
  *
  * @param [in] self The plan object.
- * @param [in] src The source texture.
+ * @param [in] instances The number of
+ *        times to process the buffers.
+ * @param [in] indices An index buffer created with
+ *        @a cg_buffer_new_for_indices .
+ * @param [in] first_buffer The first buffer object.
+ * @param [in] ... Remaining buffer objects,
+ *        terminated with `NULL`.
  *
  * @memberof CgPlan
  *
  */
 CPC_GPU_AVAILABLE_IN_ALL
-void cg_plan_blit (CgPlan *self,
-                   CgTexture *src);
+void cg_plan_append_indexed (
+    CgPlan *self,
+    guint instances,
+    CgBuffer *indices,
+    CgBuffer *first_buffer,
+    ...) G_GNUC_NULL_TERMINATED;
 
-/*! @brief Terminate the current child group
- *         and in turn restore the state of the
- *         plan object to before the group was
- *         configured.
+/*! @brief Like @a cg_plan_append_indexed but
+ *         read a sized buffer instead.
  *
  * @param [in] self The plan object.
- * @param [in] n_groups The number of groups to pop.
- *
- * This function must always be paired with
- * a preceding @a cg_plan_push_group or
- * @a cg_plan_push_state .
+ * @param [in] instances The number of
+ *        times to process the buffers.
+ * @param [in] indices An index buffer.
+ * @param [in] buffer A buffer of @a CgBuffer .
+ * @param [in] n_buffers The length of the buffer.
  *
  * @memberof CgPlan
  *
  */
 CPC_GPU_AVAILABLE_IN_ALL
-void cg_plan_pop_n_groups (
+void cg_plan_append_indexed_v (
     CgPlan *self,
-    guint n_groups);
+    guint instances,
+    CgBuffer *indices,
+    CgBuffer **buffers,
+    guint n_buffers);
 
-/*! @brief A convenience macro to pop one group.
+/*! @brief Like @a cg_plan_append_indexed but
+ *         choose how vertices form primitives.
  *
  * @param [in] self The plan object.
+ * @param [in] topology The primitive topology,
+ *        for example @a CG_TOPOLOGY_LINE_STRIP .
+ * @param [in] instances The number of
+ *        times to process the buffers.
+ * @param [in] indices An index buffer created with
+ *        @a cg_buffer_new_for_indices , or `NULL`
+ *        to assemble vertices in order.
+ * @param [in] first_buffer The first buffer object.
+ * @param [in] ... Remaining buffer objects,
+ *        terminated with `NULL`.
+ *
+ * When drawing indexed strips, the largest value of
+ * the index format (for example `0xFFFF` for
+ * @a CG_COMPONENT_UINT16 ) ends the current strip
+ * and begins a new one, so many strips can be
+ * drawn at once.
  *
  * @memberof CgPlan
  *
  */
-#define cg_plan_pop(self) \
-  cg_plan_pop_n_groups (self, 1)
+CPC_GPU_AVAILABLE_IN_ALL
+void cg_plan_append_primitives (
+    CgPlan *self,
+    int topology,
+    guint instances,
+    CgBuffer *indices,
+    CgBuffer *first_buffer,
+    ...) G_GNUC_NULL_TERMINATED;
 
-/*! @brief Convert a plan object and its associated
- *         resources into backend specific instructions.
+/*! @brief Like @a cg_plan_append_primitives but
+ *         read a sized buffer instead.
  *
  * @param [in] self The plan object.
- * @param [out] error The return location
- *        for a recoverable error.
- *
- * This function will invoke the backend, which in turn
- * will attempt to consume and compile the plan into a
- * @a CgCommands object.
+ * @param [in] topology The primitive topology.
+ * @param [in] instances The number of
+ *        times to process the buffers.
+ * @param [in] indices An index buffer, or `NULL`.
+ * @param [in] buffer A buffer of @a CgBuffer .
+ * @param [in] n_buffers The length of the buffer.
  *
- * It is programmer error to call this function such that the
- * last reference to the plan will not be released. If references
- * are still held elsewhere, the function will log a critical
- * error and return `NULL`.
+ * @memberof CgPlan
+ *
+ */
+CPC_GPU_AVAILABLE_IN_ALL
+void cg_plan_append_primitives_v (
+    CgPlan *self,
+    int topology,
+    guint instances,
+    CgBuffer *indices,
+    CgBuffer **buffers,
+    guint n_buffers);
+
+/*! @brief Like @a cg_plan_append_primitives_v but
+ *         draw a range of instances.
+ *
+ * @param [in] self The plan object.
+ * @param [in] topology The primitive topology.
+ * @param [in] first_instance The instance to start at.
+ * @param [in] instances The number of instances to draw.
+ * @param [in] indices An index buffer, or `NULL`.
+ * @param [in] buffer A buffer of @a CgBuffer .
+ * @param [in] n_buffers The length of the buffer.
+ *
+ * Segments with a nonzero instance rate begin reading
+ * at @p first_instance , so draws can share one large
+ * buffer of per-instance data.
+ *
+ * @memberof CgPlan
+ *
+ */
+CPC_GPU_AVAILABLE_IN_ALL
+void cg_plan_append_instances_v (
+    CgPlan *self,
+    int topology,
+    guint first_instance,
+    guint instances,
+    CgBuffer *indices,
+    CgBuffer **buffers,
+    guint n_buffers);
+
+/*! @brief Copy a texture to the output.
+ *
+ * @param [in] self The plan object.
+ * @param [in] src The source texture.
+ *
+ * @memberof CgPlan
+ *
+ */
+CPC_GPU_AVAILABLE_IN_ALL
+void cg_plan_blit (CgPlan *self,
+                   CgTexture *src);
+
+/*! @brief Copy part of a texture to the output.
+ *
+ * @param [in] self The plan object.
+ * @param [in] src The source texture.
+ * @param [in] x The x coordinate of the source region.
+ * @param [in] y The y coordinate of the source region.
+ * @param [in] width The width of the source region.
+ * @param [in] height The height of the source region.
+ * @param [in] linear Whether to filter linearly when
+ *        the region is stretched, rather than picking
+ *        the nearest texel. Ignored for depth textures.
+ *
+ * The region is stretched over the group's destination
+ * rectangle.
+ *
+ * @memberof CgPlan
+ *
+ */
+CPC_GPU_AVAILABLE_IN_ALL
+void cg_plan_blit_region (
+    CgPlan *self,
+    CgTexture *src,
+    int x,
+    int y,
+    int width,
+    int height,
+    gboolean linear);
+
+/*! @brief Build a hierarchical depth pyramid
+ *         from a depth texture.
+ *
+ * @param [in] self The plan object.
+ * @param [in] depth The depth texture, which must
+ *        not be multisampled.
+ * @param [in] pyramid The texture receiving the pyramid,
+ *        usually created with @a cg_texture_new_depth_pyramid .
+ *        Its format must be @a CG_FORMAT_R32 and it must
+ *        not be larger than @p depth .
+ * @param [in] max_depth Whether each texel keeps the
+ *        largest depth it covers rather than the smallest.
+ *        Occlusion tests against a @a CG_TEST_LEQUAL depth
+ *        buffer want the largest.
+ *
+ * Level 0 of @p pyramid receives @p depth and every
+ * following level reduces the one before it, with odd
+ * sizes rounding outwards so no texel is left out.
+ * Every level the texture was created with is written
+ * in this one step, using compute where the backend
+ * supports it. The group's targets and state are left
+ * untouched.
+ *
+ * Later groups sample the result like any other texture
+ * uniform. Address levels explicitly, for instance with
+ * `texelFetch`, as the texture is filtered as if it had
+ * a single level.
+ *
+ * @memberof CgPlan
+ *
+ */
+CPC_GPU_AVAILABLE_IN_ALL
+void cg_plan_build_depth_pyramid (
+    CgPlan *self,
+    CgTexture *depth,
+    CgTexture *pyramid,
+    gboolean max_depth);
+
+/*! @brief Terminate the current child group
+ *         and in turn restore the state of the
+ *         plan object to before the group was
+ *         configured.
+ *
+ * @param [in] self The plan object.
+ * @param [in] n_groups The number of groups to pop.
+ *
+ * This function must always be paired with
+ * a preceding @a cg_plan_push_group or
+ * @a cg_plan_push_state .
+ *
+ * @memberof CgPlan
+ *
+ */
+CPC_GPU_AVAILABLE_IN_ALL
+void cg_plan_pop_n_groups (
+    CgPlan *self,
+    guint n_groups);
+
+/*! @brief A convenience macro to pop one group.
+ *
+ * @param [in] self The plan object.
+ *
+ * @memberof CgPlan
+ *
+ */
+#define cg_plan_pop(self) \
+  cg_plan_pop_n_groups (self, 1)
+
+/*! @brief Convert a plan object and its associated
+ *         resources into backend specific instructions.
+ *
+ * @param [in] self The plan object.
+ * @param [out] error The return location
+ *        for a recoverable error.
+ *
+ * This function will invoke the backend, which in turn
+ * will attempt to consume and compile the plan into a
+ * @a CgCommands object.
+ *
+ * It is programmer error to call this function such that the
+ * last reference to the plan will not be released. If references
+ * are still held elsewhere, the function will log a critical
+ * error and return `NULL`.
+ *
+ * A plan the backend cannot carry out as written fails
+ * with @a CG_ERROR_INVALID_PLAN , either here or, for
+ * backends which only walk the plan then, when the
+ * commands are dispatched.
  *
  * @return A newly allocated @a CgCommands object,
  *         or `NULL` if an error occured.
@@ -1314,12 +2528,904 @@ gboolean cg_commands_dispatch (
 CPC_GPU_AVAILABLE_IN_ALL
 GPtrArray *cg_commands_ref_last_debug_dispatch (CgCommands *self);
 
+/*! @brief The resource handle of the default framebuffer
+ *         in a @a CgGraph .
+ *
+ * Passes which write this resource are never culled.
+ *
+ */
+#define CG_GRAPH_DEFAULT_TARGET 0
+
+/*! @brief A callback which records the operations
+ *         of a @a CgGraph pass.
+ *
+ * @param [in] graph The graph being compiled.
+ * @param [in] plan The plan to record into. If the pass
+ *        writes textures, a group targeting them with
+ *        a full-size destination has already been pushed.
+ * @param [in] user_data The data passed to
+ *        @a cg_graph_add_pass .
+ *
+ * Any groups pushed by the callback must be popped
+ * before it returns.
+ *
+ */
+typedef void (*CgGraphPassFunc) (
+    CgGraph *graph,
+    CgPlan *plan,
+    gpointer user_data);
+
+/*! @brief Create a new @a CgGraph object.
+ *
+ * @param [in] self The GPU object.
+ *
+ * @return The newly allocated object.
+ *
+ * @memberof CgGraph
+ *
+ */
+CPC_GPU_AVAILABLE_IN_ALL
+CgGraph *cg_graph_new (CgGpu *self) G_GNUC_WARN_UNUSED_RESULT;
+
+/*! @brief Create a strong reference to
+ *         a @a CgGraph object.
+ *
+ * @param [in] self The object.
+ *
+ * @return The same object.
+ *
+ * @memberof CgGraph
+ *
+ */
+CPC_GPU_AVAILABLE_IN_ALL
+CgGraph *cg_graph_ref (CgGraph *self);
+
+/*! @brief Release a strong reference to
+ *         a @a CgGraph object.
+ *
+ * @param [in] self The object.
+ *
+ * @memberof CgGraph
+ *
+ */
+CPC_GPU_AVAILABLE_IN_ALL
+void cg_graph_unref (gpointer self);
+
+/*! @brief Add an existing texture to the graph.
+ *
+ * @param [in] self The graph object.
+ * @param [in] texture The texture.
+ *
+ * Passes writing an imported texture are still culled
+ * unless something in the graph reads it or it is
+ * marked with @a cg_graph_export .
+ *
+ * @return The resource handle.
+ *
+ * @memberof CgGraph
+ *
+ */
+CPC_GPU_AVAILABLE_IN_ALL
+guint cg_graph_import_texture (
+    CgGraph *self,
+    CgTexture *texture);
+
+/*! @brief Declare a transient texture owned by the graph.
+ *
+ * @param [in] self The graph object.
+ * @param [in] width The width of the image.
+ * @param [in] height The height of the image.
+ * @param [in] format The image format.
+ * @param [in] msaa The number of samples to use.
+ *
+ * The backing texture is only assigned during
+ * @a cg_graph_compile and may be shared with other
+ * transient resources whose lifetimes don't overlap.
+ *
+ * @return The resource handle.
+ *
+ * @memberof CgGraph
+ *
+ */
+CPC_GPU_AVAILABLE_IN_ALL
+guint cg_graph_create_texture (
+    CgGraph *self,
+    int width,
+    int height,
+    int format,
+    int msaa);
+
+/*! @brief Like @a cg_graph_create_texture but
+ *         for a depth component.
+ *
+ * @param [in] self The graph object.
+ * @param [in] width The width of the image.
+ * @param [in] height The height of the image.
+ * @param [in] msaa The number of samples to use.
+ *
+ * @return The resource handle.
+ *
+ * @memberof CgGraph
+ *
+ */
+CPC_GPU_AVAILABLE_IN_ALL
+guint cg_graph_create_depth (
+    CgGraph *self,
+    int width,
+    int height,
+    int msaa);
+
+/*! @brief Mark a resource as consumed outside of the graph.
+ *
+ * @param [in] self The graph object.
+ * @param [in] resource The resource handle.
+ *
+ * Passes writing an exported resource are never culled,
+ * and an exported transient texture is kept alive until
+ * the end of the graph.
+ *
+ * @memberof CgGraph
+ *
+ */
+CPC_GPU_AVAILABLE_IN_ALL
+void cg_graph_export (
+    CgGraph *self,
+    guint resource);
+
+/*! @brief Add a pass to the graph.
+ *
+ * @param [in] self The graph object.
+ * @param [in] name A name for the pass, used in errors.
+ * @param [in] func The callback which records the pass.
+ * @param [in] user_data The data to pass to `func`.
+ * @param [in] destroy_user_data The function used to
+ *        release `user_data`, or `NULL`.
+ *
+ * @return The pass handle.
+ *
+ * @memberof CgGraph
+ *
+ */
+CPC_GPU_AVAILABLE_IN_ALL
+guint cg_graph_add_pass (
+    CgGraph *self,
+    const char *name,
+    CgGraphPassFunc func,
+    gpointer user_data,
+    GDestroyNotify destroy_user_data);
+
+/*! @brief Declare that a pass samples or
+ *         blits from a resource.
+ *
+ * @param [in] self The graph object.
+ * @param [in] pass The pass handle.
+ * @param [in] resource The resource handle.
+ *
+ * The pass sees what the last pass added before it
+ * wrote, or the initial contents if there is no such
+ * pass, and passes added later that write the resource
+ * wait for it to finish.
+ *
+ * @memberof CgGraph
+ *
+ */
+CPC_GPU_AVAILABLE_IN_ALL
+void cg_graph_pass_read (
+    CgGraph *self,
+    guint pass,
+    guint resource);
+
+/*! @brief Declare that a pass renders into a resource.
+ *
+ * @param [in] self The graph object.
+ * @param [in] pass The pass handle.
+ * @param [in] resource The resource handle, or
+ *        @a CG_GRAPH_DEFAULT_TARGET .
+ *
+ * Writes to the same resource happen in the order
+ * the passes were added. A pass may not write both
+ * the default target and textures.
+ *
+ * @memberof CgGraph
+ *
+ */
+CPC_GPU_AVAILABLE_IN_ALL
+void cg_graph_pass_write (
+    CgGraph *self,
+    guint pass,
+    guint resource);
+
+/*! @brief Retrieve the texture backing a resource.
+ *
+ * @param [in] self The graph object.
+ * @param [in] resource The resource handle.
+ *
+ * Only valid from within a @a CgGraphPassFunc or after
+ * @a cg_graph_compile . When called from a pass which
+ * reads a multisampled resource, the resolved texture
+ * is returned instead.
+ *
+ * @return The texture, owned by the graph, or `NULL`
+ *         for @a CG_GRAPH_DEFAULT_TARGET .
+ *
+ * @memberof CgGraph
+ *
+ */
+CPC_GPU_AVAILABLE_IN_ALL
+CgTexture *cg_graph_get_texture (
+    CgGraph *self,
+    guint resource);
+
+/*! @brief Compile the graph into a new plan.
+ *
+ * @param [in] self The graph object.
+ * @param [out] error `GError` return location
+ *        for a recoverable error.
+ *
+ * The pass callbacks are invoked from within this
+ * function. The root group of the resulting plan is
+ * left pushed so it can be extended further; pop it
+ * before turning the plan into commands.
+ *
+ * @return The plan, or `NULL` on error.
+ *
+ * @memberof CgGraph
+ *
+ */
+CPC_GPU_AVAILABLE_IN_ALL
+CgPlan *cg_graph_compile (
+    CgGraph *self,
+    GError **error) G_GNUC_WARN_UNUSED_RESULT;
+
+/*! @brief Remove all passes and resources from the graph.
+ *
+ * @param [in] self The graph object.
+ *
+ * Transient textures are kept around so that the
+ * next compilation can reuse them, which makes it
+ * cheap to rebuild the graph every frame.
+ *
+ * @memberof CgGraph
+ *
+ */
+CPC_GPU_AVAILABLE_IN_ALL
+void cg_graph_reset (CgGraph *self);
+
+/*! @brief Create a new @a CgScaler object.
+ *
+ * @param [in] self The GPU object.
+ * @param [in] target_ms The GPU time per dispatch to
+ *        aim for, in milliseconds.
+ * @param [in] min_scale The lowest scale the controller
+ *        may choose, between `0` and `1`.
+ * @param [out] error `GError` return location
+ *        for a recoverable error.
+ *
+ * Fails if the backend cannot measure GPU time.
+ *
+ * @return The newly allocated object, or `NULL` on error.
+ *
+ * @memberof CgScaler
+ *
+ */
+CPC_GPU_AVAILABLE_IN_ALL
+CgScaler *cg_scaler_new (
+    CgGpu *self,
+    double target_ms,
+    double min_scale,
+    GError **error) G_GNUC_WARN_UNUSED_RESULT;
+
+/*! @brief Create a strong reference to
+ *         a @a CgScaler object.
+ *
+ * @param [in] self The object.
+ *
+ * @return The same object.
+ *
+ * @memberof CgScaler
+ *
+ */
+CPC_GPU_AVAILABLE_IN_ALL
+CgScaler *cg_scaler_ref (CgScaler *self);
+
+/*! @brief Release a strong reference to
+ *         a @a CgScaler object.
+ *
+ * @param [in] self The object.
+ *
+ * @memberof CgScaler
+ *
+ */
+CPC_GPU_AVAILABLE_IN_ALL
+void cg_scaler_unref (gpointer self);
+
+/*! @brief Dispatch commands while measuring
+ *         how long the GPU takes to run them.
+ *
+ * @param [in] self The scaler object.
+ * @param [in] commands The commands to dispatch.
+ * @param [out] error `GError` return location
+ *        for a recoverable error.
+ *
+ * Measurements become available a few frames late and
+ * are collected here without stalling, after which the
+ * scale is updated. Call this once per frame with the
+ * commands that render the scaled content.
+ *
+ * @return Whether the dispatch succeeded.
+ *
+ * @memberof CgScaler
+ *
+ */
+CPC_GPU_AVAILABLE_IN_ALL
+gboolean cg_scaler_dispatch (
+    CgScaler *self,
+    CgCommands *commands,
+    GError **error);
+
+/*! @brief Retrieve the current resolution scale.
+ *
+ * @param [in] self The scaler object.
+ *
+ * @return The scale, between the minimum
+ *         scale and `1`.
+ *
+ * @memberof CgScaler
+ *
+ */
+CPC_GPU_AVAILABLE_IN_ALL
+double cg_scaler_get_scale (CgScaler *self);
+
+/*! @brief Retrieve the smoothed GPU time of
+ *         recent dispatches.
+ *
+ * @param [in] self The scaler object.
+ *
+ * @return The time in milliseconds, or a negative
+ *         number if nothing was measured yet.
+ *
+ * @memberof CgScaler
+ *
+ */
+CPC_GPU_AVAILABLE_IN_ALL
+double cg_scaler_get_gpu_ms (CgScaler *self);
+
+/*! @brief Set the destination of the configuring
+ *         group to the scaled portion of a target.
+ *
+ * @param [in] self The scaler object.
+ * @param [in] plan The plan object.
+ * @param [in] target A scalable render target,
+ *        allocated at its maximum size.
+ *
+ * The equivalent of calling @a cg_plan_config_dest
+ * with the scaled size of @p target .
+ *
+ * @memberof CgScaler
+ *
+ */
+CPC_GPU_AVAILABLE_IN_ALL
+void cg_scaler_config_dest (
+    CgScaler *self,
+    CgPlan *plan,
+    CgTexture *target);
+
+/*! @brief Stretch the scaled portion of a
+ *         target over the current group.
+ *
+ * @param [in] self The scaler object.
+ * @param [in] plan The plan object.
+ * @param [in] target A scalable render target
+ *        previously drawn to within a group set
+ *        up with @a cg_scaler_config_dest .
+ *
+ * The equivalent of calling @a cg_plan_blit_region
+ * with linear filtering.
+ *
+ * @memberof CgScaler
+ *
+ */
+CPC_GPU_AVAILABLE_IN_ALL
+void cg_scaler_blit (
+    CgScaler *self,
+    CgPlan *plan,
+    CgTexture *target);
+
+/*! @brief A description of the state a draw runs
+ *         with, for use with @a cg_gpu_warm_up
+ *
+ * Zeroed fields select the same defaults a plan would.
+ *
+ */
+typedef struct
+{
+  CgShader *shader;            /*!< The shader. */
+  const int *color_formats;    /*!< The format of each color target. */
+  guint n_color_formats;       /*!< The number of color targets. */
+  gboolean depth;              /*!< Whether a depth target is attached. */
+  int msaa;                    /*!< The number of samples of the targets. */
+  int src_blend;               /*!< The source blend factor of the color
+                                    targets; see @a CG_BLEND_ZERO . */
+  int dst_blend;               /*!< The destination blend factor. */
+  int depth_test_func;         /*!< The depth test; see @a CG_TEST_NEVER . */
+  gboolean no_backface_cull;   /*!< Whether backface culling is disabled. */
+  const CgDataSegment *layout; /*!< The vertex layout. */
+  guint layout_length;         /*!< The length of the vertex layout. */
+  int topology;                /*!< The primitive topology; see
+                                    @a CG_TOPOLOGY_TRIANGLES . */
+} CgPipelineDesc;
+
+/*! @brief Gather the draw states used by a plan.
+ *
+ * @param [in] self The plan object.
+ * @param [out] n_descs Return location for the
+ *        number of descriptions.
+ *
+ * Every distinct combination of shader, targets, blend,
+ * depth, culling, vertex layout and topology is reported
+ * once. Draws using more than one vertex buffer are
+ * skipped. Keep the result around, for instance from a
+ * previous session's first frames, and hand it to
+ * @a cg_gpu_warm_up during loading.
+ *
+ * @return A newly allocated array, to be freed
+ *         with @a cg_pipeline_descs_free .
+ *
+ * @memberof CgPlan
+ *
+ */
+CPC_GPU_AVAILABLE_IN_ALL
+CgPipelineDesc *cg_plan_collect_pipelines (
+    CgPlan *self,
+    guint *n_descs) G_GNUC_WARN_UNUSED_RESULT;
+
+/*! @brief Free an array returned by
+ *         @a cg_plan_collect_pipelines
+ *
+ * @param [in] descs The array.
+ * @param [in] n_descs The length of the array.
+ *
+ */
+CPC_GPU_AVAILABLE_IN_ALL
+void cg_pipeline_descs_free (
+    CgPipelineDesc *descs,
+    guint n_descs);
+
+/*! @brief Prepare shaders and draw states ahead of time.
+ *
+ * @param [in] self The GPU object.
+ * @param [in] descs The draw states to prepare.
+ * @param [in] n_descs The number of draw states.
+ * @param [out] error `GError` return location
+ *        for a recoverable error.
+ *
+ * Shaders are compiled, small offscreen targets of the
+ * requested formats are created, and a single degenerate
+ * triangle is drawn with each state so the driver builds
+ * its internal pipelines now rather than on the first
+ * frame that needs them. Meant to be called while
+ * loading.
+ *
+ * @return Whether warming up succeeded.
+ *
+ * @memberof CgGpu
+ *
+ */
+CPC_GPU_AVAILABLE_IN_ALL
+gboolean cg_gpu_warm_up (
+    CgGpu *self,
+    const CgPipelineDesc *descs,
+    guint n_descs,
+    GError **error);
+
+/*! @brief Mesh optimization flags.
+ *
+ * For use with @a cg_mesh_optimize
+ *
+ */
+enum
+{
+  CG_MESH_DEDUPLICATE = 1 << 0,    /*!< Merge bitwise identical vertices. */
+  CG_MESH_OPTIMIZE_CACHE = 1 << 1, /*!< Reorder triangles for post-transform
+                                        vertex cache locality. */
+  CG_MESH_OPTIMIZE_FETCH = 1 << 2, /*!< Reorder vertices so they are fetched
+                                        in ascending order. */
+  CG_MESH_32_BIT_INDICES = 1 << 3, /*!< Always produce 32-bit indices, even when
+                                        the vertex count would fit in 16 bits. */
+
+  CG_MESH_OPTIMIZE_ALL = CG_MESH_DEDUPLICATE | CG_MESH_OPTIMIZE_CACHE | CG_MESH_OPTIMIZE_FETCH, /*!< Everything except forced 32-bit indices */
+};
+
+/*! @brief The result of @a cg_mesh_optimize .
+ *
+ * The vertex data shares the layout of the input
+ * and can be passed to @a cg_buffer_new_for_data
+ * along with the same spec, while the index data
+ * is meant for @a cg_buffer_new_for_indices .
+ * Release the contents with @a cg_mesh_clear .
+ *
+ * The average cache miss ratio (ACMR) is the number
+ * of vertex shader invocations per triangle with a
+ * simulated FIFO post-transform cache. 3 is the
+ * worst possible value and 0.5 is the ideal for
+ * large regular meshes.
+ *
+ */
+typedef struct
+{
+  gpointer vertices;      /*!< The optimized vertex data. */
+  gsize vertices_size;    /*!< The size of the vertex data. */
+  gpointer indices;       /*!< The generated index data. */
+  gsize indices_size;     /*!< The size of the index data. */
+  int index_format;       /*!< Either @a CG_COMPONENT_UINT16 or
+                               @a CG_COMPONENT_UINT32 . */
+
+  guint n_input_vertices; /*!< The number of vertices in the input. */
+  guint n_vertices;       /*!< The number of vertices in the output. */
+  guint n_triangles;      /*!< The number of triangles in both. */
+  float acmr_before;      /*!< The ACMR before triangle reordering. */
+  float acmr_after;       /*!< The ACMR after triangle reordering. */
+} CgMesh;
+
+/*! @brief Convert a triangle list into an
+ *         optimized indexed mesh.
+ *
+ * @param [in] spec The data layout spec of the vertices.
+ * @param [in] spec_length The length of the layout spec buffer.
+ * @param [in] data The vertex data, three vertices per triangle.
+ * @param [in] size The size of the vertex data.
+ * @param [in] flags A bitmask of @a CG_MESH_DEDUPLICATE
+ *        and friends.
+ * @param [in] cache_size The size of the vertex cache to
+ *        optimize for, or 0 for a reasonable default.
+ * @param [out] mesh The location to store the result.
+ *
+ * This is a CPU-only utility and doesn't require a
+ * @a CgGpu . Large meshes are processed on multiple
+ * threads. Triangle reordering uses the Tipsify
+ * algorithm from Sander et al., run independently
+ * on contiguous runs of triangles when threaded.
+ *
+ * Indices of value `0xFFFF` are never produced in
+ * 16-bit mode, leaving it free for primitive restart.
+ *
+ * @return Whether `mesh` was populated.
+ *
+ */
+CPC_GPU_AVAILABLE_IN_ALL
+gboolean cg_mesh_optimize (
+    const CgDataSegment *spec,
+    guint spec_length,
+    gconstpointer data,
+    gsize size,
+    int flags,
+    guint cache_size,
+    CgMesh *mesh);
+
+/*! @brief Release the data held by a @a CgMesh .
+ *
+ * @param [in] self The mesh to clear.
+ *
+ */
+CPC_GPU_AVAILABLE_IN_ALL
+void cg_mesh_clear (CgMesh *self);
+
+/*! @brief Create a new @a CgBatch object.
+ *
+ * @param [in] self The GPU object.
+ *
+ * @return The newly allocated object.
+ *
+ * @memberof CgBatch
+ *
+ */
+CPC_GPU_AVAILABLE_IN_ALL
+CgBatch *cg_batch_new (CgGpu *self) G_GNUC_WARN_UNUSED_RESULT;
+
+/*! @brief Create a strong reference to
+ *         a @a CgBatch object.
+ *
+ * @param [in] self The object.
+ *
+ * @return The same object.
+ *
+ * @memberof CgBatch
+ *
+ */
+CPC_GPU_AVAILABLE_IN_ALL
+CgBatch *cg_batch_ref (CgBatch *self);
+
+/*! @brief Release a strong reference to
+ *         a @a CgBatch object.
+ *
+ * @param [in] self The object.
+ *
+ * @memberof CgBatch
+ *
+ */
+CPC_GPU_AVAILABLE_IN_ALL
+void cg_batch_unref (gpointer self);
+
+/*! @brief Add a transformed quad to the batch.
+ *
+ * @param [in] self The batch object.
+ * @param [in] layer Quads in lower layers are drawn
+ *        first. Within a layer, quads may be reordered
+ *        to group them by texture.
+ * @param [in] texture The texture to sample, or `NULL`
+ *        for a plain colored quad.
+ * @param [in] uv The region of @p texture to sample as
+ *        `{ u0, v0, u1, v1 }` , for example a rectangle
+ *        in an atlas, or `NULL` for the whole texture.
+ * @param [in] transform An affine transform from the
+ *        unit square to pixels, laid out like a
+ *        `cairo_matrix_t` :
+ *        `{ xx, yx, xy, yy, x0, y0 }` .
+ * @param [in] color An RGBA color between `0` and `1`
+ *        multiplied with the texture, or `NULL` for
+ *        opaque white.
+ *
+ * @memberof CgBatch
+ *
+ */
+CPC_GPU_AVAILABLE_IN_ALL
+void cg_batch_add (
+    CgBatch *self,
+    int layer,
+    CgTexture *texture,
+    const float *uv,
+    const float *transform,
+    const float *color);
+
+/*! @brief Add an axis-aligned quad to the batch.
+ *
+ * @param [in] self The batch object.
+ * @param [in] layer See @a cg_batch_add .
+ * @param [in] texture The texture, or `NULL` .
+ * @param [in] uv The region of @p texture , or `NULL` .
+ * @param [in] x The left edge in pixels.
+ * @param [in] y The top edge in pixels.
+ * @param [in] width The width in pixels.
+ * @param [in] height The height in pixels.
+ * @param [in] color The color, or `NULL` .
+ *
+ * @memberof CgBatch
+ *
+ */
+CPC_GPU_AVAILABLE_IN_ALL
+void cg_batch_add_rect (
+    CgBatch *self,
+    int layer,
+    CgTexture *texture,
+    const float *uv,
+    float x,
+    float y,
+    float width,
+    float height,
+    const float *color);
+
+/*! @brief Retrieve the number of quads waiting
+ *         to be flushed.
+ *
+ * @param [in] self The batch object.
+ *
+ * @return The number of quads.
+ *
+ * @memberof CgBatch
+ *
+ */
+CPC_GPU_AVAILABLE_IN_ALL
+guint cg_batch_get_n_quads (CgBatch *self);
+
+/*! @brief Draw every quad in the batch into a plan.
+ *
+ * @param [in] self The batch object.
+ * @param [in] plan The plan object.
+ * @param [in] width The width of the destination in
+ *        pixels, which quad coordinates are relative to.
+ * @param [in] height The height of the destination.
+ *
+ * Groups are pushed under the current group of
+ * @p plan , so its targets, destination and blending
+ * apply. Depth testing is disabled for the quads.
+ * The batch is empty afterwards and can be reused.
+ *
+ * @memberof CgBatch
+ *
+ */
+CPC_GPU_AVAILABLE_IN_ALL
+void cg_batch_flush (
+    CgBatch *self,
+    CgPlan *plan,
+    int width,
+    int height);
+
+/*! @brief Discard every quad in the batch.
+ *
+ * @param [in] self The batch object.
+ *
+ * @memberof CgBatch
+ *
+ */
+CPC_GPU_AVAILABLE_IN_ALL
+void cg_batch_clear (CgBatch *self);
+
+/*! @brief Produce a page of a virtual texture.
+ *
+ * @param [in] level The mip level of the page, where
+ *        0 is full resolution.
+ * @param [in] x The column of the page within @p level .
+ * @param [in] y The row of the page within @p level .
+ * @param [in] page_size The width and height of the page.
+ * @param [in] user_data The user data.
+ * @return A newly allocated buffer of
+ *         @p page_size * @p page_size RGBA8 pixels,
+ *         freed with g_free, or NULL on failure.
+ *
+ * This is called from worker threads.
+ *
+ */
+typedef gpointer (*CgVirtualTextureLoadFunc) (
+    int level,
+    int x,
+    int y,
+    int page_size,
+    gpointer user_data);
+
+/*! @brief Create a new @a CgVirtualTexture object.
+ *
+ * @param [in] self The gpu object.
+ * @param [in] width The width of the full image.
+ * @param [in] height The height of the full image.
+ * @param [in] page_size The width and height of a page.
+ * @param [in] cache_pages The width and height of the
+ *        page cache in pages, at most 256.
+ * @param [in] load The function producing pages.
+ * @param [in] user_data User data for @p load .
+ * @param [in] destroy_user_data A function to free
+ *        @p user_data with, or NULL.
+ * @param [out] error Error return location.
+ * @return A new virtual texture object, or NULL on error.
+ *
+ * @memberof CgVirtualTexture
+ *
+ */
+CPC_GPU_AVAILABLE_IN_ALL
+CgVirtualTexture *cg_virtual_texture_new (
+    CgGpu *self,
+    int width,
+    int height,
+    int page_size,
+    int cache_pages,
+    CgVirtualTextureLoadFunc load,
+    gpointer user_data,
+    GDestroyNotify destroy_user_data,
+    GError **error) G_GNUC_WARN_UNUSED_RESULT;
+
+/*! @brief Increase the reference count of
+ *         a @a CgVirtualTexture object.
+ *
+ * @param [in] self The virtual texture object.
+ * @return @p self .
+ *
+ * @memberof CgVirtualTexture
+ *
+ */
+CPC_GPU_AVAILABLE_IN_ALL
+CgVirtualTexture *cg_virtual_texture_ref (CgVirtualTexture *self);
+
+/*! @brief Decrease the reference count of
+ *         a @a CgVirtualTexture object.
+ *
+ * @param [in] self The virtual texture object.
+ *
+ * @memberof CgVirtualTexture
+ *
+ */
+CPC_GPU_AVAILABLE_IN_ALL
+void cg_virtual_texture_unref (gpointer self);
+
+/*! @brief Get GLSL helpers for sampling virtual textures.
+ *
+ * @return Shader source to paste into a fragment
+ *         shader after the version directive.
+ *
+ * The source declares the uniforms @a vtCache ,
+ * @a vtIndirection , @a vtSize and @a vtInfo , and
+ * two functions. @a vtSample(uv) returns the color of
+ * the finest resident page at @a uv , and
+ * @a vtFeedback(uv) returns the pixel a feedback
+ * pass should write for @a uv .
+ *
+ * @memberof CgVirtualTexture
+ *
+ */
+CPC_GPU_AVAILABLE_IN_ALL
+const char *cg_virtual_texture_get_glsl (void);
+
+/*! @brief Configure uniforms for sampling a virtual texture.
+ *
+ * @param [in] self The virtual texture object.
+ * @param [in] plan The plan object, which must be
+ *        in the configuration stage.
+ *
+ * @memberof CgVirtualTexture
+ *
+ */
+CPC_GPU_AVAILABLE_IN_ALL
+void cg_virtual_texture_config_uniforms (
+    CgVirtualTexture *self,
+    CgPlan *plan);
+
+/*! @brief Configure a plan group as the feedback pass.
+ *
+ * @param [in] self The virtual texture object.
+ * @param [in] plan The plan object, which must be
+ *        in the configuration stage.
+ * @param [in] width The width of the view being drawn.
+ * @param [in] height The height of the view being drawn.
+ *
+ * This sets the target, destination and uniforms of
+ * the group. Geometry drawn into it should use a
+ * shader writing @a vtFeedback . The next call to
+ * @a cg_virtual_texture_update starts reading the
+ * result back without stalling, and the pages it
+ * names are requested once it arrives, usually a
+ * frame or two later.
+ *
+ * @memberof CgVirtualTexture
+ *
+ */
+CPC_GPU_AVAILABLE_IN_ALL
+void cg_virtual_texture_config_feedback (
+    CgVirtualTexture *self,
+    CgPlan *plan,
+    int width,
+    int height);
+
+/*! @brief Request visible pages and upload loaded ones.
+ *
+ * @param [in] self The virtual texture object.
+ * @param [out] error Error return location.
+ * @return Whether the operation succeeded.
+ *
+ * Call this once per frame, after the commands drawing
+ * the feedback pass were dispatched and before the
+ * next plan sampling the texture is dispatched.
+ *
+ * @memberof CgVirtualTexture
+ *
+ */
+CPC_GPU_AVAILABLE_IN_ALL
+gboolean cg_virtual_texture_update (
+    CgVirtualTexture *self,
+    GError **error);
+
+/*! @brief Get the number of pages in the cache.
+ *
+ * @param [in] self The virtual texture object.
+ * @return The number of resident pages.
+ *
+ * @memberof CgVirtualTexture
+ *
+ */
+CPC_GPU_AVAILABLE_IN_ALL
+guint cg_virtual_texture_get_n_resident (CgVirtualTexture *self);
+
 G_DEFINE_AUTOPTR_CLEANUP_FUNC (CgGpu, cg_gpu_unref);
 G_DEFINE_AUTOPTR_CLEANUP_FUNC (CgPlan, cg_plan_unref);
 G_DEFINE_AUTOPTR_CLEANUP_FUNC (CgShader, cg_shader_unref);
 G_DEFINE_AUTOPTR_CLEANUP_FUNC (CgBuffer, cg_buffer_unref);
 G_DEFINE_AUTOPTR_CLEANUP_FUNC (CgTexture, cg_texture_unref);
 G_DEFINE_AUTOPTR_CLEANUP_FUNC (CgCommands, cg_commands_unref);
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (CgGraph, cg_graph_unref);
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (CgScaler, cg_scaler_unref);
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (CgBatch, cg_batch_unref);
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (CgVirtualTexture, cg_virtual_texture_unref);
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (CgFence, cg_fence_unref);
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (CgReadback, cg_readback_unref);
+G_DEFINE_AUTO_CLEANUP_CLEAR_FUNC (CgMesh, cg_mesh_clear);
+G_DEFINE_AUTO_CLEANUP_CLEAR_FUNC (CgDmabuf, cg_dmabuf_clear);
 
 G_END_DECLS
 
@@ -0,0 +1,211 @@
+#define G_LOG_DOMAIN "CpcGpuTest"
+#include <cpc-gpu/cpc-gpu.h>
+
+#include "fixture.h"
+#include "null-gl.h"
+
+/* Counts the heap allocations the library makes for a few
+ * scripted workloads on the null GL implementation, and
+ * fails if they regress. Repeatedly dispatching the same
+ * commands must not allocate at all, and rebuilding the
+ * same plan must allocate the same amount every time,
+ * within a budget that grows with the number of draws.
+ *
+ * The allocator is interposed by defining malloc and
+ * friends here, which forward to glibc's own entry points.
+ * Every shared library, GLib included, resolves to these. */
+
+#define DEFAULT_DRAWS 100
+#define DEFAULT_ITERATIONS 100
+#define REBUILDS 3
+
+/* Generous on purpose: this should catch per-node string
+ * building or quadratic growth, not small changes */
+#define PLAN_ALLOCATIONS_PER_DRAW 64
+#define PLAN_ALLOCATIONS_FIXED 256
+
+extern void *__libc_malloc (size_t size);
+extern void *__libc_calloc (size_t n, size_t size);
+extern void *__libc_realloc (void *ptr, size_t size);
+extern void *__libc_memalign (size_t alignment, size_t size);
+
+static gint counting = FALSE;
+static guint64 n_allocations = 0;
+
+static inline void
+count_allocation (void)
+{
+  if (g_atomic_int_get (&counting))
+    __atomic_fetch_add (&n_allocations, 1, __ATOMIC_RELAXED);
+}
+
+void *
+malloc (size_t size)
+{
+  count_allocation ();
+  return __libc_malloc (size);
+}
+
+void *
+calloc (size_t n,
+        size_t size)
+{
+  count_allocation ();
+  return __libc_calloc (n, size);
+}
+
+void *
+realloc (void *ptr,
+         size_t size)
+{
+  count_allocation ();
+  return __libc_realloc (ptr, size);
+}
+
+void *
+aligned_alloc (size_t alignment,
+               size_t size)
+{
+  count_allocation ();
+  return __libc_memalign (alignment, size);
+}
+
+int
+posix_memalign (void **ptr,
+                size_t alignment,
+                size_t size)
+{
+  count_allocation ();
+  *ptr = __libc_memalign (alignment, size);
+  return *ptr != NULL ? 0 : 12 /* ENOMEM */;
+}
+
+static void
+begin_counting (void)
+{
+  __atomic_store_n (&n_allocations, 0, __ATOMIC_RELAXED);
+  g_atomic_int_set (&counting, TRUE);
+}
+
+static guint64
+end_counting (void)
+{
+  g_atomic_int_set (&counting, FALSE);
+  return __atomic_load_n (&n_allocations, __ATOMIC_RELAXED);
+}
+
+static gboolean
+check_dispatch (CgGpu *gpu,
+                CgShader *shader,
+                CgBuffer *vertices,
+                guint n_draws,
+                guint iterations,
+                GError **error)
+{
+  g_autoptr (CgCommands) commands = NULL;
+  guint64 allocations = 0;
+  gboolean success = TRUE;
+
+  commands = cg_plan_unref_to_commands (
+      fixture_build_plan (gpu, NULL, 1920, 1080, shader, vertices, n_draws), error);
+  if (commands == NULL)
+    return FALSE;
+
+  /* The first dispatch may set up state lazily */
+  if (!cg_commands_dispatch (commands, error))
+    return FALSE;
+
+  begin_counting ();
+  for (guint i = 0; i < iterations && success; i++)
+    success = cg_commands_dispatch (commands, error);
+  allocations = end_counting ();
+
+  if (!success)
+    return FALSE;
+
+  g_print ("dispatch %10" G_GUINT64_FORMAT " allocations over %u dispatches\n",
+           allocations, iterations);
+  return allocations == 0;
+}
+
+static gboolean
+check_rebuild (CgGpu *gpu,
+               CgShader *shader,
+               CgBuffer *vertices,
+               guint n_draws,
+               GError **error)
+{
+  guint64 budget = PLAN_ALLOCATIONS_FIXED + (guint64)PLAN_ALLOCATIONS_PER_DRAW * n_draws;
+  guint64 allocations[REBUILDS + 1] = { 0 };
+
+  /* The first build links the program */
+  for (guint i = 0; i < G_N_ELEMENTS (allocations); i++)
+    {
+      g_autoptr (CgCommands) commands = NULL;
+
+      begin_counting ();
+      commands = cg_plan_unref_to_commands (
+          fixture_build_plan (gpu, NULL, 1920, 1080, shader, vertices, n_draws), error);
+      allocations[i] = end_counting ();
+
+      if (commands == NULL)
+        return FALSE;
+    }
+
+  g_print ("rebuild  %10" G_GUINT64_FORMAT " allocations per plan of %u draws (budget %" G_GUINT64_FORMAT ")\n",
+           allocations[1], n_draws, budget);
+
+  for (guint i = 1; i < G_N_ELEMENTS (allocations); i++)
+    {
+      if (allocations[i] != allocations[1] || allocations[i] > budget)
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+int
+main (int argc,
+      char **argv)
+{
+  g_autoptr (GError) local_error = NULL;
+  guint n_draws = DEFAULT_DRAWS;
+  guint iterations = DEFAULT_ITERATIONS;
+  g_autoptr (CgGpu) gpu = NULL;
+  g_autoptr (CgShader) shader = NULL;
+  g_autoptr (CgBuffer) vertices = NULL;
+  gboolean success = FALSE;
+
+  if (argc > 1)
+    n_draws = MAX (1, g_ascii_strtoull (argv[1], NULL, 10));
+  if (argc > 2)
+    iterations = MAX (1, g_ascii_strtoull (argv[2], NULL, 10));
+
+  gpu = cg_gpu_new (
+      CG_INIT_FLAG_BACKEND_OPENGL
+          | CG_INIT_FLAG_NO_FALLBACK,
+      null_gl_get_proc_address, &local_error);
+  if (gpu == NULL)
+    goto err;
+  cg_gpu_steal_this_thread (gpu);
+
+  shader = fixture_new_shader (gpu);
+  vertices = fixture_new_triangle (gpu);
+
+  success = check_dispatch (gpu, shader, vertices, n_draws, iterations, &local_error)
+            && check_rebuild (gpu, shader, vertices, n_draws, &local_error);
+  if (!success && local_error != NULL)
+    goto err;
+
+  g_clear_pointer (&vertices, cg_buffer_unref);
+  g_clear_pointer (&shader, cg_shader_unref);
+  cg_gpu_release_this_thread (gpu);
+
+  if (!success)
+    g_printerr ("Allocation counts regressed\n");
+  return success ? 0 : 1;
+
+err:
+  g_printerr ("%s\n", local_error != NULL ? local_error->message : "Unknown error");
+  return 1;
+}
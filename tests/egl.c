@@ -0,0 +1,730 @@
+#define _GNU_SOURCE
+#define G_LOG_DOMAIN "CpcGpuTest"
+#include <cpc-gpu/cpc-gpu.h>
+
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/udmabuf.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "fixture.h"
+
+/* Renders through real OpenGL contexts from EGL's
+ * surfaceless platform, which Mesa backs with llvmpipe
+ * where there is no GPU. Every test skips itself when
+ * no such context can be made. */
+
+#define SIZE 8
+
+static const float red[] = { 1.0f, 0.0f, 0.0f, 1.0f };
+static const float green[] = { 0.0f, 1.0f, 0.0f, 1.0f };
+
+static gboolean
+skip_if_unsupported (GError *error)
+{
+  if (g_error_matches (error, CG_ERROR, CG_ERROR_NOT_SUPPORTED)
+      || g_error_matches (error, CG_ERROR, CG_ERROR_FAILED_INIT))
+    {
+      g_test_skip (error->message);
+      return TRUE;
+    }
+
+  return FALSE;
+}
+
+static void
+assert_filled (CgTexture *texture,
+               guint32 rgba)
+{
+  g_autoptr (GError) local_error = NULL;
+  guint8 pixels[SIZE * SIZE * 4] = { 0 };
+
+  g_assert_true (cg_texture_download (texture, pixels, sizeof (pixels), &local_error));
+  g_assert_no_error (local_error);
+  g_assert_true (fixture_pixels_equal (pixels, SIZE * SIZE, rgba));
+}
+
+static void
+test_headless_draw (void)
+{
+  g_autoptr (GError) local_error = NULL;
+  g_autoptr (CgGpu) gpu = NULL;
+  g_autoptr (CgTexture) target = NULL;
+
+  gpu = cg_gpu_new_headless (0, -1, &local_error);
+  if (gpu == NULL && skip_if_unsupported (local_error))
+    return;
+  g_assert_no_error (local_error);
+  cg_gpu_steal_this_thread (gpu);
+
+  target = cg_texture_new_for_data (gpu, NULL, 0, SIZE, SIZE, CG_FORMAT_RGBA8, 1, 0);
+  g_assert_true (fixture_fill (gpu, target, SIZE, SIZE, red, &local_error));
+  g_assert_no_error (local_error);
+
+  assert_filled (target, 0xff0000ff);
+
+  g_clear_pointer (&target, cg_texture_unref);
+  cg_gpu_release_this_thread (gpu);
+}
+
+/* A 4x4 page image drawn at its own size, which makes the
+ * feedback pass ask for every page of the finest level */
+#define VT_SIZE 64
+#define VT_PAGE_SIZE 16
+#define VT_ALL_PAGES (16 + 4 + 1)
+#define VT_MAX_FRAMES 200
+
+static const char *vt_vertex_shader =
+    "#version 330\n"
+    "in vec3 position;\n"
+    "out vec2 uv;\n"
+    "void main() { uv = position.xy * 0.5 + 0.5; gl_Position = vec4(position, 1.0); }\n";
+
+static const char *vt_fragment_shader =
+    "in vec2 uv;\n"
+    "out vec4 color;\n"
+    "void main() { color = vtFeedback(uv); }\n";
+
+static gpointer
+load_vt_page (int level,
+              int x,
+              int y,
+              int page_size,
+              gpointer user_data)
+{
+  return g_malloc0 ((gsize)page_size * page_size * 4);
+}
+
+static void
+test_virtual_texture_feedback (void)
+{
+  g_autoptr (GError) local_error = NULL;
+  g_autoptr (CgGpu) gpu = NULL;
+  g_autoptr (CgVirtualTexture) vt = NULL;
+  g_autoptr (CgShader) shader = NULL;
+  g_autoptr (CgBuffer) vertices = NULL;
+  g_autofree char *fragment_shader = NULL;
+  guint frame = 0;
+
+  gpu = cg_gpu_new_headless (0, -1, &local_error);
+  if (gpu == NULL && skip_if_unsupported (local_error))
+    return;
+  g_assert_no_error (local_error);
+  cg_gpu_steal_this_thread (gpu);
+
+  vt = cg_virtual_texture_new (
+      gpu, VT_SIZE, VT_SIZE, VT_PAGE_SIZE, 8,
+      load_vt_page, NULL, NULL, &local_error);
+  g_assert_no_error (local_error);
+
+  fragment_shader = g_strconcat (
+      "#version 330\n", cg_virtual_texture_get_glsl (), vt_fragment_shader, NULL);
+  shader = cg_shader_new_for_code (gpu, vt_vertex_shader, fragment_shader);
+  vertices = fixture_new_quad (gpu);
+
+  /* Pages load on other threads, so keep drawing
+   * frames until they have all arrived */
+  for (; frame < VT_MAX_FRAMES && cg_virtual_texture_get_n_resident (vt) < VT_ALL_PAGES; frame++)
+    {
+      g_autoptr (CgCommands) commands = NULL;
+      CgPlan *plan = NULL;
+
+      plan = cg_plan_new (gpu);
+      cg_plan_begin_config (plan);
+      cg_virtual_texture_config_feedback (vt, plan, VT_SIZE, VT_SIZE);
+      cg_plan_config_shader (plan, shader);
+      cg_plan_push_group (plan);
+      cg_plan_append (plan, 1, vertices, NULL);
+      cg_plan_pop (plan);
+
+      commands = cg_plan_unref_to_commands (plan, &local_error);
+      g_assert_no_error (local_error);
+      g_assert_true (cg_commands_dispatch (commands, &local_error));
+      g_assert_no_error (local_error);
+
+      g_assert_true (cg_virtual_texture_update (vt, &local_error));
+      g_assert_no_error (local_error);
+      g_usleep (G_TIME_SPAN_MILLISECOND);
+    }
+
+  g_assert_cmpuint (cg_virtual_texture_get_n_resident (vt), ==, VT_ALL_PAGES);
+
+  g_clear_pointer (&vertices, cg_buffer_unref);
+  g_clear_pointer (&shader, cg_shader_unref);
+  g_clear_pointer (&vt, cg_virtual_texture_unref);
+  cg_gpu_release_this_thread (gpu);
+}
+
+static void
+test_dmabuf_round_trip (void)
+{
+  g_autoptr (GError) local_error = NULL;
+  g_autoptr (CgGpu) gpu = NULL;
+  g_autoptr (CgTexture) source = NULL;
+  g_autoptr (CgTexture) imported = NULL;
+  g_auto (CgDmabuf) dmabuf = { 0 };
+
+  gpu = cg_gpu_new_headless (0, -1, &local_error);
+  if (gpu == NULL && skip_if_unsupported (local_error))
+    return;
+  g_assert_no_error (local_error);
+  cg_gpu_steal_this_thread (gpu);
+
+  source = cg_texture_new_for_data (gpu, NULL, 0, SIZE, SIZE, CG_FORMAT_RGBA8, 1, 0);
+  g_assert_true (fixture_fill (gpu, source, SIZE, SIZE, green, &local_error));
+  g_assert_no_error (local_error);
+
+  /* Software drivers can only export with a render
+   * node or udmabuf to allocate from */
+  if (!cg_texture_export_dmabuf (source, &dmabuf, &local_error))
+    {
+      if (g_error_matches (local_error, CG_ERROR, CG_ERROR_NOT_SUPPORTED)
+          || g_error_matches (local_error, CG_ERROR, CG_ERROR_FAILED_TEXTURE_GEN))
+        {
+          g_test_skip (local_error->message);
+          g_clear_pointer (&source, cg_texture_unref);
+          cg_gpu_release_this_thread (gpu);
+          return;
+        }
+      g_assert_no_error (local_error);
+    }
+  g_assert_cmpint (dmabuf.width, ==, SIZE);
+  g_assert_cmpint (dmabuf.height, ==, SIZE);
+  g_assert_cmpuint (dmabuf.n_planes, >=, 1);
+  g_assert_cmpint (dmabuf.fds[0], >=, 0);
+
+  imported = cg_texture_new_for_dmabuf (gpu, &dmabuf, &local_error);
+  g_assert_no_error (local_error);
+  g_assert_nonnull (imported);
+
+  assert_filled (imported, 0x00ff00ff);
+
+  g_clear_pointer (&imported, cg_texture_unref);
+  g_clear_pointer (&source, cg_texture_unref);
+  cg_gpu_release_this_thread (gpu);
+}
+
+/* From drm_fourcc.h, RGBA in memory order */
+#define DRM_FORMAT_ABGR8888 0x34324241
+#define DRM_FORMAT_MOD_INVALID ((1ULL << 56) - 1)
+
+/* Wider than a row, as drivers may want rows aligned */
+#define UDMABUF_STRIDE 256
+
+/* Imports memory the driver did not allocate itself, which
+ * is what clients and capture devices hand over, so this
+ * only depends on the kernel offering udmabuf */
+static void
+test_udmabuf_import (void)
+{
+  g_autoptr (GError) local_error = NULL;
+  g_autoptr (CgGpu) gpu = NULL;
+  g_autoptr (CgTexture) imported = NULL;
+  g_auto (CgDmabuf) dmabuf = { .fds = { -1, -1, -1, -1 } };
+  struct udmabuf_create create = { 0 };
+  const guint8 pixel[4] = { 0x00, 0xff, 0x00, 0xff };
+  gsize page_size = 0;
+  gsize size = 0;
+  guint8 *map = NULL;
+  int udmabuf = -1;
+  int memfd = -1;
+
+  udmabuf = open ("/dev/udmabuf", O_RDWR | O_CLOEXEC);
+  if (udmabuf < 0 && errno == ENOENT)
+    {
+      g_test_skip ("No /dev/udmabuf to allocate from");
+      return;
+    }
+  g_assert_cmpint (udmabuf, >=, 0);
+
+  gpu = cg_gpu_new_headless (0, -1, &local_error);
+  if (gpu == NULL && skip_if_unsupported (local_error))
+    {
+      close (udmabuf);
+      return;
+    }
+  g_assert_no_error (local_error);
+  cg_gpu_steal_this_thread (gpu);
+
+  /* udmabuf wants whole pages that can't shrink under it */
+  page_size = sysconf (_SC_PAGESIZE);
+  size = ((gsize)UDMABUF_STRIDE * SIZE + page_size - 1) / page_size * page_size;
+  memfd = memfd_create ("cpc-gpu-test", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  g_assert_cmpint (memfd, >=, 0);
+  g_assert_cmpint (ftruncate (memfd, size), ==, 0);
+  g_assert_cmpint (fcntl (memfd, F_ADD_SEALS, F_SEAL_SHRINK), ==, 0);
+
+  map = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+  g_assert_true (map != MAP_FAILED);
+  for (guint y = 0; y < SIZE; y++)
+    for (guint x = 0; x < SIZE; x++)
+      memcpy (map + y * UDMABUF_STRIDE + x * 4, pixel, sizeof (pixel));
+  munmap (map, size);
+
+  create.memfd = memfd;
+  create.flags = UDMABUF_FLAGS_CLOEXEC;
+  create.offset = 0;
+  create.size = size;
+  dmabuf.fds[0] = ioctl (udmabuf, UDMABUF_CREATE, &create);
+  g_assert_cmpint (dmabuf.fds[0], >=, 0);
+  close (memfd);
+  close (udmabuf);
+
+  dmabuf.width = SIZE;
+  dmabuf.height = SIZE;
+  dmabuf.fourcc = DRM_FORMAT_ABGR8888;
+  dmabuf.modifier = DRM_FORMAT_MOD_INVALID;
+  dmabuf.n_planes = 1;
+  dmabuf.offsets[0] = 0;
+  dmabuf.strides[0] = UDMABUF_STRIDE;
+
+  imported = cg_texture_new_for_dmabuf (gpu, &dmabuf, &local_error);
+  g_assert_no_error (local_error);
+  g_assert_nonnull (imported);
+
+  assert_filled (imported, 0x00ff00ff);
+
+  g_clear_pointer (&imported, cg_texture_unref);
+  cg_gpu_release_this_thread (gpu);
+}
+
+static const CgDataSegment position_layout[] = {
+  {
+      .name = "position",
+      .type = CG_TYPE_FLOAT,
+      .num = 3,
+      .instance_rate = 0,
+  },
+};
+
+/* Two strips over the two leftmost and two rightmost
+ * columns, which only stay apart if the index between
+ * them restarts the strip */
+static const float strips[] = {
+  -1.0f, -1.0f, 0.0f,
+  -0.5f, -1.0f, 0.0f,
+  -1.0f, 1.0f, 0.0f,
+  -0.5f, 1.0f, 0.0f,
+  0.5f, -1.0f, 0.0f,
+  1.0f, -1.0f, 0.0f,
+  0.5f, 1.0f, 0.0f,
+  1.0f, 1.0f, 0.0f,
+};
+
+static void
+check_primitive_restart (CgGpu *gpu,
+                         CgBuffer *indices)
+{
+  g_autoptr (GError) local_error = NULL;
+  g_autoptr (CgShader) shader = NULL;
+  g_autoptr (CgBuffer) vertices = NULL;
+  g_autoptr (CgTexture) target = NULL;
+  g_autoptr (CgPlan) plan = NULL;
+  g_autoptr (CgCommands) commands = NULL;
+  guint8 pixels[SIZE * SIZE * 4] = { 0 };
+
+  shader = fixture_new_tint_shader (gpu);
+  vertices = cg_buffer_new_for_data (
+      gpu, strips, sizeof (strips),
+      position_layout, G_N_ELEMENTS (position_layout));
+  target = cg_texture_new_for_data (gpu, NULL, 0, SIZE, SIZE, CG_FORMAT_RGBA8, 1, 0);
+
+  plan = cg_plan_new (gpu);
+  cg_plan_push_state (
+      plan,
+      CG_STATE_TARGET, CG_TEXTURE (target),
+      CG_STATE_DEST, CG_RECT (0, 0, SIZE, SIZE),
+      CG_STATE_SHADER, CG_SHADER (shader),
+      CG_STATE_UNIFORM, CG_KEYVAL ("tint", CG_VEC4 (1.0f, 0.0f, 0.0f, 1.0f)),
+      NULL);
+  cg_plan_append_primitives (plan, CG_TOPOLOGY_TRIANGLE_STRIP, 1, indices, vertices, NULL);
+  cg_plan_pop (plan);
+
+  commands = cg_plan_unref_to_commands (g_steal_pointer (&plan), &local_error);
+  g_assert_no_error (local_error);
+  g_assert_true (cg_commands_dispatch (commands, &local_error));
+  g_assert_no_error (local_error);
+
+  g_assert_true (cg_texture_download (target, pixels, sizeof (pixels), &local_error));
+  g_assert_no_error (local_error);
+  for (guint y = 0; y < SIZE; y++)
+    {
+      const guint8 *row = pixels + y * SIZE * 4;
+
+      g_assert_true (fixture_pixels_equal (row, 2, 0xff0000ff));
+      g_assert_true (fixture_pixels_equal (row + 2 * 4, SIZE - 4, 0x00000000));
+      g_assert_true (fixture_pixels_equal (row + (SIZE - 2) * 4, 2, 0xff0000ff));
+    }
+}
+
+static void
+test_primitive_restart (void)
+{
+  static const guint8 indices8[] = { 0, 1, 2, 3, G_MAXUINT8, 4, 5, 6, 7 };
+  static const guint16 indices16[] = { 0, 1, 2, 3, G_MAXUINT16, 4, 5, 6, 7 };
+  static const guint32 indices32[] = { 0, 1, 2, 3, G_MAXUINT32, 4, 5, 6, 7 };
+  g_autoptr (GError) local_error = NULL;
+  g_autoptr (CgGpu) gpu = NULL;
+  g_autoptr (CgBuffer) indices = NULL;
+
+  gpu = cg_gpu_new_headless (0, -1, &local_error);
+  if (gpu == NULL && skip_if_unsupported (local_error))
+    return;
+  g_assert_no_error (local_error);
+  cg_gpu_steal_this_thread (gpu);
+
+  /* The restart index is the largest value of each type */
+  indices = cg_buffer_new_for_indices (gpu, indices8, sizeof (indices8), CG_COMPONENT_UINT8);
+  check_primitive_restart (gpu, indices);
+  g_clear_pointer (&indices, cg_buffer_unref);
+
+  indices = cg_buffer_new_for_indices (gpu, indices16, sizeof (indices16), CG_COMPONENT_UINT16);
+  check_primitive_restart (gpu, indices);
+  g_clear_pointer (&indices, cg_buffer_unref);
+
+  indices = cg_buffer_new_for_indices (gpu, indices32, sizeof (indices32), CG_COMPONENT_UINT32);
+  check_primitive_restart (gpu, indices);
+  g_clear_pointer (&indices, cg_buffer_unref);
+
+  cg_gpu_release_this_thread (gpu);
+}
+
+static const char *instanced_vertex_shader =
+    "#version 330\n"
+    "in vec3 position;\n"
+    "in float shift;\n"
+    "in vec4 instance_color;\n"
+    "flat out vec4 v_color;\n"
+    "void main() {\n"
+    "  v_color = instance_color;\n"
+    "  gl_Position = vec4(position.x + shift, position.yz, 1.0);\n"
+    "}\n";
+
+static const char *instanced_fragment_shader =
+    "#version 330\n"
+    "flat in vec4 v_color;\n"
+    "out vec4 color;\n"
+    "void main() { color = v_color; }\n";
+
+static const CgDataSegment instance_layout[] = {
+  {
+      .name = "shift",
+      .type = CG_TYPE_FLOAT,
+      .num = 1,
+      .instance_rate = 1,
+  },
+  {
+      .name = "instance_color",
+      .type = CG_TYPE_FLOAT,
+      .num = 4,
+      .instance_rate = 1,
+  },
+};
+
+/* The left half of the viewport, shifted right by
+ * instances with a shift of one */
+static const float half_quad[] = {
+  -1.0f, -1.0f, 0.0f,
+  0.0f, -1.0f, 0.0f,
+  -1.0f, 1.0f, 0.0f,
+  0.0f, -1.0f, 0.0f,
+  0.0f, 1.0f, 0.0f,
+  -1.0f, 1.0f, 0.0f,
+};
+
+static const float instance_data[] = {
+  0.0f, 1.0f, 0.0f, 0.0f, 1.0f,
+  0.0f, 0.0f, 1.0f, 0.0f, 1.0f,
+  1.0f, 0.0f, 0.0f, 1.0f, 1.0f,
+  0.0f, 1.0f, 1.0f, 1.0f, 1.0f,
+};
+
+static void
+test_first_instance (void)
+{
+  g_autoptr (GError) local_error = NULL;
+  g_autoptr (CgGpu) gpu = NULL;
+  g_autoptr (CgShader) shader = NULL;
+  g_autoptr (CgBuffer) vertices = NULL;
+  g_autoptr (CgBuffer) instances = NULL;
+  g_autoptr (CgTexture) target = NULL;
+  g_autoptr (CgPlan) plan = NULL;
+  g_autoptr (CgCommands) commands = NULL;
+  CgBuffer *buffers[2] = { 0 };
+  guint8 pixels[SIZE * SIZE * 4] = { 0 };
+
+  gpu = cg_gpu_new_headless (0, -1, &local_error);
+  if (gpu == NULL && skip_if_unsupported (local_error))
+    return;
+  g_assert_no_error (local_error);
+  cg_gpu_steal_this_thread (gpu);
+
+  shader = cg_shader_new_for_code (gpu, instanced_vertex_shader, instanced_fragment_shader);
+  vertices = cg_buffer_new_for_data (
+      gpu, half_quad, sizeof (half_quad),
+      position_layout, G_N_ELEMENTS (position_layout));
+  instances = cg_buffer_new_for_data (
+      gpu, instance_data, sizeof (instance_data),
+      instance_layout, G_N_ELEMENTS (instance_layout));
+  target = cg_texture_new_for_data (gpu, NULL, 0, SIZE, SIZE, CG_FORMAT_RGBA8, 1, 0);
+  buffers[0] = vertices;
+  buffers[1] = instances;
+
+  /* Starting at the second instance puts green on the
+   * left and blue on the right, where reading from the
+   * start would put red and green */
+  plan = cg_plan_new (gpu);
+  cg_plan_push_state (
+      plan,
+      CG_STATE_TARGET, CG_TEXTURE (target),
+      CG_STATE_DEST, CG_RECT (0, 0, SIZE, SIZE),
+      CG_STATE_SHADER, CG_SHADER (shader),
+      NULL);
+  cg_plan_append_instances_v (plan, CG_TOPOLOGY_TRIANGLES, 1, 2, NULL, buffers, 2);
+  cg_plan_pop (plan);
+
+  commands = cg_plan_unref_to_commands (g_steal_pointer (&plan), &local_error);
+  g_assert_no_error (local_error);
+  g_assert_true (cg_commands_dispatch (commands, &local_error));
+  g_assert_no_error (local_error);
+
+  g_assert_true (cg_texture_download (target, pixels, sizeof (pixels), &local_error));
+  g_assert_no_error (local_error);
+  for (guint y = 0; y < SIZE; y++)
+    {
+      const guint8 *row = pixels + y * SIZE * 4;
+
+      g_assert_true (fixture_pixels_equal (row, SIZE / 2, 0x00ff00ff));
+      g_assert_true (fixture_pixels_equal (row + SIZE / 2 * 4, SIZE / 2, 0x0000ffff));
+    }
+
+  g_clear_pointer (&commands, cg_commands_unref);
+  g_clear_pointer (&target, cg_texture_unref);
+  g_clear_pointer (&instances, cg_buffer_unref);
+  g_clear_pointer (&vertices, cg_buffer_unref);
+  g_clear_pointer (&shader, cg_shader_unref);
+  cg_gpu_release_this_thread (gpu);
+}
+
+static void
+test_depth_pyramid_viewport (void)
+{
+  g_autoptr (GError) local_error = NULL;
+  g_autoptr (CgGpu) gpu = NULL;
+  g_autoptr (CgShader) shader = NULL;
+  g_autoptr (CgBuffer) vertices = NULL;
+  g_autoptr (CgTexture) target = NULL;
+  g_autoptr (CgTexture) depth = NULL;
+  g_autoptr (CgTexture) pyramid = NULL;
+  g_autoptr (CgPlan) plan = NULL;
+  g_autoptr (CgCommands) commands = NULL;
+  guint8 pixels[SIZE * SIZE * 4] = { 0 };
+
+  gpu = cg_gpu_new_headless (0, -1, &local_error);
+  if (gpu == NULL && skip_if_unsupported (local_error))
+    return;
+  g_assert_no_error (local_error);
+  cg_gpu_steal_this_thread (gpu);
+
+  shader = fixture_new_tint_shader (gpu);
+  vertices = fixture_new_quad (gpu);
+  target = cg_texture_new_for_data (gpu, NULL, 0, SIZE, SIZE, CG_FORMAT_RGBA8, 1, 0);
+  depth = cg_texture_new_depth (gpu, SIZE, SIZE, 0);
+  pyramid = cg_texture_new_depth_pyramid (gpu, SIZE, SIZE);
+
+  /* Building the pyramid draws into each of its levels,
+   * and the draw after it must still land in the left
+   * half the group asked for */
+  plan = cg_plan_new (gpu);
+  cg_plan_push_state (
+      plan,
+      CG_STATE_TARGET, CG_TEXTURE (target),
+      CG_STATE_TARGET, CG_TEXTURE (depth),
+      CG_STATE_DEST, CG_RECT (0, 0, SIZE / 2, SIZE),
+      CG_STATE_SHADER, CG_SHADER (shader),
+      CG_STATE_UNIFORM, CG_KEYVAL ("tint", CG_VEC4 (1.0f, 0.0f, 0.0f, 1.0f)),
+      NULL);
+  cg_plan_build_depth_pyramid (plan, depth, pyramid, TRUE);
+  cg_plan_append (plan, 1, vertices, NULL);
+  cg_plan_pop (plan);
+
+  commands = cg_plan_unref_to_commands (g_steal_pointer (&plan), &local_error);
+  g_assert_no_error (local_error);
+  g_assert_true (cg_commands_dispatch (commands, &local_error));
+  g_assert_no_error (local_error);
+
+  g_assert_true (cg_texture_download (target, pixels, sizeof (pixels), &local_error));
+  g_assert_no_error (local_error);
+  for (guint y = 0; y < SIZE; y++)
+    {
+      const guint8 *row = pixels + y * SIZE * 4;
+
+      g_assert_true (fixture_pixels_equal (row, SIZE / 2, 0xff0000ff));
+      g_assert_true (fixture_pixels_equal (row + SIZE / 2 * 4, SIZE / 2, 0x00000000));
+    }
+
+  g_clear_pointer (&commands, cg_commands_unref);
+  g_clear_pointer (&pyramid, cg_texture_unref);
+  g_clear_pointer (&depth, cg_texture_unref);
+  g_clear_pointer (&target, cg_texture_unref);
+  g_clear_pointer (&vertices, cg_buffer_unref);
+  g_clear_pointer (&shader, cg_shader_unref);
+  cg_gpu_release_this_thread (gpu);
+}
+
+typedef struct
+{
+  EGLDisplay display;
+  EGLContext contexts[2];
+} SharedContexts;
+
+static gboolean
+make_shared_contexts (SharedContexts *shared)
+{
+  static const EGLint attribs[] = {
+    EGL_CONTEXT_MAJOR_VERSION,
+    4,
+    EGL_CONTEXT_MINOR_VERSION,
+    3,
+    EGL_CONTEXT_OPENGL_PROFILE_MASK,
+    EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+    EGL_NONE,
+  };
+  PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display = NULL;
+
+  get_platform_display = (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress ("eglGetPlatformDisplayEXT");
+  if (get_platform_display == NULL)
+    return FALSE;
+
+  shared->display = get_platform_display (EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+  if (shared->display == EGL_NO_DISPLAY
+      || !eglInitialize (shared->display, NULL, NULL)
+      || !eglBindAPI (EGL_OPENGL_API))
+    return FALSE;
+
+  shared->contexts[0] = eglCreateContext (
+      shared->display, EGL_NO_CONFIG_KHR, EGL_NO_CONTEXT, attribs);
+  if (shared->contexts[0] == EGL_NO_CONTEXT)
+    return FALSE;
+  shared->contexts[1] = eglCreateContext (
+      shared->display, EGL_NO_CONFIG_KHR, shared->contexts[0], attribs);
+  if (shared->contexts[1] == EGL_NO_CONTEXT)
+    {
+      eglDestroyContext (shared->display, shared->contexts[0]);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static void
+make_current (SharedContexts *shared,
+              guint index,
+              CgGpu *gpu)
+{
+  g_assert_true (eglMakeCurrent (
+      shared->display, EGL_NO_SURFACE, EGL_NO_SURFACE,
+      shared->contexts[index]));
+  if (gpu != NULL)
+    cg_gpu_steal_this_thread (gpu);
+}
+
+static void
+test_share_group_fence (void)
+{
+  g_autoptr (GError) local_error = NULL;
+  SharedContexts shared = { 0 };
+  CgGpu *producer = NULL;
+  CgGpu *consumer = NULL;
+  CgTexture *rendered = NULL;
+  CgTexture *copy = NULL;
+  CgFence *fence = NULL;
+  CgPlan *plan = NULL;
+  CgCommands *commands = NULL;
+
+  if (!make_shared_contexts (&shared))
+    {
+      g_test_skip ("No surfaceless EGL contexts");
+      return;
+    }
+
+  make_current (&shared, 0, NULL);
+  producer = cg_gpu_new (
+      CG_INIT_FLAG_BACKEND_OPENGL | CG_INIT_FLAG_NO_FALLBACK,
+      eglGetProcAddress, &local_error);
+  g_assert_no_error (local_error);
+  cg_gpu_steal_this_thread (producer);
+
+  rendered = cg_texture_new_for_data (producer, NULL, 0, SIZE, SIZE, CG_FORMAT_RGBA8, 1, 0);
+  g_assert_true (fixture_fill (producer, rendered, SIZE, SIZE, red, &local_error));
+  g_assert_no_error (local_error);
+  fence = cg_fence_new (producer, &local_error);
+  g_assert_no_error (local_error);
+  cg_gpu_release_this_thread (producer);
+
+  /* The consumer only sees the rendering once its
+   * own context waits on the producer's fence */
+  make_current (&shared, 1, NULL);
+  consumer = cg_gpu_new_shared (
+      producer, CG_INIT_FLAG_BACKEND_OPENGL | CG_INIT_FLAG_NO_FALLBACK,
+      eglGetProcAddress, &local_error);
+  g_assert_no_error (local_error);
+  cg_gpu_steal_this_thread (consumer);
+
+  g_assert_true (cg_fence_client_wait (fence, consumer, G_TIME_SPAN_SECOND * 10 * 1000, &local_error));
+  g_assert_no_error (local_error);
+  g_assert_true (cg_fence_wait (fence, consumer));
+
+  copy = cg_texture_new_for_data (consumer, NULL, 0, SIZE, SIZE, CG_FORMAT_RGBA8, 1, 0);
+  plan = cg_plan_new (consumer);
+  cg_plan_push_state (
+      plan,
+      CG_STATE_TARGET, CG_TEXTURE (copy),
+      CG_STATE_DEST, CG_RECT (0, 0, SIZE, SIZE),
+      NULL);
+  cg_plan_blit (plan, rendered);
+  cg_plan_pop (plan);
+  commands = cg_plan_unref_to_commands (plan, &local_error);
+  g_assert_no_error (local_error);
+  g_assert_true (cg_commands_dispatch (commands, &local_error));
+  g_assert_no_error (local_error);
+
+  assert_filled (copy, 0xff0000ff);
+
+  cg_commands_unref (commands);
+  cg_texture_unref (copy);
+  cg_gpu_release_this_thread (consumer);
+  cg_gpu_unref (consumer);
+
+  make_current (&shared, 0, producer);
+  cg_fence_unref (fence);
+  cg_texture_unref (rendered);
+  cg_gpu_release_this_thread (producer);
+  cg_gpu_unref (producer);
+
+  eglMakeCurrent (shared.display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+  eglDestroyContext (shared.display, shared.contexts[1]);
+  eglDestroyContext (shared.display, shared.contexts[0]);
+}
+
+int
+main (int argc,
+      char **argv)
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/egl/headless-draw", test_headless_draw);
+  g_test_add_func ("/egl/primitive-restart", test_primitive_restart);
+  g_test_add_func ("/egl/first-instance", test_first_instance);
+  g_test_add_func ("/egl/depth-pyramid-viewport", test_depth_pyramid_viewport);
+  g_test_add_func ("/egl/virtual-texture-feedback", test_virtual_texture_feedback);
+  g_test_add_func ("/egl/dmabuf-round-trip", test_dmabuf_round_trip);
+  g_test_add_func ("/egl/udmabuf-import", test_udmabuf_import);
+  g_test_add_func ("/egl/share-group-fence", test_share_group_fence);
+
+  return g_test_run ();
+}
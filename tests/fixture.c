@@ -0,0 +1,172 @@
+#include "fixture.h"
+
+static const char *vertex_shader =
+    "#version 330\n"
+    "#pragma cpc_gpu_kernel color\n"
+    "in vec3 position;\n"
+    "void main() { gl_Position = vec4(position, 1.0); }\n";
+
+static const char *fragment_shader =
+    "#version 330\n"
+    "out vec4 color;\n"
+    "void main() { color = vec4(1.0); }\n";
+
+static const char *tint_fragment_shader =
+    "#version 330\n"
+    "uniform vec4 tint;\n"
+    "out vec4 color;\n"
+    "void main() { color = tint; }\n";
+
+static const CgDataSegment layout[] = {
+  {
+      .name = "position",
+      .type = CG_TYPE_FLOAT,
+      .num = 3,
+      .instance_rate = 0,
+  },
+};
+
+static const float triangle[] = {
+  0.0f, 0.0f, 0.0f,
+  1.0f, 0.0f, 0.0f,
+  0.0f, 1.0f, 0.0f,
+};
+
+static const float quad[] = {
+  -1.0f, -1.0f, 0.0f,
+  1.0f, -1.0f, 0.0f,
+  -1.0f, 1.0f, 0.0f,
+  1.0f, -1.0f, 0.0f,
+  1.0f, 1.0f, 0.0f,
+  -1.0f, 1.0f, 0.0f,
+};
+
+CgShader *
+fixture_new_shader (CgGpu *gpu)
+{
+  return cg_shader_new_for_code (gpu, vertex_shader, fragment_shader);
+}
+
+CgBuffer *
+fixture_new_triangle (CgGpu *gpu)
+{
+  return cg_buffer_new_for_data (
+      gpu, triangle, sizeof (triangle),
+      layout, G_N_ELEMENTS (layout));
+}
+
+CgShader *
+fixture_new_tint_shader (CgGpu *gpu)
+{
+  return cg_shader_new_for_code (gpu, vertex_shader, tint_fragment_shader);
+}
+
+CgBuffer *
+fixture_new_quad (CgGpu *gpu)
+{
+  return cg_buffer_new_for_data (
+      gpu, quad, sizeof (quad),
+      layout, G_N_ELEMENTS (layout));
+}
+
+gboolean
+fixture_fill (CgGpu *gpu,
+              CgTexture *target,
+              int width,
+              int height,
+              const float *tint,
+              GError **error)
+{
+  g_autoptr (CgShader) shader = NULL;
+  g_autoptr (CgBuffer) vertices = NULL;
+  g_autoptr (CgPlan) plan = NULL;
+  g_autoptr (CgCommands) commands = NULL;
+
+  shader = fixture_new_tint_shader (gpu);
+  vertices = fixture_new_quad (gpu);
+
+  plan = cg_plan_new (gpu);
+  cg_plan_push_state (
+      plan,
+      CG_STATE_TARGET, CG_TEXTURE (target),
+      CG_STATE_DEST, CG_RECT (0, 0, width, height),
+      CG_STATE_SHADER, CG_SHADER (shader),
+      CG_STATE_UNIFORM, CG_KEYVAL ("tint", CG_VEC4 (tint[0], tint[1], tint[2], tint[3])),
+      NULL);
+  cg_plan_append (plan, 1, vertices, NULL);
+  cg_plan_pop (plan);
+
+  commands = cg_plan_unref_to_commands (g_steal_pointer (&plan), error);
+  if (commands == NULL)
+    return FALSE;
+
+  return cg_commands_dispatch (commands, error);
+}
+
+gboolean
+fixture_pixels_equal (const guint8 *pixels,
+                      guint n_pixels,
+                      guint32 rgba)
+{
+  for (guint i = 0; i < n_pixels; i++)
+    {
+      const guint8 *pixel = pixels + i * 4;
+      guint32 value = 0;
+
+      value = (guint32)pixel[0] << 24 | (guint32)pixel[1] << 16 | (guint32)pixel[2] << 8 | pixel[3];
+      if (value != rgba)
+        {
+          g_printerr ("Pixel %u is 0x%08x, expected 0x%08x\n", i, value, rgba);
+          return FALSE;
+        }
+    }
+
+  return TRUE;
+}
+
+/* Draws the triangle n_draws times into target, or the
+ * default framebuffer when target is NULL */
+CgPlan *
+fixture_build_plan (CgGpu *gpu,
+                    CgTexture *target,
+                    int width,
+                    int height,
+                    CgShader *shader,
+                    CgBuffer *vertices,
+                    guint n_draws)
+{
+  g_autoptr (CgPlan) plan = NULL;
+
+  plan = cg_plan_new (gpu);
+
+  if (target != NULL)
+    cg_plan_push_state (
+        plan,
+        CG_STATE_TARGET, CG_TEXTURE (target),
+        NULL);
+
+  cg_plan_push_state (
+      plan,
+      CG_STATE_DEST, CG_RECT (0, 0, width, height),
+      CG_STATE_SHADER, CG_SHADER (shader),
+      NULL);
+
+  /* Alternate some state so every draw pays for a few
+   * state changes as well as the draw call itself */
+  for (guint i = 0; i < n_draws; i++)
+    {
+      cg_plan_push_state (
+          plan,
+          CG_STATE_DEPTH_FUNC, CG_INT (i % 2 == 0 ? CG_TEST_LEQUAL : CG_TEST_ALWAYS),
+          CG_STATE_BACKFACE_CULL, CG_BOOL (i % 2 == 0),
+          NULL);
+      cg_plan_append (plan, 1, vertices, NULL);
+      cg_plan_pop (plan);
+    }
+
+  cg_plan_pop (plan);
+  if (target != NULL)
+    cg_plan_pop (plan);
+
+  return g_steal_pointer (&plan);
+}
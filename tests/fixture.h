@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cpc-gpu/cpc-gpu.h>
+
+G_BEGIN_DECLS
+
+/* The workload shared by the tests and benchmarks: a
+ * single triangle drawn with a flat white shader, which
+ * the software backend runs with its color kernel. */
+
+CgShader *fixture_new_shader (CgGpu *gpu);
+CgBuffer *fixture_new_triangle (CgGpu *gpu);
+
+/* Like fixture_new_shader (), but colored by a vec4
+ * uniform named "tint", and a quad covering the whole
+ * viewport, for tests that check pixels */
+CgShader *fixture_new_tint_shader (CgGpu *gpu);
+CgBuffer *fixture_new_quad (CgGpu *gpu);
+
+/* Dispatches a plan filling an RGBA8 target with `tint` */
+gboolean fixture_fill (CgGpu *gpu,
+                       CgTexture *target,
+                       int width,
+                       int height,
+                       const float *tint,
+                       GError **error);
+
+/* Checks every pixel of tightly packed RGBA8 data */
+gboolean fixture_pixels_equal (const guint8 *pixels,
+                               guint n_pixels,
+                               guint32 rgba);
+
+CgPlan *fixture_build_plan (CgGpu *gpu,
+                            CgTexture *target,
+                            int width,
+                            int height,
+                            CgShader *shader,
+                            CgBuffer *vertices,
+                            guint n_draws);
+
+G_END_DECLS
@@ -0,0 +1,207 @@
+#define G_LOG_DOMAIN "CpcGpuTest"
+#include <cpc-gpu/cpc-gpu.h>
+
+#include "fixture.h"
+
+/* Checks the order frame graphs run passes in by the
+ * pixels they leave behind, on the software backend. */
+
+#define SIZE 8
+
+#define RED 0xff0000ff
+#define GREEN 0x00ff00ff
+
+typedef struct
+{
+  CgShader *shader;
+  CgBuffer *quad;
+  float tint[4];
+} Fill;
+
+typedef struct
+{
+  guint src;
+} Copy;
+
+static void
+fill_pass (CgGraph *graph,
+           CgPlan *plan,
+           gpointer user_data)
+{
+  Fill *fill = user_data;
+
+  cg_plan_push_state (
+      plan,
+      CG_STATE_SHADER, CG_SHADER (fill->shader),
+      CG_STATE_UNIFORM, CG_KEYVAL ("tint", CG_VEC4 (fill->tint[0], fill->tint[1], fill->tint[2], fill->tint[3])),
+      NULL);
+  cg_plan_append (plan, 1, fill->quad, NULL);
+  cg_plan_pop (plan);
+}
+
+static void
+copy_pass (CgGraph *graph,
+           CgPlan *plan,
+           gpointer user_data)
+{
+  Copy *copy = user_data;
+
+  cg_plan_blit (plan, cg_graph_get_texture (graph, copy->src));
+}
+
+static guint
+add_fill (CgGraph *graph,
+          Fill *fill,
+          guint dest)
+{
+  guint pass = 0;
+
+  pass = cg_graph_add_pass (graph, "fill", fill_pass, fill, NULL);
+  cg_graph_pass_write (graph, pass, dest);
+
+  return pass;
+}
+
+static guint
+add_copy (CgGraph *graph,
+          Copy *copy,
+          guint dest)
+{
+  guint pass = 0;
+
+  pass = cg_graph_add_pass (graph, "copy", copy_pass, copy, NULL);
+  cg_graph_pass_read (graph, pass, copy->src);
+  cg_graph_pass_write (graph, pass, dest);
+
+  return pass;
+}
+
+static void
+assert_texture (CgTexture *texture,
+                guint32 rgba)
+{
+  g_autoptr (GError) local_error = NULL;
+  guint8 pixels[SIZE * SIZE * 4] = { 0 };
+
+  g_assert_true (cg_texture_download (texture, pixels, sizeof (pixels), &local_error));
+  g_assert_no_error (local_error);
+  g_assert_true (fixture_pixels_equal (pixels, SIZE * SIZE, rgba));
+}
+
+/* A pass reading a resource sees what was written before
+ * it was added, not what a later writer leaves behind */
+static void
+test_versions (void)
+{
+  g_autoptr (GError) local_error = NULL;
+  g_autoptr (CgGpu) gpu = NULL;
+  g_autoptr (CgShader) shader = NULL;
+  g_autoptr (CgBuffer) quad = NULL;
+  g_autoptr (CgTexture) first = NULL;
+  g_autoptr (CgTexture) second = NULL;
+  g_autoptr (CgGraph) graph = NULL;
+  g_autoptr (CgCommands) commands = NULL;
+  CgPlan *plan = NULL;
+  guint n_threads = 1;
+  guint resource = 0;
+  guint first_out = 0;
+  guint second_out = 0;
+  Fill fill_red = { .tint = { 1.0f, 0.0f, 0.0f, 1.0f } };
+  Fill fill_green = { .tint = { 0.0f, 1.0f, 0.0f, 1.0f } };
+  Copy copy = { 0 };
+
+  gpu = cg_gpu_new (CG_INIT_FLAG_BACKEND_SOFTWARE, &n_threads, &local_error);
+  g_assert_no_error (local_error);
+
+  shader = fixture_new_tint_shader (gpu);
+  quad = fixture_new_quad (gpu);
+  first = cg_texture_new_for_data (gpu, NULL, 0, SIZE, SIZE, CG_FORMAT_RGBA8, 1, 0);
+  second = cg_texture_new_for_data (gpu, NULL, 0, SIZE, SIZE, CG_FORMAT_RGBA8, 1, 0);
+
+  fill_red.shader = fill_green.shader = shader;
+  fill_red.quad = fill_green.quad = quad;
+
+  graph = cg_graph_new (gpu);
+  resource = cg_graph_create_texture (graph, SIZE, SIZE, CG_FORMAT_RGBA8, 0);
+  first_out = cg_graph_import_texture (graph, first);
+  second_out = cg_graph_import_texture (graph, second);
+  cg_graph_export (graph, first_out);
+  cg_graph_export (graph, second_out);
+  copy.src = resource;
+
+  add_fill (graph, &fill_red, resource);
+  add_copy (graph, &copy, first_out);
+  add_fill (graph, &fill_green, resource);
+  add_copy (graph, &copy, second_out);
+
+  plan = cg_graph_compile (graph, &local_error);
+  g_assert_no_error (local_error);
+  cg_plan_pop (plan);
+
+  commands = cg_plan_unref_to_commands (plan, &local_error);
+  g_assert_no_error (local_error);
+  g_assert_true (cg_commands_dispatch (commands, &local_error));
+  g_assert_no_error (local_error);
+
+  assert_texture (first, RED);
+  assert_texture (second, GREEN);
+}
+
+/* Without a reader of its own the first version is never
+ * copied out, but its writer still runs first */
+static void
+test_overwrite (void)
+{
+  g_autoptr (GError) local_error = NULL;
+  g_autoptr (CgGpu) gpu = NULL;
+  g_autoptr (CgShader) shader = NULL;
+  g_autoptr (CgBuffer) quad = NULL;
+  g_autoptr (CgTexture) out = NULL;
+  g_autoptr (CgGraph) graph = NULL;
+  g_autoptr (CgCommands) commands = NULL;
+  CgPlan *plan = NULL;
+  guint n_threads = 1;
+  guint resource = 0;
+  Fill fill_red = { .tint = { 1.0f, 0.0f, 0.0f, 1.0f } };
+  Fill fill_green = { .tint = { 0.0f, 1.0f, 0.0f, 1.0f } };
+
+  gpu = cg_gpu_new (CG_INIT_FLAG_BACKEND_SOFTWARE, &n_threads, &local_error);
+  g_assert_no_error (local_error);
+
+  shader = fixture_new_tint_shader (gpu);
+  quad = fixture_new_quad (gpu);
+  out = cg_texture_new_for_data (gpu, NULL, 0, SIZE, SIZE, CG_FORMAT_RGBA8, 1, 0);
+
+  fill_red.shader = fill_green.shader = shader;
+  fill_red.quad = fill_green.quad = quad;
+
+  graph = cg_graph_new (gpu);
+  resource = cg_graph_import_texture (graph, out);
+  cg_graph_export (graph, resource);
+
+  add_fill (graph, &fill_red, resource);
+  add_fill (graph, &fill_green, resource);
+
+  plan = cg_graph_compile (graph, &local_error);
+  g_assert_no_error (local_error);
+  cg_plan_pop (plan);
+
+  commands = cg_plan_unref_to_commands (plan, &local_error);
+  g_assert_no_error (local_error);
+  g_assert_true (cg_commands_dispatch (commands, &local_error));
+  g_assert_no_error (local_error);
+
+  assert_texture (out, GREEN);
+}
+
+int
+main (int argc,
+      char **argv)
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/graph/versions", test_versions);
+  g_test_add_func ("/graph/overwrite", test_overwrite);
+
+  return g_test_run ();
+}
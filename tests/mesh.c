@@ -0,0 +1,257 @@
+#define G_LOG_DOMAIN "CpcGpuTest"
+#include <cpc-gpu/cpc-gpu.h>
+
+#include <string.h>
+
+/* Checks cg_mesh_optimize () against meshes small enough
+ * to run on one thread and large enough to be split
+ * into several jobs. */
+
+typedef struct
+{
+  float position[3];
+} Vertex;
+
+typedef struct
+{
+  Vertex v[3];
+} Triangle;
+
+static const CgDataSegment layout[] = {
+  {
+      .name = "position",
+      .type = CG_TYPE_FLOAT,
+      .num = 3,
+      .instance_rate = 0,
+  },
+};
+
+/* A grid of `size` by `size` quads, two triangles each,
+ * listed column by column with the vertices of shared
+ * edges duplicated, as a triangle list exporter would */
+static Triangle *
+make_grid (guint size,
+           guint *n_triangles)
+{
+  Triangle *triangles = NULL;
+  guint n = 0;
+
+  triangles = g_new0 (Triangle, size * size * 2);
+  for (guint x = 0; x < size; x++)
+    {
+      for (guint y = 0; y < size; y++)
+        {
+          Vertex a = { { x, y, 0.0f } };
+          Vertex b = { { x + 1, y, 0.0f } };
+          Vertex c = { { x, y + 1, 0.0f } };
+          Vertex d = { { x + 1, y + 1, 0.0f } };
+
+          triangles[n++] = (Triangle){ { a, b, c } };
+          triangles[n++] = (Triangle){ { b, d, c } };
+        }
+    }
+
+  *n_triangles = n;
+  return triangles;
+}
+
+/* Rotates a triangle so its smallest vertex comes first,
+ * which keeps the winding and makes equal triangles
+ * compare equal no matter where they start */
+static void
+canonicalize (Triangle *triangle)
+{
+  guint first = 0;
+  Triangle rotated = { 0 };
+
+  for (guint i = 1; i < 3; i++)
+    {
+      if (memcmp (&triangle->v[i], &triangle->v[first], sizeof (Vertex)) < 0)
+        first = i;
+    }
+  for (guint i = 0; i < 3; i++)
+    rotated.v[i] = triangle->v[(first + i) % 3];
+  *triangle = rotated;
+}
+
+static int
+compare_triangles (gconstpointer a,
+                   gconstpointer b)
+{
+  return memcmp (a, b, sizeof (Triangle));
+}
+
+static guint32
+get_index (const CgMesh *mesh,
+           guint i)
+{
+  if (mesh->index_format == CG_COMPONENT_UINT16)
+    return ((const guint16 *)mesh->indices)[i];
+  else
+    return ((const guint32 *)mesh->indices)[i];
+}
+
+static void
+check_permutation (const Triangle *input,
+                   guint n_triangles,
+                   const CgMesh *mesh)
+{
+  g_autofree Triangle *expected = NULL;
+  g_autofree Triangle *output = NULL;
+  const Vertex *vertices = mesh->vertices;
+  gsize index_size = 0;
+
+  index_size = mesh->index_format == CG_COMPONENT_UINT16 ? 2 : 4;
+  g_assert_cmpuint (mesh->n_triangles, ==, n_triangles);
+  g_assert_cmpuint (mesh->indices_size, ==, (gsize)n_triangles * 3 * index_size);
+  g_assert_cmpuint (mesh->vertices_size, ==, (gsize)mesh->n_vertices * sizeof (Vertex));
+
+  expected = g_memdup2 (input, n_triangles * sizeof (Triangle));
+  output = g_new0 (Triangle, n_triangles);
+  for (guint i = 0; i < n_triangles; i++)
+    {
+      for (guint j = 0; j < 3; j++)
+        {
+          guint32 index = get_index (mesh, i * 3 + j);
+
+          g_assert_cmpuint (index, <, mesh->n_vertices);
+          output[i].v[j] = vertices[index];
+        }
+    }
+
+  for (guint i = 0; i < n_triangles; i++)
+    {
+      canonicalize (&expected[i]);
+      canonicalize (&output[i]);
+    }
+  qsort (expected, n_triangles, sizeof (Triangle), compare_triangles);
+  qsort (output, n_triangles, sizeof (Triangle), compare_triangles);
+
+  g_assert_cmpmem (output, n_triangles * sizeof (Triangle),
+                   expected, n_triangles * sizeof (Triangle));
+}
+
+static void
+test_grid (guint size,
+           int flags)
+{
+  g_autofree Triangle *triangles = NULL;
+  guint n_triangles = 0;
+  CgMesh mesh = { 0 };
+
+  triangles = make_grid (size, &n_triangles);
+
+  g_assert_true (cg_mesh_optimize (
+      layout, G_N_ELEMENTS (layout),
+      triangles, n_triangles * sizeof (Triangle),
+      flags, 0, &mesh));
+
+  check_permutation (triangles, n_triangles, &mesh);
+
+  /* Every grid point ends up as exactly one vertex */
+  if (flags & CG_MESH_DEDUPLICATE)
+    g_assert_cmpuint (mesh.n_vertices, ==, (size + 1) * (size + 1));
+  if (flags & CG_MESH_OPTIMIZE_CACHE)
+    g_assert_cmpfloat (mesh.acmr_after, <=, mesh.acmr_before);
+  else
+    g_assert_cmpfloat (mesh.acmr_after, ==, mesh.acmr_before);
+
+  cg_mesh_clear (&mesh);
+}
+
+static void
+test_small_grid (void)
+{
+  test_grid (16, CG_MESH_OPTIMIZE_ALL);
+}
+
+static void
+test_large_grid (void)
+{
+  /* Past the per-job minimums, so both deduplication
+   * and reordering run on several threads if there are
+   * processors for them */
+  test_grid (256, CG_MESH_OPTIMIZE_ALL);
+}
+
+static void
+test_32_bit_indices (void)
+{
+  test_grid (16, CG_MESH_OPTIMIZE_ALL | CG_MESH_32_BIT_INDICES);
+}
+
+static void
+test_no_deduplication (void)
+{
+  test_grid (16, CG_MESH_OPTIMIZE_CACHE | CG_MESH_OPTIMIZE_FETCH);
+}
+
+static void
+test_cache_improves (void)
+{
+  g_autofree Triangle *triangles = NULL;
+  guint n_triangles = 0;
+  CgMesh mesh = { 0 };
+
+  triangles = make_grid (64, &n_triangles);
+
+  g_assert_true (cg_mesh_optimize (
+      layout, G_N_ELEMENTS (layout),
+      triangles, n_triangles * sizeof (Triangle),
+      CG_MESH_OPTIMIZE_ALL, 16, &mesh));
+  g_test_message ("ACMR %.3f before, %.3f after", mesh.acmr_before, mesh.acmr_after);
+
+  /* Column order reuses only the previous column's
+   * vertices, which a 16 entry FIFO can't hold for a
+   * column 64 quads tall */
+  g_assert_cmpfloat (mesh.acmr_before, >, 0.9f);
+  g_assert_cmpfloat (mesh.acmr_after, <, mesh.acmr_before);
+  g_assert_cmpfloat (mesh.acmr_after, >=, 0.5f);
+
+  cg_mesh_clear (&mesh);
+}
+
+static void
+test_random_soup (void)
+{
+  g_autoptr (GRand) rand = NULL;
+  g_autofree Triangle *triangles = NULL;
+  guint n_triangles = 3000;
+  CgMesh mesh = { 0 };
+
+  /* Few distinct positions, so many vertices and
+   * some whole triangles are duplicates */
+  rand = g_rand_new_with_seed (1);
+  triangles = g_new0 (Triangle, n_triangles);
+  for (guint i = 0; i < n_triangles; i++)
+    for (guint j = 0; j < 3; j++)
+      for (guint k = 0; k < 3; k++)
+        triangles[i].v[j].position[k] = g_rand_int_range (rand, 0, 4);
+
+  g_assert_true (cg_mesh_optimize (
+      layout, G_N_ELEMENTS (layout),
+      triangles, n_triangles * sizeof (Triangle),
+      CG_MESH_OPTIMIZE_ALL, 0, &mesh));
+
+  check_permutation (triangles, n_triangles, &mesh);
+  g_assert_cmpuint (mesh.n_vertices, <=, 4 * 4 * 4);
+  g_assert_cmpfloat (mesh.acmr_after, <=, mesh.acmr_before);
+
+  cg_mesh_clear (&mesh);
+}
+
+int
+main (int argc,
+      char **argv)
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/mesh/small-grid", test_small_grid);
+  g_test_add_func ("/mesh/large-grid", test_large_grid);
+  g_test_add_func ("/mesh/32-bit-indices", test_32_bit_indices);
+  g_test_add_func ("/mesh/no-deduplication", test_no_deduplication);
+  g_test_add_func ("/mesh/cache-improves", test_cache_improves);
+  g_test_add_func ("/mesh/random-soup", test_random_soup);
+
+  return g_test_run ();
+}
@@ -0,0 +1,230 @@
+#include "null-gl.h"
+
+#include <string.h>
+
+#include "external/glad.h"
+
+#define NULL_GL_ATTRIBUTE "position"
+
+static guint64 n_calls = 0;
+static GLuint next_name = 1;
+static gboolean syncs_signaled = FALSE;
+static guint8 mapping[NULL_GL_MAX_MAPPING];
+
+static guintptr
+null_call (void)
+{
+  n_calls++;
+  return 0;
+}
+
+static const GLubyte *GLAD_API_PTR
+null_get_string (GLenum name)
+{
+  n_calls++;
+
+  switch (name)
+    {
+    case GL_VERSION:
+      return (const GLubyte *)"4.6.0 null";
+    case GL_SHADING_LANGUAGE_VERSION:
+      return (const GLubyte *)"4.60";
+    default:
+      return (const GLubyte *)"null";
+    }
+}
+
+static const GLubyte *GLAD_API_PTR
+null_get_stringi (GLenum name,
+                  GLuint index)
+{
+  n_calls++;
+  return (const GLubyte *)"GL_null";
+}
+
+static void GLAD_API_PTR
+null_get_integerv (GLenum pname,
+                   GLint *data)
+{
+  n_calls++;
+
+  switch (pname)
+    {
+    case GL_MAX_TEXTURE_SIZE:
+      *data = 16384;
+      break;
+    case GL_NUM_EXTENSIONS:
+      /* GLAD refuses to load with no extensions at all */
+      *data = 1;
+      break;
+    case GL_MAJOR_VERSION:
+      *data = 4;
+      break;
+    case GL_MINOR_VERSION:
+      *data = 6;
+      break;
+    default:
+      *data = 0;
+      break;
+    }
+}
+
+static void GLAD_API_PTR
+null_get_shaderiv (GLuint shader,
+                   GLenum pname,
+                   GLint *params)
+{
+  n_calls++;
+  *params = pname == GL_COMPILE_STATUS ? GL_TRUE : 0;
+}
+
+static void GLAD_API_PTR
+null_get_programiv (GLuint program,
+                    GLenum pname,
+                    GLint *params)
+{
+  n_calls++;
+
+  switch (pname)
+    {
+    case GL_LINK_STATUS:
+      *params = GL_TRUE;
+      break;
+    case GL_ACTIVE_ATTRIBUTES:
+      *params = 1;
+      break;
+    default:
+      *params = 0;
+      break;
+    }
+}
+
+static void GLAD_API_PTR
+null_get_active_attrib (GLuint program,
+                        GLuint index,
+                        GLsizei buf_size,
+                        GLsizei *length,
+                        GLint *size,
+                        GLenum *type,
+                        GLchar *name)
+{
+  n_calls++;
+
+  g_strlcpy (name, NULL_GL_ATTRIBUTE, buf_size);
+  if (length != NULL)
+    *length = strlen (name);
+  *size = 1;
+  *type = GL_FLOAT_VEC3;
+}
+
+static GLuint GLAD_API_PTR
+null_create (GLenum type)
+{
+  n_calls++;
+  return next_name++;
+}
+
+static void GLAD_API_PTR
+null_gen (GLsizei n,
+          GLuint *names)
+{
+  n_calls++;
+  for (GLsizei i = 0; i < n; i++)
+    names[i] = next_name++;
+}
+
+static GLenum GLAD_API_PTR
+null_check_framebuffer_status (GLenum target)
+{
+  n_calls++;
+  return GL_FRAMEBUFFER_COMPLETE;
+}
+
+static GLsync GLAD_API_PTR
+null_fence_sync (GLenum condition,
+                 GLbitfield flags)
+{
+  n_calls++;
+  return (GLsync)(guintptr)next_name++;
+}
+
+static GLenum GLAD_API_PTR
+null_client_wait_sync (GLsync sync,
+                       GLbitfield flags,
+                       GLuint64 timeout)
+{
+  n_calls++;
+  return syncs_signaled ? GL_CONDITION_SATISFIED : GL_TIMEOUT_EXPIRED;
+}
+
+static void *GLAD_API_PTR
+null_map_buffer_range (GLenum target,
+                       GLintptr offset,
+                       GLsizeiptr length,
+                       GLbitfield access)
+{
+  n_calls++;
+
+  if (offset + length > sizeof (mapping))
+    return NULL;
+
+  memset (mapping, NULL_GL_MAPPED_BYTE, sizeof (mapping));
+  return mapping + offset;
+}
+
+static const struct
+{
+  const char *name;
+  NullGlProc func;
+} overrides[] = {
+  { "glGetString", (NullGlProc)null_get_string },
+  { "glGetStringi", (NullGlProc)null_get_stringi },
+  { "glGetIntegerv", (NullGlProc)null_get_integerv },
+  { "glGetShaderiv", (NullGlProc)null_get_shaderiv },
+  { "glGetProgramiv", (NullGlProc)null_get_programiv },
+  { "glGetActiveAttrib", (NullGlProc)null_get_active_attrib },
+  { "glCreateShader", (NullGlProc)null_create },
+  { "glCreateProgram", (NullGlProc)null_create },
+  { "glGenBuffers", (NullGlProc)null_gen },
+  { "glGenVertexArrays", (NullGlProc)null_gen },
+  { "glGenTextures", (NullGlProc)null_gen },
+  { "glGenFramebuffers", (NullGlProc)null_gen },
+  { "glGenQueries", (NullGlProc)null_gen },
+  { "glCheckFramebufferStatus", (NullGlProc)null_check_framebuffer_status },
+  { "glFenceSync", (NullGlProc)null_fence_sync },
+  { "glClientWaitSync", (NullGlProc)null_client_wait_sync },
+  { "glMapBufferRange", (NullGlProc)null_map_buffer_range },
+};
+
+NullGlProc
+null_gl_get_proc_address (const char *name)
+{
+  for (guint i = 0; i < G_N_ELEMENTS (overrides); i++)
+    {
+      if (g_strcmp0 (overrides[i].name, name) == 0)
+        return overrides[i].func;
+    }
+
+  /* Every other entry point takes whatever arguments it
+   * is given and returns zero, which is GL_NO_ERROR for
+   * glGetError () and harmless everywhere else. */
+  return (NullGlProc)null_call;
+}
+
+guint64
+null_gl_get_n_calls (void)
+{
+  return n_calls;
+}
+
+void
+null_gl_reset_n_calls (void)
+{
+  n_calls = 0;
+}
+
+void
+null_gl_set_syncs_signaled (gboolean signaled)
+{
+  syncs_signaled = signaled;
+}
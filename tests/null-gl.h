@@ -0,0 +1,27 @@
+#pragma once
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* An OpenGL implementation that does nothing. Every entry
+ * point only bumps a counter, apart from the handful of
+ * queries the library needs answered to get going. Pass
+ * null_gl_get_proc_address to cg_gpu_new () as the loader. */
+
+/* Mapped buffers read as this byte, up to this size */
+#define NULL_GL_MAPPED_BYTE 0xa5
+#define NULL_GL_MAX_MAPPING 4096
+
+typedef void (*NullGlProc) (void);
+
+NullGlProc null_gl_get_proc_address (const char *name);
+
+guint64 null_gl_get_n_calls (void);
+void null_gl_reset_n_calls (void);
+
+/* Fences stay unsignaled until this says otherwise,
+ * so waits on them time out */
+void null_gl_set_syncs_signaled (gboolean signaled);
+
+G_END_DECLS
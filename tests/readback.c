@@ -0,0 +1,121 @@
+#define G_LOG_DOMAIN "CpcGpuTest"
+#include <cpc-gpu/cpc-gpu.h>
+
+#include "null-gl.h"
+
+/* Polls readbacks on the null GL implementation, whose
+ * fences only signal when the test lets them, so running
+ * out of time can be checked without a slow GPU. */
+
+#define SIZE 8
+
+static void
+test_wait (void)
+{
+  g_autoptr (GError) local_error = NULL;
+  g_autoptr (CgGpu) gpu = NULL;
+  g_autoptr (CgTexture) texture = NULL;
+  g_autoptr (CgReadback) readback = NULL;
+  guint8 pixels[SIZE * SIZE] = { 0 };
+
+  gpu = cg_gpu_new (
+      CG_INIT_FLAG_BACKEND_OPENGL
+          | CG_INIT_FLAG_NO_FALLBACK,
+      null_gl_get_proc_address, &local_error);
+  g_assert_no_error (local_error);
+  cg_gpu_steal_this_thread (gpu);
+
+  null_gl_set_syncs_signaled (FALSE);
+  texture = cg_texture_new_for_data (gpu, NULL, 0, SIZE, SIZE, CG_FORMAT_RGBA8, 1, 0);
+
+  /* Converted to one channel on the way */
+  readback = cg_texture_download_async (texture, 0, 0, SIZE, SIZE, CG_FORMAT_R8, &local_error);
+  g_assert_no_error (local_error);
+  g_assert_nonnull (readback);
+  g_assert_cmpuint (cg_readback_get_size (readback), ==, sizeof (pixels));
+
+  /* Running out of time is not an error */
+  g_assert_false (cg_readback_wait (readback, 0, &local_error));
+  g_assert_no_error (local_error);
+  g_assert_false (cg_readback_wait (readback, G_TIME_SPAN_MILLISECOND * 1000, &local_error));
+  g_assert_no_error (local_error);
+
+  null_gl_set_syncs_signaled (TRUE);
+  g_assert_true (cg_readback_wait (readback, 0, &local_error));
+  g_assert_no_error (local_error);
+
+  /* Once ready, a readback stays ready */
+  null_gl_set_syncs_signaled (FALSE);
+  g_assert_true (cg_readback_wait (readback, 0, &local_error));
+  g_assert_no_error (local_error);
+
+  g_assert_true (cg_readback_finish (readback, pixels, sizeof (pixels), &local_error));
+  g_assert_no_error (local_error);
+  for (guint i = 0; i < G_N_ELEMENTS (pixels); i++)
+    g_assert_cmpuint (pixels[i], ==, NULL_GL_MAPPED_BYTE);
+
+  g_clear_pointer (&readback, cg_readback_unref);
+  g_clear_pointer (&texture, cg_texture_unref);
+  cg_gpu_release_this_thread (gpu);
+}
+
+static gpointer
+load_page (int level,
+           int x,
+           int y,
+           int page_size,
+           gpointer user_data)
+{
+  return g_malloc0 ((gsize)page_size * page_size * 4);
+}
+
+/* Feedback that never arrives must not hold up frames */
+static void
+test_virtual_texture (void)
+{
+  g_autoptr (GError) local_error = NULL;
+  g_autoptr (CgGpu) gpu = NULL;
+  g_autoptr (CgVirtualTexture) vt = NULL;
+
+  gpu = cg_gpu_new (
+      CG_INIT_FLAG_BACKEND_OPENGL
+          | CG_INIT_FLAG_NO_FALLBACK,
+      null_gl_get_proc_address, &local_error);
+  g_assert_no_error (local_error);
+  cg_gpu_steal_this_thread (gpu);
+
+  null_gl_set_syncs_signaled (FALSE);
+  vt = cg_virtual_texture_new (gpu, 64, 64, 16, 4, load_page, NULL, NULL, &local_error);
+  g_assert_no_error (local_error);
+
+  for (guint frame = 0; frame < 8; frame++)
+    {
+      g_autoptr (CgPlan) plan = NULL;
+
+      plan = cg_plan_new (gpu);
+      cg_plan_begin_config (plan);
+      cg_virtual_texture_config_feedback (vt, plan, SIZE * 8, SIZE * 8);
+
+      g_assert_true (cg_virtual_texture_update (vt, &local_error));
+      g_assert_no_error (local_error);
+    }
+
+  null_gl_set_syncs_signaled (TRUE);
+  g_assert_true (cg_virtual_texture_update (vt, &local_error));
+  g_assert_no_error (local_error);
+
+  g_clear_pointer (&vt, cg_virtual_texture_unref);
+  cg_gpu_release_this_thread (gpu);
+}
+
+int
+main (int argc,
+      char **argv)
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/readback/wait", test_wait);
+  g_test_add_func ("/readback/virtual-texture", test_virtual_texture);
+
+  return g_test_run ();
+}
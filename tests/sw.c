@@ -0,0 +1,762 @@
+#define G_LOG_DOMAIN "CpcGpuTest"
+#include <cpc-gpu/cpc-gpu.h>
+
+#include "fixture.h"
+
+/* Checks the software backend pixel for pixel. Values are
+ * picked so every expected channel is exact in RGBA8. */
+
+/* Several tiles wide and tall, with neither side a
+ * multiple of the tile size or of the shading lanes */
+#define WIDTH 150
+#define HEIGHT 131
+/* Enough cells for the dispatch to run in parallel */
+#define GRID 12
+#define SIZE 8
+
+typedef struct
+{
+  float position[3];
+} Position;
+
+typedef struct
+{
+  float position[3];
+  float color[4];
+} ColorVertex;
+
+typedef struct
+{
+  float position[3];
+  float uv[2];
+} TextureVertex;
+
+static const CgDataSegment position_layout[] = {
+  {
+      .name = "position",
+      .type = CG_TYPE_FLOAT,
+      .num = 3,
+      .instance_rate = 0,
+  },
+};
+
+static const CgDataSegment color_layout[] = {
+  {
+      .name = "position",
+      .type = CG_TYPE_FLOAT,
+      .num = 3,
+      .instance_rate = 0,
+  },
+  {
+      .name = "color",
+      .type = CG_TYPE_FLOAT,
+      .num = 4,
+      .instance_rate = 0,
+  },
+};
+
+static const CgDataSegment texture_layout[] = {
+  {
+      .name = "position",
+      .type = CG_TYPE_FLOAT,
+      .num = 3,
+      .instance_rate = 0,
+  },
+  {
+      .name = "uv",
+      .type = CG_TYPE_FLOAT,
+      .num = 2,
+      .instance_rate = 0,
+  },
+};
+
+static const char *texture_vertex_shader =
+    "#version 330\n"
+    "#pragma cpc_gpu_kernel texture\n"
+    "in vec3 position;\n"
+    "in vec2 uv;\n"
+    "out vec2 v_uv;\n"
+    "void main() { v_uv = uv; gl_Position = vec4(position, 1.0); }\n";
+
+static const char *texture_fragment_shader =
+    "#version 330\n"
+    "uniform sampler2D tex;\n"
+    "in vec2 v_uv;\n"
+    "out vec4 color;\n"
+    "void main() { color = texture(tex, v_uv); }\n";
+
+static const char *color_vertex_shader =
+    "#version 330\n"
+    "#pragma cpc_gpu_kernel color\n"
+    "uniform mat4 transform;\n"
+    "uniform vec4 tint;\n"
+    "in vec3 position;\n"
+    "in vec4 color;\n"
+    "out vec4 v_color;\n"
+    "void main() { v_color = color * tint; gl_Position = transform * vec4(position, 1.0); }\n";
+
+static const char *color_fragment_shader =
+    "#version 330\n"
+    "in vec4 v_color;\n"
+    "out vec4 color;\n"
+    "void main() { color = v_color; }\n";
+
+static CgGpu *
+new_gpu (guint n_threads)
+{
+  g_autoptr (GError) local_error = NULL;
+  CgGpu *gpu = NULL;
+
+  gpu = cg_gpu_new (CG_INIT_FLAG_BACKEND_SOFTWARE, &n_threads, &local_error);
+  g_assert_no_error (local_error);
+  g_assert_nonnull (gpu);
+
+  return gpu;
+}
+
+static void
+dispatch (CgPlan *plan)
+{
+  g_autoptr (GError) local_error = NULL;
+  g_autoptr (CgCommands) commands = NULL;
+
+  commands = cg_plan_unref_to_commands (plan, &local_error);
+  g_assert_no_error (local_error);
+  g_assert_true (cg_commands_dispatch (commands, &local_error));
+  g_assert_no_error (local_error);
+}
+
+static guint8 *
+download (CgTexture *texture,
+          int width,
+          int height)
+{
+  g_autoptr (GError) local_error = NULL;
+  guint8 *pixels = NULL;
+
+  pixels = g_malloc0 ((gsize)width * height * 4);
+  g_assert_true (cg_texture_download (texture, pixels, (gsize)width * height * 4, &local_error));
+  g_assert_no_error (local_error);
+
+  return pixels;
+}
+
+/* Two triangles covering `x0` to `x1` and `y0` to `y1`
+ * in normalized coordinates, wound counter-clockwise */
+static CgBuffer *
+new_rect (CgGpu *gpu,
+          float x0,
+          float y0,
+          float x1,
+          float y1,
+          float z)
+{
+  const Position rect[] = {
+    { { x0, y0, z } },
+    { { x1, y0, z } },
+    { { x0, y1, z } },
+    { { x1, y0, z } },
+    { { x1, y1, z } },
+    { { x0, y1, z } },
+  };
+
+  return cg_buffer_new_for_data (
+      gpu, rect, sizeof (rect),
+      position_layout, G_N_ELEMENTS (position_layout));
+}
+
+/* Checks the columns `x0` to `x1` of the rows `y0` to `y1` */
+static void
+assert_region (const guint8 *pixels,
+               int width,
+               int x0,
+               int y0,
+               int x1,
+               int y1,
+               guint32 rgba)
+{
+  for (int y = y0; y < y1; y++)
+    g_assert_true (fixture_pixels_equal (
+        pixels + ((gsize)y * width + x0) * 4, x1 - x0, rgba));
+}
+
+/* A grid whose inner points are moved at random, split
+ * into triangles along alternating diagonals. The edges
+ * of the grid stay on the edges of the viewport, so every
+ * pixel center lies in exactly one triangle. */
+static CgBuffer *
+new_jittered_grid (CgGpu *gpu,
+                   guint32 seed)
+{
+  g_autoptr (GRand) rand = NULL;
+  g_autofree Position *triangles = NULL;
+  float points[GRID + 1][GRID + 1][2] = { 0 };
+  guint n = 0;
+
+  rand = g_rand_new_with_seed (seed);
+  for (int i = 0; i <= GRID; i++)
+    {
+      for (int j = 0; j <= GRID; j++)
+        {
+          float x = -1.0f + 2.0f * i / GRID;
+          float y = -1.0f + 2.0f * j / GRID;
+
+          if (i > 0 && i < GRID)
+            x += (g_rand_int_range (rand, -1000, 1001) / 1000.0f) * 0.2f * 2.0f / GRID;
+          if (j > 0 && j < GRID)
+            y += (g_rand_int_range (rand, -1000, 1001) / 1000.0f) * 0.2f * 2.0f / GRID;
+
+          points[i][j][0] = x;
+          points[i][j][1] = y;
+        }
+    }
+
+  triangles = g_new0 (Position, GRID * GRID * 6);
+  for (int i = 0; i < GRID; i++)
+    {
+      for (int j = 0; j < GRID; j++)
+        {
+          const float *a = points[i][j];
+          const float *b = points[i + 1][j];
+          const float *c = points[i][j + 1];
+          const float *d = points[i + 1][j + 1];
+          const float *corners[6] = { 0 };
+
+          if ((i + j) % 2 == 0)
+            {
+              corners[0] = a, corners[1] = b, corners[2] = c;
+              corners[3] = b, corners[4] = d, corners[5] = c;
+            }
+          else
+            {
+              corners[0] = a, corners[1] = b, corners[2] = d;
+              corners[3] = a, corners[4] = d, corners[5] = c;
+            }
+
+          for (int k = 0; k < 6; k++)
+            triangles[n++] = (Position){ { corners[k][0], corners[k][1], 0.0f } };
+        }
+    }
+
+  return cg_buffer_new_for_data (
+      gpu, triangles, n * sizeof (Position),
+      position_layout, G_N_ELEMENTS (position_layout));
+}
+
+static void
+check_watertight (guint n_threads)
+{
+  g_autoptr (CgGpu) gpu = NULL;
+  g_autoptr (CgShader) shader = NULL;
+  g_autoptr (CgTexture) target = NULL;
+  g_autofree guint8 *pixels = NULL;
+  CgPlan *plan = NULL;
+
+  gpu = new_gpu (n_threads);
+  shader = fixture_new_tint_shader (gpu);
+  target = cg_texture_new_for_data (gpu, NULL, 0, WIDTH, HEIGHT, CG_FORMAT_RGBA8, 1, 0);
+
+  /* Adding an eighth per triangle, so pixels drawn
+   * twice or missed come out brighter or darker */
+  plan = cg_plan_new (gpu);
+  cg_plan_push_state (
+      plan,
+      CG_STATE_TARGET, CG_TUPLE3 (CG_TEXTURE (target), CG_INT (CG_BLEND_ONE), CG_INT (CG_BLEND_ONE)),
+      CG_STATE_SHADER, CG_SHADER (shader),
+      CG_STATE_UNIFORM, CG_KEYVAL ("tint", CG_VEC4 (0.125f, 0.125f, 0.125f, 0.125f)),
+      NULL);
+  for (guint32 seed = 1; seed <= 4; seed++)
+    {
+      g_autoptr (CgBuffer) grid = NULL;
+
+      grid = new_jittered_grid (gpu, seed);
+      cg_plan_append (plan, 1, grid, NULL);
+    }
+  cg_plan_pop (plan);
+  dispatch (plan);
+
+  /* Four grids, each covering every pixel once */
+  pixels = download (target, WIDTH, HEIGHT);
+  assert_region (pixels, WIDTH, 0, 0, WIDTH, HEIGHT, 0x80808080);
+}
+
+static void
+test_watertight (void)
+{
+  check_watertight (1);
+}
+
+static void
+test_watertight_threaded (void)
+{
+  check_watertight (4);
+}
+
+static void
+test_depth (void)
+{
+  g_autoptr (CgGpu) gpu = NULL;
+  g_autoptr (CgShader) shader = NULL;
+  g_autoptr (CgTexture) target = NULL;
+  g_autoptr (CgTexture) depth = NULL;
+  g_autoptr (CgBuffer) middle = NULL;
+  g_autoptr (CgBuffer) far = NULL;
+  g_autoptr (CgBuffer) near = NULL;
+  g_autofree guint8 *pixels = NULL;
+  CgPlan *plan = NULL;
+
+  gpu = new_gpu (1);
+  shader = fixture_new_tint_shader (gpu);
+  target = cg_texture_new_for_data (gpu, NULL, 0, SIZE, SIZE, CG_FORMAT_RGBA8, 1, 0);
+  depth = cg_texture_new_depth (gpu, SIZE, SIZE, 0);
+  middle = new_rect (gpu, -1.0f, -1.0f, 1.0f, 1.0f, 0.0f);
+  far = new_rect (gpu, -1.0f, -1.0f, 1.0f, 1.0f, 0.5f);
+  near = new_rect (gpu, -1.0f, -1.0f, 0.0f, 1.0f, -0.5f);
+
+  /* The far quad is hidden behind the middle one, and
+   * the near one covers it on the left */
+  plan = cg_plan_new (gpu);
+  cg_plan_push_state (
+      plan,
+      CG_STATE_TARGET, CG_TEXTURE (target),
+      CG_STATE_TARGET, CG_TEXTURE (depth),
+      CG_STATE_SHADER, CG_SHADER (shader),
+      NULL);
+  cg_plan_push_state (plan, CG_STATE_UNIFORM, CG_KEYVAL ("tint", CG_VEC4 (1.0f, 0.0f, 0.0f, 1.0f)), NULL);
+  cg_plan_append (plan, 1, middle, NULL);
+  cg_plan_pop (plan);
+  cg_plan_push_state (plan, CG_STATE_UNIFORM, CG_KEYVAL ("tint", CG_VEC4 (0.0f, 1.0f, 0.0f, 1.0f)), NULL);
+  cg_plan_append (plan, 1, far, NULL);
+  cg_plan_pop (plan);
+  cg_plan_push_state (plan, CG_STATE_UNIFORM, CG_KEYVAL ("tint", CG_VEC4 (0.0f, 0.0f, 1.0f, 1.0f)), NULL);
+  cg_plan_append (plan, 1, near, NULL);
+  cg_plan_pop (plan);
+
+  /* Passing only behind what is there, the middle
+   * quad shows again where the near one covers it */
+  cg_plan_push_state (
+      plan,
+      CG_STATE_DEPTH_FUNC, CG_INT (CG_TEST_GREATER),
+      CG_STATE_UNIFORM, CG_KEYVAL ("tint", CG_VEC4 (1.0f, 1.0f, 1.0f, 1.0f)),
+      NULL);
+  cg_plan_append (plan, 1, middle, NULL);
+  cg_plan_pop (plan);
+  cg_plan_pop (plan);
+  dispatch (plan);
+
+  pixels = download (target, SIZE, SIZE);
+  assert_region (pixels, SIZE, 0, 0, SIZE / 2, SIZE, 0xffffffff);
+  assert_region (pixels, SIZE, SIZE / 2, 0, SIZE, SIZE, 0xff0000ff);
+
+  g_clear_pointer (&pixels, g_free);
+  g_clear_pointer (&depth, cg_texture_unref);
+  depth = cg_texture_new_depth (gpu, SIZE, SIZE, 0);
+
+  /* Drawn in the opposite order, the default test
+   * keeps the nearest of the three */
+  plan = cg_plan_new (gpu);
+  cg_plan_push_state (
+      plan,
+      CG_STATE_TARGET, CG_TEXTURE (target),
+      CG_STATE_TARGET, CG_TEXTURE (depth),
+      CG_STATE_SHADER, CG_SHADER (shader),
+      NULL);
+  cg_plan_push_state (plan, CG_STATE_UNIFORM, CG_KEYVAL ("tint", CG_VEC4 (0.0f, 0.0f, 1.0f, 1.0f)), NULL);
+  cg_plan_append (plan, 1, near, NULL);
+  cg_plan_pop (plan);
+  cg_plan_push_state (plan, CG_STATE_UNIFORM, CG_KEYVAL ("tint", CG_VEC4 (1.0f, 0.0f, 0.0f, 1.0f)), NULL);
+  cg_plan_append (plan, 1, middle, NULL);
+  cg_plan_pop (plan);
+  cg_plan_push_state (plan, CG_STATE_UNIFORM, CG_KEYVAL ("tint", CG_VEC4 (0.0f, 1.0f, 0.0f, 1.0f)), NULL);
+  cg_plan_append (plan, 1, far, NULL);
+  cg_plan_pop (plan);
+  cg_plan_pop (plan);
+  dispatch (plan);
+
+  pixels = download (target, SIZE, SIZE);
+  assert_region (pixels, SIZE, 0, 0, SIZE / 2, SIZE, 0x0000ffff);
+  assert_region (pixels, SIZE, SIZE / 2, 0, SIZE, SIZE, 0xff0000ff);
+}
+
+static void
+test_color_kernel (void)
+{
+  /* Scales by a half, so the quad covers the middle
+   * four of eight pixels in each direction */
+  static const float transform[16] = {
+    0.5f, 0.0f, 0.0f, 0.0f,
+    0.0f, 0.5f, 0.0f, 0.0f,
+    0.0f, 0.0f, 1.0f, 0.0f,
+    0.0f, 0.0f, 0.0f, 1.0f,
+  };
+  static const ColorVertex quad[] = {
+    { { -1.0f, -1.0f, 0.0f }, { 0.5f, 0.25f, 1.0f, 1.0f } },
+    { { 1.0f, -1.0f, 0.0f }, { 0.5f, 0.25f, 1.0f, 1.0f } },
+    { { -1.0f, 1.0f, 0.0f }, { 0.5f, 0.25f, 1.0f, 1.0f } },
+    { { 1.0f, -1.0f, 0.0f }, { 0.5f, 0.25f, 1.0f, 1.0f } },
+    { { 1.0f, 1.0f, 0.0f }, { 0.5f, 0.25f, 1.0f, 1.0f } },
+    { { -1.0f, 1.0f, 0.0f }, { 0.5f, 0.25f, 1.0f, 1.0f } },
+  };
+  g_autoptr (CgGpu) gpu = NULL;
+  g_autoptr (CgShader) shader = NULL;
+  g_autoptr (CgBuffer) vertices = NULL;
+  g_autoptr (CgTexture) target = NULL;
+  g_autofree guint8 *pixels = NULL;
+  CgPlan *plan = NULL;
+
+  gpu = new_gpu (1);
+  shader = cg_shader_new_for_code (gpu, color_vertex_shader, color_fragment_shader);
+  vertices = cg_buffer_new_for_data (
+      gpu, quad, sizeof (quad),
+      color_layout, G_N_ELEMENTS (color_layout));
+  target = cg_texture_new_for_data (gpu, NULL, 0, SIZE, SIZE, CG_FORMAT_RGBA8, 1, 0);
+
+  plan = cg_plan_new (gpu);
+  cg_plan_push_state (
+      plan,
+      CG_STATE_TARGET, CG_TEXTURE (target),
+      CG_STATE_SHADER, CG_SHADER (shader),
+      CG_STATE_UNIFORM, CG_KEYVAL ("transform", CG_MAT4 (transform)),
+      CG_STATE_UNIFORM, CG_KEYVAL ("tint", CG_VEC4 (0.5f, 1.0f, 0.75f, 1.0f)),
+      NULL);
+  cg_plan_append (plan, 1, vertices, NULL);
+  cg_plan_pop (plan);
+  dispatch (plan);
+
+  /* The vertex color times the tint, 0.25, 0.25, 0.75, 1 */
+  pixels = download (target, SIZE, SIZE);
+  assert_region (pixels, SIZE, 0, 0, SIZE, 2, 0x00000000);
+  assert_region (pixels, SIZE, 0, 2, 2, 6, 0x00000000);
+  assert_region (pixels, SIZE, 2, 2, 6, 6, 0x4040bfff);
+  assert_region (pixels, SIZE, 6, 2, SIZE, 6, 0x00000000);
+  assert_region (pixels, SIZE, 0, 6, SIZE, SIZE, 0x00000000);
+}
+
+/* A texel for every pixel, each with its own color */
+static guint32
+get_texel (int x,
+           int y)
+{
+  return (guint32)(x * 32) << 24 | (guint32)(y * 32) << 16 | (guint32)((x + y) % 2 ? 0xff : 0) << 8 | 0xff;
+}
+
+static void
+fill_texels (guint8 *texels)
+{
+  for (int y = 0; y < SIZE; y++)
+    {
+      for (int x = 0; x < SIZE; x++)
+        {
+          guint32 texel = get_texel (x, y);
+
+          for (int i = 0; i < 4; i++)
+            texels[(y * SIZE + x) * 4 + i] = texel >> (24 - i * 8);
+        }
+    }
+}
+
+static void
+test_texture_kernel (void)
+{
+  static const TextureVertex quad[] = {
+    { { -1.0f, -1.0f, 0.0f }, { 0.0f, 0.0f } },
+    { { 1.0f, -1.0f, 0.0f }, { 1.0f, 0.0f } },
+    { { -1.0f, 1.0f, 0.0f }, { 0.0f, 1.0f } },
+    { { 1.0f, -1.0f, 0.0f }, { 1.0f, 0.0f } },
+    { { 1.0f, 1.0f, 0.0f }, { 1.0f, 1.0f } },
+    { { -1.0f, 1.0f, 0.0f }, { 0.0f, 1.0f } },
+  };
+  g_autoptr (CgGpu) gpu = NULL;
+  g_autoptr (CgShader) shader = NULL;
+  g_autoptr (CgBuffer) vertices = NULL;
+  g_autoptr (CgTexture) texture = NULL;
+  g_autoptr (CgTexture) target = NULL;
+  g_autofree guint8 *pixels = NULL;
+  guint8 texels[SIZE * SIZE * 4] = { 0 };
+  CgPlan *plan = NULL;
+
+  fill_texels (texels);
+
+  gpu = new_gpu (1);
+  shader = cg_shader_new_for_code (gpu, texture_vertex_shader, texture_fragment_shader);
+  vertices = cg_buffer_new_for_data (
+      gpu, quad, sizeof (quad),
+      texture_layout, G_N_ELEMENTS (texture_layout));
+  texture = cg_texture_new_for_data (gpu, texels, sizeof (texels), SIZE, SIZE, CG_FORMAT_RGBA8, 1, 0);
+  target = cg_texture_new_for_data (gpu, NULL, 0, SIZE, SIZE, CG_FORMAT_RGBA8, 1, 0);
+
+  /* Pixel centers land on texel centers, so
+   * filtering reproduces the texture exactly */
+  plan = cg_plan_new (gpu);
+  cg_plan_push_state (
+      plan,
+      CG_STATE_TARGET, CG_TEXTURE (target),
+      CG_STATE_SHADER, CG_SHADER (shader),
+      CG_STATE_UNIFORM, CG_KEYVAL ("tex", CG_TEXTURE (texture)),
+      NULL);
+  cg_plan_append (plan, 1, vertices, NULL);
+  cg_plan_pop (plan);
+  dispatch (plan);
+
+  pixels = download (target, SIZE, SIZE);
+  for (int y = 0; y < SIZE; y++)
+    for (int x = 0; x < SIZE; x++)
+      assert_region (pixels, SIZE, x, y, x + 1, y + 1, get_texel (x, y));
+}
+
+static void
+test_batch_kernel (void)
+{
+  static const guint8 green[] = { 0x00, 0xff, 0x00, 0xff };
+  static const float red[] = { 1.0f, 0.0f, 0.0f, 1.0f };
+  static const float blue[] = { 0.0f, 0.0f, 1.0f, 1.0f };
+  g_autoptr (CgGpu) gpu = NULL;
+  g_autoptr (CgBatch) batch = NULL;
+  g_autoptr (CgTexture) texture = NULL;
+  g_autoptr (CgTexture) target = NULL;
+  g_autofree guint8 *pixels = NULL;
+  CgPlan *plan = NULL;
+
+  gpu = new_gpu (1);
+  batch = cg_batch_new (gpu);
+  texture = cg_texture_new_for_data (gpu, green, sizeof (green), 1, 1, CG_FORMAT_RGBA8, 1, 0);
+  target = cg_texture_new_for_data (gpu, NULL, 0, SIZE, SIZE, CG_FORMAT_RGBA8, 1, 0);
+
+  /* Added out of order, the lower layer still goes
+   * first. Batch coordinates start at the top. */
+  cg_batch_add_rect (batch, 1, NULL, NULL, 0.0f, 0.0f, SIZE / 2, SIZE, red);
+  cg_batch_add_rect (batch, 1, texture, NULL, SIZE / 2, 0.0f, SIZE / 2, SIZE / 2, NULL);
+  cg_batch_add_rect (batch, 0, NULL, NULL, 0.0f, 0.0f, SIZE, SIZE, blue);
+
+  plan = cg_plan_new (gpu);
+  cg_plan_push_state (plan, CG_STATE_TARGET, CG_TEXTURE (target), NULL);
+  cg_batch_flush (batch, plan, SIZE, SIZE);
+  cg_plan_pop (plan);
+  dispatch (plan);
+  g_assert_cmpuint (cg_batch_get_n_quads (batch), ==, 0);
+
+  /* Rows are stored bottom up */
+  pixels = download (target, SIZE, SIZE);
+  assert_region (pixels, SIZE, 0, 0, SIZE / 2, SIZE, 0xff0000ff);
+  assert_region (pixels, SIZE, SIZE / 2, SIZE / 2, SIZE, SIZE, 0x00ff00ff);
+  assert_region (pixels, SIZE, SIZE / 2, 0, SIZE, SIZE / 2, 0x0000ffff);
+}
+
+static void
+test_stencil (void)
+{
+  g_autoptr (CgGpu) gpu = NULL;
+  g_autoptr (CgShader) shader = NULL;
+  g_autoptr (CgTexture) target = NULL;
+  g_autoptr (CgTexture) depth = NULL;
+  g_autoptr (CgBuffer) left = NULL;
+  g_autoptr (CgBuffer) bottom = NULL;
+  g_autoptr (CgBuffer) full = NULL;
+  g_autofree guint8 *pixels = NULL;
+  CgPlan *plan = NULL;
+
+  gpu = new_gpu (1);
+  shader = fixture_new_tint_shader (gpu);
+  target = cg_texture_new_for_data (gpu, NULL, 0, SIZE, SIZE, CG_FORMAT_RGBA8, 1, 0);
+  depth = cg_texture_new_depth_for_format (gpu, SIZE, SIZE, CG_DEPTH_FORMAT_D24S8, 0);
+  left = new_rect (gpu, -1.0f, -1.0f, 0.0f, 1.0f, 0.0f);
+  bottom = new_rect (gpu, -1.0f, -1.0f, 1.0f, 0.0f, 0.0f);
+  full = new_rect (gpu, -1.0f, -1.0f, 1.0f, 1.0f, 0.0f);
+
+  plan = cg_plan_new (gpu);
+  cg_plan_push_state (
+      plan,
+      CG_STATE_TARGET, CG_TEXTURE (target),
+      CG_STATE_TARGET, CG_TEXTURE (depth),
+      CG_STATE_SHADER, CG_SHADER (shader),
+      CG_STATE_DEPTH_FUNC, CG_INT (CG_TEST_ALWAYS),
+      CG_STATE_UNIFORM, CG_KEYVAL ("tint", CG_VEC4 (1.0f, 0.0f, 0.0f, 1.0f)),
+      NULL);
+
+  /* Only stencil is written: one on the left, then
+   * incremented where the bottom half overlaps it */
+  cg_plan_push_state (
+      plan,
+      CG_STATE_WRITE_MASK, CG_UINT (CG_WRITE_MASK_STENCIL),
+      CG_STATE_STENCIL_FUNC, CG_TUPLE3 (CG_INT (CG_TEST_ALWAYS), CG_UINT (1), CG_UINT (0xff)),
+      CG_STATE_STENCIL_OPS,
+      CG_TUPLE3 (CG_INT (CG_STENCIL_OP_KEEP), CG_INT (CG_STENCIL_OP_KEEP), CG_INT (CG_STENCIL_OP_REPLACE)),
+      NULL);
+  cg_plan_append (plan, 1, left, NULL);
+  cg_plan_pop (plan);
+  cg_plan_push_state (
+      plan,
+      CG_STATE_WRITE_MASK, CG_UINT (CG_WRITE_MASK_STENCIL),
+      CG_STATE_STENCIL_FUNC, CG_TUPLE3 (CG_INT (CG_TEST_EQUAL), CG_UINT (1), CG_UINT (0xff)),
+      CG_STATE_STENCIL_OPS,
+      CG_TUPLE3 (CG_INT (CG_STENCIL_OP_KEEP), CG_INT (CG_STENCIL_OP_KEEP), CG_INT (CG_STENCIL_OP_INCREMENT)),
+      NULL);
+  cg_plan_append (plan, 1, bottom, NULL);
+  cg_plan_pop (plan);
+
+  /* Then color lands only where the stencil is two */
+  cg_plan_push_state (
+      plan,
+      CG_STATE_WRITE_MASK, CG_UINT (CG_WRITE_MASK_COLOR),
+      CG_STATE_STENCIL_FUNC, CG_TUPLE3 (CG_INT (CG_TEST_EQUAL), CG_UINT (2), CG_UINT (0xff)),
+      NULL);
+  cg_plan_append (plan, 1, full, NULL);
+  cg_plan_pop (plan);
+  cg_plan_pop (plan);
+  dispatch (plan);
+
+  pixels = download (target, SIZE, SIZE);
+  assert_region (pixels, SIZE, 0, 0, SIZE / 2, SIZE / 2, 0xff0000ff);
+  assert_region (pixels, SIZE, SIZE / 2, 0, SIZE, SIZE / 2, 0x00000000);
+  assert_region (pixels, SIZE, 0, SIZE / 2, SIZE, SIZE, 0x00000000);
+}
+
+static CgReadback *
+start_readback (CgTexture *texture,
+                int x,
+                int y,
+                int width,
+                int height,
+                int format)
+{
+  g_autoptr (GError) local_error = NULL;
+  CgReadback *readback = NULL;
+
+  readback = cg_texture_download_async (texture, x, y, width, height, format, &local_error);
+  g_assert_no_error (local_error);
+  g_assert_nonnull (readback);
+
+  return readback;
+}
+
+static void
+finish_readback (CgReadback *readback,
+                 gpointer data,
+                 gsize size)
+{
+  g_autoptr (GError) local_error = NULL;
+
+  g_assert_cmpuint (cg_readback_get_size (readback), ==, size);
+  g_assert_true (cg_readback_finish (readback, data, size, &local_error));
+  g_assert_no_error (local_error);
+}
+
+static void
+test_readback (void)
+{
+  static const guint8 rgb[] = { 0x10, 0x20, 0x30, 0x40, 0x50, 0x60 };
+  static const float clear[] = { 0.0f, 0.0f, 0.0f, 0.0f };
+  g_autoptr (GError) local_error = NULL;
+  g_autoptr (CgGpu) gpu = NULL;
+  g_autoptr (CgTexture) texture = NULL;
+  g_autoptr (CgTexture) opaque = NULL;
+  g_autoptr (CgReadback) same = NULL;
+  g_autoptr (CgReadback) red = NULL;
+  g_autoptr (CgReadback) floats = NULL;
+  g_autoptr (CgReadback) alpha = NULL;
+  g_autofree guint8 *pixels = NULL;
+  guint8 texels[SIZE * SIZE * 4] = { 0 };
+  guint8 same_pixels[3 * 2 * 4] = { 0 };
+  guint8 red_pixels[3 * 2] = { 0 };
+  float float_pixels[3 * 2 * 4] = { 0 };
+  guint8 alpha_pixels[2 * 4] = { 0 };
+
+  fill_texels (texels);
+
+  gpu = new_gpu (1);
+  texture = cg_texture_new_for_data (gpu, texels, sizeof (texels), SIZE, SIZE, CG_FORMAT_RGBA8, 1, 0);
+  opaque = cg_texture_new_for_data (gpu, rgb, sizeof (rgb), 2, 1, CG_FORMAT_RGB8, 1, 0);
+
+  /* A region touching no edge, in the texture's own
+   * format, in fewer channels, and as floats. Missing
+   * alpha reads as one. */
+  same = start_readback (texture, 2, 3, 3, 2, 0);
+  red = start_readback (texture, 2, 3, 3, 2, CG_FORMAT_R8);
+  floats = start_readback (texture, 2, 3, 3, 2, CG_FORMAT_RGBA32);
+  alpha = start_readback (opaque, 0, 0, 2, 1, CG_FORMAT_RGBA8);
+
+  /* Readbacks copy the pixels right away, so there is
+   * never anything to wait for, and rendering afterwards
+   * leaves them alone */
+  g_assert_true (fixture_fill (gpu, texture, SIZE, SIZE, clear, &local_error));
+  g_assert_no_error (local_error);
+  g_assert_true (cg_readback_wait (same, 0, &local_error));
+  g_assert_no_error (local_error);
+
+  finish_readback (same, same_pixels, sizeof (same_pixels));
+  finish_readback (red, red_pixels, sizeof (red_pixels));
+  finish_readback (floats, float_pixels, sizeof (float_pixels));
+  finish_readback (alpha, alpha_pixels, sizeof (alpha_pixels));
+
+  for (int y = 0; y < 2; y++)
+    {
+      for (int x = 0; x < 3; x++)
+        {
+          guint32 texel = get_texel (2 + x, 3 + y);
+          int pixel = y * 3 + x;
+
+          g_assert_cmpuint (red_pixels[pixel], ==, texel >> 24);
+          for (int i = 0; i < 4; i++)
+            {
+              guint8 channel = texel >> (24 - i * 8);
+
+              g_assert_cmpuint (same_pixels[pixel * 4 + i], ==, channel);
+              g_assert_cmpfloat_with_epsilon (
+                  float_pixels[pixel * 4 + i], channel / 255.0f, 1e-6);
+            }
+        }
+    }
+
+  g_assert_true (fixture_pixels_equal (alpha_pixels, 1, 0x102030ff));
+  g_assert_true (fixture_pixels_equal (alpha_pixels + 4, 1, 0x405060ff));
+
+  /* Though the texture itself did change */
+  pixels = download (texture, SIZE, SIZE);
+  assert_region (pixels, SIZE, 0, 0, SIZE, SIZE, 0x00000000);
+}
+
+static void
+test_blit_into_itself (void)
+{
+  g_autoptr (GError) local_error = NULL;
+  g_autoptr (CgGpu) gpu = NULL;
+  g_autoptr (CgTexture) texture = NULL;
+  g_autoptr (CgCommands) commands = NULL;
+  CgPlan *plan = NULL;
+
+  gpu = new_gpu (1);
+  texture = cg_texture_new_for_data (gpu, NULL, 0, SIZE, SIZE, CG_FORMAT_RGBA8, 1, 0);
+
+  plan = cg_plan_new (gpu);
+  cg_plan_push_state (
+      plan,
+      CG_STATE_TARGET, CG_TEXTURE (texture),
+      NULL);
+  cg_plan_blit (plan, texture);
+  cg_plan_pop (plan);
+
+  /* Plans are only walked at dispatch */
+  commands = cg_plan_unref_to_commands (plan, &local_error);
+  g_assert_no_error (local_error);
+  g_assert_false (cg_commands_dispatch (commands, &local_error));
+  g_assert_error (local_error, CG_ERROR, CG_ERROR_INVALID_PLAN);
+}
+
+int
+main (int argc,
+      char **argv)
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/sw/watertight", test_watertight);
+  g_test_add_func ("/sw/watertight-threaded", test_watertight_threaded);
+  g_test_add_func ("/sw/depth", test_depth);
+  g_test_add_func ("/sw/color-kernel", test_color_kernel);
+  g_test_add_func ("/sw/texture-kernel", test_texture_kernel);
+  g_test_add_func ("/sw/batch-kernel", test_batch_kernel);
+  g_test_add_func ("/sw/stencil", test_stencil);
+  g_test_add_func ("/sw/readback", test_readback);
+  g_test_add_func ("/sw/blit-into-itself", test_blit_into_itself);
+
+  return g_test_run ();
+}
@@ -0,0 +1,322 @@
+#define G_LOG_DOMAIN "CpcGpuTest"
+#include <cpc-gpu/cpc-gpu.h>
+
+#include "fixture.h"
+
+/* Draws on whichever device the Vulkan loader finds,
+ * lavapipe included, and reads the result back. Every
+ * test skips itself without a loader or a device.
+ *
+ * The shaders are assembled by hand so the build needs
+ * no SPIR-V compiler. The vertex stage passes "position"
+ * through and the fragment stage writes opaque red. */
+
+#define SIZE 8
+/* Enough for the backend to record
+ * each pass on a thread of its own */
+#define N_PASSES 2
+#define N_DRAWS 32
+
+static const guint32 vertex_spirv[] = {
+  /* Magic, version 1.0, generator, id bound, schema */
+  0x07230203, 0x00010000, 0, 18, 0,
+  /* OpCapability Shader */
+  0x00020011, 0x00000001,
+  /* OpMemoryModel Logical GLSL450 */
+  0x0003000e, 0x00000000, 0x00000001,
+  /* OpEntryPoint Vertex %main "main" %position %out */
+  0x0007000f, 0x00000000, 0x0000000b, 0x6e69616d, 0x00000000, 0x00000008, 0x00000009,
+  /* OpName %position "position" */
+  0x00050005, 0x00000008, 0x69736f70, 0x6e6f6974, 0x00000000,
+  /* OpDecorate %position Location 0 */
+  0x00040047, 0x00000008, 0x0000001e, 0x00000000,
+  /* OpDecorate %out BuiltIn Position */
+  0x00040047, 0x00000009, 0x0000000b, 0x00000000,
+  /* %void = OpTypeVoid */
+  0x00020013, 0x00000001,
+  /* %fn = OpTypeFunction %void */
+  0x00030021, 0x00000002, 0x00000001,
+  /* %float = OpTypeFloat 32 */
+  0x00030016, 0x00000003, 0x00000020,
+  /* %vec3 = OpTypeVector %float 3 */
+  0x00040017, 0x00000004, 0x00000003, 0x00000003,
+  /* %vec4 = OpTypeVector %float 4 */
+  0x00040017, 0x00000005, 0x00000003, 0x00000004,
+  /* %in_vec3 = OpTypePointer Input %vec3 */
+  0x00040020, 0x00000006, 0x00000001, 0x00000004,
+  /* %out_vec4 = OpTypePointer Output %vec4 */
+  0x00040020, 0x00000007, 0x00000003, 0x00000005,
+  /* %position = OpVariable %in_vec3 Input */
+  0x0004003b, 0x00000006, 0x00000008, 0x00000001,
+  /* %out = OpVariable %out_vec4 Output */
+  0x0004003b, 0x00000007, 0x00000009, 0x00000003,
+  /* %one = OpConstant %float 1.0 */
+  0x0004002b, 0x00000003, 0x0000000a, 0x3f800000,
+  /* %main = OpFunction %void None %fn */
+  0x00050036, 0x00000001, 0x0000000b, 0x00000000, 0x00000002,
+  /* OpLabel */
+  0x000200f8, 0x0000000c,
+  /* %p = OpLoad %vec3 %position */
+  0x0004003d, 0x00000004, 0x0000000d, 0x00000008,
+  /* %x = OpCompositeExtract %float %p 0 */
+  0x00050051, 0x00000003, 0x0000000e, 0x0000000d, 0x00000000,
+  /* %y = OpCompositeExtract %float %p 1 */
+  0x00050051, 0x00000003, 0x0000000f, 0x0000000d, 0x00000001,
+  /* %z = OpCompositeExtract %float %p 2 */
+  0x00050051, 0x00000003, 0x00000010, 0x0000000d, 0x00000002,
+  /* %v = OpCompositeConstruct %vec4 %x %y %z %one */
+  0x00070050, 0x00000005, 0x00000011, 0x0000000e, 0x0000000f, 0x00000010, 0x0000000a,
+  /* OpStore %out %v */
+  0x0003003e, 0x00000009, 0x00000011,
+  /* OpReturn */
+  0x000100fd,
+  /* OpFunctionEnd */
+  0x00010038,
+};
+
+static const guint32 fragment_spirv[] = {
+  /* Magic, version 1.0, generator, id bound, schema */
+  0x07230203, 0x00010000, 0, 12, 0,
+  /* OpCapability Shader */
+  0x00020011, 0x00000001,
+  /* OpMemoryModel Logical GLSL450 */
+  0x0003000e, 0x00000000, 0x00000001,
+  /* OpEntryPoint Fragment %main "main" %color */
+  0x0006000f, 0x00000004, 0x0000000a, 0x6e69616d, 0x00000000, 0x00000006,
+  /* OpExecutionMode %main OriginUpperLeft */
+  0x00030010, 0x0000000a, 0x00000007,
+  /* OpName %color "color" */
+  0x00040005, 0x00000006, 0x6f6c6f63, 0x00000072,
+  /* OpDecorate %color Location 0 */
+  0x00040047, 0x00000006, 0x0000001e, 0x00000000,
+  /* %void = OpTypeVoid */
+  0x00020013, 0x00000001,
+  /* %fn = OpTypeFunction %void */
+  0x00030021, 0x00000002, 0x00000001,
+  /* %float = OpTypeFloat 32 */
+  0x00030016, 0x00000003, 0x00000020,
+  /* %vec4 = OpTypeVector %float 4 */
+  0x00040017, 0x00000004, 0x00000003, 0x00000004,
+  /* %out_vec4 = OpTypePointer Output %vec4 */
+  0x00040020, 0x00000005, 0x00000003, 0x00000004,
+  /* %color = OpVariable %out_vec4 Output */
+  0x0004003b, 0x00000005, 0x00000006, 0x00000003,
+  /* %zero = OpConstant %float 0.0 */
+  0x0004002b, 0x00000003, 0x00000007, 0x00000000,
+  /* %one = OpConstant %float 1.0 */
+  0x0004002b, 0x00000003, 0x00000008, 0x3f800000,
+  /* %red = OpConstantComposite %vec4 %one %zero %zero %one */
+  0x0007002c, 0x00000004, 0x00000009, 0x00000008, 0x00000007, 0x00000007, 0x00000008,
+  /* %main = OpFunction %void None %fn */
+  0x00050036, 0x00000001, 0x0000000a, 0x00000000, 0x00000002,
+  /* OpLabel */
+  0x000200f8, 0x0000000b,
+  /* OpStore %color %red */
+  0x0003003e, 0x00000006, 0x00000009,
+  /* OpReturn */
+  0x000100fd,
+  /* OpFunctionEnd */
+  0x00010038,
+};
+static CgGpu *
+new_gpu (void)
+{
+  g_autoptr (GError) local_error = NULL;
+  GLogLevelFlags fatal_mask = 0;
+  CgGpu *gpu = NULL;
+
+  /* cg_gpu_new logs a critical before returning the
+   * error a missing driver is skipped on */
+  fatal_mask = g_log_set_always_fatal (G_LOG_FATAL_MASK);
+  gpu = cg_gpu_new (
+      CG_INIT_FLAG_BACKEND_VULKAN | CG_INIT_FLAG_NO_FALLBACK,
+      NULL, &local_error);
+  g_log_set_always_fatal (fatal_mask);
+  if (gpu == NULL
+      && (g_error_matches (local_error, CG_ERROR, CG_ERROR_NOT_SUPPORTED)
+          || g_error_matches (local_error, CG_ERROR, CG_ERROR_FAILED_INIT)))
+    {
+      g_test_skip (local_error->message);
+      return NULL;
+    }
+  g_assert_no_error (local_error);
+
+  return gpu;
+}
+
+static CgShader *
+new_shader (CgGpu *gpu)
+{
+  return cg_shader_new_for_spirv (
+      gpu,
+      vertex_spirv, sizeof (vertex_spirv),
+      fragment_spirv, sizeof (fragment_spirv),
+      NULL);
+}
+
+static void
+dispatch (CgPlan *plan)
+{
+  g_autoptr (GError) local_error = NULL;
+  g_autoptr (CgCommands) commands = NULL;
+
+  commands = cg_plan_unref_to_commands (plan, &local_error);
+  g_assert_no_error (local_error);
+  g_assert_true (cg_commands_dispatch (commands, &local_error));
+  g_assert_no_error (local_error);
+}
+
+static void
+read_back (CgTexture *texture,
+           guint8 *pixels)
+{
+  g_autoptr (GError) local_error = NULL;
+  g_autoptr (CgReadback) readback = NULL;
+
+  readback = cg_texture_download_async (texture, 0, 0, SIZE, SIZE, 0, &local_error);
+  g_assert_no_error (local_error);
+  g_assert_nonnull (readback);
+  g_assert_true (cg_readback_finish (readback, pixels, SIZE * SIZE * 4, &local_error));
+  g_assert_no_error (local_error);
+}
+
+static void
+test_draw (void)
+{
+  g_autoptr (CgGpu) gpu = NULL;
+  g_autoptr (CgShader) shader = NULL;
+  g_autoptr (CgBuffer) vertices = NULL;
+  g_autoptr (CgTexture) target = NULL;
+  guint8 pixels[SIZE * SIZE * 4] = { 0 };
+  CgPlan *plan = NULL;
+
+  gpu = new_gpu ();
+  if (gpu == NULL)
+    return;
+
+  shader = new_shader (gpu);
+  vertices = fixture_new_quad (gpu);
+  target = cg_texture_new_for_data (gpu, NULL, 0, SIZE, SIZE, CG_FORMAT_RGBA8, 1, 0);
+
+  /* Covers the whole target either way up */
+  plan = cg_plan_new (gpu);
+  cg_plan_push_state (
+      plan,
+      CG_STATE_TARGET, CG_TEXTURE (target),
+      CG_STATE_DEST, CG_RECT (0, 0, SIZE, SIZE),
+      CG_STATE_SHADER, CG_SHADER (shader),
+      CG_STATE_BACKFACE_CULL, CG_BOOL (FALSE),
+      NULL);
+  cg_plan_append (plan, 1, vertices, NULL);
+  cg_plan_pop (plan);
+  dispatch (plan);
+
+  read_back (target, pixels);
+  g_assert_true (fixture_pixels_equal (pixels, SIZE * SIZE, 0xff0000ff));
+}
+
+static void
+test_parallel_passes (void)
+{
+  g_autoptr (CgGpu) gpu = NULL;
+  g_autoptr (CgShader) shader = NULL;
+  g_autoptr (CgBuffer) vertices = NULL;
+  CgTexture *targets[N_PASSES] = { NULL };
+  CgPlan *plan = NULL;
+
+  gpu = new_gpu ();
+  if (gpu == NULL)
+    return;
+
+  shader = new_shader (gpu);
+  vertices = fixture_new_quad (gpu);
+
+  /* Pass `i` covers the left (i + 1) / N_PASSES of
+   * its target, so a pass recorded against the wrong
+   * render pass or viewport shows up. A plan has a
+   * single root, so the passes share one without a
+   * target of its own. */
+  plan = cg_plan_new (gpu);
+  cg_plan_push_state (
+      plan,
+      CG_STATE_SHADER, CG_SHADER (shader),
+      CG_STATE_BACKFACE_CULL, CG_BOOL (FALSE),
+      NULL);
+  for (guint i = 0; i < N_PASSES; i++)
+    {
+      targets[i] = cg_texture_new_for_data (gpu, NULL, 0, SIZE, SIZE, CG_FORMAT_RGBA8, 1, 0);
+
+      cg_plan_push_state (
+          plan,
+          CG_STATE_TARGET, CG_TEXTURE (targets[i]),
+          CG_STATE_DEST, CG_RECT (0, 0, SIZE * (i + 1) / N_PASSES, SIZE),
+          NULL);
+      for (guint j = 0; j < N_DRAWS; j++)
+        cg_plan_append (plan, 1, vertices, NULL);
+      cg_plan_pop (plan);
+    }
+  cg_plan_pop (plan);
+  dispatch (plan);
+
+  for (guint i = 0; i < N_PASSES; i++)
+    {
+      guint8 pixels[SIZE * SIZE * 4] = { 0 };
+      int covered = SIZE * (i + 1) / N_PASSES;
+
+      read_back (targets[i], pixels);
+      for (int y = 0; y < SIZE; y++)
+        {
+          const guint8 *row = pixels + y * SIZE * 4;
+
+          g_assert_true (fixture_pixels_equal (row, covered, 0xff0000ff));
+          g_assert_true (fixture_pixels_equal (row + covered * 4, SIZE - covered, 0x00000000));
+        }
+
+      cg_texture_unref (targets[i]);
+    }
+}
+
+static void
+test_no_target (void)
+{
+  g_autoptr (GError) local_error = NULL;
+  g_autoptr (CgGpu) gpu = NULL;
+  g_autoptr (CgShader) shader = NULL;
+  g_autoptr (CgBuffer) vertices = NULL;
+  g_autoptr (CgCommands) commands = NULL;
+  CgPlan *plan = NULL;
+
+  gpu = new_gpu ();
+  if (gpu == NULL)
+    return;
+
+  shader = new_shader (gpu);
+  vertices = fixture_new_quad (gpu);
+
+  /* Unlike GL there is no default framebuffer to fall back on */
+  plan = cg_plan_new (gpu);
+  cg_plan_push_state (
+      plan,
+      CG_STATE_DEST, CG_RECT (0, 0, SIZE, SIZE),
+      CG_STATE_SHADER, CG_SHADER (shader),
+      NULL);
+  cg_plan_append (plan, 1, vertices, NULL);
+  cg_plan_pop (plan);
+
+  commands = cg_plan_unref_to_commands (plan, &local_error);
+  g_assert_error (local_error, CG_ERROR, CG_ERROR_INVALID_PLAN);
+  g_assert_null (commands);
+}
+
+int
+main (int argc,
+      char **argv)
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/vulkan/draw", test_draw);
+  g_test_add_func ("/vulkan/parallel-passes", test_parallel_passes);
+  g_test_add_func ("/vulkan/no-target", test_no_target);
+
+  return g_test_run ();
+}
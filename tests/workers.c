@@ -0,0 +1,137 @@
+#define G_LOG_DOMAIN "CpcGpuTest"
+#include <cpc-gpu/cpc-gpu.h>
+
+#include <pthread.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "fixture.h"
+
+/* Runs cg_gpu_run_headless_workers (), which forks, so
+ * this lives apart from the other EGL tests: none of
+ * them may leave a driver thread behind first. */
+
+#define SIZE 8
+#define N_WORKERS 2
+
+enum
+{
+  WORKER_STARTED = 1,
+  WORKER_DREW,
+};
+
+static gboolean
+draw_in_worker (CgGpu *gpu,
+                guint index,
+                guint n_workers,
+                gpointer user_data,
+                GError **error)
+{
+  static const float blue[] = { 0.0f, 0.0f, 1.0f, 1.0f };
+  volatile guint *slots = user_data;
+  g_autoptr (CgTexture) target = NULL;
+  guint8 pixels[SIZE * SIZE * 4] = { 0 };
+
+  slots[index] = WORKER_STARTED;
+
+  target = cg_texture_new_for_data (gpu, NULL, 0, SIZE, SIZE, CG_FORMAT_RGBA8, 1, 0);
+  if (!fixture_fill (gpu, target, SIZE, SIZE, blue, error)
+      || !cg_texture_download (target, pixels, sizeof (pixels), error))
+    return FALSE;
+  if (!fixture_pixels_equal (pixels, SIZE * SIZE, 0x0000ffff))
+    return FALSE;
+
+  slots[index] = WORKER_DREW;
+  return TRUE;
+}
+
+static void
+test_draw (void)
+{
+  g_autoptr (GError) local_error = NULL;
+  volatile guint *slots = NULL;
+  gboolean success = FALSE;
+  guint n_started = 0;
+
+  /* Workers report back through memory the fork keeps shared */
+  slots = mmap (NULL, N_WORKERS * sizeof (guint), PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  g_assert_true (slots != MAP_FAILED);
+
+  success = cg_gpu_run_headless_workers (0, -1, N_WORKERS, draw_in_worker, (gpointer)slots, &local_error);
+
+  for (guint i = 0; i < N_WORKERS; i++)
+    if (slots[i] != 0)
+      n_started++;
+  if (g_error_matches (local_error, CG_ERROR, CG_ERROR_FAILED_INIT) && n_started == 0)
+    {
+      g_test_skip ("No worker could make a headless context");
+      munmap ((gpointer)slots, N_WORKERS * sizeof (guint));
+      return;
+    }
+
+  g_assert_no_error (local_error);
+  g_assert_true (success);
+  for (guint i = 0; i < N_WORKERS; i++)
+    g_assert_cmpuint (slots[i], ==, WORKER_DREW);
+
+  munmap ((gpointer)slots, N_WORKERS * sizeof (guint));
+}
+
+static gpointer
+wait_for_pipe (gpointer data)
+{
+  int *fds = data;
+  char byte = 0;
+
+  while (read (fds[0], &byte, 1) < 0)
+    ;
+  return NULL;
+}
+
+static gboolean
+never_run (CgGpu *gpu,
+           guint index,
+           guint n_workers,
+           gpointer user_data,
+           GError **error)
+{
+  return FALSE;
+}
+
+static void
+test_refuses_threads (void)
+{
+  g_autoptr (GError) local_error = NULL;
+  pthread_t thread = { 0 };
+  int fds[2] = { -1, -1 };
+
+  if (access ("/proc/self/status", R_OK) != 0)
+    {
+      g_test_skip ("The thread count is unknown on this system");
+      return;
+    }
+
+  g_assert_cmpint (pipe (fds), ==, 0);
+  g_assert_cmpint (pthread_create (&thread, NULL, wait_for_pipe, fds), ==, 0);
+
+  g_assert_false (cg_gpu_run_headless_workers (0, -1, N_WORKERS, never_run, NULL, &local_error));
+  g_assert_error (local_error, CG_ERROR, CG_ERROR_NOT_SUPPORTED);
+
+  g_assert_cmpint (write (fds[1], "", 1), ==, 1);
+  pthread_join (thread, NULL);
+  close (fds[0]);
+  close (fds[1]);
+}
+
+int
+main (int argc,
+      char **argv)
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/workers/draw", test_draw);
+  g_test_add_func ("/workers/refuses-threads", test_refuses_threads);
+
+  return g_test_run ();
+}